@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/* Define the kernel def so we get the extra defs */
+#define __is_onyx_kernel
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <onyx/clock.h>
+#include <onyx/vdso.h>
+#undef __is_onyx_kernel
+
+/* CNTVCT_EL0 is readable from EL0, as long as the kernel sets CNTKCTL_EL1.EL0VCTEN.
+ * The isb keeps the read from being speculated ahead of earlier instructions.
+ */
+static inline uint64_t vdso_read_counter(void)
+{
+    uint64_t t;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(t)::"memory");
+    return t;
+}
+
+#include <onyx/vdso_gettime.h>
+
+int __kernel_clock_gettime(clockid_t clk_id, struct timespec *tp)
+{
+    return vdso_do_clock_gettime(clk_id, tp);
+}
+
+int __kernel_gettimeofday(struct timeval *tv, struct timezone *tz)
+{
+    return vdso_do_gettimeofday(tv, tz);
+}
+
+time_t __kernel_time(time_t *s)
+{
+    return vdso_do_time(s);
+}
+
+int __kernel_getcpu(unsigned int *cpu, unsigned int *node, void *tcache)
+{
+    return vdso_do_getcpu(cpu, node, tcache);
+}
@@ -1,7 +1,47 @@
 /*
- * Copyright (c) 2021 Pedro Falcato
+ * Copyright (c) 2021 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
  */
+/* Define the kernel def so we get the extra defs */
+#define __is_onyx_kernel
 
-// STUB
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <onyx/clock.h>
+#include <onyx/vdso.h>
+#undef __is_onyx_kernel
+
+/* The time CSR is readable from U-mode, as long as the kernel sets scounteren.TM */
+static inline uint64_t vdso_read_counter(void)
+{
+    uint64_t t;
+    __asm__ __volatile__("rdtime %0" : "=r"(t));
+    return t;
+}
+
+#include <onyx/vdso_gettime.h>
+
+int __vdso_clock_gettime(clockid_t clk_id, struct timespec *tp)
+{
+    return vdso_do_clock_gettime(clk_id, tp);
+}
+
+int __vdso_gettimeofday(struct timeval *tv, struct timezone *tz)
+{
+    return vdso_do_gettimeofday(tv, tz);
+}
+
+time_t __vdso_time(time_t *s)
+{
+    return vdso_do_time(s);
+}
+
+int __vdso_getcpu(unsigned int *cpu, unsigned int *node, void *tcache)
+{
+    return vdso_do_getcpu(cpu, node, tcache);
+}
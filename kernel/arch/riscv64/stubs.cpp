@@ -24,6 +24,11 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     UNIMPLEMENTED;
 }
 
+void platform_msi_set_target(struct pci_msi_data *data, unsigned int cpu)
+{
+    UNIMPLEMENTED;
+}
+
 size_t arch_heap_get_size(void)
 {
     return 0x200000000000;
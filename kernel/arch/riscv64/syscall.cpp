@@ -13,6 +13,7 @@
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
 #include <onyx/gen/syscall.h>
+#include <onyx/perf_probe.h>
 #include <onyx/proc_event.h>
 
 #include <platform/syscall.h>
@@ -35,6 +36,8 @@ long do_syscall64(registers_t *frame)
     unsigned long syscall_nr = frame->a7;
     long ret = 0;
 
+    perf_count_sw(PERF_COUNT_SW_SYSCALLS);
+
     proc_event_enter_syscall((syscall_frame *) frame, frame->a7);
 
     if (likely(syscall_nr <= NR_SYSCALL_MAX))
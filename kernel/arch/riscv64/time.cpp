@@ -9,6 +9,7 @@
 #include <onyx/riscv/intrinsics.h>
 #include <onyx/riscv/sbi.h>
 #include <onyx/timer.h>
+#include <onyx/vdso.h>
 
 #include <fixed_point/fixed_point.h>
 
@@ -25,6 +26,7 @@ struct clocksource riscv_clock = {
     .get_ticks = riscv_get_time,
     .get_ns = riscv_timer_get_ns,
     .elapsed_ns = riscv_timer_elapsed_ns,
+    .vdso_clock_mode = VDSO_CLOCK_MODE_COUNTER,
 };
 
 hrtime_t riscv_timer_get_ns()
@@ -86,8 +88,7 @@ void platform_init_clockevents(void)
     }
     else
     {
-        this_timer->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
-        INIT_LIST_HEAD(&this_timer->event_list);
+        timer_init(this_timer);
     }
 }
 
@@ -150,4 +151,6 @@ void time_init()
     }
 
     riscv_or_csr(RISCV_SIE, RISCV_SIE_STIE);
+    /* Let the vDSO read the time CSR */
+    riscv_or_csr(RISCV_SCOUNTEREN, RISCV_SCOUNTEREN_TM);
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 - 2021 Pedro Falcato
+ * Copyright (c) 2017 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  *
@@ -15,11 +15,10 @@
 #include <unistd.h>
 
 #include <onyx/clock.h>
+#include <onyx/compiler.h>
 #include <onyx/vdso.h>
 #undef __is_onyx_kernel
 
-#include <fixed_point/fixed_point.h>
-
 struct vdso_info
 {
     char name[255];
@@ -30,84 +29,44 @@ struct vdso_info
 static const struct vdso_info info = {
     .name = "onyx-vdso", .kernel = "onyx-rolling", .architecture = "x86_64"};
 
-long __vdso_syscall(long number, ...);
-
 static struct vdso_info *__vdso_get_vdso_info(void)
 {
     return (struct vdso_info *) &info;
 }
 
-uint64_t clock_delta_calc(uint64_t start, uint64_t end)
+static inline uint64_t vdso_read_counter(void)
 {
-    return end - start;
+    return rdtsc();
 }
 
-volatile struct vdso_clock_time clock_realtime = {0};
-volatile struct vdso_clock_time clock_monotonic = {0};
-volatile struct vdso_time __time;
+#define VDSO_ARCH_HAS_GETCPU
 
-unsigned long tsc_elapsed_ns(uint64_t start, uint64_t end)
+/* The kernel keeps the cpu number in IA32_TSC_AUX */
+static inline unsigned int vdso_arch_getcpu(void)
 {
-    uint64_t delta = clock_delta_calc(start, end);
-    return u64_mul_u64_fp32_64(delta, __time.ticks_per_ns);
+    unsigned int lo, hi, aux;
+    __asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+    return aux;
 }
 
-#define SyS_clock_gettime 42
+#include <onyx/vdso_gettime.h>
 
 int __vdso_clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
-    if (!__time.using_tsc)
-    {
-        /* If we're not using the tsc, just do the system call */
-        return __vdso_syscall(SyS_clock_gettime, clk_id, tp);
-    }
-
-    volatile struct vdso_clock_time *clk = NULL;
-    switch (clk_id)
-    {
-        case CLOCK_REALTIME: {
-            clk = &clock_realtime;
-            break;
-        }
-        case CLOCK_MONOTONIC:
-        case CLOCK_MONOTONIC_RAW: {
-            clk = &clock_monotonic;
-            break;
-        }
-        default: {
-            return __vdso_syscall(SyS_clock_gettime, clk_id, tp);
-        }
-    }
-
-    hrtime_t epoch_ns = clk->epoch * NS_PER_SEC;
-
-    uint64_t end = rdtsc();
-    epoch_ns += tsc_elapsed_ns(clk->tick, end);
-
-    hrtime_to_timespec(epoch_ns, tp);
-    return 0;
+    return vdso_do_clock_gettime(clk_id, tp);
 }
 
 time_t __vdso_sys_time(time_t *s)
 {
-    time_t posix = clock_realtime.epoch;
-    if (s)
-    {
-        *s = posix;
-    }
-    return posix;
+    return vdso_do_time(s);
 }
 
 int __vdso_sys_gettimeofday(struct timeval *tv, struct timezone *tz)
 {
-    if (tv)
-    {
-        struct timespec tp;
-        struct timeval t;
-        __vdso_clock_gettime(CLOCK_REALTIME, &tp);
+    return vdso_do_gettimeofday(tv, tz);
+}
 
-        tv->tv_sec = tp.tv_sec;
-        tv->tv_usec = tp.tv_nsec / 1000;
-    }
-    return 0;
+int __vdso_getcpu(unsigned int *cpu, unsigned int *node, void *tcache)
+{
+    return vdso_do_getcpu(cpu, node, tcache);
 }
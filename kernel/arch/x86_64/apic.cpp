@@ -931,8 +931,7 @@ void platform_init_clockevents()
     }
     else
     {
-        this_timer->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
-        INIT_LIST_HEAD(&this_timer->event_list);
+        timer_init(this_timer);
     }
 }
 
@@ -943,8 +942,7 @@ struct timer *platform_get_timer()
     if (!get_per_cpu(timer_initialised))
     {
         /* This is for clocksources that register themselves earlier than the platform timers */
-        INIT_LIST_HEAD(&this_timer->event_list);
-        this_timer->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
+        timer_init(this_timer);
         write_per_cpu(defer_events, true);
         write_per_cpu(timer_initialised, true);
         this_timer->set_oneshot = apic_set_oneshot;
@@ -33,6 +33,7 @@
 #include <onyx/x86/control_regs.h>
 #include <onyx/x86/gdt.h>
 #include <onyx/x86/ktrace.h>
+#include <onyx/vdso.h>
 #include <onyx/x86/msr.h>
 #include <onyx/x86/pat.h>
 #include <onyx/x86/pic.h>
@@ -316,6 +317,10 @@ void x86_init_percpu(void)
         x86_init_percpu_intel();
     }
 
+    /* The vDSO's getcpu reads the cpu number back with rdtscp */
+    if (x86_has_cap(X86_FEATURE_RDTSCP))
+        wrmsr(IA32_TSC_AUX, get_cpu_nr());
+
     printf("cpu#%u tsc: %lu\n", get_cpu_nr(), rdtsc());
 }
 
@@ -346,6 +351,9 @@ void cpu_init_late(void)
 
     x86_init_percpu();
 
+    if (x86_has_cap(X86_FEATURE_RDTSCP))
+        vdso_enable_getcpu();
+
     /* Setup the x86 platform defaults */
     x86_platform.has_legacy_devices = true;
     x86_platform.i8042 = I8042_EXPECTED_PRESENT;
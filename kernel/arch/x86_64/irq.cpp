@@ -13,7 +13,6 @@
 #include <stdlib.h>
 
 #include <onyx/cpu.h>
-#include <onyx/dpc.h>
 #include <onyx/irq.h>
 #include <onyx/panic.h>
 #include <onyx/platform.h>
@@ -115,6 +114,11 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     return 0;
 }
 
+void platform_msi_set_target(struct pci_msi_data *data, unsigned int cpu)
+{
+    data->address = PCI_MSI_BASE_ADDRESS | (cpu2lapicid(cpu) << PCI_MSI_APIC_ID_SHIFT);
+}
+
 void platform_send_eoi(uint64_t irq)
 {
     /* Note: MSI interrupts also require EOIs */
@@ -571,7 +571,7 @@ extern "C" unsigned long x86_dispatch_interrupt(struct registers *regs)
     else if (vec_no == X86_PERFPROBE)
     {
         result = INTERRUPT_STACK_ALIGN(regs);
-        if (perf_probe_is_enabled() && in_kernel_space_regs(regs))
+        if (perf_probe_is_enabled())
             perf_probe_do(regs);
     }
     else
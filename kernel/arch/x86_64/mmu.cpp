@@ -1154,6 +1154,56 @@ int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages)
     return 0;
 }
 
+static void x86_mmu_write_protect(PML *table, unsigned int pt_level, page_table_iterator &it)
+{
+    unsigned int index = addr_get_index(it.curr_addr(), pt_level);
+
+    /* Get the size that each entry represents here */
+    auto entry_size = level_to_entry_size(pt_level);
+
+    tlb_invalidation_tracker invd_tracker;
+
+    for (unsigned int i = index; i < PAGE_TABLE_ENTRIES && it.length(); i++)
+    {
+        auto &pt_entry = table->entries[i];
+
+        if (x86_pte_empty(pt_entry))
+        {
+            it.adjust_length(entry_size - (it.curr_addr() & (entry_size - 1)));
+            continue;
+        }
+
+        bool is_huge_page = is_huge_page_level(pt_level) && pt_entry & X86_PAGING_HUGE;
+
+        if (pt_level == PT_LEVEL || is_huge_page)
+        {
+            /* Atomically, so we don't lose an A/D bit update from the hardware */
+            unsigned long old = __atomic_fetch_and(&pt_entry, ~X86_PAGING_WRITE, __ATOMIC_RELAXED);
+
+            if (old & X86_PAGING_WRITE)
+                invd_tracker.add_page(it.curr_addr(), entry_size);
+
+            it.adjust_length(entry_size);
+        }
+        else
+        {
+            PML *next_table = (PML *) PHYS_TO_VIRT(PML_EXTRACT_ADDRESS(pt_entry));
+            x86_mmu_write_protect(next_table, pt_level - 1, it);
+        }
+    }
+}
+
+void vm_mmu_write_protect(struct mm_address_space *as, void *addr, size_t pages)
+{
+    scoped_lock g{as->page_table_lock};
+
+    page_table_iterator it{(unsigned long) addr, pages << PAGE_SHIFT, as};
+
+    PML *first_level = (PML *) PHYS_TO_VIRT(as->arch_mmu.cr3);
+
+    x86_mmu_write_protect(first_level, x86_paging_levels - 1, it);
+}
+
 static int x86_mmu_fork(PML *table, unsigned int pt_level, page_table_iterator &it)
 {
     // TODO(pedro): We still can't destroy page tables if fork goes south.
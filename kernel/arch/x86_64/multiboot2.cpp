@@ -52,7 +52,6 @@
 #include <onyx/vdso.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
-#include <onyx/worker.h>
 #include <onyx/x86/idt.h>
 #include <onyx/x86/kvm.h>
 #include <onyx/x86/msr.h>
@@ -13,6 +13,7 @@
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
 #include <onyx/gen/syscall.h>
+#include <onyx/perf_probe.h>
 #include <onyx/proc_event.h>
 
 #include <platform/syscall.h>
@@ -37,6 +38,8 @@ extern "C" long do_syscall64(struct syscall_frame *frame)
     unsigned long syscall_nr = frame->rax;
     long ret = 0;
 
+    perf_count_sw(PERF_COUNT_SW_SYSCALLS);
+
     proc_event_enter_syscall(frame, frame->rax);
 
     if (likely(syscall_nr <= NR_SYSCALL_MAX))
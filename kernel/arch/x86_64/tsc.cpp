@@ -15,6 +15,7 @@
 #include <onyx/log.h>
 #include <onyx/panic.h>
 #include <onyx/timer.h>
+#include <onyx/vdso.h>
 #include <onyx/x86/tsc.h>
 
 #include <fixed_point/fixed_point.h>
@@ -33,6 +34,7 @@ struct clocksource tsc_clock = {
     .get_ticks = rdtsc,
     .get_ns = tsc_get_ns,
     .elapsed_ns = tsc_elapsed_ns,
+    .vdso_clock_mode = VDSO_CLOCK_MODE_COUNTER,
 };
 
 #define TSC_MAX_COUNT UINT64_MAX
@@ -116,11 +118,3 @@ hrtime_t tsc_elapsed_ns(hrtime_t start, hrtime_t end)
     hrtime_t delta = clock_delta_calc(start, end);
     return u64_mul_u64_fp32_64(delta, ticks_per_ns);
 }
-
-void tsc_setup_vdso(struct vdso_time *time)
-{
-    if (!tsc_enabled)
-        return;
-    time->ticks_per_ns = ticks_per_ns;
-    time->using_tsc = x86_has_usable_tsc();
-}
@@ -12,7 +12,6 @@
 
 #include <onyx/acpi.h>
 #include <onyx/cpu.h>
-#include <onyx/dpc.h>
 #include <onyx/irq.h>
 #include <onyx/limits.h>
 #include <onyx/mm/slab.h>
@@ -23,6 +22,9 @@
 #include <onyx/task_switching.h>
 #include <onyx/timer.h>
 #include <onyx/vm.h>
+#include <onyx/workqueue.h>
+
+#include <onyx/mm/pool.hpp>
 
 #include <pci/pci.h>
 
@@ -120,26 +122,41 @@ acpi_thread_id acpi_os_get_thread_id()
     return get_current_thread()->id;
 }
 
-acpi_status acpi_os_execute(acpi_execute_type type, acpi_osd_exec_callback function, void *context)
+struct acpi_deferred_call
 {
-    struct dpc_work w;
-    w.context = context;
-    w.funcptr = function;
+    struct work_struct work;
+    acpi_osd_exec_callback function;
+    void *context;
+};
 
-    /* TODO: Something tells me these callbacks may sleep, and henceforth they're not
-     * okay to use in dpc contexts, where latency is key.
-     */
+static memory_pool<acpi_deferred_call, MEMORY_POOL_USABLE_ON_IRQ> acpi_call_pool;
+
+static void acpi_do_deferred_call(struct work_struct *work)
+{
+    auto call = container_of(work, acpi_deferred_call, work);
+    call->function(call->context);
+    acpi_call_pool.free(call);
+}
 
-    /* My really crappy fix that doesn't fix a lot right now is to set the priority to LOW */
-    if (dpc_schedule_work(&w, DPC_PRIORITY_LOW) < 0)
+acpi_status acpi_os_execute(acpi_execute_type type, acpi_osd_exec_callback function, void *context)
+{
+    auto call = acpi_call_pool.allocate();
+    if (!call)
         return AE_NO_MEMORY;
 
+    call->function = function;
+    call->context = context;
+    INIT_WORK(&call->work, acpi_do_deferred_call);
+
+    /* These callbacks (notify handlers, GPE methods) may sleep for a good while */
+    queue_work(system_unbound_wq, &call->work);
+
     return AE_OK;
 }
 
 void acpi_os_wait_events_complete(void)
 {
-    /* TODO: This is impossible to implement right now */
+    flush_workqueue(system_unbound_wq);
 }
 
 void acpi_os_sleep(u64 milliseconds)
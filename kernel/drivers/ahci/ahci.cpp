@@ -20,7 +20,6 @@
 #include <onyx/cpu.h>
 #include <onyx/dev.h>
 #include <onyx/dma.h>
-#include <onyx/dpc.h>
 #include <onyx/irq.h>
 #include <onyx/log.h>
 #include <onyx/module.h>
@@ -82,27 +81,69 @@ void ahci_deal_aio(struct command_list *list)
     ahci_wake_io(req);
 }
 
-void ahci_do_clist_irq(struct ahci_port *port, int j)
+void ahci_do_clist_irq(struct ahci_port *port, int j, uint32_t port_is)
+{
+    /* A queued command that left SActive completed successfully. Errors are for whoever's still
+     * outstanding, and get sorted out by error handling.
+     */
+    if (port->ncq_issued & (1U << j))
+        port_is &= ~AHCI_INTST_ERROR;
+
+    port->cmdslots[j].received_interrupt = true;
+    port->cmdslots[j].last_interrupt_status = port_is;
+    port->cmdslots[j].status = port->port->status;
+    port->cmdslots[j].tfd = port->port->tfd;
+    ahci_deal_aio(&port->cmdslots[j]);
+}
+
+/**
+ * @brief Complete a command that never got completed by the HBA. Must hold port_lock.
+ *
+ * @param port Port
+ * @param j Command slot
+ */
+static void ahci_fail_slot(struct ahci_port *port, unsigned int j)
 {
     port->cmdslots[j].received_interrupt = true;
-    port->cmdslots[j].last_interrupt_status = port->port->interrupt_status;
+    port->cmdslots[j].last_interrupt_status = AHCI_PORT_INTERRUPT_TFEE;
     port->cmdslots[j].status = port->port->status;
     port->cmdslots[j].tfd = port->port->tfd;
     ahci_deal_aio(&port->cmdslots[j]);
 }
 
-void ahci_do_port_irqs(struct ahci_port *port)
+void ahci_do_port_irqs(struct ahci_port *port, uint32_t port_is)
 {
-    uint32_t cmd_done = port->issued ^ port->port->command_issue;
+    /* Non-queued commands are done once they leave CI, queued ones once they leave SActive */
+    uint32_t cmd_done = port->issued & ~(port->port->command_issue | port->port->active);
 
     for (unsigned int j = 0; j < 32; j++)
     {
         if (cmd_done & (1U << j))
         {
-            ahci_do_clist_irq(port, j);
-            port->issued &= ~(1UL << j);
+            ahci_do_clist_irq(port, j, port_is);
+            port->issued &= ~(1U << j);
+            port->ncq_issued &= ~(1U << j);
+        }
+    }
+
+    if (port_is & AHCI_INTST_ERROR && port->issued)
+    {
+        /* The HBA stops processing commands on errors, so we need to get it going again */
+        if (!port->in_eh)
+        {
+            port->in_eh = true;
+            schedule_work(&port->eh_work);
+        }
+        else if (port->issued & (1U << port->eh_slot))
+        {
+            /* Error handling's own command failed */
+            ahci_fail_slot(port, port->eh_slot);
+            port->issued &= ~(1U << port->eh_slot);
         }
     }
+
+    if (cmd_done && port->ncq_depth)
+        wait_queue_wake_all(&port->issue_wq);
 }
 
 irqstatus_t ahci_irq(struct irq_context *ctx, void *cookie)
@@ -134,7 +175,7 @@ irqstatus_t ahci_irq(struct irq_context *ctx, void *cookie)
             uint32_t port_is = port->port->interrupt_status;
             port->port->interrupt_status = port_is;
             dev->hba->interrupt_status = (1U << i);
-            ahci_do_port_irqs(port);
+            ahci_do_port_irqs(port, port_is);
         }
 
         spin_unlock_irqrestore(&port->port_lock, cpu_flags);
@@ -186,21 +227,85 @@ ssize_t ahci_read(size_t offset, size_t count, void *buffer, struct blockdev *bl
 }
 
 #define ATA_CMD_ERR_BAD_REQ 0xff
-static uint8_t bio_req_to_ata_command(struct bio_req *req)
+static uint8_t bio_req_to_ata_command(struct bio_req *req, bool ncq)
 {
     uint8_t op = (req->flags & BIO_REQ_OP_MASK);
 
     switch (op)
     {
         case BIO_REQ_READ_OP:
-            return ATA_CMD_READ_DMA_EXT;
+            return ncq ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_READ_DMA_EXT;
         case BIO_REQ_WRITE_OP:
-            return ATA_CMD_WRITE_DMA_EXT;
+            return ncq ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_WRITE_DMA_EXT;
         default:
             return ATA_CMD_ERR_BAD_REQ;
     }
 }
 
+static void ahci_wait_aio(struct ahci_port *port, struct aio_req *req);
+
+/**
+ * @brief Discard a request's range with DATA SET MANAGEMENT/TRIM
+ *
+ * @param port Port
+ * @param req Request
+ * @param sector First sector, adjusted for the partition offset
+ * @return 0 on success, negative error codes
+ */
+static int ahci_submit_trim(struct ahci_port *port, struct bio_req *req, sector_t sector)
+{
+    sector_t nr_sectors = req->nr_sectors;
+    const size_t max_entries = port->trim_blocks * ATA_TRIM_ENTRIES_PER_BLOCK;
+
+    if (nr_sectors == 0 || nr_sectors > max_entries * ATA_TRIM_RANGE_MAX_SECTORS)
+    {
+        req->flags |= BIO_REQ_EIO;
+        return -EIO;
+    }
+
+    /* Unused entries need to be zero */
+    struct page *p = alloc_page(0);
+    if (!p)
+    {
+        req->flags |= BIO_REQ_EIO;
+        return -ENOMEM;
+    }
+
+    uint64_t *entries = (uint64_t *) PAGE_TO_VIRT(p);
+    size_t nr_entries = 0;
+
+    while (nr_sectors)
+    {
+        sector_t len = min(nr_sectors, ATA_TRIM_RANGE_MAX_SECTORS);
+        entries[nr_entries++] = ATA_TRIM_ENTRY(sector, len);
+        sector += len;
+        nr_sectors -= len;
+    }
+
+    struct ahci_command_ata cmd;
+    cmd.buffer = entries;
+    cmd.lba = 0;
+    cmd.size = (nr_entries + ATA_TRIM_ENTRIES_PER_BLOCK - 1) / ATA_TRIM_ENTRIES_PER_BLOCK * 512;
+    cmd.write = true;
+    cmd.cmd = ATA_CMD_DSM;
+    cmd.flags = 0;
+
+    bool ok = ahci_do_command(port, &cmd);
+    free_page(p);
+
+    if (!ok)
+    {
+        req->flags |= BIO_REQ_EIO;
+        return -EIO;
+    }
+
+    req->flags |= BIO_REQ_DONE;
+    return 0;
+}
+
+/* With NCQ, a bio's commands all get queued before we wait on them */
+#define AHCI_MAX_INFLIGHT_PER_BIO 8
+
 int ahci_submit_request(struct blockdev *dev, struct bio_req *req)
 {
     struct ahci_port *port = (ahci_port *) dev->device_info;
@@ -208,35 +313,72 @@ int ahci_submit_request(struct blockdev *dev, struct bio_req *req)
         return -ENXIO;
 
     sector_t sector = req->sector_number + (dev->offset / 512);
+    const bool ncq = port->ncq_depth != 0;
+    const unsigned int max_inflight = ncq ? AHCI_MAX_INFLIGHT_PER_BIO : 1;
+    struct aio_req ioreqs[AHCI_MAX_INFLIGHT_PER_BIO];
+    unsigned int nr_inflight = 0;
+    bool error = false;
 
     // printk("req: %lu.%lu\n", req->curr_vec_index, req->nr_vecs);
 
-    while (req->curr_vec_index != req->nr_vecs)
+    if ((req->flags & BIO_REQ_OP_MASK) == BIO_REQ_DISCARD_OP && port->trim_blocks)
+        return ahci_submit_trim(port, req, sector);
+
+    uint8_t ata_cmd = bio_req_to_ata_command(req, ncq);
+    if (ata_cmd == ATA_CMD_ERR_BAD_REQ)
     {
-        struct ahci_command_ata cmd;
-        cmd.lba = sector;
-        cmd.cmd = bio_req_to_ata_command(req);
+        req->flags |= BIO_REQ_NOT_SUPP;
+        return -EIO;
+    }
 
-        if (cmd.cmd == ATA_CMD_ERR_BAD_REQ)
+    while (req->curr_vec_index != req->nr_vecs || nr_inflight)
+    {
+        if (req->curr_vec_index != req->nr_vecs && nr_inflight < max_inflight && !error)
         {
-            req->flags |= BIO_REQ_NOT_SUPP;
-            return -EIO;
-        }
+            struct ahci_command_ata cmd;
+            cmd.lba = sector;
+            cmd.cmd = ata_cmd;
+            cmd.write = (req->flags & BIO_REQ_OP_MASK) == BIO_REQ_WRITE_OP;
+            cmd.buffer = req;
+            cmd.flags = AHCI_COMMAND_BIO_REQ;
+
+            struct aio_req *ioreq = &ioreqs[nr_inflight];
+            aio_req_init(ioreq);
+            ioreq->req_start = get_main_clock()->get_ns();
+
+            if (ahci_do_command_async(port, &cmd, ioreq))
+            {
+                nr_inflight++;
+                /* ahci_do_command_async fills in cmd.size with the size of the command */
+                sector += cmd.size / 512;
+                continue;
+            }
 
-        cmd.write = (req->flags & BIO_REQ_OP_MASK) == BIO_REQ_WRITE_OP;
+            error = true;
+        }
 
-        cmd.buffer = req;
-        cmd.flags = AHCI_COMMAND_BIO_REQ;
+        if (!nr_inflight)
+            break;
 
-        if (!ahci_do_command(port, &cmd))
+        /* Reap everything we've got in flight */
+        for (unsigned int i = 0; i < nr_inflight; i++)
         {
-            req->flags |= BIO_REQ_EIO;
-            return -EIO;
+            ahci_wait_aio(port, &ioreqs[i]);
+            if (ioreqs[i].status != AIO_STATUS_OK)
+                error = true;
+            ahci_destroy_aio(port, &ioreqs[i]);
         }
 
-        /* ahci_do_command fills in cmd.size with the size read */
-        sector_t sectors_read = cmd.size / 512;
-        sector += sectors_read;
+        nr_inflight = 0;
+
+        if (error)
+            break;
+    }
+
+    if (error)
+    {
+        req->flags |= BIO_REQ_EIO;
+        return -EIO;
     }
 
     req->flags |= BIO_REQ_DONE;
@@ -308,11 +450,83 @@ command_list_t *ahci_find_free_command_list(command_list_t *lists, unsigned int
     }
 }
 
-void ahci_issue_command(struct ahci_port *port, size_t slot)
+static bool ahci_is_ncq_command(uint8_t cmd)
+{
+    return cmd == ATA_CMD_READ_FPDMA_QUEUED || cmd == ATA_CMD_WRITE_FPDMA_QUEUED;
+}
+
+/**
+ * @brief Issue a prepared command. Must hold port_lock.
+ *
+ * @param port Port
+ * @param slot Command slot
+ * @param ncq True if it's a queued command
+ */
+void ahci_issue_command(struct ahci_port *port, size_t slot, bool ncq)
 {
+    port->issued |= (1U << slot);
+
+    if (ncq)
+    {
+        /* SActive needs to be set before CI */
+        port->ncq_issued |= (1U << slot);
+        port->port->active = (1U << slot);
+    }
+
     port->port->command_issue = (1U << slot);
 }
 
+static bool ahci_may_issue(struct ahci_port *port, bool ncq)
+{
+    if (port->in_eh)
+        return false;
+
+    if (!port->ncq_depth)
+        return true;
+
+    /* Queued and non-queued commands can't be mixed. Non-queued ones need the queue to drain
+     * first, and they get priority so they don't starve.
+     */
+    if (ncq)
+        return !(port->issued & ~port->ncq_issued) && !port->nq_waiting;
+
+    return !port->issued;
+}
+
+/**
+ * @brief Lock the port for issuing a command, waiting until it can take it
+ *
+ * @param port Port
+ * @param ncq True if it's a queued command
+ * @return IRQ flags for spin_unlock_irqrestore
+ */
+static unsigned long ahci_lock_for_issue(struct ahci_port *port, bool ncq)
+{
+    unsigned long flags;
+    const bool nq_wait = !ncq && port->ncq_depth;
+
+    if (nq_wait)
+        __atomic_add_fetch(&port->nq_waiting, 1, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        wait_for_event(&port->issue_wq, ahci_may_issue(port, ncq));
+
+        flags = spin_lock_irqsave(&port->port_lock);
+
+        if (nq_wait)
+            __atomic_sub_fetch(&port->nq_waiting, 1, __ATOMIC_RELAXED);
+
+        if (ahci_may_issue(port, ncq))
+            return flags;
+
+        if (nq_wait)
+            __atomic_add_fetch(&port->nq_waiting, 1, __ATOMIC_RELAXED);
+
+        spin_unlock_irqrestore(&port->port_lock, flags);
+    }
+}
+
 command_list_t *ahci_allocate_command_list(struct ahci_port *ahci_port, size_t *index)
 {
     command_list_t *clist = ahci_port->clist;
@@ -404,13 +618,20 @@ long ahci_setup_prdt_bio(prdt_t *prdt, struct bio_req *r, size_t *size)
     return i;
 }
 
-bool ahci_do_command_async(struct ahci_port *ahci_port, struct ahci_command_ata *buf,
-                           struct aio_req *ioreq)
+/**
+ * @brief Fill in a command slot's command table and PRDT
+ *
+ * @param ahci_port Port
+ * @param buf Command
+ * @param list_index Command slot
+ * @param ioreq aio_req to complete when the command is done
+ * @return True on success
+ */
+static bool ahci_prepare_command(struct ahci_port *ahci_port, struct ahci_command_ata *buf,
+                                 size_t list_index, struct aio_req *ioreq)
 {
     const uint16_t fis_len = 5;
-    size_t list_index = 0;
-
-    command_list_t *list = ahci_allocate_command_list(ahci_port, &list_index);
+    command_list_t *list = ahci_port->clist + list_index;
 
     list->desc_info = fis_len | (buf->write ? AHCI_COMMAND_LIST_WRITE : 0);
     list->prdbc = 0;
@@ -429,7 +650,6 @@ bool ahci_do_command_async(struct ahci_port *ahci_port, struct ahci_command_ata
         if ((nr_prdt = ahci_setup_prdt_bio(prdt, req, &buf->size)) < 0)
         {
             ioreq->status = AIO_STATUS_EIO;
-            ahci_free_list(ahci_port, list_index);
             return false;
         }
     }
@@ -438,10 +658,7 @@ bool ahci_do_command_async(struct ahci_port *ahci_port, struct ahci_command_ata
         struct phys_ranges ranges;
 
         if (dma_get_ranges(buf->buffer, buf->size, PRDT_MAX_SIZE, &ranges) < 0)
-        {
-            ahci_free_list(ahci_port, list_index);
             return false;
-        }
 
         nr_prdt = (long) ahci_setup_prdt(prdt, &ranges);
 
@@ -457,19 +674,35 @@ bool ahci_do_command_async(struct ahci_port *ahci_port, struct ahci_command_ata
     table->cfis.c = 1;
     table->cfis.feature_low = 1;
 
+    if (buf->cmd == ATA_CMD_DSM)
+        table->cfis.feature_low = ATA_DSM_TRIM;
+
     /* Load the LBA */
     uint64_t lba = buf->lba;
     // printk("Lba: %lu\n", lba);
     ahci_set_lba(lba, &table->cfis);
 
     /* We need to set bit 6 to enable the LBA mode */
-    if (buf->cmd == ATA_CMD_READ_DMA_EXT || buf->cmd == ATA_CMD_WRITE_DMA_EXT)
+    if (buf->cmd == ATA_CMD_READ_DMA_EXT || buf->cmd == ATA_CMD_WRITE_DMA_EXT ||
+        buf->cmd == ATA_CMD_DSM || ahci_is_ncq_command(buf->cmd))
         table->cfis.device = (1 << 6);
     else
         table->cfis.device = 0;
 
     size_t num_sectors = buf->size / 512;
-    table->cfis.count = (uint16_t) num_sectors;
+
+    if (ahci_is_ncq_command(buf->cmd))
+    {
+        /* FPDMA QUEUED takes the sector count in the features register, and the tag (which is
+         * our slot) in bits 7:3 of the count.
+         */
+        table->cfis.feature_low = num_sectors & 0xff;
+        table->cfis.feature_high = (num_sectors >> 8) & 0xff;
+        table->cfis.count = (uint16_t) (list_index << 3);
+    }
+    else
+        table->cfis.count = (uint16_t) num_sectors;
+
     table->cfis.command = buf->cmd;
 
     struct command_list *l = &ahci_port->cmdslots[list_index];
@@ -477,17 +710,47 @@ bool ahci_do_command_async(struct ahci_port *ahci_port, struct ahci_command_ata
     l->req = ioreq;
     ioreq->cookie = (void *) list_index;
 
-    unsigned long cpu_flags = spin_lock_irqsave(&ahci_port->port_lock);
+    return true;
+}
 
-    ahci_port->issued |= (1 << list_index);
+bool ahci_do_command_async(struct ahci_port *ahci_port, struct ahci_command_ata *buf,
+                           struct aio_req *ioreq)
+{
+    size_t list_index = 0;
+    const bool ncq = ahci_is_ncq_command(buf->cmd);
+
+    ahci_allocate_command_list(ahci_port, &list_index);
+
+    if (!ahci_prepare_command(ahci_port, buf, list_index, ioreq))
+    {
+        ahci_free_list(ahci_port, list_index);
+        return false;
+    }
+
+    unsigned long cpu_flags = ahci_lock_for_issue(ahci_port, ncq);
 
-    ahci_issue_command(ahci_port, list_index);
+    ahci_issue_command(ahci_port, list_index, ncq);
 
     spin_unlock_irqrestore(&ahci_port->port_lock, cpu_flags);
 
     return true;
 }
 
+/**
+ * @brief Wait for an aio_req issued with ahci_do_command_async to complete
+ *
+ * @param port Port
+ * @param req Request
+ */
+static void ahci_wait_aio(struct ahci_port *port, struct aio_req *req)
+{
+    wait_for_event(&req->wake_sem, req->signaled);
+
+    /* Completions get signalled under port_lock. Once we get it, they're done touching req. */
+    unsigned long cpu_flags = spin_lock_irqsave(&port->port_lock);
+    spin_unlock_irqrestore(&port->port_lock, cpu_flags);
+}
+
 void ahci_wake_callback(void *cb, struct wait_queue_token *token)
 {
     struct aio_req *req = (aio_req *) cb;
@@ -839,6 +1102,230 @@ void ahci_destroy_aio(struct ahci_port *port, struct aio_req *req)
     ahci_free_list(port, (size_t) req->cookie);
 }
 
+/**
+ * @brief Get a port going again after an error. The HBA stops processing commands when it hits
+ * one, and only restarts when we cycle PxCMD.ST. Clearing ST also clears CI and SActive.
+ *
+ * @param port Port
+ */
+static void ahci_port_restart(struct ahci_port *port)
+{
+    ahci_port_t *regs = port->port;
+
+    regs->pxcmd = regs->pxcmd & ~AHCI_PORT_CMD_START;
+    if (ahci_wait_bit(&regs->pxcmd, AHCI_PORT_CMD_CR, 500, true) < 0)
+        MPRINTF("error: port %d: timeout waiting for PXCMD_CR to clear\n", port->port_nr);
+
+    regs->error = regs->error;
+    regs->interrupt_status = regs->interrupt_status;
+
+    if (regs->tfd & (ATA_SR_BSY | ATA_SR_DRQ))
+    {
+        /* The device is still busy. Override it if we can, else reset the link. */
+        if (port->dev->hba->host_cap & AHCI_CAP_SCLO)
+        {
+            regs->pxcmd = regs->pxcmd | AHCI_PORT_CMD_CL_OVERRIDE;
+            if (ahci_wait_bit(&regs->pxcmd, AHCI_PORT_CMD_CL_OVERRIDE, 500, true) < 0)
+                MPRINTF("error: port %d: timeout waiting for CLO\n", port->port_nr);
+        }
+        else
+        {
+            regs->control = (regs->control & ~0xf) | 1;
+            sched_sleep_ms(1);
+            regs->control = regs->control & ~0xf;
+
+            for (int i = 0; i < 100 && AHCI_PORT_STATUS_DET(regs->status) != 3; i++)
+                sched_sleep_ms(1);
+
+            regs->error = regs->error;
+        }
+    }
+
+    regs->pxcmd = regs->pxcmd | AHCI_PORT_CMD_START;
+}
+
+/**
+ * @brief Read the NCQ command error log, which tells us which queued command failed. Reading it
+ * also gets the device out of its NCQ error state. Called from error handling, with the port
+ * otherwise idle.
+ *
+ * @param port Port
+ * @return The failed tag, -1 if the failed command wasn't a queued one, or -EIO
+ */
+static int ahci_read_ncq_error_log(struct ahci_port *port)
+{
+    struct ahci_command_ata cmd = {};
+    struct aio_req req;
+    const unsigned int slot = port->eh_slot;
+
+    aio_req_init(&req);
+
+    cmd.cmd = ATA_CMD_READ_LOG_EXT;
+    cmd.size = 512;
+    cmd.write = false;
+    cmd.buffer = port->eh_log;
+    /* The log address goes in LBA[7:0], the page in LBA[15:8] */
+    cmd.lba = ATA_LOG_NCQ_ERROR;
+
+    if (!ahci_prepare_command(port, &cmd, slot, &req))
+        return -EIO;
+
+    unsigned long flags = spin_lock_irqsave(&port->port_lock);
+    ahci_issue_command(port, slot, false);
+    spin_unlock_irqrestore(&port->port_lock, flags);
+
+    int st = aio_wait_on_req(&req, 500 * NS_PER_MS);
+
+    flags = spin_lock_irqsave(&port->port_lock);
+    port->issued &= ~(1U << slot);
+    port->cmdslots[slot].req = nullptr;
+    port->clist[slot].prdtl = 0;
+    spin_unlock_irqrestore(&port->port_lock, flags);
+
+    if (st < 0 || req.status != AIO_STATUS_OK)
+        return -EIO;
+
+    if (port->eh_log[0] & ATA_LOG_NCQ_ERROR_NQ)
+        return -1;
+
+    return port->eh_log[0] & ATA_LOG_NCQ_ERROR_TAG;
+}
+
+/**
+ * @brief Recover from a command error. The device aborts every outstanding queued command when
+ * one of them fails, so the failed one gets completed with an error, and the rest get re-issued.
+ *
+ * @param work The port's eh_work
+ */
+static void ahci_eh_work(struct work_struct *work)
+{
+    struct ahci_port *port = container_of(work, struct ahci_port, eh_work);
+    ahci_port_t *regs = port->port;
+
+    unsigned long flags = spin_lock_irqsave(&port->port_lock);
+    const uint32_t outstanding = port->issued;
+    const uint32_t ncq = port->ncq_issued & outstanding;
+    port->issued = port->ncq_issued = 0;
+    spin_unlock_irqrestore(&port->port_lock, flags);
+
+    MPRINTF("port %d: command error (serr %08x tfd %08x), %u commands outstanding\n",
+            port->port_nr, regs->error, regs->tfd, __builtin_popcount(outstanding));
+
+    ahci_port_restart(port);
+
+    /* Non-queued commands just fail */
+    uint32_t failed = outstanding & ~ncq;
+    uint32_t reissue = 0;
+
+    if (ncq)
+    {
+        int tag = ahci_read_ncq_error_log(port);
+
+        if (tag == -EIO)
+        {
+            /* We don't know what failed, and the port may be wedged again */
+            ahci_port_restart(port);
+            failed |= ncq;
+        }
+        else if (tag >= 0 && ncq & (1U << tag))
+        {
+            failed |= (1U << tag);
+            reissue = ncq & ~(1U << tag);
+        }
+        else
+            reissue = ncq;
+    }
+
+    flags = spin_lock_irqsave(&port->port_lock);
+
+    for (unsigned int j = 0; j < 32; j++)
+    {
+        if (failed & (1U << j))
+            ahci_fail_slot(port, j);
+        if (reissue & (1U << j))
+            port->clist[j].prdbc = 0;
+    }
+
+    if (reissue)
+    {
+        port->issued |= reissue;
+        port->ncq_issued |= reissue;
+        regs->active = reissue;
+        regs->command_issue = reissue;
+    }
+
+    port->in_eh = false;
+
+    spin_unlock_irqrestore(&port->port_lock, flags);
+
+    wait_queue_wake_all(&port->issue_wq);
+}
+
+static uint32_t ahci_slot_mask(unsigned int nr)
+{
+    return nr >= 32 ? ~0U : (1U << nr) - 1;
+}
+
+/**
+ * @brief Enable NCQ on a port, if both the HBA and the device support it.
+ * Slots 0 to depth - 1 get used as tags, and one more slot is kept around for error handling.
+ *
+ * @param port Port
+ */
+static void ahci_setup_ncq(struct ahci_port *port)
+{
+    if (!(port->dev->hba->host_cap & AHCI_CAP_SNCQ) ||
+        !(port->identify.sata_capabilities & ATA_SATA_CAP_NCQ))
+        return;
+
+    unsigned int depth = ATA_QUEUE_DEPTH(port->identify.queue_depth);
+    if (depth > port->ncs - 1)
+        depth = port->ncs - 1;
+
+    if (depth < 2)
+        return;
+
+    spin_lock(&port->bitmap_spl);
+    port->list_bitmap |= ~ahci_slot_mask(depth);
+    spin_unlock(&port->bitmap_spl);
+
+    port->eh_slot = depth;
+    port->ncq_depth = depth;
+
+    MPRINTF("port %d: using NCQ with queue depth %u\n", port->port_nr, depth);
+}
+
+/* A page's worth of TRIM ranges */
+#define AHCI_MAX_TRIM_BLOCKS (PAGE_SIZE / 512)
+
+/**
+ * @brief Enable discard on a port, if the device supports TRIM
+ *
+ * @param port Port
+ */
+static void ahci_setup_trim(struct ahci_port *port)
+{
+    port->trim_blocks = 0;
+
+    if (!(port->identify.data_management_support & ATA_DATA_MGMT_TRIM))
+        return;
+
+    /* Word 105 has the maximum number of blocks DATA SET MANAGEMENT takes. 0 means it's not
+     * reported, so stick to one.
+     */
+    unsigned int blocks = port->identify.data_set_max;
+    if (blocks == 0)
+        blocks = 1;
+    if (blocks > AHCI_MAX_TRIM_BLOCKS)
+        blocks = AHCI_MAX_TRIM_BLOCKS;
+
+    port->trim_blocks = blocks;
+    port->bdev->max_discard_sectors =
+        blocks * ATA_TRIM_ENTRIES_PER_BLOCK * ATA_TRIM_RANGE_MAX_SECTORS;
+
+    MPRINTF("port %d: TRIM supported\n", port->port_nr);
+}
+
 int ahci_do_identify(struct ahci_port *port)
 {
     switch (port->port->sig)
@@ -866,6 +1353,9 @@ int ahci_do_identify(struct ahci_port *port)
                                          ? port->identify.lba_capacity2
                                          : port->identify.lba_capacity;
 
+            ahci_setup_ncq(port);
+            ahci_setup_trim(port);
+
             break;
         }
         default:
@@ -945,8 +1435,9 @@ void ahci_init_port(struct ahci_port *ahci_port)
 
     unsigned int ncs = AHCI_CAP_NCS(device->hba->host_cap);
     MPRINTF("AHCI controller supports %u command list slots\n", ncs);
-    ahci_port->list_bitmap = -(1 << ncs);
-    // wait queue debugging value: ~((1 << 1) - 1); true: -(1 << ncs)
+    ahci_port->ncs = ncs;
+    ahci_port->list_bitmap = ~ahci_slot_mask(ncs);
+    // wait queue debugging value: ~((1 << 1) - 1); true: ~ahci_slot_mask(ncs)
     if (ahci_allocate_port_lists(hba, port, ahci_port) < 0)
     {
         VERBOSE_MPRINTF("Failed to allocate the command and FIS lists for port %p\n", port);
@@ -969,6 +1460,8 @@ void ahci_init_port(struct ahci_port *ahci_port)
     }
 
     init_wait_queue_head(&ahci_port->list_wq);
+    init_wait_queue_head(&ahci_port->issue_wq);
+    INIT_WORK(&ahci_port->eh_work, ahci_eh_work);
 
     /* Enable FIS receive */
     port->pxcmd = port->pxcmd | AHCI_PORT_CMD_FRE;
@@ -13,6 +13,7 @@
 
 #include <onyx/async_io.h>
 #include <onyx/spinlock.h>
+#include <onyx/workqueue.h>
 
 #include <drivers/ata.h>
 #include <pci/pci.h>
@@ -242,7 +243,24 @@ struct ahci_port
     struct spinlock bitmap_spl;
     struct wait_queue list_wq;
     ata_identify_response identify;
+    /* Slots we issued and the HBA hasn't completed yet, and which of those are NCQ commands */
     uint32_t issued;
+    uint32_t ncq_issued;
+    /* Number of command slots */
+    unsigned int ncs;
+    /* NCQ queue depth (slots 0 to ncq_depth - 1 double as tags), 0 if we're not using NCQ */
+    unsigned int ncq_depth;
+    /* Blocks of TRIM ranges we send per DATA SET MANAGEMENT command, 0 if TRIM isn't supported */
+    unsigned int trim_blocks;
+    /* Slot reserved for error handling's READ LOG EXT */
+    unsigned int eh_slot;
+    bool in_eh;
+    /* Non-queued commands waiting for the NCQ commands to drain */
+    unsigned int nq_waiting;
+    /* Issuers wait here while the port can't take their command */
+    struct wait_queue issue_wq;
+    struct work_struct eh_work;
+    uint8_t eh_log[512];
     unique_ptr<blockdev> bdev;
 };
 
@@ -269,7 +287,7 @@ struct ahci_command_ata
 #define AHCI_CAP_SXS                  (1 << 5)
 #define AHCI_CAP_EMS                  (1 << 6)
 #define AHCI_CAP_CCCS                 (1 << 7)
-#define AHCI_CAP_NCS(val)             ((val >> 8) & 0xF)
+#define AHCI_CAP_NCS(val)             ((((val) >> 8) & 0x1F) + 1)
 #define AHCI_CAP_PSC                  (1 << 13)
 #define AHCI_CAP_SSC                  (1 << 14)
 #define AHCI_CAP_PMD                  (1 << 15)
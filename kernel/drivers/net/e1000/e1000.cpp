@@ -21,6 +21,7 @@
 #include <onyx/net/ethernet.h>
 #include <onyx/net/netif.h>
 #include <onyx/net/network.h>
+#include <onyx/net/page_pool.h>
 #include <onyx/panic.h>
 #include <onyx/scoped_lock.h>
 #include <onyx/vm.h>
@@ -30,6 +31,17 @@
 
 static constexpr size_t number_rx_desc = ((PAGE_SIZE * 2) / sizeof(e1000_tx_desc));
 
+/* Every RX descriptor gets a page of its own, that's handed to the packetbuf as-is. Must match
+ * RCTL_BSIZE.
+ */
+static constexpr size_t rx_buffer_size = 4096;
+static_assert(rx_buffer_size <= PAGE_SIZE);
+
+#define E1000_RX_INTS (IMS_RXT0 | IMS_RXDMT0 | IMS_RXO)
+
+/* 8000 interrupts per second, like other drivers default to */
+#define E1000_DEFAULT_RX_USECS 125
+
 /* There's a -1 here to account for the tail descriptor that's 16 bytes in size (aka the size of a
  * desc) */
 static constexpr size_t number_tx_desc = ((PAGE_SIZE * 2) / sizeof(e1000_tx_desc));
@@ -58,12 +70,21 @@ struct e1000_device
 
     page *rx_pages;
     page *tx_pages;
-    page *rx_buf_pages;
+    page *rx_bufs[number_rx_desc];
+    page_pool rx_pool;
     pci::pci_device *nicdev;
     netif *nic_netif;
     unsigned char e1000_internal_mac_address[6];
     unsigned int irq_nr;
 
+    /* The offload context last loaded into the NIC. It sticks around until the next context
+     * descriptor, so packets with the same layout don't need one.
+     */
+    bool tx_ctx_valid{false};
+    uint8_t tx_ctx_ipcss;
+    uint8_t tx_ctx_tucss;
+    uint8_t tx_ctx_tucso;
+
     template <typename Type>
     Type &tx_descriptor(unsigned int idx)
     {
@@ -103,6 +124,13 @@ struct e1000_device
 
     void prepare_context_desc(packetbuf *buf);
 
+    bool tx_ctx_matches(packetbuf *buf) const
+    {
+        return tx_ctx_valid && tx_ctx_ipcss == buf->net_header_off() &&
+               tx_ctx_tucss == buf->csum_start - buf->data &&
+               tx_ctx_tucso == buf->csum_offset_bytes();
+    }
+
     void free_descs(unsigned int to_free)
     {
         scoped_lock g{tx_lock};
@@ -127,57 +155,94 @@ static void e1000_init_busmastering(struct e1000_device *dev)
     dev->nicdev->enable_busmastering();
 }
 
-int e1000_process_packet(netif *nif, e1000_rx_desc &desc)
+/**
+ * @brief Hand a received packet to the network stack
+ *
+ * @param nif Network interface
+ * @param desc RX descriptor
+ * @param page Page the packet was received in. The packet takes over our reference.
+ * @return 0 on success, negative error codes
+ */
+int e1000_process_packet(netif *nif, e1000_rx_desc &desc, struct page *page)
 {
     if (desc.errors != 0)
+    {
+        free_page(page);
         return -EIO;
+    }
 
     auto pckt = make_refc<packetbuf>();
     if (!pckt)
+    {
+        free_page(page);
         return -ENOMEM;
+    }
 
-    if (!pckt->allocate_space(desc.length))
-        return -ENOMEM;
+    pckt->attach_rx_buffer(page, 0, desc.length, rx_buffer_size);
 
     if (desc.status & (RSTA_IXSM))
     {
         pckt->needs_csum = 1;
     }
 
-    void *p = pckt->put(desc.length);
-
-    memcpy(p, PHYS_TO_VIRT(desc.addr), desc.length);
-
     return netif_process_pbuf(nif, pckt.get());
 }
 
-int e1000_pollrx(netif *nif)
+int e1000_pollrx(netif *nif, int budget)
 {
     e1000_device *dev = (e1000_device *) nif->priv;
 
-    uint16_t old_cur = 0;
-    while ((dev->rx_descs[dev->rx_cur].status & RSTA_DD))
+    int done = 0;
+    while (done < budget && (dev->rx_descs[dev->rx_cur].status & RSTA_DD))
     {
         auto &rxd = dev->rx_descs[dev->rx_cur];
+        struct page *page = dev->rx_bufs[dev->rx_cur];
 
-        e1000_process_packet(nif, rxd);
+        /* The packet gets the page, and the descriptor gets a new one. If we can't find a
+         * replacement, drop the packet and let the NIC have the page back.
+         */
+        struct page *new_page = page_pool_alloc(&dev->rx_pool);
+        if (new_page)
+        {
+            page_pool_recycle(&dev->rx_pool, page);
+            e1000_process_packet(nif, rxd, page);
 
-        dev->rx_descs[dev->rx_cur].status = 0;
-        old_cur = dev->rx_cur;
+            dev->rx_bufs[dev->rx_cur] = new_page;
+            rxd.addr = (uint64_t) page_to_phys(new_page);
+        }
 
+        rxd.status = 0;
         dev->rx_cur = (dev->rx_cur + 1) % number_rx_desc;
-
-        e1000_write(REG_RXDESCTAIL, old_cur, dev);
+        done++;
     }
 
-    return 0;
+    /* Give the NIC back everything up to (but not including) the next descriptor we'll look at */
+    if (done)
+        e1000_write(REG_RXDESCTAIL, (dev->rx_cur + number_rx_desc - 1) % number_rx_desc, dev);
+
+    return done;
 }
 
 void e1000_rxend(netif *nif)
 {
     e1000_device *dev = (e1000_device *) nif->priv;
 
-    e1000_write(REG_IMS, IMS_TXDW | IMS_TXQE | IMS_RXT0, dev);
+    e1000_write(REG_IMS, E1000_RX_INTS, dev);
+}
+
+int e1000_set_coalesce(netif *nif, unsigned int rx_usecs)
+{
+    e1000_device *dev = (e1000_device *) nif->priv;
+
+    /* ITR throttles every interrupt, which is what we want since TX completions get polled for.
+     * The older RDTR/RADV timers are left disabled, as Intel recommends.
+     */
+    unsigned long itr = ((unsigned long) rx_usecs * 1000) / ITR_UNIT_NS;
+    itr = min(itr, (unsigned long) ITR_MAX);
+    e1000_write(REG_ITR, itr, dev);
+
+    nif->rx_coalesce_usecs = (itr * ITR_UNIT_NS) / 1000;
+    return 0;
 }
 
 unsigned int e1000_irqs = 0;
@@ -187,10 +252,11 @@ irqstatus_t e1000_irq(struct irq_context *ctx, void *cookie)
     auto device = (e1000_device *) cookie;
 
     volatile uint32_t status = e1000_read(REG_ICR, device);
-    if (status & ICR_RXT0)
+    if (status & E1000_RX_INTS)
     {
+        /* Keep RX interrupts masked until the poll runs dry */
+        e1000_write(REG_IMC, E1000_RX_INTS, device);
         netif_signal_rx(device->nic_netif);
-        e1000_write(REG_IMS, IMS_TXDW | IMS_TXQE, device);
         e1000_irqs++;
     }
 
@@ -316,32 +382,25 @@ extern "C" struct page_frag_res page_frag_alloc(struct page_frag_alloc_info *inf
     return r;
 }
 
-const size_t rx_buffer_size = 2048;
-
 int e1000_init_rx(struct e1000_device *dev)
 {
     int st = 0;
     size_t needed_pages = vm_size_to_pages(sizeof(struct e1000_rx_desc) * number_rx_desc);
     struct page *rx_pages = alloc_pages(needed_pages, PAGE_ALLOC_CONTIGUOUS);
 
-    struct page_frag_alloc_info alloc_info;
     unsigned long rxd_base = 0;
     struct e1000_rx_desc *rxdescs;
+    unsigned int i = 0;
 
     if (!rx_pages)
         return -ENOMEM;
 
-    struct page *rx_buf_pages =
-        alloc_pages(vm_size_to_pages(number_rx_desc * rx_buffer_size), PAGE_ALLOC_NO_ZERO);
-    if (!rx_buf_pages)
+    if (page_pool_init(&dev->rx_pool, number_rx_desc) < 0)
     {
         st = -ENOMEM;
         goto error0;
     }
 
-    alloc_info.curr = alloc_info.page_list = rx_buf_pages;
-    alloc_info.off = 0;
-
     rxdescs = (e1000_rx_desc *) map_page_list(rx_pages, needed_pages << PAGE_SHIFT,
                                               VM_READ | VM_WRITE | VM_READ);
     if (!rxdescs)
@@ -350,14 +409,17 @@ int e1000_init_rx(struct e1000_device *dev)
         goto error1;
     }
 
-    for (unsigned int i = 0; i < number_rx_desc; i++)
+    for (i = 0; i < number_rx_desc; i++)
     {
-        struct page_frag_res res = page_frag_alloc(&alloc_info, rx_buffer_size);
-        /* How can this even happen? Keep this here though, as a sanity check */
-        if (!res.page)
-            panic("OOM allocating rx buffers");
+        struct page *page = page_pool_alloc(&dev->rx_pool);
+        if (!page)
+        {
+            st = -ENOMEM;
+            goto error2;
+        }
 
-        rxdescs[i].addr = (uint64_t) page_to_phys(res.page) + res.off;
+        dev->rx_bufs[i] = page;
+        rxdescs[i].addr = (uint64_t) page_to_phys(page);
 
         rxdescs[i].status = 0;
     }
@@ -372,20 +434,23 @@ int e1000_init_rx(struct e1000_device *dev)
     e1000_write(REG_RXDESCHEAD, 0, dev);
     e1000_write(REG_RXDESCTAIL, number_rx_desc - 1, dev);
 
-    dev->rx_buf_pages = rx_buf_pages;
     dev->rx_pages = rx_pages;
     dev->rx_cur = 0;
     dev->rx_descs = rxdescs;
 
     e1000_write(REG_RCTL,
                 RCTL_EN | RCTL_SBP | RCTL_UPE | RCTL_MPE | RCTL_LBM_NONE | RTCL_RDMTS_HALF |
-                    RCTL_BAM | RCTL_SECRC | RCTL_BSIZE_2048,
+                    RCTL_BAM | RCTL_SECRC | RCTL_BSIZE_4096,
                 dev);
 
     return 0;
 
+error2:
+    while (i--)
+        free_page(dev->rx_bufs[i]);
+    vm_munmap(&kernel_address_space, rxdescs, needed_pages << PAGE_SHIFT);
 error1:
-    free_pages(rx_buf_pages);
+    page_pool_destroy(&dev->rx_pool);
 error0:
     free_pages(rx_pages);
     return st;
@@ -460,7 +525,8 @@ void e1000_enable_interrupts(struct e1000_device *dev)
     assert(install_irq(dev->irq_nr, e1000_irq, (struct device *) dev->nicdev, IRQ_FLAG_REGULAR,
                        dev) == 0);
 
-    e1000_write(REG_IMS, IMS_TXDW | IMS_TXQE | IMS_RXT0, dev);
+    /* TX completions get busy-polled for, so there's no point in getting interrupts for them */
+    e1000_write(REG_IMS, E1000_RX_INTS, dev);
     e1000_read(REG_ICR, dev);
 }
 
@@ -570,18 +636,22 @@ void e1000_device::prepare_context_desc(packetbuf *buf)
 
     memset(&desc, 0, sizeof(desc));
 
-    desc.tucss = buf->transport_header_off();
+    /* The NIC sums everything from tucss to the end of the packet (the pseudo-header's sum is
+     * already in the checksum field) and stores it at tucso.
+     */
+    desc.tucss = buf->csum_start - buf->data;
     desc.ipcss = buf->net_header_off();
-
-    if (buf->needs_csum)
-    {
-        desc.tucso = buf->csum_offset_bytes();
-        desc.tucse = 0;
-    }
+    desc.tucso = buf->csum_offset_bytes();
+    desc.tucse = 0;
 
     desc.dtype = E1000_TX_CONTEXT_DESC;
     desc.tucmd = CMD_DEXT | CMD_RS;
 
+    tx_ctx_valid = true;
+    tx_ctx_ipcss = desc.ipcss;
+    tx_ctx_tucss = desc.tucss;
+    tx_ctx_tucso = desc.tucso;
+
     increment_tx_cur();
 }
 
@@ -633,15 +703,18 @@ unsigned int e1000_device::prepare_extended_descs(packetbuf *buf)
 
 int e1000_device::send_packet_extended_tx(packetbuf *buf)
 {
-    /* We need a context descriptor, so we're adding 1 to the descriptors
-     * required by the packetbuf's data itself
-     */
+    unsigned int needed_descs = calc_packetbuf_descs(buf);
 
-    unsigned int needed_descs = calc_packetbuf_descs(buf) + 1;
+    /* We may need a context descriptor, so wait for 1 more than the packetbuf's data needs */
+    wait_for_tx_descs(needed_descs + 1);
 
-    wait_for_tx_descs(needed_descs);
+    if (buf->needs_csum && !tx_ctx_matches(buf))
+    {
+        prepare_context_desc(buf);
+        needed_descs++;
+    }
 
-    prepare_context_desc(buf);
+    tx_used += needed_descs;
 
     auto old_cur = prepare_extended_descs(buf);
 
@@ -805,12 +878,14 @@ int e1000_probe(struct device *__dev)
 
     /* TODO: Allocate device names */
     n->name = "eth0";
-    n->flags |= NETIF_LINKUP;
+    n->flags |= NETIF_LINKUP | NETIF_SUPPORTS_CSUM_OFFLOAD;
     n->sendpacket = e1000_send_packet;
     n->priv = nicdev;
     n->mtu = 1500;
     n->poll_rx = e1000_pollrx;
     n->rx_end = e1000_rxend;
+    n->set_coalesce = e1000_set_coalesce;
+    e1000_set_coalesce(n, E1000_DEFAULT_RX_USECS);
     nicdev->nic_netif = n;
     n->dll_ops = &eth_ops;
     memcpy(n->mac_address, nicdev->e1000_internal_mac_address, 6);
@@ -31,6 +31,7 @@
 #define REG_FEXT       0x002c
 #define REG_FCT        0x0030
 #define REG_ICR        0x00c0
+#define REG_ITR        0x00c4
 #define REG_IMS        0x00d0
 #define REG_IMC        0x00d8
 #define REG_IVAR       0x00e4
@@ -133,9 +134,15 @@
 #define ICR_ECCER        (1 << 22)
 #define ICR_INT_ASSERTED (1 << 31)
 
-#define IMS_TXDW (1 << 0)
-#define IMS_TXQE (1 << 1)
-#define IMS_RXT0 (1 << 7)
+#define IMS_TXDW   (1 << 0)
+#define IMS_TXQE   (1 << 1)
+#define IMS_RXDMT0 (1 << 4)
+#define IMS_RXO    (1 << 6)
+#define IMS_RXT0   (1 << 7)
+
+/* ITR counts the minimum interval between interrupts in 256ns units */
+#define ITR_UNIT_NS 256
+#define ITR_MAX     0xffff
 
 struct e1000_rx_desc
 {
@@ -13,7 +13,9 @@
 
 #include <onyx/dev.h>
 #include <onyx/driver.h>
+#include <onyx/net/inet_csum.h>
 #include <onyx/net/netif.h>
+#include <onyx/net/page_pool.h>
 #include <onyx/wait_queue.h>
 
 #include <pci/pci.h>
@@ -25,6 +27,26 @@
 constexpr size_t number_tx_desc = 256;
 constexpr size_t tx_buffer_size = 2048;
 
+constexpr size_t number_rx_desc = 256;
+/* Every RX descriptor gets a page of its own, that's handed to the packetbuf as-is */
+constexpr size_t rx_buffer_size = 4096;
+static_assert(rx_buffer_size <= PAGE_SIZE);
+
+/* The RX timer ticks roughly every 5us on gigabit links, with the default C+ scale */
+#define RTL8168_RX_TIMER_UNIT_US 5
+
+/* 8000 interrupts per second, like other drivers default to */
+#define RTL8168_DEFAULT_RX_USECS 125
+
+/* Where the checksum lives in TCP and UDP headers */
+#define RTL8168_TCP_CSUM_OFF 16
+#define RTL8168_UDP_CSUM_OFF 6
+
+/* Some revisions get the checksum of frames the NIC pads wrong. Frames this short get their
+ * checksum done in software.
+ */
+#define RTL8168_MIN_CSUM_FRAME 60
+
 class rtl8168_device
 {
 private:
@@ -36,6 +58,8 @@ private:
     netif *netif_;
 
     unsigned int rx_cur{0};
+    page *rx_bufs_[number_rx_desc];
+    page_pool rx_pool_;
 
     unsigned int tx_cur{0};
     unsigned int tx_used{0};
@@ -44,7 +68,7 @@ private:
 
 public:
     rtl8168_device(pci::pci_device *dev)
-        : dev_{dev}, regs_{}, mac_{}, rxdescs_{}, txdescs_{}, netif_{}
+        : dev_{dev}, regs_{}, mac_{}, rxdescs_{}, txdescs_{}, netif_{}, rx_bufs_{}, rx_pool_{}
     {
     }
 
@@ -131,9 +155,10 @@ public:
     /**
      * @brief Does an RX poll
      *
-     * @return 0 on success, else error code
+     * @param budget Maximum number of packets to process
+     * @return Number of packets processed
      */
-    int poll_rx();
+    int poll_rx(int budget);
 
     /**
      * @brief Ends the rx poll
@@ -141,6 +166,22 @@ public:
      */
     void rx_end();
 
+    /**
+     * @brief Set up RX interrupt mitigation
+     *
+     * @param rx_usecs Maximum RX interrupt delay, in us
+     * @return 0
+     */
+    int set_coalesce(unsigned int rx_usecs);
+
+    /**
+     * @brief Give an RX descriptor (back) to the NIC
+     *
+     * @param idx Index of the descriptor
+     * @param page Page to receive into
+     */
+    void post_rx_buffer(unsigned int idx, page *page);
+
     unsigned int nr_tx_descs_available() const
     {
         return number_tx_desc - tx_used;
@@ -177,6 +218,8 @@ public:
     }
 
     unsigned int prepare_send(packetbuf *buf);
+
+    uint32_t tx_csum_opts(packetbuf *buf);
 };
 
 /**
@@ -222,25 +265,30 @@ int rtl8168_device::reset()
     return 0;
 }
 
-constexpr size_t number_rx_desc = 256;
-constexpr size_t rx_buffer_size = 2048;
-
-struct page_frag_alloc_info
+/**
+ * @brief Give an RX descriptor (back) to the NIC
+ *
+ * @param idx Index of the descriptor
+ * @param page Page to receive into
+ */
+void rtl8168_device::post_rx_buffer(unsigned int idx, page *page)
 {
-    struct page *page_list;
-    struct page *curr;
-    size_t off;
-};
+    auto &desc = rxdescs_[idx];
+    const auto phys_addr = (uint64_t) page_to_phys(page);
 
-struct page_frag_res
-{
-    struct page *page;
-    size_t off;
-};
+    rx_bufs_[idx] = page;
+    desc.buffer_addr_low = (uint32_t) phys_addr;
+    desc.buffer_addr_high = (uint32_t) (phys_addr >> 32);
+    desc.vlan = 0;
 
-extern "C" struct page_frag_res page_frag_alloc(struct page_frag_alloc_info *inf, size_t size);
+    uint32_t status = RTL8168_RX_DESC_FLAG_OWN | (uint32_t) rx_buffer_size;
+    if (idx == number_rx_desc - 1)
+        status |= RTL8168_RX_DESC_FLAG_EOR;
+
+    /* The NIC may pick it up as soon as it sees OWN */
+    __atomic_store_n(&desc.status, status, __ATOMIC_RELEASE);
+}
 
-#include <onyx/byteswap.h>
 /**
  * @brief Configure RX
  *
@@ -254,48 +302,40 @@ int rtl8168_device::configure_rx()
     regs_.write16(RTL8168_RMS, rx_buffer_size);
 
     auto desc_pages = vm_size_to_pages(number_rx_desc * sizeof(rtl8168_rx_desc));
-    printk("Pages: %lu\n", desc_pages);
     struct page *p = alloc_pages(desc_pages, PAGE_ALLOC_CONTIGUOUS);
     if (!p)
     {
         return -ENOMEM;
     }
 
-    struct page_frag_alloc_info alloc_info;
-    auto buf_pages = vm_size_to_pages(number_rx_desc * rx_buffer_size);
-    struct page *rx_buf_pages = alloc_pages(buf_pages, PAGE_ALLOC_NO_ZERO);
-    if (!rx_buf_pages)
+    if (page_pool_init(&rx_pool_, number_rx_desc) < 0)
     {
         free_pages(p);
         return -ENOMEM;
     }
 
-    alloc_info.curr = alloc_info.page_list = rx_buf_pages;
-    alloc_info.off = 0;
-
     rxdescs_ = (rtl8168_rx_desc *) map_page_list(p, desc_pages << PAGE_SHIFT, VM_READ | VM_WRITE);
     if (!rxdescs_)
     {
-        free_pages(rx_buf_pages);
+        page_pool_destroy(&rx_pool_);
         free_pages(p);
         return -ENOMEM;
     }
 
     for (unsigned int i = 0; i < number_rx_desc; i++)
     {
-        struct page_frag_res res = page_frag_alloc(&alloc_info, rx_buffer_size);
-        /* How can this even happen? Keep this here though, as a sanity check */
-        assert(res.page != nullptr);
-        auto phys_addr = (uint64_t) page_to_phys(res.page) + res.off;
-        rxdescs_[i].buffer_addr_low = (uint32_t) phys_addr;
-        rxdescs_[i].buffer_addr_high = (uint32_t) (phys_addr >> 32);
-        rxdescs_[i].status = RTL8168_RX_DESC_FLAG_OWN | (uint32_t) rx_buffer_size;
-
-        if (i == number_rx_desc - 1)
+        struct page *page = page_pool_alloc(&rx_pool_);
+        if (!page)
         {
-            // set the EOR
-            rxdescs_[i].status |= RTL8168_RX_DESC_FLAG_EOR;
+            while (i--)
+                free_page(rx_bufs_[i]);
+            vm_munmap(&kernel_address_space, rxdescs_, desc_pages << PAGE_SHIFT);
+            page_pool_destroy(&rx_pool_);
+            free_pages(p);
+            return -ENOMEM;
         }
+
+        post_rx_buffer(i, page);
     }
 
     unsigned long rxd_base = (unsigned long) page_to_phys(p);
@@ -324,7 +364,7 @@ int rtl8168_device::configure_tx()
     }
 
     txdescs_ = (rtl8168_rx_desc *) map_page_list(p, desc_pages << PAGE_SHIFT, VM_READ | VM_WRITE);
-    if (!rxdescs_)
+    if (!txdescs_)
     {
         free_pages(p);
         return -ENOMEM;
@@ -360,9 +400,9 @@ int rtl8168_send_packet(packetbuf *buf, netif *nif)
     return ((rtl8168_device *) nif->priv)->send_packet(buf);
 }
 
-int rtl8168_poll_rx(netif *nif)
+int rtl8168_poll_rx(netif *nif, int budget)
 {
-    return ((rtl8168_device *) nif->priv)->poll_rx();
+    return ((rtl8168_device *) nif->priv)->poll_rx(budget);
 }
 
 void rtl8168_rx_end(netif *nif)
@@ -370,10 +410,87 @@ void rtl8168_rx_end(netif *nif)
     ((rtl8168_device *) nif->priv)->rx_end();
 }
 
+int rtl8168_set_coalesce(netif *nif, unsigned int rx_usecs)
+{
+    return ((rtl8168_device *) nif->priv)->set_coalesce(rx_usecs);
+}
+
+/**
+ * @brief Checksum a short frame in software. Its payload may be spread over several pages
+ * (zero-copy sends, splice), so gather it first. It's tiny anyway.
+ *
+ * @param buf Packet
+ */
+static void rtl8168_csum_short_frame(packetbuf *buf)
+{
+    unsigned char l4[RTL8168_MIN_CSUM_FRAME];
+
+    /* The field holds the pseudo-header's sum, finish it off */
+    auto starting_csum = *buf->csum_offset;
+    *(volatile may_alias_uint16_t *) buf->csum_offset = 0;
+
+    unsigned int len = buf->tail - buf->csum_start;
+    memcpy(l4, buf->csum_start, len);
+
+    for (unsigned int i = 1; buf->page_vec[i].page; i++)
+    {
+        const auto &v = buf->page_vec[i];
+        memcpy(l4 + len, (unsigned char *) PAGE_TO_VIRT(v.page) + v.page_off, v.length);
+        len += v.length;
+    }
+
+    *buf->csum_offset = ipsum_fold(__ipsum_unfolded(l4, len, starting_csum));
+}
+
+/**
+ * @brief Work out the checksum offload bits for a packet
+ *
+ * @param buf Packet
+ * @return Bits to set in the TX descriptors' second dword
+ */
+uint32_t rtl8168_device::tx_csum_opts(packetbuf *buf)
+{
+    if (!buf->needs_csum)
+        return 0;
+
+    const unsigned int l4_off = buf->csum_start - buf->data;
+
+    if (buf->length() < RTL8168_MIN_CSUM_FRAME)
+    {
+        rtl8168_csum_short_frame(buf);
+        return 0;
+    }
+
+    uint32_t opts;
+
+    /* The NIC needs to be told where the transport header starts for IPv6, as it doesn't parse
+     * the extension headers.
+     */
+    if ((buf->net_header[0] >> 4) == 6)
+    {
+        DCHECK(l4_off <= RTL8168_TX_DESC_V2_TCPHO_MAX);
+        opts = RTL8168_TX_DESC_V2_IPV6_CS | (l4_off << RTL8168_TX_DESC_V2_TCPHO_SHIFT);
+    }
+    else
+        opts = RTL8168_TX_DESC_V2_IPV4_CS;
+
+    /* TCP and UDP are the only users of checksum offloading, tell them apart by where the
+     * checksum is.
+     */
+    if (buf->csum_offset_bytes() - l4_off == RTL8168_UDP_CSUM_OFF)
+        opts |= RTL8168_TX_DESC_V2_UDP_CS;
+    else
+        opts |= RTL8168_TX_DESC_V2_TCP_CS;
+
+    return opts;
+}
+
 unsigned int rtl8168_device::prepare_send(packetbuf *buf)
 {
     unsigned int last_tx = 0;
     unsigned int xmited = 0;
+    const unsigned int first_tx = tx_cur;
+    const uint32_t csum_opts = tx_csum_opts(buf);
 
     for (const auto &vec : buf->page_vec)
     {
@@ -396,11 +513,18 @@ unsigned int rtl8168_device::prepare_send(packetbuf *buf)
         const auto addr = ((uint64_t) page_to_phys(vec.page)) + buffer_start_off;
         desc.buffer_addr_low = (uint32_t) addr;
         desc.buffer_addr_high = (uint32_t) (addr >> 32);
+        desc.vlan = csum_opts;
 
-        desc.status = length | RTL8168_TX_DESC_FLAG_OWN;
+        desc.status = length;
 
         if (!xmited)
             desc.status |= RTL8168_TX_DESC_FLAG_FS;
+        else
+            desc.status |= RTL8168_TX_DESC_FLAG_OWN;
+
+        /* memset() wiped the end of ring marker */
+        if (tx_cur == number_tx_desc - 1)
+            desc.status |= RTL8168_TX_DESC_FLAG_EOR;
 
         last_tx = tx_cur;
 
@@ -411,6 +535,9 @@ unsigned int rtl8168_device::prepare_send(packetbuf *buf)
 
     txdescs_[last_tx].status |= RTL8168_TX_DESC_FLAG_LS;
 
+    /* Hand the first descriptor over last, so the NIC never sees half a packet */
+    __atomic_or_fetch(&txdescs_[first_tx].status, RTL8168_TX_DESC_FLAG_OWN, __ATOMIC_RELEASE);
+
     return last_tx;
 }
 
@@ -432,47 +559,76 @@ int rtl8168_device::send_packet(packetbuf *buf)
     return 0;
 }
 
-static int process_packet(netif *nif, rtl8168_rx_desc &desc)
+/* The length the NIC reports includes the CRC */
+#define RTL8168_FCS_LEN 4
+
+/**
+ * @brief Hand a received packet to the network stack
+ *
+ * @param nif Network interface
+ * @param status The RX descriptor's status
+ * @param page Page the packet was received in. The packet takes over our reference.
+ * @return 0 on success, negative error codes
+ */
+static int process_packet(netif *nif, uint32_t status, page *page)
 {
+    const unsigned int len = status & RTL8168_RX_LENGTH_MASK;
+
+    if (status & RTL8168_RX_DESC_FLAG_RES || len <= RTL8168_FCS_LEN)
+    {
+        free_page(page);
+        return -EIO;
+    }
+
     auto pckt = make_refc<packetbuf>();
     if (!pckt)
+    {
+        free_page(page);
         return -ENOMEM;
+    }
 
-    unsigned int len = desc.status & RTL8168_RX_LENGTH_MASK;
-    auto addr = ((uint64_t) desc.buffer_addr_high << 32) | desc.buffer_addr_low;
-
-    eth_header *eth = (eth_header *) (PHYS_TO_VIRT(addr));
-
-    printk("Eth: %04x\n", ntohs(eth->ethertype));
-    printk("Packet length %u\n", len);
-
-    if (!pckt->allocate_space(len))
-        return -ENOMEM;
+    pckt->attach_rx_buffer(page, 0, len - RTL8168_FCS_LEN, rx_buffer_size);
 
     pckt->needs_csum = 1;
 
-    void *p = pckt->put(len);
-
-    memcpy(p, PHYS_TO_VIRT(addr), len);
-
     return netif_process_pbuf(nif, pckt.get());
 }
 
 /**
  * @brief Does an RX poll
  *
- * @return 0 on success, else error code
+ * @param budget Maximum number of packets to process
+ * @return Number of packets processed
  */
-int rtl8168_device::poll_rx()
+int rtl8168_device::poll_rx(int budget)
 {
-    while (!(rxdescs_[rx_cur].status & RTL8168_RX_DESC_FLAG_OWN))
+    int done = 0;
+
+    while (done < budget)
     {
-        auto &rx_desc = rxdescs_[rx_cur];
-        process_packet(netif_, rx_desc);
+        const uint32_t status = __atomic_load_n(&rxdescs_[rx_cur].status, __ATOMIC_ACQUIRE);
+        if (status & RTL8168_RX_DESC_FLAG_OWN)
+            break;
+
+        page *page = rx_bufs_[rx_cur];
+
+        /* The packet gets the page, and the descriptor gets a new one. If we can't find a
+         * replacement, drop the packet and let the NIC have the page back.
+         */
+        struct page *new_page = page_pool_alloc(&rx_pool_);
+        if (new_page)
+        {
+            page_pool_recycle(&rx_pool_, page);
+            process_packet(netif_, status, page);
+            page = new_page;
+        }
+
+        post_rx_buffer(rx_cur, page);
         rx_cur = (rx_cur + 1) % number_rx_desc;
+        done++;
     }
 
-    return 0;
+    return done;
 }
 
 /**
@@ -484,6 +640,30 @@ void rtl8168_device::rx_end()
     regs_.write16(RTL8168_IMR, RTL8168_INT_LINKCHG | RTL8168_INT_ROK);
 }
 
+/**
+ * @brief Set up RX interrupt mitigation
+ *
+ * @param rx_usecs Maximum RX interrupt delay, in us
+ * @return 0
+ */
+int rtl8168_device::set_coalesce(unsigned int rx_usecs)
+{
+    unsigned int timer = (rx_usecs + RTL8168_RX_TIMER_UNIT_US - 1) / RTL8168_RX_TIMER_UNIT_US;
+    timer = cul::min(timer, (unsigned int) RTL8168_INTRMITIGATE_MAX);
+
+    /* Let as many frames as possible pile up, so the timer is what decides when we get the
+     * interrupt. TX completions get busy-polled for, so leave TX alone.
+     */
+    uint16_t val = 0;
+    if (timer)
+        val = (timer << RTL8168_INTRMITIGATE_RX_TIMER_SHIFT) |
+              (RTL8168_INTRMITIGATE_MAX << RTL8168_INTRMITIGATE_RX_FRAMES_SHIFT);
+
+    regs_.write16(RTL8168_INTRMITIGATE, val);
+    netif_->rx_coalesce_usecs = timer * RTL8168_RX_TIMER_UNIT_US;
+    return 0;
+}
+
 /**
  * @brief Initialises the rtl8111/rtl8168 device
  *
@@ -537,13 +717,15 @@ int rtl8168_device::init()
 
     /* TODO: Allocate device names */
     n->name = "eth0";
-    n->flags |= NETIF_LINKUP;
+    n->flags |= NETIF_LINKUP | NETIF_SUPPORTS_CSUM_OFFLOAD;
     n->sendpacket = rtl8168_send_packet;
     n->priv = this;
     n->mtu = 1500;
     n->poll_rx = rtl8168_poll_rx;
     n->rx_end = rtl8168_rx_end;
+    n->set_coalesce = rtl8168_set_coalesce;
     netif_ = n;
+    set_coalesce(RTL8168_DEFAULT_RX_USECS);
     n->dll_ops = &eth_ops;
     memcpy(n->mac_address, mac_, 6);
     netif_register_if(n);
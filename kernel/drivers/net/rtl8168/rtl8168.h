@@ -64,6 +64,14 @@
 #define RTL8168_RDSAR_LOW  0xe4
 #define RTL8168_RDSAR_HIGH 0xe8
 
+// Interrupt mitigation. Bits 15..12 are the TX timer, 11..8 TX frames, 7..4 the RX timer and
+// 3..0 RX frames. Timer units depend on the link speed and the C+ scale bits.
+#define RTL8168_INTRMITIGATE 0xe2
+
+#define RTL8168_INTRMITIGATE_RX_TIMER_SHIFT  4
+#define RTL8168_INTRMITIGATE_RX_FRAMES_SHIFT 0
+#define RTL8168_INTRMITIGATE_MAX             0xf
+
 // Max transmit packet size, in 128 byte units
 #define RTL8168_MTPS 0xec
 
@@ -135,6 +143,15 @@ struct rtl8168_rx_desc
 #define RTL8168_TX_DESC_FLAG_EOR   (1 << 30)
 #define RTL8168_TX_DESC_FLAG_OWN   (1 << 31)
 
+// PCIe 8168/8111 chips take the checksum offload bits in the second dword (the v1 bits above are
+// for the old PCI 8169s)
+#define RTL8168_TX_DESC_V2_IPV6_CS     (1 << 28)
+#define RTL8168_TX_DESC_V2_IPV4_CS     (1 << 29)
+#define RTL8168_TX_DESC_V2_TCP_CS      (1 << 30)
+#define RTL8168_TX_DESC_V2_UDP_CS      (1U << 31)
+#define RTL8168_TX_DESC_V2_TCPHO_SHIFT 18
+#define RTL8168_TX_DESC_V2_TCPHO_MAX   0x3ff
+
 struct rtl8168_tx_desc
 {
     uint32_t status;
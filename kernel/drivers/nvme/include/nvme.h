@@ -285,6 +285,25 @@ private:
      */
     int submit_request(nvme_namespace *ns, struct bio_req *req);
 
+    /**
+     * @brief Discard a request's range with a Dataset Management command
+     *
+     * @param ns NVMe namespace
+     * @param req BIO req to serve
+     * @return 0 on success, negative error codes
+     */
+    int submit_discard(nvme_namespace *ns, struct bio_req *req);
+
+    /**
+     * @brief Submit an IO command on behalf of a request, and wait for it to complete
+     *
+     * @param ns NVMe namespace
+     * @param req BIO req the command serves
+     * @param cmd Command
+     * @return 0 on success, negative error codes
+     */
+    int do_io_command(nvme_namespace *ns, struct bio_req *req, nvmecmd *cmd);
+
     struct prp_setup
     {
         size_t xfer_blocks;
@@ -679,7 +698,27 @@ static_assert(sizeof(nvme_identify_namespace) == 4096);
 #define NVME_CREATE_IOCQ_PHYS_CONTIG (1 << 0)
 #define NVME_CREATE_IOCQ_IEN         (1 << 1)
 
-#define NVME_NVM_CMD_WRITE 1
-#define NVME_NVM_CMD_READ  2
+#define NVME_NVM_CMD_WRITE        1
+#define NVME_NVM_CMD_READ         2
+#define NVME_NVM_CMD_WRITE_ZEROES 8
+#define NVME_NVM_CMD_DSM          9
+
+/* Identify controller ONCS bits */
+#define NVME_ONCS_DSM          (1 << 2)
+#define NVME_ONCS_WRITE_ZEROES (1 << 3)
+
+/* Dataset Management: cdw10 holds the number of ranges (0's based), cdw11 the attributes */
+#define NVME_DSM_ATTR_DEALLOCATE (1 << 2)
+
+struct nvme_dsm_range
+{
+    uint32_t attributes;
+    uint32_t nlb;
+    uint64_t slba;
+};
+
+/* Write Zeroes: cdw12 holds the number of blocks (0's based) and these flags */
+#define NVME_WRITE_ZEROES_DEAC    (1U << 25)
+#define NVME_WRITE_ZEROES_MAX_NLB 0x10000
 
 #endif
@@ -285,6 +285,13 @@ int nvme_device::init_drive(uint32_t nsid, unique_page identify_namespace_data)
     d->sector_size = lba;
     d->nr_sectors = nspace_identify->nsze * lba;
     d->device_info = nspace.get();
+
+    const nvme_identify_t *ctrl_identify = (const nvme_identify_t *) PAGE_TO_VIRT(identify_page_);
+    if (ctrl_identify->ONCS & NVME_ONCS_DSM)
+        d->max_discard_sectors = UINT32_MAX;
+    if (ctrl_identify->ONCS & NVME_ONCS_WRITE_ZEROES)
+        d->max_write_zeroes_sectors = NVME_WRITE_ZEROES_MAX_NLB;
+
     d->submit_request = [](struct blockdev *dev, struct bio_req *req) -> int {
         nvme_namespace *n = (nvme_namespace *) dev->device_info;
         // TODO: Hack! The disk driver should never get a request for a partition
@@ -331,10 +338,10 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
             return unexpected{-EINVAL};
         }
 
-        if (req->vec[i].page_off + req->vec[i].length != PAGE_SIZE && i != 0)
+        if (req->vec[i].page_off + req->vec[i].length != PAGE_SIZE && i + 1 != req->nr_vecs)
         {
-            // Same as above. We're basically forced to guarantee all these page_iov are actual full
-            // pages
+            // Same as above, but for the end. Only the last entry may end before the end of the
+            // page, as the transfer size tells the controller where it stops.
             return unexpected{-EINVAL};
         }
     }
@@ -435,6 +442,11 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
         case BIO_REQ_WRITE_OP:
             command = NVME_NVM_CMD_WRITE;
             break;
+        case BIO_REQ_WRITE_ZEROES_OP:
+            command = NVME_NVM_CMD_WRITE_ZEROES;
+            break;
+        case BIO_REQ_DISCARD_OP:
+            return submit_discard(ns, req);
         default:
             req->flags |= BIO_REQ_EIO;
             return -EOPNOTSUPP;
@@ -446,6 +458,22 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
     cmd.cmd.nsid = ns->nsid_;
     cmd.cmd.cdw12 = 0;
 
+    if (command == NVME_NVM_CMD_WRITE_ZEROES)
+    {
+        if (req->nr_sectors == 0 || req->nr_sectors > NVME_WRITE_ZEROES_MAX_NLB)
+        {
+            req->flags |= BIO_REQ_EIO;
+            return -EIO;
+        }
+
+        cmd.cmd.cdw10 = (uint32_t) req->sector_number;
+        cmd.cmd.cdw11 = (uint32_t) (req->sector_number >> 32);
+        cmd.cmd.cdw12 = (uint32_t) (req->nr_sectors - 1);
+        if (req->flags & BIO_REQ_UNMAP)
+            cmd.cmd.cdw12 |= NVME_WRITE_ZEROES_DEAC;
+        return do_io_command(ns, req, &cmd);
+    }
+
     auto ex = setup_prp(req, ns);
 
     if (ex.has_error())
@@ -469,19 +497,72 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
     cmd.cmd.cdw13 = 0;
     cmd.cmd.cdw14 = 0;
 
+    return do_io_command(ns, req, &cmd);
+}
+
+/**
+ * @brief Discard a request's range with a Dataset Management command
+ *
+ * @param ns NVMe namespace
+ * @param req BIO req to serve
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::submit_discard(nvme_namespace *ns, struct bio_req *req)
+{
+    if (req->nr_sectors == 0 || req->nr_sectors > UINT32_MAX)
+    {
+        req->flags |= BIO_REQ_EIO;
+        return -EIO;
+    }
+
+    // The range list is the command's data. We only ever send one range.
+    unique_page range_page = alloc_page(PAGE_ALLOC_NO_ZERO);
+    if (!range_page)
+    {
+        req->flags |= BIO_REQ_EIO;
+        return -ENOMEM;
+    }
+
+    nvme_dsm_range *range = (nvme_dsm_range *) PAGE_TO_VIRT(range_page);
+    range->attributes = 0;
+    range->nlb = (uint32_t) req->nr_sectors;
+    range->slba = req->sector_number;
+
+    nvmecmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmd.cdw0.cdw0 =
+        NVME_CMD_OPCODE(NVME_NVM_CMD_DSM) | NVME_CMD_FUSE_NORMAL | NVME_CMD_PSDT_PRP;
+    cmd.cmd.nsid = ns->nsid_;
+    cmd.cmd.dptr.prp[0] = (prp_entry_t) page_to_phys(range_page);
+    cmd.cmd.cdw10 = 0;
+    cmd.cmd.cdw11 = NVME_DSM_ATTR_DEALLOCATE;
+
+    return do_io_command(ns, req, &cmd);
+}
+
+/**
+ * @brief Submit an IO command on behalf of a request, and wait for it to complete
+ *
+ * @param ns NVMe namespace
+ * @param req BIO req the command serves
+ * @param cmd Command
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::do_io_command(nvme_namespace *ns, struct bio_req *req, nvmecmd *cmd)
+{
     wait_queue wq;
     init_wait_queue_head(&wq);
-    cmd.wq = &wq;
+    cmd->wq = &wq;
 
     auto &queue = queues_[pick_io_queue(req)];
-    queue.submit_command(&cmd);
+    queue.submit_command(cmd);
 
-    wait_for_event(&wq, cmd.has_response);
+    wait_for_event(&wq, cmd->has_response);
 
-    if (auto status = NVME_CQE_STATUS_CODE(cmd.response.dw3); status != 0)
+    if (auto status = NVME_CQE_STATUS_CODE(cmd->response.dw3); status != 0)
     {
-        printf("nvme%un%u: NVME_NVM_CMD_READ/WRITE: Status error %x\n", device_index_, ns->nsid_,
-               status);
+        printf("nvme%un%u: IO command %02x: Status error %x\n", device_index_, ns->nsid_,
+               cmd->cmd.cdw0.opcode, status);
         req->flags |= BIO_REQ_EIO;
         return -EIO;
     }
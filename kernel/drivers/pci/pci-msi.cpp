@@ -13,6 +13,7 @@
 #include <onyx/acpi.h>
 #include <onyx/page.h>
 #include <onyx/platform.h>
+#include <onyx/vm.h>
 
 #include <pci/pci-msi.h>
 #include <pci/pci.h>
@@ -71,4 +72,59 @@ int pci_device::enable_msi(irq_t handler, void *cookie)
     return 0;
 }
 
+int pci_device::enable_msix(unsigned int nr_vecs, irq_t handler, void *const *cookies,
+                            const unsigned int *cpus)
+{
+    if (!platform_has_msi())
+        return errno = EIO, -1;
+
+    size_t offset = find_capability(PCI_CAP_ID_MSI_X, 0);
+    if (offset == 0)
+        return errno = ENODEV, -1;
+
+    uint16_t message_control = read(offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    if (nr_vecs == 0 || nr_vecs > (unsigned int) PCI_MSIX_MSGCTRL_TABLE_SIZE(message_control))
+        return errno = EINVAL, -1;
+
+    uint32_t table_info = read(offset + PCI_MSIX_TABLE_OFF, sizeof(uint32_t));
+    unsigned int bir = table_info & PCI_MSIX_BIR_MASK;
+
+    auto bar = (volatile uint8_t *) map_bar(bir, VM_NOCACHE);
+    if (!bar)
+        return errno = ENOMEM, -1;
+
+    volatile uint8_t *table = bar + (table_info & ~PCI_MSIX_BIR_MASK);
+
+    struct pci_msi_data data;
+    if (platform_allocate_msi_interrupts(nr_vecs, true, &data) < 0)
+        return -1;
+
+    /* Keep every vector masked while we program the table */
+    message_control |= PCI_MSIX_MSGCTRL_ENABLE | PCI_MSIX_MSGCTRL_FUNCTION_MASK;
+    write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    for (unsigned int i = 0; i < nr_vecs; i++)
+    {
+        struct pci_msi_data vec_data = data;
+        vec_data.data = data.data + i;
+
+        if (cpus)
+            platform_msi_set_target(&vec_data, cpus[i]);
+
+        assert(install_irq(data.irq_offset + i, handler, this, IRQ_FLAG_REGULAR, cookies[i]) == 0);
+
+        volatile uint8_t *entry = table + i * PCI_MSIX_ENTRY_SIZE;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_ADDR_LO) = vec_data.address;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_ADDR_HI) = vec_data.address_high;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_DATA) = vec_data.data;
+        *(volatile uint32_t *) (entry + PCI_MSIX_ENTRY_VECTOR_CTL) = 0;
+    }
+
+    message_control &= ~PCI_MSIX_MSGCTRL_FUNCTION_MASK;
+    write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    return 0;
+}
+
 } // namespace pci
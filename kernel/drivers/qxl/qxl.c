@@ -11,7 +11,6 @@
 
 #include <onyx/acpi.h>
 #include <onyx/dev.h>
-#include <onyx/dpc.h>
 #include <onyx/driver.h>
 
 #include <pci/pci.h>
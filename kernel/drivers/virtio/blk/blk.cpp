@@ -8,8 +8,12 @@
 
 #include "blk.hpp"
 
+#include <onyx/cpu.h>
 #include <onyx/id.h>
 #include <onyx/log.h>
+#include <onyx/new.h>
+
+#include <onyx/utility.hpp>
 
 namespace virtio
 {
@@ -17,27 +21,57 @@ namespace virtio
 static blk_features supported_features[] = {blk_features::size_max, blk_features::seg_max,
                                             blk_features::geometry, blk_features::ro,
                                             blk_features::blk_size, blk_features::topology,
-                                            blk_features::discard,  blk_features::write_zeroes};
+                                            blk_features::mq,       blk_features::discard,
+                                            blk_features::write_zeroes};
 
 static uint32_t bio_req_to_virtio_blk_type(uint8_t op)
 {
     switch (op)
     {
-    // TODO: Add support for the others
     case BIO_REQ_READ_OP:
         return VIRTIO_BLK_T_IN;
     case BIO_REQ_WRITE_OP:
         return VIRTIO_BLK_T_OUT;
+    case BIO_REQ_DISCARD_OP:
+        return VIRTIO_BLK_T_DISCARD;
+    case BIO_REQ_WRITE_ZEROES_OP:
+        return VIRTIO_BLK_T_WRITE_ZEROES;
     default:
         return (uint32_t) -1;
     }
 }
 
-int blk_vdev::submit_request(struct bio_req *req)
+void blk_vdev::kick_pending_queues(unsigned long except)
+{
+    unsigned long pending = __atomic_exchange_n(&kick_pending, 0, __ATOMIC_RELAXED);
+    pending &= ~except;
+
+    while (pending)
+    {
+        unsigned int nr = __builtin_ctzl(pending);
+        pending &= pending - 1;
+        get_vq(nr)->notify();
+    }
+}
+
+int blk_vdev::queue_request(struct bio_req *req)
 {
     uint8_t op = req->flags & BIO_REQ_OP_MASK;
+    uint32_t type = bio_req_to_virtio_blk_type(op);
+    const bool dataless = type == VIRTIO_BLK_T_DISCARD || type == VIRTIO_BLK_T_WRITE_ZEROES;
+
+    if (type == (uint32_t) -1)
+        return -EIO;
+
+    if ((type == VIRTIO_BLK_T_DISCARD && !has_feature((unsigned long) blk_features::discard)) ||
+        (type == VIRTIO_BLK_T_WRITE_ZEROES &&
+         !has_feature((unsigned long) blk_features::write_zeroes)))
+    {
+        req->flags |= BIO_REQ_NOT_SUPP;
+        return -EOPNOTSUPP;
+    }
 
-    // We allocate a meta page that will hold the header and status
+    // We allocate a meta page that will hold the header, status and in-flight state
     // Yes, it's a bit wasteful, but much faster than walking page tables for stack
     // variables' physical addresses
     struct page *meta_page = alloc_page(PAGE_ALLOC_NO_ZERO);
@@ -47,25 +81,41 @@ int blk_vdev::submit_request(struct bio_req *req)
     virtio_blk_request *breq = (virtio_blk_request *) PAGE_TO_VIRT(meta_page);
     virtio_blk_tail *btail = (virtio_blk_tail *) (breq + 1);
 
-    breq->type = bio_req_to_virtio_blk_type(op);
+    breq->type = type;
+    breq->sector = dataless ? 0 : req->sector_number;
+    breq->reserved = 0;
+    btail->status = 0;
+
+    // Data-less requests describe their range in a segment, which takes the place of the data
+    page_iov segment_vec;
 
-    if (breq->type == (uint32_t) -1)
+    if (dataless)
     {
-        free_page(meta_page);
-        return -EIO;
+        auto seg = (virtio_blk_discard_write_zeroes *) ((char *) breq + VIRTIO_BLK_SEGMENT_OFF);
+        seg->sector = req->sector_number;
+        seg->num_sectors = (uint32_t) req->nr_sectors;
+        seg->flags = 0;
+
+        if (type == VIRTIO_BLK_T_WRITE_ZEROES && req->flags & BIO_REQ_UNMAP &&
+            write_zeroes_may_unmap)
+            seg->flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+
+        segment_vec.page = meta_page;
+        segment_vec.page_off = VIRTIO_BLK_SEGMENT_OFF;
+        segment_vec.length = sizeof(virtio_blk_discard_write_zeroes);
     }
 
-    breq->sector = req->sector_number;
-    breq->reserved = 0;
-    btail->status = 0;
+    auto inflight = new ((char *) breq + VIRTIO_BLK_INFLIGHT_OFF)
+        virtio_blk_inflight{req, meta_page};
 
-    const auto &requestq = get_vq(0);
+    /* Spread requests over the queues by cpu. It doesn't matter if we get migrated. */
+    const unsigned int qnr = get_cpu_nr() % nr_queues;
+    const auto &requestq = get_vq(qnr);
 
     virtio_allocation_info alloc_info;
-    virtio_completion completion;
 
-    alloc_info.nr_vecs = req->nr_vecs + 2;
-    alloc_info.vec = req->vec;
+    alloc_info.nr_vecs = dataless ? 3 : req->nr_vecs + 2;
+    alloc_info.vec = dataless ? &segment_vec : req->vec;
     alloc_info.context = meta_page;
     alloc_info.alloc_flags = VIRTIO_ALLOCATION_FLAG_WRITE;
 
@@ -102,13 +152,42 @@ int blk_vdev::submit_request(struct bio_req *req)
         return {v, alloc_flags};
     };
 
-    alloc_info.completion = &completion;
+    alloc_info.completion = inflight;
 
     requestq->allocate_descriptors(alloc_info, false);
 
-    requestq->put_buffer(alloc_info, true);
+    /* Batches only ring the doorbell(s) on their last request */
+    if (req->flags & BIO_REQ_MORE)
+    {
+        requestq->put_buffer(alloc_info, false);
+        __atomic_or_fetch(&kick_pending, 1UL << qnr, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        requestq->put_buffer(alloc_info, true);
+        if (__atomic_load_n(&kick_pending, __ATOMIC_RELAXED))
+            kick_pending_queues(1UL << qnr);
+    }
+
+    return 0;
+}
+
+int blk_vdev::submit_request(struct bio_req *req)
+{
+    int st = queue_request(req);
+
+    /* A request that doesn't make it ends its batch, so get the ones before it going */
+    if (st < 0 && __atomic_load_n(&kick_pending, __ATOMIC_RELAXED))
+        kick_pending_queues(0);
+
+    return st;
+}
 
-    completion.wait();
+void virtio_blk_inflight::wake()
+{
+    struct bio_req *req = bio;
+    struct page *page = meta_page;
+    virtio_blk_tail *btail = (virtio_blk_tail *) ((virtio_blk_request *) PAGE_TO_VIRT(page) + 1);
 
     if (btail->status == VIRTIO_BLK_S_OK)
     {
@@ -123,9 +202,9 @@ int blk_vdev::submit_request(struct bio_req *req)
         req->flags |= BIO_REQ_EIO;
     }
 
-    free_page(meta_page);
-
-    return 0;
+    /* We live in the meta page, so we're gone after this */
+    free_page(page);
+    bio_end_io(req);
 }
 
 void blk_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
@@ -163,11 +242,27 @@ bool blk_vdev::perform_subsystem_initialization()
         return false;
     }
 
-    // Create the requestq queue
-    if (!create_virtqueue(0, get_max_virtq_size(0)))
+    if (has_feature(static_cast<unsigned long>(blk_features::mq)))
     {
-        set_failure();
-        return false;
+        nr_queues = read<uint16_t>(static_cast<unsigned long>(blk_registers::num_queues));
+        nr_queues = cul::min(nr_queues, cul::min(get_nr_cpus(), VIRTIO_BLK_MAX_QUEUES));
+        if (nr_queues == 0)
+            nr_queues = 1;
+    }
+
+    // Give each queue its own interrupt, routed to the cpu that submits to it. If that
+    // doesn't work out, they share the legacy interrupt.
+    if (!setup_queue_vectors(nr_queues))
+        printk("virtio-blk: MSI-X unavailable, using the legacy interrupt\n");
+
+    // Create the requestq queues
+    for (unsigned int i = 0; i < nr_queues; i++)
+    {
+        if (!create_virtqueue(i, get_max_virtq_size(i)))
+        {
+            set_failure();
+            return false;
+        }
     }
 
     finalise_driver_init();
@@ -178,7 +273,23 @@ bool blk_vdev::perform_subsystem_initialization()
         return false;
 
     dev->submit_request = blk::blk_submit_request;
+    dev->flags |= BLKDEV_FLAG_ASYNC;
+    dev->device_info = this;
     dev->sector_size = 512;
+    dev->nr_sectors = read<uint64_t>(static_cast<unsigned long>(blk_registers::capacity));
+
+    // We send a single segment per request, so only the sector limits matter
+    if (has_feature(static_cast<unsigned long>(blk_features::discard)))
+        dev->max_discard_sectors =
+            read<uint32_t>(static_cast<unsigned long>(blk_registers::max_discard_sectors));
+
+    if (has_feature(static_cast<unsigned long>(blk_features::write_zeroes)))
+    {
+        dev->max_write_zeroes_sectors =
+            read<uint32_t>(static_cast<unsigned long>(blk_registers::max_write_zeroes_sectors));
+        write_zeroes_may_unmap =
+            read<uint8_t>(static_cast<unsigned long>(blk_registers::write_zeroes_may_unmap));
+    }
 
     if (blkdev_init(dev.get()) < 0)
         return false;
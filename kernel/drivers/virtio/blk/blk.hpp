@@ -29,10 +29,11 @@ enum class blk_registers
     blk_size = 20,
     topo_physical_block_exp = 24,
     topo_alignment_offset = 25,
-    topo_min_io_size = 27,
+    topo_min_io_size = 26,
     topo_opt_io_size = 28,
     writeback = 32,
     unused0 = 33,
+    num_queues = 34,
     max_discard_sectors = 36,
     max_discard_seg = 40,
     discard_sector_alignment = 44,
@@ -52,19 +53,33 @@ enum class blk_features
     flush = 9,
     topology = 10,
     wce = 11,
-    discard = 12,
+    mq = 12,
+    discard = 13,
     write_zeroes = 14
 };
 
+/* We keep track of queues that need a kick in an unsigned long */
+#define VIRTIO_BLK_MAX_QUEUES 64U
+
 class blk_vdev : public vdev
 {
 private:
     size_t block_size;
     size_t disk_size;
     size_t size_max, seg_max;
+    unsigned int nr_queues;
+    /* Queues that got requests with BIO_REQ_MORE, and haven't been kicked yet */
+    unsigned long kick_pending;
+    /* The device may deallocate sectors on write zeroes requests */
+    bool write_zeroes_may_unmap;
+
+    void kick_pending_queues(unsigned long except);
+    int queue_request(struct bio_req *req);
 
 public:
-    blk_vdev(pci::pci_device *d) : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}
+    blk_vdev(pci::pci_device *d)
+        : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}, nr_queues{1},
+          kick_pending{}, write_zeroes_may_unmap{}
     {
     }
     ~blk_vdev();
@@ -87,6 +102,36 @@ struct virtio_blk_tail
     uint8_t status;
 };
 
+/* Discard and write zeroes requests carry one of these (per segment) instead of data */
+struct virtio_blk_discard_write_zeroes
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1 << 0)
+
+/* In-flight request. It lives in the request's meta page, after the header and the tail, and
+ * completes the bio when the device is done with it.
+ */
+struct virtio_blk_inflight : public virtio_completion
+{
+    struct bio_req *bio;
+    struct page *meta_page;
+
+    virtio_blk_inflight(struct bio_req *bio, struct page *meta_page)
+        : bio{bio}, meta_page{meta_page}
+    {
+    }
+
+    void wake() override;
+};
+
+/* Meta page layout: header, tail, segment (for data-less requests) and in-flight state */
+#define VIRTIO_BLK_SEGMENT_OFF  32
+#define VIRTIO_BLK_INFLIGHT_OFF 64
+
 #define VIRTIO_BLK_T_IN           0
 #define VIRTIO_BLK_T_OUT          1
 #define VIRTIO_BLK_T_FLUSH        4
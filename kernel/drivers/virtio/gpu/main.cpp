@@ -27,7 +27,7 @@ bool gpu_vdev::perform_subsystem_initialization()
     if (raw_has_feature(gpu_features::edid_supported))
         signal_feature(gpu_features::edid_supported);
 
-    if (!finish_feature_negotiation())
+    if (!do_device_independent_negotiation() || !finish_feature_negotiation())
     {
         set_failure();
         return false;
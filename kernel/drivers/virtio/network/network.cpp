@@ -56,11 +56,11 @@ void network_vdev::__rx_end(netif *nif)
     dev->rx_end();
 }
 
-int network_vdev::__poll_rx(netif *nif)
+int network_vdev::__poll_rx(netif *nif, int budget)
 {
     auto dev = static_cast<network_vdev *>(nif->priv);
 
-    return dev->poll_rx();
+    return dev->poll_rx(budget);
 }
 
 static constexpr unsigned int network_receiveq = 0;
@@ -70,15 +70,17 @@ void network_vdev::rx_end()
 {
     auto &vq = get_vq(network_receiveq);
 
-    vq->enable_interrupts();
+    /* Packets that came in after we stopped polling don't get an interrupt, poll again */
+    if (vq->enable_interrupts())
+        netif_signal_rx(nif.get());
 }
 
-int network_vdev::poll_rx()
+int network_vdev::poll_rx(int budget)
 {
     auto &vq = get_vq(network_receiveq);
 
-    vq->handle_irq();
-    return 0;
+    /* Anything past the budget stays in the used ring, for the next poll */
+    return vq->handle_irq(budget);
 }
 
 int network_vdev::send_packet(packetbuf *buf)
@@ -46,12 +46,12 @@ private:
 
     static int __sendpacket(packetbuf *buf, netif *nif);
     static void __rx_end(netif *nif);
-    static int __poll_rx(netif *nif);
+    static int __poll_rx(netif *nif, int budget);
 
     int send_packet(packetbuf *buf);
 
     void rx_end();
-    int poll_rx();
+    int poll_rx(int budget);
 
     void process_packet(unsigned long paddr, unsigned long len);
 
@@ -6,7 +6,9 @@
 #include "virtio.hpp"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <onyx/acpi.h>
 #include <onyx/byteswap.h>
@@ -15,11 +17,14 @@
 #include <onyx/dev.h>
 #include <onyx/dma.h>
 #include <onyx/driver.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
 
 #include <pci/pci.h>
 
 #include "virtio_utils.hpp"
 #include <onyx/memory.hpp>
+#include <onyx/utility.hpp>
 
 namespace virtio
 {
@@ -189,7 +194,20 @@ bool vdev::create_virtqueue(unsigned int nr, unsigned int queue_size)
         virtqueue_list.set_nr_elems(nr + 1);
     }
 
-    virtqueue_list[nr] = make_unique<virtq_split>(this, queue_size, nr);
+    if (nr < vq_vectors.size())
+    {
+        write_config<uint16_t>(pci_common_cfg::queue_select, nr);
+        write_config<uint16_t>(pci_common_cfg::queue_msix_vector, nr);
+
+        /* The device reads back NO_VECTOR if it couldn't allocate resources for the vector */
+        if (read_config<uint16_t>(pci_common_cfg::queue_msix_vector) == VIRTIO_MSI_NO_VECTOR)
+            return false;
+    }
+
+    if (has_feature(device_features::ring_packed))
+        virtqueue_list[nr] = make_unique<virtq_packed>(this, queue_size, nr);
+    else
+        virtqueue_list[nr] = make_unique<virtq_split>(this, queue_size, nr);
 
     if (!virtqueue_list[nr])
         return false;
@@ -233,6 +251,10 @@ void vdev::set_failure()
     pci_common_cfg().write<uint8_t>(pci_common_cfg::device_status, st);
 }
 
+static const device_features ring_features[] = {device_features::ring_indirect_desc,
+                                                device_features::ring_event_idx,
+                                                device_features::ring_packed};
+
 bool vdev::do_device_independent_negotiation()
 {
     if (raw_has_feature(device_features::version_1))
@@ -245,33 +267,63 @@ bool vdev::do_device_independent_negotiation()
             return false;
     }
 
-    if (raw_has_feature(device_features::ring_indirect_desc))
+    /* Ring features are handled by the virtqueue code, for every driver */
+    for (auto feature : ring_features)
     {
-        signal_feature(device_features::ring_indirect_desc);
+        if (raw_has_feature(feature))
+            signal_feature(feature);
     }
 
     return true;
 }
 
-bool virtq_split::init()
+bool virtq::init_common()
 {
-    /* Described in section 2.6 - keep in mind that we align the
-     * previous virtq segment's size to the next segment's alignment(also described in 2.6)
-     */
-    size_t descriptor_table_length = ALIGN_TO(queue_size * sizeof(virtq_desc), 2);
-    size_t avail_ring_length = ALIGN_TO(queue_size * sizeof(uint16_t) + 4, 4);
-    size_t used_ring_length = queue_size * sizeof(virtq_used_elem) + sizeof(uint16_t) * 2;
-    size_t total_pages =
-        vm_size_to_pages(descriptor_table_length + avail_ring_length + used_ring_length);
+    event_idx = device->has_feature(device_features::ring_event_idx);
+    indirect = device->has_feature(device_features::ring_indirect_desc);
 
     desc_bitmap.set_size(queue_size);
     if (!desc_bitmap.allocate_bitmap())
         return false;
 
-    if (!completions.reserve(queue_size))
+    if (!completions.reserve(queue_size) || !indirect_tables.reserve(queue_size))
         return false;
 
     completions.set_nr_elems(queue_size);
+    indirect_tables.set_nr_elems(queue_size);
+
+    for (unsigned int i = 0; i < queue_size; i++)
+    {
+        completions[i] = nullptr;
+        indirect_tables[i] = nullptr;
+    }
+
+    return true;
+}
+
+virtq::~virtq()
+{
+    for (auto table : indirect_tables)
+    {
+        if (table)
+            free_page(table);
+    }
+}
+
+bool virtq_split::init()
+{
+    /* Described in section 2.6 - keep in mind that we align the
+     * previous virtq segment's size to the next segment's alignment(also described in 2.6).
+     * Both rings have an extra uint16_t at the end, for VIRTIO_F_EVENT_IDX.
+     */
+    size_t descriptor_table_length = ALIGN_TO(queue_size * sizeof(virtq_desc), 2);
+    size_t avail_ring_length = ALIGN_TO(queue_size * sizeof(uint16_t) + 6, 4);
+    size_t used_ring_length = queue_size * sizeof(virtq_used_elem) + sizeof(uint16_t) * 3;
+    size_t total_pages =
+        vm_size_to_pages(descriptor_table_length + avail_ring_length + used_ring_length);
+
+    if (!init_common())
+        return false;
 
     vq_pages = alloc_pages(total_pages, PAGE_ALLOC_CONTIGUOUS);
     if (!vq_pages)
@@ -315,14 +367,73 @@ bool virtq::has_available_descriptors(size_t nr) const
     return avail_descs >= nr;
 }
 
+static virtio_desc_info virtq_get_buf(size_t i, virtio_allocation_info &info)
+{
+    if (info.fill_function)
+        return info.fill_function(i, info);
+    return {info.vec[i], info.alloc_flags};
+}
+
+/**
+ * @brief Allocate and fill an indirect descriptor table for a buffer, if it's worth it.
+ * Tables are a page, and we can't allocate pages in IRQ context, so those buffers
+ * always go in the ring.
+ *
+ * @param info Allocation info
+ * @param irq_context True if we're in IRQ context
+ * @return The table, or nullptr if the buffer should go in the ring directly
+ */
+struct page *virtq::alloc_indirect_table(virtio_allocation_info &info, bool irq_context)
+{
+    if (!indirect || irq_context || info.nr_vecs < 2)
+        return nullptr;
+
+    /* The device can't deal with chains longer than the queue, indirect or not */
+    if (info.nr_vecs > cul::min(queue_size, (unsigned int) (PAGE_SIZE / sizeof(virtq_desc))))
+        return nullptr;
+
+    struct page *table = alloc_page(PAGE_ALLOC_NO_ZERO);
+    if (!table)
+        return nullptr;
+
+    virtq_desc *descs = (virtq_desc *) PAGE_TO_VIRT(table);
+
+    for (size_t i = 0; i < info.nr_vecs; i++)
+    {
+        auto dinfo = virtq_get_buf(i, info);
+        auto v = &dinfo.v;
+        bool has_next_desc = i + 1 != info.nr_vecs;
+
+        descs[i].paddr = (unsigned long) page_to_phys(v->page) + v->page_off;
+        descs[i].length = v->length;
+        descs[i].flags = (has_next_desc ? VIRTQ_DESC_F_NEXT : 0) |
+                         (dinfo.flags & VIRTIO_ALLOCATION_FLAG_WRITE ? VIRTQ_DESC_F_WRITE : 0);
+        descs[i].next = has_next_desc ? i + 1 : 0;
+    }
+
+    return table;
+}
+
+void virtq::free_indirect_table(unsigned int index)
+{
+    if (indirect_tables[index])
+    {
+        free_page(indirect_tables[index]);
+        indirect_tables[index] = nullptr;
+    }
+}
+
 void virtq::allocate_descriptors(virtio_allocation_info &info, bool irq_context)
 {
+    struct page *table = alloc_indirect_table(info, irq_context);
+
     // Ergh, using spin_lock_irqrestore here is tough since we need to coordinate with
     // wait_for_event_locked
     auto flags = irq_save_and_disable();
     spin_lock(&desc_alloc_lock);
 
-    auto nr_descs = info.nr_vecs;
+    /* An indirect table takes a single descriptor in the ring */
+    auto nr_descs = table ? 1 : info.nr_vecs;
 
     if (!irq_context)
     {
@@ -335,7 +446,10 @@ void virtq::allocate_descriptors(virtio_allocation_info &info, bool irq_context)
             cpu_relax();
     }
 
-    allocate_buffer_list(info);
+    allocate_buffer_list(info, table);
+
+    if (table)
+        stats.indirect++;
 
     spin_unlock(&desc_alloc_lock);
 
@@ -351,32 +465,37 @@ unsigned int virtq::alloc_descriptor_internal()
     return (unsigned int) desc;
 }
 
-void virtq_split::allocate_buffer_list(virtio_allocation_info &info)
+void virtq_split::allocate_buffer_list(virtio_allocation_info &info, struct page *table)
 {
     MUST_HOLD_LOCK(&desc_alloc_lock);
     uint16_t desc_head = 0;
     uint16_t seq = 0;
     uint16_t index = alloc_descriptor_internal();
-    auto vec = info.vec;
 
-    for (size_t i = 0; i < info.nr_vecs; i++, vec++)
+    if (table)
+    {
+        virtq_desc *desc = descs + index;
+        desc->paddr = (unsigned long) page_to_phys(table);
+        desc->length = info.nr_vecs * sizeof(virtq_desc);
+        desc->flags = VIRTQ_DESC_F_INDIRECT;
+        desc->next = 0;
+
+        indirect_tables[index] = table;
+        completions[index] = info.completion;
+        info.first_desc = index;
+        if (info.completion)
+            info.completion->descs_pending = info.nr_vecs;
+        return;
+    }
+
+    for (size_t i = 0; i < info.nr_vecs; i++)
     {
         if (seq++ == 0)
         {
             desc_head = index;
         }
 
-        virtio_desc_info dinfo;
-
-        if (info.fill_function)
-        {
-            dinfo = info.fill_function(i, info);
-        }
-        else
-        {
-            dinfo.v = *vec;
-            dinfo.flags = info.alloc_flags;
-        }
+        virtio_desc_info dinfo = virtq_get_buf(i, info);
 
         auto v = &dinfo.v;
 
@@ -411,6 +530,8 @@ void virtq_split::allocate_buffer_list(virtio_allocation_info &info)
 
 void virtq_split::put_buffer(const virtio_allocation_info &info, bool should_notify)
 {
+    scoped_lock<spinlock, true> g{ring_lock};
+
     write_memory_barrier();
 
     avail->ring[avail->idx % this->queue_size] = info.first_desc;
@@ -419,7 +540,7 @@ void virtq_split::put_buffer(const virtio_allocation_info &info, bool should_not
     write_memory_barrier();
 
     if (should_notify) [[likely]]
-        notify();
+        kick();
 }
 
 void virtq::resubmit_buffer(uint32_t desc, bool should_notify)
@@ -427,14 +548,50 @@ void virtq::resubmit_buffer(uint32_t desc, bool should_notify)
     virtio_allocation_info info;
     info.first_desc = desc;
 
+    requeued = true;
     put_buffer(info, should_notify);
 }
 
-void virtq_split::notify()
+void virtq::notify()
 {
+    scoped_lock<spinlock, true> g{ring_lock};
+    kick();
+}
+
+void virtq::write_notify()
+{
+    stats.kicks++;
     device->notify_cfg().write<uint32_t>(eff_queue_notify_off, nr);
 }
 
+void virtq_split::kick()
+{
+    MUST_HOLD_LOCK(&ring_lock);
+    uint16_t new_idx = avail->idx;
+    uint16_t old_idx = kicked_avail_idx;
+    bool needed;
+
+    kicked_avail_idx = new_idx;
+
+    /* The device needs to see the new avail idx before we look at whether it wants a
+     * notification. Otherwise it may go to sleep after we read a stale avail_event.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (event_idx)
+        needed = vring_need_event(read_once(*avail_event()), new_idx, old_idx);
+    else
+        needed = !(read_once(used->flags) & VIRTQ_USED_F_NO_NOTIFY);
+
+    if (!needed)
+    {
+        stats.kicks_suppressed++;
+        return;
+    }
+
+    write_notify();
+}
+
 cul::pair<unsigned long, size_t> virtq_split::get_buf_from_id(uint16_t id) const
 {
     assert(id < queue_size);
@@ -444,6 +601,9 @@ cul::pair<unsigned long, size_t> virtq_split::get_buf_from_id(uint16_t id) const
 void virtq_split::free_chain(uint32_t id)
 {
     size_t processed = 0;
+
+    free_indirect_table(id);
+
     while (true)
     {
         processed++;
@@ -464,40 +624,420 @@ void virtq_split::free_chain(uint32_t id)
         wait_queue_wake_all(&desc_alloc_wq);
 }
 
-void virtq_split::handle_irq()
+void virtq::complete_buffer(const virtq_used_elem &elem)
 {
-    while (used->idx != last_seen_used_idx)
-    {
-        auto &elem = used->ring[last_seen_used_idx % this->queue_size];
+    stats.used++;
+    device->handle_used_buffer(elem, this);
+
+    scoped_lock<spinlock, true> g{desc_alloc_lock};
+    reset_completion(elem.id);
 
-        device->handle_used_buffer(elem, this);
+    /* Resubmitted buffers stay in the ring */
+    if (!requeued)
+        free_chain(elem.id);
+    requeued = false;
+}
+
+bool virtq_split::has_used_buffers() const
+{
+    return read_once(used->idx) != last_seen_used_idx;
+}
+
+unsigned int virtq_split::handle_irq(unsigned int budget)
+{
+    unsigned int done = 0;
+
+    while (done < budget)
+    {
+        if (!has_used_buffers())
         {
-            scoped_lock<spinlock, true> g{desc_alloc_lock};
-            reset_completion(elem.id);
-            free_chain(elem.id);
+            if (!event_idx || !irqs_enabled)
+                break;
+
+            /* Ask for an interrupt on the next used buffer, and recheck, as the device may have
+             * used some in the meanwhile and not interrupted us.
+             */
+            __atomic_store_n(used_event(), last_seen_used_idx, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            if (!has_used_buffers())
+                break;
         }
 
+        read_memory_barrier();
+
+        auto &elem = used->ring[last_seen_used_idx % this->queue_size];
+
+        complete_buffer(elem);
+
         last_seen_used_idx++;
+        done++;
     }
+
+    return done;
 }
 
 void virtq_split::disable_interrupts()
 {
-    avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    irqs_enabled = false;
+
+    /* The device ignores the flag with VIRTIO_F_EVENT_IDX. Point used_event right behind us,
+     * so it's only crossed after the used ring wraps around.
+     */
+    if (event_idx)
+        __atomic_store_n(used_event(), (uint16_t) (last_seen_used_idx - 1), __ATOMIC_RELAXED);
+    else
+        avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+bool virtq_split::enable_interrupts()
+{
+    irqs_enabled = true;
+
+    if (event_idx)
+        __atomic_store_n(used_event(), last_seen_used_idx, __ATOMIC_RELAXED);
+    else
+        avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return has_used_buffers();
 }
 
-void virtq_split::enable_interrupts()
+bool virtq_packed::init()
 {
-    avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    /* Described in section 2.8. The descriptor ring is 16-byte aligned, and both event
+     * suppression structures are 4-byte aligned.
+     */
+    size_t ring_length = queue_size * sizeof(virtq_packed_desc);
+    size_t total_pages = vm_size_to_pages(ring_length + 2 * sizeof(virtq_packed_event));
+
+    if (!init_common())
+        return false;
+
+    if (!state.reserve(queue_size))
+        return false;
+    state.set_nr_elems(queue_size);
+
+    /* Descriptors need to start zeroed, as the device looks at their flags */
+    vq_pages = alloc_pages(total_pages, PAGE_ALLOC_CONTIGUOUS);
+    if (!vq_pages)
+        return false;
+
+    unsigned long vq_pages_phys = reinterpret_cast<unsigned long>(page_to_phys(vq_pages));
+
+    auto _ring = vq_pages_phys;
+    auto _driver = vq_pages_phys + ring_length;
+    auto _device = _driver + sizeof(virtq_packed_event);
+
+    device->write_config<uint16_t>(pci_common_cfg::queue_select, nr);
+    device->write_config<uint16_t>(pci_common_cfg::queue_size, queue_size);
+    device->write_config<uint32_t>(pci_common_cfg::queue_desc_low, static_cast<uint32_t>(_ring));
+    device->write_config<uint32_t>(pci_common_cfg::queue_desc_high,
+                                   static_cast<uint32_t>(_ring << 32));
+    device->write_config<uint32_t>(pci_common_cfg::queue_device_high,
+                                   static_cast<uint32_t>(_device << 32));
+    device->write_config<uint32_t>(pci_common_cfg::queue_device_low,
+                                   static_cast<uint32_t>(_device));
+    device->write_config<uint32_t>(pci_common_cfg::queue_driver_high,
+                                   static_cast<uint32_t>(_driver << 32));
+    device->write_config<uint32_t>(pci_common_cfg::queue_driver_low,
+                                   static_cast<uint32_t>(_driver));
+
+    eff_queue_notify_off = device->notify_cfg().notify_off_mult *
+                           device->read_config<uint16_t>(pci_common_cfg::queue_notify_off);
+
+    device->write_config<uint16_t>(pci_common_cfg::queue_enable, 1);
+
+    ring = reinterpret_cast<virtq_packed_desc *>(PHYS_TO_VIRT(_ring));
+    driver_event = reinterpret_cast<virtq_packed_event *>(PHYS_TO_VIRT(_driver));
+    device_event = reinterpret_cast<virtq_packed_event *>(PHYS_TO_VIRT(_device));
+
+    return true;
+}
+
+void virtq_packed::allocate_buffer_list(virtio_allocation_info &info, struct page *table)
+{
+    MUST_HOLD_LOCK(&desc_alloc_lock);
+    unsigned long id;
+    assert(desc_bitmap.find_free_bit(&id) == true);
+
+    /* Buffers only get ring descriptors when they're put in the ring, in put_buffer.
+     * Here we just reserve them, and pick a buffer id.
+     */
+    auto &st = state[id];
+    st.num = table ? 1 : info.nr_vecs;
+    avail_descs -= st.num;
+
+    if (table)
+    {
+        st.paddr = (unsigned long) page_to_phys(table);
+        st.length = info.nr_vecs * sizeof(virtq_desc);
+        st.flags = VIRTQ_DESC_F_INDIRECT;
+        indirect_tables[id] = table;
+    }
+    else
+    {
+        auto dinfo = virtq_get_buf(0, info);
+        st.paddr = (unsigned long) page_to_phys(dinfo.v.page) + dinfo.v.page_off;
+        st.length = dinfo.v.length;
+        st.flags = dinfo.flags & VIRTIO_ALLOCATION_FLAG_WRITE ? VIRTQ_DESC_F_WRITE : 0;
+    }
+
+    completions[id] = info.completion;
+    info.first_desc = id;
+    if (info.completion)
+        info.completion->descs_pending = info.nr_vecs;
+}
+
+void virtq_packed::put_buffer(const virtio_allocation_info &info, bool should_notify)
+{
+    scoped_lock<spinlock, true> g{ring_lock};
+    const uint16_t id = info.first_desc;
+    const auto &st = state[id];
+    const uint16_t head = next_avail;
+    uint16_t head_flags = 0;
+
+    /* Resubmitted and indirect buffers take a single descriptor, which we have in st. Otherwise,
+     * this is the same info that was passed to allocate_descriptors.
+     */
+    assert(st.num == 1 || info.nr_vecs == st.num);
+
+    for (uint16_t i = 0; i < st.num; i++)
+    {
+        auto desc = &ring[next_avail];
+        uint16_t flags;
+
+        if (i == 0)
+        {
+            desc->paddr = st.paddr;
+            desc->length = st.length;
+            flags = st.flags;
+        }
+        else
+        {
+            /* const_cast: fill functions take a mutable context, but don't change it */
+            auto dinfo = virtq_get_buf(i, const_cast<virtio_allocation_info &>(info));
+            desc->paddr = (unsigned long) page_to_phys(dinfo.v.page) + dinfo.v.page_off;
+            desc->length = dinfo.v.length;
+            flags = dinfo.flags & VIRTIO_ALLOCATION_FLAG_WRITE ? VIRTQ_DESC_F_WRITE : 0;
+        }
+
+        desc->id = id;
+
+        if (i + 1 != st.num)
+            flags |= VIRTQ_DESC_F_NEXT;
+        /* A chain can wrap around the ring, so descriptors past the wrap get the new lap's bits */
+        flags |= avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+
+        /* The head gets made available last, after the rest of the chain is visible */
+        if (i == 0)
+            head_flags = flags;
+        else
+            desc->flags = flags;
+
+        if (++next_avail == queue_size)
+        {
+            next_avail = 0;
+            avail_wrap = !avail_wrap;
+        }
+    }
+
+    __atomic_store_n(&ring[head].flags, head_flags, __ATOMIC_RELEASE);
+    num_added += st.num;
+
+    if (should_notify) [[likely]]
+        kick();
+}
+
+void virtq_packed::kick()
+{
+    MUST_HOLD_LOCK(&ring_lock);
+    const uint16_t new_idx = next_avail;
+    const uint16_t old_idx = new_idx - num_added;
+    bool needed;
+
+    num_added = 0;
+
+    /* See virtq_split::kick() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    const uint16_t off_wrap = read_once(device_event->off_wrap);
+    const uint16_t flags = read_once(device_event->flags);
+
+    if (flags == VIRTQ_PACKED_EVENT_F_DESC)
+    {
+        uint16_t event = off_wrap & ~(1 << VIRTQ_PACKED_EVENT_WRAP_SHIFT);
+
+        /* The event is in the previous lap around the ring, adjust it so it's comparable */
+        if ((bool) (off_wrap >> VIRTQ_PACKED_EVENT_WRAP_SHIFT) != avail_wrap)
+            event -= queue_size;
+
+        needed = vring_need_event(event, new_idx, old_idx);
+    }
+    else
+        needed = flags != VIRTQ_PACKED_EVENT_F_DISABLE;
+
+    if (!needed)
+    {
+        stats.kicks_suppressed++;
+        return;
+    }
+
+    write_notify();
+}
+
+cul::pair<unsigned long, size_t> virtq_packed::get_buf_from_id(uint16_t id) const
+{
+    assert(id < queue_size);
+    return {state[id].paddr, state[id].length};
+}
+
+void virtq_packed::free_chain(uint32_t id)
+{
+    const uint16_t num = state[id].num;
+
+    free_indirect_table(id);
+    desc_bitmap.free_bit(id);
+    avail_descs += num;
+
+    if (num == 1)
+        wait_queue_wake(&desc_alloc_wq);
+    else
+        wait_queue_wake_all(&desc_alloc_wq);
+}
+
+bool virtq_packed::has_used_buffers() const
+{
+    const uint16_t flags = __atomic_load_n(&ring[next_used].flags, __ATOMIC_ACQUIRE);
+    const bool avail = flags & VIRTQ_DESC_F_AVAIL;
+    const bool used = flags & VIRTQ_DESC_F_USED;
+
+    return avail == used && used == used_wrap;
+}
+
+void virtq_packed::set_used_event()
+{
+    driver_event->off_wrap = next_used | (used_wrap << VIRTQ_PACKED_EVENT_WRAP_SHIFT);
+    write_memory_barrier();
+    driver_event->flags = VIRTQ_PACKED_EVENT_F_DESC;
+}
+
+unsigned int virtq_packed::handle_irq(unsigned int budget)
+{
+    unsigned int done = 0;
+
+    while (done < budget)
+    {
+        if (!has_used_buffers())
+        {
+            if (!event_idx || !irqs_enabled)
+                break;
+
+            /* See virtq_split::handle_irq() */
+            set_used_event();
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            if (!has_used_buffers())
+                break;
+        }
+
+        const auto desc = &ring[next_used];
+        const virtq_used_elem elem{desc->id, desc->length};
+
+        /* The device skips over the whole chain, so do we */
+        next_used += state[elem.id].num;
+        if (next_used >= queue_size)
+        {
+            next_used -= queue_size;
+            used_wrap = !used_wrap;
+        }
+
+        complete_buffer(elem);
+        done++;
+    }
+
+    return done;
+}
+
+void virtq_packed::disable_interrupts()
+{
+    irqs_enabled = false;
+    driver_event->flags = VIRTQ_PACKED_EVENT_F_DISABLE;
+}
+
+bool virtq_packed::enable_interrupts()
+{
+    irqs_enabled = true;
+
+    if (event_idx)
+        set_used_event();
+    else
+        driver_event->flags = VIRTQ_PACKED_EVENT_F_ENABLE;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return has_used_buffers();
+}
+
+void vdev::handle_queue_irq(unsigned int nr)
+{
+    auto &vq = virtqueue_list[nr];
+
+    /* Skip queues that have nothing for us, as the interrupt may be shared */
+    if (!vq || !vq->has_used_buffers())
+        return;
+
+    vq->account_irq();
+
+    if (driver_handle_vq_irq(nr) == handle_vq_irq_result::HANDLE)
+        vq->handle_irq(UINT_MAX);
 }
 
 void vdev::handle_vq_irq()
 {
-    for (auto &c : virtqueue_list)
+    for (unsigned int i = 0; i < virtqueue_list.size(); i++)
+        handle_queue_irq(i);
+}
+
+static irqstatus_t virtio_handle_vq_msix(struct irq_context *context, void *cookie)
+{
+    auto vec = (virtq_vector *) cookie;
+
+    /* Queues can't be created or destroyed with their vector live, so this is safe */
+    vec->dev->handle_queue_irq(vec->nr);
+    return IRQ_HANDLED;
+}
+
+bool vdev::setup_queue_vectors(unsigned int nr_vqs)
+{
+    cul::vector<void *> cookies;
+    cul::vector<unsigned int> cpus;
+    const unsigned int nr_cpus = get_nr_cpus();
+
+    if (!vq_vectors.resize(nr_vqs) || !cookies.resize(nr_vqs) || !cpus.resize(nr_vqs))
     {
-        if (driver_handle_vq_irq(c->get_nr()) == handle_vq_irq_result::HANDLE)
-            c->handle_irq();
+        vq_vectors.clear();
+        return false;
     }
+
+    for (unsigned int i = 0; i < nr_vqs; i++)
+    {
+        vq_vectors[i] = {this, i};
+        cookies[i] = &vq_vectors[i];
+        cpus[i] = i % nr_cpus;
+    }
+
+    /* We don't use config change interrupts */
+    write_config<uint16_t>(pci_common_cfg::msix_config, VIRTIO_MSI_NO_VECTOR);
+
+    if (dev->enable_msix(nr_vqs, virtio_handle_vq_msix, cookies.get_buf(), cpus.get_buf()) < 0)
+    {
+        vq_vectors.clear();
+        return false;
+    }
+
+    return true;
 }
 
 static bool our_irq(uint32_t status)
@@ -527,6 +1067,86 @@ irqstatus_t vdev::handle_irq()
     return IRQ_HANDLED;
 }
 
+size_t vdev::print_queue_stats(char *buf, size_t len)
+{
+    auto addr = dev->addr();
+    size_t printed = 0;
+
+    for (auto &vq : virtqueue_list)
+    {
+        if (!vq)
+            continue;
+
+        const auto &st = vq->get_stats();
+        printed += snprintf(buf + printed, printed < len ? len - printed : 0,
+                            "%04x:%02x:%02x.%x %u %s %lu %lu %lu %lu %lu\n", addr.segment,
+                            addr.bus, addr.device, addr.function, vq->get_nr(),
+                            has_feature(device_features::ring_packed) ? "packed" : "split",
+                            st.kicks, st.kicks_suppressed, st.irqs, st.used, st.indirect);
+    }
+
+    return printed;
+}
+
+static DEFINE_LIST(vdev_list);
+static spinlock vdev_list_lock;
+
+static void add_vdev(vdev *dev)
+{
+    scoped_lock g{vdev_list_lock};
+    list_add_tail(&dev->vdev_list_node, &vdev_list);
+}
+
+static ssize_t virtio_queues_read(void *buffer, size_t size, off_t off)
+{
+    const size_t buflen = PAGE_SIZE;
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len =
+        snprintf(buf, buflen, "device queue ring kicks kicks_suppressed irqs used indirect\n");
+
+    {
+        scoped_lock g{vdev_list_lock};
+        list_for_every (&vdev_list)
+        {
+            if (len >= buflen)
+                break;
+            vdev *dev = container_of(l, vdev, vdev_list_node);
+            len += dev->print_queue_stats(buf + len, buflen - len);
+        }
+    }
+
+    if (len >= buflen)
+        len = buflen - 1;
+
+    ssize_t st = 0;
+    if ((size_t) off < len)
+    {
+        size_t to_copy = cul::min(len - off, size);
+        st = copy_to_user(buffer, buf + off, to_copy) < 0 ? -EFAULT : (ssize_t) to_copy;
+    }
+
+    free(buf);
+    return st;
+}
+
+static struct sysfs_object virtio_obj;
+static struct sysfs_object virtio_queues_file;
+
+static void virtio_sysfs_init()
+{
+    assert(sysfs_object_init("virtio", &virtio_obj) == 0);
+    virtio_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("queues", &virtio_queues_file, &virtio_obj) == 0);
+    virtio_queues_file.read = virtio_queues_read;
+    virtio_queues_file.perms = 0444 | S_IFREG;
+
+    sysfs_add(&virtio_obj, nullptr);
+}
+
 } // namespace virtio
 
 struct pci::pci_id virtio_pci_ids[] = {{PCI_ID_DEVICE(VIRTIO_VENDOR_ID, PCI_ANY_ID, NULL)},
@@ -588,6 +1208,7 @@ int virtio_probe(struct device *_dev)
     virtio_device->perform_base_virtio_initialization();
     virtio_device->perform_subsystem_initialization();
 
+    virtio::add_vdev(virtio_device.get_data());
     virtio_device.release();
 
     return 0;
@@ -600,6 +1221,7 @@ struct driver virtio_driver = {.name = "virtio",
 
 extern "C" int virtio_init(void)
 {
+    virtio::virtio_sysfs_init();
     pci::register_driver(&virtio_driver);
     return 0;
 }
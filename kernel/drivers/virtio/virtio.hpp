@@ -14,6 +14,7 @@
 #include <onyx/bitmap.h>
 #include <onyx/condvar.h>
 #include <onyx/irq.h>
+#include <onyx/list.h>
 #include <onyx/net/netif.h>
 #include <onyx/packetbuf.h>
 #include <onyx/port_io.h>
@@ -77,6 +78,8 @@ struct virtq_avail
     /* At the end there's a uint16_t used_event if VIRTIO_F_EVENT_IDX */
 };
 
+#define VIRTQ_USED_F_NO_NOTIFY (1 << 0)
+
 struct virtq_used_elem
 {
     /* uint32_t is used here for padding purposes - the value is actually 16-bit */
@@ -89,10 +92,54 @@ struct virtq_used
     uint16_t flags;
     uint16_t idx;
     struct virtq_used_elem ring[];
+    /* At the end there's a uint16_t avail_event if VIRTIO_F_EVENT_IDX */
+};
+
+/* Packed virtqueues (section 2.8) */
+
+/* Descriptor flags that mark a descriptor as available/used, relative to the wrap counters */
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED  (1 << 15)
+
+struct virtq_packed_desc
+{
+    uint64_t paddr;
+    uint32_t length;
+    /* Buffer id */
+    uint16_t id;
+    uint16_t flags;
+};
+
+#define VIRTQ_PACKED_EVENT_F_ENABLE  0x0
+#define VIRTQ_PACKED_EVENT_F_DISABLE 0x1
+/* Only notify when off_wrap is reached. Needs VIRTIO_F_EVENT_IDX */
+#define VIRTQ_PACKED_EVENT_F_DESC    0x2
+
+#define VIRTQ_PACKED_EVENT_WRAP_SHIFT 15
+
+struct virtq_packed_event
+{
+    uint16_t off_wrap;
+    uint16_t flags;
 };
 
 #pragma GCC diagnostic pop
 
+/**
+ * @brief Check if the other side needs to be notified, for VIRTIO_F_EVENT_IDX.
+ * The other side asked to be notified once event_idx is crossed, and we moved the index from old
+ * to new_idx.
+ *
+ * @param event_idx Index the other side wants to be notified at
+ * @param new_idx New index
+ * @param old Index when we last notified (or decided not to)
+ * @return True if a notification is needed
+ */
+static inline bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old)
+{
+    return (uint16_t) (new_idx - event_idx - 1) < (uint16_t) (new_idx - old);
+}
+
 class vdev;
 class virtq;
 
@@ -156,57 +203,127 @@ struct virtio_allocation_info
     }
 };
 
+/* Per-queue counters, see /sys/virtio/queues */
+struct virtq_stats
+{
+    /* Notifications sent to the device */
+    unsigned long kicks;
+    /* Notifications the device told us it didn't need */
+    unsigned long kicks_suppressed;
+    /* Interrupts that found used buffers in this queue */
+    unsigned long irqs;
+    /* Used buffers processed */
+    unsigned long used;
+    /* Buffers submitted through an indirect descriptor table */
+    unsigned long indirect;
+};
+
 class virtq
 {
 protected:
     vdev *device;
     unsigned int nr;
-    /* Descriptor bitmap */
+    unsigned int queue_size;
+    /* Descriptor bitmap (buffer ids, for packed queues) */
     Bitmap<0, false> desc_bitmap;
     cul::vector<virtio_completion *> completions;
+    /* Indirect descriptor tables, indexed like completions */
+    cul::vector<struct page *> indirect_tables;
     /* Number of available descriptors - can only be touched when desc_alloc_lock is held */
     size_t avail_descs;
     /* Descriptor allocation lock */
     spinlock desc_alloc_lock;
     wait_queue desc_alloc_wq;
+    /* Protects the driver side of the ring and the notification state */
+    spinlock ring_lock;
+    /* Note: this has been calculated from queue_mult * queue_notify_off */
+    unsigned long eff_queue_notify_off;
+    /* VIRTIO_F_EVENT_IDX and VIRTIO_F_INDIRECT_DESC were negotiated */
+    bool event_idx;
+    bool indirect;
+    bool irqs_enabled;
+    /* Set by resubmit_buffer, so handle_irq doesn't free the buffer */
+    bool requeued;
+    virtq_stats stats;
 
     bool has_available_descriptors(size_t nr) const;
     unsigned int alloc_descriptor_internal();
+    bool init_common();
+    struct page *alloc_indirect_table(virtio_allocation_info &info, bool irq_context);
+    void free_indirect_table(unsigned int index);
+    void complete_buffer(const virtq_used_elem &elem);
+
+    /**
+     * @brief Frees a buffer's descriptors after the device is done with it.
+     * Runs with desc_alloc_lock held.
+     *
+     * @param id Buffer id (the head descriptor, for split queues)
+     */
+    virtual void free_chain(uint32_t id) = 0;
 
 public:
     void allocate_descriptors(virtio_allocation_info &info, bool irq_context);
 
-    virtual unsigned int get_queue_size() = 0;
-    virtq(vdev *dev, unsigned int nr)
-        : device{dev}, nr{nr}, desc_bitmap{}, avail_descs(), desc_alloc_lock{}
+    unsigned int get_queue_size() const
     {
-        spinlock_init(&desc_alloc_lock);
-        init_wait_queue_head(&desc_alloc_wq);
+        return queue_size;
     }
 
-    virtual ~virtq()
+    virtq(vdev *dev, unsigned int nr, unsigned int qsize)
+        : device{dev}, nr{nr}, queue_size{qsize}, desc_bitmap{}, avail_descs(qsize),
+          desc_alloc_lock{}, ring_lock{}, eff_queue_notify_off{}, event_idx{}, indirect{},
+          irqs_enabled{true}, requeued{}, stats{}
     {
+        spinlock_init(&desc_alloc_lock);
+        spinlock_init(&ring_lock);
+        init_wait_queue_head(&desc_alloc_wq);
     }
+
+    virtual ~virtq();
     virtual bool init() = 0;
 
     /**
      * @brief Allocates buffers in the queue and sets up the linked list
-     * Note: This function runs with desc_alloc_lock held and with avail_descs >= nr_descs.
+     * Note: This function runs with desc_alloc_lock held and with enough available descriptors.
      *
      * @param info Allocation info [in and out parameter]
+     * @param table Indirect descriptor table, already filled in, or nullptr
+     */
+    virtual void allocate_buffer_list(virtio_allocation_info &info, struct page *table) = 0;
+
+    /**
+     * @brief Notify the device of new available buffers, if it wants to be notified
      */
-    virtual void allocate_buffer_list(virtio_allocation_info &info) = 0;
-    virtual void notify() = 0;
-    virtual void handle_irq() = 0;
+    void notify();
+
+    /**
+     * @brief Process used buffers
+     *
+     * @param budget Maximum number of used buffers to process. Any buffers past that are left in
+     * the ring, for the next call.
+     * @return Number of used buffers processed
+     */
+    virtual unsigned int handle_irq(unsigned int budget) = 0;
     unsigned int get_nr() const
     {
         return nr;
     }
     virtual cul::pair<unsigned long, size_t> get_buf_from_id(uint16_t id) const = 0;
     virtual void disable_interrupts() = 0;
-    virtual void enable_interrupts() = 0;
+
+    /**
+     * @brief Re-enables used buffer interrupts
+     *
+     * @return True if there are used buffers pending, that may have been missed
+     */
+    virtual bool enable_interrupts() = 0;
     virtual void put_buffer(const virtio_allocation_info &info, bool notify) = 0;
 
+    /**
+     * @brief Check if the device has used buffers we haven't processed yet
+     */
+    virtual bool has_used_buffers() const = 0;
+
     /**
      * @brief Get the completion object
      *
@@ -225,41 +342,69 @@ public:
 
     /**
      * @brief Resubmits an already-set up buffer to the available queue
+     * Can only be called from handle_used_buffer, for the buffer being handled.
      *
      * @param desc Descriptor head
      */
     void resubmit_buffer(uint32_t desc, bool should_notify);
+
+    void account_irq()
+    {
+        stats.irqs++;
+    }
+
+    const virtq_stats &get_stats() const
+    {
+        return stats;
+    }
+
+protected:
+    /**
+     * @brief Notify the device, if it wants to be notified.
+     * Runs with ring_lock held.
+     */
+    virtual void kick() = 0;
+    void write_notify();
 };
 
 class virtq_split : public virtq
 {
 private:
     struct page *vq_pages;
-    unsigned int queue_size;
     /* Descriptor area */
     struct virtq_desc *descs;
     /* Driver area */
     struct virtq_avail *avail;
     /* Device area */
     struct virtq_used *used;
-    /* Note: this has been calculated from queue_mult * queue_notify_off */
-    unsigned long eff_queue_notify_off;
     /* The driver keeps track of the last used_idx in order to track progress for used buffers */
-    unsigned int last_seen_used_idx;
+    uint16_t last_seen_used_idx;
+    /* avail->idx the last time we decided whether to kick */
+    uint16_t kicked_avail_idx;
 
-    void free_chain(uint32_t id);
+    void free_chain(uint32_t id) override;
+    void kick() override;
 
     virtq_desc *get_desc(uint32_t id)
     {
         return descs + id;
     }
 
+    uint16_t *used_event() const
+    {
+        return &avail->ring[queue_size];
+    }
+
+    uint16_t *avail_event() const
+    {
+        return reinterpret_cast<uint16_t *>(&used->ring[queue_size]);
+    }
+
 public:
     virtq_split(vdev *dev, unsigned int qsize, unsigned int nr)
-        : virtq{dev, nr}, vq_pages{nullptr}, queue_size{qsize}, descs{nullptr}, avail{nullptr},
-          used{nullptr}, eff_queue_notify_off{0}, last_seen_used_idx{0}
+        : virtq{dev, nr, qsize}, vq_pages{nullptr}, descs{nullptr}, avail{nullptr}, used{nullptr},
+          last_seen_used_idx{0}, kicked_avail_idx{0}
     {
-        avail_descs = queue_size;
     }
 
     ~virtq_split()
@@ -269,21 +414,75 @@ public:
     bool init() override;
     void put_buffer(const virtio_allocation_info &info, bool notify) override;
 
-    unsigned int get_queue_size() override
+    void allocate_buffer_list(virtio_allocation_info &info, struct page *table) override;
+
+    unsigned int handle_irq(unsigned int budget) override;
+
+    cul::pair<unsigned long, size_t> get_buf_from_id(uint16_t id) const override;
+
+    void disable_interrupts() override;
+    bool enable_interrupts() override;
+    bool has_used_buffers() const override;
+};
+
+class virtq_packed : public virtq
+{
+private:
+    /* What we need to remember about each buffer id */
+    struct buf_state
+    {
+        /* Head descriptor, kept around for get_buf_from_id and resubmit_buffer */
+        uint64_t paddr;
+        uint32_t length;
+        uint16_t flags;
+        /* Number of ring descriptors the buffer takes up */
+        uint16_t num;
+    };
+
+    struct page *vq_pages;
+    struct virtq_packed_desc *ring;
+    /* Driver area - our used buffer notification suppression */
+    struct virtq_packed_event *driver_event;
+    /* Device area - the device's notification suppression */
+    struct virtq_packed_event *device_event;
+    cul::vector<buf_state> state;
+    /* Next descriptor we'll make available, and the avail wrap counter */
+    uint16_t next_avail;
+    bool avail_wrap;
+    /* Next descriptor we expect to be used, and the used wrap counter */
+    uint16_t next_used;
+    bool used_wrap;
+    /* Descriptors made available since the last kick decision */
+    uint16_t num_added;
+
+    void free_chain(uint32_t id) override;
+    void kick() override;
+    void set_used_event();
+
+public:
+    virtq_packed(vdev *dev, unsigned int qsize, unsigned int nr)
+        : virtq{dev, nr, qsize}, vq_pages{nullptr}, ring{nullptr}, driver_event{nullptr},
+          device_event{nullptr}, next_avail{0}, avail_wrap{true},
+          next_used{0}, used_wrap{true}, num_added{0}
     {
-        return queue_size;
     }
 
-    void allocate_buffer_list(virtio_allocation_info &info) override;
+    ~virtq_packed()
+    {
+    }
+
+    bool init() override;
+    void put_buffer(const virtio_allocation_info &info, bool notify) override;
 
-    void notify() override;
+    void allocate_buffer_list(virtio_allocation_info &info, struct page *table) override;
 
-    void handle_irq() override;
+    unsigned int handle_irq(unsigned int budget) override;
 
     cul::pair<unsigned long, size_t> get_buf_from_id(uint16_t id) const override;
 
     void disable_interrupts() override;
-    void enable_interrupts() override;
+    bool enable_interrupts() override;
+    bool has_used_buffers() const override;
 };
 
 class virtio_structure
@@ -373,6 +572,13 @@ enum class handle_vq_irq_result
     DELAY
 };
 
+/* Cookie for a virtqueue's MSI-X vector */
+struct virtq_vector
+{
+    vdev *dev;
+    unsigned int nr;
+};
+
 /* TODO: Hide pci::pci_device (since it may or may not be a pci::pci_device) with a virtual class */
 class vdev
 {
@@ -381,6 +587,8 @@ protected:
     void *bars[PCI_NR_BARS];
     virtio_structure structures[5];
     cul::vector<unique_ptr<virtq>> virtqueue_list;
+    /* MSI-X vectors, one per virtqueue, if set up by setup_queue_vectors() */
+    cul::vector<virtq_vector> vq_vectors;
 
     virtual bool supports_legacy()
     {
@@ -393,12 +601,6 @@ protected:
 
     void cache_features();
 
-    bool has_feature(unsigned long feature) const
-    {
-        assert(feature < 64);
-        return feature_cache[0] & (1UL << feature);
-    }
-
     static constexpr unsigned long feature_to_bit(unsigned long feature)
     {
         return 1UL << feature;
@@ -410,7 +612,10 @@ protected:
     }
 
 public:
-    vdev(pci::pci_device *dev) : dev(dev), bars{}, structures{}, feature_cache{}
+    /* Node in the list of virtio devices, for /sys/virtio */
+    struct list_head vdev_list_node;
+
+    vdev(pci::pci_device *dev) : dev(dev), bars{}, structures{}, feature_cache{}, vdev_list_node{}
     {
     }
     virtual ~vdev()
@@ -468,6 +673,13 @@ public:
 
     bool raw_has_feature(unsigned long feature);
 
+    /* Check if a feature was negotiated */
+    bool has_feature(unsigned long feature) const
+    {
+        assert(feature < 64);
+        return feature_cache[0] & (1UL << feature);
+    }
+
     /* To be used by drivers to negotiate features */
     void signal_feature(unsigned long feature);
 
@@ -488,6 +700,22 @@ public:
 
     void handle_vq_irq();
 
+    /**
+     * @brief Handle a virtqueue's interrupt
+     *
+     * @param nr Virtqueue number
+     */
+    void handle_queue_irq(unsigned int nr);
+
+    /**
+     * @brief Give each virtqueue its own MSI-X vector. Virtqueue i's vector gets routed to cpu i
+     * (modulo the number of cpus). Must be called before creating the virtqueues.
+     *
+     * @param nr_vqs Number of virtqueues
+     * @return True on success, false if the device keeps using the shared interrupt
+     */
+    bool setup_queue_vectors(unsigned int nr_vqs);
+
     virtual void handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
     {
     }
@@ -501,6 +729,15 @@ public:
     {
         return virtqueue_list[nr];
     }
+
+    /**
+     * @brief Print this device's queue counters, one queue per line
+     *
+     * @param buf Buffer
+     * @param len Length of the buffer
+     * @return Number of characters printed (snprintf-style)
+     */
+    size_t print_queue_stats(char *buf, size_t len);
 };
 
 enum device_status : uint8_t
@@ -71,6 +71,9 @@ enum isr_cfg
 #define VIRTIO_ISR_CFG_QUEUE_INTERRUPT (1 << 0)
 #define VIRTIO_ISR_CFG_DEVICE_CFG_INT  (1 << 1)
 
+/* Written to msix_config/queue_msix_vector for "no MSI-X vector", or read back on failure */
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
 constexpr size_t notify_off_multiplier = length_off + 4;
 
 }; // namespace virtio
@@ -55,6 +55,33 @@
 #define ATAPI_CMD_READ          0xA8
 #define ATAPI_CMD_EJECT         0x1B
 #define ATA_CMD_EXEC_DRIVE_DIAG 0x90
+#define ATA_CMD_READ_LOG_EXT    0x2F
+
+#define ATA_CMD_DSM             0x06
+
+/* Native Command Queuing */
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+/* NCQ command error log, read with READ LOG EXT after an NCQ command fails */
+#define ATA_LOG_NCQ_ERROR     0x10
+#define ATA_LOG_NCQ_ERROR_NQ  (1 << 7) // The failed command wasn't a queued command
+#define ATA_LOG_NCQ_ERROR_TAG 0x1f
+
+/* IDENTIFY word 76 (sata_capabilities) */
+#define ATA_SATA_CAP_NCQ (1 << 8)
+/* IDENTIFY word 75 (queue_depth) */
+#define ATA_QUEUE_DEPTH(word) (((word) & 0x1f) + 1)
+
+/* DATA SET MANAGEMENT takes the TRIM bit in the features register, and a list of range entries
+ * (48-bit LBA, 16-bit sector count), in 512 byte blocks, as its data.
+ */
+#define ATA_DSM_TRIM                 (1 << 0)
+#define ATA_TRIM_ENTRIES_PER_BLOCK   64
+#define ATA_TRIM_RANGE_MAX_SECTORS   0xffffUL
+#define ATA_TRIM_ENTRY(lba, sectors) ((lba) | ((uint64_t) (sectors) << 48))
+/* IDENTIFY word 169 (data_management_support) */
+#define ATA_DATA_MGMT_TRIM (1 << 0)
 
 #define ATA_TYPE_ATA   1
 #define ATA_TYPE_ATAPI 2
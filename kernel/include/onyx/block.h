@@ -13,11 +13,14 @@
 #include <stdlib.h>
 #include <onyx/types.h>
 
+#include <onyx/clock.h>
 #include <onyx/culstring.h>
 #include <onyx/dev.h>
 #include <onyx/list.h>
 #include <onyx/page.h>
 #include <onyx/page_iov.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
 
 #include <onyx/slice.hpp>
 
@@ -33,6 +36,13 @@ typedef uint64_t sector_t;
 #define BIO_REQ_OP_MASK  (0xff)
 #define BIO_REQ_READ_OP  0
 #define BIO_REQ_WRITE_OP 1
+/* Data-less operations: they act on nr_sectors sectors starting at sector_number, and carry no
+ * vecs.
+ */
+/* The device may throw the data away. Reads of discarded sectors return unspecified data. */
+#define BIO_REQ_DISCARD_OP      2
+/* Zero the sectors */
+#define BIO_REQ_WRITE_ZEROES_OP 3
 
 /* BIO flags start at bit 8 since bits 0 - 7 are reserved for operations */
 /* Note that we still have 24 bits for flags, which should be More Than Enough(tm) */
@@ -40,6 +50,16 @@ typedef uint64_t sector_t;
 #define BIO_REQ_EIO      (1 << 9)
 #define BIO_REQ_TIMEOUT  (1 << 10)
 #define BIO_REQ_NOT_SUPP (1 << 11)
+/* More requests follow, so the driver may hold off on ringing the device's doorbell.
+ * The last request of a batch must not have this flag set. A request that fails to submit ends
+ * the batch. bio_batch_submit() sets it for every request but the last.
+ */
+#define BIO_REQ_MORE     (1 << 12)
+/* Write zeroes: the device may deallocate the sectors, as long as they read back as zeroes */
+#define BIO_REQ_UNMAP    (1 << 13)
+
+/* Any of these means the request failed */
+#define BIO_REQ_ERROR_MASK (BIO_REQ_EIO | BIO_REQ_TIMEOUT | BIO_REQ_NOT_SUPP)
 
 struct bio_req
 {
@@ -48,6 +68,17 @@ struct bio_req
     struct page_iov *vec;
     size_t nr_vecs;
     size_t curr_vec_index;
+    /* Number of sectors. Data-less ops set it, the block layer fills it in for the rest. */
+    sector_t nr_sectors;
+    /* Completion callback, set up by bio_submit_request(_async). May be called in IRQ context. */
+    void (*b_end_io)(struct bio_req *req);
+    void *b_private;
+    /* Set up by the block layer, for accounting. b_sector is the sector the request got submitted
+     * with, as drivers may adjust sector_number.
+     */
+    struct blockdev *b_dev;
+    sector_t b_sector;
+    hrtime_t b_start;
 };
 
 typedef ssize_t (*__blkread)(size_t offset, size_t count, void *buffer, struct blockdev *_this);
@@ -57,6 +88,40 @@ typedef int (*__blkpowermanagement)(int op, struct blockdev *_this);
 
 struct superblock;
 
+/* I/O accounting groups */
+#define BLKDEV_STAT_READ      0
+#define BLKDEV_STAT_WRITE     1
+#define BLKDEV_STAT_DISCARD   2
+#define BLKDEV_STAT_FLUSH     3
+#define BLKDEV_NR_STAT_GROUPS 4
+
+/* Latency histogram buckets: bucket 0 is < 1us, bucket n is [2^(n-1), 2^n) us, and the last one
+ * holds everything above that.
+ */
+#define BLKDEV_LAT_BUCKETS 24
+
+struct blkdev_stats
+{
+    struct spinlock lock;
+    unsigned long ios[BLKDEV_NR_STAT_GROUPS];
+    /* In 512-byte units */
+    unsigned long sectors[BLKDEV_NR_STAT_GROUPS];
+    /* Time spent on requests, in ns */
+    unsigned long ticks[BLKDEV_NR_STAT_GROUPS];
+    unsigned long lat_hist[BLKDEV_NR_STAT_GROUPS][BLKDEV_LAT_BUCKETS];
+    unsigned long in_flight;
+    /* Time the device had requests in flight, and that time weighted by the number of requests, in
+     * ns
+     */
+    unsigned long io_ticks;
+    unsigned long time_in_queue;
+    /* Last time io_ticks and time_in_queue got updated */
+    hrtime_t stamp;
+};
+
+/* submit_request queues the request and returns, and completes it later through bio_end_io() */
+#define BLKDEV_FLAG_ASYNC (1 << 0)
+
 struct blockdev
 {
     __blkread read;
@@ -72,6 +137,12 @@ struct blockdev
     struct blockdev *actual_blockdev; // isn't null when blockdev is a partition
     size_t offset;
     int (*submit_request)(struct blockdev *dev, struct bio_req *req);
+    unsigned int flags;
+    /* Maximum size of a single discard/write zeroes request, 0 if the device doesn't support it */
+    sector_t max_discard_sectors;
+    sector_t max_write_zeroes_sectors;
+    /* Partitions account their I/O both here and in the whole disk's stats */
+    struct blkdev_stats stats;
     /* This vmo serves as the buffer cache of the block device, exactly like the page cache */
     struct vm_object *vmo;
     /* This will have the mounted superblock here if this block device is mounted */
@@ -84,7 +155,8 @@ struct blockdev
 
     constexpr blockdev()
         : read{}, write{}, flush{}, power{}, name{}, sector_size{}, nr_sectors{}, device_info{},
-          actual_blockdev{}, offset{}, submit_request{}, vmo{}, sb{}, dev{}, partition_prefix{}
+          actual_blockdev{}, offset{}, submit_request{}, flags{}, max_discard_sectors{},
+          max_write_zeroes_sectors{}, stats{}, vmo{}, sb{}, dev{}, partition_prefix{}
     {
     }
 };
@@ -142,8 +214,147 @@ int blkdev_flush(struct blockdev *dev);
  */
 int blkdev_power(int op, struct blockdev *dev);
 
+/**
+ * @brief Submit a request and wait for it to complete.
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return 0 if the request was submitted (check req->flags for its status), negative error code
+ * if not
+ */
 int bio_submit_request(struct blockdev *dev, struct bio_req *req);
 
+/**
+ * @brief Submit a request without waiting for it. req->b_end_io gets called when it completes.
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return 0 if the request was submitted, negative error code if not (in which case b_end_io is
+ * never called)
+ */
+int bio_submit_request_async(struct blockdev *dev, struct bio_req *req);
+
+/**
+ * @brief Complete a request. Called by asynchronous drivers.
+ *
+ * @param req Request
+ */
+void bio_end_io(struct bio_req *req);
+
+/**
+ * @brief Account for a request getting issued to the device
+ *
+ * @param dev Block device the request was submitted to
+ * @param req Request
+ */
+void blkdev_account_start(struct blockdev *dev, struct bio_req *req);
+
+/**
+ * @brief Account for a request that got issued, but never made it to the device
+ *
+ * @param req Request
+ */
+void blkdev_account_cancel(struct bio_req *req);
+
+/**
+ * @brief Account for a completed request, and trace it
+ *
+ * @param req Request
+ * @param error True if the request failed
+ */
+void blkdev_account_done(struct bio_req *req, bool error);
+
+/**
+ * @brief Account for a flush getting issued. Flushes don't go through bios.
+ *
+ * @param dev Block device
+ * @return Time the flush got issued at
+ */
+hrtime_t blkdev_account_flush_start(struct blockdev *dev);
+
+/**
+ * @brief Account for a completed flush, and trace it
+ *
+ * @param dev Block device
+ * @param start Return value of blkdev_account_flush_start
+ * @param error True if the flush failed
+ */
+void blkdev_account_flush_done(struct blockdev *dev, hrtime_t start, bool error);
+
+/**
+ * @brief Call a function for every block device (partitions included), with the device list
+ * locked
+ *
+ * @param cb Callback
+ * @param ctx Context for the callback
+ */
+void blkdev_for_every(void (*cb)(struct blockdev *dev, void *ctx), void *ctx);
+
+/* Requests that get submitted in batches, which are then waited on together */
+#define BIO_BATCH_SIZE    16
+#define BIO_BATCH_NR_VECS 8
+
+struct bio_batch
+{
+    struct spinlock lock;
+    struct wait_queue wq;
+    unsigned int pending;
+    int status;
+    struct bio_req reqs[BIO_BATCH_SIZE];
+    struct page_iov vecs[BIO_BATCH_SIZE][BIO_BATCH_NR_VECS];
+};
+
+/**
+ * @brief Allocate a batch of requests. Free it with free().
+ *
+ * @return The batch, or NULL if we're out of memory
+ */
+struct bio_batch *bio_batch_alloc();
+
+/**
+ * @brief Submit the first nr requests of a batch, and wait for all of them to complete
+ *
+ * @param dev Block device
+ * @param b Batch
+ * @param nr Number of requests
+ * @return 0 on success, negative error codes
+ */
+int bio_batch_submit(struct blockdev *dev, struct bio_batch *b, unsigned int nr);
+
+static inline bool blkdev_supports_discard(struct blockdev *dev)
+{
+    return dev->max_discard_sectors != 0;
+}
+
+/**
+ * @brief Discard a range of sectors. Big ranges get split into as many requests as needed.
+ *
+ * @param dev Block device
+ * @param sector First sector
+ * @param nr_sectors Number of sectors
+ * @return 0 on success, -EOPNOTSUPP if the device can't discard, or another negative error code
+ */
+int blkdev_issue_discard(struct blockdev *dev, sector_t sector, sector_t nr_sectors);
+
+/* Let the device deallocate the zeroed sectors */
+#define BLKDEV_ZERO_UNMAP      (1 << 0)
+/* Don't fall back to writing out zeroes if the device can't zero the range by itself */
+#define BLKDEV_ZERO_NOFALLBACK (1 << 1)
+
+/**
+ * @brief Zero a range of sectors, with write zeroes requests if the device supports them, or
+ * regular writes if not.
+ *
+ * @param dev Block device
+ * @param sector First sector
+ * @param nr_sectors Number of sectors
+ * @param flags BLKDEV_ZERO_* flags
+ * @return 0 on success, -EOPNOTSUPP if the device can't zero the range by itself and
+ * BLKDEV_ZERO_NOFALLBACK was given, or another negative error code
+ */
+int blkdev_issue_zeroout(struct blockdev *dev, sector_t sector, sector_t nr_sectors,
+                         unsigned int flags);
+
 static inline bool block_get_device_letter_from_id(unsigned int id, cul::slice<char> buffer)
 {
     if (id > 26)
@@ -50,6 +50,8 @@ struct clocksource
     hrtime_t (*get_ticks)(void);
     hrtime_t (*get_ns)(void);
     hrtime_t (*elapsed_ns)(hrtime_t old_ticks, hrtime_t new_ticks);
+    /* VDSO_CLOCK_MODE_*: how the vDSO can read this clocksource */
+    unsigned int vdso_clock_mode;
 };
 
 struct clock_time
@@ -69,6 +71,11 @@ struct clock_time *get_raw_clock_time(clockid_t clkid);
 time_t clock_get_posix_time(void);
 hrtime_t clocksource_get_time(void);
 
+/**
+ * @brief Update the coarse clocks (CLOCK_*_COARSE). Called on ticks.
+ */
+void clock_update_coarse(void);
+
 bool timespec_valid(const struct timespec *ts, bool may_be_negative);
 bool timeval_valid(const struct timeval *tv, bool may_be_negative);
 
@@ -15,6 +15,8 @@
 #include <onyx/fnv.h>
 #include <onyx/limits.h>
 #include <onyx/list.h>
+#include <onyx/list_nulls.h>
+#include <onyx/rcu.h>
 #include <onyx/rwlock.h>
 #include <onyx/vfs.h>
 
@@ -26,6 +28,8 @@
 #define DENTRY_FLAG_MOUNT_ROOT (1 << 1)
 #define DENTRY_FLAG_PENDING    (1 << 2)
 #define DENTRY_FLAG_FAILED     (1 << 3)
+/* Cached lookup failure: the name doesn't exist. Negative dentries have no inode */
+#define DENTRY_FLAG_NEGATIVE   (1 << 4)
 
 struct dentry
 {
@@ -40,10 +44,13 @@ struct dentry
 
     struct dentry *d_parent;
     struct list_head d_parent_dir_node;
-    struct list_head d_cache_node;
+    /* dcache hash table linkage, and the hash we were inserted with */
+    struct hlist_nulls_node d_hash;
+    fnv_hash_t d_cache_hash;
     struct list_head d_children_head;
     struct dentry *d_mount_dentry;
     atomic<uint16_t> d_flags;
+    struct rcu_head d_rcu;
 };
 
 struct dentry *dentry_open(char *path, struct dentry *base);
@@ -66,6 +73,40 @@ using dentry_lookup_flags_t = uint16_t;
 
 dentry *dentry_lookup_internal(std::string_view v, dentry *dir, dentry_lookup_flags_t flags = 0);
 
+/**
+ * @brief Look up a name in the dcache, without taking locks or refs.
+ * Must be called under rcu_read_lock(). The result may be pending, negative, or getting renamed
+ * under us, so callers validate it with dcache_read_retry().
+ *
+ * @param dir Parent directory
+ * @param name Name
+ * @return The dentry, or nullptr if it's not cached
+ */
+dentry *dentry_lookup_rcu(dentry *dir, std::string_view name);
+
+/**
+ * @brief Start a lockless dcache read-side section. Renames bump the dcache sequence count.
+ *
+ * @return Sequence number to pass to dcache_read_retry()
+ */
+unsigned int dcache_read_begin();
+
+/**
+ * @brief Check if a rename raced with a lockless dcache read-side section
+ *
+ * @param seq Sequence number returned by dcache_read_begin()
+ * @return True if the reader needs to retry (or fall back to the locked walk)
+ */
+bool dcache_read_retry(unsigned int seq);
+
+/**
+ * @brief Get a reference to a dentry, unless it's already dying
+ *
+ * @param d Dentry, found under rcu_read_lock()
+ * @return True if we got a reference
+ */
+bool dentry_get_unless_zero(dentry *d);
+
 struct nameidata;
 dentry *dentry_resolve(nameidata &data);
 void dentry_destroy(dentry *d);
@@ -186,6 +227,11 @@ __always_inline bool dentry_is_symlink(const dentry *d)
     return S_ISLNK(d->d_inode->i_mode);
 }
 
+__always_inline bool dentry_is_negative(const dentry *d)
+{
+    return d->d_flags & DENTRY_FLAG_NEGATIVE;
+}
+
 __always_inline bool dentry_is_mountpoint(const dentry *dir)
 {
     return dir->d_flags & DENTRY_FLAG_MOUNTPOINT;
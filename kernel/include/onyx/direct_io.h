@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_DIRECT_IO_H
+#define _ONYX_DIRECT_IO_H
+
+#include <onyx/block.h>
+#include <onyx/vfs.h>
+
+/* Direct I/O flags */
+#define DIO_WRITE (1 << 0)
+
+/* Sector returned by dio_map_t for holes */
+#define DIO_SECTOR_HOLE ((sector_t) -1)
+
+/**
+ * @brief Map a range of a file to the disk.
+ *
+ * @param ino Inode
+ * @param off Offset in the file, aligned to the sector size
+ * @param len Length of the range, aligned to the sector size
+ * @param sector Set to the sector off lives in, or DIO_SECTOR_HOLE if it's not backed by the disk
+ * @return Number of bytes, starting at off, that are contiguous on the disk (or all part of the
+ * same hole). This must be a multiple of the sector size, no bigger than len. Negative error codes
+ * on error.
+ */
+typedef ssize_t (*dio_map_t)(struct inode *ino, size_t off, size_t len, sector_t *sector);
+
+static inline bool dio_is_aligned(struct blockdev *dev, size_t off, size_t len, void *ubuf)
+{
+    return ((off | len | (unsigned long) ubuf) & (dev->sector_size - 1)) == 0;
+}
+
+/**
+ * @brief Do I/O straight between a user buffer and the disk, bypassing the page cache.
+ * The buffer's pages get pinned, and handed to the device as they are.
+ * Keeping the page cache coherent is up to the caller.
+ *
+ * @param dev Block device
+ * @param ino Inode
+ * @param off Offset in the file, aligned to the sector size
+ * @param len Length, aligned to the sector size
+ * @param ubuf User buffer, aligned to the sector size
+ * @param flags DIO_* flags
+ * @param map Callback that maps the file to the disk. Holes read back as zeroes, and end writes.
+ * @return Number of bytes transferred, or negative error codes
+ */
+ssize_t do_direct_io(struct blockdev *dev, struct inode *ino, size_t off, size_t len, void *ubuf,
+                     unsigned int flags, dio_map_t map);
+
+#endif
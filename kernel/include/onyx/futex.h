@@ -10,24 +10,17 @@
 #include <onyx/process.h>
 #include <onyx/spinlock.h>
 
-#define FUTEX_WAIT            0
-#define FUTEX_WAKE            1
-#define FUTEX_FD              2
-#define FUTEX_REQUEUE         3
-#define FUTEX_CMP_REQUEUE     4
-#define FUTEX_WAKE_OP         5
-#define FUTEX_LOCK_PI         6
-#define FUTEX_UNLOCK_PI       7
-#define FUTEX_TRYLOCK_PI      8
-#define FUTEX_WAIT_BITSET     9
-#define FUTEX_WAKE_BITSET     10
-#define FUTEX_WAIT_REQUEUE_PI 11
-#define FUTEX_CMP_REQUEUE_PI  12
-
-#define FUTEX_PRIVATE_FLAG   128
-#define FUTEX_CLOCK_REALTIME 256
-#define FUTEX_OP_MASK        ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
+#include <uapi/futex.h>
 
 int futex_wake(int *uaddr, int nr_waiters);
 
+/**
+ * @brief Give up the PI futexes owned by an exiting thread.
+ * Waiters get woken up and fail with ESRCH, like they would if the owner had died before
+ * they got to the futex.
+ *
+ * @param thread The exiting thread (current)
+ */
+void futex_exit_pi(struct thread *thread);
+
 #endif
@@ -123,6 +123,14 @@ public:
         this->lock();
     }
 
+    /* For paths that may be called with the lock already held, which then stays held */
+    explicit scoped_hybrid_lock(hybrid_lock &lock, socket *sock, bool held)
+        : IsLocked{false}, lock_{lock}, sock{sock}
+    {
+        if (!held)
+            this->lock();
+    }
+
     ~scoped_hybrid_lock()
     {
         if (IsLocked)
@@ -10,21 +10,32 @@
 
 #include <onyx/file.h>
 #include <onyx/mutex.h>
+#include <onyx/rcu.h>
 #include <onyx/vfs.h>
 
 #define FDS_PER_LONG            (sizeof(unsigned long) * 8)
 #define FILE_DESCRIPTOR_GROW_NR (FDS_PER_LONG)
 
+/* The fd table is RCU-protected. Lookups just load a file pointer under rcu_read_lock() and grab
+ * a reference, while anything that changes the table (or the bitmaps) holds fdlock. Tables are
+ * replaced, never resized in place, so readers always see a consistent file_desc_entries.
+ */
+struct fd_table
+{
+    unsigned int file_desc_entries;
+    struct file **file_desc;
+    unsigned long *cloexec_fds;
+    unsigned long *open_fds;
+    struct rcu_head rcu;
+};
+
 struct ioctx
 {
     /* Current working directory */
     spinlock cwd_lock{};
     file *cwd{};
     spinlock fdlock{};
-    struct file **file_desc{};
-    unsigned int file_desc_entries{};
-    unsigned long *cloexec_fds{};
-    unsigned long *open_fds{};
+    struct fd_table *fdt{};
     mode_t umask{};
 };
 
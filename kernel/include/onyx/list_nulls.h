@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _ONYX_LIST_NULLS_H
+#define _ONYX_LIST_NULLS_H
+
+#include <stdbool.h>
+
+/* Singly-linked hash lists terminated by a "nulls" marker instead of NULL, like linux's.
+ * The marker encodes a value (usually the bucket index), so a lockless reader can tell if it
+ * got moved to another chain while walking (because the node it stood on got removed and
+ * re-added, or the table got rehashed), and restart.
+ * Writers must be serialized by the user, readers may walk concurrently with them.
+ */
+
+struct hlist_nulls_node
+{
+    struct hlist_nulls_node *next, **pprev;
+};
+
+struct hlist_nulls_head
+{
+    struct hlist_nulls_node *first;
+};
+
+#define NULLS_MARKER(value) ((struct hlist_nulls_node *) (1UL | (((unsigned long) (value)) << 1)))
+
+static inline bool is_a_nulls(const struct hlist_nulls_node *ptr)
+{
+    return (unsigned long) ptr & 1;
+}
+
+static inline unsigned long get_nulls_value(const struct hlist_nulls_node *ptr)
+{
+    return (unsigned long) ptr >> 1;
+}
+
+static inline void INIT_HLIST_NULLS_HEAD(struct hlist_nulls_head *h, unsigned long nulls)
+{
+    h->first = NULLS_MARKER(nulls);
+}
+
+static inline bool hlist_nulls_unhashed(const struct hlist_nulls_node *n)
+{
+    return !n->pprev;
+}
+
+static inline void hlist_nulls_add_head(struct hlist_nulls_node *n, struct hlist_nulls_head *h)
+{
+    struct hlist_nulls_node *first = h->first;
+
+    n->next = first;
+    n->pprev = &h->first;
+    if (!is_a_nulls(first))
+        first->pprev = &n->next;
+
+    /* Publish the node only after it's fully set up */
+    __atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+}
+
+static inline void hlist_nulls_del(struct hlist_nulls_node *n)
+{
+    struct hlist_nulls_node *next = n->next;
+
+    /* n->next is left alone, so readers standing on n can keep walking */
+    __atomic_store_n(n->pprev, next, __ATOMIC_RELAXED);
+    if (!is_a_nulls(next))
+        next->pprev = n->pprev;
+    n->pprev = NULL;
+}
+
+static inline struct hlist_nulls_node *hlist_nulls_first(const struct hlist_nulls_head *h)
+{
+    return __atomic_load_n(&h->first, __ATOMIC_ACQUIRE);
+}
+
+static inline struct hlist_nulls_node *hlist_nulls_next(const struct hlist_nulls_node *n)
+{
+    return __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+}
+
+#define hlist_nulls_for_every(pos, head) \
+    for (pos = hlist_nulls_first(head); !is_a_nulls(pos); pos = hlist_nulls_next(pos))
+
+#endif
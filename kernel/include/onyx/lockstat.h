@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_LOCKSTAT_H
+#define _ONYX_LOCKSTAT_H
+
+#ifdef CONFIG_LOCKSTAT
+
+#include <stdbool.h>
+
+#include <onyx/clock.h>
+#include <onyx/cmdline.h>
+
+struct spinlock;
+
+/* Toggled through /sys/lockstat/enable, or the "lockstat" kernel parameter */
+extern kparam::typed_kernel_param<bool> lockstat_enabled;
+
+/**
+ * @brief Account a lock acquisition. Lock classes are keyed by acquisition site.
+ *
+ * @param lock Lock that was just acquired
+ * @param site Return address of the lock call
+ * @param contended True if we had to wait
+ * @param wait Time spent waiting
+ * @param now Time we got the lock at
+ */
+void lockstat_acquire(struct spinlock *lock, unsigned long site, bool contended, hrtime_t wait,
+                      hrtime_t now);
+
+/**
+ * @brief Account a lock release (and the time it was held for).
+ *
+ * @param lock Lock that is about to be released
+ */
+void lockstat_release(struct spinlock *lock);
+
+#endif
+
+#endif
@@ -44,8 +44,56 @@
 #define LOG_LEVEL_ERROR   (1 << 2)
 #define LOG_LEVEL_FATAL   (1 << 3)
 
+/* Record levels, as in syslog(3) */
+#define KLOG_EMERG   0
+#define KLOG_ALERT   1
+#define KLOG_CRIT    2
+#define KLOG_ERR     3
+#define KLOG_WARNING 4
+#define KLOG_NOTICE  5
+#define KLOG_INFO    6
+#define KLOG_DEBUG   7
+
+#define KLOG_DEFAULT_LEVEL KLOG_INFO
+
+/* Record flags */
+#define KLOG_CONSOLE (1 << 0) /* Gets written to the console */
+#define KLOG_CONT    (1 << 1) /* Continues the previous record */
+
 void kernlog_set_log_level(unsigned int level);
 void kernlog_send(unsigned int level, const char *msg, ...);
 void kernlog_print(const char *msg);
 
+/**
+ * @brief Log a message. Lockless and irq-safe, the console gets written to asynchronously.
+ *
+ * @param level Level of the message (KLOG_*)
+ * @param flags Record flags
+ * @param msg Message
+ * @param len Length of the message
+ */
+void kernlog_emit(unsigned int level, unsigned int flags, const char *msg, size_t len);
+
+/**
+ * @brief Log a message, without kicking the console. The caller needs to call
+ * kernlog_kick_console() afterwards, once it's out of its irqs-off section.
+ *
+ * @param level Level of the message (KLOG_*)
+ * @param flags Record flags
+ * @param msg Message
+ * @param len Length of the message
+ */
+void __kernlog_emit(unsigned int level, unsigned int flags, const char *msg, size_t len);
+
+/**
+ * @brief Get the console written to, by the console thread if we have one. Can be called from
+ * any context, the console only gets written to synchronously if we can sleep (or are panicking).
+ */
+void kernlog_kick_console();
+
+/**
+ * @brief Let the console be written to, whoever was writing to it. Used when panicking.
+ */
+void kernlog_bust_console(void);
+
 #endif
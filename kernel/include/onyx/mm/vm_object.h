@@ -92,6 +92,14 @@ struct vm_object
     unsigned long refcount;
     struct vm_object *forked_from;
 
+    /* Shadow chain: pages that aren't in our tree are looked up in the backing object, at the
+     * same offset, as long as the offset is below backing_limit. Backing objects are created on
+     * fork and are never modified while shared. Once we're a backing object's only user, it gets
+     * collapsed into us.
+     */
+    struct vm_object *backing;
+    size_t backing_limit;
+
     struct vm_object *prev_private, *next_private;
 
     /**
@@ -193,8 +201,21 @@ vm_object *vmo_create_phys(size_t size);
  */
 vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page **ppage);
 
+/**
+ * @brief Looks up a page in the VMO or in its shadow chain, without populating or copying
+ * anything. The page may be shared with other VMOs, so it must only be mapped read-only.
+ *
+ * @param vmo The VMO
+ * @param off The offset inside the vm object
+ * @param ppage Pointer to where the (pinned) struct page will be placed
+ * @return The vm_status_t of the request, VMO_STATUS_NON_EXISTENT if the page isn't there
+ */
+vmo_status_t vmo_lookup_page(vm_object *vmo, size_t off, struct page **ppage);
+
 /**
  * @brief Forks the VMO, performing any COW tricks that may be required.
+ * Private VMOs don't get their pages copied: both sides end up shadowing a common backing object
+ * with the pages, and copy them on write.
  *
  * @param vmo The VMO to be forked.
  * @param shared True if the region is shared. This makes it skip all the work.
@@ -227,12 +248,14 @@ bool vmo_unref(vm_object *vmo);
 int vmo_resize(size_t new_size, vm_object *vmo);
 
 /**
- * @brief Creates a new vmo and moves all pages in [split_point, split_point + hole_size] to it.
+ * @brief Frees the pages in [split_point, split_point + hole_size) and moves every page past the
+ * hole to a new vmo. The new vmo keeps the same offsets (and shadow chain) as the original, so it
+ * must be mapped at offset split_point + hole_size.
  *
  * @param split_point The start of the split point.
  * @param hole_size The size of the hole.
  * @param vmo The VMO to be split.
- * @return The new vmo populated with all pre-existing vmo pages in the range.
+ * @return The new vmo populated with all pre-existing vmo pages past the hole.
  */
 vm_object *vmo_split(size_t split_point, size_t hole_size, vm_object *vmo);
 
@@ -282,6 +305,7 @@ void vmo_ref(vm_object *vmo);
 
 /**
  * @brief Determines whether or not the VMO is currently being shared.
+ * VMOs that have a shadow chain are always considered shared.
  *
  * @param vmo The VMO.
  * @return True if it is, false if not.
@@ -22,6 +22,8 @@ protected:
     size_t packet_list_len;
     int pending_;
     size_t length_;
+    /* Sum of the truesize of every packet in the cork */
+    size_t truesize_;
 
     // Needed so we can check whether or not to let us have more datagrams
     int sock_type;
@@ -30,7 +32,8 @@ protected:
                          size_t max_packet_len, size_t skip_first);
 
 public:
-    inet_cork(int sock_type) : pending_{AF_UNSPEC}, length_{}, sock_type{sock_type}
+    inet_cork(int sock_type)
+        : packet_list_len{}, pending_{AF_UNSPEC}, length_{}, truesize_{}, sock_type{sock_type}
     {
         INIT_LIST_HEAD(&packet_list);
     }
@@ -39,6 +42,35 @@ public:
 
     int append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_size, size_t max_packet_len);
 
+    /**
+     * @brief Append data to the cork without copying it, by pinning the user's pages
+     * (see packetbuf::zerocopy_from_user). New packets are always allocated, and get attached to
+     * the send's zerocopy_ctl.
+     *
+     * @param vec Iovec of user data
+     * @param vec_len Number of iovecs
+     * @param proto_hdr_size Size of the protocol's header
+     * @param max_packet_len Maximum length of each packet
+     * @param zc The send's zerocopy_ctl
+     * @return 0 on success, negative error codes
+     */
+    int append_zerocopy(const iovec *vec, size_t vec_len, size_t proto_hdr_size,
+                        size_t max_packet_len, zerocopy_ctl *zc);
+
+    /**
+     * @brief Append kernel pages to the cork without copying them (see packetbuf::attach_page).
+     * Used by splice and sendfile. Keeps filling the last packet if it's also made of attached
+     * pages.
+     *
+     * @param vec Page vectors to attach
+     * @param nr_vecs Number of page vectors
+     * @param proto_hdr_size Size of the protocol's header
+     * @param max_packet_len Maximum length of each packet
+     * @return 0 on success, negative error codes
+     */
+    int append_pages(const page_iov *vec, size_t nr_vecs, size_t proto_hdr_size,
+                     size_t max_packet_len);
+
     int send(const iflow &flow, void (*prepare_headers)(packetbuf *buf, const iflow &flow));
 
     list_head *get_packet_list()
@@ -56,6 +88,16 @@ public:
         return length_;
     }
 
+    /**
+     * @brief Get the memory used by the cork's packets.
+     *
+     * @return Sum of the truesize of every packet in the cork.
+     */
+    size_t truesize() const
+    {
+        return truesize_;
+    }
+
     /**
      * @brief Append a whole packetbuf to the end of the list
      *        Note: Increments buf's reference count
@@ -65,8 +107,22 @@ public:
     void append_packet(packetbuf *buf)
     {
         packet_list_len++;
+        truesize_ += buf->truesize;
         list_add_tail(&buf->list_node, &packet_list);
     }
+
+    /**
+     * @brief Remove a packetbuf from the list
+     *        Note: The reference to buf is passed to the caller
+     *
+     * @param buf Packetbuf to remove
+     */
+    void remove_packet(packetbuf *buf)
+    {
+        packet_list_len--;
+        truesize_ -= buf->truesize;
+        list_remove(&buf->list_node);
+    }
 };
 
 #endif
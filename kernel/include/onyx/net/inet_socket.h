@@ -8,11 +8,13 @@
 #define _ONYX_NET_INET_SOCKET_H
 
 #include <onyx/byteswap.h>
+#include <onyx/list_nulls.h>
 #include <onyx/net/inet_cork.h>
 #include <onyx/net/inet_proto.h>
 #include <onyx/net/inet_route.h>
 #include <onyx/net/inet_sock_addr.h>
 #include <onyx/net/socket.h>
+#include <onyx/rcu.h>
 
 // Pretty solid TTL default
 #define INET_DEFAULT_TTL 64
@@ -40,7 +42,7 @@ void copy_msgname_to_user(struct msghdr *msg, packetbuf *buf, bool isv6, in_port
 struct inet_socket : public socket
 {
     inet_sock_address src_addr;
-    list_head_cpp<inet_socket> bind_table_node;
+    struct hlist_nulls_node bind_table_node;
     inet_sock_address dest_addr;
 
     inet_route route_cache;
@@ -52,10 +54,11 @@ struct inet_socket : public socket
 
     unsigned int ipv4_on_inet6 : 1, ipv6_only : 1, route_cache_valid : 1;
     int ttl;
+    struct rcu_head rcu;
 
     inet_socket()
-        : socket{}, src_addr{}, bind_table_node{this}, dest_addr{}, proto_info{},
-          ipv4_on_inet6{}, ipv6_only{}, route_cache_valid{}, ttl{INET_DEFAULT_TTL}
+        : socket{}, src_addr{}, bind_table_node{}, dest_addr{}, proto_info{},
+          ipv4_on_inet6{}, ipv6_only{}, route_cache_valid{}, ttl{INET_DEFAULT_TTL}, rcu{}
     {
         INIT_LIST_HEAD(&rx_packet_list);
         init_wait_queue_head(&rx_wq);
@@ -124,10 +127,30 @@ struct inet_socket : public socket
         return reinterpret_cast<inet_proto_family *>(proto_domain);
     }
 
-    void append_inet_rx_pbuf(packetbuf *buf);
+    /**
+     * @brief Queue a packetbuf in the receive queue, charging it against rx_max_buf.
+     *
+     * @param buf Packetbuf to queue (gets a new reference)
+     * @return True if queued, false if there was no room and the packet should be dropped.
+     */
+    bool append_inet_rx_pbuf(packetbuf *buf);
+
+    /**
+     * @brief Remove a packetbuf from the receive queue, uncharge it and drop the queue's
+     * reference.
+     *
+     * @param buf Packetbuf to dequeue
+     */
+    void dequeue_inet_rx_pbuf(packetbuf *buf);
 
     virtual ~inet_socket();
 
+    /**
+     * @brief Free the socket after a grace period, as lockless socket table lookups may still be
+     * looking at it.
+     */
+    void operator delete(void *ptr);
+
     int setsockopt_inet(int level, int opt, const void *optval, socklen_t len);
     int getsockopt_inet(int level, int opt, void *optval, socklen_t *len);
 
@@ -159,6 +182,17 @@ struct inet_socket : public socket
      */
     bool can_offload_csum(netif *nif, packetbuf *buf) const;
 
+    /**
+     * @brief Check if we can send zero-copy packets through an interface.
+     *        Zero-copy packets aren't linear, so the interface needs to offload checksumming.
+     * @param nif Network interface
+     * @return True if possible, else false
+     */
+    bool can_zerocopy(netif *nif) const
+    {
+        return nif->flags & NETIF_SUPPORTS_CSUM_OFFLOAD;
+    }
+
 #define call_based_on_inet(func, ...) \
     ((effective_domain() == AF_INET6) ? func<AF_INET6>(__VA_ARGS__) : func<AF_INET>(__VA_ARGS__))
 
@@ -147,11 +147,11 @@ inline bool check_sockaddr_in(sockaddr_in *in)
 template <typename T>
 inline T *inet_resolve_socket(in_addr_t src, in_port_t port_src, in_port_t port_dst, int proto,
                               netif *nif, bool ign_dst, const inet_proto *proto_info,
-                              unsigned int instance = 0)
+                              unsigned int instance = 0, unsigned int extra_flags = 0)
 {
     in_addr __src;
     __src.s_addr = src;
-    auto flags = (!ign_dst ? GET_SOCKET_DSTADDR_VALID : 0);
+    auto flags = (!ign_dst ? GET_SOCKET_DSTADDR_VALID : 0) | extra_flags;
 
     const inet_sock_address socket_dst{__src, port_src};
     const inet_sock_address socket_src{nif->local_ip.sin_addr, port_dst};
@@ -79,8 +79,17 @@ struct netif
     struct list_head inet6_addr_list;
 
     int (*sendpacket)(packetbuf *buf, struct netif *nif);
-    int (*poll_rx)(struct netif *nif);
+    /* Process at most budget received packets, returns the number of packets processed.
+     * Returning budget means there may be more work left: the poll gets rescheduled, and
+     * rx_end (which re-enables RX interrupts) only gets called once the device runs dry.
+     */
+    int (*poll_rx)(struct netif *nif, int budget);
     void (*rx_end)(struct netif *nif);
+    /* Delay RX interrupts by up to rx_usecs, so a burst of packets only raises one. Drivers
+     * round it to what the hardware supports and store the result in rx_coalesce_usecs.
+     */
+    int (*set_coalesce)(struct netif *nif, unsigned int rx_usecs);
+    unsigned int rx_coalesce_usecs;
 
     struct list_head list_node;
     struct list_head rx_queue_node;
@@ -88,8 +97,8 @@ struct netif
 
     netif()
         : name{}, device_file{}, priv{}, if_id{}, flags{}, mtu{}, mac_address{}, local_ip{},
-          inet6_addr_list_lock{}, inet6_addr_list{}, sendpacket{}, poll_rx{}, rx_end{}, list_node{},
-          rx_queue_node{}, dll_ops{}
+          inet6_addr_list_lock{}, inet6_addr_list{}, sendpacket{}, poll_rx{}, rx_end{},
+          set_coalesce{}, rx_coalesce_usecs{}, list_node{}, rx_queue_node{}, dll_ops{}
     {
         INIT_LIST_HEAD(&inet6_addr_list);
     }
@@ -118,6 +127,8 @@ struct inet_socket;
 #define GET_SOCKET_UNLOCKED        (1 << 0)
 #define GET_SOCKET_DSTADDR_VALID   (1 << 1)
 #define GET_SOCKET_CHECK_EXISTENCE (1 << 2)
+/* Don't load balance between SO_REUSEPORT sockets, for lookups that want every socket */
+#define GET_SOCKET_NO_REUSEPORT (1 << 3)
 
 #define ADD_SOCKET_UNLOCKED    (1 << 0)
 #define REMOVE_SOCKET_UNLOCKED (1 << 0)
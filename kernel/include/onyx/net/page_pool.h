@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _ONYX_NET_PAGE_POOL_H
+#define _ONYX_NET_PAGE_POOL_H
+
+#include <onyx/page.h>
+
+/**
+ * @brief Recycles the pages a NIC receives packets into.
+ * Drivers hand received pages straight to packetbufs, and give them to the pool at the same time.
+ * The pool keeps a reference of its own, and once the packet lets go of the page (i.e the page's
+ * only reference is the pool's), the page gets handed out again to refill the RX ring, without
+ * going through the page allocator.
+ *
+ * Pages come back in the order they were handed out, so only the oldest one gets looked at. A page
+ * that's still in use when the pool is full gets dropped from the pool, and is freed whenever its
+ * packet is.
+ *
+ * Not thread safe: a pool belongs to an RX ring, and callers serialise against the ring.
+ */
+struct page_pool
+{
+    struct page **pages;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+};
+
+/**
+ * @brief Initialise a page pool
+ *
+ * @param pool Pool
+ * @param size Number of pages the pool can hold (must be a power of 2)
+ * @return 0 on success, negative error codes
+ */
+int page_pool_init(struct page_pool *pool, unsigned int size);
+
+/**
+ * @brief Free the pool, and drop its references to the pages it holds
+ *
+ * @param pool Pool
+ */
+void page_pool_destroy(struct page_pool *pool);
+
+/**
+ * @brief Get a page for the RX ring. Recycles the oldest page if it's free, and allocates a new
+ * one otherwise.
+ *
+ * @param pool Pool
+ * @return A page, with a single reference belonging to the caller, or nullptr if we're out of
+ * memory
+ */
+struct page *page_pool_alloc(struct page_pool *pool);
+
+/**
+ * @brief Give a page to the pool, so it can be handed out again once it's free.
+ * The pool takes a reference of its own, so this must be called before the caller gives its
+ * reference away.
+ *
+ * @param pool Pool
+ * @param page Page
+ */
+void page_pool_recycle(struct page_pool *pool, struct page *page);
+
+#endif
@@ -12,10 +12,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <onyx/clock.h>
 #include <onyx/fnv.h>
 #include <onyx/hybrid_lock.h>
 #include <onyx/net/netif.h>
 #include <onyx/net/proto_family.h>
+#include <onyx/net/zerocopy.h>
 #include <onyx/object.h>
 #include <onyx/refcount.h>
 #include <onyx/semaphore.h>
@@ -33,8 +35,20 @@
 #define PROTOCOL_TCP  4
 #define PROTOCOL_UNIX 5
 
-#define DEFAULT_RX_MAX_BUF UINT16_MAX
-#define DEFAULT_TX_MAX_BUF UINT16_MAX
+/* Socket buffers are charged by their true size (see packetbuf::truesize), so leave some
+ * room for the overhead on top of the payload.
+ */
+#define DEFAULT_RX_MAX_BUF (208 * 1024)
+#define DEFAULT_TX_MAX_BUF (208 * 1024)
+#define SOCK_MIN_BUF       (2 * PAGE_SIZE)
+
+/**
+ * @brief Check if the network stack is under memory pressure.
+ * Under pressure, sockets get a smaller share of their buffer limits.
+ *
+ * @return True if under pressure, else false.
+ */
+bool net_mem_under_pressure();
 
 struct socket_conn_request
 {
@@ -147,11 +161,25 @@ public:
 
     unsigned int rx_max_buf;
     unsigned int tx_max_buf;
+    /* Memory currently charged against rx_max_buf and tx_max_buf */
+    atomic<unsigned int> rx_alloc;
+    atomic<unsigned int> tx_alloc;
 
     bool reuse_addr : 1;
 
+    /* SO_REUSEPORT: share the local address with other sockets of the same user */
+    bool reuse_port : 1;
+
     bool broadcast_allowed : 1;
 
+    bool zerocopy_enabled : 1;
+
+    /* MSG_ZEROCOPY state, allocated when SO_ZEROCOPY first gets enabled */
+    sock_zerocopy *zerocopy;
+
+    /* Effective uid that set SO_REUSEPORT */
+    uid_t reuse_port_uid;
+
     hrtime_t rcv_timeout;
     hrtime_t snd_timeout;
     unsigned int shutdown_state;
@@ -161,14 +189,18 @@ public:
         : type{}, proto{}, domain{}, in_band_queue{this}, oob_data_queue{this}, flags{}, sock_err{},
           socket_lock{}, bound{}, connected{}, listener_sem{}, conn_req_list_lock{},
           conn_request_list{}, nr_pending{}, backlog{}, proto_domain{},
-          rx_max_buf{DEFAULT_RX_MAX_BUF}, tx_max_buf{DEFAULT_TX_MAX_BUF}, reuse_addr{false},
-          rcv_timeout{0}, snd_timeout{0}, shutdown_state{}
+          rx_max_buf{DEFAULT_RX_MAX_BUF}, tx_max_buf{DEFAULT_TX_MAX_BUF}, rx_alloc{0},
+          tx_alloc{0}, reuse_addr{false}, reuse_port{false}, broadcast_allowed{false}, zerocopy_enabled{false},
+          zerocopy{nullptr}, reuse_port_uid{0}, rcv_timeout{0}, snd_timeout{0}, shutdown_state{}
     {
         INIT_LIST_HEAD(&socket_backlog);
     }
 
     virtual ~socket()
     {
+        /* In-flight packets may still hold references to this */
+        if (zerocopy)
+            zerocopy->unref();
     }
 
     ssize_t default_recvfrom(void *buf, size_t len, int flags, sockaddr *src_addr, socklen_t *slen);
@@ -227,6 +259,101 @@ public:
         return ret;
     }
 
+    /**
+     * @brief Charge a received buffer against rx_max_buf and the global network memory.
+     * An empty receive queue always gets to charge a buffer, so a socket can't get wedged.
+     *
+     * @param size Size to charge (usually packetbuf::truesize)
+     * @param force Charge even if we're over the limits (for data we can't drop anymore)
+     * @return True if charged, false if the buffer should be dropped.
+     */
+    bool rx_charge(unsigned int size, bool force = false);
+
+    /**
+     * @brief Uncharge a buffer that was charged with rx_charge.
+     *
+     * @param size Size to uncharge
+     */
+    void rx_uncharge(unsigned int size);
+
+    /**
+     * @brief Charge a buffer that is queued for transmission against tx_max_buf.
+     *
+     * @param size Size to charge (usually packetbuf::truesize)
+     * @param force Charge even if we're over the limits
+     * @return True if charged, false if there's no room.
+     */
+    bool tx_charge(unsigned int size, bool force = false);
+
+    /**
+     * @brief Uncharge a buffer that was charged with tx_charge.
+     *
+     * @param size Size to uncharge
+     */
+    void tx_uncharge(unsigned int size);
+
+    /**
+     * @brief Check if there's room in the send buffer.
+     *
+     * @return True if there's room, else false.
+     */
+    bool tx_has_space() const
+    {
+        return tx_alloc < tx_max_buf;
+    }
+
+    /**
+     * @brief Start a MSG_ZEROCOPY send.
+     *
+     * @param msg_flags Flags passed to sendmsg
+     * @return The send's zerocopy_ctl, nullptr if this isn't a zerocopy send, or a negative error
+     * code.
+     */
+    expected<zerocopy_ctl *, int> zerocopy_begin(int msg_flags);
+
+    /**
+     * @brief Finish queueing a MSG_ZEROCOPY send, and drop the sender's reference to ctl.
+     *
+     * @param ctl The send's zerocopy_ctl (may be nullptr)
+     * @param queued True if the send succeeded. Sends that failed without queueing anything are
+     * dropped and never reported.
+     */
+    void zerocopy_end(zerocopy_ctl *ctl, bool queued)
+    {
+        if (!ctl)
+            return;
+
+        if (!queued && ctl->refs.load() == 1)
+            zerocopy->abort_send(ctl);
+        else
+            ctl->put();
+    }
+
+    /**
+     * @brief Read a message from the error queue (recvmsg(MSG_ERRQUEUE)). The message stays
+     * queued until consume_errqueue() is called, once it got to user space.
+     *
+     * @param msg Message header (with kernel pointers)
+     * @param err Filled with the error that was read, for consume_errqueue()
+     * @return 0 on success, -EAGAIN if the error queue is empty
+     */
+    ssize_t recv_errqueue(struct msghdr *msg, sock_extended_err &err);
+
+    /**
+     * @brief Dequeue a message read by recv_errqueue().
+     *
+     * @param err Error filled by recv_errqueue()
+     */
+    void consume_errqueue(const sock_extended_err &err);
+
+    /**
+     * @brief Poll the error queue.
+     *
+     * @param poll_file Poll file
+     * @return POLLERR if there's something in the error queue, else 0.
+     */
+    short poll_errqueue(void *poll_file);
+
 #define CONSUME_SOCK_ERR \
     if (has_sock_err())  \
     return consume_sock_err()
@@ -237,6 +364,45 @@ public:
     virtual int connect(sockaddr *addr, socklen_t addrlen, int flags);
     virtual ssize_t sendmsg(const struct msghdr *msg, int flags);
     virtual ssize_t recvmsg(struct msghdr *msg, int flags);
+
+    /**
+     * @brief Receive a batch of messages (recvmmsg).
+     * The default implementation calls recvmsg for every message. Sockets that can do better,
+     * e.g by taking the socket lock once for the whole batch, override this.
+     *
+     * @param umsgvec User array of mmsghdrs
+     * @param vlen Length of the array
+     * @param flags Flags passed to recvmmsg
+     * @param deadline Stop receiving after this point in time (may be nullptr)
+     * @return Number of messages received, or a negative error code
+     */
+    virtual int recvmmsg(struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                         const hrtime_t *deadline);
+
+    /**
+     * @brief Send a batch of messages (sendmmsg).
+     * The default implementation calls sendmsg for every message. Sockets that can do better,
+     * e.g by taking the socket lock once for the whole batch, override this.
+     *
+     * @param umsgvec User array of mmsghdrs
+     * @param vlen Length of the array
+     * @param flags Flags passed to sendmmsg
+     * @return Number of messages sent, or a negative error code
+     */
+    virtual int sendmmsg(struct mmsghdr *umsgvec, unsigned int vlen, int flags);
+
+    /**
+     * @brief Send part of a kernel page (splice, sendfile).
+     * The default implementation copies it through sendmsg. Sockets that can attach the page
+     * to their packets instead override this.
+     *
+     * @param page Page to send
+     * @param off Offset of the data inside the page
+     * @param len Length of the data
+     * @param flags MSG_* flags
+     * @return Number of bytes sent, or a negative error code
+     */
+    virtual ssize_t sendpage(struct page *page, unsigned int off, size_t len, int flags);
     virtual int getsockname(sockaddr *addr, socklen_t *addrlen);
     virtual int getpeername(sockaddr *addr, socklen_t *addrlen);
     virtual int shutdown(int how);
@@ -266,11 +432,57 @@ sockaddr &sa_generic(T &s)
 
 #define SOL_ICMP   800
 #define SOL_TCP    6
-#define SOL_UDP    21
+#define SOL_UDP    17
 #define SOL_ICMPV6 58
 
 void socket_init(struct socket *socket);
 
+/**
+ * @brief Check if a file is a socket.
+ *
+ * @param f File
+ * @return True if so, else false.
+ */
+bool file_is_socket(struct file *f);
+
+/**
+ * @brief Send part of a kernel page through a socket file (see socket::sendpage).
+ *
+ * @param f Socket file
+ * @param page Page to send
+ * @param off Offset of the data inside the page
+ * @param len Length of the data
+ * @return Number of bytes sent, or -1 with errno set
+ */
+ssize_t socket_sendpage(struct file *f, struct page *page, unsigned int off, size_t len);
+
+/**
+ * @brief Receive a batch of messages into a user mmsghdr array.
+ *
+ * @param sock Socket
+ * @param umsgvec User array of mmsghdrs
+ * @param vlen Length of the array
+ * @param flags Flags passed to recvmmsg
+ * @param deadline Stop receiving after this point in time (may be nullptr)
+ * @param recv Receives a single message, with kernel pointers
+ * @return Number of messages received, or a negative error code
+ */
+int socket_do_recvmmsg(socket *sock, struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                       const hrtime_t *deadline, ssize_t (*recv)(socket *, msghdr *, int));
+
+/**
+ * @brief Send a batch of messages from a user mmsghdr array.
+ *
+ * @param sock Socket
+ * @param umsgvec User array of mmsghdrs
+ * @param vlen Length of the array
+ * @param flags Flags passed to sendmmsg
+ * @param send Sends a single message, with kernel pointers
+ * @return Number of messages sent, or a negative error code
+ */
+int socket_do_sendmmsg(socket *sock, struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                       ssize_t (*send)(socket *, const msghdr *, int));
+
 // Internal representations of the shutdown state of the socket
 #define SHUTDOWN_RD   (1 << 0)
 #define SHUTDOWN_WR   (1 << 1)
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2020 Pedro Falcato
+ * Copyright (c) 2020 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -7,32 +7,76 @@
 #ifndef _ONYX_NET_SOCKET_TABLE_H
 #define _ONYX_NET_SOCKET_TABLE_H
 
+#include <onyx/list_nulls.h>
+#include <onyx/mutex.h>
 #include <onyx/net/inet_socket.h>
 #include <onyx/net/netif.h>
 #include <onyx/spinlock.h>
 
-#include <onyx/hashtable.hpp>
+#include <onyx/atomic.hpp>
 #include <onyx/utility.hpp>
 
+/* Initial number of buckets. Tables grow from here as sockets get added. */
 #ifndef CONFIG_SOCKET_HASHTABLE_SIZE
 #define CONFIG_SOCKET_HASHTABLE_SIZE 512
 #endif
 
+/* Sockets are hashed by (protocol, local port), so more buckets than ports is pointless */
+#define SOCKET_TABLE_MAX_BUCKETS 65536
+
+/* Number of writer locks. Must be a power of 2, no larger than CONFIG_SOCKET_HASHTABLE_SIZE,
+ * so a bucket always maps to the same lock regardless of the table's size.
+ */
+#define SOCKET_TABLE_NR_LOCKS 64
+
+struct socket_table_buckets
+{
+    unsigned int mask;
+    struct hlist_nulls_head *heads;
+};
+
+/**
+ * Inet socket lookup table.
+ * Lookups are lockless: they walk the hash chains under rcu_read_lock() and take a reference
+ * to the socket they find. Writers (bind, unbind) serialize on a per-bucket lock. Unhashed
+ * sockets stay around for a grace period (see inet_socket::operator delete), so lookups never
+ * walk into freed memory.
+ * The table doubles in size when it gets too loaded.
+ */
 class socket_table
 {
 private:
-    cul::hashtable2<struct inet_socket *, CONFIG_SOCKET_HASHTABLE_SIZE, uint32_t,
-                    &inet_socket::make_hash>
-        socket_hashtable;
-    struct spinlock lock_[CONFIG_SOCKET_HASHTABLE_SIZE];
+    /* The initial buckets live in the table, so tables can be statically allocated */
+    struct hlist_nulls_head initial_heads[CONFIG_SOCKET_HASHTABLE_SIZE];
+    socket_table_buckets initial;
+    socket_table_buckets *buckets;
+    /* Odd while the table is being rehashed */
+    atomic<unsigned int> seq;
+    atomic<unsigned int> nr_sockets;
+    struct mutex resize_lock;
+    struct spinlock lock_[SOCKET_TABLE_NR_LOCKS];
 
-public:
-    constexpr socket_table() : socket_hashtable{}, lock_{}
+    socket_table_buckets *get_buckets() const
     {
-        for (auto &l : lock_)
-            spinlock_init(&l);
+        return __atomic_load_n(&buckets, __ATOMIC_ACQUIRE);
     }
 
+    bool needs_grow() const
+    {
+        const auto b = get_buckets();
+        return nr_sockets.load(mem_order::relaxed) > (b->mask + 1) * 2 &&
+               b->mask + 1 < SOCKET_TABLE_MAX_BUCKETS;
+    }
+
+    void grow();
+
+    inet_socket *lookup(const socket_table_buckets *b, fnv_hash_t hash, const socket_id &id,
+                        unsigned int flags, unsigned int inst, bool *restart);
+    inet_socket *select_reuseport(const socket_table_buckets *b, fnv_hash_t hash,
+                                  inet_socket *first, const socket_id &id, unsigned int flags);
+
+public:
+    socket_table();
     ~socket_table() = default;
 
     CLASS_DISALLOW_MOVE(socket_table);
@@ -40,7 +84,7 @@ public:
 
     size_t index_from_hash(fnv_hash_t hash)
     {
-        return socket_hashtable.get_hashtable_index(hash);
+        return hash & (SOCKET_TABLE_NR_LOCKS - 1);
     }
 
     void lock(fnv_hash_t hash)
@@ -56,6 +100,24 @@ public:
     inet_socket *get_socket(const socket_id &id, unsigned int flags, unsigned int inst = 0);
     bool add_socket(inet_socket *sock, unsigned int flags);
     bool remove_socket(inet_socket *sock, unsigned int flags);
+
+    /**
+     * @brief Check if binding a socket to an id would conflict with another socket.
+     * Sockets that both set SO_REUSEPORT (and belong to the same user) don't conflict.
+     * Must be called with the bucket's lock held.
+     *
+     * @param id Socket id to bind to
+     * @param flags GET_SOCKET_* flags
+     * @param sock Socket that wants to bind
+     * @return True if the address is in use
+     */
+    bool bind_conflicts(const socket_id &id, unsigned int flags, const inet_socket *sock);
+
+    /**
+     * @brief Grow the table if it's too loaded. May sleep, so it must be called
+     * from process context, without any table locks held.
+     */
+    void maybe_grow();
 };
 
 #endif
@@ -332,6 +332,8 @@ private:
     struct list_head pending_out_packets;
     wait_queue tcp_ack_wq;
     wait_queue conn_wq;
+    /* Woken up when send buffer memory is released (i.e data got acked) */
+    wait_queue send_wq;
     uint32_t seq_number;
     uint32_t ack_number;
     uint32_t last_ack_number;
@@ -568,6 +570,7 @@ public:
     int handle_segment(const packet_handling_data &data);
 
     friend class tcp_packet;
+    friend struct tcp_pending_out;
 
     static constexpr uint16_t default_mss = 536;
     static constexpr uint16_t default_window_size_shift = 0;
@@ -576,7 +579,7 @@ public:
     tcp_socket()
         : inet_socket{}, state(tcp_state::TCP_STATE_CLOSED), type(SOCK_STREAM), packet_semaphore{},
           packet_list_head{}, packet_lock{}, tcp_ack_list_lock{}, pending_out_packets{},
-          tcp_ack_wq{}, conn_wq{}, seq_number{0}, ack_number{0}, current_pos{}, mss{default_mss},
+          tcp_ack_wq{}, conn_wq{}, send_wq{}, seq_number{0}, ack_number{0}, current_pos{}, mss{default_mss},
           window_size{0}, window_size_shift{default_window_size_shift}, our_window_size{UINT16_MAX},
           our_window_shift{default_window_size_shift}, expected_ack{0}, connection_pending{},
           pending_out{SOCK_STREAM}, pending_accept_list{}, nagle_enabled{false}, time_wait_timer{},
@@ -584,6 +587,7 @@ public:
           pending_out_lock{}
     {
         init_wait_queue_head(&conn_wq);
+        init_wait_queue_head(&send_wq);
         INIT_LIST_HEAD(&tcp_ack_list);
         init_wait_queue_head(&tcp_ack_wq);
         INIT_LIST_HEAD(&pending_out_packets);
@@ -628,6 +632,7 @@ public:
     }
 
     ssize_t sendmsg(const msghdr *msg, int flags) override;
+    ssize_t sendpage(struct page *page, unsigned int off, size_t len, int flags) override;
 
     uint32_t &sequence_nr()
     {
@@ -639,7 +644,8 @@ public:
         return ack_number;
     }
 
-    ssize_t queue_data(iovec *vec, int vlen, size_t count);
+    ssize_t queue_data(iovec *vec, int vlen, size_t count, zerocopy_ctl *zc);
+    int wait_for_tx_space(int flags);
 
     int setsockopt(int level, int opt, const void *optval, socklen_t optlen) override;
     int getsockopt(int level, int opt, void *optval, socklen_t *optlen) override;
@@ -728,6 +734,8 @@ struct tcp_pending_out : public refcountable
     struct clockevent timer;
     list_head_cpp<tcp_pending_out> node;
     unsigned int transmission_try{};
+    /* Send buffer memory charged to the socket for this segment */
+    unsigned int tx_charged{};
     union {
         tcp_socket *sock;
         tcp_connection_req *req;
@@ -790,6 +798,21 @@ struct tcp_pending_out : public refcountable
     {
         timer_cancel_event(&timer);
         list_remove(&node);
+        release_tx_mem();
+    }
+
+    /**
+     * @brief Give back the send buffer memory this segment was charged for
+     * Note: socket lock held
+     *
+     */
+    void release_tx_mem()
+    {
+        if (!tx_charged)
+            return;
+        sock->tx_uncharge(tx_charged);
+        tx_charged = 0;
+        wait_queue_wake_all(&sock->send_wq);
     }
 
     /**
@@ -32,8 +32,13 @@ struct udp_packet
     struct udp_packet *next;
 };
 
-#define UDP_CORK  1
-#define UDP_ENCAP 100
+#define UDP_CORK    1
+#define UDP_ENCAP   100
+#define UDP_SEGMENT 103
+#define UDP_GRO     104
+
+/* Maximum number of datagrams a single UDP_SEGMENT send may be split into */
+#define UDP_MAX_SEGMENTS 64
 
 #define UDP_ENCAP_ESPINUDP_NON_IKE 1
 #define UDP_ENCAP_ESPINUDP         2
@@ -64,15 +69,30 @@ class udp_socket : public inet_socket
     }
 
     template <typename AddrType>
-    ssize_t udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst);
+    ssize_t udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst, bool locked);
+
+    ssize_t do_sendmsg(const msghdr *msg, int flags, bool locked);
+
+    ssize_t recvmsg_locked(msghdr *msg, int flags);
+    packetbuf *next_gro_dgram(packetbuf *first, packetbuf *prev, size_t room);
 
     unsigned int wants_cork : 1;
+    /* Coalesce received datagrams (UDP_GRO) */
+    unsigned int wants_gro : 1;
+    /* Split sends into datagrams of this size (UDP_SEGMENT), 0 if disabled */
+    uint16_t gso_size;
 
     inet_cork cork;
 
 public:
-    udp_socket() : wants_cork{0}, cork{SOCK_DGRAM}
+    udp_socket() : wants_cork{0}, wants_gro{0}, gso_size{0}, cork{SOCK_DGRAM}
+    {
+    }
+
+    ~udp_socket() override
     {
+        /* The cork frees its packets by itself, but we charged them */
+        tx_uncharge(cork.truesize());
     }
 
     int bind(sockaddr *addr, socklen_t len) override;
@@ -83,6 +103,9 @@ public:
     int send_packet(const msghdr *msg, ssize_t payload_size, in_port_t source_port,
                     in_port_t dest_port, inet_route &route, int msg_domain);
     ssize_t recvmsg(msghdr *msg, int flags) override;
+    int recvmmsg(mmsghdr *umsgvec, unsigned int vlen, int flags,
+                 const hrtime_t *deadline) override;
+    int sendmmsg(mmsghdr *umsgvec, unsigned int vlen, int flags) override;
 
     void rx_dgram(packetbuf *buf);
 
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _ONYX_NET_ZEROCOPY_H
+#define _ONYX_NET_ZEROCOPY_H
+
+#include <stdint.h>
+
+#include <onyx/list.h>
+#include <onyx/refcount.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
+
+#include <onyx/atomic.hpp>
+
+#include <uapi/errqueue.h>
+
+/* Sends smaller than this get copied, since pinning the user's pages costs more than a copy */
+#define ZEROCOPY_MIN_SEND_SIZE 1024
+
+struct sock_zerocopy;
+
+/**
+ * @brief Tracks a single MSG_ZEROCOPY send.
+ * Every packetbuf that points to the user's pages holds a reference, and once the last one goes
+ * away (i.e the data was acked, or transmitted), the send gets reported as complete on the
+ * socket's error queue.
+ */
+struct zerocopy_ctl
+{
+    atomic<unsigned int> refs;
+    sock_zerocopy *owner;
+    /* Range of completed sends [lo, hi]. Neighbouring completions get merged. */
+    uint32_t lo;
+    uint32_t hi;
+    bool copied;
+    struct list_head list_node;
+
+    zerocopy_ctl(sock_zerocopy *owner, uint32_t id)
+        : refs{1}, owner{owner}, lo{id}, hi{id}, copied{false}, list_node{}
+    {
+    }
+
+    void *operator new(size_t length);
+    void operator delete(void *ptr);
+
+    void get()
+    {
+        refs.add_fetch(1, mem_order::relaxed);
+    }
+
+    /**
+     * @brief Drop a reference. Dropping the last one completes the send.
+     * May be called from any context.
+     */
+    void put();
+};
+
+/**
+ * @brief Per-socket MSG_ZEROCOPY state.
+ * This is refcounted separately from the socket, since packets can still be in flight
+ * after the socket is gone.
+ */
+struct sock_zerocopy : public refcountable
+{
+    struct spinlock lock;
+    /* List of zerocopy_ctl's that completed and weren't read yet */
+    struct list_head completed;
+    wait_queue wq;
+    /* Id of the next send */
+    atomic<uint32_t> next_id;
+
+    sock_zerocopy() : lock{}, next_id{0}
+    {
+        INIT_LIST_HEAD(&completed);
+        init_wait_queue_head(&wq);
+    }
+
+    ~sock_zerocopy() override;
+
+    void *operator new(size_t length);
+    void operator delete(void *ptr);
+
+    /**
+     * @brief Start tracking a new send.
+     *
+     * @return The new zerocopy_ctl, or nullptr if we're out of memory.
+     */
+    zerocopy_ctl *begin_send();
+
+    /**
+     * @brief Drop a send that didn't queue any data. It doesn't get reported, and its id
+     * gets reused if no other send started in the meanwhile.
+     *
+     * @param ctl The send's zerocopy_ctl, which must not be attached to any packet.
+     */
+    void abort_send(zerocopy_ctl *ctl);
+
+    /**
+     * @brief Queue a completed send on the error queue.
+     *
+     * @param ctl The send's zerocopy_ctl, which may get freed.
+     */
+    void complete(zerocopy_ctl *ctl);
+
+    /**
+     * @brief Look at the oldest completion, without dequeuing it.
+     *
+     * @param err Extended error to fill
+     * @return True if there was a completion, else false.
+     */
+    bool peek(sock_extended_err &err);
+
+    /**
+     * @brief Dequeue a completion that was returned by peek() and got to user space.
+     * Sends that got merged into it since then stay queued.
+     *
+     * @param err Extended error filled by peek()
+     */
+    void consume(const sock_extended_err &err);
+
+    bool has_completions() const
+    {
+        return !list_is_empty(&completed);
+    }
+};
+
+#endif
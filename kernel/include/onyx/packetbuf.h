@@ -11,8 +11,10 @@
 
 #include <stddef.h>
 
+#include <onyx/assert.h>
 #include <onyx/limits.h>
 #include <onyx/net/inet_route.h>
+#include <onyx/net/zerocopy.h>
 #include <onyx/page.h>
 #include <onyx/page_iov.h>
 #include <onyx/refcount.h>
@@ -21,7 +23,9 @@
 
 #define DEFAULT_HEADER_LEN 128
 
-struct vm_object;
+/* Heads up to this size get carved out of the per-cpu fragment cache */
+#define PACKETBUF_FRAG_MAX_SIZE (PAGE_SIZE / 2)
+#define PACKETBUF_FRAG_ALIGN    64
 
 #define PACKETBUF_GSO_TSO4 (1 << 0)
 #define PACKETBUF_GSO_TSO6 (1 << 1)
@@ -42,16 +46,19 @@ struct vm_object;
  *    fit in the head area.
  *
  *
- * Future design considerations:
- * 1) Future implementations of zero copy networking may need to reserve the first iov. It is then
- *    unclear if there are going to limitations in the packet's physical fragmentation of memory.
+ * Memory layout and accounting:
+ * Small packets don't get a whole page for their head area. allocate_space() carves the head out of
+ * a per-cpu page fragment cache, and every fragment holds its own reference to the backing page, so
+ * the page gets freed when the last packet that uses it goes away. Packets whose head doesn't fit in
+ * a fragment get a whole page, like before. truesize records how much memory the packetbuf is
+ * actually pinning, and is what gets charged against the socket's rx_max_buf/tx_max_buf.
  *
- * 2) The packetbufs don't yet account for memory. It's noteworthy that packetbufs have huge
- * internal fragmentation, since every page_iov has a single PAGE_SIZE'd page that may consume a lot
- * more memory than the actual packet's size. We should either: 1) Ignore any wastefulness(provides
- * less accurate bookkeeping) or 2) Add some kmalloc-like-thing that allocates a chunk of physically
- * contiguous memory. This would possibly require a new page allocator in an efficient
- * implementation.
+ * Zero copy:
+ * MSG_ZEROCOPY sends pin the user's pages and attach them to the data area, leaving the head area
+ * for the headers. Those packets are marked zero_copy and point to the send's zerocopy_ctl, which
+ * gets released when the packetbuf is freed. Since the data area isn't mapped linearly after the
+ * headers, such packets can only be sent through interfaces that do checksum offloading and must
+ * not need fragmenting.
  *
  */
 struct packetbuf : public refcountable
@@ -80,9 +87,9 @@ struct packetbuf : public refcountable
 
     uint16_t *csum_offset;
     unsigned char *csum_start;
-    vm_object *vmo;
 
     unsigned int header_length;
+    unsigned int truesize;
     uint16_t gso_size;
 
     uint8_t gso_flags;
@@ -91,6 +98,9 @@ struct packetbuf : public refcountable
     unsigned int zero_copy : 1;
     int domain;
 
+    /* MSG_ZEROCOPY send this packet's data belongs to, if any */
+    zerocopy_ctl *zc;
+
     list_head_cpp<packetbuf> list_node;
 
     union {
@@ -117,8 +127,8 @@ public:
     packetbuf()
         : refcountable{}, page_vec{}, phy_header{}, link_header{}, net_header{},
           transport_header{}, data{}, tail{}, end{}, buffer_start{}, csum_offset{nullptr},
-          csum_start{nullptr}, vmo{}, header_length{}, gso_size{}, gso_flags{},
-          needs_csum{0}, zero_copy{0}, domain{0}, list_node{this}
+          csum_start{nullptr}, header_length{}, truesize{sizeof(packetbuf)}, gso_size{},
+          gso_flags{}, needs_csum{0}, zero_copy{0}, domain{0}, zc{nullptr}, list_node{this}
     {
     }
 
@@ -142,6 +152,19 @@ public:
      */
     bool allocate_space(size_t length);
 
+    /**
+     * @brief Build the packet around the buffer a NIC received it in, instead of copying it out.
+     * Like allocate_space(), this is only meant to be called once, at initialisation.
+     * The packetbuf takes over the caller's reference to the page.
+     *
+     * @param page Page the packet was received in
+     * @param off Offset of the buffer in the page
+     * @param len Length of the packet
+     * @param size Size of the buffer
+     */
+    void attach_rx_buffer(struct page *page, unsigned int off, unsigned int len,
+                          unsigned int size);
+
     /**
      * @brief Reserve space for the headers.
      *
@@ -244,6 +267,41 @@ public:
      */
     ssize_t expand_buffer(const void *ubuf, unsigned int len);
 
+    /**
+     * @brief Expands the packet buffer by pinning the user's pages and attaching them to the data
+     * area, instead of copying. Marks the packetbuf as zero_copy.
+     *
+     * @param ubuf User address of the buffer.
+     * @param len Length of the buffer.
+     * @return The amount attached (which may be short if we ran out of page vectors), or a
+     * negative error code if we failed to attach anything.
+     */
+    ssize_t zerocopy_from_user(const void *ubuf, unsigned int len);
+
+    /**
+     * @brief Attach a kernel page (e.g from a pipe or the page cache) to the data area, taking a
+     * reference to it. Marks the packetbuf as zero_copy.
+     *
+     * @param page Page to attach.
+     * @param off Offset of the data inside the page.
+     * @param len Length of the data.
+     * @return True if attached, false if we ran out of page vectors.
+     */
+    bool attach_page(struct page *page, unsigned int off, unsigned int len);
+
+    /**
+     * @brief Attach a MSG_ZEROCOPY send to the packetbuf. It will get released when the packetbuf
+     * is freed.
+     *
+     * @param ctl The send's zerocopy_ctl
+     */
+    void attach_zerocopy(zerocopy_ctl *ctl)
+    {
+        DCHECK(zc == nullptr);
+        ctl->get();
+        zc = ctl;
+    }
+
     /**
      * @brief Counts all valid page vector entries.
      *
@@ -86,6 +86,15 @@ void paging_protect_kernel(void);
 void paging_free_page_tables(struct mm_address_space *mm);
 bool paging_write_protect(void *addr, struct mm_address_space *mm);
 int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages);
+
+/**
+ * @brief Write-protect every page mapped in a range, skipping page tables that don't exist.
+ *
+ * @param as The target address space
+ * @param addr Start of the range
+ * @param pages Number of pages
+ */
+void vm_mmu_write_protect(struct mm_address_space *as, void *addr, size_t pages);
 void *paging_unmap(void *memory);
 
 #ifdef __x86_64__
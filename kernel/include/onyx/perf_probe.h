@@ -13,6 +13,7 @@
 #include <stdint.h>
 
 #include <onyx/compiler.h>
+#include <onyx/scheduler.h>
 
 #include <uapi/perf_probe.h>
 
@@ -62,4 +63,27 @@ void perf_probe_commit_wait(const struct flame_graph_entry *fge);
  */
 void perf_probe_try_wait_trace(struct registers *regs);
 
+/**
+ * @brief Count a software event for a thread
+ *
+ * @param thread Thread
+ * @param event Event (PERF_COUNT_SW_*)
+ */
+static inline void perf_count_sw_thread(struct thread *thread, unsigned int event)
+{
+    thread->sw_counters[event]++;
+}
+
+/**
+ * @brief Count a software event for the current thread
+ *
+ * @param event Event (PERF_COUNT_SW_*)
+ */
+static inline void perf_count_sw(unsigned int event)
+{
+    struct thread *t = get_current_thread();
+    if (t)
+        perf_count_sw_thread(t, event);
+}
+
 #endif
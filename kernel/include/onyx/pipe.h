@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2017 - 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _ONYX_PIPE_H
+#define _ONYX_PIPE_H
+
+#include <onyx/list.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/refcount.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/utils.h>
+#include <onyx/vfs.h>
+#include <onyx/wait_queue.h>
+
+#include <uapi/fcntl.h>
+
+#include <onyx/utility.hpp>
+
+/* Writes may append to this buffer's page. Only set for pages the pipe allocated itself, since
+ * page cache pages and vmspliced user pages must never be written to.
+ */
+#define PIPE_BUF_CAN_MERGE (1 << 0)
+
+struct pipe_buffer
+{
+    struct page *page_;
+    struct list_head list_node;
+    unsigned int len_;
+    unsigned int offset_{0};
+    unsigned int flags_{0};
+
+    /**
+     * @brief Construct a new pipe buffer. The pipe buffer takes over a reference to the page.
+     *
+     * @param page Page that holds the data
+     * @param len Length of the data
+     * @param offset Offset of the data in the page
+     * @param flags PIPE_BUF_* flags
+     */
+    pipe_buffer(struct page *page, unsigned int len, unsigned int offset = 0,
+                unsigned int flags = 0)
+        : page_{page}, len_{len}, offset_{offset}, flags_{flags}
+    {
+    }
+
+    pipe_buffer() = delete;
+
+    CLASS_DISALLOW_COPY(pipe_buffer);
+    CLASS_DISALLOW_MOVE(pipe_buffer);
+
+    ~pipe_buffer()
+    {
+        page_unref(page_);
+    }
+
+    bool can_merge() const
+    {
+        return flags_ & PIPE_BUF_CAN_MERGE;
+    }
+
+    void *data() const
+    {
+        return (u8 *) PAGE_TO_VIRT(page_) + offset_;
+    }
+
+    void *operator new(size_t len);
+    void operator delete(void *ptr);
+};
+
+class pipe : public refcountable
+{
+private:
+    struct list_head pipe_buffers;
+    size_t buf_size;
+    size_t curr_len{0};
+    mutex pipe_lock;
+
+    wait_queue write_queue;
+    wait_queue read_queue;
+
+    bool can_read() const
+    {
+        return curr_len != 0;
+    }
+
+    bool can_read_or_eof() const
+    {
+        return can_read() || writer_count == 0;
+    }
+
+    bool can_write() const
+    {
+        return curr_len < buf_size;
+    }
+
+    bool can_write_or_broken() const
+    {
+        return curr_len < buf_size || reader_count == 0;
+    }
+
+    pipe_buffer *first_buf()
+    {
+        return container_of(list_first_element(&pipe_buffers), pipe_buffer, list_node);
+    }
+
+    ssize_t append(const void *ubuf, size_t len, bool atomic);
+
+    /**
+     * @brief Consume data from the head pipe buffer, and free it if it's now empty.
+     * Must be called with the pipe lock held.
+     *
+     * @param pbf The head pipe buffer
+     * @param len Length to consume
+     */
+    void consume(pipe_buffer *pbf, size_t len);
+
+    /**
+     * @brief Wait for space in the pipe. Must be called with the pipe lock held.
+     *
+     * @param flags File flags (O_NONBLOCK)
+     * @return Available space, or a negative error code (-EPIPE, -EAGAIN, -EINTR)
+     */
+    ssize_t wait_for_space(int flags);
+
+    /**
+     * @brief Wait for data in the pipe. Must be called with the pipe lock held.
+     *
+     * @param flags File flags (O_NONBLOCK)
+     * @return Length of the data in the pipe, 0 on EOF, or a negative error code
+     *         (-EAGAIN, -EINTR)
+     */
+    ssize_t wait_for_data(int flags);
+
+public:
+    size_t reader_count{1};
+    size_t writer_count{1};
+    pipe();
+    ~pipe() override;
+    ssize_t read(int flags, size_t len, void *buffer);
+    ssize_t write(int flags, size_t len, const void *buffer);
+    bool is_full() const;
+    size_t available_space() const;
+    void close_read_end();
+    void close_write_end();
+    short poll(void *poll_file, short events);
+
+    void wake_all(wait_queue *wq)
+    {
+        wait_queue_wake_all(wq);
+    }
+
+    size_t get_unread_len() const
+    {
+        return curr_len;
+    }
+
+    void *operator new(size_t len);
+    void operator delete(void *ptr);
+
+    void set_max_length(size_t len)
+    {
+        buf_size = len;
+    }
+
+    int get_capacity();
+    int set_capacity(size_t len);
+
+    int open_named(struct file *filp);
+
+    /**
+     * @brief Fill the pipe with pipe buffers produced by a callable, without copying.
+     * Blocks (unless O_NONBLOCK) until there's some space in the pipe, and returns a short
+     * count once the pipe fills up.
+     *
+     * @param flags File flags (O_NONBLOCK)
+     * @param len Maximum length to splice in
+     * @param fill Callable with signature ssize_t(size_t max_len, pipe_buffer **out). It
+     *             returns the length of the new pipe buffer, 0 if there's no more data, or a
+     *             negative error code. Called with the pipe lock held.
+     * @return Number of bytes spliced in, or a negative error code
+     */
+    template <typename Callable>
+    ssize_t splice_in(int flags, size_t len, Callable fill)
+    {
+        ssize_t ret = 0;
+        scoped_mutex g{pipe_lock};
+
+        while (len)
+        {
+            /* Only block if we haven't done anything yet */
+            ssize_t st = wait_for_space(ret ? flags | O_NONBLOCK : flags);
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            pipe_buffer *buf = nullptr;
+            st = fill(cul::min((size_t) st, len), &buf);
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            list_add_tail(&buf->list_node, &pipe_buffers);
+            curr_len += st;
+            ret += st;
+            len -= st;
+        }
+
+        g.unlock();
+
+        if (ret > 0)
+            wake_all(&read_queue);
+        return ret;
+    }
+
+    /**
+     * @brief Wait for space in the pipe, for splice sources that can block (sockets, ttys) and
+     * need to fill their pipe buffer without the pipe lock held. The buffer then gets added with
+     * splice_in_buffer().
+     *
+     * @param flags File flags (O_NONBLOCK)
+     * @return Available space, or a negative error code (-EPIPE, -EAGAIN, -EINTR)
+     */
+    ssize_t splice_in_wait(int flags);
+
+    /**
+     * @brief Add a pipe buffer that was filled without the pipe lock held (see splice_in_wait()).
+     * This never blocks, so the pipe may go over its capacity if someone else filled it in the
+     * meanwhile; that beats throwing away data we already consumed from the source.
+     *
+     * @param buf Pipe buffer. The pipe takes it over on success.
+     * @return Length of the buffer, or -EPIPE if there are no readers left
+     */
+    ssize_t splice_in_buffer(pipe_buffer *buf);
+
+    /**
+     * @brief Drain pipe buffers from the pipe into a callable, without copying them out first.
+     * Blocks (unless O_NONBLOCK) until there's some data in the pipe, and returns a short
+     * count once it runs dry or the callable does a short transfer.
+     *
+     * @param flags File flags (O_NONBLOCK)
+     * @param len Maximum length to splice out
+     * @param drain Callable with signature ssize_t(pipe_buffer *buf, size_t len). It returns
+     *              the number of bytes it consumed from the buffer, or a negative error code.
+     *              Called with the pipe lock held.
+     * @return Number of bytes spliced out, 0 on EOF, or a negative error code
+     */
+    template <typename Callable>
+    ssize_t splice_out(int flags, size_t len, Callable drain)
+    {
+        ssize_t ret = 0;
+        scoped_mutex g{pipe_lock};
+
+        while (len)
+        {
+            ssize_t st = wait_for_data(ret ? flags | O_NONBLOCK : flags);
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            auto pbf = first_buf();
+            const size_t to_drain = cul::min((size_t) pbf->len_, len);
+
+            st = drain(pbf, to_drain);
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            consume(pbf, st);
+            ret += st;
+            len -= st;
+
+            if ((size_t) st < to_drain)
+                break;
+        }
+
+        g.unlock();
+
+        if (ret > 0)
+            wake_all(&write_queue);
+        return ret;
+    }
+
+    /**
+     * @brief Move (or with tee, duplicate) pipe buffers from this pipe to another one.
+     * Only page references get passed around, data is never copied.
+     *
+     * @param dst Destination pipe
+     * @param len Maximum length to move
+     * @param flags File flags (O_NONBLOCK)
+     * @param tee If true, leave the data in this pipe
+     * @return Number of bytes moved, 0 on EOF, or a negative error code
+     */
+    ssize_t move_to(pipe *dst, size_t len, int flags, bool tee);
+};
+
+/**
+ * @brief Get the pipe behind a file.
+ *
+ * @param f File
+ * @return The pipe, or nullptr if the file isn't a pipe
+ */
+pipe *file_to_pipe(struct file *f);
+
+#endif
@@ -17,6 +17,14 @@
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
                                      struct pci_msi_data *data);
 
+/**
+ * @brief Route an MSI message, allocated by platform_allocate_msi_interrupts, to a cpu
+ *
+ * @param data MSI data, whose address gets adjusted
+ * @param cpu Target cpu
+ */
+void platform_msi_set_target(struct pci_msi_data *data, unsigned int cpu);
+
 int platform_install_irq(unsigned int irqn, struct interrupt_handler *h);
 void platform_mask_irq(unsigned int irq);
 
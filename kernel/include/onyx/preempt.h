@@ -14,6 +14,7 @@
 #include <platform/irq.h>
 
 void sched_enable_pulse();
+void sched_disable_pulse();
 
 void sched_handle_preempt(bool may_softirq);
 
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_RCU_H
+#define _ONYX_RCU_H
+
+#include <onyx/compiler.h>
+#include <onyx/preempt.h>
+
+struct rcu_head
+{
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+/**
+ * @brief Enter an RCU read-side critical section.
+ * Readers just can't context switch, so this is a preemption-disabled region. It nests, and
+ * can't sleep.
+ */
+__always_inline void rcu_read_lock()
+{
+    sched_disable_preempt();
+}
+
+/**
+ * @brief Leave an RCU read-side critical section.
+ */
+__always_inline void rcu_read_unlock()
+{
+    sched_enable_preempt();
+}
+
+/* Load an RCU-protected pointer. Only valid inside rcu_read_lock(), or with the update-side lock
+ * held.
+ */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* Publish an RCU-protected pointer. Everything stored to the pointed-to object beforehand is
+ * visible to readers that see the new pointer.
+ */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/**
+ * @brief Call func after a grace period, i.e once every reader that may be looking at the object
+ * is done. Callbacks run in softirq context, so they can't sleep.
+ *
+ * @param head rcu_head embedded in the object
+ * @param func Callback
+ */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/**
+ * @brief Wait for a full grace period to elapse. Sleeps.
+ */
+void synchronize_rcu();
+
+/**
+ * @brief Report a quiescent state for this cpu. Called by the scheduler on context switches and
+ * by the idle loop.
+ */
+void rcu_qs();
+
+/**
+ * @brief Move this cpu's callbacks along, and kick off grace periods for them.
+ * Called from the tick and the idle loop.
+ */
+void rcu_check_callbacks();
+
+/**
+ * @brief Check if this cpu has callbacks waiting, and thus can't stop its tick.
+ */
+bool rcu_needs_cpu();
+
+/**
+ * @brief Invoke this cpu's finished callbacks. The RCU softirq handler.
+ */
+void rcu_do_callbacks();
+
+#endif
@@ -38,6 +38,26 @@ public:
         return __refcount.add_fetch(1, mem_order::acquire);
     }
 
+    /**
+     * @brief Take a reference, unless the object is already being destroyed (refcount 0).
+     * Useful for lockless lookups that can find objects whose last reference is gone.
+     *
+     * @return True if we got a reference, false if the object is dying
+     */
+    bool ref_not_zero()
+    {
+        unsigned long refs = __refcount.load(mem_order::relaxed);
+
+        do
+        {
+            if (refs == 0)
+                return false;
+        } while (!__refcount.compare_exchange_weak(refs, refs + 1, mem_order::acquire,
+                                                   mem_order::relaxed));
+
+        return true;
+    }
+
     unsigned long refer_multiple(unsigned long n)
     {
         return __refcount.add_fetch(n, mem_order::acquire);
@@ -24,6 +24,7 @@ static inline void mov_non_temporal(volatile Type *p, Type val)
 #define RISCV_SIE      "sie"
 #define RISCV_SIP      "sip"
 #define RISCV_SSCRATCH "sscratch"
+#define RISCV_SCOUNTEREN "scounteren"
 
 #define riscv_read_csr(register)                               \
     ({                                                         \
@@ -52,6 +53,8 @@ static inline uint64_t riscv_get_time()
     return riscv_read_csr(RISCV_TIME);
 }
 
+#define RISCV_SCOUNTEREN_TM (1 << 1) // 1 = U-mode can read the time CSR
+
 #define RISCV_SIE_SSIE (1 << 1)
 #define RISCV_SIE_STIE (1 << 5)
 #define RISCV_SIE_SEIE (1 << 9)
@@ -20,6 +20,9 @@
 #include <onyx/preempt.h>
 #include <onyx/signal.h>
 #include <onyx/spinlock.h>
+#include <onyx/workqueue.h>
+
+#include <uapi/perf_probe.h>
 
 #define NUM_PRIO 40
 
@@ -37,6 +40,9 @@ struct kcov_data;
 #define THREAD_STRUCT_CANARY 0xcacacacafdfddead
 #define THREAD_DEAD_CANARY   0xdeadbeefbeefdead
 
+struct worker;
+struct futex_pi_state;
+
 using thread_t = struct thread
 {
     unsigned long refcount;
@@ -70,6 +76,20 @@ using thread_t = struct thread
 
     struct thread_cputime_info cputime_info;
     mm_address_space *aspace{};
+    /* Set if this thread is a workqueue worker */
+    struct worker *wq_worker{};
+    /* Used to finish tearing down the thread, after it's dead */
+    struct work_struct destroy_work;
+    /* PI futexes owned by this thread, and the priority it had before they boosted it (or -1).
+     * pi_exiting gets set once the thread has started dropping them on exit, after which it can't
+     * be given new ones. Protected by the futex PI lock.
+     */
+    struct futex_pi_state *pi_owned{};
+    int pi_saved_prio{-1};
+    bool pi_exiting{};
+    /* Software event counts (PERF_COUNT_SW_*), and the cpu the thread last ran on */
+    unsigned long sw_counters[PERF_COUNT_SW_MAX]{};
+    unsigned int last_cpu{-1U};
 
 #ifdef CONFIG_KCOV
     struct kcov_data *kcov_data{nullptr};
@@ -162,6 +182,14 @@ void sched_wake_up_available_threads(void);
 
 void sched_block(struct thread *thread);
 
+/**
+ * @brief Change a thread's priority, requeueing it if it's waiting to run.
+ *
+ * @param thread Thread
+ * @param prio New priority
+ */
+void sched_set_priority(struct thread *thread, int prio);
+
 void __sched_block(struct thread *thread, unsigned long cpuflags);
 
 void thread_exit();
@@ -172,6 +200,15 @@ void sched_start_thread_for_cpu(struct thread *thread, unsigned int cpu);
 
 void sched_init_cpu(unsigned int cpu);
 
+/**
+ * @brief Check if a cpu has threads waiting to run (besides the current one and the idle thread).
+ * Racy, unless the cpu's scheduler lock is held.
+ *
+ * @param cpu CPU
+ * @return True if there are queued threads
+ */
+bool sched_cpu_has_queued_threads(unsigned int cpu);
+
 void thread_append_to_global_list(struct thread *t);
 
 void thread_remove_from_list(struct thread *t);
@@ -13,6 +13,7 @@
 
 #include <onyx/tty.h>
 #include <onyx/wait_queue.h>
+#include <onyx/workqueue.h>
 
 class serial_port
 {
@@ -32,6 +33,10 @@ protected:
     uint8_t byte_buf[100];
     size_t byte_buf_size;
     tty *tty_;
+    /* Hands received bytes to the tty, outside of IRQ context */
+    work_struct rx_work;
+
+    static void rx_work_fn(work_struct *work);
     /**
      * @brief Sets the baud rate
      *
@@ -51,6 +56,7 @@ public:
     {
         nr = allocate_serial_index();
         spinlock_init(&bytebuf_lock);
+        INIT_WORK(&rx_work, rx_work_fn);
     }
 
     void dispatch();
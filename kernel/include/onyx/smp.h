@@ -25,6 +25,11 @@ void set_online(unsigned int cpu);
 void boot(unsigned int cpu);
 unsigned int get_online_cpus();
 
+/**
+ * @brief Get the mask of online cpus
+ */
+const cpumask &get_online_cpumask();
+
 void boot_cpus();
 
 using sync_call_func = void (*)(void *context);
@@ -14,7 +14,9 @@
 enum softirq_vector
 {
     SOFTIRQ_VECTOR_TIMER = 0,
-    SOFTIRQ_VECTOR_NETRX
+    SOFTIRQ_VECTOR_NETRX,
+    SOFTIRQ_VECTOR_RCU,
+    SOFTIRQ_NR_VECTORS
 };
 
 void softirq_raise(enum softirq_vector vec);
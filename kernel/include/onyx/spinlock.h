@@ -27,13 +27,30 @@
 
 typedef unsigned int raw_spinlock_t;
 
+/* The lock word is split in two: the low half has the owner (cpu + 1, 0 if unlocked) and the high
+ * half has the tail of the queue of waiters (see kernel/spinlock.cpp), 0 if there's none.
+ */
+#define SPINLOCK_OWNER_MASK 0xffffU
+#define SPINLOCK_TAIL_SHIFT 16
+
 struct spinlock
 {
-    /* TODO: Conditionally have these debug features, and have owner_cpu be in lock */
-    raw_spinlock_t lock;
+    union {
+        raw_spinlock_t lock;
+        struct
+        {
+            /* Only valid on little endian */
+            unsigned short owner;
+            unsigned short tail;
+        };
+    };
 #ifdef CONFIG_SPINLOCK_DEBUG
     unsigned long holder;
 #endif
+#ifdef CONFIG_LOCKSTAT
+    void *lockstat_class;
+    unsigned long lockstat_acquired;
+#endif
 };
 
 #ifdef __cplusplus
@@ -56,6 +73,9 @@ CONSTEXPR static inline void spinlock_init(struct spinlock *s)
 #ifdef CONFIG_SPINLOCK_DEBUG
     s->holder = 0xDEADCAFEDEADCAFE;
 #endif
+#ifdef CONFIG_LOCKSTAT
+    s->lockstat_class = NULL;
+#endif
 
     s->lock = 0;
 }
@@ -79,7 +99,7 @@ static inline void spin_unlock_irqrestore(struct spinlock *lock, unsigned long o
 
 static inline bool spin_lock_held(struct spinlock *lock)
 {
-    return lock->lock == get_cpu_nr() + 1;
+    return lock->owner == get_cpu_nr() + 1;
 }
 
 static inline void spin_lock(struct spinlock *lock)
@@ -20,8 +20,12 @@ struct file;
 
 struct blockdev;
 
-#define SB_FLAG_NODIRTY   (1 << 0)
-#define SB_FLAG_IN_MEMORY (1 << 1)
+/* SB_FLAG_NEGATIVE_DENTRIES: The namespace only ever changes through the VFS, so failed lookups
+ * can be cached.
+ */
+#define SB_FLAG_NODIRTY           (1 << 0)
+#define SB_FLAG_IN_MEMORY         (1 << 1)
+#define SB_FLAG_NEGATIVE_DENTRIES (1 << 2)
 
 struct superblock
 {
@@ -32,6 +36,10 @@ struct superblock
     int (*flush_inode)(struct inode *inode);
     int (*kill_inode)(struct inode *inode);
     int (*statfs)(struct statfs *buf, superblock *sb);
+    /* Called on sync(2) and shutdown, before writeback, to push out anything the filesystem
+     * holds back on its own (optional).
+     */
+    int (*sync_fs)(struct superblock *sb);
     unsigned int s_block_size;
     struct blockdev *s_bdev;
     dev_t s_devnr;
@@ -46,6 +54,12 @@ void superblock_add_inode(struct superblock *sb, struct inode *inode);
 void superblock_remove_inode(struct superblock *sb, struct inode *inode);
 void superblock_kill(struct superblock *sb);
 
+/**
+ * @brief Calls sync_fs on every mounted filesystem
+ *
+ */
+void superblock_sync_all();
+
 struct page_iov;
 
 int sb_read_bio(struct superblock *sb, struct page_iov *vec, size_t nr_vecs, size_t block_number);
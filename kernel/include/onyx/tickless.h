@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_TICKLESS_H
+#define _ONYX_TICKLESS_H
+
+struct clockevent;
+
+/**
+ * @brief Stop the scheduler tick, if there's nothing else to run.
+ * Called by the idle thread before halting. Only the next real clockevent is left programmed.
+ */
+void tick_nohz_idle_enter(void);
+
+/**
+ * @brief Stop the tick on an adaptive-tick (nohz_full) cpu that only has one runnable thread.
+ * Called by the tick itself.
+ *
+ * @param pulse The scheduler's pulse clockevent. It's not requeued if the tick stops.
+ */
+void tick_nohz_stop_busy(struct clockevent *pulse);
+
+/**
+ * @brief Restart the tick if it was stopped. Called on context switches, with IRQs disabled.
+ */
+void tick_nohz_task_switch(void);
+
+/**
+ * @brief Make sure a cpu that just got a thread queued has its tick running.
+ * Must be called after queueing the thread.
+ *
+ * @param cpu CPU the thread got queued on
+ */
+void tick_nohz_kick(unsigned int cpu);
+
+#endif
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2016, 2017 Pedro Falcato
+ * Copyright (c) 2016 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -21,6 +21,13 @@ void ndelay(unsigned int ns);
 #define CLOCKEVENT_FLAG_PULSE \
     (1 << 2) /* Automatically requeue the same struct (that was modified by the cb) */
 #define CLOCKEVENT_FLAG_POISON (1 << 3)
+/* Coarse timeout (retransmits, expiries, ...). Goes on the timer wheel, and may fire up to
+ * 1/8th of its timeout late.
+ */
+#define CLOCKEVENT_FLAG_COARSE (1 << 4)
+
+/* Default slack for sleeps, so wakeups close to each other get batched in the same interrupt */
+#define TIMER_SLACK_DEFAULT (50 * NS_PER_US)
 
 struct timer;
 
@@ -33,10 +40,23 @@ struct clockevent
     {
     };
     hrtime_t deadline;
+    /* The event may fire up to slack ns after its deadline. Hrtimers are ordered by
+     * deadline + slack, and expire as soon as their deadline passes, so events with
+     * overlapping windows get handled in one go.
+     */
+    hrtime_t slack{0};
     void *priv;
     unsigned int flags;
     void (*callback)(struct clockevent *ev);
+    /* Wheel bucket or softirq list linkage */
     struct list_head list_node;
+    /* Pairing heap linkage. heap_prev points to the left sibling, or the parent for the
+     * first child.
+     */
+    struct clockevent *heap_child{nullptr};
+    struct clockevent *heap_next{nullptr};
+    struct clockevent *heap_prev{nullptr};
+    unsigned int wheel_idx{0};
     struct timer *timer;
 
     ~clockevent()
@@ -48,13 +68,57 @@ struct clockevent
 
 #define TIMER_NEXT_EVENT_NOT_PENDING UINT64_MAX
 
+/* The wheel has TIMER_WHEEL_LVL_DEPTH levels of TIMER_WHEEL_LVL_SIZE buckets. Each level is
+ * 8 times coarser than the one below it. Timers never cascade between levels: they're put in the
+ * level whose granularity fits their timeout, and expire straight from there.
+ */
+#define TIMER_WHEEL_TICK          NS_PER_MS
+#define TIMER_WHEEL_LVL_CLK_SHIFT 3
+#define TIMER_WHEEL_LVL_BITS      6
+#define TIMER_WHEEL_LVL_SIZE      (1UL << TIMER_WHEEL_LVL_BITS)
+#define TIMER_WHEEL_LVL_DEPTH     8
+#define TIMER_WHEEL_SIZE          (TIMER_WHEEL_LVL_SIZE * TIMER_WHEEL_LVL_DEPTH)
+
+struct timer_wheel
+{
+    /* Next tick to be processed */
+    unsigned long clk;
+    /* Tick of the first bucket that needs processing, ULONG_MAX if empty */
+    unsigned long next_expiry;
+    unsigned long nr_events;
+    unsigned long pending[TIMER_WHEEL_SIZE / (8 * sizeof(unsigned long))];
+    struct list_head buckets[TIMER_WHEEL_SIZE];
+};
+
+struct timer_stats
+{
+    unsigned long hrtimer_expirations;
+    unsigned long wheel_expirations;
+    /* Expirations that got handled before their deadline + slack, batched with another */
+    unsigned long coalesced;
+    unsigned long softirq_expirations;
+    unsigned long nr_hrtimers;
+    unsigned long max_hrtimers;
+    unsigned long nr_wheel;
+    unsigned long max_wheel;
+    /* Updated by the tickless code, see kernel/time/tickless.cpp */
+    unsigned long tick_stops;
+    unsigned long ticks_skipped_idle;
+    unsigned long ticks_skipped_busy;
+};
+
 struct timer
 {
     const char *name;
     hrtime_t next_event;
     void *priv;
-    struct list_head event_list;
+    /* Pairing heap of hrtimers, ordered by deadline + slack */
+    struct clockevent *hrtimers;
+    struct timer_wheel wheel;
+    /* Expired non-atomic events, waiting for the timer softirq */
+    struct list_head softirq_list;
     struct spinlock event_list_lock;
+    struct timer_stats stats;
     void (*set_oneshot)(hrtime_t in_future);
     void (*set_periodic)(unsigned long freq);
     void (*disable_timer)(void);
@@ -62,7 +126,31 @@ struct timer
 };
 
 struct timer *platform_get_timer(void);
+
+/**
+ * @brief Initialise a cpu's timer queues. Called by the platform code, on the timer's cpu.
+ *
+ * @param t Timer
+ */
+void timer_init(struct timer *t);
+
 void timer_queue_clockevent(struct clockevent *ev);
 void timer_handle_events(struct timer *t);
 
+/**
+ * @brief Reprogram the timer for its next event. Used after cancelling events, which normally
+ * leaves the timer programmed as it was.
+ *
+ * @param t Timer (must be the current cpu's)
+ */
+void timer_reprogram(struct timer *t);
+
+/**
+ * @brief Change the deadline of a clockevent, (re)queueing it.
+ *
+ * @param ev Clockevent
+ * @param deadline New deadline
+ */
+void timer_mod_event(struct clockevent *ev, hrtime_t deadline);
+
 #endif
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 Pedro Falcato
+ * Copyright (c) 2017 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -14,22 +14,80 @@
 
 #include <fixed_point/fixed_point.h>
 
-struct vdso_time
+/* vdso_data::clock_mode */
+/* There's no counter userspace can read, every clock_gettime is a system call */
+#define VDSO_CLOCK_MODE_NONE    0
+/* The arch's cycle counter (TSC, the time CSR, CNTVCT_EL0) can be read from userspace */
+#define VDSO_CLOCK_MODE_COUNTER 1
+
+/* vdso_data::flags */
+/* getcpu can be answered from userspace (x86: TSC_AUX holds the cpu number) */
+#define VDSO_FLAG_GETCPU (1 << 0)
+
+/**
+ * Time data shared with the vDSO. The kernel updates it under a seqcount: seq is odd while an
+ * update is in progress, and readers retry if seq changed while they were reading.
+ */
+struct vdso_data
 {
+    unsigned int seq;
+    unsigned int clock_mode;
+    unsigned int flags;
+    /* CLOCK_MONOTONIC = mono_offset + counter * ticks_per_ns, exactly like the clocksource does */
     struct fp_32_64 ticks_per_ns;
+    hrtime_t mono_offset;
+    /* CLOCK_REALTIME = CLOCK_MONOTONIC + realtime_offset (modulo 2^64) */
+    hrtime_t realtime_offset;
+    /* CLOCK_MONOTONIC as of the last tick, for the _COARSE clocks */
+    hrtime_t coarse_mono;
+};
+
+static inline void vdso_relax(void)
+{
 #ifdef __x86_64__
-    bool using_tsc;
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
 #endif
-};
+}
 
-struct vdso_clock_time
+static inline unsigned int vdso_read_begin(const struct vdso_data *vd)
 {
-    time_t epoch;
-    hrtime_t tick;
-};
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&vd->seq, __ATOMIC_ACQUIRE)) & 1)
+        vdso_relax();
+
+    return seq;
+}
+
+static inline bool vdso_read_retry(const struct vdso_data *vd, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&vd->seq, __ATOMIC_RELAXED) != seq;
+}
 
 void vdso_init(void);
 void *vdso_map(void);
 int vdso_update_time(clockid_t id, struct clock_time *time);
 
+/**
+ * @brief Tell the vDSO about a new main clocksource.
+ *
+ * @param clk Clocksource
+ */
+void vdso_update_clocksource(struct clocksource *clk);
+
+/**
+ * @brief Update the vDSO's coarse clocks.
+ *
+ * @param now Current CLOCK_MONOTONIC time
+ */
+void vdso_update_coarse(hrtime_t now);
+
+/**
+ * @brief Enable the vDSO's getcpu fast path. Called by arch code, once every cpu can answer it.
+ */
+void vdso_enable_getcpu(void);
+
 #endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_VDSO_GETTIME_H
+#define _ONYX_VDSO_GETTIME_H
+
+/* Generic vDSO time code, included by every arch's __vdso.c (and nothing else).
+ * The arch provides, before including this header:
+ *  - uint64_t vdso_read_counter(void): reads the cycle counter the main clocksource is built on
+ *  - long __vdso_syscall(long nr, ...): the system call fallback
+ *  - Optionally, VDSO_ARCH_HAS_GETCPU and unsigned int vdso_arch_getcpu(void)
+ */
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <onyx/clock.h>
+#include <onyx/gen/syscall.h>
+#include <onyx/vdso.h>
+
+#include <fixed_point/fixed_point.h>
+
+/* Updated by the kernel, see kernel/vdso.cpp. Hidden, so we don't go through the GOT */
+__attribute__((visibility("hidden"))) struct vdso_data __vdso_data = {0};
+
+struct timezone;
+
+long __vdso_syscall(long number, ...);
+
+static inline hrtime_t vdso_counter_ns(const struct vdso_data *vd)
+{
+    return vd->mono_offset + u64_mul_u64_fp32_64(vdso_read_counter(), vd->ticks_per_ns);
+}
+
+static int vdso_do_clock_gettime(clockid_t clk_id, struct timespec *tp)
+{
+    const struct vdso_data *vd = &__vdso_data;
+    unsigned int seq;
+    hrtime_t t;
+
+    switch (clk_id)
+    {
+        case CLOCK_REALTIME:
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_BOOTTIME:
+            do
+            {
+                seq = vdso_read_begin(vd);
+                if (vd->clock_mode == VDSO_CLOCK_MODE_NONE)
+                    return __vdso_syscall(__NR_clock_gettime, clk_id, tp);
+
+                t = vdso_counter_ns(vd);
+                if (clk_id == CLOCK_REALTIME)
+                    t += vd->realtime_offset;
+            } while (vdso_read_retry(vd, seq));
+            break;
+
+        case CLOCK_REALTIME_COARSE:
+        case CLOCK_MONOTONIC_COARSE:
+            do
+            {
+                seq = vdso_read_begin(vd);
+                t = vd->coarse_mono;
+                if (clk_id == CLOCK_REALTIME_COARSE)
+                    t += vd->realtime_offset;
+            } while (vdso_read_retry(vd, seq));
+            break;
+
+        default:
+            return __vdso_syscall(__NR_clock_gettime, clk_id, tp);
+    }
+
+    hrtime_to_timespec(t, tp);
+    return 0;
+}
+
+static int vdso_do_gettimeofday(struct timeval *tv, struct timezone *tz)
+{
+    if (tv)
+    {
+        struct timespec tp;
+        int st = vdso_do_clock_gettime(CLOCK_REALTIME, &tp);
+        if (st < 0)
+            return st;
+
+        tv->tv_sec = tp.tv_sec;
+        tv->tv_usec = tp.tv_nsec / NS_PER_US;
+    }
+
+    return 0;
+}
+
+static time_t vdso_do_time(time_t *s)
+{
+    struct timespec tp;
+    vdso_do_clock_gettime(CLOCK_REALTIME_COARSE, &tp);
+
+    if (s)
+        *s = tp.tv_sec;
+    return tp.tv_sec;
+}
+
+static int vdso_do_getcpu(unsigned int *cpu, unsigned int *node, void *tcache)
+{
+#ifdef VDSO_ARCH_HAS_GETCPU
+    if (__atomic_load_n(&__vdso_data.flags, __ATOMIC_RELAXED) & VDSO_FLAG_GETCPU)
+    {
+        if (cpu)
+            *cpu = vdso_arch_getcpu();
+        if (node)
+            *node = 0;
+        return 0;
+    }
+#endif
+
+    return __vdso_syscall(__NR_getcpu, cpu, node, tcache);
+}
+
+#endif
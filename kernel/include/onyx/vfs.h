@@ -15,6 +15,7 @@
 
 #include <onyx/mm/vm_object.h>
 #include <onyx/object.h>
+#include <onyx/rcu.h>
 #include <onyx/rwlock.h>
 #include <onyx/superblock.h>
 #include <onyx/vm.h>
@@ -74,6 +75,8 @@ struct file_ops
                          size_t len);
     int (*fcntl)(struct file *filp, int cmd, unsigned long arg);
     void (*release)(struct file *filp);
+    /* O_DIRECT reads and writes, straight between the user's buffer and the disk */
+    ssize_t (*direct_io)(size_t off, size_t len, void *ubuf, unsigned int flags, struct file *f);
 };
 
 struct getdents_ret
@@ -153,6 +156,8 @@ struct file
     unsigned int f_flags;
     struct dentry *f_dentry;
     void *private_data;
+    /* Files are freed after a grace period, as fd lookups are lockless */
+    struct rcu_head f_rcu;
 };
 
 int inode_create_vmo(struct inode *ino);
@@ -262,11 +267,33 @@ bool file_can_access(struct file *file, unsigned int perms);
 bool fd_may_access(struct file *f, unsigned int access);
 
 struct page_cache_block;
-struct page_cache_block *inode_get_page(struct inode *inode, off_t offset, long flags);
+struct page_cache_block *inode_get_page(struct inode *inode, size_t offset, long flags);
+bool inode_is_cacheable(struct inode *file);
 
 struct file *inode_to_file(struct inode *ino);
 int inode_truncate_range(struct inode *inode, size_t start, size_t end);
 
+/**
+ * @brief Write back the dirty cached pages of a range of the file
+ *
+ * @param inode Inode
+ * @param start Start of the range
+ * @param end End of the range (exclusive)
+ * @return 0 on success, negative error codes
+ */
+int inode_sync_range(struct inode *inode, size_t start, size_t end);
+
+/**
+ * @brief Write back and drop the cached pages of a range of the file, so the next access
+ * goes to the disk. Partially covered pages go too.
+ *
+ * @param inode Inode
+ * @param start Start of the range
+ * @param end End of the range (exclusive)
+ * @return 0 on success, negative error codes
+ */
+int inode_invalidate_range(struct inode *inode, size_t start, size_t end);
+
 struct filesystem_root
 {
     struct object object;
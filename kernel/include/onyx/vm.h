@@ -477,6 +477,18 @@ ssize_t copy_from_user(void *data, const void *usr, size_t len);
 ssize_t user_memset(void *data, int val, size_t len);
 }
 
+/**
+ * @brief Copies data from user space, without faulting pages in.
+ * Meant for contexts that can't take page faults (e.g irq handlers). Fails if the memory isn't
+ * mapped in already.
+ *
+ * @param data The destination kernel pointer.
+ * @param usr The source user space pointer.
+ * @param len The length of the copy, in bytes.
+ * @return 0 if successful, -EFAULT if not.
+ */
+ssize_t copy_from_user_nofault(void *data, const void *usr, size_t len);
+
 /**
  * @brief Sets up backing for a newly-mmaped region.
  *
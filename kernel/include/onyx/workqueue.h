@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_WORKQUEUE_H
+#define _ONYX_WORKQUEUE_H
+
+#include <stdbool.h>
+
+#include <onyx/list.h>
+#include <onyx/timer.h>
+
+struct work_struct;
+struct workqueue;
+
+typedef void (*work_func_t)(struct work_struct *work);
+
+/* work_struct::data holds the pool_workqueue the work is queued on, plus these flags */
+#define WORK_STRUCT_PENDING (1UL << 0)
+#define WORK_STRUCT_FLAGS   (WORK_STRUCT_PENDING)
+
+/* A unit of deferred work. Work items are embedded in whatever they operate on (use
+ * container_of to get to it), so queueing them never allocates and can't fail.
+ * A work item can only be queued once at a time, but it may requeue itself while it runs.
+ */
+struct work_struct
+{
+    unsigned long data;
+    struct list_head entry;
+    work_func_t func;
+};
+
+struct delayed_work
+{
+    struct work_struct work;
+    struct clockevent timer;
+    struct workqueue *wq;
+    unsigned int cpu;
+};
+
+#define INIT_WORK(w, f)                   \
+    do                                    \
+    {                                     \
+        (w)->data = 0;                    \
+        INIT_LIST_HEAD(&(w)->entry);      \
+        (w)->func = (f);                  \
+    } while (0)
+
+#define INIT_DELAYED_WORK(dw, f)           \
+    do                                     \
+    {                                      \
+        INIT_WORK(&(dw)->work, f);         \
+        (dw)->timer.flags = 0;             \
+        (dw)->timer.timer = nullptr;       \
+        (dw)->wq = nullptr;                \
+    } while (0)
+
+static inline bool work_pending(const struct work_struct *work)
+{
+    return __atomic_load_n(&work->data, __ATOMIC_RELAXED) & WORK_STRUCT_PENDING;
+}
+
+/* Workqueue flags */
+/* Not bound to any cpu, its work runs wherever there's a free worker */
+#define WQ_UNBOUND (1 << 0)
+/* Work runs one item at a time, in queueing order. Implies WQ_UNBOUND */
+#define WQ_ORDERED (1 << 1)
+/* Served by high priority workers */
+#define WQ_HIGHPRI (1 << 2)
+
+#define WORK_CPU_UNBOUND ((unsigned int) -1)
+
+/* The system's workqueues.
+ * system_wq: per-cpu, for short work items
+ * system_highpri_wq: per-cpu, for latency-sensitive work (bottom halves of IRQs)
+ * system_unbound_wq: for long running work, or work that sleeps a lot
+ */
+extern struct workqueue *system_wq;
+extern struct workqueue *system_highpri_wq;
+extern struct workqueue *system_unbound_wq;
+
+/**
+ * @brief Create a workqueue.
+ *
+ * @param name Name of the workqueue
+ * @param flags WQ_* flags
+ * @return The workqueue, or NULL if we're out of memory
+ */
+struct workqueue *workqueue_create(const char *name, unsigned int flags);
+
+/**
+ * @brief Destroy a workqueue. Waits for all of its work to finish.
+ * Nothing may queue work on it anymore.
+ *
+ * @param wq Workqueue
+ */
+void workqueue_destroy(struct workqueue *wq);
+
+/**
+ * @brief Queue work on a workqueue. Usable from any context, including IRQs.
+ * Per-cpu workqueues run the work on the current cpu.
+ *
+ * @param wq Workqueue
+ * @param work Work item
+ * @return False if the work was already pending, else true
+ */
+bool queue_work(struct workqueue *wq, struct work_struct *work);
+
+/**
+ * @brief Queue work on a specific cpu's pool.
+ *
+ * @param cpu CPU, or WORK_CPU_UNBOUND for the current one
+ * @param wq Workqueue. Unbound workqueues ignore cpu.
+ * @param work Work item
+ * @return False if the work was already pending, else true
+ */
+bool queue_work_on(unsigned int cpu, struct workqueue *wq, struct work_struct *work);
+
+/**
+ * @brief Queue work after a delay. The delay is coarse (see CLOCKEVENT_FLAG_COARSE).
+ *
+ * @param wq Workqueue
+ * @param dw Delayed work item
+ * @param delay Delay, in ns
+ * @return False if the work was already pending, else true
+ */
+bool queue_delayed_work(struct workqueue *wq, struct delayed_work *dw, hrtime_t delay);
+
+/**
+ * @brief Cancel pending work. Does not wait for it, if it's already running.
+ *
+ * @param work Work item
+ * @return True if the work was pending
+ */
+bool cancel_work(struct work_struct *work);
+
+/**
+ * @brief Cancel pending delayed work. Does not wait for it, if it's already running.
+ *
+ * @param dw Delayed work item
+ * @return True if the work was pending
+ */
+bool cancel_delayed_work(struct delayed_work *dw);
+
+/**
+ * @brief Wait for all the work queued on a workqueue to finish.
+ *
+ * @param wq Workqueue
+ */
+void flush_workqueue(struct workqueue *wq);
+
+static inline bool schedule_work(struct work_struct *work)
+{
+    return queue_work(system_wq, work);
+}
+
+static inline bool schedule_delayed_work(struct delayed_work *dw, hrtime_t delay)
+{
+    return queue_delayed_work(system_wq, dw, delay);
+}
+
+struct thread;
+
+/* Scheduler hooks, for concurrency management */
+void wq_worker_sleeping(struct thread *thread);
+void wq_worker_running(struct thread *thread);
+
+#endif
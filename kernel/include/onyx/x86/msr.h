@@ -14,6 +14,7 @@
 #define FS_BASE_MSR       0xC0000100
 #define GS_BASE_MSR       0xC0000101
 #define KERNEL_GS_BASE    0xC0000102
+#define IA32_TSC_AUX      0xC0000103
 #define IA32_MSR_STAR     0xC0000081
 #define IA32_MSR_LSTAR    0xC0000082
 #define IA32_MSR_CSTAR    0xC0000083
@@ -9,9 +9,8 @@
 #ifndef _ONYX_X86_TSC_H
 #define _ONYX_X86_TSC_H
 
-#include <onyx/vdso.h>
+#include <onyx/clock.h>
 
-void tsc_setup_vdso(struct vdso_time *time);
 void tsc_init(void);
 hrtime_t tsc_get_counter_from_ns(hrtime_t t);
 
@@ -19,6 +19,24 @@
 #define PCI_MSI_MSGCTRL_64BIT         (1 << 7)
 #define PCI_MSI_MSGCTRL_PERVECTOR_MSK (1 << 8)
 
+#define PCI_MSIX_MESSAGE_CONTROL_OFF 2
+#define PCI_MSIX_TABLE_OFF           4
+
+#define PCI_MSIX_MSGCTRL_TABLE_SIZE(ctrl) (((ctrl) & 0x7ff) + 1)
+#define PCI_MSIX_MSGCTRL_FUNCTION_MASK    (1 << 14)
+#define PCI_MSIX_MSGCTRL_ENABLE           (1 << 15)
+
+#define PCI_MSIX_BIR_MASK 0x7
+
+/* MSI-X table entries */
+#define PCI_MSIX_ENTRY_SIZE       16
+#define PCI_MSIX_ENTRY_ADDR_LO    0
+#define PCI_MSIX_ENTRY_ADDR_HI    4
+#define PCI_MSIX_ENTRY_DATA       8
+#define PCI_MSIX_ENTRY_VECTOR_CTL 12
+
+#define PCI_MSIX_ENTRY_CTL_MASKED (1 << 0)
+
 #define PCI_MSI_1_VECTOR   0x0000
 #define PCI_MSI_2_VECTORS  0x0001
 #define PCI_MSI_4_VECTORS  0x0002
@@ -262,6 +262,18 @@ public:
     void disable_irq();
     size_t find_capability(uint8_t cap, int instance = 0);
     int enable_msi(irq_t handler, void *cookie);
+
+    /**
+     * @brief Enable MSI-X, with a vector per cookie.
+     *
+     * @param nr_vecs Number of vectors
+     * @param handler IRQ handler, for every vector
+     * @param cookies Cookie for each vector's handler
+     * @param cpus Cpu to route each vector to, or nullptr to route them all to the current one
+     * @return 0 on success, -1 on failure (with errno set)
+     */
+    int enable_msix(unsigned int nr_vecs, irq_t handler, void *const *cookies,
+                    const unsigned int *cpus);
     expected<pci_bar, int> get_bar(unsigned int index);
     void *map_bar(unsigned int index, unsigned int caching);
     void set_bar(const pci_bar &bar, unsigned int index);
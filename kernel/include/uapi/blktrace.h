@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_BLKTRACE_H
+#define _UAPI_BLKTRACE_H
+
+#include <onyx/types.h>
+
+#define BLKTRACE_OP_READ         0
+#define BLKTRACE_OP_WRITE        1
+#define BLKTRACE_OP_DISCARD      2
+#define BLKTRACE_OP_WRITE_ZEROES 3
+#define BLKTRACE_OP_FLUSH        4
+
+/* The request failed */
+#define BLKTRACE_FLAG_ERROR (1 << 0)
+
+#define BLKTRACE_DEV_NAME_LEN 16
+
+/* One completed request. /sys/block/trace holds the last events, and the event with sequence
+ * number seq lives at offset seq * sizeof(struct blktrace_event). Reading from an offset whose
+ * events got overwritten starts at the oldest event still around, so readers should track the
+ * sequence numbers they get back.
+ */
+struct blktrace_event
+{
+    __u64 seq;
+    /* Completion time, in ns since boot */
+    __u64 time;
+    /* Time between submission and completion, in ns */
+    __u64 latency;
+    /* First sector, relative to the device */
+    __u64 sector;
+    __u32 nr_sectors;
+    /* Number of requests in flight on the device when it completed, this one included */
+    __u32 in_flight;
+    __u8 op;
+    __u8 flags;
+    __u8 reserved[6];
+    char dev[BLKTRACE_DEV_NAME_LEN];
+};
+
+#endif
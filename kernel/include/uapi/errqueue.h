@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _UAPI_ERRQUEUE_H
+#define _UAPI_ERRQUEUE_H
+
+#include <onyx/types.h>
+
+/* Socket error queue messages, read with recvmsg(MSG_ERRQUEUE) and delivered as a
+ * IP_RECVERR/IPV6_RECVERR control message.
+ */
+struct sock_extended_err
+{
+    __u32 ee_errno;
+    __u8 ee_origin;
+    __u8 ee_type;
+    __u8 ee_code;
+    __u8 ee_pad;
+    __u32 ee_info;
+    __u32 ee_data;
+};
+
+#define SO_EE_ORIGIN_NONE     0
+#define SO_EE_ORIGIN_LOCAL    1
+#define SO_EE_ORIGIN_ICMP     2
+#define SO_EE_ORIGIN_ICMP6    3
+#define SO_EE_ORIGIN_TXSTATUS 4
+#define SO_EE_ORIGIN_ZEROCOPY 5
+
+/* MSG_ZEROCOPY notifications: ee_info..ee_data is the range of completed sends. If the kernel had
+ * to copy the data anyway, ee_code is set to SO_EE_CODE_ZEROCOPY_COPIED.
+ */
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+
+#endif
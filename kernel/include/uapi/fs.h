@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _UAPI_FS_H
+#define _UAPI_FS_H
+
+#include <onyx/types.h>
+
+#include <uapi/ioctl.h>
+
+/* Block device ioctls. Both take a __u64[2] of {start, length}, in bytes, aligned to the sector
+ * size.
+ */
+#define BLKDISCARD _IO(0x12, 119)
+#define BLKZEROOUT _IO(0x12, 127)
+
+struct fstrim_range
+{
+    __u64 start;
+    __u64 len;
+    __u64 minlen;
+};
+
+/* Discard a filesystem's free space. start, len and minlen are in bytes. On return, len holds the
+ * number of bytes that got discarded.
+ */
+#define FITRIM _IOWR('X', 121, struct fstrim_range)
+
+#endif
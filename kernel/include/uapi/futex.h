@@ -28,4 +28,32 @@
 #define FUTEX_CLOCK_REALTIME 256
 #define FUTEX_OP_MASK        ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
+/* FUTEX_WAIT_BITSET/FUTEX_WAKE_BITSET */
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
+/* PI futex word layout */
+#define FUTEX_WAITERS    0x80000000
+#define FUTEX_OWNER_DIED 0x40000000
+#define FUTEX_TID_MASK   0x3fffffff
+
+/* FUTEX_WAKE_OP operations, encoded as FUTEX_OP(op, oparg, cmp, cmparg) in val3 */
+#define FUTEX_OP_SET  0
+#define FUTEX_OP_ADD  1
+#define FUTEX_OP_OR   2
+#define FUTEX_OP_ANDN 3
+#define FUTEX_OP_XOR  4
+
+/* Use (1 << oparg) as the operand */
+#define FUTEX_OP_OPARG_SHIFT 8
+
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+    (((op & 0xf) << 28) | ((cmp & 0xf) << 24) | ((oparg & 0xfff) << 12) | (cmparg & 0xfff))
+
 #endif
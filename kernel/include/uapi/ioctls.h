@@ -95,6 +95,8 @@
 #define SIOGETMAC       0x9004
 #define SIOGETIFNAME    0x9005
 #define SIOGETINDEX     0x9006
+#define SIOGETCOALESCE  0x9007
+#define SIOSETCOALESCE  0x9008
 
 #define SIOCGIFNAME  0x8910
 #define SIOCGIFCONF  0x8912
@@ -143,6 +145,13 @@ struct winsize
 #define N_SYNC_PPP     14
 #define N_HCI          15
 
+/* Interrupt moderation settings, for SIOGETCOALESCE/SIOSETCOALESCE */
+struct if_coalesce
+{
+    /* Maximum time an RX interrupt gets delayed by, 0 to disable */
+    unsigned int rx_usecs;
+};
+
 #ifdef __is_onyx_kernel
 #include <uapi/netinet.h>
 
@@ -10,12 +10,18 @@
 
 #include <onyx/types.h>
 
-#define FLAME_GRAPH_FRAMES   32
-#define FLAME_GRAPH_NENTRIES 65536
+#define FLAME_GRAPH_FRAMES      32
+#define FLAME_GRAPH_USER_FRAMES 16
+#define FLAME_GRAPH_NENTRIES    65536
 
 struct flame_graph_entry
 {
+    /* Kernel stack, 0 terminated. Empty if the sample hit user space. */
     unsigned long rips[FLAME_GRAPH_FRAMES];
+    /* User stack (walked through frame pointers), 0 terminated */
+    unsigned long user_rips[FLAME_GRAPH_USER_FRAMES];
+    __s32 pid;
+    __s32 tid;
 };
 
 struct flame_graph_pcpu
@@ -30,5 +36,36 @@ struct flame_graph_pcpu
 #define PERF_PROBE_GET_BUFFER_LENGTH   1
 #define PERF_PROBE_READ_DATA           2
 #define PERF_PROBE_ENABLE_DISABLE_WAIT 3
+#define PERF_PROBE_SET_FILTER          4
+#define PERF_PROBE_ATTACH_COUNTER      5
+#define PERF_PROBE_RESET_COUNTER       6
+
+/* Restricts sampling to some threads. Takes effect on the next enable. */
+struct perf_probe_filter
+{
+    __s32 pid;  /* Only sample this process, if not 0 */
+    __s32 pgid; /* Only sample this process group, if not 0 */
+    __u32 freq; /* Samples per second, per cpu (0 for the default) */
+    __u32 flags;
+};
+
+#define PERF_PROBE_DEFAULT_FREQ 1000
+#define PERF_PROBE_MAX_FREQ     10000
+
+/* Software events, counted per thread */
+#define PERF_COUNT_SW_CONTEXT_SWITCHES 0
+#define PERF_COUNT_SW_PAGE_FAULTS      1
+#define PERF_COUNT_SW_CPU_MIGRATIONS   2
+#define PERF_COUNT_SW_SYSCALLS         3
+#define PERF_COUNT_SW_MAX              4
+
+/* Turns an open perf-probe file into a counter. read(2) then returns how many times the event
+ * happened since the counter was attached (or last reset), as a __u64.
+ */
+struct perf_counter_attr
+{
+    __u32 event; /* PERF_COUNT_SW_* */
+    __s32 tid;   /* Thread to count, or 0 for the calling thread */
+};
 
 #endif
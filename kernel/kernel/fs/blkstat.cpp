@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/block.h>
+#include <onyx/clock.h>
+#include <onyx/init.h>
+#include <onyx/majorminor.h>
+#include <onyx/mutex.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/utils.h>
+#include <onyx/vm.h>
+
+#include <uapi/blktrace.h>
+
+/* Block I/O accounting. Every bio gets timestamped when it's issued, and accounted for (in the
+ * device it got submitted to, and in the whole disk if that's a partition) when it completes.
+ * /sys/block/diskstats has the counters, in the same layout as Linux's /proc/diskstats, so iostat
+ * and friends can make sense of it. /sys/block/latency has the latency histograms.
+ *
+ * Completed requests can also be traced into a ring buffer (/sys/block/trace), enabled through
+ * /sys/block/trace_enable.
+ */
+
+static_assert(BLKTRACE_OP_READ == BIO_REQ_READ_OP);
+static_assert(BLKTRACE_OP_WRITE == BIO_REQ_WRITE_OP);
+static_assert(BLKTRACE_OP_DISCARD == BIO_REQ_DISCARD_OP);
+static_assert(BLKTRACE_OP_WRITE_ZEROES == BIO_REQ_WRITE_ZEROES_OP);
+static_assert(sizeof(struct blktrace_event) == 64);
+
+/* Must be a power of 2 */
+#define BLKTRACE_NR_EVENTS 2048
+
+static struct blktrace_event *blktrace_ring;
+static unsigned long blktrace_head;
+static bool blktrace_enabled;
+static struct mutex blktrace_enable_lock;
+
+static unsigned int blkdev_op_to_group(unsigned int op)
+{
+    switch (op)
+    {
+        case BLKTRACE_OP_READ:
+            return BLKDEV_STAT_READ;
+        case BLKTRACE_OP_DISCARD:
+            return BLKDEV_STAT_DISCARD;
+        case BLKTRACE_OP_FLUSH:
+            return BLKDEV_STAT_FLUSH;
+        default:
+            return BLKDEV_STAT_WRITE;
+    }
+}
+
+static unsigned int blkdev_lat_bucket(hrtime_t latency)
+{
+    const unsigned long us = latency / NS_PER_US;
+    if (us == 0)
+        return 0;
+
+    return min(64U - __builtin_clzl(us), BLKDEV_LAT_BUCKETS - 1U);
+}
+
+/**
+ * @brief Bring io_ticks and time_in_queue up to date. Called with the stats lock held.
+ *
+ * @param s Stats
+ * @param now Current time
+ */
+static void blkdev_stats_update_time(struct blkdev_stats *s, hrtime_t now)
+{
+    /* Requests can complete on a cpu whose clock lags behind a bit */
+    if (now <= s->stamp)
+        return;
+
+    if (s->in_flight)
+    {
+        s->io_ticks += now - s->stamp;
+        s->time_in_queue += s->in_flight * (now - s->stamp);
+    }
+
+    s->stamp = now;
+}
+
+static void blkdev_stats_start(struct blkdev_stats *s, hrtime_t now)
+{
+    scoped_lock<spinlock, true> g{s->lock};
+    blkdev_stats_update_time(s, now);
+    s->in_flight++;
+}
+
+/**
+ * @brief Take a request off the in-flight count, and account for it if it completed
+ *
+ * @param s Stats
+ * @param op Op (BLKTRACE_OP_*), or -1 if the request never made it to the device
+ * @param nr_sectors Number of 512-byte sectors
+ * @param latency Latency
+ * @param now Current time
+ * @return Number of requests that were in flight, this one included
+ */
+static unsigned long blkdev_stats_done(struct blkdev_stats *s, int op, sector_t nr_sectors,
+                                       hrtime_t latency, hrtime_t now)
+{
+    scoped_lock<spinlock, true> g{s->lock};
+    const unsigned long in_flight = s->in_flight;
+
+    blkdev_stats_update_time(s, now);
+    s->in_flight--;
+
+    if (op >= 0)
+    {
+        const unsigned int group = blkdev_op_to_group(op);
+        s->ios[group]++;
+        s->sectors[group] += nr_sectors;
+        s->ticks[group] += latency;
+        s->lat_hist[group][blkdev_lat_bucket(latency)]++;
+    }
+
+    return in_flight;
+}
+
+static void blktrace_record(struct blockdev *dev, unsigned int op, sector_t sector,
+                            sector_t nr_sectors, hrtime_t latency, hrtime_t now,
+                            unsigned long in_flight, bool error)
+{
+    if (likely(!__atomic_load_n(&blktrace_enabled, __ATOMIC_ACQUIRE)))
+        return;
+
+    const unsigned long seq = __atomic_fetch_add(&blktrace_head, 1, __ATOMIC_RELAXED);
+    struct blktrace_event *ev = &blktrace_ring[seq & (BLKTRACE_NR_EVENTS - 1)];
+
+    /* Readers check seq before and after copying the event out, seqlock-style */
+    __atomic_store_n(&ev->seq, (__u64) -1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ev->time = now;
+    ev->latency = latency;
+    ev->sector = sector;
+    ev->nr_sectors = nr_sectors;
+    ev->in_flight = in_flight;
+    ev->op = op;
+    ev->flags = error ? BLKTRACE_FLAG_ERROR : 0;
+    strlcpy(ev->dev, dev->name.data(), sizeof(ev->dev));
+
+    __atomic_store_n(&ev->seq, seq, __ATOMIC_RELEASE);
+}
+
+static sector_t bio_nr_sectors(struct blockdev *dev, struct bio_req *req)
+{
+    if ((req->flags & BIO_REQ_OP_MASK) > BIO_REQ_WRITE_OP)
+        return req->nr_sectors;
+
+    size_t len = 0;
+    for (size_t i = 0; i < req->nr_vecs; i++)
+        len += req->vec[i].length;
+
+    return len / dev->sector_size;
+}
+
+void blkdev_account_start(struct blockdev *dev, struct bio_req *req)
+{
+    const hrtime_t now = clocksource_get_time();
+
+    req->b_dev = dev;
+    req->b_sector = req->sector_number;
+    req->b_start = now;
+    req->nr_sectors = bio_nr_sectors(dev, req);
+
+    blkdev_stats_start(&dev->stats, now);
+    if (blkdev_is_partition(dev))
+        blkdev_stats_start(&dev->actual_blockdev->stats, now);
+}
+
+void blkdev_account_cancel(struct bio_req *req)
+{
+    struct blockdev *dev = req->b_dev;
+    const hrtime_t now = clocksource_get_time();
+
+    blkdev_stats_done(&dev->stats, -1, 0, 0, now);
+    if (blkdev_is_partition(dev))
+        blkdev_stats_done(&dev->actual_blockdev->stats, -1, 0, 0, now);
+}
+
+static void blkdev_account(struct blockdev *dev, unsigned int op, sector_t sector,
+                           sector_t nr_sectors, hrtime_t start, bool error)
+{
+    const hrtime_t now = clocksource_get_time();
+    const hrtime_t latency = now > start ? now - start : 0;
+    /* The stats count 512-byte sectors regardless of the device's sector size, like Linux's */
+    const sector_t nr_512 = nr_sectors * dev->sector_size / 512;
+
+    /* Failed requests still count towards the in-flight time, but not the I/O stats */
+    unsigned long in_flight =
+        blkdev_stats_done(&dev->stats, error ? -1 : (int) op, nr_512, latency, now);
+    if (blkdev_is_partition(dev))
+        blkdev_stats_done(&dev->actual_blockdev->stats, error ? -1 : (int) op, nr_512, latency,
+                          now);
+
+    blktrace_record(dev, op, sector, nr_sectors, latency, now, in_flight, error);
+}
+
+void blkdev_account_done(struct bio_req *req, bool error)
+{
+    blkdev_account(req->b_dev, req->flags & BIO_REQ_OP_MASK, req->b_sector, req->nr_sectors,
+                   req->b_start, error);
+}
+
+hrtime_t blkdev_account_flush_start(struct blockdev *dev)
+{
+    const hrtime_t now = clocksource_get_time();
+
+    blkdev_stats_start(&dev->stats, now);
+    if (blkdev_is_partition(dev))
+        blkdev_stats_start(&dev->actual_blockdev->stats, now);
+
+    return now;
+}
+
+void blkdev_account_flush_done(struct blockdev *dev, hrtime_t start, bool error)
+{
+    blkdev_account(dev, BLKTRACE_OP_FLUSH, 0, 0, start, error);
+}
+
+struct blkstat_buf
+{
+    char *buf;
+    size_t len;
+    size_t buflen;
+};
+
+static ssize_t blkstat_copy_out(void *buffer, size_t size, off_t off, const char *buf,
+                                size_t len)
+{
+    if ((size_t) off >= len)
+        return 0;
+
+    size_t to_copy = cul::min(len - off, size);
+    return copy_to_user(buffer, buf + off, to_copy) < 0 ? -EFAULT : (ssize_t) to_copy;
+}
+
+/**
+ * @brief Print something for every block device into a buffer, and copy it out
+ *
+ * @param buffer User buffer
+ * @param size Size of the user buffer
+ * @param off Offset
+ * @param per_dev Space needed for each device
+ * @param print Print callback
+ * @return Number of bytes copied, or negative error codes
+ */
+static ssize_t blkstat_print(void *buffer, size_t size, off_t off, size_t per_dev,
+                             void (*print)(struct blockdev *dev, void *ctx))
+{
+    size_t nr_devs = 0;
+    blkdev_for_every([](struct blockdev *, void *ctx) { (*(size_t *) ctx)++; }, &nr_devs);
+
+    /* Devices that show up in the meanwhile get cut off, which is fine */
+    struct blkstat_buf b;
+    b.buflen = per_dev * (nr_devs + 1);
+    b.len = 0;
+    b.buf = (char *) malloc(b.buflen);
+    if (!b.buf)
+        return -ENOMEM;
+
+    blkdev_for_every(print, &b);
+
+    if (b.len >= b.buflen)
+        b.len = b.buflen - 1;
+
+    ssize_t st = blkstat_copy_out(buffer, size, off, b.buf, b.len);
+    free(b.buf);
+    return st;
+}
+
+static void blkdev_stats_snapshot(struct blockdev *dev, struct blkdev_stats *out)
+{
+    struct blkdev_stats *s = &dev->stats;
+    scoped_lock<spinlock, true> g{s->lock};
+
+    blkdev_stats_update_time(s, clocksource_get_time());
+    memcpy(out, s, sizeof(*out));
+}
+
+static void diskstats_print_dev(struct blockdev *dev, void *ctx)
+{
+    struct blkstat_buf *b = (struct blkstat_buf *) ctx;
+    struct blkdev_stats s;
+    const dev_t devno = dev->dev ? dev->dev->dev() : 0;
+
+    if (b->len >= b->buflen)
+        return;
+
+    blkdev_stats_snapshot(dev, &s);
+
+    /* Same fields as /proc/diskstats. We don't merge requests, so merges are always 0. */
+    b->len += snprintf(b->buf + b->len, b->buflen - b->len,
+                       "%4u %7u %s %lu 0 %lu %lu %lu 0 %lu %lu %lu %lu %lu %lu 0 %lu %lu %lu %lu\n",
+                       MAJOR(devno), MINOR(devno), dev->name.data(), s.ios[BLKDEV_STAT_READ],
+                       s.sectors[BLKDEV_STAT_READ], s.ticks[BLKDEV_STAT_READ] / NS_PER_MS,
+                       s.ios[BLKDEV_STAT_WRITE], s.sectors[BLKDEV_STAT_WRITE],
+                       s.ticks[BLKDEV_STAT_WRITE] / NS_PER_MS, s.in_flight,
+                       s.io_ticks / NS_PER_MS, s.time_in_queue / NS_PER_MS,
+                       s.ios[BLKDEV_STAT_DISCARD], s.sectors[BLKDEV_STAT_DISCARD],
+                       s.ticks[BLKDEV_STAT_DISCARD] / NS_PER_MS, s.ios[BLKDEV_STAT_FLUSH],
+                       s.ticks[BLKDEV_STAT_FLUSH] / NS_PER_MS);
+}
+
+static ssize_t diskstats_read(void *buffer, size_t size, off_t off)
+{
+    return blkstat_print(buffer, size, off, 256, diskstats_print_dev);
+}
+
+static const char *blkdev_stat_group_names[BLKDEV_NR_STAT_GROUPS] = {"read", "write", "discard",
+                                                                      "flush"};
+
+static void latency_print_dev(struct blockdev *dev, void *ctx)
+{
+    struct blkstat_buf *b = (struct blkstat_buf *) ctx;
+    struct blkdev_stats s;
+
+    blkdev_stats_snapshot(dev, &s);
+
+    for (unsigned int i = 0; i < BLKDEV_NR_STAT_GROUPS && b->len < b->buflen; i++)
+    {
+        b->len += snprintf(b->buf + b->len, b->buflen - b->len, "%s %s", dev->name.data(),
+                           blkdev_stat_group_names[i]);
+
+        for (unsigned int j = 0; j < BLKDEV_LAT_BUCKETS && b->len < b->buflen; j++)
+            b->len += snprintf(b->buf + b->len, b->buflen - b->len, " %lu", s.lat_hist[i][j]);
+
+        if (b->len < b->buflen)
+            b->len += snprintf(b->buf + b->len, b->buflen - b->len, "\n");
+    }
+}
+
+static ssize_t latency_read(void *buffer, size_t size, off_t off)
+{
+    /* Header: bucket n holds latencies >= the nth lower bound, in us */
+    char header[256];
+    size_t len = snprintf(header, sizeof(header), "device op");
+    for (unsigned int i = 0; i < BLKDEV_LAT_BUCKETS; i++)
+        len += snprintf(header + len, sizeof(header) - len, " %lu", i ? 1UL << (i - 1) : 0);
+    len += snprintf(header + len, sizeof(header) - len, "\n");
+
+    if ((size_t) off < len)
+        return blkstat_copy_out(buffer, size, off, header, len);
+
+    ssize_t st = blkstat_print(buffer, size, off - len, 4 * 32 * (BLKDEV_LAT_BUCKETS + 2),
+                               latency_print_dev);
+    return st;
+}
+
+static ssize_t blktrace_read(void *buffer, size_t size, off_t off)
+{
+    if (!__atomic_load_n(&blktrace_ring, __ATOMIC_ACQUIRE))
+        return 0;
+
+    const unsigned long head = __atomic_load_n(&blktrace_head, __ATOMIC_ACQUIRE);
+    const unsigned long oldest = head > BLKTRACE_NR_EVENTS ? head - BLKTRACE_NR_EVENTS : 0;
+    unsigned long seq = cul::max((unsigned long) off / sizeof(struct blktrace_event), oldest);
+    size_t copied = 0;
+
+    for (; seq < head && size - copied >= sizeof(struct blktrace_event); seq++)
+    {
+        const struct blktrace_event *slot = &blktrace_ring[seq & (BLKTRACE_NR_EVENTS - 1)];
+        struct blktrace_event ev;
+
+        const __u64 slot_seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        /* Still being written, pick it up next time */
+        if (slot_seq == (__u64) -1 || slot_seq < seq)
+            break;
+
+        /* Overwritten */
+        if (slot_seq != seq)
+            continue;
+
+        memcpy(&ev, slot, sizeof(ev));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (copy_to_user((char *) buffer + copied, &ev, sizeof(ev)) < 0)
+            return copied ?: -EFAULT;
+        copied += sizeof(ev);
+    }
+
+    return copied;
+}
+
+static ssize_t blktrace_enable_read(void *buffer, size_t size, off_t off)
+{
+    return blkstat_copy_out(buffer, size, off,
+                            __atomic_load_n(&blktrace_enabled, __ATOMIC_RELAXED) ? "1\n" : "0\n",
+                            2);
+}
+
+static ssize_t blktrace_enable_write(void *buffer, size_t size, off_t off)
+{
+    char c;
+
+    if (size == 0)
+        return 0;
+
+    if (copy_from_user(&c, buffer, 1) < 0)
+        return -EFAULT;
+
+    if (c != '0' && c != '1')
+        return -EINVAL;
+
+    scoped_mutex g{blktrace_enable_lock};
+
+    /* The ring sticks around once allocated, so readers and writers never need to check for it
+     * going away.
+     */
+    if (c == '1' && !blktrace_ring)
+    {
+        auto ring = (struct blktrace_event *) vmalloc(
+            vm_size_to_pages(BLKTRACE_NR_EVENTS * sizeof(struct blktrace_event)), VM_TYPE_REGULAR,
+            VM_READ | VM_WRITE);
+        if (!ring)
+            return -ENOMEM;
+
+        for (unsigned int i = 0; i < BLKTRACE_NR_EVENTS; i++)
+            ring[i].seq = (__u64) -1;
+
+        __atomic_store_n(&blktrace_ring, ring, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&blktrace_enabled, c == '1', __ATOMIC_RELEASE);
+    return size;
+}
+
+static struct sysfs_object block_obj;
+static struct sysfs_object diskstats_file;
+static struct sysfs_object latency_file;
+static struct sysfs_object blktrace_file;
+static struct sysfs_object blktrace_enable_file;
+
+static void blkstat_sysfs_init()
+{
+    assert(sysfs_object_init("block", &block_obj) == 0);
+    block_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("diskstats", &diskstats_file, &block_obj) == 0);
+    diskstats_file.read = diskstats_read;
+    diskstats_file.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("latency", &latency_file, &block_obj) == 0);
+    latency_file.read = latency_read;
+    latency_file.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("trace", &blktrace_file, &block_obj) == 0);
+    blktrace_file.read = blktrace_read;
+    blktrace_file.perms = 0400 | S_IFREG;
+
+    assert(sysfs_init_and_add("trace_enable", &blktrace_enable_file, &block_obj) == 0);
+    blktrace_enable_file.read = blktrace_enable_read;
+    blktrace_enable_file.write = blktrace_enable_write;
+    blktrace_enable_file.perms = 0644 | S_IFREG;
+
+    sysfs_add(&block_obj, nullptr);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(blkstat_sysfs_init);
@@ -5,8 +5,10 @@
  *
  * SPDX-License-Identifier: MIT
  */
+#include <assert.h>
 #include <errno.h>
 #include <uapi/fcntl.h>
+#include <uapi/fs.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,13 +17,31 @@
 
 #include <onyx/block.h>
 #include <onyx/buffer.h>
+#include <onyx/direct_io.h>
 #include <onyx/page.h>
 #include <onyx/page_iov.h>
 #include <onyx/rwlock.h>
+#include <onyx/scoped_lock.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+#include <onyx/wait_queue.h>
 
 static struct rwlock dev_list_lock;
 static struct list_head dev_list = LIST_HEAD_INIT(dev_list);
 
+void blkdev_for_every(void (*cb)(struct blockdev *dev, void *ctx), void *ctx)
+{
+    rw_lock_read(&dev_list_lock);
+
+    list_for_every (&dev_list)
+    {
+        struct blockdev *blk = container_of(l, struct blockdev, block_dev_head);
+        cb(blk, ctx);
+    }
+
+    rw_unlock_read(&dev_list_lock);
+}
+
 /*
  * Function: struct blockdev *blkdev_search(const char *name);
  * Description: Search for 'name' on the linked list
@@ -49,13 +69,52 @@ struct blockdev *blkdev_search(const char *name)
     return NULL;
 }
 
+/**
+ * @brief Convert a user {start, length} byte range to sectors
+ *
+ * @param d Block device
+ * @param urange User pointer to a __u64[2]
+ * @param sector Set to the first sector
+ * @param nr_sectors Set to the number of sectors
+ * @return 0 on success, negative error codes
+ */
+static int blkdev_get_user_range(struct blockdev *d, void *urange, sector_t *sector,
+                                 sector_t *nr_sectors)
+{
+    __u64 range[2];
+
+    if (copy_from_user(range, urange, sizeof(range)) < 0)
+        return -EFAULT;
+
+    if (range[0] % d->sector_size || range[1] % d->sector_size)
+        return -EINVAL;
+
+    *sector = range[0] / d->sector_size;
+    *nr_sectors = range[1] / d->sector_size;
+    return 0;
+}
+
 unsigned int blkdev_ioctl(int request, void *argp, struct file *f)
 {
     auto d = (blockdev *) f->f_ino->i_helper;
+    sector_t sector, nr_sectors;
+    int st;
 
-    (void) d;
     switch (request)
     {
+        case BLKDISCARD:
+        case BLKZEROOUT: {
+            if (!fd_may_access(f, FILE_ACCESS_WRITE))
+                return -EBADF;
+
+            if ((st = blkdev_get_user_range(d, argp, &sector, &nr_sectors)) < 0)
+                return st;
+
+            if (request == BLKDISCARD)
+                return blkdev_issue_discard(d, sector, nr_sectors);
+            return blkdev_issue_zeroout(d, sector, nr_sectors, 0);
+        }
+
         default:
             return -EINVAL;
     }
@@ -259,12 +318,73 @@ size_t blkdev_write_file(size_t offset, size_t len, void *buffer, struct file *f
     return written;
 }
 
+static int blkdev_fallocate(int mode, off_t offset, off_t len, struct file *f)
+{
+    auto d = (blockdev *) f->f_ino->i_helper;
+
+    if (!fd_may_access(f, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (offset < 0 || len <= 0)
+        return -EINVAL;
+
+    /* The size of a block device is fixed */
+    if (!(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+
+    if (offset % d->sector_size || len % d->sector_size)
+        return -EINVAL;
+
+    /* Don't pull blocks from under a mounted filesystem */
+    if (d->sb)
+        return -EBUSY;
+
+    sector_t sector = offset / d->sector_size;
+    sector_t nr_sectors = len / d->sector_size;
+
+    switch (mode & ~FALLOC_FL_KEEP_SIZE)
+    {
+        case FALLOC_FL_PUNCH_HOLE:
+            /* Punched holes read back as zeroes, so plain discards don't cut it */
+            return blkdev_issue_zeroout(d, sector, nr_sectors,
+                                        BLKDEV_ZERO_UNMAP | BLKDEV_ZERO_NOFALLBACK);
+        case FALLOC_FL_ZERO_RANGE:
+            return blkdev_issue_zeroout(d, sector, nr_sectors, 0);
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static ssize_t blkdev_dio_map(struct inode *ino, size_t off, size_t len, sector_t *sector)
+{
+    auto d = (blockdev *) ino->i_helper;
+    *sector = off / d->sector_size;
+    return len;
+}
+
+static ssize_t blkdev_direct_io(size_t off, size_t len, void *ubuf, unsigned int flags,
+                                struct file *f)
+{
+    auto d = (blockdev *) f->f_ino->i_helper;
+    const size_t size = d->nr_sectors * d->sector_size;
+
+    if (off >= size)
+        return flags & DIO_WRITE ? -ENOSPC : 0;
+
+    /* Reads and writes through the device file never go through the buffer cache, so there's
+     * nothing to keep coherent here.
+     */
+    return do_direct_io(d, f->f_ino, off, min(len, size - off), ubuf, flags, blkdev_dio_map);
+}
+
 const struct vm_object_ops blk_vmo_ops = {.commit = bbuffer_commit};
 
 const struct file_ops blkdev_ops = {
     .read = blkdev_read_file,
     .write = blkdev_write_file,
     .ioctl = blkdev_ioctl,
+    .fallocate = blkdev_fallocate,
+    .direct_io = blkdev_direct_io,
 };
 
 int blkdev_init(struct blockdev *blk)
@@ -357,12 +477,15 @@ ssize_t blkdev_write(size_t offset, size_t count, void *buffer, struct blockdev
  */
 int blkdev_flush(struct blockdev *dev)
 {
-    if (blkdev_is_partition(dev))
-        return blkdev_flush(dev->actual_blockdev);
-    if (!dev->flush)
+    struct blockdev *disk = blkdev_is_partition(dev) ? dev->actual_blockdev : dev;
+    if (!disk->flush)
         return errno = ENOSYS, -1;
 
-    return dev->flush(dev);
+    hrtime_t start = blkdev_account_flush_start(dev);
+    int st = disk->flush(disk);
+    blkdev_account_flush_done(dev, start, st < 0);
+
+    return st;
 }
 /*
  * Function: int blkdev_power(int op, struct blockdev *dev);
@@ -380,12 +503,315 @@ int blkdev_power(int op, struct blockdev *dev)
     return dev->power(op, dev);
 }
 
+struct bio_sync_waiter
+{
+    /* Held while waking, so the waiter can't return (and take the waiter off its stack) while
+     * bio_sync_end_io is still touching it.
+     */
+    struct spinlock lock;
+    struct wait_queue wq;
+    bool done;
+};
+
+static void bio_sync_end_io(struct bio_req *req)
+{
+    auto w = (struct bio_sync_waiter *) req->b_private;
+    scoped_lock<spinlock, true> g{w->lock};
+    w->done = true;
+    wait_queue_wake_all(&w->wq);
+}
+
+static bool bio_sync_done(struct bio_sync_waiter *w)
+{
+    scoped_lock<spinlock, true> g{w->lock};
+    return w->done;
+}
+
+/**
+ * @brief Submit a request to a synchronous driver
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return Return value of submit_request
+ */
+static int bio_submit_sync(struct blockdev *dev, struct bio_req *req)
+{
+    blkdev_account_start(dev, req);
+
+    /* There's no telling apart failures to submit and I/O errors here */
+    int st = dev->submit_request(dev, req);
+    blkdev_account_done(req, st < 0 || req->flags & BIO_REQ_ERROR_MASK);
+
+    return st;
+}
+
 int bio_submit_request(struct blockdev *dev, struct bio_req *req)
 {
     if (unlikely(dev->submit_request == NULL))
         return -EIO;
 
-    return dev->submit_request(dev, req);
+    if (!(dev->flags & BLKDEV_FLAG_ASYNC))
+        return bio_submit_sync(dev, req);
+
+    struct bio_sync_waiter w;
+    spinlock_init(&w.lock);
+    init_wait_queue_head(&w.wq);
+    w.done = false;
+
+    /* We're going to wait on it, so it's the last one */
+    req->flags &= ~BIO_REQ_MORE;
+    req->b_end_io = bio_sync_end_io;
+    req->b_private = &w;
+
+    blkdev_account_start(dev, req);
+
+    int st = dev->submit_request(dev, req);
+    if (st < 0)
+    {
+        blkdev_account_cancel(req);
+        return st;
+    }
+
+    wait_for_event(&w.wq, bio_sync_done(&w));
+    return 0;
+}
+
+int bio_submit_request_async(struct blockdev *dev, struct bio_req *req)
+{
+    assert(req->b_end_io != nullptr);
+
+    if (unlikely(dev->submit_request == NULL))
+        return -EIO;
+
+    /* Synchronous drivers are done with it by the time submit_request returns */
+    if (!(dev->flags & BLKDEV_FLAG_ASYNC))
+    {
+        int st = bio_submit_sync(dev, req);
+        if (st < 0)
+            return st;
+
+        req->b_end_io(req);
+        return 0;
+    }
+
+    blkdev_account_start(dev, req);
+
+    int st = dev->submit_request(dev, req);
+    if (st < 0)
+    {
+        blkdev_account_cancel(req);
+        return st;
+    }
+
+    return 0;
+}
+
+void bio_end_io(struct bio_req *req)
+{
+    const bool error = req->flags & BIO_REQ_ERROR_MASK || !(req->flags & BIO_REQ_DONE);
+
+    blkdev_account_done(req, error);
+    req->b_end_io(req);
+}
+
+struct bio_batch *bio_batch_alloc()
+{
+    struct bio_batch *b = (struct bio_batch *) malloc(sizeof(struct bio_batch));
+    if (!b)
+        return nullptr;
+
+    spinlock_init(&b->lock);
+    init_wait_queue_head(&b->wq);
+    return b;
+}
+
+static void bio_batch_end_io(struct bio_req *req)
+{
+    auto b = (struct bio_batch *) req->b_private;
+    scoped_lock<spinlock, true> g{b->lock};
+
+    if (req->flags & BIO_REQ_NOT_SUPP)
+        b->status = -EOPNOTSUPP;
+    else if (!(req->flags & BIO_REQ_DONE) && !b->status)
+        b->status = -EIO;
+
+    if (--b->pending == 0)
+        wait_queue_wake_all(&b->wq);
+}
+
+static bool bio_batch_done(struct bio_batch *b)
+{
+    scoped_lock<spinlock, true> g{b->lock};
+    return b->pending == 0;
+}
+
+int bio_batch_submit(struct blockdev *dev, struct bio_batch *b, unsigned int nr)
+{
+    unsigned int i;
+    int st = 0;
+
+    b->pending = nr;
+    b->status = 0;
+
+    for (i = 0; i < nr; i++)
+    {
+        struct bio_req *req = &b->reqs[i];
+        req->b_end_io = bio_batch_end_io;
+        req->b_private = b;
+        req->curr_vec_index = 0;
+        if (i + 1 != nr)
+            req->flags |= BIO_REQ_MORE;
+
+        if ((st = bio_submit_request_async(dev, req)) < 0)
+            break;
+    }
+
+    if (i != nr)
+    {
+        /* The rest never got submitted, so nothing's going to complete them */
+        scoped_lock<spinlock, true> g{b->lock};
+        b->pending -= nr - i;
+    }
+
+    wait_for_event(&b->wq, bio_batch_done(b));
+    return st < 0 ? st : b->status;
+}
+
+static bool blkdev_range_ok(struct blockdev *dev, sector_t sector, sector_t nr_sectors)
+{
+    return sector + nr_sectors >= sector && sector + nr_sectors <= dev->nr_sectors;
+}
+
+/**
+ * @brief Split a data-less request into max_sectors-sized bios, and submit them
+ *
+ * @param dev Block device
+ * @param op Op and flags
+ * @param sector First sector
+ * @param nr_sectors Number of sectors
+ * @param max_sectors Maximum size of a single request
+ * @return 0 on success, negative error codes
+ */
+static int blkdev_issue_dataless(struct blockdev *dev, uint32_t op, sector_t sector,
+                                 sector_t nr_sectors, sector_t max_sectors)
+{
+    int st = 0;
+    struct bio_batch *b = bio_batch_alloc();
+    if (!b)
+        return -ENOMEM;
+
+    while (nr_sectors && !st)
+    {
+        unsigned int nr;
+
+        for (nr = 0; nr < BIO_BATCH_SIZE && nr_sectors; nr++)
+        {
+            struct bio_req *req = &b->reqs[nr];
+            const sector_t len = min(nr_sectors, max_sectors);
+
+            req->flags = op;
+            req->sector_number = sector;
+            req->nr_sectors = len;
+            req->vec = nullptr;
+            req->nr_vecs = 0;
+
+            sector += len;
+            nr_sectors -= len;
+        }
+
+        st = bio_batch_submit(dev, b, nr);
+    }
+
+    free(b);
+    return st;
+}
+
+int blkdev_issue_discard(struct blockdev *dev, sector_t sector, sector_t nr_sectors)
+{
+    if (!blkdev_supports_discard(dev))
+        return -EOPNOTSUPP;
+
+    if (!blkdev_range_ok(dev, sector, nr_sectors))
+        return -EINVAL;
+
+    return blkdev_issue_dataless(dev, BIO_REQ_DISCARD_OP, sector, nr_sectors,
+                                 dev->max_discard_sectors);
+}
+
+/**
+ * @brief Zero a range of sectors by writing out the zero page
+ *
+ * @param dev Block device
+ * @param sector First sector
+ * @param nr_sectors Number of sectors
+ * @return 0 on success, negative error codes
+ */
+static int blkdev_write_zero_pages(struct blockdev *dev, sector_t sector, sector_t nr_sectors)
+{
+    struct page *zero_page = vm_get_zero_page();
+    const sector_t max_sectors = (BIO_BATCH_NR_VECS * PAGE_SIZE) / dev->sector_size;
+    int st = 0;
+    struct bio_batch *b = bio_batch_alloc();
+    if (!b)
+        return -ENOMEM;
+
+    while (nr_sectors && !st)
+    {
+        unsigned int nr;
+
+        for (nr = 0; nr < BIO_BATCH_SIZE && nr_sectors; nr++)
+        {
+            struct bio_req *req = &b->reqs[nr];
+            const sector_t len = min(nr_sectors, max_sectors);
+            size_t bytes = len * dev->sector_size;
+            size_t nr_vecs = 0;
+
+            for (; bytes; nr_vecs++)
+            {
+                struct page_iov *v = &b->vecs[nr][nr_vecs];
+                v->page = zero_page;
+                v->page_off = 0;
+                v->length = min(bytes, PAGE_SIZE);
+                bytes -= v->length;
+            }
+
+            req->flags = BIO_REQ_WRITE_OP;
+            req->sector_number = sector;
+            req->vec = b->vecs[nr];
+            req->nr_vecs = nr_vecs;
+
+            sector += len;
+            nr_sectors -= len;
+        }
+
+        st = bio_batch_submit(dev, b, nr);
+    }
+
+    free(b);
+    return st;
+}
+
+int blkdev_issue_zeroout(struct blockdev *dev, sector_t sector, sector_t nr_sectors,
+                         unsigned int flags)
+{
+    if (!blkdev_range_ok(dev, sector, nr_sectors))
+        return -EINVAL;
+
+    if (dev->max_write_zeroes_sectors)
+    {
+        uint32_t op = BIO_REQ_WRITE_ZEROES_OP;
+        if (flags & BLKDEV_ZERO_UNMAP)
+            op |= BIO_REQ_UNMAP;
+
+        int st = blkdev_issue_dataless(dev, op, sector, nr_sectors, dev->max_write_zeroes_sectors);
+        if (st != -EOPNOTSUPP)
+            return st;
+    }
+
+    if (flags & BLKDEV_ZERO_NOFALLBACK)
+        return -EOPNOTSUPP;
+
+    return blkdev_write_zero_pages(dev, sector, nr_sectors);
 }
 
 atomic<unsigned int> next_scsi_dev_num = 0;
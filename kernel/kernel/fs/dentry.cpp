@@ -13,30 +13,28 @@
 #include <string.h>
 
 #include <onyx/compiler.h>
+#include <onyx/cpu.h>
 #include <onyx/dentry.h>
 #include <onyx/file.h>
 #include <onyx/mm/slab.h>
 #include <onyx/mtable.h>
+#include <onyx/mutex.h>
 #include <onyx/namei.h>
+#include <onyx/rcu.h>
+#include <onyx/scheduler.h>
+#include <onyx/spinlock.h>
 #include <onyx/user.h>
 #include <onyx/vfs.h>
 #include <onyx/wait.h>
+#include <onyx/workqueue.h>
 
 #include <onyx/expected.hpp>
-#include <onyx/hashtable.hpp>
 #include <onyx/list.hpp>
 #include <onyx/string_view.hpp>
 
 static struct slab_cache *dentry_cache;
 dentry *root_dentry = nullptr;
 
-fnv_hash_t hash_dentry(dentry *&d)
-{
-    auto hash = fnv_hash(&d->d_parent, sizeof(dentry *));
-    hash = fnv_hash_cont(d->d_name, d->d_name_length, hash);
-    return hash;
-}
-
 fnv_hash_t hash_dentry_fields(dentry *parent, std::string_view name)
 {
     auto hash = fnv_hash(&parent, sizeof(dentry *));
@@ -44,68 +42,317 @@ fnv_hash_t hash_dentry_fields(dentry *parent, std::string_view name)
     return hash;
 }
 
-cul::hashtable2<dentry *, 1024, fnv_hash_t, hash_dentry> dentry_ht;
-static rwslock dentry_ht_locks[1024];
+/* The dcache hash table. Lookups don't take locks (they run under RCU), and the chains are nulls
+ * lists, so a lookup that gets dragged into another chain (by a resize, or because the dentry it
+ * was standing on got renamed) sees a foreign nulls value at the end and restarts.
+ * Writers take one of the striped locks, picked by the hash. Since the table never gets smaller
+ * than the number of locks, a chain is always covered by a single lock. The table doubles in size
+ * once it holds as many dentries as it has buckets, and growing takes every lock.
+ */
+#define DENTRY_HT_INITIAL_SIZE 1024
+#define DENTRY_HT_MAX_SIZE     (1UL << 20)
+#define DENTRY_HT_NR_LOCKS     1024
+
+static_assert(DENTRY_HT_INITIAL_SIZE >= DENTRY_HT_NR_LOCKS);
+
+struct dentry_hashtable
+{
+    unsigned long mask;
+    struct rcu_head rcu;
+    struct hlist_nulls_head heads[];
+};
+
+static struct dentry_hashtable *dentry_ht;
+static struct spinlock dentry_ht_locks[DENTRY_HT_NR_LOCKS];
+static unsigned long dentry_ht_nr_entries;
+static struct mutex dentry_ht_resize_lock;
+
+/* Renames (and moves) change a dentry's name and parent, which lockless walkers can't deal with by
+ * themselves. These bump the dcache sequence count, and walkers that raced with them retry.
+ */
+static struct spinlock dcache_seq_lock;
+static unsigned int dcache_seq;
 
-[[gnu::always_inline]] static inline bool dentry_compare_name(dentry *dent,
-                                                              std::string_view &to_cmp)
+/* Names that don't fit in d_inline_name. These get freed after a grace period, since lockless
+ * lookups may be comparing against them while we rename.
+ */
+struct dentry_name
 {
-    std::string_view dent_name{dent->d_name, dent->d_name_length};
+    struct rcu_head rcu;
+    char name[];
+};
+
+/* Dentries get freed after a grace period, but inode_unref() may sleep, so the actual freeing
+ * gets done by a worker.
+ */
+static struct rcu_head *dentry_free_list;
+static struct work_struct dentry_free_work;
 
-    return dent_name.compare(to_cmp) == 0;
+static void dcache_write_begin()
+{
+    spin_lock(&dcache_seq_lock);
+    __atomic_store_n(&dcache_seq, dcache_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void dcache_write_end()
+{
+    __atomic_store_n(&dcache_seq, dcache_seq + 1, __ATOMIC_RELEASE);
+    spin_unlock(&dcache_seq_lock);
 }
 
-dentry *dentry_open_from_cache_unlocked(dentry *dent, std::string_view name)
+unsigned int dcache_read_begin()
 {
-    auto namehash = fnv_hash(name.data(), name.length());
-    auto hash = hash_dentry_fields(dent, name);
-    auto index = dentry_ht.get_hashtable_index(hash);
-    auto list = dentry_ht.get_hashtable(index);
+    unsigned int seq;
 
-    list_for_every (list)
+    while ((seq = __atomic_load_n(&dcache_seq, __ATOMIC_ACQUIRE)) & 1)
+        cpu_relax();
+
+    return seq;
+}
+
+bool dcache_read_retry(unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&dcache_seq, __ATOMIC_RELAXED) != seq;
+}
+
+static struct spinlock *dentry_ht_lock_for(fnv_hash_t hash)
+{
+    return &dentry_ht_locks[hash & (DENTRY_HT_NR_LOCKS - 1)];
+}
+
+static char *dentry_alloc_name(const char *name, size_t length)
+{
+    struct dentry_name *dn = (struct dentry_name *) malloc(sizeof(*dn) + length + 1);
+    if (!dn)
+        return nullptr;
+
+    memcpy(dn->name, name, length);
+    dn->name[length] = '\0';
+    return dn->name;
+}
+
+static void dentry_free_name_rcu(struct rcu_head *head)
+{
+    free(container_of(head, struct dentry_name, rcu));
+}
+
+static bool dentry_compare_name(const dentry *dent, std::string_view name)
+{
+    const size_t length = __atomic_load_n(&dent->d_name_length, __ATOMIC_RELAXED);
+    const char *dname = __atomic_load_n(&dent->d_name, __ATOMIC_RELAXED);
+
+    if (length != name.length())
+        return false;
+
+    /* A racing rename may have given us a long name's length with the inline buffer. Don't walk
+     * off the end of it (the sequence count catches the rest).
+     */
+    if (dname == dent->d_inline_name && length >= INLINE_NAME_MAX)
+        return false;
+
+    return !memcmp(dname, name.data(), length);
+}
+
+/**
+ * @brief Look up a dentry in a hash table chain
+ *
+ * @param ht Hash table
+ * @param hash Hash of (parent, name)
+ * @param parent Parent directory
+ * @param name Name
+ * @param restart If not null, set to true if the walk ended up in another chain
+ * @return The dentry, or nullptr
+ */
+static dentry *__dentry_ht_lookup(const struct dentry_hashtable *ht, fnv_hash_t hash,
+                                  const dentry *parent, std::string_view name, bool *restart)
+{
+    const unsigned long index = hash & ht->mask;
+    struct hlist_nulls_node *node;
+
+    hlist_nulls_for_every(node, &ht->heads[index])
     {
-        dentry *d = container_of(l, dentry, d_cache_node);
+        dentry *d = container_of(node, dentry, d_hash);
 
-        if (d->d_parent != dent || d->d_name_hash != namehash)
+        if (__atomic_load_n(&d->d_cache_hash, __ATOMIC_RELAXED) != hash ||
+            __atomic_load_n(&d->d_parent, __ATOMIC_RELAXED) != parent)
             continue;
 
-        scoped_rwslock<rw_lock::read> g{d->d_lock};
-        if (d->d_parent == dent && d->d_name_hash == namehash && dentry_compare_name(d, name))
-        {
-            dentry_get(d);
-
+        if (dentry_compare_name(d, name))
             return d;
-        }
     }
 
+    if (restart && get_nulls_value(node) != index)
+        *restart = true;
+
     return nullptr;
 }
 
+dentry *dentry_lookup_rcu(dentry *dir, std::string_view name)
+{
+    const fnv_hash_t hash = hash_dentry_fields(dir, name);
+
+    for (;;)
+    {
+        bool restart = false;
+        dentry *d = __dentry_ht_lookup(rcu_dereference(dentry_ht), hash, dir, name, &restart);
+        if (d || !restart)
+            return d;
+    }
+}
+
+bool dentry_get_unless_zero(dentry *d)
+{
+    unsigned long ref = __atomic_load_n(&d->d_ref, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (ref == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&d->d_ref, &ref, ref + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
 dentry *dentry_open_from_cache(dentry *dent, std::string_view name)
 {
-    auto hash = hash_dentry_fields(dent, name);
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::read> g{dentry_ht_locks[index]};
+    dentry *d;
+
+    rcu_read_lock();
 
-    return dentry_open_from_cache_unlocked(dent, name);
+    for (;;)
+    {
+        const unsigned int seq = dcache_read_begin();
+
+        d = dentry_lookup_rcu(dent, name);
+        if (d && !dentry_get_unless_zero(d))
+            d = nullptr;
+
+        if (!d || !dcache_read_retry(seq))
+            break;
+
+        /* Raced with a rename, the dentry may not be what we were looking for */
+        rcu_read_unlock();
+        dentry_put(d);
+        rcu_read_lock();
+    }
+
+    rcu_read_unlock();
+    return d;
 }
 
-void dentry_remove_from_cache(dentry *dent, dentry *parent)
+static bool dentry_ht_needs_grow()
 {
-    auto hash = hash_dentry_fields(dent, std::string_view{dent->d_name, dent->d_name_length});
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::write> g{dentry_ht_locks[index]};
+    const struct dentry_hashtable *ht = __atomic_load_n(&dentry_ht, __ATOMIC_RELAXED);
+    const unsigned long nr_buckets = ht->mask + 1;
 
-    list_remove(&dent->d_cache_node);
+    return nr_buckets < DENTRY_HT_MAX_SIZE &&
+           __atomic_load_n(&dentry_ht_nr_entries, __ATOMIC_RELAXED) > nr_buckets;
 }
 
-static void dentry_add_to_cache(dentry *dent, dentry *parent)
+static void dentry_ht_free_rcu(struct rcu_head *head)
 {
-    auto hash = hash_dentry_fields(dent, std::string_view{dent->d_name, dent->d_name_length});
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::write> g{dentry_ht_locks[index]};
+    free(container_of(head, struct dentry_hashtable, rcu));
+}
+
+static void dentry_ht_grow()
+{
+    scoped_mutex g{dentry_ht_resize_lock};
+
+    if (!dentry_ht_needs_grow())
+        return;
+
+    struct dentry_hashtable *old = dentry_ht;
+    const unsigned long nr_buckets = (old->mask + 1) * 2;
+
+    struct dentry_hashtable *ht = (struct dentry_hashtable *) malloc(
+        sizeof(struct dentry_hashtable) + sizeof(struct hlist_nulls_head) * nr_buckets);
+    if (!ht)
+        return;
+
+    ht->mask = nr_buckets - 1;
+
+    for (unsigned long i = 0; i < nr_buckets; i++)
+        INIT_HLIST_NULLS_HEAD(&ht->heads[i], i);
 
-    list_add_tail(&dent->d_cache_node, dentry_ht.get_hashtable(index));
+    for (auto &l : dentry_ht_locks)
+        spin_lock(&l);
+
+    for (unsigned long i = 0; i <= old->mask; i++)
+    {
+        struct hlist_nulls_head *head = &old->heads[i];
+
+        /* Always move the head of the chain, so every node only ever points to nodes that were
+         * moved before it, or that weren't moved yet. Readers can't loop.
+         */
+        while (!is_a_nulls(head->first))
+        {
+            dentry *d = container_of(head->first, dentry, d_hash);
+            hlist_nulls_del(&d->d_hash);
+            hlist_nulls_add_head(&d->d_hash, &ht->heads[d->d_cache_hash & ht->mask]);
+        }
+    }
+
+    rcu_assign_pointer(dentry_ht, ht);
+
+    for (auto &l : dentry_ht_locks)
+        spin_unlock(&l);
+
+    call_rcu(&old->rcu, dentry_ht_free_rcu);
+}
+
+static void dentry_ht_maybe_grow()
+{
+    if (!dentry_ht_needs_grow() || sched_is_preemption_disabled())
+        return;
+
+    dentry_ht_grow();
+}
+
+/**
+ * @brief Hash a dentry. Must hold the hash's lock.
+ *
+ * @param dent Dentry
+ * @param hash Hash of (parent, name)
+ */
+static void __dentry_add_to_cache(dentry *dent, fnv_hash_t hash)
+{
+    struct dentry_hashtable *ht = dentry_ht;
+
+    dent->d_cache_hash = hash;
+    hlist_nulls_add_head(&dent->d_hash, &ht->heads[hash & ht->mask]);
+    __atomic_add_fetch(&dentry_ht_nr_entries, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Unhash a dentry. Must hold its hash's lock.
+ *
+ * @param dent Dentry
+ */
+static void __dentry_remove_from_cache(dentry *dent)
+{
+    if (hlist_nulls_unhashed(&dent->d_hash))
+        return;
+
+    hlist_nulls_del(&dent->d_hash);
+    __atomic_sub_fetch(&dentry_ht_nr_entries, 1, __ATOMIC_RELAXED);
+}
+
+static void dentry_add_to_cache(dentry *dent)
+{
+    const fnv_hash_t hash =
+        hash_dentry_fields(dent->d_parent, std::string_view{dent->d_name, dent->d_name_length});
+    scoped_lock g{*dentry_ht_lock_for(hash)};
+
+    __dentry_add_to_cache(dent, hash);
+}
+
+void dentry_remove_from_cache(dentry *dent)
+{
+    scoped_lock g{*dentry_ht_lock_for(dent->d_cache_hash)};
+    __dentry_remove_from_cache(dent);
 }
 
 void dentry_get(dentry *d)
@@ -120,6 +367,43 @@ void dentry_put(dentry *d)
         dentry_destroy(d);
 }
 
+static void dentry_free(dentry *d)
+{
+    if (d->d_inode)
+        inode_unref(d->d_inode);
+
+    if (d->d_name != d->d_inline_name)
+        free(container_of(d->d_name, struct dentry_name, name));
+
+    d->~dentry();
+    kmem_cache_free(dentry_cache, d);
+}
+
+static void dentry_free_work_fn(struct work_struct *work)
+{
+    struct rcu_head *head = __atomic_exchange_n(&dentry_free_list, nullptr, __ATOMIC_ACQUIRE);
+
+    while (head)
+    {
+        struct rcu_head *next = head->next;
+        dentry_free(container_of(head, dentry, d_rcu));
+        head = next;
+    }
+}
+
+static void dentry_free_rcu(struct rcu_head *head)
+{
+    struct rcu_head *first = __atomic_load_n(&dentry_free_list, __ATOMIC_RELAXED);
+
+    do
+    {
+        head->next = first;
+    } while (!__atomic_compare_exchange_n(&dentry_free_list, &first, head, false,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    schedule_work(&dentry_free_work);
+}
+
 void dentry_destroy(dentry *d)
 {
     if (d->d_parent)
@@ -129,23 +413,17 @@ void dentry_destroy(dentry *d)
             list_remove(&d->d_parent_dir_node);
         }
 
-        dentry_remove_from_cache(d, d->d_parent);
+        dentry_remove_from_cache(d);
 
         dentry_put(d->d_parent);
     }
-
-    if (d->d_inode)
-        inode_unref(d->d_inode);
+    else
+        dentry_remove_from_cache(d);
 
     // printk("Dentry %s dead\n", d->d_name);
 
-    if (d->d_name_length > INLINE_NAME_MAX)
-    {
-        free((void *) d->d_name);
-    }
-
-    d->~dentry();
-    kmem_cache_free(dentry_cache, d);
+    /* Lockless walkers may still be looking at us */
+    call_rcu(&d->d_rcu, dentry_free_rcu);
 }
 
 /**
@@ -155,7 +433,7 @@ void dentry_destroy(dentry *d)
  */
 void dentry_fail_lookup(dentry *d)
 {
-    dentry_remove_from_cache(d, d->d_parent);
+    dentry_remove_from_cache(d);
 
     {
         scoped_rwslock<rw_lock::write> g{d->d_parent->d_lock};
@@ -181,9 +459,22 @@ void dentry_complete_lookup(dentry *d)
     wake_address((void *) &d->d_flags);
 }
 
+/**
+ * @brief Complete a dentry lookup that didn't find anything.
+ * The dentry stays in the cache as a negative dentry, holding on to the lookup's ref.
+ *
+ * @param d Dentry
+ */
+static void dentry_complete_negative(dentry *d)
+{
+    d->d_flags |= DENTRY_FLAG_NEGATIVE;
+    dentry_complete_lookup(d);
+}
+
 void dentry_kill_unlocked(dentry *entry)
 {
-    assert(entry->d_ref == 1);
+    /* The caller took the last ref (the cache's) away */
+    assert(entry->d_ref == 0);
 
     if (entry->d_parent)
     {
@@ -192,7 +483,7 @@ void dentry_kill_unlocked(dentry *entry)
         entry->d_parent = nullptr;
     }
 
-    dentry_remove_from_cache(entry, entry->d_parent);
+    dentry_remove_from_cache(entry);
 
     dentry_destroy(entry);
 }
@@ -214,13 +505,13 @@ dentry *dentry_create(const char *name, inode *inode, dentry *parent)
 
     size_t name_length = strlen(name);
 
-    if (name_length <= INLINE_NAME_MAX)
+    if (name_length < INLINE_NAME_MAX)
     {
-        strlcpy(new_dentry->d_name, name, INLINE_NAME_MAX);
+        memcpy(new_dentry->d_name, name, name_length + 1);
     }
     else
     {
-        char *dname = (char *) memdup((void *) name, name_length + 1);
+        char *dname = dentry_alloc_name(name, name_length);
         if (!dname)
         {
             kmem_cache_free(dentry_cache, new_dentry);
@@ -233,6 +524,8 @@ dentry *dentry_create(const char *name, inode *inode, dentry *parent)
     new_dentry->d_name_length = name_length;
     new_dentry->d_name_hash = fnv_hash(new_dentry->d_name, new_dentry->d_name_length);
     new_dentry->d_inode = inode;
+    new_dentry->d_hash.pprev = nullptr;
+    new_dentry->d_cache_hash = 0;
 
     /* We need this if() because we might call dentry_create before retrieving an inode */
     if (inode)
@@ -253,6 +546,14 @@ dentry *dentry_create(const char *name, inode *inode, dentry *parent)
     return new_dentry;
 }
 
+/**
+ * @brief Wait for a pending dentry's lookup to finish
+ *
+ * @param dent Dentry (with a ref, which gets dropped on failure)
+ * @return The dentry, or nullptr if the lookup failed. errno is set to ENOENT if the name doesn't
+ * exist (we found a negative dentry), EAGAIN if the lookup failed for another reason and should
+ * be retried.
+ */
 dentry *dentry_wait_for_pending(dentry *dent)
 {
     wait_for(
@@ -263,10 +564,12 @@ dentry *dentry_wait_for_pending(dentry *dent)
         },
         WAIT_FOR_FOREVER, 0);
 
-    if (dent->d_flags & DENTRY_FLAG_FAILED)
+    const uint16_t flags = dent->d_flags;
+
+    if (flags & (DENTRY_FLAG_FAILED | DENTRY_FLAG_NEGATIVE))
     {
         dentry_put(dent);
-        return nullptr;
+        return errno = flags & DENTRY_FLAG_NEGATIVE ? ENOENT : EAGAIN, nullptr;
     }
 
     assert(dent->d_inode != nullptr);
@@ -274,37 +577,83 @@ dentry *dentry_wait_for_pending(dentry *dent)
     return dent;
 }
 
+/**
+ * @brief Get rid of a negative dentry, because the name is getting created.
+ * Must hold the parent's d_lock and the dentry's hash lock. The caller drops the refs after
+ * unlocking.
+ *
+ * @param dent Negative dentry
+ */
+static void dentry_unhash_negative(dentry *dent)
+{
+    __dentry_remove_from_cache(dent);
+    list_remove(&dent->d_parent_dir_node);
+    dent->d_parent = nullptr;
+}
+
 expected<dentry *, int> __dentry_create_pending_lookup(const char *name, inode *ino, dentry *parent,
                                                        bool check_existance)
 {
-    auto hash = hash_dentry_fields(parent, name);
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::write> g2{parent->d_lock};
-    scoped_rwslock<rw_lock::write> g{dentry_ht_locks[index]};
-    auto list = dentry_ht.get_hashtable(index);
+    const std::string_view namev{name};
+    auto hash = hash_dentry_fields(parent, namev);
 
-    auto dent = dentry_open_from_cache_unlocked(parent, std::string_view(name));
-
-    if (dent)
+    for (;;)
     {
-        g.unlock();
-        g2.unlock();
-        dent = dentry_wait_for_pending(dent);
+        scoped_rwslock<rw_lock::write> g2{parent->d_lock};
+        scoped_lock g{*dentry_ht_lock_for(hash)};
 
-        if (dent && check_existance)
-            return unexpected<int>{-EEXIST};
-        else if (dent)
-            return dent;
-    }
+        auto dent = __dentry_ht_lookup(dentry_ht, hash, parent, namev, nullptr);
+        if (dent && !dentry_get_unless_zero(dent))
+            dent = nullptr;
 
-    auto d = dentry_create(name, ino, parent);
-    if (!d)
-        return unexpected<int>{-ENOMEM};
+        if (dent && check_existance && dentry_is_negative(dent))
+        {
+            /* We're creating this name, the negative dentry is stale */
+            dentry_unhash_negative(dent);
+            g.unlock();
+            g2.unlock();
+
+            /* Drop our ref, the cache's ref and the negative dentry's ref on the parent */
+            dentry_put(parent);
+            dentry_put(dent);
+            dentry_put(dent);
+            continue;
+        }
 
-    d->d_flags |= DENTRY_FLAG_PENDING;
+        if (dent)
+        {
+            g.unlock();
+            g2.unlock();
+            dent = dentry_wait_for_pending(dent);
 
-    list_add_tail(&d->d_cache_node, list);
-    return d;
+            if (dent && check_existance)
+            {
+                dentry_put(dent);
+                return unexpected<int>{-EEXIST};
+            }
+            else if (dent)
+                return dent;
+
+            if (errno == ENOENT && !check_existance)
+                return unexpected<int>{-ENOENT};
+
+            /* The lookup failed, or we saw it go negative. Try again. */
+            continue;
+        }
+
+        auto d = dentry_create(name, ino, parent);
+        if (!d)
+            return unexpected<int>{-ENOMEM};
+
+        d->d_flags |= DENTRY_FLAG_PENDING;
+
+        __dentry_add_to_cache(d, hash);
+
+        g.unlock();
+        g2.unlock();
+        dentry_ht_maybe_grow();
+        return d;
+    }
 }
 
 expected<dentry *, int> dentry_create_pending_lookup(const char *name, inode *ino, dentry *parent,
@@ -320,8 +669,13 @@ dentry *__dentry_try_to_open(std::string_view name, dentry *dir, bool lock_ino)
         if (d->d_flags & DENTRY_FLAG_PENDING)
         {
             d = dentry_wait_for_pending(d);
-
-            return d;
+            if (d || errno == ENOENT)
+                return d;
+        }
+        else if (dentry_is_negative(d))
+        {
+            dentry_put(d);
+            return errno = ENOENT, nullptr;
         }
         else
             return d;
@@ -362,9 +716,20 @@ dentry *__dentry_try_to_open(std::string_view name, dentry *dir, bool lock_ino)
 
     if (!ino)
     {
+        /* Filesystems whose names can appear behind the VFS's back (sysfs, etc) don't get
+         * negative dentries, as nothing would ever replace them.
+         */
+        if (errno == ENOENT && pino->i_sb->s_flags & SB_FLAG_NEGATIVE_DENTRIES)
+        {
+            /* Remember that the name doesn't exist. Our ref becomes the cache's. */
+            dentry_complete_negative(dent);
+            return errno = ENOENT, nullptr;
+        }
+
         // printk("failed\n");
+        int err = errno;
         dentry_fail_lookup(dent);
-        return nullptr;
+        return errno = err, nullptr;
     }
 
     dent->d_inode = ino;
@@ -428,12 +793,20 @@ dentry *dentry_lookup_internal(std::string_view v, dentry *dir, dentry_lookup_fl
 
             if (dent)
                 return dent;
+            else if (errno == ENOENT)
+                return nullptr;
             else
             {
                 goto resolve;
             }
         }
 
+        if (dentry_is_negative(dent))
+        {
+            dentry_put(dent);
+            return errno = ENOENT, nullptr;
+        }
+
         return dent;
     }
 
@@ -550,6 +923,16 @@ void dentry_init()
 {
     dentry_cache = kmem_cache_create("dentry", sizeof(dentry), 0, KMEM_CACHE_HWALIGN, nullptr);
     CHECK(dentry_cache != nullptr);
+
+    dentry_ht = (struct dentry_hashtable *) malloc(
+        sizeof(struct dentry_hashtable) + sizeof(struct hlist_nulls_head) * DENTRY_HT_INITIAL_SIZE);
+    CHECK(dentry_ht != nullptr);
+
+    dentry_ht->mask = DENTRY_HT_INITIAL_SIZE - 1;
+    for (unsigned long i = 0; i < DENTRY_HT_INITIAL_SIZE; i++)
+        INIT_HLIST_NULLS_HEAD(&dentry_ht->heads[i], i);
+
+    INIT_WORK(&dentry_free_work, dentry_free_work_fn);
 }
 
 struct path_element
@@ -653,7 +1036,7 @@ void dentry_do_unlink(dentry *entry)
         inode_dec_nlink(entry->d_inode);
     }
 
-    dentry_remove_from_cache(entry, parent);
+    dentry_remove_from_cache(entry);
 
     entry->d_lock.unlock_write();
 
@@ -689,61 +1072,106 @@ bool dentry_does_not_have_parent(dentry *dir, dentry *to_not_have)
 
 void dentry_move(dentry *target, dentry *new_parent)
 {
+    /* target gets rehashed by the dentry_rename() that follows us */
+    dcache_write_begin();
+
     list_remove(&target->d_parent_dir_node);
 
     list_add_tail(&target->d_parent_dir_node, &new_parent->d_children_head);
 
     auto old = target->d_parent;
-    target->d_parent = new_parent;
+    __atomic_store_n(&target->d_parent, new_parent, __ATOMIC_RELAXED);
+
+    dcache_write_end();
 
     if (dentry_is_dir(target))
         inode_dec_nlink(old->d_inode);
 
-    dentry_get(old);
+    dentry_get(new_parent);
+    dentry_put(old);
 }
 
-void dentry_rename(dentry *dent, const char *name)
+/**
+ * @brief Get rid of a negative dentry for a name, because something is getting renamed over it
+ *
+ * @param dir Parent directory
+ * @param name Name
+ */
+static void dentry_invalidate_negative(dentry *dir, std::string_view name)
 {
-    size_t name_length = strlen(name);
+    const fnv_hash_t hash = hash_dentry_fields(dir, name);
+    dentry *dent;
 
-    if (name_length <= INLINE_NAME_MAX)
     {
-        strlcpy(dent->d_name, name, INLINE_NAME_MAX);
+        scoped_rwslock<rw_lock::write> g2{dir->d_lock};
+        scoped_lock g{*dentry_ht_lock_for(hash)};
 
-        /* It's in this exact order so we don't accidentally touch free'd memory or
-         * an invalid d_name that resulted from a non-filled inline d_name.
-         */
-        if (dent->d_name != dent->d_inline_name)
-        {
-            auto old = dent->d_name;
-            dent->d_name = dent->d_inline_name;
-            free(old);
-        }
+        dent = __dentry_ht_lookup(dentry_ht, hash, dir, name, nullptr);
+        if (!dent || !dentry_is_negative(dent) || !dentry_get_unless_zero(dent))
+            return;
+
+        dentry_unhash_negative(dent);
     }
-    else
+
+    dentry_put(dir);
+    dentry_put(dent);
+    dentry_put(dent);
+}
+
+void dentry_rename(dentry *dent, const char *name)
+{
+    size_t name_length = strlen(name);
+    char *dname = dent->d_inline_name;
+
+    dentry_invalidate_negative(dent->d_parent, std::string_view{name, name_length});
+
+    if (name_length >= INLINE_NAME_MAX)
     {
-        char *dname = (char *) memdup(name, name_length + 1);
+        dname = dentry_alloc_name(name, name_length);
         /* TODO: Ugh, how do I handle this? */
         assert(dname != nullptr);
+    }
 
-        auto old = dent->d_name;
+    /* Lockless walkers can find us in the hash table while we change names, and compare against
+     * either name. They get told to retry by the sequence count.
+     */
+    dcache_write_begin();
 
-        dent->d_name = dname;
+    dentry_remove_from_cache(dent);
 
-        if (old != dent->d_inline_name)
-        {
-            free(old);
-        }
+    char *old = dent->d_name;
+
+    if (dname == dent->d_inline_name)
+    {
+        /* Make sure nobody sees the inline buffer with a long name's length */
+        __atomic_store_n(&dent->d_name_length, name_length, __ATOMIC_RELAXED);
+        memcpy(dent->d_inline_name, name, name_length + 1);
     }
 
-    dent->d_name_length = name_length;
+    __atomic_store_n(&dent->d_name, dname, __ATOMIC_RELAXED);
+    __atomic_store_n(&dent->d_name_length, name_length, __ATOMIC_RELAXED);
     dent->d_name_hash = fnv_hash(dent->d_name, dent->d_name_length);
+
+    if (old != dent->d_inline_name)
+        call_rcu(&container_of(old, struct dentry_name, name)->rcu, dentry_free_name_rcu);
+
+    dentry_add_to_cache(dent);
+
+    dcache_write_end();
 }
 
 bool dentry_is_empty(dentry *dir)
 {
     scoped_rwslock<rw_lock::write> g{dir->d_lock};
-    return list_is_empty(&dir->d_children_head);
+
+    list_for_every (&dir->d_children_head)
+    {
+        dentry *d = container_of(l, dentry, d_parent_dir_node);
+        if (!dentry_is_negative(d))
+            return false;
+    }
+
+    return true;
 }
 
 cul::atomic_size_t killed_dentries = 0;
@@ -771,7 +1199,13 @@ void dentry_trim_caches()
             {
                 dentry *d = container_of(l, dentry, d_parent_dir_node);
 
-                if (d->d_ref == 1)
+                unsigned long ref = 1;
+
+                /* Only the cache holds a ref. Take it away, so lockless lookups can't get
+                 * new ones.
+                 */
+                if (__atomic_compare_exchange_n(&d->d_ref, &ref, 0, false, __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
                 {
                     // If we're destroying this dentry, take a peek at the parent and
                     // check if they have a ref of 2 (refe'd by themselves for existing, and us)
@@ -789,7 +1223,7 @@ void dentry_trim_caches()
                 else
                 {
                     // Still has refs. If directory, try and clean it up next
-                    if (dentry_is_dir(d))
+                    if (d->d_inode && dentry_is_dir(d))
                     {
                         // We need to ref dentries, so we don't lose them magically
                         dentry_get(d);
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/direct_io.h>
+#include <onyx/page.h>
+#include <onyx/utils.h>
+#include <onyx/vm.h>
+
+/* The buffer gets pinned a batch's worth of pages at a time */
+#define DIO_MAX_PAGES (BIO_BATCH_SIZE * BIO_BATCH_NR_VECS)
+
+struct dio
+{
+    struct blockdev *dev;
+    unsigned int flags;
+    struct bio_batch *batch;
+    /* Number of requests queued up in the batch */
+    unsigned int nr_reqs;
+    struct page *pages[DIO_MAX_PAGES];
+};
+
+static int dio_submit(struct dio *d)
+{
+    if (!d->nr_reqs)
+        return 0;
+
+    int st = bio_batch_submit(d->dev, d->batch, d->nr_reqs);
+    d->nr_reqs = 0;
+    return st;
+}
+
+/**
+ * @brief Queue up a piece of a pinned page for I/O
+ *
+ * @param d Direct I/O request
+ * @param sector Sector the piece maps to
+ * @param page Page
+ * @param page_off Offset of the piece in the page
+ * @param len Length of the piece
+ * @return 0 on success, negative error codes
+ */
+static int dio_add_page(struct dio *d, sector_t sector, struct page *page, unsigned int page_off,
+                        unsigned int len)
+{
+    struct bio_batch *b = d->batch;
+    const unsigned int sector_size = d->dev->sector_size;
+
+    if (d->nr_reqs)
+    {
+        struct bio_req *req = &b->reqs[d->nr_reqs - 1];
+        struct page_iov *last = &req->vec[req->nr_vecs - 1];
+
+        if (req->sector_number + req->nr_sectors == sector)
+        {
+            /* Contiguous on the disk. Pieces of the same page get merged, otherwise the new
+             * piece needs to pick up at the start of a page, where the last one left off.
+             */
+            if (last->page == page && last->page_off + last->length == page_off)
+            {
+                last->length += len;
+                req->nr_sectors += len / sector_size;
+                return 0;
+            }
+
+            if (last->page_off + last->length == PAGE_SIZE && page_off == 0 &&
+                req->nr_vecs < BIO_BATCH_NR_VECS)
+            {
+                struct page_iov *v = &req->vec[req->nr_vecs++];
+                v->page = page;
+                v->page_off = 0;
+                v->length = len;
+                req->nr_sectors += len / sector_size;
+                return 0;
+            }
+        }
+    }
+
+    if (d->nr_reqs == BIO_BATCH_SIZE)
+    {
+        if (int st = dio_submit(d); st < 0)
+            return st;
+    }
+
+    struct bio_req *req = &b->reqs[d->nr_reqs];
+    req->flags = d->flags & DIO_WRITE ? BIO_REQ_WRITE_OP : BIO_REQ_READ_OP;
+    req->sector_number = sector;
+    req->nr_sectors = len / sector_size;
+    req->vec = b->vecs[d->nr_reqs];
+    req->nr_vecs = 1;
+    req->vec->page = page;
+    req->vec->page_off = page_off;
+    req->vec->length = len;
+    d->nr_reqs++;
+
+    return 0;
+}
+
+/**
+ * @brief Do direct I/O on a chunk of the buffer that fits in a batch
+ *
+ * @param d Direct I/O request
+ * @param ino Inode
+ * @param off Offset in the file
+ * @param len Length of the chunk
+ * @param addr Address of the chunk
+ * @param map Map callback
+ * @return Number of bytes transferred, or negative error codes
+ */
+static ssize_t dio_do_chunk(struct dio *d, struct inode *ino, size_t off, size_t len,
+                            unsigned long addr, dio_map_t map)
+{
+    const bool write = d->flags & DIO_WRITE;
+    const unsigned int page_off = addr & (PAGE_SIZE - 1);
+    const size_t nr_pages = vm_size_to_pages(page_off + len);
+    size_t done = 0;
+    int st = 0;
+
+    /* Reads from the disk write to the buffer, and writes read from it */
+    if (!(get_phys_pages((void *) (addr - page_off), GPP_USER | (write ? GPP_READ : GPP_WRITE),
+                         d->pages, nr_pages) &
+          GPP_ACCESS_OK))
+        return -EFAULT;
+
+    while (done < len)
+    {
+        sector_t sector;
+        ssize_t mapped = map(ino, off + done, len - done, &sector);
+
+        if (mapped <= 0)
+        {
+            st = mapped ?: -EIO;
+            break;
+        }
+
+        /* Holes need to be filled in by the filesystem first */
+        if (write && sector == DIO_SECTOR_HOLE)
+            break;
+
+        for (size_t pos = 0; pos < (size_t) mapped;)
+        {
+            const size_t buf_off = page_off + done + pos;
+            struct page *page = d->pages[buf_off >> PAGE_SHIFT];
+            const unsigned int poff = buf_off & (PAGE_SIZE - 1);
+            const unsigned int amount = min((size_t) mapped - pos, PAGE_SIZE - poff);
+
+            if (sector == DIO_SECTOR_HOLE)
+                memset((char *) PAGE_TO_VIRT(page) + poff, 0, amount);
+            else if ((st = dio_add_page(d, sector + pos / d->dev->sector_size, page, poff,
+                                        amount)) < 0)
+                break;
+
+            pos += amount;
+        }
+
+        if (st < 0)
+            break;
+
+        done += mapped;
+    }
+
+    if (int st2 = dio_submit(d); st2 < 0 && !st)
+        st = st2;
+
+    for (size_t i = 0; i < nr_pages; i++)
+        page_unpin(d->pages[i]);
+
+    return st < 0 ? st : (ssize_t) done;
+}
+
+ssize_t do_direct_io(struct blockdev *dev, struct inode *ino, size_t off, size_t len, void *ubuf,
+                     unsigned int flags, dio_map_t map)
+{
+    unsigned long addr = (unsigned long) ubuf;
+    size_t done = 0;
+    ssize_t st = 0;
+
+    if (!dio_is_aligned(dev, off, len, ubuf))
+        return -EINVAL;
+
+    struct dio *d = (struct dio *) malloc(sizeof(struct dio));
+    if (!d)
+        return -ENOMEM;
+
+    d->batch = bio_batch_alloc();
+    if (!d->batch)
+    {
+        free(d);
+        return -ENOMEM;
+    }
+
+    d->dev = dev;
+    d->flags = flags;
+    d->nr_reqs = 0;
+
+    while (done < len)
+    {
+        const size_t chunk =
+            min(len - done, DIO_MAX_PAGES * PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+
+        st = dio_do_chunk(d, ino, off + done, chunk, addr, map);
+        if (st <= 0)
+            break;
+
+        done += st;
+        addr += st;
+
+        /* Stopped at a hole */
+        if ((size_t) st != chunk)
+            break;
+    }
+
+    free(d->batch);
+    free(d);
+
+    return done ?: st;
+}
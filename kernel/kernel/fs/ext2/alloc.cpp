@@ -93,13 +93,7 @@ ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr
     return res.value_or(EXT2_ERR_INV_BLOCK);
 }
 
-/**
- * @brief Allocates a block, taking into account the preferred block group
- *
- * @param preferred The preferred block group. If -1, no preferrence
- * @return Block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
- */
-ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
+ext2_block_no ext2_superblock::try_allocate_block(ext2_block_group_no preferred)
 {
     if (sb->s_free_blocks_count == 0) [[unlikely]]
         return EXT2_ERR_INV_BLOCK;
@@ -151,6 +145,29 @@ ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
     return EXT2_ERR_INV_BLOCK;
 }
 
+/**
+ * @brief Allocates a block, taking into account the preferred block group
+ *
+ * @param preferred The preferred block group. If -1, no preferrence
+ * @return Block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
+ */
+ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
+{
+    ext2_block_no block = try_allocate_block(preferred);
+
+    /* Blocks waiting to be discarded are still allocated. Get them back before giving up. Retry
+     * even if we had nothing to flush: we may have just waited for someone else's flush, which
+     * released its blocks after our first try.
+     */
+    if (block == EXT2_ERR_INV_BLOCK && online_discard)
+    {
+        flush_discards();
+        block = try_allocate_block(preferred);
+    }
+
+    return block;
+}
+
 /**
  * @brief Frees a block
  *
@@ -164,5 +181,8 @@ void ext2_superblock::free_block(ext2_block_no block)
 
     assert(block_group < number_of_block_groups);
 
+    if (online_discard && queue_discard(block))
+        return;
+
     block_groups[block_group].free_block(block, this);
 }
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+
+#include <onyx/direct_io.h>
+#include <onyx/pagecache.h>
+#include <onyx/scoped_lock.h>
+
+#include "ext2.h"
+
+static ssize_t ext2_dio_map(struct inode *ino, size_t off, size_t len, sector_t *sector)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    auto raw_inode = ext2_get_inode_from_node(ino);
+    const size_t block_off = off & (sb->block_size - 1);
+    const ext2_block_no first_index = off >> sb->block_size_shift;
+    ext2_block_no first = EXT2_ERR_INV_BLOCK;
+    size_t mapped = 0;
+
+    /* Look up blocks until they stop being contiguous (or stop being a hole) */
+    for (ext2_block_no i = 0; mapped < len; i++)
+    {
+        auto res = ext2_get_block_from_inode(raw_inode, first_index + i, sb);
+        if (res.has_error())
+        {
+            if (mapped)
+                break;
+            return res.error();
+        }
+
+        ext2_block_no block = res.value();
+
+        if (i == 0)
+            first = block;
+        else if (first == EXT2_ERR_INV_BLOCK ? block != EXT2_ERR_INV_BLOCK
+                                             : block != first + i)
+            break;
+
+        mapped += sb->block_size - (i == 0 ? block_off : 0);
+    }
+
+    if (first == EXT2_ERR_INV_BLOCK)
+        *sector = DIO_SECTOR_HOLE;
+    else
+        *sector = ((sector_t) first << sb->block_size_shift) / sb->s_bdev->sector_size +
+                  block_off / sb->s_bdev->sector_size;
+
+    return cul::min(mapped, len);
+}
+
+static ssize_t ext2_direct_read(size_t off, size_t len, void *ubuf, struct inode *ino)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    scoped_rwlock<rw_lock::read> g{ino->i_rwlock};
+
+    if (off >= ino->i_size)
+        return 0;
+
+    /* The disk deals in whole sectors, so the tail of the last one gets read in too. The buffer's
+     * big enough for it, since len is aligned.
+     */
+    const size_t to_read = cul::min(len, ino->i_size - off);
+    const size_t io_len = cul::align_up2(to_read, (size_t) sb->s_bdev->sector_size);
+
+    /* Whatever's dirty in the page cache is newer than what's on the disk */
+    if (int st = inode_sync_range(ino, off, off + io_len); st < 0)
+        return st;
+
+    ssize_t st = do_direct_io(sb->s_bdev, ino, off, io_len, ubuf, 0, ext2_dio_map);
+    if (st < 0)
+        return st;
+
+    return cul::min((size_t) st, to_read);
+}
+
+static ssize_t ext2_direct_write(size_t off, size_t len, void *ubuf, struct inode *ino)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+    scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
+    ssize_t written = 0;
+    ssize_t st;
+
+    /* Only blocks that are already there get written directly */
+    size_t direct_len = 0;
+    if (off < ino->i_size)
+        direct_len = cul::align_down2(cul::min(len, ino->i_size - off),
+                                      (size_t) sb->s_bdev->sector_size);
+
+    if (direct_len)
+    {
+        /* Write back and drop the cached pages first, so they don't overwrite us later */
+        if ((st = inode_invalidate_range(ino, off, off + direct_len)) < 0)
+            return st;
+
+        written = do_direct_io(sb->s_bdev, ino, off, direct_len, ubuf, DIO_WRITE, ext2_dio_map);
+        if (written < 0)
+            return written;
+
+        /* Someone may have faulted the range back in, through a mapping */
+        inode_invalidate_range(ino, off, off + written);
+
+        if ((size_t) written == len)
+            return written;
+    }
+
+    /* Holes and appends need blocks allocated and the size updated, which the page cache already
+     * knows how to do. Write those through it, and write them back right away.
+     */
+    const size_t rest = off + written;
+
+    st = file_write_cache_unlocked((char *) ubuf + written, len - written, ino, rest);
+    if (st < 0)
+        return written ?: st;
+
+    if (int st2 = inode_sync_range(ino, rest, rest + st); st2 < 0)
+        return written ?: st2;
+
+    inode_invalidate_range(ino, rest, rest + st);
+
+    return written + st;
+}
+
+ssize_t ext2_direct_io(size_t off, size_t len, void *ubuf, unsigned int flags, struct file *f)
+{
+    auto sb = ext2_superblock_from_inode(f->f_ino);
+
+    if (!dio_is_aligned(sb->s_bdev, off, len, ubuf))
+        return -EINVAL;
+
+    if (flags & DIO_WRITE)
+        return ext2_direct_write(off, len, ubuf, f->f_ino);
+    return ext2_direct_read(off, len, ubuf, f->f_ino);
+}
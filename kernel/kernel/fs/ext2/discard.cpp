@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <limits.h>
+
+#include <onyx/clock.h>
+#include <onyx/cred.h>
+#include <onyx/user.h>
+
+#include <uapi/fs.h>
+
+#include "ext2.h"
+
+/**
+ * @brief Queue a freed block for discard
+ *
+ * @param block Block number
+ * @return True if queued, false if it should be freed right away
+ */
+bool ext2_superblock::queue_discard(ext2_block_no block)
+{
+    scoped_mutex g{discard_lock};
+
+    /* Files get freed block by block, in order, so the last extent is usually the one to grow */
+    if (discard_pending.size())
+    {
+        auto &last = discard_pending.back();
+
+        if (last.start + last.len == block)
+        {
+            last.len++;
+            goto queued;
+        }
+
+        if (block + 1 == last.start)
+        {
+            last.start--;
+            last.len++;
+            goto queued;
+        }
+    }
+
+    if (!discard_pending.push_back(ext2_discard_extent{block, 1}))
+        return false;
+
+queued:
+    if (discard_pending.size() >= EXT2_DISCARD_BATCH)
+        queue_work(system_unbound_wq, &discard_batch_work);
+    else
+        queue_delayed_work(system_unbound_wq, &discard_work, EXT2_DISCARD_DELAY);
+    return true;
+}
+
+/**
+ * @brief Discard a range of blocks
+ *
+ * @param start First block
+ * @param len Number of blocks
+ * @return 0 on success, negative error codes
+ */
+int ext2_superblock::discard_blocks(ext2_block_no start, ext2_block_no len)
+{
+    const sector_t sectors_per_block = block_size / s_bdev->sector_size;
+    return blkdev_issue_discard(s_bdev, (sector_t) start * sectors_per_block,
+                                (sector_t) len * sectors_per_block);
+}
+
+/**
+ * @brief Discard the blocks waiting for it, and release them
+ *
+ * @return True if any blocks got released
+ */
+bool ext2_superblock::flush_discards()
+{
+    /* Hold the flush lock until the blocks are released, so anyone that runs out of space while
+     * we're at it waits for them.
+     */
+    scoped_mutex flush{discard_flush_lock};
+    cul::vector<ext2_discard_extent> extents;
+
+    {
+        scoped_mutex g{discard_lock};
+        extents = cul::move(discard_pending);
+    }
+
+    if (!extents.size())
+        return false;
+
+    for (auto &e : extents)
+    {
+        /* A failed discard is harmless, the device just doesn't get the blocks back */
+        if (discard_blocks(e.start, e.len) == -EOPNOTSUPP)
+            online_discard = false;
+
+        for (uint32_t i = 0; i < e.len; i++)
+        {
+            ext2_block_no block = e.start + i;
+            block_groups[(block - first_data_block()) / blocks_per_block_group].free_block(block,
+                                                                                          this);
+        }
+    }
+
+    return true;
+}
+
+void ext2_superblock::ext2_discard_work(struct work_struct *work)
+{
+    ext2_superblock *sb = container_of(work, ext2_superblock, discard_work.work);
+    sb->flush_discards();
+}
+
+void ext2_superblock::ext2_discard_batch_work(struct work_struct *work)
+{
+    ext2_superblock *sb = container_of(work, ext2_superblock, discard_batch_work);
+    sb->flush_discards();
+}
+
+static bool ext2_bitmap_test(const uint8_t *bitmap, uint32_t bit)
+{
+    return bitmap[bit / CHAR_BIT] & (1 << (bit % CHAR_BIT));
+}
+
+/**
+ * @brief Discard the free space in a range of the group's blocks
+ *
+ * @param sb Superblock
+ * @param start First bit of the bitmap
+ * @param end Last bit of the bitmap (exclusive)
+ * @param minlen Minimum length of a free extent for it to be discarded
+ * @param trimmed Incremented by the number of discarded blocks
+ * @return 0 on success, negative error codes
+ */
+int ext2_block_group::trim(ext2_superblock *sb, uint32_t start, uint32_t end, uint32_t minlen,
+                           uint64_t *trimmed)
+{
+    /* Nothing can get allocated from under the discards while we hold the bitmap lock */
+    scoped_mutex g{block_bitmap_lock};
+
+    if (bgd->unallocated_blocks_in_group < minlen)
+        return 0;
+
+    auto_block_buf buf = sb_read_block(sb, bgd->block_usage_addr);
+
+    if (!buf)
+    {
+        sb->error("Failed to read block bitmap");
+        return -EIO;
+    }
+
+    auto bitmap = static_cast<const uint8_t *>(block_buf_data(buf));
+    const ext2_block_no first_block = nr * sb->blocks_per_block_group + sb->first_data_block();
+    uint32_t bit = start;
+
+    while (bit < end)
+    {
+        if (ext2_bitmap_test(bitmap, bit))
+        {
+            bit++;
+            continue;
+        }
+
+        uint32_t run = bit;
+        while (bit < end && !ext2_bitmap_test(bitmap, bit))
+            bit++;
+
+        if (bit - run < minlen)
+            continue;
+
+        if (int st = sb->discard_blocks(first_block + run, bit - run); st < 0)
+            return st;
+
+        *trimmed += bit - run;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Discard the free blocks in a range of the filesystem (FITRIM)
+ *
+ * @param start First block
+ * @param len Number of blocks
+ * @param minlen Minimum length of a free extent for it to be discarded
+ * @param trimmed Set to the number of discarded blocks
+ * @return 0 on success, negative error codes
+ */
+int ext2_superblock::trim(uint64_t start, uint64_t len, uint64_t minlen, uint64_t *trimmed)
+{
+    *trimmed = 0;
+
+    if (start >= total_blocks || minlen > blocks_per_block_group)
+        return -EINVAL;
+
+    const uint64_t end = len > total_blocks - start ? total_blocks : start + len;
+    if (start < first_data_block())
+        start = first_data_block();
+    if (minlen == 0)
+        minlen = 1;
+
+    /* Blocks waiting for online discard are still allocated, get them out of the way first */
+    if (online_discard)
+        flush_discards();
+
+    for (uint32_t i = (start - first_data_block()) / blocks_per_block_group;
+         i < number_of_block_groups; i++)
+    {
+        const uint64_t bg_start = (uint64_t) i * blocks_per_block_group + first_data_block();
+        if (bg_start >= end)
+            break;
+
+        uint32_t first_bit = start > bg_start ? start - bg_start : 0;
+        uint32_t last_bit = cul::min(end - bg_start, (uint64_t) blocks_per_block_group);
+
+        if (int st = block_groups[i].trim(this, first_bit, last_bit, minlen, trimmed); st < 0)
+            return st;
+    }
+
+    return 0;
+}
+
+unsigned int ext2_ioctl(int request, void *argp, struct file *f)
+{
+    ext2_superblock *sb = ext2_superblock_from_inode(f->f_ino);
+
+    switch (request)
+    {
+        case FITRIM: {
+            struct fstrim_range range;
+            uint64_t trimmed;
+
+            if (!is_root_user())
+                return -EPERM;
+
+            if (!blkdev_supports_discard(sb->s_bdev))
+                return -EOPNOTSUPP;
+
+            if (copy_from_user(&range, argp, sizeof(range)) < 0)
+                return -EFAULT;
+
+            const uint64_t minlen =
+                (range.minlen + sb->block_size - 1) >> sb->block_size_shift;
+
+            int st = sb->trim(range.start >> sb->block_size_shift,
+                              range.len >> sb->block_size_shift, minlen, &trimmed);
+            if (st < 0)
+                return st;
+
+            range.len = trimmed << sb->block_size_shift;
+
+            if (copy_to_user(argp, &range, sizeof(range)) < 0)
+                return -EFAULT;
+
+            return 0;
+        }
+    }
+
+    return -ENOTTY;
+}
@@ -44,10 +44,13 @@ ssize_t ext2_writepage(struct page *page, size_t off, struct inode *ino);
 int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len);
 int ext2_link(struct inode *target, const char *name, struct inode *dir);
 inode *ext2_symlink(const char *name, const char *dest, dentry *dir);
+unsigned int ext2_ioctl(int request, void *argp, struct file *f);
+ssize_t ext2_direct_io(size_t off, size_t len, void *ubuf, unsigned int flags, struct file *f);
 
 struct file_ops ext2_ops = {.open = ext2_open,
                             .close = ext2_close,
                             .getdirent = ext2_getdirent,
+                            .ioctl = ext2_ioctl,
                             .creat = ext2_creat,
                             .link = ext2_link_fops,
                             .symlink = ext2_symlink,
@@ -59,7 +62,8 @@ struct file_ops ext2_ops = {.open = ext2_open,
                             .fallocate = ext2_fallocate,
                             .readpage = ext2_readpage,
                             .writepage = ext2_writepage,
-                            .prepare_write = ext2_prepare_write};
+                            .prepare_write = ext2_prepare_write,
+                            .direct_io = ext2_direct_io};
 
 void ext2_delete_inode(struct inode *inode_, uint32_t inum, struct ext2_superblock *fs)
 {
@@ -493,6 +497,13 @@ int ext2_statfs(struct statfs *buf, superblock *sb)
     return ((ext2_superblock *) sb)->stat_fs(buf);
 }
 
+int ext2_sync_fs(superblock *sb)
+{
+    /* Blocks waiting for online discard are still allocated on disk, release them */
+    ((ext2_superblock *) sb)->flush_discards();
+    return 0;
+}
+
 struct inode *ext2_mount_partition(struct blockdev *dev)
 {
     LOG("ext2", "mounting ext2 partition on block device %s\n", dev->name.c_str());
@@ -616,6 +627,11 @@ struct inode *ext2_mount_partition(struct blockdev *dev)
     sb->flush_inode = ext2_flush_inode;
     sb->kill_inode = ext2_kill_inode;
     sb->statfs = ext2_statfs;
+    sb->sync_fs = ext2_sync_fs;
+    sb->online_discard = blkdev_supports_discard(dev);
+
+    if (sb->online_discard)
+        LOG("ext2", "%s supports discard, enabling online discard\n", dev->name.c_str());
 
     sb->sb->s_mtime = clock_get_posix_time();
     sb->sb->s_mnt_count++;
@@ -628,6 +644,7 @@ struct inode *ext2_mount_partition(struct blockdev *dev)
 error:
     if (b)
         block_buf_put(b);
+    dev->sb = nullptr;
     delete sb;
 
     return nullptr;
@@ -20,6 +20,7 @@
 #include <onyx/spinlock.h>
 #include <onyx/vector.h>
 #include <onyx/vfs.h>
+#include <onyx/workqueue.h>
 
 #include <onyx/expected.hpp>
 #include <onyx/pair.hpp>
@@ -384,9 +385,33 @@ public:
     expected<ext2_block_no, int> allocate_block(ext2_superblock *sb);
     void free_block(ext2_block_no block, ext2_superblock *sb);
 
+    /**
+     * @brief Discard the free space in a range of the group's blocks
+     *
+     * @param sb Superblock
+     * @param start First bit of the bitmap
+     * @param end Last bit of the bitmap (exclusive)
+     * @param minlen Minimum length of a free extent for it to be discarded
+     * @param trimmed Incremented by the number of discarded blocks
+     * @return 0 on success, negative error codes
+     */
+    int trim(ext2_superblock *sb, uint32_t start, uint32_t end, uint32_t minlen,
+             uint64_t *trimmed);
+
     auto_block_buf get_inode_table(const ext2_superblock *sb, uint32_t off) const;
 };
 
+/* A range of blocks waiting to be discarded */
+struct ext2_discard_extent
+{
+    ext2_block_no start;
+    uint32_t len;
+};
+
+/* Pending extents before we kick off a discard, instead of waiting for the timer */
+#define EXT2_DISCARD_BATCH 128
+#define EXT2_DISCARD_DELAY (5 * NS_PER_SEC)
+
 struct block_buf;
 struct ext2_superblock : public superblock
 {
@@ -409,14 +434,40 @@ struct ext2_superblock : public superblock
     unsigned int entry_shift;
     cul::vector<ext2_block_group> block_groups;
 
+    /* Online discard: freed blocks are only released in the bitmaps once they've been discarded,
+     * so they can't get reallocated (and written to) while the discard is in flight.
+     * discard_lock protects the pending list, discard_flush_lock serializes flushes.
+     */
+    bool online_discard;
+    mutex discard_lock;
+    mutex discard_flush_lock;
+    cul::vector<ext2_discard_extent> discard_pending;
+    struct delayed_work discard_work;
+    struct work_struct discard_batch_work;
+
     ext2_block_no try_allocate_block_from_bg(ext2_block_group_no nr);
+    ext2_block_no try_allocate_block(ext2_block_group_no preferred);
+
+    /**
+     * @brief Queue a freed block for discard
+     *
+     * @param block Block number
+     * @return True if queued, false if it should be freed right away
+     */
+    bool queue_discard(ext2_block_no block);
 
 public:
-    ext2_superblock()
+    ext2_superblock() : online_discard{}
     {
         superblock_init(this);
+        s_flags = SB_FLAG_NEGATIVE_DENTRIES;
+        INIT_DELAYED_WORK(&discard_work, ext2_discard_work);
+        INIT_WORK(&discard_batch_work, ext2_discard_batch_work);
     }
 
+    static void ext2_discard_work(struct work_struct *work);
+    static void ext2_discard_batch_work(struct work_struct *work);
+
     /**
      * @brief Alocates an inode
      *
@@ -454,6 +505,33 @@ public:
      */
     void free_block(ext2_block_no block);
 
+    /**
+     * @brief Discard the blocks waiting for it, and release them
+     *
+     * @return True if any blocks got released
+     */
+    bool flush_discards();
+
+    /**
+     * @brief Discard a range of blocks
+     *
+     * @param start First block
+     * @param len Number of blocks
+     * @return 0 on success, negative error codes
+     */
+    int discard_blocks(ext2_block_no start, ext2_block_no len);
+
+    /**
+     * @brief Discard the free blocks in a range of the filesystem (FITRIM)
+     *
+     * @param start First block
+     * @param len Number of blocks
+     * @param minlen Minimum length of a free extent for it to be discarded
+     * @param trimmed Set to the number of discarded blocks
+     * @return 0 on success, negative error codes
+     */
+    int trim(uint64_t start, uint64_t len, uint64_t minlen, uint64_t *trimmed);
+
     /**
      * @brief Read an ext2_inode from disk
      *
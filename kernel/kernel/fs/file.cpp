@@ -80,11 +80,29 @@ void fd_put(struct file *fd)
     }
 }
 
+/**
+ * @brief Grab a reference to a file we found through an RCU lookup.
+ * Fails if the file is on its way out (its fd got closed and it dropped to 0 refs).
+ */
+static bool fd_get_unless_zero(struct file *f)
+{
+    unsigned long refs = __atomic_load_n(&f->f_refcount, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (refs == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&f->f_refcount, &refs, refs + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
 static inline bool fd_is_open(int fd, struct ioctx *ctx)
 {
     unsigned long long_idx = fd / FDS_PER_LONG;
     unsigned long bit_idx = fd % FDS_PER_LONG;
-    return ctx->open_fds[long_idx] & (1UL << bit_idx);
+    return ctx->fdt->open_fds[long_idx] & (1UL << bit_idx);
 }
 
 static bool validate_fd_number(int fd, struct ioctx *ctx)
@@ -94,7 +112,7 @@ static bool validate_fd_number(int fd, struct ioctx *ctx)
         return false;
     }
 
-    if ((unsigned int) fd >= ctx->file_desc_entries)
+    if ((unsigned int) fd >= ctx->fdt->file_desc_entries)
     {
         return false;
     }
@@ -111,7 +129,7 @@ static inline void fd_close_bit(int fd, struct ioctx *ctx)
 {
     unsigned long long_idx = fd / FDS_PER_LONG;
     unsigned long bit_idx = fd % FDS_PER_LONG;
-    ctx->open_fds[long_idx] &= ~(1UL << bit_idx);
+    ctx->fdt->open_fds[long_idx] &= ~(1UL << bit_idx);
 }
 
 void fd_set_cloexec(int fd, bool toggle, struct ioctx *ctx)
@@ -120,9 +138,9 @@ void fd_set_cloexec(int fd, bool toggle, struct ioctx *ctx)
     unsigned long bit_idx = fd % FDS_PER_LONG;
 
     if (toggle)
-        ctx->cloexec_fds[long_idx] |= (1UL << bit_idx);
+        ctx->fdt->cloexec_fds[long_idx] |= (1UL << bit_idx);
     else
-        ctx->cloexec_fds[long_idx] &= ~(1UL << bit_idx);
+        ctx->fdt->cloexec_fds[long_idx] &= ~(1UL << bit_idx);
 }
 
 void fd_set_open(int fd, bool toggle, struct ioctx *ctx)
@@ -131,9 +149,9 @@ void fd_set_open(int fd, bool toggle, struct ioctx *ctx)
     unsigned long bit_idx = fd % FDS_PER_LONG;
 
     if (toggle)
-        ctx->open_fds[long_idx] |= (1UL << bit_idx);
+        ctx->fdt->open_fds[long_idx] |= (1UL << bit_idx);
     else
-        ctx->open_fds[long_idx] &= ~(1UL << bit_idx);
+        ctx->fdt->open_fds[long_idx] &= ~(1UL << bit_idx);
 }
 
 bool fd_is_cloexec(int fd, struct ioctx *ctx)
@@ -141,7 +159,7 @@ bool fd_is_cloexec(int fd, struct ioctx *ctx)
     unsigned long long_idx = fd / FDS_PER_LONG;
     unsigned long bit_idx = fd % FDS_PER_LONG;
 
-    return ctx->cloexec_fds[long_idx] & (1UL << bit_idx);
+    return ctx->fdt->cloexec_fds[long_idx] & (1UL << bit_idx);
 }
 
 struct file *__get_file_description_unlocked(int fd, struct process *p)
@@ -151,7 +169,7 @@ struct file *__get_file_description_unlocked(int fd, struct process *p)
     if (!validate_fd_number(fd, ctx))
         return errno = EBADF, nullptr;
 
-    struct file *f = ctx->file_desc[fd];
+    struct file *f = ctx->fdt->file_desc[fd];
     fd_get(f);
 
     return f;
@@ -160,12 +178,28 @@ struct file *__get_file_description_unlocked(int fd, struct process *p)
 struct file *__get_file_description(int fd, struct process *p)
 {
     struct ioctx *ctx = &p->ctx;
+    struct file *f = nullptr;
 
-    spin_lock(&ctx->fdlock);
+    if (fd < 0)
+        return errno = EBADF, nullptr;
+
+    /* Lockless lookup. Tables and files are only freed after a grace period, so all we need to
+     * watch out for is a concurrent close dropping the last reference.
+     */
+    rcu_read_lock();
 
-    struct file *f = __get_file_description_unlocked(fd, p);
+    struct fd_table *fdt = rcu_dereference(ctx->fdt);
 
-    spin_unlock(&ctx->fdlock);
+    if (fdt && (unsigned int) fd < fdt->file_desc_entries)
+        f = rcu_dereference(fdt->file_desc[fd]);
+
+    if (f && !fd_get_unless_zero(f))
+        f = nullptr;
+
+    rcu_read_unlock();
+
+    if (!f)
+        return errno = EBADF, nullptr;
 
     return f;
 }
@@ -178,11 +212,13 @@ expected<file *, int> __file_close_unlocked(int fd, struct process *p)
     if (!validate_fd_number(fd, ctx))
         return unexpected<int>{-EBADF};
 
-    struct file *f = ctx->file_desc[fd];
+    struct file *f = ctx->fdt->file_desc[fd];
 
-    /* Set the entry to nullptr */
+    /* Set the entry to nullptr. Lockless lookups may still see the file, they'll either get a ref
+     * (and it's as if they ran before the close) or see it drop to 0 refs.
+     */
     /* TODO: Shrink the fd table? */
-    ctx->file_desc[fd] = nullptr;
+    rcu_assign_pointer(ctx->fdt->file_desc[fd], nullptr);
     fd_close_bit(fd, ctx);
 
     return f;
@@ -216,138 +252,124 @@ struct file *get_file_description(int fd)
     return __get_file_description(fd, get_current_process());
 }
 
+#define FD_ENTRIES_TO_FDSET_SIZE(x) ((x) / 8)
+
+/**
+ * @brief Allocate a zeroed fd table, with the fd array and bitmaps in the same allocation
+ *
+ * @param nr_fds Number of entries, must be a multiple of FDS_PER_LONG
+ * @return The new table, or nullptr
+ */
+static struct fd_table *fdt_alloc(unsigned int nr_fds)
+{
+    const size_t size = sizeof(struct fd_table) + nr_fds * sizeof(struct file *) +
+                        2 * FD_ENTRIES_TO_FDSET_SIZE(nr_fds);
+    struct fd_table *fdt = (struct fd_table *) zalloc(size);
+    if (!fdt)
+        return nullptr;
+
+    fdt->file_desc_entries = nr_fds;
+    fdt->file_desc = (struct file **) (fdt + 1);
+    fdt->cloexec_fds = (unsigned long *) (fdt->file_desc + nr_fds);
+    fdt->open_fds = fdt->cloexec_fds + nr_fds / FDS_PER_LONG;
+    return fdt;
+}
+
+static void fdt_free_rcu(struct rcu_head *head)
+{
+    free(container_of(head, struct fd_table, rcu));
+}
+
 int copy_file_descriptors(struct process *process, struct ioctx *ctx)
 {
     scoped_lock g{ctx->fdlock};
+    struct fd_table *old = ctx->fdt;
 
-    process->ctx.file_desc = (file **) malloc(ctx->file_desc_entries * sizeof(void *));
-    process->ctx.file_desc_entries = ctx->file_desc_entries;
-    if (!process->ctx.file_desc)
-    {
+    struct fd_table *fdt = fdt_alloc(old->file_desc_entries);
+    if (!fdt)
         return -ENOMEM;
-    }
 
-    process->ctx.cloexec_fds = (unsigned long *) malloc(ctx->file_desc_entries / 8);
-    if (!process->ctx.cloexec_fds)
-    {
-        free(process->ctx.file_desc);
-        return -ENOMEM;
-    }
+    memcpy(fdt->cloexec_fds, old->cloexec_fds, FD_ENTRIES_TO_FDSET_SIZE(old->file_desc_entries));
+    memcpy(fdt->open_fds, old->open_fds, FD_ENTRIES_TO_FDSET_SIZE(old->file_desc_entries));
 
-    process->ctx.open_fds = (unsigned long *) malloc(ctx->file_desc_entries / 8);
-    if (!process->ctx.open_fds)
+    for (unsigned int i = 0; i < fdt->file_desc_entries; i++)
     {
-        free(process->ctx.file_desc);
-        free(process->ctx.cloexec_fds);
-        return -ENOMEM;
-    }
-
-    memcpy(process->ctx.cloexec_fds, ctx->cloexec_fds, ctx->file_desc_entries / 8);
-    memcpy(process->ctx.open_fds, ctx->open_fds, ctx->file_desc_entries / 8);
+        /* Reserved (but not yet installed) fds don't carry over */
+        struct file *f = old->file_desc[i];
+        if (!f)
+        {
+            fdt->open_fds[i / FDS_PER_LONG] &= ~(1UL << (i % FDS_PER_LONG));
+            continue;
+        }
 
-    for (unsigned int i = 0; i < process->ctx.file_desc_entries; i++)
-    {
-        process->ctx.file_desc[i] = ctx->file_desc[i];
-        if (fd_is_open(i, &process->ctx))
-            fd_get(ctx->file_desc[i]);
+        fd_get(f);
+        fdt->file_desc[i] = f;
     }
 
+    process->ctx.fdt = fdt;
     return 0;
 }
 
 int allocate_file_descriptor_table(struct process *process)
 {
-    process->ctx.file_desc = (file **) zalloc(FILE_DESCRIPTOR_GROW_NR * sizeof(void *));
-    if (!process->ctx.file_desc)
-        return -ENOMEM;
-
-    process->ctx.file_desc_entries = FILE_DESCRIPTOR_GROW_NR;
-
-    process->ctx.cloexec_fds = (unsigned long *) zalloc(FILE_DESCRIPTOR_GROW_NR / 8);
-    if (!process->ctx.cloexec_fds)
-    {
-        free(process->ctx.file_desc);
-        return -ENOMEM;
-    }
-
-    process->ctx.open_fds = (unsigned long *) zalloc(FILE_DESCRIPTOR_GROW_NR / 8);
-    if (!process->ctx.open_fds)
-    {
-        free(process->ctx.file_desc);
-        free(process->ctx.cloexec_fds);
-        return -1;
-    }
-
-    return 0;
+    process->ctx.fdt = fdt_alloc(FILE_DESCRIPTOR_GROW_NR);
+    return process->ctx.fdt ? 0 : -ENOMEM;
 }
 
-#define FD_ENTRIES_TO_FDSET_SIZE(x) ((x) / 8)
-
 /* Enlarges the file descriptor table by FILE_DESCRIPTOR_GROW_NR(64) entries */
 int enlarge_file_descriptor_table(struct process *process, unsigned int new_size)
 {
-    unsigned int old_nr_fds = process->ctx.file_desc_entries;
+    struct fd_table *old = process->ctx.fdt;
+    unsigned int old_nr_fds = old->file_desc_entries;
+
+    MUST_HOLD_LOCK(&process->ctx.fdlock);
 
     new_size = ALIGN_TO(new_size, FILE_DESCRIPTOR_GROW_NR);
 
     if (new_size > INT_MAX || new_size >= process->get_rlimit(RLIMIT_NOFILE).rlim_cur)
         return -EBADF;
 
-    unsigned int new_nr_fds = new_size;
-
-    struct file **table = (file **) malloc(new_nr_fds * sizeof(void *));
-    unsigned long *cloexec_fds = (unsigned long *) malloc(FD_ENTRIES_TO_FDSET_SIZE(new_nr_fds));
-    /* We use zalloc here to implicitly zero free fds */
-    unsigned long *open_fds = (unsigned long *) zalloc(FD_ENTRIES_TO_FDSET_SIZE(new_nr_fds));
-    if (!table || !cloexec_fds || !open_fds)
-        goto error;
+    struct fd_table *fdt = fdt_alloc(new_size);
+    if (!fdt)
+        return -ENOMEM;
 
     /* Note that we use old_nr_fds for these copies specifically as to not go
      * out of bounds.
      */
-    memcpy(table, process->ctx.file_desc, (old_nr_fds) * sizeof(void *));
-    memcpy(cloexec_fds, process->ctx.cloexec_fds, FD_ENTRIES_TO_FDSET_SIZE(old_nr_fds));
-    memcpy(open_fds, process->ctx.open_fds, FD_ENTRIES_TO_FDSET_SIZE(old_nr_fds));
-
-    free(process->ctx.cloexec_fds);
-    free(process->ctx.open_fds);
-    free(process->ctx.file_desc);
+    memcpy(fdt->file_desc, old->file_desc, old_nr_fds * sizeof(void *));
+    memcpy(fdt->cloexec_fds, old->cloexec_fds, FD_ENTRIES_TO_FDSET_SIZE(old_nr_fds));
+    memcpy(fdt->open_fds, old->open_fds, FD_ENTRIES_TO_FDSET_SIZE(old_nr_fds));
 
-    process->ctx.file_desc = table;
-    process->ctx.cloexec_fds = cloexec_fds;
-    process->ctx.open_fds = open_fds;
-    process->ctx.file_desc_entries = new_nr_fds;
+    /* Readers may still be looking at the old table */
+    rcu_assign_pointer(process->ctx.fdt, fdt);
+    call_rcu(&old->rcu, fdt_free_rcu);
 
     return 0;
-
-error:
-    free(table);
-    free(cloexec_fds);
-    free(open_fds);
-
-    /* Don't forget to restore the old file_desc_entries! */
-    process->ctx.file_desc_entries = old_nr_fds;
-
-    return -ENOMEM;
 }
 
 void process_destroy_file_descriptors(process *process)
 {
     ioctx *ctx = &process->ctx;
-    file **table = ctx->file_desc;
+    struct fd_table *fdt;
 
-    for (unsigned int i = 0; i < ctx->file_desc_entries; i++)
     {
-        if (!fd_is_open(i, ctx))
+        scoped_lock g{ctx->fdlock};
+        fdt = ctx->fdt;
+        rcu_assign_pointer(ctx->fdt, nullptr);
+    }
+
+    if (!fdt)
+        return;
+
+    for (unsigned int i = 0; i < fdt->file_desc_entries; i++)
+    {
+        if (!fdt->file_desc[i])
             continue;
 
-        fd_put(table[i]);
+        fd_put(fdt->file_desc[i]);
     }
 
-    free(table);
-
-    ctx->file_desc = nullptr;
-    ctx->file_desc_entries = 0;
+    call_rcu(&fdt->rcu, fdt_free_rcu);
 }
 
 int alloc_fd(int fdbase)
@@ -365,21 +387,21 @@ int alloc_fd(int fdbase)
 
     while (true)
     {
-        unsigned long nr_longs = ioctx->file_desc_entries / FDS_PER_LONG;
+        unsigned long nr_longs = ioctx->fdt->file_desc_entries / FDS_PER_LONG;
 
         for (unsigned long i = starting_long; i < nr_longs; i++)
         {
-            if (ioctx->open_fds[i] == ULONG_MAX)
+            if (ioctx->fdt->open_fds[i] == ULONG_MAX)
                 continue;
 
             /* We speed it up by doing an ffz. */
-            unsigned int first_free = __builtin_ctzl(~ioctx->open_fds[i]);
+            unsigned int first_free = __builtin_ctzl(~ioctx->fdt->open_fds[i]);
 
             for (unsigned int j = first_free; j < FDS_PER_LONG; j++)
             {
                 int fd = FDS_PER_LONG * i + j;
 
-                if (ioctx->open_fds[i] & (1UL << j))
+                if (ioctx->fdt->open_fds[i] & (1UL << j))
                     continue;
 
                 if (fd < fdbase)
@@ -390,7 +412,7 @@ int alloc_fd(int fdbase)
                     if (current->get_rlimit(RLIMIT_NOFILE).rlim_cur < (unsigned long) fd)
                         return -EMFILE;
                     /* Found a free fd that we can use, let's mark it used and return it */
-                    ioctx->open_fds[i] |= (1UL << j);
+                    ioctx->fdt->open_fds[i] |= (1UL << j);
                     /* And don't forget to reset the cloexec flag! */
                     fd_set_cloexec(fd, false, ioctx);
                     g.keep_locked();
@@ -400,7 +422,7 @@ int alloc_fd(int fdbase)
         }
 
         /* TODO: Make it so we can enlarge it directly to the size we want */
-        int new_entries = ioctx->file_desc_entries + FILE_DESCRIPTOR_GROW_NR;
+        int new_entries = ioctx->fdt->file_desc_entries + FILE_DESCRIPTOR_GROW_NR;
         if (enlarge_file_descriptor_table(current, new_entries) < 0)
         {
             return -ENOMEM;
@@ -415,8 +437,9 @@ int file_alloc(struct file *f, struct ioctx *ioctx)
     if (filedesc < 0)
         return errno = -filedesc, filedesc;
 
-    ioctx->file_desc[filedesc] = f;
+    /* Grab the table's reference before the file becomes visible to lookups */
     fd_get(f);
+    rcu_assign_pointer(ioctx->fdt->file_desc[filedesc], f);
 
     return filedesc;
 }
@@ -603,7 +626,7 @@ static expected<struct file *, int> try_to_open(struct file *base, const char *f
 /* TODO: Add O_SYNC */
 #define VALID_OPEN_FLAGS                                                                       \
     (O_RDONLY | O_WRONLY | O_RDWR | O_CREAT | O_DIRECTORY | O_EXCL | O_NOFOLLOW | O_NONBLOCK | \
-     O_APPEND | O_CLOEXEC | O_LARGEFILE | O_TRUNC | O_NOCTTY | O_PATH | O_NOATIME)
+     O_APPEND | O_CLOEXEC | O_LARGEFILE | O_TRUNC | O_NOCTTY | O_PATH | O_NOATIME | O_DIRECT)
 
 int do_sys_open(const char *filename, int flags, mode_t mode, struct file *__rel)
 {
@@ -630,6 +653,12 @@ int do_sys_open(const char *filename, int flags, mode_t mode, struct file *__rel
 
     struct file *file = ex.value();
 
+    if (flags & O_DIRECT && !file->f_ino->i_fops->direct_io)
+    {
+        fd_put(file);
+        return -EINVAL;
+    }
+
     if (file->f_ino->i_fops->on_open)
     {
         int st = file->f_ino->i_fops->on_open(file);
@@ -684,7 +713,7 @@ int sys_dup(int fd)
         goto out_error;
     }
 
-    ioctx->file_desc[new_fd] = f;
+    rcu_assign_pointer(ioctx->fdt->file_desc[new_fd], f);
 
     /* We don't put the fd on success, because it's the reference the new fd holds */
 
@@ -718,7 +747,7 @@ int sys_dup23_internal(int oldfd, int newfd, int dupflags, unsigned int flags)
         goto out;
     }
 
-    if ((unsigned int) newfd > ioctx->file_desc_entries)
+    if ((unsigned int) newfd >= ioctx->fdt->file_desc_entries)
     {
         int st = enlarge_file_descriptor_table(current, (unsigned int) newfd + 1);
         if (st < 0)
@@ -734,7 +763,7 @@ int sys_dup23_internal(int oldfd, int newfd, int dupflags, unsigned int flags)
         return flags & DUP23_DUP3 ? -EINVAL : 0;
     }
 
-    if (ioctx->file_desc[newfd])
+    if (ioctx->fdt->file_desc[newfd])
     {
         auto ex = __file_close_unlocked(newfd, current);
         if (ex.has_error())
@@ -746,7 +775,7 @@ int sys_dup23_internal(int oldfd, int newfd, int dupflags, unsigned int flags)
         newf_old = ex.value();
     }
 
-    ioctx->file_desc[newfd] = f;
+    rcu_assign_pointer(ioctx->fdt->file_desc[newfd], f);
     fd_set_cloexec(newfd, dupflags & O_CLOEXEC, ioctx);
     fd_set_open(newfd, true, ioctx);
 
@@ -1262,9 +1291,9 @@ int do_dupfd(struct file *f, int fdbase, bool cloexec)
         return new_fd;
 
     struct ioctx *ioctx = &get_current_process()->ctx;
-    ioctx->file_desc[new_fd] = f;
 
     fd_get(f);
+    rcu_assign_pointer(ioctx->fdt->file_desc[new_fd], f);
 
     fd_set_cloexec(new_fd, cloexec, ioctx);
 
@@ -1351,6 +1380,9 @@ int fcntl_f_setfl(int fd, struct ioctx *ctx, unsigned long arg)
             return -EPERM;
     }
 
+    if (arg & O_DIRECT && !f.get_file()->f_ino->i_fops->direct_io)
+        return -EINVAL;
+
     f.get_file()->f_flags = arg | (f.get_file()->f_flags & ~SETFL_MASK);
 
     return 0;
@@ -1653,9 +1685,9 @@ int sys_fmount(int fd, const char *upath)
 
 void file_do_cloexec(struct ioctx *ctx)
 {
-    struct file **fd = ctx->file_desc;
+    struct file **fd = ctx->fdt->file_desc;
 
-    for (unsigned int i = 0; i < ctx->file_desc_entries; i++)
+    for (unsigned int i = 0; i < ctx->fdt->file_desc_entries; i++)
     {
         if (!fd[i])
             continue;
@@ -2218,14 +2250,22 @@ file *file_alloc()
 {
     return (file *) kmem_cache_alloc(file_cache, 0);
 }
+
+static void file_free_rcu(struct rcu_head *head)
+{
+    kmem_cache_free(file_cache, (void *) container_of(head, struct file, f_rcu));
+}
+
 /**
  * @brief Free a struct file
+ * The actual freeing happens after a grace period, as lockless fd lookups may still be looking at
+ * the file.
  *
  * @arg file Pointer to struct file
  */
 void file_free(struct file *file)
 {
-    kmem_cache_free(file_cache, (void *) file);
+    call_rcu(&file->f_rcu, file_free_rcu);
 }
 
 /**
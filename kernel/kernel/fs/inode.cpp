@@ -312,6 +312,45 @@ ssize_t inode_sync(struct inode *inode)
     return 0;
 }
 
+int inode_sync_range(struct inode *inode, size_t start, size_t end)
+{
+    if (!inode->i_pages)
+        return 0;
+
+    int st = 0;
+    struct rb_itor it;
+    it.node = nullptr;
+    scoped_mutex g{inode->i_pages->page_lock};
+
+    it.tree = inode->i_pages->pages;
+
+    bool valid = rb_itor_search_ge(&it, (const void *) cul::align_down2(start, PAGE_SIZE));
+
+    while (valid && (size_t) rb_itor_key(&it) < end)
+    {
+        struct page *page = (struct page *) *rb_itor_datum(&it);
+
+        if (page->flags & PAGE_FLAG_DIRTY && flush_sync_one(&page->cache->fobj) < 0)
+            st = -EIO;
+
+        valid = rb_itor_next(&it);
+    }
+
+    return st;
+}
+
+int inode_invalidate_range(struct inode *inode, size_t start, size_t end)
+{
+    if (!inode->i_pages)
+        return 0;
+
+    start = cul::align_down2(start, PAGE_SIZE);
+    end = cul::align_up2(end, PAGE_SIZE);
+
+    /* Dirty pages get written back as they're freed */
+    return vmo_punch_range(inode->i_pages, start, end - start);
+}
+
 bool inode_is_cacheable(struct inode *file);
 
 void inode_release(struct inode *inode)
@@ -449,6 +488,9 @@ void superblock_remove_inode(struct superblock *sb, struct inode *inode)
 
 void superblock_kill(struct superblock *sb)
 {
+    if (sb->sync_fs)
+        sb->sync_fs(sb);
+
     list_for_every_safe (&sb->s_inodes)
     {
         struct inode *ino = container_of(l, inode, i_sb_list_node);
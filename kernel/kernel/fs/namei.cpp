@@ -10,6 +10,7 @@
 #include <onyx/dentry.h>
 #include <onyx/file.h>
 #include <onyx/namei.h>
+#include <onyx/rcu.h>
 #include <onyx/user.h>
 
 // XXX(heat): lookup root seems to leak
@@ -193,6 +194,136 @@ static int namei_walk_component(std::string_view v, nameidata &data, unsigned in
     return 0;
 }
 
+/**
+ * @brief Walk as many path components as we can through the dcache, without locks or refs.
+ * Stops at anything the regular walk needs to handle: cache misses, pending lookups, symlinks,
+ * "..", and last names the caller wants for itself. Everything gets validated against the dcache
+ * sequence count at the end, and thrown away if a rename raced with us.
+ *
+ * @param data Lookup data
+ * @return 0 on success (even if we didn't get anywhere), -ENOENT if we found a negative dentry
+ */
+static int namei_walk_rcu(nameidata &data)
+{
+    auto &path = data.paths[data.pdepth];
+    const size_t orig_pos = path.pos;
+    const fs_token_type orig_type = path.token_type;
+    size_t good_pos = orig_pos;
+    fs_token_type good_type = orig_type;
+    dentry *cur = data.cur;
+    dentry *parent = nullptr;
+    unsigned int walked = 0;
+    int st = 0;
+
+    rcu_read_lock();
+    const unsigned int seq = dcache_read_begin();
+
+    while (good_type != fs_token_type::LAST_NAME_IN_PATH)
+    {
+        auto v = get_token_from_path(path, data.lookup_flags & LOOKUP_DONT_DO_LAST_NAME);
+        const bool is_last = path.token_type == fs_token_type::LAST_NAME_IN_PATH;
+
+        if (v.length() == 0 || v.length() > NAME_MAX || !v.compare(".."))
+            break;
+
+        if (is_last && (data.lookup_flags & LOOKUP_DONT_DO_LAST_NAME ||
+                        (data.pdepth == 0 && data.handler)))
+            break;
+
+        if (!dentry_is_dir(cur) || !inode_can_access(cur->d_inode, FILE_ACCESS_EXECUTE))
+            break;
+
+        dentry *child = cur;
+
+        if (v.compare("."))
+        {
+            child = dentry_lookup_rcu(cur, v);
+            if (!child)
+                break;
+
+            const uint16_t flags = child->d_flags;
+
+            if (flags & (DENTRY_FLAG_PENDING | DENTRY_FLAG_FAILED))
+                break;
+
+            if (flags & DENTRY_FLAG_NEGATIVE)
+            {
+                st = -ENOENT;
+                break;
+            }
+
+            if (dentry_is_symlink(child))
+                break;
+
+            if (flags & DENTRY_FLAG_MOUNTPOINT)
+            {
+                child = __atomic_load_n(&child->d_mount_dentry, __ATOMIC_ACQUIRE);
+                if (!child)
+                    break;
+            }
+        }
+
+        parent = cur;
+        cur = child;
+        walked++;
+        good_pos = path.pos;
+        good_type = path.token_type;
+    }
+
+    if (st == 0 && walked == 0)
+    {
+        rcu_read_unlock();
+        path.pos = orig_pos;
+        path.token_type = orig_type;
+        return 0;
+    }
+
+    if (st < 0)
+    {
+        /* The name doesn't exist, if nothing got renamed under us */
+        const bool retry = dcache_read_retry(seq);
+        rcu_read_unlock();
+
+        if (!retry)
+            return st;
+
+        path.pos = orig_pos;
+        path.token_type = orig_type;
+        return 0;
+    }
+
+    /* Pin the end result. Everything in between was never touched. */
+    const bool got_cur = dentry_get_unless_zero(cur);
+    const bool got_parent = parent && dentry_get_unless_zero(parent);
+
+    if (!got_cur || (parent && !got_parent) || dcache_read_retry(seq))
+    {
+        rcu_read_unlock();
+
+        if (got_cur)
+            dentry_put(cur);
+        if (got_parent)
+            dentry_put(parent);
+
+        path.pos = orig_pos;
+        path.token_type = orig_type;
+        return 0;
+    }
+
+    rcu_read_unlock();
+
+    path.pos = good_pos;
+    path.token_type = good_type;
+
+    if (data.parent)
+        dentry_put(data.parent);
+    dentry_put(data.cur);
+    data.parent = parent;
+    data.cur = cur;
+
+    return 0;
+}
+
 /**
  * @brief Do path resolution
  *
@@ -235,6 +366,13 @@ static int namei_resolve_path(nameidata &data)
             continue;
         }
 
+        /* Fast path: walk what we can through the dcache, then pick up where it stopped */
+        if (int err = namei_walk_rcu(data); err < 0)
+            return err;
+
+        if (path.token_type == fs_token_type::LAST_NAME_IN_PATH)
+            continue;
+
         /* Get the next token from the path.
          * Note that it does not consume *if* this is the last token and the caller asked for us not
          * to do so.
@@ -87,6 +87,9 @@ int partition_setup(cul::string name, struct blockdev *block, size_t first_secto
     d->nr_sectors = (last_sector - first_sector) + 1;
     d->actual_blockdev = block;
     d->submit_request = block->submit_request;
+    d->flags = block->flags;
+    d->max_discard_sectors = block->max_discard_sectors;
+    d->max_write_zeroes_sectors = block->max_write_zeroes_sectors;
     d->device_info = block->device_info;
 
     if (blkdev_init(d) < 0)
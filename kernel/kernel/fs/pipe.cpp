@@ -20,6 +20,7 @@
 #include <onyx/limits.h>
 #include <onyx/mm/slab.h>
 #include <onyx/panic.h>
+#include <onyx/pipe.h>
 #include <onyx/poll.h>
 #include <onyx/process.h>
 #include <onyx/scoped_lock.h>
@@ -43,121 +44,27 @@ constexpr unsigned long max_pipe_size = 0x100000;
 
 static slab_cache *pipe_buffer_cache, *pipe_cache;
 
-struct pipe_buffer
+void *pipe_buffer::operator new(size_t len)
 {
-    struct page *page_;
-    struct list_head list_node;
-    unsigned int len_;
-    unsigned int offset_{0};
-
-    pipe_buffer(struct page *page, unsigned int len) : page_{page}, len_{len}
-    {
-    }
-
-    pipe_buffer() = delete;
-
-    CLASS_DISALLOW_COPY(pipe_buffer);
-    CLASS_DISALLOW_MOVE(pipe_buffer);
-
-    ~pipe_buffer()
-    {
-        page_unref(page_);
-    }
-
-    void *operator new(size_t len)
-    {
-        return kmem_cache_alloc(pipe_buffer_cache, 0);
-    }
-
-    void operator delete(void *ptr)
-    {
-        kmem_cache_free(pipe_buffer_cache, ptr);
-    }
-};
+    return kmem_cache_alloc(pipe_buffer_cache, 0);
+}
 
-class pipe : public refcountable
+void pipe_buffer::operator delete(void *ptr)
 {
-private:
-    struct list_head pipe_buffers;
-    size_t buf_size{default_pipe_size};
-    size_t curr_len{0};
-    mutex pipe_lock;
-
-    wait_queue write_queue;
-    wait_queue read_queue;
-
-    bool can_read() const
-    {
-        return curr_len != 0;
-    }
-
-    bool can_read_or_eof() const
-    {
-        return can_read() || writer_count == 0;
-    }
-
-    bool can_write() const
-    {
-        return curr_len < buf_size;
-    }
-
-    bool can_write_or_broken() const
-    {
-        return curr_len < buf_size || reader_count == 0;
-    }
-
-    pipe_buffer *first_buf()
-    {
-        return container_of(list_first_element(&pipe_buffers), pipe_buffer, list_node);
-    }
-
-    ssize_t append(const void *ubuf, size_t len, bool atomic);
-
-public:
-    size_t reader_count{1};
-    size_t writer_count{1};
-    pipe();
-    ~pipe() override;
-    ssize_t read(int flags, size_t len, void *buffer);
-    ssize_t write(int flags, size_t len, const void *buffer);
-    bool is_full() const;
-    size_t available_space() const;
-    void close_read_end();
-    void close_write_end();
-    short poll(void *poll_file, short events);
-
-    void wake_all(wait_queue *wq)
-    {
-        wait_queue_wake_all(wq);
-    }
-
-    size_t get_unread_len() const
-    {
-        return curr_len;
-    }
-
-    void *operator new(size_t len)
-    {
-        return kmem_cache_alloc(pipe_cache, 0);
-    }
-
-    void operator delete(void *ptr)
-    {
-        kmem_cache_free(pipe_cache, ptr);
-    }
-
-    void set_max_length(size_t len)
-    {
-        buf_size = len;
-    }
+    kmem_cache_free(pipe_buffer_cache, ptr);
+}
 
-    int get_capacity();
-    int set_capacity(size_t len);
+void *pipe::operator new(size_t len)
+{
+    return kmem_cache_alloc(pipe_cache, 0);
+}
 
-    int open_named(struct file *filp);
-};
+void pipe::operator delete(void *ptr)
+{
+    kmem_cache_free(pipe_cache, ptr);
+}
 
-pipe::pipe() : refcountable(2)
+pipe::pipe() : refcountable(2), buf_size{default_pipe_size}
 {
     init_wait_queue_head(&write_queue);
     init_wait_queue_head(&read_queue);
@@ -240,27 +147,14 @@ ssize_t pipe::read(int flags, size_t len, void *buf)
 
         size_t to_read = min((size_t) pbf->len_, len);
 
-        u8 *page_buf = (u8 *) PAGE_TO_VIRT(pbf->page_) + pbf->offset_;
-
-        if (copy_to_user((u8 *) buf + ret, page_buf, to_read) < 0)
+        if (copy_to_user((u8 *) buf + ret, pbf->data(), to_read) < 0)
         {
             if (!ret)
                 ret = -EFAULT;
             break;
         }
 
-        pbf->offset_ += to_read;
-        pbf->len_ -= to_read;
-
-        if (pbf->len_ == 0)
-        {
-            // If its now empty, free the pipe buffer
-            list_remove(&pbf->list_node);
-            delete pbf;
-        }
-
-        // Decrement the length of the pipe (curr_len)
-        curr_len -= to_read;
+        consume(pbf, to_read);
         ret += to_read;
         len -= to_read;
 
@@ -298,10 +192,13 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
     {
         auto last_buf = container_of(list_last_element(&pipe_buffers), pipe_buffer, list_node);
 
-        // See if we have space in this pipe buffer
+        const size_t data_end = last_buf->offset_ + last_buf->len_;
+
+        // See if we have space in this pipe buffer. Spliced pages (from the page cache, or
+        // someone else's pipe) are never written to.
         // TODO: Idea to test: memmove data back if we have offset != 0
         // May compact things a bit.
-        if (PAGE_SIZE - last_buf->len_ <= len)
+        if (last_buf->can_merge() && data_end < PAGE_SIZE)
         {
             // We have space, copy up
             if (atomic)
@@ -309,13 +206,13 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
 
             old_restore_len = last_buf->len_;
             u8 *page_buf = (u8 *) PAGE_TO_VIRT(last_buf->page_);
-            size_t to_copy = min(PAGE_SIZE - last_buf->len_, len);
-            if (copy_from_user(page_buf + last_buf->offset_, ubuf, to_copy) < 0)
+            size_t to_copy = min(PAGE_SIZE - data_end, len);
+            if (copy_from_user(page_buf + data_end, ubuf, to_copy) < 0)
                 return -EFAULT;
 
             // Adjust the length
             last_buf->len_ += to_copy;
-            assert(last_buf->len_ <= PAGE_SIZE);
+            assert(last_buf->offset_ + last_buf->len_ <= PAGE_SIZE);
             len -= to_copy;
             ret += to_copy;
             curr_len += to_copy;
@@ -336,7 +233,7 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
 
         auto blen = min(min(avail, len), PAGE_SIZE);
         // Note: the page and its lifetime are now tied to the pipe buffer
-        auto buf = make_unique<pipe_buffer>(p, blen);
+        auto buf = make_unique<pipe_buffer>(p, blen, 0, PIPE_BUF_CAN_MERGE);
         if (!buf)
         {
             ret = -ENOMEM;
@@ -468,6 +365,191 @@ pipe *get_pipe(void *helper)
     return (pipe *) helper;
 }
 
+void pipe::consume(pipe_buffer *pbf, size_t len)
+{
+    pbf->offset_ += len;
+    pbf->len_ -= len;
+
+    if (pbf->len_ == 0)
+    {
+        // If its now empty, free the pipe buffer
+        list_remove(&pbf->list_node);
+        delete pbf;
+    }
+
+    // Decrement the length of the pipe (curr_len)
+    curr_len -= len;
+}
+
+ssize_t pipe::wait_for_space(int flags)
+{
+    while (true)
+    {
+        if (reader_count == 0)
+        {
+            CALL_KUNIT_MOCKABLE(kernel_raise_signal, SIGPIPE, get_current_process(), 0, nullptr);
+            return -EPIPE;
+        }
+
+        if (can_write())
+            return available_space();
+
+        if (flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_for_event_mutex_interruptible(&write_queue, can_write_or_broken(), &pipe_lock) ==
+            -EINTR)
+            return -EINTR;
+    }
+}
+
+ssize_t pipe::wait_for_data(int flags)
+{
+    while (true)
+    {
+        if (can_read())
+            return curr_len;
+
+        if (writer_count == 0)
+            return 0;
+
+        if (flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_for_event_mutex_interruptible(&read_queue, can_read_or_eof(), &pipe_lock) ==
+            -EINTR)
+            return -EINTR;
+    }
+}
+
+ssize_t pipe::splice_in_wait(int flags)
+{
+    scoped_mutex g{pipe_lock};
+    return wait_for_space(flags);
+}
+
+ssize_t pipe::splice_in_buffer(pipe_buffer *buf)
+{
+    scoped_mutex g{pipe_lock};
+
+    if (reader_count == 0)
+    {
+        CALL_KUNIT_MOCKABLE(kernel_raise_signal, SIGPIPE, get_current_process(), 0, nullptr);
+        return -EPIPE;
+    }
+
+    /* Readers may consume (and free) the buffer as soon as we unlock */
+    const unsigned int len = buf->len_;
+    list_add_tail(&buf->list_node, &pipe_buffers);
+    curr_len += len;
+
+    g.unlock();
+
+    wake_all(&read_queue);
+    return len;
+}
+
+ssize_t pipe::move_to(pipe *dst, size_t len, int flags, bool tee)
+{
+    ssize_t ret = 0;
+
+    if (dst == this)
+        return -EINVAL;
+
+    if (!len)
+        return 0;
+
+    // Lock both pipes in a stable order, so splices going in opposite directions can't deadlock
+    mutex *first = this < dst ? &pipe_lock : &dst->pipe_lock;
+    mutex *second = this < dst ? &dst->pipe_lock : &pipe_lock;
+
+    while (true)
+    {
+        mutex_lock(first);
+        mutex_lock(second);
+
+        if (can_read() && dst->can_write() && dst->reader_count != 0)
+            break;
+
+        const bool need_data = !can_read();
+        const bool eof = need_data && writer_count == 0;
+
+        mutex_unlock(second);
+        mutex_unlock(first);
+
+        if (eof)
+            return 0;
+
+        // Wait for whatever we're missing, with only that pipe locked
+        if (need_data)
+        {
+            scoped_mutex g{pipe_lock};
+            if (ssize_t st = wait_for_data(flags); st < 0)
+                return st;
+        }
+        else
+        {
+            scoped_mutex g{dst->pipe_lock};
+            if (ssize_t st = dst->wait_for_space(flags); st < 0)
+                return st;
+        }
+    }
+
+    len = min(len, dst->available_space());
+
+    list_for_every_safe (&pipe_buffers)
+    {
+        if (!len)
+            break;
+
+        auto pbf = container_of(l, pipe_buffer, list_node);
+        const size_t to_move = min((size_t) pbf->len_, len);
+
+        if (!tee && to_move == pbf->len_)
+        {
+            // Move the whole buffer over
+            list_remove(&pbf->list_node);
+            curr_len -= to_move;
+            list_add_tail(&pbf->list_node, &dst->pipe_buffers);
+        }
+        else
+        {
+            // Share the page between both pipes. Neither buffer may be appended to from now on,
+            // or writes to one pipe could show up in the other.
+            auto nbuf = new pipe_buffer{pbf->page_, (unsigned int) to_move, pbf->offset_};
+            if (!nbuf)
+            {
+                if (!ret)
+                    ret = -ENOMEM;
+                break;
+            }
+
+            page_ref(pbf->page_);
+            pbf->flags_ &= ~PIPE_BUF_CAN_MERGE;
+            list_add_tail(&nbuf->list_node, &dst->pipe_buffers);
+
+            if (!tee)
+                consume(pbf, to_move);
+        }
+
+        dst->curr_len += to_move;
+        ret += to_move;
+        len -= to_move;
+    }
+
+    mutex_unlock(second);
+    mutex_unlock(first);
+
+    if (ret > 0)
+    {
+        dst->wake_all(&dst->read_queue);
+        if (!tee)
+            wake_all(&write_queue);
+    }
+
+    return ret;
+}
+
 size_t pipe_read(size_t offset, size_t sizeofread, void *buffer, struct file *file)
 {
     (void) offset;
@@ -482,6 +564,14 @@ size_t pipe_write(size_t offset, size_t sizeofwrite, void *buffer, struct file *
     return p->write(file->f_flags, sizeofwrite, buffer);
 }
 
+pipe *file_to_pipe(struct file *f)
+{
+    // Both anonymous and (opened) named pipes go through pipe_read
+    if (f->f_ino->i_fops->read != pipe_read)
+        return nullptr;
+    return get_pipe(f->f_ino->i_pipe);
+}
+
 void pipe::close_write_end()
 {
     scoped_mutex g{pipe_lock};
@@ -995,4 +1085,45 @@ TEST(pipe, broken_pipe)
     EXPECT_EQ(p->get_unread_len(), 0U);
 }
 
+TEST(pipe, small_writes_merge)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+
+    ASSERT_EQ(p->write(0, 3, "abc"), 3);
+    ASSERT_EQ(p->write(0, 3, "def"), 3);
+
+    char buf[7] = {};
+    ASSERT_EQ(p->read(0, sizeof(buf), buf), 6);
+    EXPECT_EQ(strcmp(buf, "abcdef"), 0);
+}
+
+TEST(pipe, tee_and_move)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    auto p2 = make_refc<pipe>();
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+
+    EXPECT_EQ(p->move_to(p2.get(), 3, 0, true), 3);
+    EXPECT_EQ(p->get_unread_len(), 5U);
+    EXPECT_EQ(p2->get_unread_len(), 3U);
+
+    // The buffers share a page now, so this must not clobber p2's data
+    ASSERT_EQ(p->write(0, 1, "!"), 1);
+
+    EXPECT_EQ(p->move_to(p2.get(), PAGE_SIZE, 0, false), 6);
+    EXPECT_EQ(p->get_unread_len(), 0U);
+
+    char buf[10] = {};
+    ASSERT_EQ(p2->read(0, sizeof(buf), buf), 9);
+    EXPECT_EQ(strcmp(buf, "HelHello!"), 0);
+
+    EXPECT_EQ(p->move_to(p.get(), 1, 0, false), -EINVAL);
+    EXPECT_EQ(p->move_to(p2.get(), 1, O_NONBLOCK, false), -EAGAIN);
+}
+
 #endif
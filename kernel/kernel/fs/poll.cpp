@@ -127,8 +127,6 @@ public:
     }
 };
 
-struct file *__get_file_description_unlocked(int fd, struct process *p);
-
 int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
               const sigset_t *usigmask, size_t sigsetsize)
 {
@@ -169,8 +167,6 @@ int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
     if (!vec.reserve(nfds))
         return -ENOMEM;
 
-    scoped_lock pfdg{get_current_process()->ctx.fdlock};
-
     /* First, we iterate through the file descriptors and add ourselves to wait queues */
     for (struct pollfd *it = fds; it != end; it++)
     {
@@ -188,7 +184,7 @@ int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
             continue;
         }
 
-        struct file *f = __get_file_description_unlocked(kpollfd.fd, get_current_process());
+        struct file *f = get_file_description(kpollfd.fd);
         if (!f)
         {
             kpollfd.revents = POLLNVAL;
@@ -214,8 +210,6 @@ int sys_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *utimeout,
         fd_put(f);
     }
 
-    pfdg.unlock();
-
     bool should_return = false;
 
     while (!should_return)
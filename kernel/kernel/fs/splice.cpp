@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+
+#include <onyx/file.h>
+#include <onyx/limits.h>
+#include <onyx/net/socket.h>
+#include <onyx/page.h>
+#include <onyx/pagecache.h>
+#include <onyx/pipe.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include <uapi/fcntl.h>
+#include <uapi/poll.h>
+#include <uapi/socket.h>
+
+#include <onyx/utility.hpp>
+
+/*
+ * splice and friends move data between files and pipes by passing struct page references
+ * around. Page cache pages get spliced into pipes as-is, vmsplice pins user pages into pipes, and
+ * pipe-to-pipe splices move pipe buffers over. Sockets get handed the pages themselves (see
+ * socket::sendpage). Otherwise, data only gets copied when it leaves a pipe for a file (once,
+ * straight from the page), or when the source has no page cache.
+ */
+
+static int splice_get_pos(struct file *f, off_t *upos, size_t *pos)
+{
+    if (!upos)
+    {
+        *pos = f->f_seek;
+        return 0;
+    }
+
+    off_t off;
+    if (copy_from_user(&off, upos, sizeof(off_t)) < 0)
+        return -EFAULT;
+
+    if (off < 0)
+        return -EINVAL;
+
+    *pos = off;
+    return 0;
+}
+
+static ssize_t splice_put_pos(struct file *f, off_t *upos, size_t start, ssize_t moved)
+{
+    if (moved <= 0)
+        return moved;
+
+    if (!upos)
+    {
+        /* TODO: Seek adjustments are required to be atomic */
+        __sync_add_and_fetch(&f->f_seek, moved);
+        return moved;
+    }
+
+    off_t off = start + moved;
+    if (copy_to_user(upos, &off, sizeof(off_t)) < 0)
+        return -EFAULT;
+    return moved;
+}
+
+static int splice_pipe_flags(struct file *f, unsigned int flags)
+{
+    return (flags & SPLICE_F_NONBLOCK) || (f->f_flags & O_NONBLOCK) ? O_NONBLOCK : 0;
+}
+
+/**
+ * @brief Check if reading from a file would block, without sleeping.
+ *
+ * @param f File
+ * @return True if there's nothing to read yet
+ */
+static bool splice_read_would_block(struct file *f)
+{
+    poll_table pt;
+    pt.dont_queue();
+    poll_file pf{-1, &pt, f, POLLIN, nullptr};
+
+    return !(poll_vfs(&pf, POLLIN, f) & (POLLIN | POLLHUP | POLLERR));
+}
+
+/**
+ * @brief Write a kernel buffer to a file.
+ *
+ * @param f File to write to
+ * @param pos Offset in the file
+ * @param buf Buffer
+ * @param len Length of the buffer
+ * @return Number of bytes written, or a negative error code
+ */
+static ssize_t splice_write(struct file *f, size_t pos, void *buf, size_t len)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    ssize_t st = write_vfs(pos, len, buf, f);
+    /* Some write paths return -1 and set errno */
+    if (st == -1)
+        return -errno;
+    return st;
+}
+
+/**
+ * @brief Write part of a page to a file. Sockets take a reference to the page instead of copying
+ * it, so the page must not get reused for other data.
+ *
+ * @param f File to write to
+ * @param pos Offset in the file
+ * @param page Page
+ * @param off Offset of the data inside the page
+ * @param len Length of the data
+ * @return Number of bytes written, or a negative error code
+ */
+static ssize_t splice_write_page(struct file *f, size_t pos, struct page *page, unsigned int off,
+                                 size_t len)
+{
+    if (file_is_socket(f))
+    {
+        ssize_t st = socket_sendpage(f, page, off, len);
+        if (st == -1)
+            return -errno;
+        return st;
+    }
+
+    return splice_write(f, pos, (u8 *) PAGE_TO_VIRT(page) + off, len);
+}
+
+/**
+ * @brief Splice data from a file into a pipe.
+ * Page cache pages get referenced by the pipe; files without a page cache get read into fresh
+ * pages.
+ *
+ * @param in File to read from
+ * @param pos Offset in the file, updated on return
+ * @param p Pipe
+ * @param len Maximum length
+ * @param pipe_flags Pipe flags (O_NONBLOCK)
+ * @param nonblock Don't block on the source either (SPLICE_F_NONBLOCK)
+ * @return Number of bytes spliced, or a negative error code
+ */
+static ssize_t splice_file_to_pipe(struct file *in, size_t *pos, pipe *p, size_t len,
+                                   int pipe_flags, bool nonblock)
+{
+    struct inode *ino = in->f_ino;
+    ssize_t ret;
+
+    if (S_ISDIR(ino->i_mode))
+        return -EISDIR;
+
+    if (inode_is_cacheable(ino))
+    {
+        ret = p->splice_in(pipe_flags, len, [&](size_t max, pipe_buffer **out) -> ssize_t {
+            if (*pos >= ino->i_size)
+                return 0;
+
+            struct page_cache_block *cache = inode_get_page(ino, *pos, 0);
+            if (!cache)
+                return -errno;
+
+            const unsigned int page_off = *pos & (PAGE_SIZE - 1);
+            const size_t amount =
+                cul::min(cul::min(max, PAGE_SIZE - page_off), ino->i_size - *pos);
+
+            // The pipe buffer takes over the pin inode_get_page gave us
+            auto buf = new pipe_buffer{cache->page, (unsigned int) amount, page_off};
+            if (!buf)
+            {
+                page_unpin(cache->page);
+                return -ENOMEM;
+            }
+
+            *out = buf;
+            *pos += amount;
+            return amount;
+        });
+    }
+    else
+    {
+        if (!ino->i_fops->read)
+            return -EINVAL;
+
+        /* Copy a single page's worth, since the read might block (e.g sockets, ttys). It's done
+         * without the pipe lock held, so a splice from an idle socket doesn't block everyone else
+         * using the pipe.
+         */
+        ret = p->splice_in_wait(pipe_flags);
+        if (ret <= 0)
+            return ret;
+
+        /* Racy (someone else may get to the data first), but good enough to not sleep on an
+         * empty source in the common case.
+         */
+        if (nonblock && !(in->f_flags & O_NONBLOCK) && splice_read_would_block(in))
+            return -EAGAIN;
+
+        struct page *page = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!page)
+            return -ENOMEM;
+
+        /* Allocate the pipe buffer upfront, as the data can't be put back once it's read */
+        auto buf = new pipe_buffer{page, 0, 0, PIPE_BUF_CAN_MERGE};
+        if (!buf)
+        {
+            free_page(page);
+            return -ENOMEM;
+        }
+
+        {
+            auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+            ret = read_vfs(*pos, cul::min(cul::min(len, (size_t) ret), PAGE_SIZE),
+                           PAGE_TO_VIRT(page), in);
+        }
+
+        if (ret <= 0)
+        {
+            delete buf;
+            return ret;
+        }
+
+        buf->len_ = ret;
+        ret = p->splice_in_buffer(buf);
+        if (ret < 0)
+        {
+            delete buf;
+            return ret;
+        }
+
+        *pos += ret;
+    }
+
+    if (ret > 0 && !(in->f_flags & O_NOATIME))
+        inode_update_atime(ino);
+
+    return ret;
+}
+
+/**
+ * @brief Splice data from a pipe into a file.
+ *
+ * @param p Pipe
+ * @param out File to write to
+ * @param pos Offset in the file, updated on return
+ * @param len Maximum length
+ * @param pipe_flags Pipe flags (O_NONBLOCK)
+ * @return Number of bytes spliced, or a negative error code
+ */
+static ssize_t splice_pipe_to_file(pipe *p, struct file *out, size_t *pos, size_t len,
+                                   int pipe_flags)
+{
+    return p->splice_out(pipe_flags, len, [&](pipe_buffer *buf, size_t to_drain) -> ssize_t {
+        ssize_t st = splice_write_page(out, *pos, buf->page_, buf->offset_, to_drain);
+        if (st > 0)
+            *pos += st;
+        return st;
+    });
+}
+
+/**
+ * @brief Copy data from a file to another file (or socket), going straight from the page
+ * cache if possible.
+ *
+ * @param in File to read from
+ * @param in_pos Offset in the input file, updated on return
+ * @param out File to write to
+ * @param out_pos Offset in the output file, updated on return
+ * @param len Maximum length
+ * @return Number of bytes copied, or a negative error code
+ */
+static ssize_t splice_file_to_file(struct file *in, size_t *in_pos, struct file *out,
+                                   size_t *out_pos, size_t len)
+{
+    struct inode *ino = in->f_ino;
+    ssize_t ret = 0;
+
+    if (S_ISDIR(ino->i_mode))
+        return -EISDIR;
+
+    if (inode_is_cacheable(ino))
+    {
+        while (len && *in_pos < ino->i_size)
+        {
+            struct page_cache_block *cache = inode_get_page(ino, *in_pos, 0);
+            if (!cache)
+            {
+                if (!ret)
+                    ret = -errno;
+                break;
+            }
+
+            const unsigned int page_off = *in_pos & (PAGE_SIZE - 1);
+            const size_t amount =
+                cul::min(cul::min(len, PAGE_SIZE - page_off), ino->i_size - *in_pos);
+
+            ssize_t st = splice_write_page(out, *out_pos, cache->page, page_off, amount);
+            page_unpin(cache->page);
+
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            *in_pos += st;
+            *out_pos += st;
+            ret += st;
+            len -= st;
+
+            if ((size_t) st < amount || signal_is_pending())
+                break;
+        }
+    }
+    else
+    {
+        if (!ino->i_fops->read)
+            return -EINVAL;
+
+        // No page cache, bounce through a kernel page
+        struct page *page = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!page)
+            return -ENOMEM;
+
+        void *buf = PAGE_TO_VIRT(page);
+
+        while (len)
+        {
+            const size_t to_read = cul::min(len, PAGE_SIZE);
+            ssize_t st;
+
+            {
+                auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+                st = read_vfs(*in_pos, to_read, buf, in);
+            }
+
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            const size_t was_read = st;
+            st = splice_write(out, *out_pos, buf, was_read);
+            if (st <= 0)
+            {
+                if (!ret)
+                    ret = st;
+                break;
+            }
+
+            /* Note: if the write was short, the rest of the data is lost, like in linux */
+            *in_pos += st;
+            *out_pos += st;
+            ret += st;
+            len -= st;
+
+            if ((size_t) st < to_read || signal_is_pending())
+                break;
+        }
+
+        free_page(page);
+    }
+
+    if (ret > 0 && !(in->f_flags & O_NOATIME))
+        inode_update_atime(ino);
+
+    return ret;
+}
+
+ssize_t sys_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+                   unsigned int flags)
+{
+    size_t in_pos, out_pos;
+    ssize_t st;
+
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+
+    auto_file in = get_file_description(fd_in);
+    if (!in)
+        return -errno;
+
+    auto_file out = get_file_description(fd_out);
+    if (!out)
+        return -errno;
+
+    struct file *infile = in.get_file();
+    struct file *outfile = out.get_file();
+
+    if (!fd_may_access(infile, FILE_ACCESS_READ) || !fd_may_access(outfile, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (outfile->f_flags & O_APPEND)
+        return -EINVAL;
+
+    len = cul::min(len, (size_t) SSIZE_MAX);
+
+    pipe *pin = file_to_pipe(infile);
+    pipe *pout = file_to_pipe(outfile);
+
+    if (pin && pout)
+    {
+        if (off_in || off_out)
+            return -ESPIPE;
+        return pin->move_to(pout, len, splice_pipe_flags(infile, flags) |
+                                           splice_pipe_flags(outfile, flags), false);
+    }
+
+    if (pout)
+    {
+        if (off_out)
+            return -ESPIPE;
+
+        if ((st = splice_get_pos(infile, off_in, &in_pos)) < 0)
+            return st;
+
+        const size_t start = in_pos;
+        st = splice_file_to_pipe(infile, &in_pos, pout, len, splice_pipe_flags(outfile, flags),
+                                 flags & SPLICE_F_NONBLOCK);
+        return splice_put_pos(infile, off_in, start, st);
+    }
+
+    if (pin)
+    {
+        if (off_in)
+            return -ESPIPE;
+
+        if ((st = splice_get_pos(outfile, off_out, &out_pos)) < 0)
+            return st;
+
+        const size_t start = out_pos;
+        st = splice_pipe_to_file(pin, outfile, &out_pos, len, splice_pipe_flags(infile, flags));
+        return splice_put_pos(outfile, off_out, start, st);
+    }
+
+    // One of the ends needs to be a pipe
+    return -EINVAL;
+}
+
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+
+    auto_file in = get_file_description(fd_in);
+    if (!in)
+        return -errno;
+
+    auto_file out = get_file_description(fd_out);
+    if (!out)
+        return -errno;
+
+    struct file *infile = in.get_file();
+    struct file *outfile = out.get_file();
+
+    if (!fd_may_access(infile, FILE_ACCESS_READ) || !fd_may_access(outfile, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    pipe *pin = file_to_pipe(infile);
+    pipe *pout = file_to_pipe(outfile);
+
+    if (!pin || !pout)
+        return -EINVAL;
+
+    return pin->move_to(pout, cul::min(len, (size_t) SSIZE_MAX),
+                        splice_pipe_flags(infile, flags) | splice_pipe_flags(outfile, flags), true);
+}
+
+/**
+ * @brief Splice user memory into a pipe, by pinning the user's pages.
+ *
+ * @param p Pipe
+ * @param ubuf User buffer
+ * @param len Length of the buffer
+ * @param pipe_flags Pipe flags (O_NONBLOCK)
+ * @return Number of bytes spliced, or a negative error code
+ */
+static ssize_t vmsplice_to_pipe(pipe *p, void *ubuf, size_t len, int pipe_flags)
+{
+    unsigned long addr = (unsigned long) ubuf;
+
+    return p->splice_in(pipe_flags, len, [&](size_t max, pipe_buffer **out) -> ssize_t {
+        const unsigned int page_off = addr & (PAGE_SIZE - 1);
+        const size_t amount = cul::min(max, PAGE_SIZE - page_off);
+        struct page *page;
+
+        if (!(get_phys_pages((void *) (addr - page_off), GPP_READ | GPP_USER, &page, 1) &
+              GPP_ACCESS_OK))
+            return -EFAULT;
+
+        // The pipe buffer takes over the pin. The pipe never writes to the page (no
+        // PIPE_BUF_CAN_MERGE), so this can't corrupt the user's memory.
+        auto buf = new pipe_buffer{page, (unsigned int) amount, page_off};
+        if (!buf)
+        {
+            page_unpin(page);
+            return -ENOMEM;
+        }
+
+        *out = buf;
+        addr += amount;
+        return amount;
+    });
+}
+
+ssize_t sys_vmsplice(int fd, const struct iovec *uiov, size_t nr_segs, unsigned int flags)
+{
+    ssize_t ret = 0;
+
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+
+    if (nr_segs > IOV_MAX)
+        return -EINVAL;
+
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -errno;
+
+    struct file *filp = f.get_file();
+    pipe *p = file_to_pipe(filp);
+    if (!p)
+        return -EBADF;
+
+    const bool to_pipe = fd_may_access(filp, FILE_ACCESS_WRITE);
+    if (!to_pipe && !fd_may_access(filp, FILE_ACCESS_READ))
+        return -EBADF;
+
+    const int pipe_flags = splice_pipe_flags(filp, flags);
+
+    for (size_t i = 0; i < nr_segs; i++)
+    {
+        struct iovec iov;
+        if (copy_from_user(&iov, uiov + i, sizeof(iov)) < 0)
+            return ret ?: -EFAULT;
+
+        if (iov.iov_len == 0)
+            continue;
+
+        // Reading from a pipe through vmsplice is a plain copy, like in linux
+        ssize_t st = to_pipe ? vmsplice_to_pipe(p, iov.iov_base, iov.iov_len, pipe_flags)
+                             : p->read(pipe_flags, iov.iov_len, iov.iov_base);
+
+        if (st <= 0)
+        {
+            if (!ret)
+                ret = st;
+            break;
+        }
+
+        ret += st;
+
+        if ((size_t) st < iov.iov_len)
+            break;
+    }
+
+    return ret;
+}
+
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    size_t in_pos, out_pos;
+    ssize_t st;
+
+    auto_file in = get_file_description(in_fd);
+    if (!in)
+        return -errno;
+
+    auto_file out = get_file_description(out_fd);
+    if (!out)
+        return -errno;
+
+    struct file *infile = in.get_file();
+    struct file *outfile = out.get_file();
+
+    if (!fd_may_access(infile, FILE_ACCESS_READ) || !fd_may_access(outfile, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (outfile->f_flags & O_APPEND)
+        return -EINVAL;
+
+    count = cul::min(count, (size_t) SSIZE_MAX);
+
+    if ((st = splice_get_pos(infile, offset, &in_pos)) < 0)
+        return st;
+
+    const size_t start = in_pos;
+
+    if (pipe *pout = file_to_pipe(outfile); pout)
+    {
+        // Page cache -> pipe, by reference
+        st = splice_file_to_pipe(infile, &in_pos, pout, count, splice_pipe_flags(outfile, 0),
+                                 false);
+    }
+    else
+    {
+        out_pos = outfile->f_seek;
+        st = splice_file_to_file(infile, &in_pos, outfile, &out_pos, count);
+        splice_put_pos(outfile, nullptr, 0, st);
+    }
+
+    return splice_put_pos(infile, offset, start, st);
+}
+
+ssize_t sys_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+                            unsigned int flags)
+{
+    size_t in_pos, out_pos;
+    ssize_t st;
+
+    if (flags != 0)
+        return -EINVAL;
+
+    auto_file in = get_file_description(fd_in);
+    if (!in)
+        return -errno;
+
+    auto_file out = get_file_description(fd_out);
+    if (!out)
+        return -errno;
+
+    struct file *infile = in.get_file();
+    struct file *outfile = out.get_file();
+
+    if (!fd_may_access(infile, FILE_ACCESS_READ) || !fd_may_access(outfile, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (outfile->f_flags & O_APPEND)
+        return -EBADF;
+
+    if (S_ISDIR(infile->f_ino->i_mode) || S_ISDIR(outfile->f_ino->i_mode))
+        return -EISDIR;
+
+    if (!S_ISREG(infile->f_ino->i_mode) || !S_ISREG(outfile->f_ino->i_mode))
+        return -EINVAL;
+
+    len = cul::min(len, (size_t) SSIZE_MAX);
+
+    if ((st = splice_get_pos(infile, off_in, &in_pos)) < 0)
+        return st;
+    if ((st = splice_get_pos(outfile, off_out, &out_pos)) < 0)
+        return st;
+
+    // Copying a file range onto itself is only allowed if the ranges don't overlap
+    if (infile->f_ino == outfile->f_ino && in_pos < out_pos + len && out_pos < in_pos + len)
+        return -EINVAL;
+
+    const size_t in_start = in_pos;
+    const size_t out_start = out_pos;
+
+    st = splice_file_to_file(infile, &in_pos, outfile, &out_pos, len);
+
+    if (ssize_t st2 = splice_put_pos(outfile, off_out, out_start, st); st2 < 0)
+        return st2;
+    return splice_put_pos(infile, off_in, in_start, st);
+}
@@ -13,9 +13,27 @@ void superblock_init(struct superblock *sb)
     sb->s_ref = 1;
     spinlock_init(&sb->s_ilock);
     sb->s_flags = 0;
+    sb->sync_fs = nullptr;
     mutex_init(&sb->s_rename_lock);
 }
 
+static void superblock_sync_dev(struct blockdev *dev, void *ctx)
+{
+    struct superblock *sb = dev->sb;
+
+    if (sb && sb->sync_fs)
+        sb->sync_fs(sb);
+}
+
+/**
+ * @brief Calls sync_fs on every mounted filesystem
+ *
+ */
+void superblock_sync_all()
+{
+    blkdev_for_every(superblock_sync_dev, nullptr);
+}
+
 int sb_read_bio(struct superblock *sb, struct page_iov *vec, size_t nr_vecs, size_t block_number)
 {
     struct bio_req r
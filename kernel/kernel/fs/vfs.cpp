@@ -17,6 +17,7 @@
 #include <onyx/cpu.h>
 #include <onyx/dentry.h>
 #include <onyx/dev.h>
+#include <onyx/direct_io.h>
 #include <onyx/file.h>
 #include <onyx/fnv.h>
 #include <onyx/limits.h>
@@ -174,6 +175,9 @@ void inode_update_mtime(struct inode *ino)
 
 ssize_t do_actual_read(size_t offset, size_t len, void *buf, struct file *file)
 {
+    if (file->f_flags & O_DIRECT && file->f_ino->i_fops->direct_io)
+        return file->f_ino->i_fops->direct_io(offset, len, buf, 0, file);
+
     if (!inode_is_cacheable(file->f_ino))
         return file->f_ino->i_fops->read(offset, len, buf, file);
 
@@ -219,7 +223,11 @@ ssize_t do_actual_write(size_t offset, size_t len, void *buffer, struct file *f)
     ssize_t st = 0;
     struct inode *ino = f->f_ino;
 
-    if (!inode_is_cacheable(ino))
+    if (f->f_flags & O_DIRECT && ino->i_fops->direct_io)
+    {
+        st = ino->i_fops->direct_io(offset, len, buffer, DIO_WRITE, f);
+    }
+    else if (!inode_is_cacheable(ino))
     {
         st = ino->i_fops->write(offset, len, buffer, f);
     }
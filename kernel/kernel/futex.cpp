@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 Pedro Falcato
+ * Copyright (c) 2017 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -11,17 +11,23 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
 #include <onyx/fnv.h>
 #include <onyx/futex.h>
+#include <onyx/init.h>
 #include <onyx/list.h>
 #include <onyx/pagecache.h>
+#include <onyx/panic.h>
 #include <onyx/process.h>
+#include <onyx/scheduler.h>
 #include <onyx/user.h>
+#include <onyx/vm.h>
 #include <onyx/wait_queue.h>
 
-#include <onyx/hashtable.hpp>
 #include <onyx/memory.hpp>
 #include <onyx/pair.hpp>
+#include <onyx/utility.hpp>
 
 /* This union describes the key used to match futexes with each other.
  * For private mappings, we use the mm_address_space address of the process and
@@ -92,15 +98,47 @@ struct futex_key
     }
 };
 
+} // namespace futex
+
+/* State of a contended PI futex. It exists while the futex has waiters, and links the waiters
+ * to the owner, so the owner can inherit their priority.
+ */
+struct futex_pi_state
+{
+    futex::futex_key key;
+    /* Protected by the futex PI lock. nullptr if the owner exited with the futex held */
+    struct thread *owner;
+    struct futex_pi_state *next_owned;
+    /* Highest priority among the waiters, protected by the futex PI lock */
+    int top_prio;
+    unsigned long refs;
+    /* Protected by the bucket lock */
+    struct list_head waiters;
+    struct list_head bucket_node;
+};
+
+namespace futex
+{
+
 class futex_queue
 {
 public:
     futex_key key;
     bool awaken;
+    uint32_t bitset;
+    struct thread *thread;
+    /* PI waiters only: the PI state we're blocked on, our priority, and an error to return
+     * if we got woken up without being handed the lock.
+     */
+    struct futex_pi_state *pi_state;
+    int prio;
+    int pi_error;
     wait_queue wq;
     list_head_cpp<futex_queue> list_node;
 
-    futex_queue(futex_key key) : key(key), awaken(false), wq{}, list_node{this}
+    futex_queue(futex_key key, uint32_t bitset = FUTEX_BITSET_MATCH_ANY)
+        : key(key), awaken(false), bitset{bitset}, thread{get_current_thread()}, pi_state{},
+          prio{thread->priority}, pi_error{}, wq{}, list_node{this}
     {
         init_wait_queue_head(&wq);
     }
@@ -149,73 +187,106 @@ inline uint32_t __futex_hash(futex_key &key)
     return fnv_hash(&key.both, sizeof(key.both));
 }
 
-uint32_t futex_hash(futex_queue &queue)
-{
-    return __futex_hash(queue.get_key());
-}
-
 /* We're holding a system-wide hashtable for futexes. Each bucket has a separate
  * lock to encourage concurrency. Futexes are hashed by the fnv of the futex key, whose values
- * depend on the type of mapping.
+ * depend on the type of mapping. The table is sized by the number of cpus at boot.
  */
 
-static constexpr size_t futex_hashtable_buckets = 1024;
-static cul::hashtable2<futex_queue, futex_hashtable_buckets, uint32_t, futex_hash> futex_hashtable;
-static struct spinlock futex_hashtable_locks[futex_hashtable_buckets];
+struct futex_bucket
+{
+    struct spinlock lock;
+    /* Regular waiters */
+    struct list_head waiters;
+    /* PI states of contended PI futexes */
+    struct list_head pi_states;
+};
+
+static constexpr size_t futex_buckets_per_cpu = 256;
+static constexpr size_t futex_min_buckets = 1024;
+static struct futex_bucket *futex_buckets;
+static size_t futex_hash_mask;
+
+/* Protects PI ownership (futex_pi_state::owner, the owned lists, top_prio) and priority boosts.
+ * Nests inside the bucket locks.
+ */
+static struct spinlock futex_pi_lock;
 
-uint32_t get_hashtable(futex_key &key)
+static void futex_init()
 {
-    auto hash = __futex_hash(key);
-    auto index = futex_hashtable.get_hashtable_index(hash);
+    size_t nr_buckets = futex_min_buckets;
+    while (nr_buckets < futex_buckets_per_cpu * get_nr_cpus())
+        nr_buckets <<= 1;
 
-    spin_lock(&futex_hashtable_locks[index]);
+    futex_buckets =
+        (futex_bucket *) vmalloc(vm_size_to_pages(nr_buckets * sizeof(struct futex_bucket)),
+                                 VM_TYPE_REGULAR, VM_READ | VM_WRITE);
+    if (!futex_buckets)
+        panic("futex: Failed to allocate the futex hashtable");
 
-    return index;
+    for (size_t i = 0; i < nr_buckets; i++)
+    {
+        spinlock_init(&futex_buckets[i].lock);
+        INIT_LIST_HEAD(&futex_buckets[i].waiters);
+        INIT_LIST_HEAD(&futex_buckets[i].pi_states);
+    }
+
+    futex_hash_mask = nr_buckets - 1;
 }
 
-cul::pair<uint32_t, uint32_t> lock_two_hashes(futex_key &key1, futex_key &key2)
+INIT_LEVEL_CORE_KERNEL_ENTRY(futex_init);
+
+static inline struct futex_bucket *get_bucket(futex_key &key)
 {
-    const auto hash1 = __futex_hash(key1);
-    const auto hash2 = __futex_hash(key2);
+    return &futex_buckets[__futex_hash(key) & futex_hash_mask];
+}
 
-    auto index1 = futex_hashtable.get_hashtable_index(hash1);
-    auto index2 = futex_hashtable.get_hashtable_index(hash2);
+struct futex_bucket *lock_bucket(futex_key &key)
+{
+    auto bucket = get_bucket(key);
+    spin_lock(&bucket->lock);
+    return bucket;
+}
+
+cul::pair<futex_bucket *, futex_bucket *> lock_two_buckets(futex_key &key1, futex_key &key2)
+{
+    auto b1 = get_bucket(key1);
+    auto b2 = get_bucket(key2);
 
-    if (index1 < index2)
+    if (b1 < b2)
     {
-        spin_lock(&futex_hashtable_locks[index1]);
-        spin_lock(&futex_hashtable_locks[index2]);
+        spin_lock(&b1->lock);
+        spin_lock(&b2->lock);
     }
-    else if (index1 > index2)
+    else if (b1 > b2)
     {
-        spin_lock(&futex_hashtable_locks[index2]);
-        spin_lock(&futex_hashtable_locks[index1]);
+        spin_lock(&b2->lock);
+        spin_lock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_lock(&futex_hashtable_locks[index1]);
+        spin_lock(&b1->lock);
     }
 
-    return {index1, index2};
+    return {b1, b2};
 }
 
-void unlock_two_hashes(uint32_t index1, uint32_t index2)
+void unlock_two_buckets(futex_bucket *b1, futex_bucket *b2)
 {
-    if (index1 > index2)
+    if (b1 > b2)
     {
-        spin_unlock(&futex_hashtable_locks[index1]);
-        spin_unlock(&futex_hashtable_locks[index2]);
+        spin_unlock(&b1->lock);
+        spin_unlock(&b2->lock);
     }
-    else if (index1 < index2)
+    else if (b1 < b2)
     {
-        spin_unlock(&futex_hashtable_locks[index2]);
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_unlock(&b2->lock);
+        spin_unlock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_unlock(&b1->lock);
     }
 }
 
@@ -273,46 +344,88 @@ int calculate_key(int *uaddr, int flags, futex_key &out_key)
     return 0;
 }
 
-int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
+/**
+ * @brief Pin the page behind a futex word, for operations that need to atomically modify it
+ * while holding bucket locks (where we can't take page faults).
+ *
+ * @param uaddr User address of the futex word
+ * @param page Pointer to where to store the pinned page
+ * @return Kernel pointer to the futex word, or nullptr if the address is bad
+ */
+static uint32_t *futex_pin_word(int *uaddr, struct page **page)
+{
+    int st = get_phys_pages(uaddr, GPP_READ | GPP_WRITE | GPP_USER, page, 1);
+    if (!(st & GPP_ACCESS_OK))
+        return nullptr;
+
+    return (uint32_t *) ((char *) PAGE_TO_VIRT(*page) + ((unsigned long) uaddr & (PAGE_SIZE - 1)));
+}
+
+/**
+ * @brief Read a futex timeout from user space.
+ *
+ * @param utimespec User timespec
+ * @param flags Futex flags
+ * @param absolute True if the timeout is an absolute time, false if relative
+ * @param timeout Pointer to where to store the relative timeout, in ns
+ * @return 0 on success, negative error code
+ */
+static int get_timeout(const struct timespec *utimespec, int flags, bool absolute,
+                       hrtime_t *timeout)
+{
+    struct timespec ts;
+    if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
+        return -EFAULT;
+
+    if (!timespec_valid(&ts, false))
+        return -EINVAL;
+
+    *timeout = timespec_to_hrtime(&ts);
+
+    if (!absolute)
+        return 0;
+
+    /* Absolute timeouts are against CLOCK_MONOTONIC, or CLOCK_REALTIME if asked for. We sleep
+     * for the remaining time, so realtime deadlines don't follow clock_settime.
+     */
+    struct timespec now;
+    clock_gettime_kernel(flags & FUTEX_CLOCK_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+    const hrtime_t now_ns = timespec_to_hrtime(&now);
+
+    *timeout = *timeout > now_ns ? *timeout - now_ns : 0;
+    return 0;
+}
+
+int wait(int *uaddr, int val, int flags, const struct timespec *utimespec,
+         uint32_t bitset = FUTEX_BITSET_MATCH_ANY, bool absolute = false)
 {
     bool has_timeout = false;
-    struct timespec ts
-    {
-    };
     hrtime_t timeout = 0;
     int st = 0;
 
+    if (!bitset)
+        return -EINVAL;
+
     if (utimespec != nullptr)
     {
         has_timeout = true;
-        if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
-            return -EFAULT;
-
-        if (!timespec_valid(&ts, false))
-            return -EINVAL;
+        if ((st = get_timeout(utimespec, flags, absolute, &timeout)) < 0)
+            return st;
     }
 
-    timeout = timespec_to_hrtime(&ts);
-
     futex_key key{};
 
     if ((st = calculate_key(uaddr, flags, key)) < 0)
         return st;
 
-    futex_queue queue{key};
+    futex_queue queue{key, bitset};
 
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-	printk("wuaddr %p index %lu\n", uaddr, index);
-#endif
     /* After making a queue entry for this thread and this key,
      * we're going to atomically calculate a hash index and lock that hash index,
      * then check for the value(and if doesn't match, return -EAGAIN), and finally, sleep.
      */
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-    auto lock = &futex_hashtable_locks[hash_index];
+    auto bucket = lock_bucket(key);
+    auto lock = &bucket->lock;
 
     unsigned int curr_val = 0;
 
@@ -328,7 +441,13 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
         goto out;
     }
 
-    list_add_tail(&queue.list_node, list_head);
+    if (has_timeout && timeout == 0)
+    {
+        st = -ETIMEDOUT;
+        goto out;
+    }
+
+    list_add_tail(&queue.list_node, &bucket->waiters);
 
     if (has_timeout)
         st = queue.wait(timeout, lock);
@@ -339,49 +458,28 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
 
     if (!queue.was_awaken())
     {
-        futex_hashtable.remove_element(queue);
+        list_remove(&queue.list_node);
     }
 
 out:
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    spin_unlock(lock);
     return st;
 }
 
-int wake(int *uaddr, int flags, int to_wake)
+static int __wake(futex_bucket *bucket, futex_key &key, int to_wake, uint32_t bitset)
 {
-    if (to_wake < 0)
-        return -EINVAL;
-
-    int st = 0;
-    futex_key key{};
-
-    if ((st = calculate_key(uaddr, flags, key)) < 0)
-        return st;
-
-        // printk("Shared: %s\n", key.both.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
-
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-
-	printk("uaddr %p index %lu\n", uaddr, index);
-#endif
-
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-
     int awaken = 0;
 
-    list_for_every_safe (list_head)
+    MUST_HOLD_LOCK(&bucket->lock);
+
+    list_for_every_safe (&bucket->waiters)
     {
         if (to_wake == 0)
             break;
 
         futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
 
-        MUST_HOLD_LOCK(&futex_hashtable_locks[hash_index]);
-
-        if (f->get_key() == key)
+        if (f->get_key() == key && f->bitset & bitset)
         {
             f->wake();
             to_wake--;
@@ -389,7 +487,25 @@ int wake(int *uaddr, int flags, int to_wake)
         }
     }
 
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    return awaken;
+}
+
+int wake(int *uaddr, int flags, int to_wake, uint32_t bitset = FUTEX_BITSET_MATCH_ANY)
+{
+    if (to_wake < 0 || !bitset)
+        return -EINVAL;
+
+    int st = 0;
+    futex_key key{};
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    auto bucket = lock_bucket(key);
+
+    int awaken = __wake(bucket, key, to_wake, bitset);
+
+    spin_unlock(&bucket->lock);
 
     return awaken;
 }
@@ -404,8 +520,6 @@ void futex_queue::requeue(const futex_key &new_key, struct list_head *new_head)
 int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2, int val3,
                 bool val3_valid = true)
 {
-    // printk("requeue %p, %d, %d, %p\n", uaddr, to_wake, to_requeue, uaddr2);
-
     if (to_wake < 0 || to_requeue < 0)
         return -EINVAL;
 
@@ -419,12 +533,10 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
     if ((st = calculate_key(uaddr2, flags, key2)) < 0)
         return st;
 
-    // printk("Shared: %s\n", key.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
-
-    auto [hash_index1, hash_index2] = lock_two_hashes(key1, key2);
+    auto [bucket1, bucket2] = lock_two_buckets(key1, key2);
 
-    auto wake_list = futex_hashtable.get_hashtable(hash_index1);
-    auto requeue_list = futex_hashtable.get_hashtable(hash_index2);
+    auto wake_list = &bucket1->waiters;
+    auto requeue_list = &bucket2->waiters;
 
     int awaken = 0, requeued = 0;
 
@@ -481,7 +593,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
         st = awaken;
 
 out:
-    unlock_two_hashes(hash_index1, hash_index2);
+    unlock_two_buckets(bucket1, bucket2);
     return st;
 }
 
@@ -490,7 +602,520 @@ int requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2)
     return cmp_requeue(uaddr, flags, to_wake, to_requeue, uaddr2, 0, false);
 }
 
-}; // namespace futex
+/**
+ * @brief Do a FUTEX_WAKE_OP operation on a (pinned) futex word.
+ *
+ * @param word Futex word
+ * @param encoded_op FUTEX_OP() encoded operation
+ * @return 1 if the comparison was true, 0 if not, negative error code on bad ops
+ */
+static int do_atomic_op(uint32_t *word, int encoded_op)
+{
+    const unsigned int op = (encoded_op >> 28) & 7;
+    const unsigned int cmp = (encoded_op >> 24) & 15;
+    /* oparg and cmparg are sign-extended 12-bit values */
+    int oparg = (int) ((uint32_t) encoded_op << 8) >> 20;
+    const int cmparg = (int) ((uint32_t) encoded_op << 20) >> 20;
+
+    if (op > FUTEX_OP_XOR || cmp > FUTEX_OP_CMP_GE)
+        return -ENOSYS;
+
+    if (encoded_op & (FUTEX_OP_OPARG_SHIFT << 28))
+        oparg = 1U << (oparg & 31);
+
+    uint32_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    uint32_t new_val;
+
+    do
+    {
+        switch (op)
+        {
+            case FUTEX_OP_SET:
+                new_val = oparg;
+                break;
+            case FUTEX_OP_ADD:
+                new_val = old + oparg;
+                break;
+            case FUTEX_OP_OR:
+                new_val = old | oparg;
+                break;
+            case FUTEX_OP_ANDN:
+                new_val = old & ~oparg;
+                break;
+            default:
+                new_val = old ^ oparg;
+                break;
+        }
+    } while (!__atomic_compare_exchange_n(word, &old, new_val, false, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+
+    const int oldval = (int) old;
+
+    switch (cmp)
+    {
+        case FUTEX_OP_CMP_EQ:
+            return oldval == cmparg;
+        case FUTEX_OP_CMP_NE:
+            return oldval != cmparg;
+        case FUTEX_OP_CMP_LT:
+            return oldval < cmparg;
+        case FUTEX_OP_CMP_LE:
+            return oldval <= cmparg;
+        case FUTEX_OP_CMP_GT:
+            return oldval > cmparg;
+        default:
+            return oldval >= cmparg;
+    }
+}
+
+int wake_op(int *uaddr, int flags, int to_wake, int *uaddr2, int to_wake2, int val3)
+{
+    if (to_wake < 0 || to_wake2 < 0)
+        return -EINVAL;
+
+    if ((unsigned long) uaddr2 & (4 - 1))
+        return -EINVAL;
+
+    int st = 0;
+    futex_key key1{};
+    futex_key key2{};
+    struct page *page;
+
+    if ((st = calculate_key(uaddr, flags, key1)) < 0)
+        return st;
+
+    if ((st = calculate_key(uaddr2, flags, key2)) < 0)
+        return st;
+
+    uint32_t *word2 = futex_pin_word(uaddr2, &page);
+    if (!word2)
+        return -EFAULT;
+
+    auto [bucket1, bucket2] = lock_two_buckets(key1, key2);
+
+    int cond = do_atomic_op(word2, val3);
+    if (cond < 0)
+    {
+        st = cond;
+        goto out;
+    }
+
+    st = __wake(bucket1, key1, to_wake, FUTEX_BITSET_MATCH_ANY);
+
+    if (cond)
+        st += __wake(bucket2, key2, to_wake2, FUTEX_BITSET_MATCH_ANY);
+
+out:
+    unlock_two_buckets(bucket1, bucket2);
+    page_unpin(page);
+    return st;
+}
+
+/* PI futexes. The futex word holds the owner's TID, plus FUTEX_WAITERS if there are (or may be)
+ * waiters in the kernel, in which case user space must go through FUTEX_UNLOCK_PI to release it.
+ * Waiters hang off a futex_pi_state, whose owner inherits the priority of its highest priority
+ * waiter (if higher than its own). Boosting is not transitive: if the owner is itself blocked on
+ * another PI futex, that futex's owner doesn't get boosted.
+ */
+
+static struct futex_pi_state *find_pi_state(futex_bucket *bucket, futex_key &key)
+{
+    list_for_every (&bucket->pi_states)
+    {
+        auto pi = container_of(l, struct futex_pi_state, bucket_node);
+        if (pi->key == key)
+            return pi;
+    }
+
+    return nullptr;
+}
+
+/* Must hold futex_pi_lock */
+static void pi_adjust_prio(struct thread *thread)
+{
+    const int base = thread->pi_saved_prio >= 0 ? thread->pi_saved_prio : thread->priority;
+    int prio = base;
+
+    for (auto pi = thread->pi_owned; pi; pi = pi->next_owned)
+        prio = cul::max(prio, pi->top_prio);
+
+    thread->pi_saved_prio = prio == base ? -1 : base;
+
+    if (thread->priority != prio)
+        sched_set_priority(thread, prio);
+}
+
+/* Must hold futex_pi_lock */
+static void pi_set_owner(struct futex_pi_state *pi, struct thread *owner)
+{
+    if (pi->owner)
+    {
+        for (auto pp = &pi->owner->pi_owned; *pp; pp = &(*pp)->next_owned)
+        {
+            if (*pp == pi)
+            {
+                *pp = pi->next_owned;
+                break;
+            }
+        }
+
+        pi_adjust_prio(pi->owner);
+        thread_put(pi->owner);
+    }
+
+    pi->owner = owner;
+    pi->next_owned = nullptr;
+
+    if (owner)
+    {
+        thread_get(owner);
+        pi->next_owned = owner->pi_owned;
+        owner->pi_owned = pi;
+        pi_adjust_prio(owner);
+    }
+}
+
+/* Must hold the bucket lock. Recalculates the top waiter priority and (de)boosts the owner. */
+static void pi_update_waiters(struct futex_pi_state *pi)
+{
+    int top_prio = -1;
+
+    list_for_every (&pi->waiters)
+    {
+        futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
+        top_prio = cul::max(top_prio, f->prio);
+    }
+
+    scoped_lock g{futex_pi_lock};
+    pi->top_prio = top_prio;
+
+    if (pi->owner)
+        pi_adjust_prio(pi->owner);
+}
+
+/* Must hold the bucket lock */
+static void pi_put(struct futex_pi_state *pi)
+{
+    if (__atomic_sub_fetch(&pi->refs, 1, __ATOMIC_RELAXED))
+        return;
+
+    list_remove(&pi->bucket_node);
+
+    {
+        scoped_lock g{futex_pi_lock};
+        pi_set_owner(pi, nullptr);
+    }
+
+    delete pi;
+}
+
+/* Must hold the bucket lock. Returns the waiter we should hand the lock to (the highest priority
+ * one, FIFO among equals).
+ */
+static futex_queue *pi_top_waiter(struct futex_pi_state *pi)
+{
+    futex_queue *top = nullptr;
+
+    list_for_every (&pi->waiters)
+    {
+        futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
+        if (!top || f->prio > top->prio)
+            top = f;
+    }
+
+    return top;
+}
+
+int lock_pi(int *uaddr, int flags, const struct timespec *utimespec, bool trylock)
+{
+    bool has_timeout = false;
+    hrtime_t timeout = 0;
+    int st = 0;
+    struct page *page;
+    futex_key key{};
+    struct thread *current = get_current_thread();
+    const uint32_t tid = current->id;
+    struct futex_pi_state *pi;
+    uint32_t uval;
+
+    /* FUTEX_LOCK_PI timeouts are absolute, and always against CLOCK_REALTIME */
+    if (utimespec && !trylock)
+    {
+        has_timeout = true;
+        if ((st = get_timeout(utimespec, FUTEX_CLOCK_REALTIME, true, &timeout)) < 0)
+            return st;
+    }
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    /* Allocate a PI state now, as we can't do it with the bucket locked */
+    unique_ptr<futex_pi_state> new_pi = make_unique<futex_pi_state>();
+    if (!new_pi)
+        return -ENOMEM;
+
+    uint32_t *word = futex_pin_word(uaddr, &page);
+    if (!word)
+        return -EFAULT;
+
+    futex_queue queue{key};
+    auto bucket = lock_bucket(key);
+    auto lock = &bucket->lock;
+
+retry:
+    uval = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+    if ((uval & FUTEX_TID_MASK) == tid)
+    {
+        st = -EDEADLK;
+        goto out;
+    }
+
+    if (!(uval & FUTEX_TID_MASK))
+    {
+        /* Free, grab it. Keep FUTEX_WAITERS, as there may still be waiters in the kernel. */
+        if (!__atomic_compare_exchange_n(word, &uval, uval | tid, false, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+            goto retry;
+
+        if ((pi = find_pi_state(bucket, key)))
+        {
+            scoped_lock g{futex_pi_lock};
+            pi_set_owner(pi, current);
+        }
+
+        st = 0;
+        goto out;
+    }
+
+    if (trylock)
+    {
+        st = -EAGAIN;
+        goto out;
+    }
+
+    /* Contended. Tell the owner it needs to go through the kernel to unlock */
+    if (!(uval & FUTEX_WAITERS) &&
+        !__atomic_compare_exchange_n(word, &uval, uval | FUTEX_WAITERS, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+        goto retry;
+
+    pi = find_pi_state(bucket, key);
+
+    if (!pi)
+    {
+        struct thread *owner = thread_get_from_tid(uval & FUTEX_TID_MASK);
+        if (!owner || owner->status == THREAD_DEAD || owner->flags & THREAD_KERNEL)
+        {
+            if (owner)
+                thread_put(owner);
+            st = -ESRCH;
+            goto out;
+        }
+
+        {
+            scoped_lock g{futex_pi_lock};
+
+            /* The owner is on its way out and already dropped its PI states, nobody would ever
+             * wake us up.
+             */
+            if (owner->pi_exiting)
+            {
+                g.unlock();
+                thread_put(owner);
+                st = -ESRCH;
+                goto out;
+            }
+
+            pi = new_pi.release();
+            pi->key = key;
+            pi->owner = nullptr;
+            pi->next_owned = nullptr;
+            pi->top_prio = -1;
+            pi->refs = 0;
+            INIT_LIST_HEAD(&pi->waiters);
+            list_add_tail(&pi->bucket_node, &bucket->pi_states);
+            pi_set_owner(pi, owner);
+        }
+
+        thread_put(owner);
+    }
+    else if (!pi->owner)
+    {
+        /* The owner exited with the lock held */
+        st = -ESRCH;
+        goto out;
+    }
+    else if ((uint32_t) pi->owner->id != (uval & FUTEX_TID_MASK))
+    {
+        /* User space messed with the futex word */
+        st = -EINVAL;
+        goto out;
+    }
+
+    __atomic_add_fetch(&pi->refs, 1, __ATOMIC_RELAXED);
+    queue.pi_state = pi;
+    list_add_tail(&queue.list_node, &pi->waiters);
+    pi_update_waiters(pi);
+
+    if (has_timeout && timeout == 0)
+        st = -ETIMEDOUT;
+    else if (has_timeout)
+        st = queue.wait(timeout, lock);
+    else
+        st = queue.wait(lock);
+
+    MUST_HOLD_LOCK(lock);
+
+    if (queue.was_awaken())
+    {
+        /* Either the lock was handed to us (and the futex word has our TID), or the owner died */
+        st = queue.pi_error;
+    }
+    else
+    {
+        list_remove(&queue.list_node);
+        pi_update_waiters(pi);
+    }
+
+    pi_put(pi);
+
+out:
+    spin_unlock(lock);
+    page_unpin(page);
+    return st;
+}
+
+int unlock_pi(int *uaddr, int flags)
+{
+    int st = 0;
+    struct page *page;
+    futex_key key{};
+    struct thread *current = get_current_thread();
+    const uint32_t tid = current->id;
+    struct futex_pi_state *pi;
+    futex_queue *top;
+    uint32_t uval, new_val;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    uint32_t *word = futex_pin_word(uaddr, &page);
+    if (!word)
+        return -EFAULT;
+
+    auto bucket = lock_bucket(key);
+
+    uval = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+retry:
+    if ((uval & FUTEX_TID_MASK) != tid)
+    {
+        st = -EPERM;
+        goto out;
+    }
+
+    pi = find_pi_state(bucket, key);
+    top = pi ? pi_top_waiter(pi) : nullptr;
+
+    if (!top)
+    {
+        /* No one is waiting, just release it */
+        if (!__atomic_compare_exchange_n(word, &uval, 0, false, __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED))
+            goto retry;
+
+        if (pi)
+        {
+            scoped_lock g{futex_pi_lock};
+            pi_set_owner(pi, nullptr);
+        }
+
+        goto out;
+    }
+
+    /* Hand the lock over to the top waiter. Keep FUTEX_WAITERS if it isn't the only waiter. */
+    new_val = top->thread->id;
+    if (pi->waiters.next != pi->waiters.prev)
+        new_val |= FUTEX_WAITERS;
+
+    if (!__atomic_compare_exchange_n(word, &uval, new_val, false, __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED))
+        goto retry;
+
+    top->wake();
+    pi_update_waiters(pi);
+
+    {
+        scoped_lock g{futex_pi_lock};
+        pi_set_owner(pi, top->thread);
+    }
+
+out:
+    spin_unlock(&bucket->lock);
+    page_unpin(page);
+    return st;
+}
+
+} // namespace futex
+
+void futex_exit_pi(struct thread *thread)
+{
+    {
+        /* Stop lock_pi() from making us the owner of new PI states behind our back */
+        scoped_lock g{futex::futex_pi_lock};
+        thread->pi_exiting = true;
+    }
+
+    for (;;)
+    {
+        struct futex_pi_state *pi;
+
+        {
+            scoped_lock g{futex::futex_pi_lock};
+            pi = thread->pi_owned;
+            if (!pi)
+                break;
+
+            /* Hold a reference while we lock its bucket. If it's already at 0, it's being torn
+             * down and will be gone from our list once we drop the lock.
+             */
+            unsigned long refs = __atomic_load_n(&pi->refs, __ATOMIC_RELAXED);
+            do
+            {
+                if (refs == 0)
+                    break;
+            } while (!__atomic_compare_exchange_n(&pi->refs, &refs, refs + 1, false,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+            if (refs == 0)
+            {
+                g.unlock();
+                cpu_relax();
+                continue;
+            }
+        }
+
+        auto bucket = futex::lock_bucket(pi->key);
+
+        {
+            scoped_lock g{futex::futex_pi_lock};
+            if (pi->owner == thread)
+                futex::pi_set_owner(pi, nullptr);
+        }
+
+        /* Wake everyone up. They'll fail with ESRCH, as the futex word has a dead TID. */
+        list_for_every_safe (&pi->waiters)
+        {
+            auto f = list_head_cpp<futex::futex_queue>::self_from_list_head(l);
+            f->pi_error = -ESRCH;
+            f->wake();
+        }
+
+        futex::pi_put(pi);
+        spin_unlock(&bucket->lock);
+    }
+}
 
 int futex_wake(int *uaddr, int nr_waiters)
 {
@@ -500,8 +1125,7 @@ int futex_wake(int *uaddr, int nr_waiters)
     return futex::wake(uaddr, 0, nr_waiters);
 }
 
-/* TODO: Add FUTEX_CLOCK_REALTIME support */
-#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG)
+#define FUTEX_KNOWN_FLAGS (FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
 
 static inline int get_val2(const struct timespec *t)
 {
@@ -512,26 +1136,44 @@ int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout,
               int val3)
 {
     int flags = (futex_op & ~FUTEX_OP_MASK);
+    const int op = futex_op & FUTEX_OP_MASK;
 
     /* Error out on bad flags */
     if (flags & ~FUTEX_KNOWN_FLAGS)
         return -EINVAL;
 
+    /* FUTEX_CLOCK_REALTIME only makes sense for the ops that take absolute timeouts (and
+     * FUTEX_WAIT, for which it's accepted and ignored, like Linux does).
+     */
+    if (flags & FUTEX_CLOCK_REALTIME && op != FUTEX_WAIT && op != FUTEX_WAIT_BITSET)
+        return -ENOSYS;
+
     /* Bad pointer */
     if ((unsigned long) uaddr & (4 - 1))
         return -EINVAL;
 
-    switch (futex_op & FUTEX_OP_MASK)
+    switch (op)
     {
         case FUTEX_WAIT:
             return futex::wait(uaddr, val, flags, timeout);
         case FUTEX_WAKE:
             return futex::wake(uaddr, flags, val);
+        case FUTEX_WAIT_BITSET:
+            return futex::wait(uaddr, val, flags, timeout, val3, true);
+        case FUTEX_WAKE_BITSET:
+            return futex::wake(uaddr, flags, val, val3);
         case FUTEX_CMP_REQUEUE:
             return futex::cmp_requeue(uaddr, flags, val, get_val2(timeout), uaddr2, val3);
         case FUTEX_REQUEUE:
-            // printk("futex(%p, %d, %d)(op %d)\n", uaddr, futex_op, val, futex_op & FUTEX_OP_MASK);
             return futex::requeue(uaddr, flags, val, get_val2(timeout), uaddr2);
+        case FUTEX_WAKE_OP:
+            return futex::wake_op(uaddr, flags, val, uaddr2, get_val2(timeout), val3);
+        case FUTEX_LOCK_PI:
+            return futex::lock_pi(uaddr, flags, timeout, false);
+        case FUTEX_TRYLOCK_PI:
+            return futex::lock_pi(uaddr, flags, nullptr, true);
+        case FUTEX_UNLOCK_PI:
+            return futex::unlock_pi(uaddr, flags);
         default:
             return -ENOSYS;
     }
@@ -7,7 +7,6 @@
 #include <string.h>
 
 #include <onyx/dev.h>
-#include <onyx/dpc.h>
 #include <onyx/input/device.h>
 #include <onyx/input/event.h>
 #include <onyx/panic.h>
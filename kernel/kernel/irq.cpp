@@ -12,7 +12,6 @@
 #include <stdlib.h>
 
 #include <onyx/dev.h>
-#include <onyx/dpc.h>
 #include <onyx/init.h>
 #include <onyx/irq.h>
 #include <onyx/percpu.h>
@@ -142,10 +141,3 @@ void dispatch_irq(unsigned int irq, struct irq_context *context)
     line->stats.spurious++;
     write_per_cpu(in_irq, false);
 }
-
-void irq_init(void)
-{
-    dpc_init();
-}
-
-INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(irq_init);
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2016, 2017 Pedro Falcato
+ * Copyright (c) 2016 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -9,12 +9,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <onyx/clock.h>
+#include <onyx/dev.h>
+#include <onyx/init.h>
+#include <onyx/irq.h>
+#include <onyx/kunit.h>
 #include <onyx/log.h>
 #include <onyx/panic.h>
-#include <onyx/timer.h>
+#include <onyx/poll.h>
+#include <onyx/scheduler.h>
 #include <onyx/vm.h>
+#include <onyx/wait_queue.h>
 
-#include "onyx/serial.h"
+#include <onyx/utility.hpp>
+
+#include <uapi/fcntl.h>
 
 #ifdef __x86_64__
 #define VBOX_DEBUG
@@ -24,46 +33,359 @@
 #include <onyx/port_io.h>
 #endif
 
-USED char _log_buf[LOG_BUF_SIZE];
-USED size_t log_position = 0;
+/**
+ * The kernel log is a ring of fixed-size records. Writers reserve sequence numbers with a single
+ * atomic add, and the sequence number picks the slot, so logging never takes a lock and is safe
+ * from any context. A record is published by storing seq + 1 in its stamp once it's filled in;
+ * readers check the stamp before and after copying a record out, and treat a changed stamp as the
+ * record having been overwritten.
+ *
+ * Messages that don't fit in a record are split across consecutive ones, the rest marked
+ * KLOG_CONT. The console (and the VirtualBox debug port) get written to by a kernel thread, so
+ * callers never wait on them, except early on (before the thread exists) and while panicking.
+ */
 
-void kernlog_print(const char *msg)
+#define KLOG_TEXT_MAX 104
+
+struct klog_record
+{
+    /* seq + 1 once published, 0 while empty or being written */
+    unsigned long stamp;
+    hrtime_t timestamp;
+    uint16_t cpu;
+    uint8_t level;
+    uint8_t flags;
+    uint16_t len;
+    char text[KLOG_TEXT_MAX];
+};
+
+static_assert(sizeof(struct klog_record) == 128);
+
+#define KLOG_NR_RECORDS (LOG_BUF_SIZE / sizeof(struct klog_record))
+
+static struct klog_record klog_ring[KLOG_NR_RECORDS];
+/* Next sequence number to be handed out */
+static unsigned long klog_head;
+/* Next record the console is going to write */
+static unsigned long klog_console_seq;
+/* Records before this one were cleared with syslog(2) */
+static unsigned long klog_clear_seq;
+
+static bool klog_console_locked;
+static bool klog_console_pending;
+static struct thread *klog_console_thread;
+
+/* /dev/kmsg readers wait here for new records */
+static struct wait_queue kmsg_wq;
+
+#define KLOG_OK    0
+#define KLOG_EMPTY 1 /* Not written yet */
+#define KLOG_LOST  2 /* Overwritten */
+
+static unsigned long klog_first_seq()
 {
+    unsigned long head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+    return head > KLOG_NR_RECORDS ? head - KLOG_NR_RECORDS : 0;
+}
+
+/**
+ * @brief Copy a record out of the ring
+ *
+ * @param seq Sequence number
+ * @param rec Record to copy it to (may be nullptr, to only check the record's status)
+ * @return KLOG_OK, KLOG_EMPTY or KLOG_LOST
+ */
+static int klog_read(unsigned long seq, struct klog_record *rec)
+{
+    const struct klog_record *r = &klog_ring[seq % KLOG_NR_RECORDS];
+
+    if (seq < klog_first_seq())
+        return KLOG_LOST;
+
+    unsigned long stamp = __atomic_load_n(&r->stamp, __ATOMIC_ACQUIRE);
+    if (stamp != seq + 1)
+        return stamp > seq + 1 ? KLOG_LOST : KLOG_EMPTY;
+
+    if (!rec)
+        return KLOG_OK;
+
+    memcpy(rec, r, sizeof(*rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* A writer got to it while we were copying it */
+    if (__atomic_load_n(&r->stamp, __ATOMIC_RELAXED) != stamp)
+        return KLOG_LOST;
+
+    rec->len = cul::min(rec->len, (uint16_t) KLOG_TEXT_MAX);
+    return KLOG_OK;
+}
 
+static void klog_debug_port_write(const char *s, size_t len)
+{
 #ifdef VBOX_DEBUG
-    const char *m = msg;
-    while (*m)
+    for (size_t i = 0; i < len; i++)
+        outb(0x504, s[i]);
+#endif
+}
+
+void tty_write_string_kernel(const char *s);
+
+/* Protected by klog_console_locked */
+static char klog_console_buf[1024];
+
+static void __kernlog_console_flush()
+{
+    struct klog_record rec;
+    size_t len = 0;
+
+    for (;;)
+    {
+        unsigned long seq = klog_console_seq;
+        int st = klog_read(seq, &rec);
+
+        if (st == KLOG_EMPTY)
+            break;
+
+        if (st == KLOG_LOST)
+        {
+            unsigned long first = klog_first_seq();
+            /* The record we were on got overwritten, but maybe not the ones after it */
+            klog_console_seq = first > seq ? first : seq + 1;
+            continue;
+        }
+
+        klog_console_seq++;
+        klog_debug_port_write(rec.text, rec.len);
+
+        if (!(rec.flags & KLOG_CONSOLE))
+            continue;
+
+        if (len + rec.len >= sizeof(klog_console_buf))
+        {
+            klog_console_buf[len] = '\0';
+            tty_write_string_kernel(klog_console_buf);
+            len = 0;
+        }
+
+        memcpy(klog_console_buf + len, rec.text, rec.len);
+        len += rec.len;
+    }
+
+    if (len)
     {
-        outb(0x504, *m);
-        m++;
+        klog_console_buf[len] = '\0';
+        tty_write_string_kernel(klog_console_buf);
     }
-#endif
+}
 
-    const auto nanoseconds = clocksource_get_time();
-    const auto seconds = nanoseconds / NS_PER_SEC;
-    const auto milis = (nanoseconds % NS_PER_SEC) / NS_PER_MS;
-    if (log_position + strlen(msg) + 13 + 1 <= LOG_BUF_SIZE)
+/**
+ * @brief Write out every record the console hasn't seen yet. If someone else is already at it,
+ * leave it to them.
+ */
+static void kernlog_console_flush()
+{
+    do
     {
-        /* If there's clearly enough space, it's straight forward to do */
-        /* Compose a message containing a timestamp */
-        /* TODO: This strlen(msg) + 13 + 2 math is off */
-        memset(&_log_buf[log_position], 0, strlen(msg) + 13 + 2);
-        snprintf(&_log_buf[log_position], 200, "[%05lu.%05lu] %s", seconds, milis, msg);
-        log_position += strlen(msg) + 13 + 1;
+        if (__atomic_exchange_n(&klog_console_locked, true, __ATOMIC_ACQUIRE))
+            return;
+
+        __kernlog_console_flush();
+        __atomic_store_n(&klog_console_locked, false, __ATOMIC_RELEASE);
+
+        /* Records that got published after we looked, while we still held the console, would
+         * otherwise be left behind until the next message.
+         */
+    } while (klog_read(klog_console_seq, nullptr) != KLOG_EMPTY);
+}
+
+void kernlog_bust_console(void)
+{
+    __atomic_store_n(&klog_console_locked, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the console written to, by the console thread if we have one. Can be called from
+ * any context, the console only gets written to synchronously if we can sleep (or are panicking).
+ */
+void kernlog_kick_console()
+{
+    struct thread *t = klog_console_thread;
+
+    if (is_in_panic())
+    {
+        kernlog_console_flush();
+        return;
+    }
+
+    if (!t)
+    {
+        /* No console thread yet. Writing to the console can take a long while, so only do it
+         * synchronously if we can sleep (or if the scheduler isn't even up). Otherwise, the
+         * records stay put until the next kick or until the console thread starts.
+         */
+        if (!get_current_thread() || (!irq_is_disabled() && !sched_is_preemption_disabled()))
+            kernlog_console_flush();
+        return;
+    }
+
+    if (!__atomic_exchange_n(&klog_console_pending, true, __ATOMIC_ACQ_REL))
+        thread_wake_up(t);
+}
+
+/**
+ * @brief Log a message, without kicking the console. The caller needs to call
+ * kernlog_kick_console() afterwards, once it's out of its irqs-off section.
+ *
+ * @param level Level of the message (KLOG_*)
+ * @param flags Record flags
+ * @param msg Message
+ * @param len Length of the message
+ */
+void __kernlog_emit(unsigned int level, unsigned int flags, const char *msg, size_t len)
+{
+    const unsigned long nr = len ? (len + KLOG_TEXT_MAX - 1) / KLOG_TEXT_MAX : 1;
+    const hrtime_t timestamp = clocksource_get_time();
+
+    /* Don't let an irq come in and lap us on this cpu while we're writing records */
+    unsigned long irqf = irq_save_and_disable();
+    const unsigned long seq = __atomic_fetch_add(&klog_head, nr, __ATOMIC_ACQ_REL);
+    const unsigned int cpu = get_cpu_nr();
+
+    for (unsigned long i = 0; i < nr; i++)
+    {
+        struct klog_record *r = &klog_ring[(seq + i) % KLOG_NR_RECORDS];
+        const size_t to_copy = cul::min(len, (size_t) KLOG_TEXT_MAX);
+
+        __atomic_store_n(&r->stamp, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        r->timestamp = timestamp;
+        r->cpu = cpu;
+        r->level = level;
+        r->flags = flags | (i ? KLOG_CONT : 0);
+        r->len = to_copy;
+        memcpy(r->text, msg, to_copy);
+
+        __atomic_store_n(&r->stamp, seq + i + 1, __ATOMIC_RELEASE);
+
+        msg += to_copy;
+        len -= to_copy;
+    }
+
+    irq_restore(irqf);
+}
+
+void kernlog_emit(unsigned int level, unsigned int flags, const char *msg, size_t len)
+{
+    __kernlog_emit(level, flags, msg, len);
+    kernlog_kick_console();
+}
+
+void kernlog_print(const char *msg)
+{
+    kernlog_emit(KLOG_DEFAULT_LEVEL, 0, msg, strlen(msg));
+}
+
+static void klog_console_thread_entry(void *arg)
+{
+    for (;;)
+    {
+        set_current_state(THREAD_UNINTERRUPTIBLE);
+
+        if (!__atomic_exchange_n(&klog_console_pending, false, __ATOMIC_ACQ_REL))
+        {
+            sched_yield();
+            continue;
+        }
+
+        set_current_state(THREAD_RUNNABLE);
+        kernlog_console_flush();
+        wait_queue_wake_all(&kmsg_wq);
     }
-    else
+}
+
+static void kernlog_start_console_thread()
+{
+    struct thread *t = sched_create_thread(klog_console_thread_entry, THREAD_KERNEL, nullptr);
+    if (!t)
     {
-        /* else start overwriting the buffer head */
-        log_position = 0;
-        snprintf(&_log_buf[log_position], 200, "[%lu.%lu] %s", seconds, milis, msg);
-        log_position += strlen(msg) + 13 + 1;
+        /* Not fatal, we'll just keep writing to the console synchronously */
+        printf("kernlog: Could not create the console thread\n");
+        return;
     }
+
+    /* Start off with whatever got logged up until now */
+    klog_console_pending = true;
+    __atomic_store_n(&klog_console_thread, t, __ATOMIC_RELEASE);
+    sched_start_thread(t);
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(kernlog_start_console_thread);
+
+/**
+ * @brief Format a record like dmesg does
+ *
+ * @param rec Record
+ * @param buf Buffer
+ * @param size Size of the buffer
+ * @return Length of the formatted record (which may be larger than size, like snprintf)
+ */
+static size_t klog_format_record(const struct klog_record *rec, char *buf, size_t size)
+{
+    if (rec->flags & KLOG_CONT)
+        return snprintf(buf, size, "%.*s", (int) rec->len, rec->text);
+
+    return snprintf(buf, size, "[%5lu.%06lu] %.*s", rec->timestamp / NS_PER_SEC,
+                    (rec->timestamp % NS_PER_SEC) / NS_PER_US, (int) rec->len, rec->text);
 }
 
 void kernlog_clear(void)
 {
-    memset(_log_buf, 0, LOG_BUF_SIZE);
-    log_position = 0;
+    __atomic_store_n(&klog_clear_seq, __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Read out the log, like dmesg would print it
+ *
+ * @param ubuf User buffer
+ * @param len Length of the buffer
+ * @return Number of bytes read, or negative error codes
+ */
+static int kernlog_read_all(char *ubuf, int len)
+{
+    if (len < 0)
+        return -EINVAL;
+    len = cul::min(len, LOG_BUF_SIZE);
+
+    char *buf = (char *) malloc(len + 1);
+    if (!buf)
+        return -ENOMEM;
+
+    struct klog_record rec;
+    size_t pos = 0;
+    const unsigned long end = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+    unsigned long seq = cul::max(klog_first_seq(), klog_clear_seq);
+
+    for (; seq < end && pos < (size_t) len; seq++)
+    {
+        if (klog_read(seq, &rec) != KLOG_OK)
+            continue;
+
+        size_t written = klog_format_record(&rec, buf + pos, len + 1 - pos);
+        /* Don't hand out half a record */
+        if (pos + written > (size_t) len)
+            break;
+        pos += written;
+    }
+
+    /* dmesg expects the log to be NUL terminated, if there's room */
+    if (pos < (size_t) len)
+        buf[pos] = '\0';
+
+    int st = copy_to_user(ubuf, buf, cul::min(pos + 1, (size_t) len)) < 0 ? -EFAULT : (int) pos;
+    free(buf);
+    return st;
 }
 
 #define SYSLOG_ACTION_READ        2
@@ -73,32 +395,40 @@ void kernlog_clear(void)
 
 int sys_syslog(int type, char *buffer, int len)
 {
-    if (type == SYSLOG_ACTION_SIZE_BUFFER)
-        return (int) log_position;
     switch (type)
     {
-        case SYSLOG_ACTION_READ: {
-            if (copy_to_user(buffer, _log_buf, len) < 0)
-                return -EFAULT;
-            break;
-        }
+        case SYSLOG_ACTION_SIZE_BUFFER:
+            /* Formatted records always fit in the size of the ring */
+            return LOG_BUF_SIZE;
+        case SYSLOG_ACTION_READ:
+            return kernlog_read_all(buffer, len);
         case SYSLOG_ACTION_READ_CLEAR: {
-            if (copy_to_user(buffer, _log_buf, len) < 0)
-                return -EFAULT;
-            kernlog_clear();
-            break;
+            int st = kernlog_read_all(buffer, len);
+            if (st >= 0)
+                kernlog_clear();
+            return st;
         }
-        case SYSLOG_ACTION_CLEAR: {
+        case SYSLOG_ACTION_CLEAR:
             kernlog_clear();
-            break;
-        }
+            return 0;
     }
-    return 0;
+
+    return -EINVAL;
 }
 
 void kernlog_dump(void)
 {
-    printk("%s\n", _log_buf);
+    char buf[KLOG_TEXT_MAX + 32];
+    struct klog_record rec;
+    const unsigned long end = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+
+    for (unsigned long seq = klog_first_seq(); seq < end; seq++)
+    {
+        if (klog_read(seq, &rec) != KLOG_OK)
+            continue;
+        klog_format_record(&rec, buf, sizeof(buf));
+        tty_write_string_kernel(buf);
+    }
 }
 
 static unsigned int log_level = LOG_LEVEL_ERROR | LOG_LEVEL_WARNING | LOG_LEVEL_FATAL;
@@ -112,9 +442,161 @@ void kernlog_send(unsigned int level, const char *msg, ...)
 {
     if (log_level & level)
     {
+        char buf[256];
+        unsigned int klevel = KLOG_DEBUG;
+
+        if (level & LOG_LEVEL_FATAL)
+            klevel = KLOG_CRIT;
+        else if (level & LOG_LEVEL_ERROR)
+            klevel = KLOG_ERR;
+        else if (level & LOG_LEVEL_WARNING)
+            klevel = KLOG_WARNING;
+
         va_list va;
         va_start(va, msg);
-        vprintf(msg, va);
+        int len = vsnprintf(buf, sizeof(buf), msg, va);
         va_end(va);
+
+        if (len > 0)
+            kernlog_emit(klevel, 0, buf, cul::min((size_t) len, sizeof(buf) - 1));
+    }
+}
+
+/*
+ * /dev/kmsg hands out one record per read(2), as "level,seq,timestamp_us,flag;text\n", flag being
+ * 'c' for continuation records and '-' otherwise. The file offset is the sequence number of the
+ * next record, so lseek(fd, seq, SEEK_SET) resumes reading from seq (0 being the oldest record
+ * around). Reads block for new records unless O_NONBLOCK, and fail with EPIPE (skipping ahead to
+ * the oldest record) if the reader fell behind and records got overwritten.
+ */
+
+static size_t kmsg_read(size_t offset, size_t len, void *ubuf, struct file *f)
+{
+    struct klog_record rec;
+    unsigned long seq = offset;
+    int st;
+
+    while ((st = klog_read(seq, &rec)) != KLOG_OK)
+    {
+        if (st == KLOG_LOST)
+        {
+            f->f_seek = klog_first_seq();
+            return -EPIPE;
+        }
+
+        if (f->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_for_event_interruptible(&kmsg_wq, klog_read(seq, nullptr) != KLOG_EMPTY) < 0)
+            return -EINTR;
     }
+
+    char buf[KLOG_TEXT_MAX + 64];
+    size_t written =
+        snprintf(buf, sizeof(buf), "%u,%lu,%lu,%c;%.*s", rec.level, seq,
+                 rec.timestamp / NS_PER_US, rec.flags & KLOG_CONT ? 'c' : '-', (int) rec.len,
+                 rec.text);
+
+    if (rec.len == 0 || rec.text[rec.len - 1] != '\n')
+        buf[written++] = '\n';
+
+    if (written > len)
+        return -EINVAL;
+
+    if (copy_to_user(ubuf, buf, written) < 0)
+        return -EFAULT;
+
+    /* read(2) adds what we return to the offset, and the offset is a sequence number */
+    f->f_seek = seq + 1 - written;
+    return written;
 }
+
+static size_t kmsg_write(size_t offset, size_t len, void *ubuf, struct file *f)
+{
+    char buf[256];
+    size_t to_copy = cul::min(len, sizeof(buf));
+    unsigned int level = KLOG_DEFAULT_LEVEL;
+
+    if (copy_from_user(buf, ubuf, to_copy) < 0)
+        return -EFAULT;
+
+    char *msg = buf;
+
+    /* Messages may start with "<level>", like with syslog(3) */
+    if (to_copy >= 3 && buf[0] == '<' && buf[1] >= '0' && buf[1] <= '7' && buf[2] == '>')
+    {
+        level = buf[1] - '0';
+        msg += 3;
+        to_copy -= 3;
+    }
+
+    kernlog_emit(level, 0, msg, to_copy);
+    return len;
+}
+
+static short kmsg_poll(void *poll_file, short events, struct file *f)
+{
+    short revents = POLLOUT;
+
+    if (events & POLLIN)
+    {
+        if (klog_read(f->f_seek, nullptr) != KLOG_EMPTY)
+            revents |= POLLIN;
+        else
+            poll_wait_helper(poll_file, &kmsg_wq);
+    }
+
+    return revents & events;
+}
+
+const struct file_ops kmsg_ops = {.read = kmsg_read, .write = kmsg_write, .poll = kmsg_poll};
+
+static void kmsg_init()
+{
+    auto dev = dev_register_chardevs(0, 1, 0, &kmsg_ops, cul::string{"kmsg"});
+    if (!dev)
+    {
+        printf("kernlog: Could not create /dev/kmsg\n");
+        return;
+    }
+
+    dev.value()->show(0644);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(kmsg_init);
+
+#ifdef CONFIG_KUNIT
+
+TEST(kernlog, long_messages_get_split)
+{
+    char msg[KLOG_TEXT_MAX * 2 + 10];
+    struct klog_record rec;
+
+    for (size_t i = 0; i < sizeof(msg); i++)
+        msg[i] = 'a' + i % 26;
+
+    /* Other cpus may log in the meantime, so look for our records */
+    const unsigned long start = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+    kernlog_emit(KLOG_DEBUG, 0, msg, sizeof(msg));
+
+    unsigned long seq = start;
+    for (; seq < start + KLOG_NR_RECORDS; seq++)
+    {
+        ASSERT_EQ(KLOG_OK, klog_read(seq, &rec));
+        if (rec.level == KLOG_DEBUG && rec.len == KLOG_TEXT_MAX && !memcmp(rec.text, msg, 4))
+            break;
+    }
+
+    ASSERT_LT(seq, start + KLOG_NR_RECORDS);
+    EXPECT_FALSE(rec.flags & KLOG_CONT);
+    ASSERT_EQ(KLOG_OK, klog_read(seq + 1, &rec));
+    EXPECT_TRUE(rec.flags & KLOG_CONT);
+    EXPECT_EQ((uint16_t) KLOG_TEXT_MAX, rec.len);
+    EXPECT_EQ(0, memcmp(msg + KLOG_TEXT_MAX, rec.text, KLOG_TEXT_MAX));
+    ASSERT_EQ(KLOG_OK, klog_read(seq + 2, &rec));
+    EXPECT_TRUE(rec.flags & KLOG_CONT);
+    EXPECT_EQ((uint16_t) 10, rec.len);
+    EXPECT_EQ(0, memcmp(msg + KLOG_TEXT_MAX * 2, rec.text, 10));
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/cmdline.h>
+#include <onyx/init.h>
+#include <onyx/lockstat.h>
+#include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
+#include <onyx/user.h>
+#include <onyx/vm.h>
+
+#include <onyx/utility.hpp>
+
+/* Spinlock statistics. Locks don't have a class of their own, so stats are kept per acquisition
+ * site (the return address of the spin_lock call), which is what you want when looking for hot
+ * locks anyway. Sites can be symbolized with addr2line. Everything here is lock-free, as it runs
+ * inside spin_lock.
+ */
+
+#define LOCKSTAT_NR_CLASSES 1024
+
+struct lockstat_class
+{
+    unsigned long site;
+    unsigned long acquisitions;
+    unsigned long contentions;
+    hrtime_t wait_time;
+    hrtime_t max_wait;
+    hrtime_t hold_time;
+    hrtime_t max_hold;
+};
+
+static struct lockstat_class lockstat_classes[LOCKSTAT_NR_CLASSES];
+/* Acquisitions we couldn't account because the table was full */
+static unsigned long lockstat_overflows;
+
+KERNEL_PARAM("lockstat", lockstat_enabled, bool);
+
+static struct lockstat_class *lockstat_get_class(unsigned long site)
+{
+    unsigned int idx = (site * 0x9E3779B97F4A7C15UL) >> (64 - 10);
+
+    for (unsigned int i = 0; i < LOCKSTAT_NR_CLASSES; i++, idx = (idx + 1) % LOCKSTAT_NR_CLASSES)
+    {
+        struct lockstat_class *c = &lockstat_classes[idx];
+        unsigned long cur = __atomic_load_n(&c->site, __ATOMIC_RELAXED);
+
+        if (cur == 0 && __atomic_compare_exchange_n(&c->site, &cur, site, false, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+            return c;
+
+        if (cur == site)
+            return c;
+    }
+
+    __atomic_add_fetch(&lockstat_overflows, 1, __ATOMIC_RELAXED);
+    return nullptr;
+}
+
+static void lockstat_update_max(hrtime_t *max, hrtime_t val)
+{
+    hrtime_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (val > cur &&
+           !__atomic_compare_exchange_n(max, &cur, val, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief Account a lock acquisition. Lock classes are keyed by acquisition site.
+ *
+ * @param lock Lock that was just acquired
+ * @param site Return address of the lock call
+ * @param contended True if we had to wait
+ * @param wait Time spent waiting
+ * @param now Time we got the lock at
+ */
+void lockstat_acquire(struct spinlock *lock, unsigned long site, bool contended, hrtime_t wait,
+                      hrtime_t now)
+{
+    struct lockstat_class *c = lockstat_get_class(site);
+    if (!c)
+        return;
+
+    __atomic_add_fetch(&c->acquisitions, 1, __ATOMIC_RELAXED);
+
+    if (contended)
+    {
+        __atomic_add_fetch(&c->contentions, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->wait_time, wait, __ATOMIC_RELAXED);
+        lockstat_update_max(&c->max_wait, wait);
+    }
+
+    lock->lockstat_class = c;
+    lock->lockstat_acquired = now;
+}
+
+/**
+ * @brief Account a lock release (and the time it was held for).
+ *
+ * @param lock Lock that is about to be released
+ */
+void lockstat_release(struct spinlock *lock)
+{
+    struct lockstat_class *c = (struct lockstat_class *) lock->lockstat_class;
+    const hrtime_t held = clocksource_get_time() - lock->lockstat_acquired;
+
+    lock->lockstat_class = nullptr;
+
+    __atomic_add_fetch(&c->hold_time, held, __ATOMIC_RELAXED);
+    lockstat_update_max(&c->max_hold, held);
+}
+
+static ssize_t lockstat_copy_out(void *buffer, size_t size, off_t off, const char *buf, size_t len)
+{
+    if ((size_t) off >= len)
+        return 0;
+
+    size_t to_copy = cul::min(len - off, size);
+    return copy_to_user(buffer, buf + off, to_copy) < 0 ? -EFAULT : (ssize_t) to_copy;
+}
+
+static ssize_t lockstat_stats_print(void *buffer, size_t size, off_t off)
+{
+    const size_t buflen = 128 * (LOCKSTAT_NR_CLASSES + 2);
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = snprintf(buf, buflen,
+                          "site acquisitions contentions wait_ns max_wait_ns hold_ns max_hold_ns\n");
+
+    for (unsigned int i = 0; i < LOCKSTAT_NR_CLASSES && len < buflen; i++)
+    {
+        const struct lockstat_class *c = &lockstat_classes[i];
+        if (!c->site)
+            continue;
+
+        len += snprintf(buf + len, buflen - len, "%016lx %lu %lu %lu %lu %lu %lu\n", c->site,
+                        c->acquisitions, c->contentions, c->wait_time, c->max_wait, c->hold_time,
+                        c->max_hold);
+    }
+
+    if (len < buflen)
+        len += snprintf(buf + len, buflen - len, "overflows %lu\n", lockstat_overflows);
+
+    if (len >= buflen)
+        len = buflen - 1;
+
+    ssize_t st = lockstat_copy_out(buffer, size, off, buf, len);
+    free(buf);
+    return st;
+}
+
+static ssize_t lockstat_stats_write(void *buffer, size_t size, off_t off)
+{
+    /* Any write resets the stats. Sites that are in use stay put, their counters just go to 0. */
+    for (unsigned int i = 0; i < LOCKSTAT_NR_CLASSES; i++)
+    {
+        struct lockstat_class *c = &lockstat_classes[i];
+        __atomic_store_n(&c->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->contentions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->wait_time, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->max_wait, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->hold_time, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->max_hold, 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&lockstat_overflows, 0, __ATOMIC_RELAXED);
+    return size;
+}
+
+static ssize_t lockstat_enable_read(void *buffer, size_t size, off_t off)
+{
+    return lockstat_copy_out(buffer, size, off, lockstat_enabled ? "1\n" : "0\n", 2);
+}
+
+static ssize_t lockstat_enable_write(void *buffer, size_t size, off_t off)
+{
+    char c;
+
+    if (size == 0)
+        return 0;
+
+    if (copy_from_user(&c, buffer, 1) < 0)
+        return -EFAULT;
+
+    if (c != '0' && c != '1')
+        return -EINVAL;
+
+    lockstat_enabled = c == '1';
+    return size;
+}
+
+static struct sysfs_object lockstat_obj;
+static struct sysfs_object lockstat_stats_file;
+static struct sysfs_object lockstat_enable_file;
+
+static void lockstat_sysfs_init()
+{
+    assert(sysfs_object_init("lockstat", &lockstat_obj) == 0);
+    lockstat_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("stats", &lockstat_stats_file, &lockstat_obj) == 0);
+    lockstat_stats_file.read = lockstat_stats_print;
+    lockstat_stats_file.write = lockstat_stats_write;
+    lockstat_stats_file.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("enable", &lockstat_enable_file, &lockstat_obj) == 0);
+    lockstat_enable_file.read = lockstat_enable_read;
+    lockstat_enable_file.write = lockstat_enable_write;
+    lockstat_enable_file.perms = 0644 | S_IFREG;
+
+    sysfs_add(&lockstat_obj, nullptr);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(lockstat_sysfs_init);
@@ -256,6 +256,9 @@ ssize_t flush_sync_one(struct flush_object *obj)
 
 void flush_do_sync()
 {
+    /* Filesystems may release blocks (and dirty metadata) on sync_fs, so do it first */
+    superblock_sync_all();
+
     for (auto &w : flush::thread_list)
     {
         w.sync();
@@ -28,6 +28,7 @@
 #include <onyx/paging.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
+#include <onyx/perf_probe.h>
 #include <onyx/process.h>
 #include <onyx/random.h>
 #include <onyx/spinlock.h>
@@ -827,7 +828,7 @@ int vm_clone_as(mm_address_space *addr_space, mm_address_space *original)
  * @brief Remaps an entire vm_region.
  * Using flags, it remaps the entire vm_region by iterating through every page and
  * re-mapping it. If VM_FLUSH_RWX_VALID, rwx is a valid combination of permission
- * flags and rwx overrides the pre-existing permissions in the vm_region (used in COW fork).
+ * flags and rwx overrides the pre-existing permissions in the vm_region.
  * Should only be used by MM code.
  *
  * @param mapping A pointer to the vm_region.
@@ -877,7 +878,7 @@ int vm_flush_mapping(struct vm_region *mapping, struct mm_address_space *mm, uns
  * @brief Remaps an entire vm_region.
  * Using flags, it remaps the entire vm_region by iterating through every page and
  * re-mapping it. If VM_FLUSH_RWX_VALID, rwx is a valid combination of permission
- * flags and rwx overrides the pre-existing permissions in the vm_region (used in COW fork).
+ * flags and rwx overrides the pre-existing permissions in the vm_region.
  * Should only be used by MM code.
  *
  * @param entry A pointer to the vm_region.
@@ -924,7 +925,6 @@ out:
 static bool fork_vm_region(struct vm_region *region, struct fork_iteration *it)
 {
     bool vmo_failure, is_private, using_shared_optimization, needs_to_fork_memory;
-    unsigned int new_rwx;
     bool res;
 
     struct vm_region *new_region = vm_alloc_vmregion();
@@ -976,32 +976,9 @@ static bool fork_vm_region(struct vm_region *region, struct fork_iteration *it)
 
     new_region->mm = it->target_mm;
 
-    /* If it's a private mapping, we're mapping it either COW if it's a writable mapping, or
-     * just not writable if it's a a RO/R-X mapping. Therefore, we mask the VM_WRITE bit
-     * out of the flush permissions, as to map things write-protected if it's a writable mapping.
+    /* The page tables were copied by paging_fork_tables(), after private writable mappings got
+     * write-protected (see vm_fork_address_space). Anything else gets faulted in on demand.
      */
-
-    new_rwx = is_private ? new_region->rwx & ~VM_WRITE : new_region->rwx;
-    if (vm_flush(new_region, VM_FLUSH_RWX_VALID, new_rwx | VM_NOFLUSH) < 0)
-    {
-        /* Let the generic addr space destruction code handle this,
-         * since there's everything's set now */
-        goto ohno;
-    }
-
-    if (is_private && region->rwx & VM_WRITE)
-    {
-        /* If the region is writable and we're a private mapping, we'll need to
-         * mark the original mapping as write-protected too, so the parent can also trigger COW
-         * behaviour.
-         */
-        int st = vm_flush(region, VM_FLUSH_RWX_VALID, new_rwx);
-
-        /* I don't even know how it should be possible to OOM changing protections
-         * of mappings that already exist. TODO: BUT, is it a plausible thing and should we handle
-         * it? */
-        assert(st == 0);
-    }
     return true;
 
 ohno:
@@ -1079,21 +1056,31 @@ int vm_fork_address_space(struct mm_address_space *addr_space)
     it.target_mm = addr_space;
     it.success = true;
 
+    struct mm_address_space *current_mm = get_current_address_space();
+    vm_region *entry;
+
+    /* Write-protect private writable mappings before the page tables get copied, so the parent
+     * and the child both COW on their next write. This only walks page tables that exist, and
+     * doesn't need to look at the VMOs.
+     */
+    bst_for_every_entry(&current_mm->region_tree, entry, vm_region, tree_node)
+    {
+        if (!is_mapping_shared(entry) && entry->rwx & VM_WRITE)
+            vm_mmu_write_protect(current_mm, (void *) entry->base, entry->pages);
+    }
+
     if (paging_fork_tables(addr_space) < 0)
     {
         __vm_unlock(false);
         return -1;
     }
 
-    struct mm_address_space *current_mm = get_current_address_space();
-
     bst_root_initialize(&addr_space->region_tree);
 
     addr_space->resident_set_size = current_mm->resident_set_size;
     addr_space->shared_set_size = current_mm->shared_set_size;
     addr_space->virtual_memory_size = current_mm->virtual_memory_size;
 
-    vm_region *entry;
     bst_for_every_entry(&current_mm->region_tree, entry, vm_region, tree_node)
     {
         if (!fork_vm_region(entry, &it))
@@ -2015,6 +2002,22 @@ int vm_handle_non_present_copy_on_write(struct fault_info *info, struct vm_pf_co
 
     struct vm_object *vmo = entry->vmo;
 
+    /* Pages we share with the rest of our fork family get mapped read-only, and copied on write */
+    if (vmo->backing)
+    {
+        vmo_status_t st = vmo_lookup_page(vmo, vmo_off, &ctx->page);
+        if (st == VMO_STATUS_OK)
+        {
+            ctx->page_rwx &= ~VM_WRITE;
+            return 0;
+        }
+        else if (st != VMO_STATUS_NON_EXISTENT)
+        {
+            ctx->info->signal = vmo_error_to_vm_error(st);
+            return -1;
+        }
+    }
+
     /* If we don't have a COW clone, this means we're an anon mapping and we're just looking to
      * COW-map the zero page
      */
@@ -2212,6 +2215,23 @@ int __vm_handle_pf(struct vm_region *entry, struct fault_info *info)
     return 0;
 }
 
+/* Set while this cpu is in copy_from_user_nofault() */
+static PER_CPU_VAR(bool pagefaults_disabled);
+
+ssize_t copy_from_user_nofault(void *data, const void *usr, size_t len)
+{
+    /* Stay on this cpu, and don't let anything else in while faults are off */
+    unsigned long flags = irq_save_and_disable();
+    const bool old = get_per_cpu(pagefaults_disabled);
+
+    write_per_cpu(pagefaults_disabled, true);
+    ssize_t st = copy_from_user(data, usr, len);
+    write_per_cpu(pagefaults_disabled, old);
+
+    irq_restore(flags);
+    return st;
+}
+
 /**
  * @brief Handles a page fault.
  *
@@ -2220,6 +2240,13 @@ int __vm_handle_pf(struct vm_region *entry, struct fault_info *info)
  */
 int vm_handle_page_fault(struct fault_info *info)
 {
+    /* Let the caller's fixup deal with it */
+    if (!info->user && get_per_cpu(pagefaults_disabled))
+    {
+        info->signal = VM_SIGSEGV;
+        return -1;
+    }
+
     bool use_kernel_as = !info->user && is_higher_half((void *) info->fault_address);
     struct mm_address_space *as =
         use_kernel_as ? &kernel_address_space : get_current_address_space();
@@ -2229,6 +2256,8 @@ int vm_handle_page_fault(struct fault_info *info)
     if (irq_is_disabled())
         panic("Page fault while IRQs were disabled\n");
 
+    perf_count_sw(PERF_COUNT_SW_PAGE_FAULTS);
+
     /* Surrender immediately if there's no user address space or the fault was inside vm code */
     if (!as || mutex_holds_lock(&as->vm_lock))
     {
@@ -3044,13 +3073,14 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
                 }
 
                 new_region->mapping_type = region->mapping_type;
-                new_region->offset = offset + to_shave_off;
+                new_region->offset = region->offset + offset + to_shave_off;
                 new_region->mm = region->mm;
                 new_region->flags = region->flags;
 
                 if (!is_mapping_shared(region) && !vmo_is_shared(region->vmo))
                 {
-                    struct vm_object *second = vmo_split(offset, to_shave_off, region->vmo);
+                    struct vm_object *second =
+                        vmo_split(region->offset + offset, to_shave_off, region->vmo);
                     if (!second)
                     {
                         vm_remove_region(as, new_region);
@@ -3063,8 +3093,6 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
 
                     new_region->vmo = second;
                     vmo_assign_mapping(second, new_region);
-                    /* We should need to do this */
-                    new_region->offset = 0;
                 }
                 else
                 {
@@ -3079,7 +3107,7 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size)
                 region->pages -= to_shave_off >> PAGE_SHIFT;
 
                 if (!is_mapping_shared(region) && !vmo_is_shared(region->vmo))
-                    vmo_truncate(region->vmo, region->vmo->size - to_shave_off, 0);
+                    vmo_truncate(region->vmo, region->offset + (region->pages << PAGE_SHIFT), 0);
             }
         }
 
@@ -3164,7 +3192,7 @@ int __vm_expand_mapping(struct vm_region *region, size_t new_size)
         return -ENOMEM;
 
     region->pages = new_size >> PAGE_SHIFT;
-    vmo_resize(new_size, region->vmo);
+    vmo_resize(region->offset + new_size, region->vmo);
 
     increment_vm_stat(region->mm, virtual_memory_size, diff);
     if (is_mapping_shared(region))
@@ -3693,7 +3721,7 @@ int get_phys_pages(void *_addr, unsigned int flags, struct page **pages, size_t
         }
 
         /* Calculate the number of pages we can resolve in this region */
-        size_t vm_region_off_pgs = (reg->base - addr) >> PAGE_SHIFT;
+        size_t vm_region_off_pgs = (addr - reg->base) >> PAGE_SHIFT;
         size_t max_resolved_pgs = reg->pages - vm_region_off_pgs;
         size_t resolved_pgs = min(nr_pgs, max_resolved_pgs);
 
@@ -3706,7 +3734,7 @@ int get_phys_pages(void *_addr, unsigned int flags, struct page **pages, size_t
 
         nr_pgs -= resolved_pgs;
         pages_gotten += resolved_pgs;
-        addr += nr_pgs << PAGE_SHIFT;
+        addr += resolved_pgs << PAGE_SHIFT;
     }
 
     /* Now that we're done, we're pinning the pages we just got */
@@ -137,6 +137,150 @@ vmo_status_t vmo_populate(vm_object *vmo, size_t off, page **ppage)
     return VMO_STATUS_OK;
 }
 
+/**
+ * @brief Checks if we're the only ones that can see a backing object.
+ * Backing objects can only be modified (by their sole user) in that case.
+ *
+ * @param backing The backing object
+ * @return True if only one VMO references it
+ */
+static bool vmo_sole_user(vm_object *backing)
+{
+    return __atomic_load_n(&backing->refcount, __ATOMIC_ACQUIRE) == 1;
+}
+
+/**
+ * @brief Looks up a page in the VMO's shadow chain.
+ * Shared backing objects are never modified, so this doesn't need any of their locks.
+ *
+ * @param vmo The VMO
+ * @param off Offset of the page
+ * @param powner Pointer to where the backing object that has the page will be placed
+ * @return The struct page, or nullptr if no backing object has it
+ */
+static struct page *vmo_backing_lookup(vm_object *vmo, size_t off, vm_object **powner)
+{
+    for (vm_object *cur = vmo; cur->backing && off < cur->backing_limit; cur = cur->backing)
+    {
+        void **pp = rb_tree_search(cur->backing->pages, (const void *) off);
+        if (pp)
+        {
+            *powner = cur->backing;
+            return (page *) *pp;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Collapses the VMO's backing object into it, if we're its only user (the other side of the
+ * fork exited or exec'd). The backing object's pages become ours and we take over its own backing
+ * object, so chains don't keep growing across generations of forks, and pages that got shadowed or
+ * truncated away are freed. Must be called with the page_lock held.
+ *
+ * @param vmo The VMO
+ */
+static void vmo_collapse(vm_object *vmo)
+{
+    MUST_HOLD_MUTEX(&vmo->page_lock);
+
+    vm_object *backing;
+
+    while ((backing = vmo->backing) && vmo_sole_user(backing))
+    {
+        struct rb_itor it;
+        it.tree = backing->pages;
+        it.node = nullptr;
+
+        bool node_valid = rb_itor_first(&it);
+
+        while (node_valid)
+        {
+            struct page *p = (page *) *rb_itor_datum(&it);
+            size_t off = (size_t) rb_itor_key(&it);
+
+            if (off < vmo->backing_limit)
+            {
+                dict_insert_result res = rb_tree_insert(vmo->pages, (void *) off);
+                /* Out of memory, leave the rest of the chain alone, it's still consistent */
+                if (!res.datum_ptr)
+                    return;
+
+                if (res.inserted)
+                {
+                    *res.datum_ptr = p;
+                    p = nullptr;
+                }
+            }
+
+            rb_itor_remove(&it);
+
+            /* Shadowed by one of our pages or truncated away, nobody can be mapping it */
+            if (p)
+                free_page(p);
+
+            node_valid = rb_itor_search_ge(&it, (const void *) off);
+        }
+
+        vmo->backing = backing->backing;
+        vmo->backing_limit = cul::min(vmo->backing_limit, backing->backing_limit);
+        /* Its reference to its backing object is now ours */
+        backing->backing = nullptr;
+        vmo_unref(backing);
+    }
+}
+
+/**
+ * @brief Gives the VMO its own copy of a page that's in its shadow chain.
+ * Must be called with the page_lock held.
+ *
+ * @param vmo The VMO
+ * @param off Offset of the page
+ * @param ppage Pointer to where the struct page will be placed
+ * @return The vm_status_t of the request, VMO_STATUS_NON_EXISTENT if no backing object has it
+ */
+static vmo_status_t vmo_copy_from_backing(vm_object *vmo, size_t off, struct page **ppage)
+{
+    MUST_HOLD_MUTEX(&vmo->page_lock);
+
+    vm_object *owner;
+    struct page *old_page = vmo_backing_lookup(vmo, off, &owner);
+    if (!old_page)
+        return VMO_STATUS_NON_EXISTENT;
+
+    /* If nobody else can see the backing object and nobody else holds the page (the zero page and
+     * page cache pages always have extra refs), just take it.
+     */
+    bool steal = owner == vmo->backing && vmo_sole_user(owner) && old_page->ref == 1;
+    struct page *new_page = old_page;
+
+    if (!steal)
+    {
+        new_page = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!new_page)
+            return VMO_STATUS_OUT_OF_MEM;
+
+        copy_page_to_page(page_to_phys(new_page), page_to_phys(old_page));
+    }
+
+    dict_insert_result res = rb_tree_insert(vmo->pages, (void *) off);
+    if (!res.inserted)
+    {
+        if (!steal)
+            free_page(new_page);
+        return VMO_STATUS_OUT_OF_MEM;
+    }
+
+    *res.datum_ptr = new_page;
+
+    if (steal)
+        rb_tree_remove(owner->pages, (const void *) off);
+
+    *ppage = new_page;
+    return VMO_STATUS_OK;
+}
+
 /**
  * @brief Fetch a page from a VM object
  *
@@ -168,6 +312,8 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
 
     scoped_mutex g{vmo->page_lock};
 
+    vmo_collapse(vmo);
+
     void **pp = rb_tree_search(vmo->pages, (const void *) off);
 
     if (pp)
@@ -175,6 +321,15 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
         p = (page *) *pp;
     }
 
+    if (!p && vmo->backing && !may_not_implicit_cow)
+    {
+        st = vmo_copy_from_backing(vmo, off, &p);
+        if (st == VMO_STATUS_NON_EXISTENT)
+            st = VMO_STATUS_OK;
+        else if (st != VMO_STATUS_OK)
+            return st;
+    }
+
     if (!p && is_cow && !may_not_implicit_cow)
     {
         struct page *new_page = alloc_page(PAGE_ALLOC_NO_ZERO);
@@ -230,6 +385,43 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
     return st;
 }
 
+/**
+ * @brief Looks up a page in the VMO or in its shadow chain, without populating or copying
+ * anything. The page may be shared with other VMOs, so it must only be mapped read-only.
+ *
+ * @param vmo The VMO
+ * @param off The offset inside the vm object
+ * @param ppage Pointer to where the (pinned) struct page will be placed
+ * @return The vm_status_t of the request, VMO_STATUS_NON_EXISTENT if the page isn't there
+ */
+vmo_status_t vmo_lookup_page(vm_object *vmo, size_t off, struct page **ppage)
+{
+    if (off >= vmo->size)
+        return VMO_STATUS_BUS_ERROR;
+
+    scoped_mutex g{vmo->page_lock};
+
+    vmo_collapse(vmo);
+
+    struct page *p = nullptr;
+    void **pp = rb_tree_search(vmo->pages, (const void *) off);
+
+    if (pp)
+        p = (page *) *pp;
+    else
+    {
+        vm_object *owner;
+        p = vmo_backing_lookup(vmo, off, &owner);
+    }
+
+    if (!p)
+        return VMO_STATUS_NON_EXISTENT;
+
+    page_pin(p);
+    *ppage = p;
+    return VMO_STATUS_OK;
+}
+
 void vmo_rb_delete_func(void *key, void *data)
 {
     struct page *p = (page *) data;
@@ -239,52 +431,108 @@ void vmo_rb_delete_func(void *key, void *data)
     free_page(p);
 }
 
-int vmo_fork_pages(vm_object *vmo)
+/**
+ * @brief Drops the pages of a backing object that are at or above limit.
+ * Must only be called by the backing object's sole user.
+ *
+ * @param backing The backing object
+ * @param limit The limit
+ */
+static void vmo_backing_trim(vm_object *backing, size_t limit)
 {
-    size_t pages = vm_size_to_pages(vmo->size);
-    if (!pages)
-        return 0;
+    struct rb_itor it;
+    it.tree = backing->pages;
+    it.node = nullptr;
 
-    rb_itor *it = rb_itor_new(vmo->pages);
-    if (!it)
-        return -1;
+    bool node_valid = rb_itor_search_ge(&it, (const void *) limit);
 
-    rb_tree *new_tree = rb_tree_new(page_cmp);
-    if (!new_tree)
+    while (node_valid)
     {
-        free(it);
-        return -1;
+        struct page *p = (page *) *rb_itor_datum(&it);
+        size_t off = (size_t) rb_itor_key(&it);
+
+        rb_itor_remove(&it);
+        free_page(p);
+        node_valid = rb_itor_search_ge(&it, (const void *) off);
     }
+}
 
-    scoped_mutex g{vmo->page_lock};
+/**
+ * @brief Moves the VMO's pages to a backing object, so they can be shared with a fork child.
+ * This is O(1) unless we're the backing object's only user, in which case our pages are folded
+ * into it instead of growing the chain (which is O(pages we touched since the last fork)).
+ * Must be called with the page_lock held.
+ *
+ * @param vmo The VMO
+ * @return 0 on success, negative error codes
+ */
+static int vmo_shadow(vm_object *vmo)
+{
+    MUST_HOLD_MUTEX(&vmo->page_lock);
 
-    bool node_valid = rb_itor_first(it);
+    /* Nothing of our own, we can keep sharing what we have */
+    if (rb_tree_count(vmo->pages) == 0)
+        return 0;
 
-    while (node_valid)
+    vm_object *backing = vmo->backing;
+
+    if (backing && vmo_sole_user(backing))
     {
-        struct page *old_p = (page *) *rb_itor_datum(it);
-        size_t off = (size_t) rb_itor_key(it);
+        /* Anything the backing object has above our limit is stale */
+        vmo_backing_trim(backing, vmo->backing_limit);
+        vmo->backing_limit = vmo->size;
 
-        dict_insert_result res = rb_tree_insert(new_tree, (void *) off);
-        if (!res.inserted)
+        struct rb_itor it;
+        it.tree = vmo->pages;
+        it.node = nullptr;
+
+        bool node_valid = rb_itor_first(&it);
+
+        while (node_valid)
         {
-            rb_itor_free(it);
-            return -1;
-        }
+            struct page *p = (page *) *rb_itor_datum(&it);
+            size_t off = (size_t) rb_itor_key(&it);
 
-        page_ref(old_p);
+            dict_insert_result res = rb_tree_insert(backing->pages, (void *) off);
+            if (!res.datum_ptr)
+            {
+                /* Out of memory, put the rest of our pages in a new backing object */
+                break;
+            }
+
+            /* Our page shadowed the old one, so nobody can be mapping it */
+            if (!res.inserted)
+                free_page((page *) *res.datum_ptr);
+
+            *res.datum_ptr = p;
+            rb_itor_remove(&it);
+            node_valid = rb_itor_search_ge(&it, (const void *) off);
+        }
 
-        *res.datum_ptr = old_p;
-        node_valid = rb_itor_next(it);
+        if (rb_tree_count(vmo->pages) == 0)
+            return 0;
     }
 
-    vmo->pages = new_tree;
+    vm_object *shadow = vmo_create(vmo->size, nullptr);
+    if (!shadow)
+        return -ENOMEM;
+
+    shadow->type = vmo->type;
+    cul::swap(shadow->pages, vmo->pages);
+    /* Our backing reference now belongs to the shadow */
+    shadow->backing = backing;
+    shadow->backing_limit = vmo->backing_limit;
+
+    vmo->backing = shadow;
+    vmo->backing_limit = vmo->size;
 
     return 0;
 }
 
 /**
  * @brief Forks the VMO, performing any COW tricks that may be required.
+ * Private VMOs don't get their pages copied: both sides end up shadowing a common backing object
+ * with the pages, and copy them on write.
  *
  * @param vmo The VMO to be forked.
  * @param shared True if the region is shared. This makes it skip all the work.
@@ -305,8 +553,7 @@ vm_object *vmo_fork(vm_object *vmo, bool shared, struct vm_region *reg)
         return vmo;
     }
 
-    /* Private mappings require a new copy of the vmo to be created, so we can fork it
-     * correctly. */
+    /* Private mappings require a new vmo to be created, so we can fork it correctly. */
 
     new_vmo = vmo_create(vmo->size, vmo->priv);
     if (!new_vmo)
@@ -321,12 +568,6 @@ vm_object *vmo_fork(vm_object *vmo, bool shared, struct vm_region *reg)
     new_vmo->ops = vmo->ops;
     new_vmo->type = vmo->type;
     new_vmo->priv = vmo->priv;
-
-    /* We're setting pages to the old vmo's pages so vmo_fork_pages can use them.
-     * In reality, vmo_fork_pages will just iterate through the old tree and create a copy
-     * of it.
-     */
-    new_vmo->pages = vmo->pages;
     new_vmo->cow_clone = vmo->cow_clone;
 
     if (new_vmo->cow_clone)
@@ -334,12 +575,18 @@ vm_object *vmo_fork(vm_object *vmo, bool shared, struct vm_region *reg)
 
     scoped_mutex g{vmo->page_lock};
 
-    if (vmo_fork_pages(new_vmo) < 0)
+    if (vmo_shadow(vmo) < 0)
     {
-        free(new_vmo);
+        vmo_destroy(new_vmo);
         return nullptr;
     }
 
+    new_vmo->backing = vmo->backing;
+    new_vmo->backing_limit = vmo->backing_limit;
+
+    if (new_vmo->backing)
+        vmo_ref(new_vmo->backing);
+
     return new_vmo;
 }
 
@@ -407,6 +654,9 @@ void vmo_destroy(vm_object *vmo)
     if (vmo->cow_clone)
         vmo_unref(vmo->cow_clone);
 
+    if (vmo->backing)
+        vmo_unref(vmo->backing);
+
     rb_tree_free(vmo->pages, vmo_rb_delete_func);
 
     free(vmo);
@@ -560,10 +810,19 @@ void vm_object::unmap_page(size_t offset)
 
 int vmo_resize(size_t new_size, vm_object *vmo)
 {
+    scoped_mutex g{vmo->page_lock};
     bool needs_to_purge = new_size < vmo->size;
+
+    /* Take over a backing object nobody else sees, so what we shrink away actually gets freed */
+    if (needs_to_purge)
+        vmo_collapse(vmo);
+
     vmo->size = new_size;
+    /* Whatever our backing objects have past this point is gone, even if we grow back */
+    vmo->backing_limit = cul::min(vmo->backing_limit, new_size);
     if (needs_to_purge)
-        vmo_purge_pages(0, new_size, PURGE_SHOULD_FREE | PURGE_EXCLUDE, nullptr, vmo);
+        vmo_purge_pages(0, new_size, PURGE_SHOULD_FREE | PURGE_EXCLUDE | PURGE_DO_NOT_LOCK, nullptr,
+                        vmo);
 
     return 0;
 }
@@ -587,37 +846,50 @@ vm_object *vmo_create_copy(vm_object *vmo)
     if (copy->cow_clone)
         vmo_ref(copy->cow_clone);
 
+    copy->backing = vmo->backing;
+    copy->backing_limit = vmo->backing_limit;
+    if (copy->backing)
+        vmo_ref(copy->backing);
+
     return copy;
 }
 
 /**
- * @brief Creates a new vmo and moves all pages in [split_point, split_point + hole_size] to it.
+ * @brief Frees the pages in [split_point, split_point + hole_size) and moves every page past the
+ * hole to a new vmo. The new vmo keeps the same offsets (and shadow chain) as the original, so it
+ * must be mapped at offset split_point + hole_size.
  *
  * @param split_point The start of the split point.
  * @param hole_size The size of the hole.
  * @param vmo The VMO to be split.
- * @return The new vmo populated with all pre-existing vmo pages in the range.
+ * @return The new vmo populated with all pre-existing vmo pages past the hole.
  */
 vm_object *vmo_split(size_t split_point, size_t hole_size, vm_object *vmo)
 {
+    scoped_mutex g{vmo->page_lock};
+
+    /* Take over a backing object nobody else sees before the new vmo starts sharing it, so the
+     * hole's pages actually get freed.
+     */
+    vmo_collapse(vmo);
+
     vm_object *second_vmo = vmo_create_copy(vmo);
 
     if (!second_vmo)
         return nullptr;
 
-    second_vmo->size -= split_point + hole_size;
-    INIT_LIST_HEAD(&second_vmo->mappings);
-
     unsigned long max = hole_size + split_point;
 
-    if (vmo_purge_pages(split_point, max, PURGE_SHOULD_FREE, nullptr, vmo) < 0 ||
-        vmo_purge_pages(max, vmo->size, 0, second_vmo, vmo) < 0)
+    if (vmo_purge_pages(split_point, max, PURGE_SHOULD_FREE | PURGE_DO_NOT_LOCK, nullptr,
+                        vmo) < 0 ||
+        vmo_purge_pages(max, vmo->size, PURGE_DO_NOT_LOCK, second_vmo, vmo) < 0)
     {
         vmo_destroy(second_vmo);
         return nullptr;
     }
 
-    vmo->size -= hole_size + second_vmo->size;
+    vmo->size = split_point;
+    vmo->backing_limit = cul::min(vmo->backing_limit, split_point);
 
     return second_vmo;
 }
@@ -695,6 +967,7 @@ void vmo_remove_mapping(vm_object *vmo, vm_region *region)
 
 /**
  * @brief Determines whether or not the VMO is currently being shared.
+ * A shadow chain doesn't count, as backing objects are never written through.
  *
  * @param vmo The VMO.
  * @return True if it is, false if not.
@@ -771,10 +1044,23 @@ struct page *vmo_cow_on_page(vm_object *vmo, size_t off)
 {
     scoped_mutex g{vmo->page_lock};
 
+    vmo_collapse(vmo);
+
     void **datum = rb_tree_search(vmo->pages, (void *) off);
 
     if (datum == nullptr)
-        panic("Fatal COW bug - page not found in VMO");
+    {
+        /* The page was mapped from our shadow chain */
+        struct page *p;
+        vmo_status_t st = vmo_copy_from_backing(vmo, off, &p);
+        if (st == VMO_STATUS_NON_EXISTENT)
+            panic("Fatal COW bug - page not found in VMO");
+        else if (st != VMO_STATUS_OK)
+            return nullptr;
+
+        page_pin(p);
+        return p;
+    }
 
     struct page *old_page = (page *) *datum;
 
@@ -849,6 +1135,9 @@ int vmo_truncate(vm_object *vmo, unsigned long size, unsigned long flags)
 
         if (truncating_down)
         {
+            /* Take over a backing object nobody else sees, so the range's pages get freed */
+            vmo_collapse(vmo);
+
             auto hole_start = size;
             auto hole_length = vmo->size - size;
             /* We've already locked up there */
@@ -874,6 +1163,7 @@ int vmo_truncate(vm_object *vmo, unsigned long size, unsigned long flags)
     }
 
     vmo->size = size;
+    vmo->backing_limit = cul::min(vmo->backing_limit, size);
 
     return 0;
 }
@@ -7,6 +7,7 @@
  */
 
 #include <onyx/kunit.h>
+#include <onyx/mm/vm_object.h>
 #include <onyx/vm.h>
 
 // Internal vm.cpp interfaces
@@ -40,6 +41,78 @@ TEST(mmap, test_range_at_end)
     ASSERT_EQ(allocated, -1UL);
 }
 
+TEST(vmo, shadow_chain_collapses)
+{
+    // Once the fork child goes away, the parent should get its pages back and drop the backing
+    // object, instead of keeping a chain around forever.
+    vm_object *vmo = vmo_create_phys(PAGE_SIZE);
+    ASSERT_NONNULL(vmo);
+
+    struct page *p;
+    ASSERT_EQ(vmo_get(vmo, 0, VMO_GET_MAY_POPULATE, &p), VMO_STATUS_OK);
+    page_unpin(p);
+
+    vm_object *child = vmo_fork(vmo, false, nullptr);
+    ASSERT_NONNULL(child);
+    EXPECT_NONNULL(vmo->backing);
+    EXPECT_EQ(vmo->backing, child->backing);
+
+    vmo_unref(child);
+
+    struct page *p2;
+    ASSERT_EQ(vmo_lookup_page(vmo, 0, &p2), VMO_STATUS_OK);
+    EXPECT_EQ(p, p2);
+    EXPECT_NULL(vmo->backing);
+    page_unpin(p2);
+
+    vmo_unref(vmo);
+}
+
+TEST(vmo, split_after_fork)
+{
+    // A forked VMO isn't shared as far as munmap is concerned, and splitting it must keep the
+    // pages past the hole at the same offsets.
+    vm_object *vmo = vmo_create_phys(3 * PAGE_SIZE);
+    ASSERT_NONNULL(vmo);
+
+    struct page *pages[3];
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_EQ(vmo_get(vmo, i * PAGE_SIZE, VMO_GET_MAY_POPULATE, &pages[i]), VMO_STATUS_OK);
+        page_unpin(pages[i]);
+    }
+
+    vm_object *child = vmo_fork(vmo, false, nullptr);
+    ASSERT_NONNULL(child);
+    EXPECT_FALSE(vmo_is_shared(vmo));
+    vmo_unref(child);
+
+    vm_object *second = vmo_split(PAGE_SIZE, PAGE_SIZE, vmo);
+    ASSERT_NONNULL(second);
+    EXPECT_NULL(vmo->backing);
+    EXPECT_NULL(second->backing);
+    EXPECT_EQ(vmo->size, PAGE_SIZE);
+
+    struct page *p;
+    ASSERT_EQ(vmo_lookup_page(second, 2 * PAGE_SIZE, &p), VMO_STATUS_OK);
+    EXPECT_EQ(pages[2], p);
+    page_unpin(p);
+    EXPECT_EQ(vmo_lookup_page(second, PAGE_SIZE, &p), VMO_STATUS_NON_EXISTENT);
+
+    vmo_unref(second);
+    vmo_unref(vmo);
+}
+
+TEST(uaccess, copy_from_user_nofault_unmapped)
+{
+    // Nothing is mapped at the bottom of the address space. The copy needs to fail straight
+    // away, instead of going through the page fault path.
+    unsigned long val = 0;
+    EXPECT_EQ(copy_from_user_nofault(&val, (const void *) PAGE_SIZE, sizeof(val)),
+              (ssize_t) -EFAULT);
+    EXPECT_EQ(val, 0UL);
+}
+
 #ifdef __x86_64__
 
 TEST(mmap, test_48_57_bit)
@@ -23,6 +23,10 @@ int inet_cork::append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_si
         auto packet = list_head_cpp<packetbuf>::self_from_list_head(l);
         auto packet_len = packet->length();
 
+        /* Zero-copy packets point to user memory, we can't append to those */
+        if (packet->zero_copy)
+            continue;
+
 #if DEBUG_INET_CORK
         printk("Length: %u\n", packet->length());
         printk("Max packet len %lu, proto hdr size %lu\n", max_packet_len, proto_hdr_size);
@@ -37,7 +41,9 @@ int inet_cork::append_data(const iovec *vec, size_t vec_len, size_t proto_hdr_si
 #if DEBUG_INET_CORK
             printk("Expanding buffer %u\n", to_expand);
 #endif
+            const auto old_truesize = packet->truesize;
             auto st = packet->expand_buffer(ubuf, to_expand);
+            truesize_ += packet->truesize - old_truesize;
 
             if (st < 0)
             {
@@ -113,8 +119,7 @@ int inet_cork::alloc_and_append(const iovec *vec, size_t vec_len, size_t proto_h
 
         added_from_vec += max_payload;
 
-        list_add_tail(&packet->list_node, &packet_list);
-        packet_list_len++;
+        append_packet(packet);
 
         if (added_from_vec == iov_len)
         {
@@ -128,6 +133,133 @@ int inet_cork::alloc_and_append(const iovec *vec, size_t vec_len, size_t proto_h
     return 0;
 }
 
+int inet_cork::append_zerocopy(const iovec *vec, size_t vec_len, size_t proto_hdr_size,
+                               size_t max_packet_len, zerocopy_ctl *zc)
+{
+    const size_t max_payload = max_packet_len - proto_hdr_size;
+    size_t read_in_vec = 0;
+
+    while (vec_len)
+    {
+        // Only a single datagram is allowed
+        if (packet_list_len == 1 && sock_type == SOCK_DGRAM)
+            return -EMSGSIZE;
+
+        auto packet = new packetbuf;
+        if (!packet)
+            return -ENOBUFS;
+
+        // The head only holds the headers, the data gets attached to the page vectors
+        if (!packet->allocate_space(proto_hdr_size + PACKET_MAX_HEAD_LENGTH))
+        {
+            delete packet;
+            return -ENOBUFS;
+        }
+
+        packet->reserve_headers(proto_hdr_size + PACKET_MAX_HEAD_LENGTH);
+
+        size_t payload = 0;
+
+        while (vec_len && payload < max_payload)
+        {
+            const uint8_t *ubuf = (const uint8_t *) vec->iov_base + read_in_vec;
+            const unsigned int to_attach = cul::min(vec->iov_len - read_in_vec, max_payload - payload);
+            auto st = packet->zerocopy_from_user(ubuf, to_attach);
+
+            if (st < 0)
+            {
+                delete packet;
+                return st;
+            }
+
+            payload += st;
+            read_in_vec += st;
+
+            if (read_in_vec == vec->iov_len)
+            {
+                vec++;
+                read_in_vec = 0;
+                vec_len--;
+            }
+
+            // Short attach, we ran out of page vectors
+            if ((size_t) st < to_attach)
+                break;
+        }
+
+        packet->attach_zerocopy(zc);
+        append_packet(packet);
+    }
+
+    return 0;
+}
+
+int inet_cork::append_pages(const page_iov *vec, size_t nr_vecs, size_t proto_hdr_size,
+                            size_t max_packet_len)
+{
+    const size_t max_payload = max_packet_len - proto_hdr_size;
+    size_t read_in_vec = 0;
+    packetbuf *packet = nullptr;
+
+    if (!list_is_empty(&packet_list))
+    {
+        auto last =
+            list_head_cpp<packetbuf>::self_from_list_head(list_last_element(&packet_list));
+        // Don't mix spliced pages into a MSG_ZEROCOPY send's packets
+        if (last->zero_copy && !last->zc && last->length() < max_payload)
+            packet = last;
+    }
+
+    while (nr_vecs)
+    {
+        if (!packet)
+        {
+            // Only a single datagram is allowed
+            if (packet_list_len == 1 && sock_type == SOCK_DGRAM)
+                return -EMSGSIZE;
+
+            packet = new packetbuf;
+            if (!packet)
+                return -ENOBUFS;
+
+            if (!packet->allocate_space(proto_hdr_size + PACKET_MAX_HEAD_LENGTH))
+            {
+                delete packet;
+                return -ENOBUFS;
+            }
+
+            packet->reserve_headers(proto_hdr_size + PACKET_MAX_HEAD_LENGTH);
+            append_packet(packet);
+        }
+
+        const unsigned int to_attach =
+            cul::min(vec->length - read_in_vec, max_payload - packet->length());
+        const auto old_truesize = packet->truesize;
+
+        if (!packet->attach_page(vec->page, vec->page_off + read_in_vec, to_attach))
+        {
+            // Out of page vectors, start a new packet
+            packet = nullptr;
+            continue;
+        }
+
+        truesize_ += packet->truesize - old_truesize;
+        read_in_vec += to_attach;
+
+        if (read_in_vec == vec->length)
+        {
+            vec++;
+            read_in_vec = 0;
+            nr_vecs--;
+        }
+
+        if (packet->length() == max_payload)
+            packet = nullptr;
+    }
+
+    return 0;
+}
+
 int inet_cork::send(const iflow &flow, void (*prepare_headers)(packetbuf *buf, const iflow &flow))
 {
     int pending = this->pending();
@@ -138,8 +270,7 @@ int inet_cork::send(const iflow &flow, void (*prepare_headers)(packetbuf *buf, c
 
         prepare_headers(pbf, flow);
 
-        list_remove(&pbf->list_node);
-        packet_list_len--;
+        remove_packet(pbf);
 
         int st = 0;
 
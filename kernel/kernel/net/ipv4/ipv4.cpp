@@ -525,8 +525,7 @@ int proto_family::bind_internal(sockaddr_in *in, inet_socket *sock)
          * ICMP allows you to bind multiple sockets, as they'll all receive the same packets.
          */
         if (!proto_has_no_ports &&
-            sock_table->get_socket(id,
-                                   GET_SOCKET_CHECK_EXISTENCE | GET_SOCKET_UNLOCKED | extra_flags))
+            sock_table->bind_conflicts(id, GET_SOCKET_UNLOCKED | extra_flags, sock))
         {
             sock_table->unlock(hash);
             return -EADDRINUSE;
@@ -545,6 +544,7 @@ int proto_family::bind_internal(sockaddr_in *in, inet_socket *sock)
     bool success = sock_table->add_socket(sock, ADD_SOCKET_UNLOCKED);
 
     sock_table->unlock(hash);
+    sock_table->maybe_grow();
 
     return success ? 0 : -ENOMEM;
 }
@@ -792,13 +792,34 @@ void inet_socket::unbind()
     proto_fam->unbind(this);
 }
 
-void inet_socket::append_inet_rx_pbuf(packetbuf *buf)
+bool inet_socket::append_inet_rx_pbuf(packetbuf *buf)
 {
+    if (!rx_charge(buf->truesize))
+        return false;
+
     buf->ref();
 
     list_add_tail(&buf->list_node, &rx_packet_list);
 
     wait_queue_wake_all(&rx_wq);
+    return true;
+}
+
+void inet_socket::dequeue_inet_rx_pbuf(packetbuf *buf)
+{
+    list_remove(&buf->list_node);
+    rx_uncharge(buf->truesize);
+    buf->unref();
+}
+
+static void inet_socket_free_rcu(struct rcu_head *head)
+{
+    free(container_of(head, inet_socket, rcu));
+}
+
+void inet_socket::operator delete(void *ptr)
+{
+    call_rcu(&reinterpret_cast<inet_socket *>(ptr)->rcu, inet_socket_free_rcu);
 }
 
 inet_socket::~inet_socket()
@@ -808,9 +829,7 @@ inet_socket::~inet_socket()
     list_for_every_safe (&rx_packet_list)
     {
         auto buf = list_head_cpp<packetbuf>::self_from_list_head(l);
-        list_remove(&buf->list_node);
-
-        buf->unref();
+        dequeue_inet_rx_pbuf(buf);
     }
 
     list_for_every_safe (&socket_backlog)
@@ -898,5 +917,5 @@ bool inet_proto_family::add_socket(inet_socket *sock)
 {
     auto proto_info = sock->proto_info;
     auto sock_table = proto_info->get_socket_table();
-    return sock_table->add_socket(sock, ADD_SOCKET_UNLOCKED);
+    return sock_table->add_socket(sock, 0);
 }
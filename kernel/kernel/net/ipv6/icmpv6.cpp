@@ -445,10 +445,7 @@ ssize_t icmp6_socket::recvmsg(msghdr *msg, int flags)
     msg->msg_controllen = 0;
 
     if (!(flags & MSG_PEEK))
-    {
-        list_remove(&buf->list_node);
-        buf->unref();
-    }
+        dequeue_inet_rx_pbuf(buf);
 
     return read;
 }
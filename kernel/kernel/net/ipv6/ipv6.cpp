@@ -129,8 +129,7 @@ int proto_family::bind_internal(sockaddr_in6 *in, inet_socket *sock)
          * ICMP allows you to bind multiple sockets, as they'll all receive the same packets.
          */
         if (!proto_has_no_ports &&
-            sock_table->get_socket(id,
-                                   GET_SOCKET_CHECK_EXISTENCE | GET_SOCKET_UNLOCKED | extra_flags))
+            sock_table->bind_conflicts(id, GET_SOCKET_UNLOCKED | extra_flags, sock))
         {
             sock_table->unlock(hash);
             return -EADDRINUSE;
@@ -149,6 +148,7 @@ int proto_family::bind_internal(sockaddr_in6 *in, inet_socket *sock)
     bool success = sock_table->add_socket(sock, ADD_SOCKET_UNLOCKED);
 
     sock_table->unlock(hash);
+    sock_table->maybe_grow();
 
     return success ? 0 : -ENOMEM;
 }
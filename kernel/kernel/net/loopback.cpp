@@ -53,13 +53,16 @@ int loopback_send_packet(packetbuf *buf, netif *nif)
  * @brief Dispatch pending RX packets
  *
  * @param nif Our nif (allocated in loopback_init)
- * @return 0 on success, negative error codes
+ * @param budget Maximum number of packets to process
+ * @return Number of packets processed
  */
-int loopback_pollrx(netif *nif)
+int loopback_pollrx(netif *nif, int budget)
 {
+    int done = 0;
+
     // We need to hold the lock around list accesses (pqueue).
     spin_lock(&pqueue_lock);
-    while (!list_is_empty(&pqueue))
+    while (done < budget && !list_is_empty(&pqueue))
     {
         auto pbuf = list_head_cpp<packetbuf>::self_from_list_head(list_first_element(&pqueue));
         list_remove(&pbuf->list_node);
@@ -70,6 +73,7 @@ int loopback_pollrx(netif *nif)
         spin_unlock(&pqueue_lock);
 
         netif_process_pbuf(nif, pbuf);
+        done++;
 
         // Relock for the next run.
         spin_lock(&pqueue_lock);
@@ -77,7 +81,7 @@ int loopback_pollrx(netif *nif)
 
     spin_unlock(&pqueue_lock);
 
-    return 0;
+    return done;
 }
 
 /**
@@ -19,10 +19,13 @@
 #include <onyx/net/udp.h>
 #include <onyx/softirq.h>
 #include <onyx/spinlock.h>
+#include <onyx/timer.h>
 #include <onyx/vector.h>
 
 #include <uapi/ioctls.h>
 
+#include <onyx/utility.hpp>
+
 static struct spinlock netif_list_lock = {};
 cul::vector<netif *> netif_list;
 
@@ -83,6 +86,23 @@ unsigned int netif_ioctl(int request, void *argp, struct file *f)
                 return -EFAULT;
             return 0;
         }
+
+        case SIOGETCOALESCE: {
+            if_coalesce c;
+            c.rx_usecs = netif->rx_coalesce_usecs;
+            if (copy_to_user(argp, &c, sizeof(c)) < 0)
+                return -EFAULT;
+            return 0;
+        }
+
+        case SIOSETCOALESCE: {
+            if_coalesce c;
+            if (!netif->set_coalesce)
+                return -EOPNOTSUPP;
+            if (copy_from_user(&c, argp, sizeof(c)) < 0)
+                return -EFAULT;
+            return netif->set_coalesce(netif, c.rx_usecs);
+        }
     }
 
     return -ENOTTY;
@@ -310,13 +330,33 @@ void netif_signal_rx(netif *nif)
     softirq_raise(softirq_vector::SOFTIRQ_VECTOR_NETRX);
 }
 
-void netif_do_rxpoll(netif *nif)
+/**
+ * @brief Poll a netif for received packets.
+ *
+ * @param nif Network interface
+ * @param budget Maximum number of packets to process
+ * @param done Set to the number of packets processed
+ * @return True if the netif still has work left, and must be polled again
+ */
+static bool netif_do_rxpoll(netif *nif, int budget, int *done)
 {
     __atomic_or_fetch(&nif->flags, NETIF_DOING_RX_POLL, __ATOMIC_RELAXED);
+    *done = 0;
 
     while (true)
     {
-        nif->poll_rx(nif);
+        const int processed = nif->poll_rx(nif, budget - *done);
+        *done += processed;
+
+        if (*done >= budget)
+        {
+            /* Out of budget. Keep HAS_RX_AVAILABLE set (and RX interrupts off), so nobody else
+             * queues it; we requeue it ourselves.
+             */
+            __atomic_and_fetch(&nif->flags, ~(NETIF_DOING_RX_POLL | NETIF_MISSED_RX),
+                               __ATOMIC_RELEASE);
+            return true;
+        }
 
         unsigned int flags, og_flags;
 
@@ -336,25 +376,64 @@ void netif_do_rxpoll(netif *nif)
                                               __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
 
         if (!(flags & NETIF_DOING_RX_POLL))
-            break;
+            return false;
     }
 }
 
+/* Packets a single netif gets to process before the next one gets a turn */
+#define NETIF_RX_WEIGHT 64
+/* Packets processed per NETRX softirq, across every netif */
+#define NETIF_RX_BUDGET 300
+/* Time limit for a NETRX softirq */
+#define NETIF_RX_MAX_TIME (2 * NS_PER_MS)
+
 int netif_do_rx()
 {
     auto queue = get_per_cpu_ptr(rx_queue);
+    DEFINE_LIST(polling);
+
+    /* Take the whole queue, so netif_signal_rx can keep adding to it while we poll */
+    unsigned long cpu_flags = spin_lock_irqsave(&queue->lock);
+    list_for_every_safe (&queue->to_rx_list)
+    {
+        list_remove(l);
+        list_add_tail(l, &polling);
+    }
+    spin_unlock_irqrestore(&queue->lock, cpu_flags);
 
-    scoped_lock g{queue->lock};
+    const hrtime_t end = clocksource_get_time() + NETIF_RX_MAX_TIME;
+    int budget = NETIF_RX_BUDGET;
 
-    list_for_every (&queue->to_rx_list)
+    while (!list_is_empty(&polling))
     {
-        netif *n = container_of(l, netif, rx_queue_node);
+        netif *n = container_of(list_first_element(&polling), netif, rx_queue_node);
+        list_remove(&n->rx_queue_node);
 
-        netif_do_rxpoll(n);
+        int done;
+        if (netif_do_rxpoll(n, cul::min(budget, NETIF_RX_WEIGHT), &done))
+            list_add_tail(&n->rx_queue_node, &polling);
+
+        budget -= done;
+        if (budget <= 0 || clocksource_get_time() >= end)
+            break;
     }
 
-    list_reset(&queue->to_rx_list);
+    if (list_is_empty(&polling))
+        return 0;
+
+    /* Out of budget. Put the leftovers back at the front of the queue and try again later,
+     * which may end up in ksoftirqd.
+     */
+    cpu_flags = spin_lock_irqsave(&queue->lock);
+    while (!list_is_empty(&polling))
+    {
+        auto l = list_last_element(&polling);
+        list_remove(l);
+        list_add(l, &queue->to_rx_list);
+    }
+    spin_unlock_irqrestore(&queue->lock, cpu_flags);
 
+    softirq_raise(SOFTIRQ_VECTOR_NETRX);
     return 0;
 }
 
@@ -13,7 +13,6 @@
 #include <unistd.h>
 
 #include <onyx/compiler.h>
-#include <onyx/dpc.h>
 #include <onyx/file.h>
 #include <onyx/log.h>
 #include <onyx/net/ethernet.h>
@@ -22,6 +21,7 @@
 #include <onyx/net/network.h>
 #include <onyx/net/udp.h>
 #include <onyx/packetbuf.h>
+#include <onyx/workqueue.h>
 
 #include <onyx/mm/pool.hpp>
 
@@ -41,9 +41,9 @@ void network_sethostname(const char *name)
 
 memory_pool<network_args, MEMORY_POOL_USABLE_ON_IRQ> pool;
 
-void network_do_dispatch(void *__args)
+static void network_do_dispatch(struct work_struct *work)
 {
-    network_args *args = reinterpret_cast<network_args *>(__args);
+    network_args *args = container_of(work, network_args, work);
     // network_handle_packet(args->buffer, args->size, args->netif);
     pool.free(args);
 }
@@ -61,8 +61,6 @@ void network_dispatch_receive(uint8_t *packet, uint16_t len, struct netif *netif
     args->size = len;
     args->netif = netif;
 
-    struct dpc_work work = {};
-    work.funcptr = network_do_dispatch;
-    work.context = args;
-    dpc_schedule_work(&work, DPC_PRIORITY_HIGH);
+    INIT_WORK(&args->work, network_do_dispatch);
+    queue_work(system_highpri_wq, &args->work);
 }
@@ -11,8 +11,10 @@
 #include <stdlib.h>
 
 #include <onyx/compiler.h>
-#include <onyx/mm/vm_object.h>
+#include <onyx/irq.h>
 #include <onyx/packetbuf.h>
+#include <onyx/percpu.h>
+#include <onyx/vm.h>
 
 #include <onyx/memory.hpp>
 #include <onyx/mm/pool.hpp>
@@ -29,6 +31,58 @@ void packetbuf::operator delete(void *ptr)
     packetbuf_pool.free(reinterpret_cast<packetbuf *>(ptr));
 }
 
+/**
+ * @brief Per-cpu cache that carves small packet heads out of shared pages.
+ * Every fragment handed out holds a reference to the page, and the cache holds one more
+ * for itself until it moves on to a fresh page.
+ */
+struct packetbuf_frag_cache
+{
+    struct page *page;
+    unsigned int offset;
+};
+
+static PER_CPU_VAR(packetbuf_frag_cache frag_cache);
+
+/**
+ * @brief Allocate a page fragment from the current cpu's fragment cache.
+ *
+ * @param size Size of the fragment, aligned to PACKETBUF_FRAG_ALIGN
+ * @param v page_iov to fill with the fragment
+ * @return True on success, false if we're out of memory
+ */
+static bool packetbuf_alloc_frag(unsigned int size, page_iov &v)
+{
+    DCHECK(size <= PACKETBUF_FRAG_MAX_SIZE);
+    /* Packetbufs get allocated in IRQ context by drivers, so disable irqs */
+    unsigned long flags = irq_save_and_disable();
+    auto cache = get_per_cpu_ptr(frag_cache);
+
+    if (!cache->page || cache->offset + size > PAGE_SIZE)
+    {
+        struct page *p = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!p)
+        {
+            irq_restore(flags);
+            return false;
+        }
+
+        if (cache->page)
+            free_page(cache->page);
+
+        cache->page = p;
+        cache->offset = 0;
+    }
+
+    page_ref(cache->page);
+    v.page = cache->page;
+    v.page_off = cache->offset;
+    cache->offset += size;
+
+    irq_restore(flags);
+    return true;
+}
+
 /**
  * @brief Reserve space for the packet.
  * This function is only meant to be called once, at initialisation,
@@ -41,78 +95,85 @@ void packetbuf::operator delete(void *ptr)
 bool packetbuf::allocate_space(size_t length)
 {
     /* This should only be called once - essentially,
-     * we allocate enough pages for the packet and fill page_vec.
+     * we allocate enough memory for the packet and fill page_vec.
+     * The head goes in a page fragment if it's small enough, and any other pages are
+     * allocated whole.
      */
 
     auto nr_pages = vm_size_to_pages(length);
+    unsigned int head_len = min(length, PAGE_SIZE);
+    unsigned int head_size = ALIGN_TO(head_len, PACKETBUF_FRAG_ALIGN);
 
-    page *pages = alloc_pages(nr_pages, PAGE_ALLOC_NO_ZERO);
-    if (!pages)
-        return false;
-
-    vmo = vmo_create(length, nullptr);
-    if (!vmo)
+    if (head_size <= PACKETBUF_FRAG_MAX_SIZE)
     {
-        free_pages(pages);
-        return false;
+        if (!packetbuf_alloc_frag(head_size, page_vec[0]))
+            return false;
+    }
+    else
+    {
+        page_vec[0].page = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!page_vec[0].page)
+            return false;
+        page_vec[0].page_off = 0;
+        head_size = PAGE_SIZE;
     }
 
-    auto pages_head = pages;
+    page_vec[0].length = head_len;
+    truesize += head_size;
 
-    for (size_t i = 0; i < nr_pages; i++)
+    for (size_t i = 1; i < nr_pages; i++)
     {
-        page_ref(pages);
+        page_vec[i].page = alloc_page(PAGE_ALLOC_NO_ZERO);
 
-        if (vmo_add_page_unlocked(i << PAGE_SHIFT, pages, vmo) < 0)
+        if (!page_vec[i].page)
         {
-            free_pages(pages_head);
-            vmo_destroy(vmo);
+            /* The destructor takes care of the pages we did get */
             return false;
         }
 
-        page_vec[i].page = pages;
-
-        if (i == 0)
-        {
-            page_vec[i].length = min(length, PAGE_SIZE);
-        }
-        else
-        {
-            page_vec[i].length = 0;
-        }
-
-        length -= page_vec[i].length;
+        page_vec[i].length = 0;
         page_vec[i].page_off = 0;
-        pages = pages->next_un.next_allocation;
+        truesize += PAGE_SIZE;
     }
 
-#if 0
-	buffer_start = vm_map_vmo(VM_KERNEL, VM_TYPE_REGULAR, nr_pages, VM_WRITE | VM_READ, vmo);
-	if(!buffer_start)
-	{
-		free_pages(pages_head);
-
-		for(size_t i = 0; i < nr_pages; i++)
-		{
-			page_vec[i].reset();
-		}
-
-		vmo_destroy(vmo);
-		vmo = nullptr;
-
-		return false;
-	}
-#else
-    buffer_start = PAGE_TO_VIRT(pages_head);
-#endif
+    buffer_start = (unsigned char *) PAGE_TO_VIRT(page_vec[0].page) + page_vec[0].page_off;
 
     net_header = transport_header = nullptr;
     data = tail = (unsigned char *) buffer_start;
-    end = (unsigned char *) buffer_start + PAGE_SIZE;
+    end = (unsigned char *) buffer_start + head_size;
 
     return true;
 }
 
+/**
+ * @brief Build the packet around the buffer a NIC received it in, instead of copying it out.
+ * Like allocate_space(), this is only meant to be called once, at initialisation.
+ * The packetbuf takes over the caller's reference to the page.
+ *
+ * @param page Page the packet was received in
+ * @param off Offset of the buffer in the page
+ * @param len Length of the packet
+ * @param size Size of the buffer
+ */
+void packetbuf::attach_rx_buffer(struct page *page, unsigned int off, unsigned int len,
+                                 unsigned int size)
+{
+    DCHECK(page_vec[0].page == nullptr);
+    DCHECK(len <= size && off + size <= PAGE_SIZE);
+
+    page_vec[0].page = page;
+    page_vec[0].page_off = off;
+    page_vec[0].length = len;
+    truesize += size;
+
+    buffer_start = (unsigned char *) PAGE_TO_VIRT(page) + off;
+
+    net_header = transport_header = nullptr;
+    data = (unsigned char *) buffer_start;
+    tail = data + len;
+    end = data + size;
+}
+
 /**
  * @brief Reserve space for the headers.
  *
@@ -164,17 +225,15 @@ void *packetbuf::put(unsigned int size)
  */
 packetbuf::~packetbuf()
 {
-    // const auto mapping_length = end - (unsigned char *) buffer_start;
-
-    // if(buffer_start)   vm_munmap(&kernel_address_space, buffer_start, mapping_length);
-    if (vmo)
-        vmo_unref(vmo);
-
     for (auto &v : page_vec)
     {
         if (v.page)
             free_page(v.page);
     }
+
+    /* The user's pages are no longer in use, let the send complete */
+    if (zc)
+        zc->put();
 }
 
 /**
@@ -211,7 +270,7 @@ packetbuf *packetbuf_clone(packetbuf *original)
     return buf.release();
 }
 
-static int allocate_page_vec(page_iov &v)
+static int allocate_page_vec(page_iov &v, unsigned int &truesize)
 {
     page *p = alloc_page(0);
 
@@ -221,6 +280,7 @@ static int allocate_page_vec(page_iov &v)
     v.length = 0;
     v.page = p;
     v.page_off = 0;
+    truesize += PAGE_SIZE;
 
     return 0;
 }
@@ -271,7 +331,7 @@ ssize_t packetbuf::expand_buffer(const void *ubuf_, unsigned int len)
 
         if (!v.page)
         {
-            if (allocate_page_vec(v) < 0)
+            if (allocate_page_vec(v, truesize) < 0)
                 return -ENOMEM;
         }
 
@@ -301,3 +361,77 @@ ssize_t packetbuf::expand_buffer(const void *ubuf_, unsigned int len)
 
     return ret;
 }
+
+/**
+ * @brief Expands the packet buffer by pinning the user's pages and attaching them to the data
+ * area, instead of copying. Marks the packetbuf as zero_copy.
+ *
+ * @param ubuf User address of the buffer.
+ * @param len Length of the buffer.
+ * @return The amount attached (which may be short if we ran out of page vectors), or a
+ * negative error code if we failed to attach anything.
+ */
+ssize_t packetbuf::zerocopy_from_user(const void *ubuf, unsigned int len)
+{
+    struct page *pages[PACKETBUF_MAX_NR_PAGES];
+    unsigned long addr = (unsigned long) ubuf;
+    const unsigned int first = count_page_vecs();
+    /* Leave the last entry alone, it's the terminating canary */
+    const unsigned int free_vecs = PACKETBUF_MAX_NR_PAGES + 1 - first;
+    unsigned int page_off = addr & (PAGE_SIZE - 1);
+
+    if (!len || !free_vecs)
+        return 0;
+
+    /* Pin all the pages at once, so we only walk the address space once */
+    const size_t nr_pages = min(vm_size_to_pages(page_off + len), (size_t) free_vecs);
+    if (!(get_phys_pages((void *) (addr - page_off), GPP_READ | GPP_USER, pages, nr_pages) &
+          GPP_ACCESS_OK))
+        return -EFAULT;
+
+    /* We can't put() anything after attaching pages, so close off the head area */
+    end = tail;
+    zero_copy = 1;
+
+    ssize_t ret = 0;
+
+    for (size_t i = 0; i < nr_pages; i++)
+    {
+        auto &v = page_vec[first + i];
+        const unsigned int to_attach = min(len, (unsigned int) PAGE_SIZE - page_off);
+
+        v.page = pages[i];
+        v.page_off = page_off;
+        v.length = to_attach;
+
+        /* Pinned user memory is charged to the socket like any other buffer */
+        truesize += to_attach;
+        len -= to_attach;
+        ret += to_attach;
+        page_off = 0;
+    }
+
+    return ret;
+}
+
+bool packetbuf::attach_page(struct page *page, unsigned int off, unsigned int len)
+{
+    const unsigned int idx = count_page_vecs();
+
+    /* Leave the last entry alone, it's the terminating canary */
+    if (idx == PACKETBUF_MAX_NR_PAGES + 1)
+        return false;
+
+    page_ref(page);
+
+    /* We can't put() anything after attaching pages, so close off the head area */
+    end = tail;
+    zero_copy = 1;
+
+    auto &v = page_vec[idx];
+    v.page = page;
+    v.page_off = off;
+    v.length = len;
+    truesize += len;
+    return true;
+}
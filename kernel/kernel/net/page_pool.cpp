@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <onyx/assert.h>
+#include <onyx/net/page_pool.h>
+
+/**
+ * @brief Initialise a page pool
+ *
+ * @param pool Pool
+ * @param size Number of pages the pool can hold (must be a power of 2)
+ * @return 0 on success, negative error codes
+ */
+int page_pool_init(struct page_pool *pool, unsigned int size)
+{
+    DCHECK((size & (size - 1)) == 0);
+
+    pool->pages = (struct page **) calloc(size, sizeof(struct page *));
+    if (!pool->pages)
+        return -ENOMEM;
+
+    pool->size = size;
+    pool->head = pool->tail = 0;
+    return 0;
+}
+
+/**
+ * @brief Free the pool, and drop its references to the pages it holds
+ *
+ * @param pool Pool
+ */
+void page_pool_destroy(struct page_pool *pool)
+{
+    for (; pool->head != pool->tail; pool->head++)
+        free_page(pool->pages[pool->head & (pool->size - 1)]);
+
+    free(pool->pages);
+    pool->pages = nullptr;
+}
+
+/**
+ * @brief Get a page for the RX ring. Recycles the oldest page if it's free, and allocates a new
+ * one otherwise.
+ *
+ * @param pool Pool
+ * @return A page, with a single reference belonging to the caller, or nullptr if we're out of
+ * memory
+ */
+struct page *page_pool_alloc(struct page_pool *pool)
+{
+    if (pool->head != pool->tail)
+    {
+        struct page *page = pool->pages[pool->head & (pool->size - 1)];
+
+        /* The pool's reference is the only one left, so nobody else can get to the page. Ours
+         * becomes the caller's.
+         */
+        if (__atomic_load_n(&page->ref, __ATOMIC_ACQUIRE) == 1)
+        {
+            pool->head++;
+            return page;
+        }
+    }
+
+    return alloc_page(PAGE_ALLOC_NO_ZERO);
+}
+
+/**
+ * @brief Give a page to the pool, so it can be handed out again once it's free.
+ * The pool takes a reference of its own, so this must be called before the caller gives its
+ * reference away.
+ *
+ * @param pool Pool
+ * @param page Page
+ */
+void page_pool_recycle(struct page_pool *pool, struct page *page)
+{
+    /* Full, so the oldest page is probably stuck in a socket somewhere. Let it go. */
+    if (pool->tail - pool->head == pool->size)
+        free_page(pool->pages[pool->head++ & (pool->size - 1)]);
+
+    page_ref(page);
+    pool->pages[pool->tail++ & (pool->size - 1)] = page;
+}
@@ -7,17 +7,26 @@
  */
 #include <errno.h>
 #include <net/if.h>
+#include <uapi/errqueue.h>
 #include <uapi/ioctls.h>
 
+#include <onyx/cred.h>
 #include <onyx/dentry.h>
 #include <onyx/file.h>
+#include <onyx/init.h>
+#include <onyx/limits.h>
 #include <onyx/net/ip.h>
 #include <onyx/net/netkernel.h>
 #include <onyx/net/socket.h>
+#include <onyx/page.h>
 #include <onyx/poll.h>
 #include <onyx/scoped_lock.h>
+#include <onyx/string_parsing.h>
+#include <onyx/sysfs.h>
 #include <onyx/utils.h>
 
+#include <uapi/memstat.h>
+
 /**
  * @brief Create a UNIX socket
  *
@@ -279,6 +288,38 @@ size_t socket_write(size_t offset, size_t len, void *buffer, struct file *file)
     return res;
 }
 
+ssize_t socket::sendpage(struct page *page, unsigned int off, size_t len, int flags)
+{
+    msghdr msg;
+    msg.msg_control = nullptr;
+    msg.msg_controllen = 0;
+    msg.msg_flags = 0;
+
+    iovec vec0;
+    vec0.iov_base = (char *) PAGE_TO_VIRT(page) + off;
+    vec0.iov_len = len;
+    msg.msg_iov = &vec0;
+    msg.msg_iovlen = 1;
+    msg.msg_name = nullptr;
+    msg.msg_namelen = 0;
+
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+    return sendmsg(&msg, flags);
+}
+
+bool file_is_socket(struct file *f)
+{
+    return f->f_ino->i_fops->write == socket_write;
+}
+
+ssize_t socket_sendpage(struct file *f, struct page *page, unsigned int off, size_t len)
+{
+    ssize_t res = file_to_socket(f)->sendpage(page, off, len, fd_flags_to_msg_flags(f));
+    if (res < 0)
+        return errno = -res, -1;
+    return res;
+}
+
 size_t socket_read(size_t offset, size_t len, void *buffer, file *file)
 {
     socket *s = file_to_socket(file);
@@ -1107,11 +1148,21 @@ int socket::getsockopt_socket_level(int optname, void *optval, socklen_t *optlen
             return put_option<int>(raddr, optval, optlen);
         }
 
+        case SO_REUSEPORT: {
+            const int rport = (int) reuse_port;
+            return put_option<int>(rport, optval, optlen);
+        }
+
         case SO_BROADCAST: {
             const int bcast_allowed = (int) broadcast_allowed;
             return put_option<int>(bcast_allowed, optval, optlen);
         }
 
+        case SO_ZEROCOPY: {
+            const int zc = (int) zerocopy_enabled;
+            return put_option<int>(zc, optval, optlen);
+        }
+
         default:
             return -ENOPROTOOPT;
     }
@@ -1127,7 +1178,7 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             if (ex.has_error())
                 return ex.error();
 
-            rx_max_buf = ex.value();
+            rx_max_buf = cul::max(ex.value(), (unsigned int) SOCK_MIN_BUF);
             return 0;
         }
 
@@ -1137,7 +1188,7 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             if (ex.has_error())
                 return ex.error();
 
-            tx_max_buf = ex.value();
+            tx_max_buf = cul::max(ex.value(), (unsigned int) SOCK_MIN_BUF);
             return 0;
         }
 
@@ -1151,6 +1202,21 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             return 0;
         }
 
+        case SO_REUSEPORT: {
+            auto ex = get_socket_option<int>(optval, optlen);
+
+            if (ex.has_error())
+                return ex.error();
+
+            /* Like linux, this only has an effect if set before bind() */
+            reuse_port = ex.value() != 0;
+
+            struct creds *c = creds_get();
+            reuse_port_uid = c->euid;
+            creds_put(c);
+            return 0;
+        }
+
         case SO_BROADCAST: {
             auto ex = get_socket_option<int>(optval, optlen);
 
@@ -1160,11 +1226,270 @@ int socket::setsockopt_socket_level(int optname, const void *optval, socklen_t o
             broadcast_allowed = ex.value() != 0;
             return 0;
         }
+
+        case SO_ZEROCOPY: {
+            auto ex = get_socket_option<int>(optval, optlen);
+
+            if (ex.has_error())
+                return ex.error();
+
+            if (domain != AF_INET && domain != AF_INET6)
+                return -EOPNOTSUPP;
+
+            if (type != SOCK_STREAM && type != SOCK_DGRAM)
+                return -EOPNOTSUPP;
+
+            scoped_hybrid_lock g{socket_lock, this};
+
+            if (ex.value() && !zerocopy)
+            {
+                zerocopy = new sock_zerocopy;
+                if (!zerocopy)
+                    return -ENOMEM;
+            }
+
+            zerocopy_enabled = ex.value() != 0;
+            return 0;
+        }
     }
 
     return -ENOPROTOOPT;
 }
 
+expected<zerocopy_ctl *, int> socket::zerocopy_begin(int msg_flags)
+{
+    if (!(msg_flags & MSG_ZEROCOPY) || !zerocopy_enabled)
+        return nullptr;
+
+    auto ctl = zerocopy->begin_send();
+    if (!ctl)
+        return unexpected<int>{-ENOBUFS};
+
+    return ctl;
+}
+
+ssize_t socket::recv_errqueue(struct msghdr *msg, sock_extended_err &err)
+{
+    if (!zerocopy || !zerocopy->peek(err))
+        return -EAGAIN;
+
+    msg->msg_namelen = 0;
+    msg->msg_flags = MSG_ERRQUEUE;
+
+    if (!msg->msg_control || msg->msg_controllen < CMSG_LEN(sizeof(err)))
+    {
+        msg->msg_flags |= MSG_CTRUNC;
+        msg->msg_controllen = 0;
+        return 0;
+    }
+
+    cmsghdr *cmsg = (cmsghdr *) msg->msg_control;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(err));
+    cmsg->cmsg_level = domain == AF_INET6 ? SOL_IPV6 : SOL_IP;
+    cmsg->cmsg_type = domain == AF_INET6 ? IPV6_RECVERR : IP_RECVERR;
+    memcpy(CMSG_DATA(cmsg), &err, sizeof(err));
+    msg->msg_controllen = cmsg->cmsg_len;
+
+    return 0;
+}
+
+void socket::consume_errqueue(const sock_extended_err &err)
+{
+    zerocopy->consume(err);
+}
+
+short socket::poll_errqueue(void *poll_file)
+{
+    if (!zerocopy)
+        return 0;
+
+    if (zerocopy->has_completions())
+        return POLLERR;
+
+    poll_wait_helper(poll_file, &zerocopy->wq);
+    return 0;
+}
+
+/* Global accounting of the memory pinned by socket buffers, in bytes.
+ * Past net_mem_pressure, sockets only get half of their buffer limits. Past net_mem_limit,
+ * only sockets with empty queues get to charge more memory.
+ */
+static atomic<unsigned long> net_mem_allocated{0};
+static unsigned long net_mem_pressure;
+static unsigned long net_mem_limit;
+
+bool net_mem_under_pressure()
+{
+    return net_mem_allocated.load(mem_order::relaxed) > net_mem_pressure;
+}
+
+static bool net_mem_charge(unsigned int size, bool force)
+{
+    auto new_alloc = net_mem_allocated.add_fetch(size, mem_order::relaxed);
+
+    if (new_alloc > net_mem_limit && !force) [[unlikely]]
+    {
+        net_mem_allocated.sub_fetch(size, mem_order::relaxed);
+        return false;
+    }
+
+    return true;
+}
+
+static void net_mem_uncharge(unsigned int size)
+{
+    net_mem_allocated.sub_fetch(size, mem_order::relaxed);
+}
+
+static unsigned int sock_effective_limit(unsigned int limit)
+{
+    return net_mem_under_pressure() ? limit / 2 : limit;
+}
+
+bool socket::rx_charge(unsigned int size, bool force)
+{
+    const auto curr = rx_alloc.load(mem_order::relaxed);
+
+    if (!force && curr && curr + size > sock_effective_limit(rx_max_buf))
+        return false;
+
+    if (!net_mem_charge(size, force || curr == 0))
+        return false;
+
+    rx_alloc.add_fetch(size, mem_order::relaxed);
+    return true;
+}
+
+void socket::rx_uncharge(unsigned int size)
+{
+    rx_alloc.sub_fetch(size, mem_order::relaxed);
+    net_mem_uncharge(size);
+}
+
+bool socket::tx_charge(unsigned int size, bool force)
+{
+    const auto curr = tx_alloc.load(mem_order::relaxed);
+
+    if (!force && curr && curr + size > sock_effective_limit(tx_max_buf))
+        return false;
+
+    if (!net_mem_charge(size, force || curr == 0))
+        return false;
+
+    tx_alloc.add_fetch(size, mem_order::relaxed);
+    return true;
+}
+
+void socket::tx_uncharge(unsigned int size)
+{
+    tx_alloc.sub_fetch(size, mem_order::relaxed);
+    net_mem_uncharge(size);
+}
+
+static struct sysfs_object net_obj;
+static struct sysfs_object net_mem_obj;
+static struct sysfs_object net_mem_pressure_obj;
+static struct sysfs_object net_mem_limit_obj;
+
+static ssize_t net_mem_print(unsigned long val, void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    size_t len = snprintf(buf, sizeof(buf), "%lu\n", val);
+
+    if ((size_t) off >= len)
+        return 0;
+
+    size_t to_copy = min(size, len - off);
+    if (copy_to_user(buffer, buf + off, to_copy) < 0)
+        return -EFAULT;
+
+    return to_copy;
+}
+
+static ssize_t net_mem_parse(unsigned long *val, void *buffer, size_t size)
+{
+    char buf[32];
+
+    if (size >= sizeof(buf))
+        return -EINVAL;
+
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+
+    /* Ignore trailing newlines, echo likes to add those */
+    size_t len = size;
+    while (len && buf[len - 1] == '\n')
+        len--;
+
+    auto ex = parser::parse_number_from_string<unsigned long>({buf, len});
+    if (ex.has_error())
+        return -EINVAL;
+
+    *val = ex.value();
+    return size;
+}
+
+static ssize_t net_mem_read(void *buffer, size_t size, off_t off)
+{
+    return net_mem_print(net_mem_allocated.load(mem_order::relaxed), buffer, size, off);
+}
+
+static ssize_t net_mem_pressure_read(void *buffer, size_t size, off_t off)
+{
+    return net_mem_print(net_mem_pressure, buffer, size, off);
+}
+
+static ssize_t net_mem_pressure_write(void *buffer, size_t size, off_t off)
+{
+    return net_mem_parse(&net_mem_pressure, buffer, size);
+}
+
+static ssize_t net_mem_limit_read(void *buffer, size_t size, off_t off)
+{
+    return net_mem_print(net_mem_limit, buffer, size, off);
+}
+
+static ssize_t net_mem_limit_write(void *buffer, size_t size, off_t off)
+{
+    return net_mem_parse(&net_mem_limit, buffer, size);
+}
+
+/**
+ * @brief Set up the global network memory limits and their /sys/net nodes.
+ *
+ */
+static void net_mem_init()
+{
+    memstat ms;
+    page_get_stats(&ms);
+
+    /* Default to 1/16th of memory before we start applying pressure, and 1/8th as a hard limit */
+    const unsigned long total = ms.total_pages << PAGE_SHIFT;
+    net_mem_pressure = total / 16;
+    net_mem_limit = total / 8;
+
+    assert(sysfs_object_init("net", &net_obj) == 0);
+    net_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("mem_allocated", &net_mem_obj, &net_obj) == 0);
+    net_mem_obj.read = net_mem_read;
+    net_mem_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("mem_pressure", &net_mem_pressure_obj, &net_obj) == 0);
+    net_mem_pressure_obj.read = net_mem_pressure_read;
+    net_mem_pressure_obj.write = net_mem_pressure_write;
+    net_mem_pressure_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("mem_limit", &net_mem_limit_obj, &net_obj) == 0);
+    net_mem_limit_obj.read = net_mem_limit_read;
+    net_mem_limit_obj.write = net_mem_limit_write;
+    net_mem_limit_obj.perms = 0644 | S_IFREG;
+
+    sysfs_add(&net_obj, nullptr);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(net_mem_init);
+
 int sys_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen)
 {
     auto f = get_socket_fd(sockfd);
@@ -1308,7 +1633,17 @@ int copy_msghdr_from_user(msghdr *msg, const msghdr *umsg, msghdr_guard &guard)
     return 0;
 }
 
-ssize_t socket_sendmsg(socket *sock, msghdr *umsg, int flags)
+/**
+ * @brief Send a message from a user msghdr.
+ *
+ * @param sock Socket
+ * @param umsg User msghdr
+ * @param flags Flags
+ * @param send Sends the message (with kernel pointers)
+ * @return Length sent, or a negative error code
+ */
+static ssize_t __socket_sendmsg(socket *sock, msghdr *umsg, int flags,
+                                ssize_t (*send)(socket *, const msghdr *, int))
 {
     msghdr msg;
     msghdr_guard g;
@@ -1316,7 +1651,17 @@ ssize_t socket_sendmsg(socket *sock, msghdr *umsg, int flags)
     if (int st = copy_msghdr_from_user(&msg, umsg, g); st < 0)
         return st;
 
-    return sock->sendmsg(&msg, flags);
+    return send(sock, &msg, flags);
+}
+
+static ssize_t socket_sendmsg_single(socket *sock, const msghdr *msg, int flags)
+{
+    return sock->sendmsg(msg, flags);
+}
+
+ssize_t socket_sendmsg(socket *sock, msghdr *umsg, int flags)
+{
+    return __socket_sendmsg(sock, umsg, flags, socket_sendmsg_single);
 }
 
 ssize_t sys_sendto(int sockfd, const void *buf, size_t len, int flags, struct sockaddr *addr,
@@ -1371,15 +1716,26 @@ ssize_t sys_sendmsg(int sockfd, struct msghdr *msg, int flags)
     return socket_sendmsg(sock, msg, flags | fd_flags_to_msg_flags(f.get_file()));
 }
 
-ssize_t socket_recvmsg(socket *sock, msghdr *umsg, int flags)
+/**
+ * @brief Receive a message into a user msghdr.
+ *
+ * @param sock Socket
+ * @param umsg User msghdr
+ * @param flags Flags
+ * @param recv Receives the message (with kernel pointers)
+ * @return Length of the message, or a negative error code
+ */
+static ssize_t __socket_recvmsg(socket *sock, msghdr *umsg, int flags,
+                                ssize_t (*recv)(socket *, msghdr *, int))
 {
     msghdr msg;
     msghdr_guard g;
+    sock_extended_err err;
 
     if (int st = copy_msghdr_from_user(&msg, umsg, g); st < 0)
         return st;
 
-    auto st = sock->recvmsg(&msg, flags);
+    auto st = flags & MSG_ERRQUEUE ? sock->recv_errqueue(&msg, err) : recv(sock, &msg, flags);
 
     if (st < 0)
         return st;
@@ -1396,16 +1752,30 @@ ssize_t socket_recvmsg(socket *sock, msghdr *umsg, int flags)
 
     if (msg.msg_name)
     {
-        if (copy_to_user(msg.msg_name, g.uname, msg.msg_namelen) < 0)
+        if (copy_to_user(msg.msg_name, &g.sa, msg.msg_namelen) < 0)
             return -EFAULT;
     }
 
     if (copy_to_user(umsg, &msg, sizeof(msghdr)) < 0)
         return -EFAULT;
 
+    /* Only drop the error now that user space has it. If it didn't fit, it stays queued. */
+    if (flags & MSG_ERRQUEUE && !(msg.msg_flags & MSG_CTRUNC))
+        sock->consume_errqueue(err);
+
     return st;
 }
 
+static ssize_t socket_recvmsg_single(socket *sock, msghdr *msg, int flags)
+{
+    return sock->recvmsg(msg, flags);
+}
+
+ssize_t socket_recvmsg(socket *sock, msghdr *umsg, int flags)
+{
+    return __socket_recvmsg(sock, umsg, flags, socket_recvmsg_single);
+}
+
 ssize_t sys_recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
     auto_file f = get_socket_fd(sockfd);
@@ -1417,6 +1787,132 @@ ssize_t sys_recvmsg(int sockfd, struct msghdr *msg, int flags)
     return socket_recvmsg(sock, msg, flags | fd_flags_to_msg_flags(f.get_file()));
 }
 
+int socket_do_recvmmsg(socket *sock, struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                       const hrtime_t *deadline, ssize_t (*recv)(socket *, msghdr *, int))
+{
+    unsigned int nr = 0;
+
+    while (nr < vlen)
+    {
+        ssize_t st = __socket_recvmsg(sock, &umsgvec[nr].msg_hdr, flags, recv);
+        if (st < 0)
+        {
+            /* Errors after the first message get dropped, we return what we have */
+            if (nr == 0)
+                return st;
+            break;
+        }
+
+        unsigned int len = (unsigned int) st;
+        if (copy_to_user(&umsgvec[nr].msg_len, &len, sizeof(len)) < 0)
+            return nr ? (int) nr : -EFAULT;
+
+        nr++;
+
+        if (flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+
+        /* Like linux, the timeout is only checked after receiving each message */
+        if (deadline && clocksource_get_time() >= *deadline)
+            break;
+    }
+
+    return nr;
+}
+
+int socket::recvmmsg(struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                     const hrtime_t *deadline)
+{
+    return socket_do_recvmmsg(this, umsgvec, vlen, flags, deadline, socket_recvmsg_single);
+}
+
+int sys_recvmmsg(int sockfd, struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                 struct timespec *utimeout)
+{
+    hrtime_t deadline = 0;
+    hrtime_t start = 0;
+
+    auto_file f = get_socket_fd(sockfd);
+    if (!f)
+        return -errno;
+
+    socket *sock = file_to_socket(f);
+
+    if (vlen > IOV_MAX)
+        vlen = IOV_MAX;
+
+    if (utimeout)
+    {
+        struct timespec ts;
+        if (copy_from_user(&ts, utimeout, sizeof(ts)) < 0)
+            return -EFAULT;
+        if (!timespec_valid(&ts, false))
+            return -EINVAL;
+
+        start = clocksource_get_time();
+        deadline = start + timespec_to_hrtime(&ts);
+    }
+
+    int st = sock->recvmmsg(umsgvec, vlen, flags | fd_flags_to_msg_flags(f.get_file()),
+                            utimeout ? &deadline : nullptr);
+
+    if (st >= 0 && utimeout)
+    {
+        /* Report the time left, like linux */
+        const hrtime_t now = clocksource_get_time();
+        struct timespec ts;
+        hrtime_to_timespec(now < deadline ? deadline - now : 0, &ts);
+        if (copy_to_user(utimeout, &ts, sizeof(ts)) < 0)
+            return -EFAULT;
+    }
+
+    return st;
+}
+
+int socket_do_sendmmsg(socket *sock, struct mmsghdr *umsgvec, unsigned int vlen, int flags,
+                       ssize_t (*send)(socket *, const msghdr *, int))
+{
+    unsigned int nr = 0;
+
+    while (nr < vlen)
+    {
+        ssize_t st = __socket_sendmsg(sock, &umsgvec[nr].msg_hdr, flags, send);
+        if (st < 0)
+        {
+            if (nr == 0)
+                return st;
+            break;
+        }
+
+        unsigned int len = (unsigned int) st;
+        if (copy_to_user(&umsgvec[nr].msg_len, &len, sizeof(len)) < 0)
+            return nr ? (int) nr : -EFAULT;
+
+        nr++;
+    }
+
+    return nr;
+}
+
+int socket::sendmmsg(struct mmsghdr *umsgvec, unsigned int vlen, int flags)
+{
+    return socket_do_sendmmsg(this, umsgvec, vlen, flags, socket_sendmsg_single);
+}
+
+int sys_sendmmsg(int sockfd, struct mmsghdr *umsgvec, unsigned int vlen, int flags)
+{
+    auto_file f = get_socket_fd(sockfd);
+    if (!f)
+        return -errno;
+
+    socket *sock = file_to_socket(f);
+
+    if (vlen > IOV_MAX)
+        vlen = IOV_MAX;
+
+    return sock->sendmmsg(umsgvec, vlen, flags | fd_flags_to_msg_flags(f.get_file()));
+}
+
 void sock_do_post_work(socket *sock)
 {
     return sock->handle_backlog();
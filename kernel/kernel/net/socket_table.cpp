@@ -1,52 +1,179 @@
 /*
- * Copyright (c) 2020 Pedro Falcato
+ * Copyright (c) 2020 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
+#include <stdlib.h>
+
+#include <onyx/cpu.h>
 #include <onyx/net/inet_socket.h>
 #include <onyx/net/socket_table.h>
+#include <onyx/preempt.h>
+#include <onyx/rcu.h>
+#include <onyx/scoped_lock.h>
 
-inet_socket *socket_table::get_socket(const socket_id &id, unsigned int flags, unsigned int inst)
-{
-    auto hash = inet_socket::make_hash_from_id(id);
-    bool unlocked = flags & GET_SOCKET_UNLOCKED;
-    auto index = socket_hashtable.get_hashtable_index(hash);
+static_assert(CONFIG_SOCKET_HASHTABLE_SIZE >= SOCKET_TABLE_NR_LOCKS);
+static_assert((CONFIG_SOCKET_HASHTABLE_SIZE & (CONFIG_SOCKET_HASHTABLE_SIZE - 1)) == 0);
 
-    if (!unlocked)
-        lock(hash);
+socket_table::socket_table()
+    : initial{CONFIG_SOCKET_HASHTABLE_SIZE - 1, initial_heads}, buckets{&initial}, seq{0},
+      nr_sockets{0}, resize_lock{}, lock_{}
+{
+    for (unsigned int i = 0; i < CONFIG_SOCKET_HASHTABLE_SIZE; i++)
+        INIT_HLIST_NULLS_HEAD(&initial_heads[i], i);
 
-    /* Alright, so this is the standard hashtable thing - hash the socket_id,
-     * get the iterators, and then iterate through the list and compare the
-     * socket_id with the socket's internal id. This should be pretty efficient.
-     * My biggest worry right now is that the hashtables may be too small for a lot of system load.
-     * We should do something like linux where its hash tables are allocated dynamically,
-     * based on the system memory's size.
-     */
+    for (auto &l : lock_)
+        spinlock_init(&l);
+}
 
-    auto list = socket_hashtable.get_hashtable(index);
+static inet_socket *node_to_socket(hlist_nulls_node *node)
+{
+    return container_of(node, inet_socket, bind_table_node);
+}
 
-    inet_socket *ret = nullptr;
+/**
+ * @brief Walk a hash chain, looking for a socket.
+ *
+ * @param b Buckets to look in
+ * @param hash Hash of the socket id
+ * @param id Socket id
+ * @param flags GET_SOCKET_* flags
+ * @param inst Instance of the socket to return (skips the first inst matches)
+ * @param restart Set to true if the walk got moved to another chain and needs to restart.
+ *                May be nullptr if the caller holds the bucket's lock.
+ * @return The socket, or nullptr
+ */
+inet_socket *socket_table::lookup(const socket_table_buckets *b, fnv_hash_t hash,
+                                  const socket_id &id, unsigned int flags, unsigned int inst,
+                                  bool *restart)
+{
+    const unsigned int index = hash & b->mask;
+    hlist_nulls_node *node;
 
-    list_for_every (list)
+    hlist_nulls_for_every(node, &b->heads[index])
     {
-        auto sock = list_head_cpp<inet_socket>::self_from_list_head(l);
+        auto sock = node_to_socket(node);
 
         if (sock->is_id(id, flags) && inst-- == 0)
-        {
-            ret = sock;
-            break;
-        }
+            return sock;
     }
 
-    /* GET_SOCKET_CHECK_EXISTENCE is very useful for operations like bind,
-     * as to avoid two extra atomic operations.
+    /* We ended up in another chain, because the socket we were standing on got removed and
+     * added somewhere else. Anything could've been skipped.
      */
+    if (restart && get_nulls_value(node) != index)
+        *restart = true;
+    return nullptr;
+}
+
+/**
+ * @brief Pick a socket in a SO_REUSEPORT group.
+ * Every socket in the group is bound to the same address, the flow's hash picks one of them,
+ * so packets (and connections) from the same flow always land on the same socket.
+ *
+ * @param b Buckets
+ * @param hash Hash of the socket id
+ * @param first First socket of the group
+ * @param id Socket id
+ * @param flags GET_SOCKET_* flags
+ * @return The picked socket
+ */
+inet_socket *socket_table::select_reuseport(const socket_table_buckets *b, fnv_hash_t hash,
+                                            inet_socket *first, const socket_id &id,
+                                            unsigned int flags)
+{
+    const bool v4 = first->in_ipv4_mode();
+    auto in_group = [&](inet_socket *sock) -> bool {
+        return sock->reuse_port && sock->domain == first->domain &&
+               sock->src_addr.equals(first->src_addr, v4) && sock->is_id(id, flags);
+    };
 
-    if (ret && !(flags & GET_SOCKET_CHECK_EXISTENCE))
-        ret->ref();
+    const unsigned int index = hash & b->mask;
+    hlist_nulls_node *node;
+    unsigned int nr = 0;
 
-    if (!unlocked)
-        unlock(hash);
+    hlist_nulls_for_every(node, &b->heads[index])
+    {
+        if (in_group(node_to_socket(node)))
+            nr++;
+    }
+
+    if (nr <= 1)
+        return first;
+
+    auto flow = fnv_hash(&id.dst_addr.port, sizeof(in_port_t));
+    if (id.domain == AF_INET)
+        flow = fnv_hash_cont(&id.dst_addr.in4, sizeof(id.dst_addr.in4), flow);
+    else
+        flow = fnv_hash_cont(&id.dst_addr.in6, sizeof(id.dst_addr.in6), flow);
+
+    unsigned int pick = flow % nr;
+
+    hlist_nulls_for_every(node, &b->heads[index])
+    {
+        auto sock = node_to_socket(node);
+        if (in_group(sock) && pick-- == 0)
+            return sock;
+    }
+
+    /* The group changed under us, just go with the first one */
+    return first;
+}
+
+inet_socket *socket_table::get_socket(const socket_id &id, unsigned int flags, unsigned int inst)
+{
+    auto hash = inet_socket::make_hash_from_id(id);
+
+    if (flags & GET_SOCKET_UNLOCKED)
+    {
+        /* The caller holds the bucket lock, so nothing can change under us */
+        auto ret = lookup(get_buckets(), hash, id, flags, inst, nullptr);
+
+        /* GET_SOCKET_CHECK_EXISTENCE is very useful for operations like bind,
+         * as to avoid two extra atomic operations.
+         */
+        if (ret && !(flags & GET_SOCKET_CHECK_EXISTENCE))
+            ret->ref();
+        return ret;
+    }
+
+    inet_socket *ret;
+    unsigned int s;
+
+    rcu_read_lock();
+
+    while (true)
+    {
+        /* Wait out a rehash in progress */
+        while ((s = seq.load(mem_order::acquire)) & 1)
+            cpu_relax();
+
+        auto b = get_buckets();
+        bool restart = false;
+
+        ret = lookup(b, hash, id, flags, inst, &restart);
+
+        /* Demuxing to a SO_REUSEPORT group. Connected lookups want an exact socket, and
+         * instance lookups want to see every socket.
+         */
+        if (ret && ret->reuse_port && inst == 0 &&
+            !(flags & (GET_SOCKET_DSTADDR_VALID | GET_SOCKET_NO_REUSEPORT)))
+            ret = select_reuseport(b, hash, ret, id, flags);
+
+        /* Sockets found during a rehash are still valid results. Misses aren't. */
+        if (!ret && (restart || seq.load(mem_order::acquire) != s))
+            continue;
+
+        /* The socket may be on its way out, with its destructor about to unhash it.
+         * Treat it as gone already.
+         */
+        if (ret && !(flags & GET_SOCKET_CHECK_EXISTENCE) && !ret->ref_not_zero())
+            ret = nullptr;
+
+        break;
+    }
+
+    rcu_read_unlock();
 
     return ret;
 }
@@ -64,10 +191,15 @@ bool socket_table::add_socket(inet_socket *sock, unsigned int flags)
     if (!unlocked)
         lock(hash);
 
-    socket_hashtable.add_element(sock, sock->bind_table_node.to_list_head());
+    auto b = get_buckets();
+    hlist_nulls_add_head(&sock->bind_table_node, &b->heads[hash & b->mask]);
+    nr_sockets.add_fetch(1, mem_order::relaxed);
 
     if (!unlocked)
+    {
         unlock(hash);
+        maybe_grow();
+    }
 
     return true;
 }
@@ -76,16 +208,113 @@ bool socket_table::remove_socket(inet_socket *sock, unsigned int flags)
 {
     bool unlocked = flags & REMOVE_SOCKET_UNLOCKED;
 
-    const socket_id id(sock->proto, sock->domain, sock->src_addr, sock->dest_addr);
     auto hash = inet_socket::make_hash(sock);
 
     if (!unlocked)
         lock(hash);
 
-    socket_hashtable.remove_element(sock, sock->bind_table_node.to_list_head());
+    if (!hlist_nulls_unhashed(&sock->bind_table_node))
+    {
+        hlist_nulls_del(&sock->bind_table_node);
+        nr_sockets.sub_fetch(1, mem_order::relaxed);
+    }
 
     if (!unlocked)
         unlock(hash);
 
     return true;
 }
+
+bool socket_table::bind_conflicts(const socket_id &id, unsigned int flags,
+                                  const inet_socket *sock)
+{
+    auto b = get_buckets();
+    auto hash = inet_socket::make_hash_from_id(id);
+    hlist_nulls_node *node;
+
+    hlist_nulls_for_every(node, &b->heads[hash & b->mask])
+    {
+        auto other = node_to_socket(node);
+        if (!other->is_id(id, flags))
+            continue;
+
+        if (sock->reuse_port && other->reuse_port &&
+            sock->reuse_port_uid == other->reuse_port_uid)
+            continue;
+
+        return true;
+    }
+
+    return false;
+}
+
+void socket_table::maybe_grow()
+{
+    if (!needs_grow() || sched_is_preemption_disabled())
+        return;
+
+    grow();
+}
+
+void socket_table::grow()
+{
+    scoped_mutex g{resize_lock};
+
+    if (!needs_grow())
+        return;
+
+    auto old = get_buckets();
+    const unsigned int nr_buckets = (old->mask + 1) * 2;
+
+    auto b = (socket_table_buckets *) malloc(sizeof(socket_table_buckets));
+    if (!b)
+        return;
+
+    b->heads = (hlist_nulls_head *) malloc(sizeof(hlist_nulls_head) * nr_buckets);
+    if (!b->heads)
+    {
+        free(b);
+        return;
+    }
+
+    b->mask = nr_buckets - 1;
+
+    for (unsigned int i = 0; i < nr_buckets; i++)
+        INIT_HLIST_NULLS_HEAD(&b->heads[i], i);
+
+    for (auto &l : lock_)
+        spin_lock(&l);
+
+    seq.add_fetch(1, mem_order::release);
+
+    for (unsigned int i = 0; i <= old->mask; i++)
+    {
+        auto head = &old->heads[i];
+
+        /* Always move the head of the chain, so every node only ever points to nodes
+         * that were moved before it, or that weren't moved yet. Readers can't loop.
+         */
+        while (!is_a_nulls(head->first))
+        {
+            auto sock = node_to_socket(head->first);
+            auto hash = inet_socket::make_hash(sock);
+            hlist_nulls_del(&sock->bind_table_node);
+            hlist_nulls_add_head(&sock->bind_table_node, &b->heads[hash & b->mask]);
+        }
+    }
+
+    __atomic_store_n(&buckets, b, __ATOMIC_RELEASE);
+    seq.add_fetch(1, mem_order::release);
+
+    for (auto &l : lock_)
+        spin_unlock(&l);
+
+    /* Lookups may still be walking the old buckets */
+    synchronize_rcu();
+
+    if (old != &initial)
+    {
+        free(old->heads);
+        free(old);
+    }
+}
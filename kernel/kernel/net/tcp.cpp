@@ -297,7 +297,7 @@ void tcp_socket::set_time_wait()
 
     // RFC793 says to remain in TIME_WAIT state for 2MSL seconds
     time_wait_timer->deadline = clocksource_get_time() + 2 * TCP_MSL * NS_PER_SEC;
-    time_wait_timer->flags = 0;
+    time_wait_timer->flags = CLOCKEVENT_FLAG_COARSE;
     time_wait_timer->priv = this;
     time_wait_timer->callback = [](clockevent *ev) {
         tcp_socket *sock = (tcp_socket *) ev->priv;
@@ -590,6 +590,8 @@ int tcp_socket::make_connection_from(const tcp_connection_req *req)
     {
         auto pbf = list_head_cpp<packetbuf>::self_from_list_head(l);
         list_remove(&pbf->list_node);
+        // This data was already acked, so it can't be dropped anymore
+        rx_charge(pbf->truesize, true);
         list_add_tail(&pbf->list_node, &rx_packet_list);
     }
 
@@ -737,6 +739,11 @@ int tcp_socket::do_established_rcv(const packet_handling_data &data)
         return 0;
     }
 
+    // Process the ACK first, whatever else the segment carries. Peers piggyback their acks on
+    // data, so this is what releases our acked segments (and their send buffer charge) in
+    // bidirectional traffic.
+    do_ack(data.buffer);
+
     /* ack_number holds the other side of the connection's sequence number */
     auto starting_seq_number = ntohl(data.header->sequence_number);
     auto data_off = TCP_GET_DATA_OFF(ntohs(data.header->data_offset_and_flags));
@@ -745,6 +752,14 @@ int tcp_socket::do_established_rcv(const packet_handling_data &data)
     if (flags & TCP_FLAG_FIN)
         seqs++;
 
+    if (data_size && !(flags & TCP_FLAG_FIN) && !(shutdown_state & SHUTDOWN_RD))
+    {
+        // Queue the data before acking anything. If the receive buffer is full, drop the
+        // segment without acking it; the other side retransmits it once we've made room.
+        if (!append_inet_rx_pbuf(data.buffer))
+            return 0;
+    }
+
     ack_number = starting_seq_number + seqs;
 
     // Send a reset if we got data and we're not queueing data anymore
@@ -761,24 +776,11 @@ int tcp_socket::do_established_rcv(const packet_handling_data &data)
         return 0;
     }
 
-    if (data_size || flags & TCP_FLAG_FIN)
+    if (data_size)
     {
-        // If this wasn't a FIN packet, it has data
-        // so append it to the receive buffers
-        if (!(flags & TCP_FLAG_FIN))
-        {
-            auto buf = data.buffer;
-            append_inet_rx_pbuf(buf);
-        }
-
-        // Now ack it
+        // The data was queued above, now ack it
         send_ack();
     }
-    else if (data_size == 0 && (flags & 0xff) == TCP_FLAG_ACK)
-    {
-        // Process the ACK
-        do_ack(data.buffer);
-    }
 
     return 0;
 }
@@ -1277,6 +1279,7 @@ void tcp_out_timeout(clockevent *ev)
             t->fail(t);
         scoped_lock g{t->sock->pending_out_lock};
         list_remove(&t->node);
+        t->release_tx_mem();
         return;
     }
 
@@ -1300,6 +1303,7 @@ void tcp_out_timeout(clockevent *ev)
             t->fail(t);
         scoped_lock g{t->sock->pending_out_lock};
         list_remove(&t->node);
+        t->release_tx_mem();
         return;
     }
 
@@ -1390,7 +1394,7 @@ expected<ref_guard<tcp_pending_out>, int> tcp_socket::sendpbuf(ref_guard<packetb
         pending->buf = buf;
         pending->timer.deadline = clocksource_get_time() + 200 * NS_PER_MS;
         pending->timer.priv = pending.get();
-        pending->timer.flags = CLOCKEVENT_FLAG_PULSE;
+        pending->timer.flags = CLOCKEVENT_FLAG_PULSE | CLOCKEVENT_FLAG_COARSE;
         pending->timer.callback = tcp_out_timeout;
         append_pending_out(pending.get());
     }
@@ -1436,7 +1440,7 @@ int tcp_connection_req::sendpbuf(ref_guard<packetbuf> buf, bool noack)
         pending->buf = buf;
         pending->timer.deadline = clocksource_get_time() + 200 * NS_PER_MS;
         pending->timer.priv = pending.get();
-        pending->timer.flags = CLOCKEVENT_FLAG_PULSE;
+        pending->timer.flags = CLOCKEVENT_FLAG_PULSE | CLOCKEVENT_FLAG_COARSE;
         pending->timer.callback = tcp_out_synack_timeout;
         syn_ack_pending = pending;
     }
@@ -1602,9 +1606,26 @@ int tcp_socket::connect(struct sockaddr *addr, socklen_t addrlen, int flags)
     return start_connection(flags);
 }
 
-ssize_t tcp_socket::queue_data(iovec *vec, int vlen, size_t len)
+ssize_t tcp_socket::queue_data(iovec *vec, int vlen, size_t len, zerocopy_ctl *zc)
 {
-    return pending_out.append_data(vec, vlen, 0, mss);
+    const auto old_truesize = pending_out.truesize();
+    ssize_t st;
+
+    if (zc && len >= ZEROCOPY_MIN_SEND_SIZE && can_zerocopy(route_cache.nif))
+        st = pending_out.append_zerocopy(vec, vlen, 0, mss, zc);
+    else
+    {
+        // Copy fallback, let userspace know through the completion
+        if (zc)
+            zc->copied = true;
+        st = pending_out.append_data(vec, vlen, 0, mss);
+    }
+
+    /* Charge whatever got queued, even on error. The send buffer is allowed to overshoot by
+     * one sendmsg's worth of data, since we only check for space before queueing.
+     */
+    tx_charge(pending_out.truesize() - old_truesize, true);
+    return st;
 }
 
 ssize_t tcp_socket::get_max_payload_len(uint16_t tcp_header_len)
@@ -1645,6 +1666,8 @@ int tcp_socket::send_segment(packetbuf *buf)
         if (ex.has_error())
             return ex.error();
 
+        ex.value()->tx_charged = buf->truesize;
+
         // Send went fine, decrement the window size
         window_size -= segment_len;
         return 0;
@@ -1704,6 +1727,9 @@ int tcp_socket::send_segment(packetbuf *buf)
     if (ex.has_error())
         return ex.error();
 
+    // The send buffer charge moves from the cork to the pending out
+    ex.value()->tx_charged = buf->truesize;
+
     // Send went fine, decrement the window size
     window_size -= segment_len;
     return 0;
@@ -1736,14 +1762,14 @@ int tcp_socket::try_to_send()
 
         // Pre-remove it, because if everything is successful
         // it'll get appended to another list
-        list_remove(&pbf->list_node);
+        pending_out.remove_packet(pbf);
 
         int st = send_segment(pbf);
 
         // Error, re-append
         if (st < 0)
         {
-            list_add_tail(&pbf->list_node, packet_list);
+            pending_out.append_packet(pbf);
             return sock_err;
         }
     }
@@ -1751,6 +1777,33 @@ int tcp_socket::try_to_send()
     return 0;
 }
 
+/**
+ * @brief Wait for room in the send buffer. Called with the socket lock held.
+ *
+ * @param flags MSG_* flags
+ * @return 0 on success, negative error codes
+ */
+int tcp_socket::wait_for_tx_space(int flags)
+{
+    if (tx_has_space())
+        return 0;
+
+    if (flags & MSG_DONTWAIT)
+        return -EWOULDBLOCK;
+
+    int st = wait_for_event_socklocked_interruptible(&send_wq,
+                                                     tx_has_space() || sock_err || !can_send());
+    if (st < 0)
+        return st;
+
+    CONSUME_SOCK_ERR;
+
+    if (!can_send())
+        return -EPIPE;
+
+    return 0;
+}
+
 ssize_t tcp_socket::sendmsg(const msghdr *msg, int flags)
 {
     if (msg->msg_name)
@@ -1768,7 +1821,16 @@ ssize_t tcp_socket::sendmsg(const msghdr *msg, int flags)
     if (len < 0)
         return len;
 
-    auto st = queue_data(msg->msg_iov, msg->msg_iovlen, (size_t) len);
+    if (int st = wait_for_tx_space(flags); st < 0)
+        return st;
+
+    auto zc = zerocopy_begin(flags);
+    if (zc.has_error())
+        return zc.error();
+
+    auto st = queue_data(msg->msg_iov, msg->msg_iovlen, (size_t) len, zc.value());
+    zerocopy_end(zc.value(), st >= 0);
+
     if (st < 0)
     {
         return st;
@@ -1782,6 +1844,45 @@ ssize_t tcp_socket::sendmsg(const msghdr *msg, int flags)
     return len;
 }
 
+ssize_t tcp_socket::sendpage(struct page *page, unsigned int off, size_t len, int flags)
+{
+    scoped_hybrid_lock g{socket_lock, this};
+
+    if (!can_send())
+        return -ENOTCONN;
+
+    CONSUME_SOCK_ERR;
+
+    if (int st = wait_for_tx_space(flags); st < 0)
+        return st;
+
+    ssize_t st;
+
+    if (can_zerocopy(route_cache.nif))
+    {
+        /* Hand the page itself to the packets, they hold a reference until they're ACKed */
+        const auto old_truesize = pending_out.truesize();
+        page_iov v{page, (unsigned int) len, off};
+        st = pending_out.append_pages(&v, 1, 0, mss);
+        tx_charge(pending_out.truesize() - old_truesize, true);
+    }
+    else
+    {
+        // No checksum offload, we need to copy (and checksum) the data anyway
+        iovec vec{(char *) PAGE_TO_VIRT(page) + off, len};
+        auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+        st = queue_data(&vec, 1, len, nullptr);
+    }
+
+    if (st < 0)
+        return st;
+
+    if (int _st = try_to_send(); _st < 0)
+        return _st;
+
+    return len;
+}
+
 void tcp_socket::append_pending_out(tcp_pending_out *pckt)
 {
     list_add_tail(&pckt->node, &pending_out_packets);
@@ -1968,6 +2069,8 @@ int tcp_socket::send_fin()
     tph->checksum =
         call_based_on_inet(tcp_calculate_checksum, tph, static_cast<uint16_t>(sizeof(tcp_header)),
                            route.src_addr, route.dst_addr, need_csum);
+    // Everything on the cork is charged to the send buffer
+    tx_charge(pbuf->truesize, true);
     pending_out.append_packet(pbuf.release());
 
     // Note: Since we're shutting down the socket, there's no need to be careful wrt
@@ -2043,10 +2146,7 @@ ssize_t tcp_socket::recvmsg(msghdr *msg, int flags)
     {
         // FIN packet! Let's return EOF and, if !MSG_PEEK, discard it.
         if (!(flags & MSG_PEEK))
-        {
-            list_remove(&buf->list_node);
-            buf->unref();
-        }
+            dequeue_inet_rx_pbuf(buf);
 
         return 0;
     }
@@ -2073,10 +2173,7 @@ ssize_t tcp_socket::recvmsg(msghdr *msg, int flags)
     if (!(flags & MSG_PEEK))
     {
         if (buf->length() == 0)
-        {
-            list_remove(&buf->list_node);
-            buf->unref();
-        }
+            dequeue_inet_rx_pbuf(buf);
     }
 
 #if 0
@@ -2134,7 +2231,12 @@ short tcp_socket::poll(void *poll_file, short events)
     if (events & POLLOUT)
     {
         if (!(shutdown_state & SHUTDOWN_WR))
-            avail_events |= POLLOUT;
+        {
+            if (tx_has_space())
+                avail_events |= POLLOUT;
+            else
+                poll_wait_helper(poll_file, &send_wq);
+        }
     }
 
     if (events & POLLIN)
@@ -2147,7 +2249,8 @@ short tcp_socket::poll(void *poll_file, short events)
 
     // printk("avail events: %u\n", avail_events);
 
-    return avail_events & events;
+    /* POLLERR is always reported */
+    return (avail_events & events) | poll_errqueue(poll_file);
 }
 
 int tcp_socket::getsockname(sockaddr *addr, socklen_t *len)
@@ -2200,7 +2303,9 @@ tcp_socket::~tcp_socket()
         pkt->unref();
     }
 
-    // the inet cork should clear itself out in the destructor
+    // the inet cork should clear itself out in the destructor, but its memory needs to be
+    // uncharged
+    tx_uncharge(pending_out.truesize());
 
     // unbinding should be done in inet_socket's destructor
 }
@@ -200,6 +200,128 @@ int udp_put_data(packetbuf *buf, const msghdr *msg, size_t length)
     return 0;
 }
 
+/**
+ * @brief Walks a msghdr's iovecs, for copies that span several packets.
+ */
+struct udp_iov_cursor
+{
+    const iovec *vec;
+    int nr_vecs;
+    size_t off{0};
+
+    udp_iov_cursor(const iovec *vec, int nr_vecs) : vec{vec}, nr_vecs{nr_vecs}
+    {
+    }
+
+    /**
+     * @brief Copy data to or from the iovecs, and advance the cursor.
+     *
+     * @param kbuf Kernel buffer
+     * @param len Length to copy
+     * @param to_user True if copying to the iovecs, false if copying from them
+     * @return 0 on success, -EFAULT
+     */
+    int copy(unsigned char *kbuf, size_t len, bool to_user)
+    {
+        while (len && nr_vecs)
+        {
+            const size_t chunk = min(vec->iov_len - off, len);
+            void *ubuf = (unsigned char *) vec->iov_base + off;
+
+            if ((to_user ? copy_to_user(ubuf, kbuf, chunk) : copy_from_user(kbuf, ubuf, chunk)) <
+                0)
+                return -EFAULT;
+
+            kbuf += chunk;
+            len -= chunk;
+            off += chunk;
+
+            if (off == vec->iov_len)
+            {
+                vec++;
+                nr_vecs--;
+                off = 0;
+            }
+        }
+
+        return 0;
+    }
+};
+
+/**
+ * @brief Parse SOL_UDP control messages passed to sendmsg.
+ *
+ * @param msg Message header (with kernel pointers)
+ * @param gso_size Segment size, overwritten by UDP_SEGMENT
+ * @return 0 on success, negative error codes
+ */
+static int udp_parse_cmsg(const msghdr *msg, uint16_t &gso_size)
+{
+    if (!msg->msg_control)
+        return 0;
+
+    unsigned char *ptr = (unsigned char *) msg->msg_control;
+    unsigned char *end = ptr + msg->msg_controllen;
+
+    for (; ptr + sizeof(cmsghdr) <= end; ptr += CMSG_ALIGN(((cmsghdr *) ptr)->cmsg_len))
+    {
+        auto cmsg = (cmsghdr *) ptr;
+        if (cmsg->cmsg_len < sizeof(cmsghdr) || cmsg->cmsg_len > (size_t) (end - ptr))
+            return -EINVAL;
+
+        if (cmsg->cmsg_level != SOL_UDP)
+            continue;
+
+        switch (cmsg->cmsg_type)
+        {
+            case UDP_SEGMENT:
+                if (cmsg->cmsg_len != CMSG_LEN(sizeof(uint16_t)))
+                    return -EINVAL;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(uint16_t));
+                break;
+            default:
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Attach the user's data to the packetbuf without copying (MSG_ZEROCOPY).
+ *
+ * @param buf Packetbuf
+ * @param msg Message header
+ * @param zc The send's zerocopy_ctl
+ * @return 0 on success, negative error codes
+ */
+static int udp_zerocopy_data(packetbuf *buf, const msghdr *msg, zerocopy_ctl *zc)
+{
+    for (int i = 0; i < msg->msg_iovlen; i++)
+    {
+        const auto &vec = msg->msg_iov[i];
+        size_t attached = 0;
+
+        while (attached < vec.iov_len)
+        {
+            auto st =
+                buf->zerocopy_from_user((const uint8_t *) vec.iov_base + attached,
+                                        (unsigned int) (vec.iov_len - attached));
+            if (st < 0)
+                return st;
+
+            /* Ran out of page vectors, the iovec is too fragmented */
+            if (st == 0)
+                return -EMSGSIZE;
+
+            attached += st;
+        }
+    }
+
+    buf->attach_zerocopy(zc);
+    return 0;
+}
+
 template <int domain>
 void udp_do_csum(packetbuf *buf, const inet_route &route)
 {
@@ -239,8 +361,60 @@ int udp_do_send(packetbuf *buf, const inet_route &route)
     return ret;
 }
 
+/**
+ * @brief Send a UDP_SEGMENT send, as a train of gso_size datagrams (the last one may be shorter).
+ * The route lookup, msghdr copy and checks are done once for the whole train, and the data is
+ * copied straight from the user's iovecs into each datagram.
+ *
+ * @param msg Message header
+ * @param len Length of the payload
+ * @param gso_size Segment size
+ * @param sport Source port
+ * @param dport Destination port
+ * @param route Route
+ * @return 0 on success, negative error codes
+ */
+template <int domain>
+static int udp_send_segments(const msghdr *msg, size_t len, uint16_t gso_size, in_port_t sport,
+                             in_port_t dport, const inet_route &route)
+{
+    if (gso_size + sizeof(udphdr) + inet_header_size(domain) > route.nif->mtu)
+        return -EINVAL;
+
+    if ((len + gso_size - 1) / gso_size > UDP_MAX_SEGMENTS)
+        return -EINVAL;
+
+    udp_iov_cursor cursor{msg->msg_iov, msg->msg_iovlen};
+
+    while (len)
+    {
+        const size_t seg = min(len, (size_t) gso_size);
+
+        auto pbf_st = udp_create_pbuf(seg, inet_header_size(domain));
+        if (pbf_st.has_error())
+            return pbf_st.error();
+
+        auto buf = pbf_st.value();
+
+        udp_prepare_headers(buf.get(), sport, dport, seg);
+
+        if (cursor.copy((unsigned char *) buf->put((unsigned int) seg), seg, false) < 0)
+            return -EFAULT;
+
+        udp_do_csum<domain>(buf.get(), route);
+
+        if (int st = udp_do_send<domain>(buf.get(), route); st < 0)
+            return st;
+
+        len -= seg;
+    }
+
+    return 0;
+}
+
 template <typename AddrType>
-ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst)
+ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_address &dst,
+                                bool locked)
 {
     bool wanting_cork = wants_cork || flags & MSG_MORE;
     bool will_append = false;
@@ -252,6 +426,10 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
     if (payload_size > UINT16_MAX)
         return -EMSGSIZE;
 
+    uint16_t segment_size = gso_size;
+    if (int st = udp_parse_cmsg(msg, segment_size); st < 0)
+        return st;
+
     inet_route route;
 
     constexpr auto our_domain = inet_domain_type_v<AddrType>;
@@ -262,7 +440,7 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
 
     if (cork_pending)
     {
-        scoped_hybrid_lock g{socket_lock, this};
+        scoped_hybrid_lock g{socket_lock, this, locked};
 
         if (cork_pending)
         {
@@ -304,37 +482,83 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
     /* If we're not corking, do the fast path. This path doesn't require locks since it's a simple
      * datagram.
      */
+    auto zc_st = zerocopy_begin(flags);
+    if (zc_st.has_error())
+        return zc_st.error();
+
+    auto zc = zc_st.value();
+
+    if (!will_append && segment_size && (size_t) payload_size > segment_size)
+    {
+        /* Segmented sends are always copied */
+        if (zc)
+            zc->copied = true;
+
+        int st = udp_send_segments<our_domain>(msg, payload_size, segment_size, src_addr.port,
+                                               dst.port, route);
+        zerocopy_end(zc, st >= 0);
+
+        return st < 0 ? st : payload_size;
+    }
+
     if (!will_append) [[likely]]
     {
-        auto pbf_st = udp_create_pbuf(payload_size, inet_header_size(our_domain));
+        /* Zero-copy packets can't be fragmented or checksummed in software */
+        const bool use_zc =
+            zc && payload_size >= ZEROCOPY_MIN_SEND_SIZE && can_zerocopy(route.nif) &&
+            !(route.flags & (INET4_ROUTE_FLAG_BROADCAST | INET4_ROUTE_FLAG_MULTICAST)) &&
+            route.nif->mtu >= payload_size + sizeof(udphdr) + inet_header_size(our_domain);
+
+        if (zc && !use_zc)
+            zc->copied = true;
+
+        auto pbf_st = udp_create_pbuf(use_zc ? 0 : payload_size, inet_header_size(our_domain));
 
         if (pbf_st.has_error())
+        {
+            zerocopy_end(zc, false);
             return pbf_st.error();
+        }
 
         auto buf = pbf_st.value();
 
         udp_prepare_headers(buf.get(), src_addr.port, dst.port, payload_size);
 
-        if (udp_put_data(buf.get(), msg, payload_size) < 0)
-            return -EFAULT;
+        int st = use_zc ? udp_zerocopy_data(buf.get(), msg, zc)
+                        : udp_put_data(buf.get(), msg, payload_size);
+        if (st < 0)
+        {
+            zerocopy_end(zc, false);
+            return st;
+        }
 
         udp_do_csum<our_domain>(buf.get(), route);
 
-        if (int st = udp_do_send<our_domain>(buf.get(), route); st < 0)
+        st = udp_do_send<our_domain>(buf.get(), route);
+        zerocopy_end(zc, st >= 0);
+
+        if (st < 0)
             return st;
 
         return payload_size;
     }
 
-    scoped_hybrid_lock g{socket_lock, this};
+    scoped_hybrid_lock g{socket_lock, this, locked};
 
     cork_pending = our_domain;
 
     /* Woohoo, corking path! */
-    if (int st = cork.append_data(msg->msg_iov, msg->msg_iovlen, sizeof(udphdr), 0xffff); st < 0)
-    {
+    const auto old_truesize = cork.truesize();
+    int st = cork.append_data(msg->msg_iov, msg->msg_iovlen, sizeof(udphdr), 0xffff);
+    tx_charge(cork.truesize() - old_truesize, true);
+
+    /* Corked data always gets copied */
+    if (zc)
+        zc->copied = true;
+    zerocopy_end(zc, st >= 0);
+
+    if (st < 0)
         return st;
-    }
 
 #if DEBUG_UDP_CORK
     printk("appending %lu, total len %u\n", msg->msg_iov[0].iov_len,
@@ -345,19 +569,30 @@ ssize_t udp_socket::udp_sendmsg(const msghdr *msg, int flags, const inet_sock_ad
     if (!wanting_cork)
     {
         iflow fl{route, src_addr, dst, IPPROTO_UDP};
-        int st = cork.send(fl, [](packetbuf *buf, const iflow &flow) {
+        const auto charged = cork.truesize();
+        st = cork.send(fl, [](packetbuf *buf, const iflow &flow) {
             udp_prepare_headers(buf, flow.saddr.port, flow.daddr.port, buf->length());
 
             udp_do_csum<our_domain>(buf, flow.route);
         });
 
+        tx_uncharge(charged - cork.truesize());
+
         return st < 0 ? st : payload_size;
     }
 
     return payload_size;
 }
 
-ssize_t udp_socket::sendmsg(const msghdr *msg, int flags)
+/**
+ * @brief Send a message
+ *
+ * @param msg Message, with kernel pointers
+ * @param flags Flags
+ * @param locked True if the caller holds the socket lock
+ * @return Length sent, or a negative error code
+ */
+ssize_t udp_socket::do_sendmsg(const msghdr *msg, int flags, bool locked)
 {
     sockaddr *addr = (sockaddr *) msg->msg_name;
     if (addr && !validate_sockaddr_len_pair(addr, msg->msg_namelen))
@@ -377,9 +612,26 @@ ssize_t udp_socket::sendmsg(const msghdr *msg, int flags)
     }
 
     if (our_domain == AF_INET)
-        return udp_sendmsg<in_addr>(msg, flags, dest);
+        return udp_sendmsg<in_addr>(msg, flags, dest, locked);
     else
-        return udp_sendmsg<in6_addr>(msg, flags, dest);
+        return udp_sendmsg<in6_addr>(msg, flags, dest, locked);
+}
+
+ssize_t udp_socket::sendmsg(const msghdr *msg, int flags)
+{
+    return do_sendmsg(msg, flags, false);
+}
+
+int udp_socket::sendmmsg(mmsghdr *umsgvec, unsigned int vlen, int flags)
+{
+    /* Take the socket lock once for the whole batch, instead of for every corked message. Packets
+     * that arrive in the meantime go to the backlog, and get queued when we unlock.
+     */
+    scoped_hybrid_lock hlock{socket_lock, this};
+    return socket_do_sendmmsg(this, umsgvec, vlen, flags,
+                              [](socket *sock, const msghdr *msg, int fl) -> ssize_t {
+                                  return static_cast<udp_socket *>(sock)->do_sendmsg(msg, fl, true);
+                              });
 }
 
 socket *udp_create_socket(int type)
@@ -432,7 +684,8 @@ int udp_handle_packet_mcast_bcast(const inet_route &route, packetbuf *buf)
     {
         auto socket = inet_resolve_socket<udp_socket>(header->source_ip, udp_header->source_port,
                                                       udp_header->dest_port, IPPROTO_UDP, route.nif,
-                                                      true, &udp_proto, instance++);
+                                                      true, &udp_proto, instance++,
+                                                      GET_SOCKET_NO_REUSEPORT);
         if (!socket)
             break;
 
@@ -568,23 +821,73 @@ expected<packetbuf *, int> udp_socket::get_datagram(int flags)
     return buf;
 }
 
-ssize_t udp_socket::recvmsg(msghdr *msg, int flags)
+/**
+ * @brief Check if two received datagrams belong to the same flow, and may be coalesced.
+ *
+ * @param a First datagram
+ * @param b Second datagram
+ * @return True if they came from the same address and port
+ */
+static bool udp_same_flow(const packetbuf *a, const packetbuf *b)
+{
+    if (a->domain != b->domain)
+        return false;
+
+    auto ha = (const udphdr *) a->transport_header;
+    auto hb = (const udphdr *) b->transport_header;
+    if (ha->source_port != hb->source_port)
+        return false;
+
+    if (a->domain == AF_INET6)
+    {
+        return !memcmp(&((const ip6hdr *) a->net_header)->src_addr,
+                       &((const ip6hdr *) b->net_header)->src_addr, sizeof(in6_addr));
+    }
+
+    return ((const ip_header *) a->net_header)->source_ip ==
+           ((const ip_header *) b->net_header)->source_ip;
+}
+
+/**
+ * @brief Find the next datagram in the receive queue that UDP_GRO can coalesce into this read.
+ *
+ * @param first First datagram of the read
+ * @param prev Last datagram that got coalesced
+ * @param room Space left in the user's buffer
+ * @return The datagram, or nullptr if coalescing should stop
+ */
+packetbuf *udp_socket::next_gro_dgram(packetbuf *first, packetbuf *prev, size_t room)
+{
+    /* A short segment ends a train, like it does on the sending side */
+    if (prev->length() < first->length())
+        return nullptr;
+
+    if (prev->list_node.next == &rx_packet_list)
+        return nullptr;
+
+    auto next = list_head_cpp<packetbuf>::self_from_list_head(prev->list_node.next);
+    if (next->length() > first->length() || next->length() > room || !udp_same_flow(first, next))
+        return nullptr;
+
+    return next;
+}
+
+ssize_t udp_socket::recvmsg_locked(msghdr *msg, int flags)
 {
     auto iovlen = iovec_count_length(msg->msg_iov, msg->msg_iovlen);
     if (iovlen < 0)
         return iovlen;
 
-    scoped_hybrid_lock hlock{socket_lock, this};
-
     auto st = get_datagram(flags);
     if (st.has_error())
         return st.error();
 
     auto buf = st.value();
     ssize_t read = min(iovlen, (long) buf->length());
-    ssize_t was_read = 0;
     ssize_t to_ret = read;
 
+    msg->msg_flags = 0;
+
     if (iovlen < buf->length())
         msg->msg_flags = MSG_TRUNC;
 
@@ -593,44 +896,94 @@ ssize_t udp_socket::recvmsg(msghdr *msg, int flags)
         to_ret = buf->length();
     }
 
-    const unsigned char *ptr = buf->data;
-
     if (msg->msg_name)
     {
         auto hdr = (udphdr *) buf->transport_header;
         ip::copy_msgname_to_user(msg, buf, domain == AF_INET6, hdr->source_port);
     }
 
-    for (int i = 0; i < msg->msg_iovlen; i++)
+    udp_iov_cursor cursor{msg->msg_iov, msg->msg_iovlen};
+    if (cursor.copy(buf->data, read, true) < 0)
+        return -EFAULT;
+
+    msg->msg_controllen = 0;
+
+    if (flags & MSG_PEEK)
+        return to_ret;
+
+    int segments = 1;
+    const unsigned int segment_size = buf->length();
+
+    if (wants_gro && !(msg->msg_flags & MSG_TRUNC))
     {
-        auto iov = msg->msg_iov[i];
-        auto to_copy = min((ssize_t) iov.iov_len, read - was_read);
-        if (copy_to_user(iov.iov_base, ptr, to_copy) < 0)
+        /* Coalesce the following datagrams of the same flow into this read, so the
+         * application gets a whole train of segments with a single syscall.
+         */
+        packetbuf *prev = buf;
+        size_t room = min((size_t) iovlen, (size_t) UINT16_MAX) - read;
+
+        while (auto next = next_gro_dgram(buf, prev, room))
         {
-            return -EFAULT;
-        }
+            if (cursor.copy(next->data, next->length(), true) < 0)
+                break;
+
+            read += next->length();
+            room -= next->length();
+            segments++;
 
-        was_read += to_copy;
+            if (prev != buf)
+                dequeue_inet_rx_pbuf(prev);
+            prev = next;
+        }
 
-        ptr += to_copy;
+        if (prev != buf)
+            dequeue_inet_rx_pbuf(prev);
+        to_ret = read;
     }
 
-    msg->msg_controllen = 0;
+    dequeue_inet_rx_pbuf(buf);
 
-    if (!(flags & MSG_PEEK))
+    if (segments > 1)
     {
-        list_remove(&buf->list_node);
-        buf->unref();
+        /* Tell the application where the segment boundaries were */
+        if (msg->msg_control && msg->msg_controllen >= CMSG_LEN(sizeof(int)))
+        {
+            cmsghdr *cmsg = (cmsghdr *) msg->msg_control;
+            int gso = (int) segment_size;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_GRO;
+            memcpy(CMSG_DATA(cmsg), &gso, sizeof(int));
+            msg->msg_controllen = cmsg->cmsg_len;
+        }
+        else
+            msg->msg_flags |= MSG_CTRUNC;
     }
 
-#if 0
-	printk("recv success %ld bytes\n", read);
-	printk("iovlen %ld\n", iovlen);
-#endif
-
     return to_ret;
 }
 
+ssize_t udp_socket::recvmsg(msghdr *msg, int flags)
+{
+    scoped_hybrid_lock hlock{socket_lock, this};
+    return recvmsg_locked(msg, flags);
+}
+
+int udp_socket::recvmmsg(mmsghdr *umsgvec, unsigned int vlen, int flags, const hrtime_t *deadline)
+{
+    if (flags & MSG_ERRQUEUE)
+        return socket::recvmmsg(umsgvec, vlen, flags, deadline);
+
+    /* Take the socket lock once for the whole batch. Packets that arrive in the meantime go to
+     * the backlog, and get queued when we unlock.
+     */
+    scoped_hybrid_lock hlock{socket_lock, this};
+    return socket_do_recvmmsg(this, umsgvec, vlen, flags, deadline,
+                              [](socket *sock, msghdr *msg, int fl) -> ssize_t {
+                                  return static_cast<udp_socket *>(sock)->recvmsg_locked(msg, fl);
+                              });
+}
+
 int udp_socket::getsockopt(int level, int optname, void *val, socklen_t *len)
 {
     if (is_inet_level(level))
@@ -645,6 +998,14 @@ int udp_socket::getsockopt(int level, int optname, void *val, socklen_t *len)
             case UDP_CORK: {
                 return put_option(truthy_to_int(wants_cork), val, len);
             }
+
+            case UDP_SEGMENT: {
+                return put_option((int) gso_size, val, len);
+            }
+
+            case UDP_GRO: {
+                return put_option(truthy_to_int(wants_gro), val, len);
+            }
         }
     }
 
@@ -670,6 +1031,27 @@ int udp_socket::setsockopt(int level, int optname, const void *val, socklen_t le
                 wants_cork = int_to_truthy(res.value());
                 return 0;
             }
+
+            case UDP_SEGMENT: {
+                auto res = get_socket_option<int>(val, len);
+                if (res.has_error())
+                    return res.error();
+
+                if (res.value() < 0 || res.value() > UINT16_MAX)
+                    return -EINVAL;
+
+                gso_size = res.value();
+                return 0;
+            }
+
+            case UDP_GRO: {
+                auto res = get_socket_option<int>(val, len);
+                if (res.has_error())
+                    return res.error();
+
+                wants_gro = int_to_truthy(res.value());
+                return 0;
+            }
         }
     }
 
@@ -692,7 +1074,8 @@ short udp_socket::poll(void *poll_file, short events)
 
     // printk("avail events: %u\n", avail_events);
 
-    return avail_events & events;
+    /* POLLERR is always reported */
+    return (avail_events & events) | poll_errqueue(poll_file);
 }
 
 int udp_socket::getsockname(sockaddr *addr, socklen_t *len)
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <onyx/assert.h>
+#include <onyx/net/zerocopy.h>
+
+#include <onyx/mm/pool.hpp>
+
+/* Completions happen wherever the last packetbuf gets freed, which may be in IRQ context */
+static memory_pool<zerocopy_ctl, MEMORY_POOL_USABLE_ON_IRQ> zerocopy_ctl_pool;
+static memory_pool<sock_zerocopy, MEMORY_POOL_USABLE_ON_IRQ> sock_zerocopy_pool;
+
+void *zerocopy_ctl::operator new(size_t length)
+{
+    return zerocopy_ctl_pool.allocate();
+}
+
+void zerocopy_ctl::operator delete(void *ptr)
+{
+    zerocopy_ctl_pool.free(reinterpret_cast<zerocopy_ctl *>(ptr));
+}
+
+void *sock_zerocopy::operator new(size_t length)
+{
+    return sock_zerocopy_pool.allocate();
+}
+
+void sock_zerocopy::operator delete(void *ptr)
+{
+    sock_zerocopy_pool.free(reinterpret_cast<sock_zerocopy *>(ptr));
+}
+
+void zerocopy_ctl::put()
+{
+    if (refs.sub_fetch(1, mem_order::release) != 0)
+        return;
+
+    auto zc = owner;
+    zc->complete(this);
+    /* Drop the ctl's reference to the socket's zerocopy state */
+    zc->unref();
+}
+
+sock_zerocopy::~sock_zerocopy()
+{
+    list_for_every_safe (&completed)
+    {
+        auto ctl = container_of(l, zerocopy_ctl, list_node);
+        list_remove(&ctl->list_node);
+        delete ctl;
+    }
+}
+
+zerocopy_ctl *sock_zerocopy::begin_send()
+{
+    auto ctl = new zerocopy_ctl{this, 0};
+    if (!ctl)
+        return nullptr;
+
+    ctl->lo = ctl->hi = next_id.fetch_add(1, mem_order::relaxed);
+    ref();
+    return ctl;
+}
+
+void sock_zerocopy::abort_send(zerocopy_ctl *ctl)
+{
+    DCHECK(ctl->refs.load() == 1);
+
+    uint32_t expected = ctl->lo + 1;
+    next_id.compare_exchange_strong(expected, ctl->lo, mem_order::relaxed, mem_order::relaxed);
+
+    delete ctl;
+    unref();
+}
+
+void sock_zerocopy::complete(zerocopy_ctl *ctl)
+{
+    unsigned long flags = spin_lock_irqsave(&lock);
+
+    if (!list_is_empty(&completed))
+    {
+        auto tail = container_of(list_last_element(&completed), zerocopy_ctl, list_node);
+
+        /* Merge consecutive sends, like linux does. This keeps the error queue short when
+         * sends complete in order, which is the usual case.
+         */
+        if (tail->hi + 1 == ctl->lo && tail->copied == ctl->copied)
+        {
+            tail->hi = ctl->hi;
+            spin_unlock_irqrestore(&lock, flags);
+            delete ctl;
+            wait_queue_wake_all(&wq);
+            return;
+        }
+    }
+
+    list_add_tail(&ctl->list_node, &completed);
+    spin_unlock_irqrestore(&lock, flags);
+    wait_queue_wake_all(&wq);
+}
+
+bool sock_zerocopy::peek(sock_extended_err &err)
+{
+    unsigned long flags = spin_lock_irqsave(&lock);
+
+    if (list_is_empty(&completed))
+    {
+        spin_unlock_irqrestore(&lock, flags);
+        return false;
+    }
+
+    auto ctl = container_of(list_first_element(&completed), zerocopy_ctl, list_node);
+
+    err = {};
+    err.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+    err.ee_code = ctl->copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+    err.ee_info = ctl->lo;
+    err.ee_data = ctl->hi;
+
+    spin_unlock_irqrestore(&lock, flags);
+    return true;
+}
+
+void sock_zerocopy::consume(const sock_extended_err &err)
+{
+    unsigned long flags = spin_lock_irqsave(&lock);
+
+    /* Ids are unique, so lo tells us which completion this was, even if someone else got to it
+     * first (in which case it's gone, and there's nothing to do).
+     */
+    list_for_every_safe (&completed)
+    {
+        auto ctl = container_of(l, zerocopy_ctl, list_node);
+
+        if (ctl->lo != err.ee_info)
+            continue;
+
+        if (ctl->hi != err.ee_data)
+        {
+            /* More sends got merged into it after the peek, those weren't reported yet */
+            ctl->lo = err.ee_data + 1;
+            break;
+        }
+
+        list_remove(&ctl->list_node);
+        spin_unlock_irqrestore(&lock, flags);
+        delete ctl;
+        return;
+    }
+
+    spin_unlock_irqrestore(&lock, flags);
+}
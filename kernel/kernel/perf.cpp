@@ -7,11 +7,16 @@
  */
 
 #include <onyx/cpu.h>
+#include <onyx/cred.h>
 #include <onyx/dev.h>
 #include <onyx/init.h>
+#include <onyx/kunit.h>
 #include <onyx/percpu.h>
 #include <onyx/perf_probe.h>
+#include <onyx/pid.h>
+#include <onyx/process.h>
 #include <onyx/timer.h>
+#include <onyx/vm.h>
 
 #ifdef __x86_64__
 #include <onyx/x86/apic.h>
@@ -31,6 +36,80 @@ bool perf_probe_wait_enabled = false;
 struct flame_graph_pcpu *fg;
 clockevent *ce;
 
+/* Which threads get sampled, set with PERF_PROBE_SET_FILTER */
+static struct perf_probe_filter filter;
+/* The filtered process group's pid, so the sampling code only has to compare pointers */
+static pid::auto_pid filter_pgrp;
+static hrtime_t perf_probe_period = NS_PER_SEC / PERF_PROBE_DEFAULT_FREQ;
+
+/**
+ * @brief Check if a thread should be sampled
+ *
+ * @param thread Thread
+ * @return True if so, else false
+ */
+static bool perf_probe_wants(struct thread *thread)
+{
+    if (!filter.pid && !filter.pgid)
+        return true;
+
+    /* Filtering by process leaves kernel threads out */
+    struct process *p = thread ? thread->owner : nullptr;
+    if (!p)
+        return false;
+
+    if (filter.pid && p->get_pid() != filter.pid)
+        return false;
+
+    return !filter.pgid || p->process_group.get() == filter_pgrp.get();
+}
+
+/**
+ * @brief Fill in who a sample belongs to
+ *
+ * @param e Sample
+ * @param thread Thread
+ */
+static void perf_probe_fill_ids(struct flame_graph_entry *e, struct thread *thread)
+{
+    e->pid = thread && thread->owner ? thread->owner->get_pid() : 0;
+    e->tid = thread ? thread->id : 0;
+}
+
+/**
+ * @brief Walk a user stack through its frame pointers. We may be in irq context, so the stack
+ * is read without faulting, and the walk stops at the first frame that isn't mapped in.
+ *
+ * @param ip Instruction pointer
+ * @param fp Frame pointer
+ * @param pcs Array of FLAME_GRAPH_USER_FRAMES return addresses (0 terminated)
+ */
+static void perf_probe_user_stack(unsigned long ip, unsigned long fp, unsigned long *pcs)
+{
+    size_t i = 0;
+    pcs[i++] = ip;
+
+    while (i < FLAME_GRAPH_USER_FRAMES - 1 && fp && !(fp & (sizeof(unsigned long) - 1)))
+    {
+        /* Saved frame pointer, then the return address */
+        unsigned long frame[2];
+        if (copy_from_user_nofault(frame, (const void *) fp, sizeof(frame)) < 0)
+            break;
+
+        if (!frame[1])
+            break;
+
+        pcs[i++] = frame[1];
+
+        /* Frames go up the stack, anything else is garbage (or a loop) */
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+
+    pcs[i] = 0;
+}
+
 /**
  * @brief Enable wait perf probing
  *
@@ -115,9 +194,9 @@ static int perf_probe_enable()
 #ifdef __x86_64__
         apic_send_ipi_all(0, X86_PERFPROBE);
 #endif
-        ev_->deadline = clocksource_get_time() + NS_PER_MS;
+        ev_->deadline = clocksource_get_time() + perf_probe_period;
     };
-    ev->deadline = clocksource_get_time() + 1 * NS_PER_MS;
+    ev->deadline = clocksource_get_time() + perf_probe_period;
     ev->flags = CLOCKEVENT_FLAG_ATOMIC | CLOCKEVENT_FLAG_PULSE;
     timer_queue_clockevent(ev);
 
@@ -257,6 +336,138 @@ static unsigned int perf_probe_ioctl_enable_disable_wait(void *argp)
     return st;
 }
 
+static int perf_probe_set_filter(void *argp)
+{
+    struct perf_probe_filter f;
+    if (copy_from_user(&f, argp, sizeof(f)) < 0)
+        return -EFAULT;
+
+    if (f.freq > PERF_PROBE_MAX_FREQ || f.pid < 0 || f.pgid < 0 || f.flags)
+        return -EINVAL;
+
+    pid::auto_pid pgrp;
+    if (f.pgid)
+    {
+        pgrp = pid::lookup(f.pgid);
+        if (!pgrp)
+            return -ESRCH;
+    }
+
+    perf_lock.lock_write();
+
+    /* Don't change what's being sampled under the sampling code's feet */
+    if (perf_probe_enabled || perf_probe_wait_enabled)
+        return perf_lock.unlock_write(), -EBUSY;
+
+    filter = f;
+    filter_pgrp = cul::move(pgrp);
+    perf_probe_period = NS_PER_SEC / (f.freq ?: PERF_PROBE_DEFAULT_FREQ);
+
+    perf_lock.unlock_write();
+
+    return 0;
+}
+
+/**
+ * @brief Software event counter, attached to an open perf-probe file
+ */
+struct perf_counter
+{
+    struct thread *thread;
+    unsigned int event;
+    unsigned long base;
+};
+
+static unsigned long perf_counter_value(const struct perf_counter *c)
+{
+    return __atomic_load_n(&c->thread->sw_counters[c->event], __ATOMIC_RELAXED);
+}
+
+static int perf_probe_attach_counter(void *argp, struct file *file)
+{
+    struct perf_counter_attr attr;
+    if (copy_from_user(&attr, argp, sizeof(attr)) < 0)
+        return -EFAULT;
+
+    if (attr.event >= PERF_COUNT_SW_MAX || attr.tid < 0)
+        return -EINVAL;
+
+    struct thread *t = get_current_thread();
+    if (attr.tid)
+        t = thread_get_from_tid(attr.tid);
+    else
+        thread_get(t);
+
+    if (!t)
+        return -ESRCH;
+
+    /* Only root gets to look at other processes' threads */
+    if (t->owner != get_current_process() && !is_root_user())
+    {
+        thread_put(t);
+        return -EPERM;
+    }
+
+    struct perf_counter *c = (struct perf_counter *) malloc(sizeof(*c));
+    if (!c)
+    {
+        thread_put(t);
+        return -ENOMEM;
+    }
+
+    c->thread = t;
+    c->event = attr.event;
+    c->base = perf_counter_value(c);
+
+    /* A file counts a single thing, for its whole life */
+    void *expected = nullptr;
+    if (!__atomic_compare_exchange_n(&file->private_data, &expected, (void *) c, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        thread_put(t);
+        free(c);
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+static int perf_probe_reset_counter(struct file *file)
+{
+    struct perf_counter *c = (struct perf_counter *) file->private_data;
+    if (!c)
+        return -EINVAL;
+
+    c->base = perf_counter_value(c);
+    return 0;
+}
+
+static size_t perf_probe_read(size_t offset, size_t len, void *ubuf, struct file *file)
+{
+    struct perf_counter *c = (struct perf_counter *) file->private_data;
+    if (!c)
+        return -EINVAL;
+
+    __u64 val = perf_counter_value(c) - c->base;
+    if (len < sizeof(val))
+        return -EINVAL;
+
+    if (copy_to_user(ubuf, &val, sizeof(val)) < 0)
+        return -EFAULT;
+
+    return sizeof(val);
+}
+
+static void perf_probe_release(struct file *file)
+{
+    struct perf_counter *c = (struct perf_counter *) file->private_data;
+    if (!c)
+        return;
+
+    thread_put(c->thread);
+    free(c);
+}
+
 unsigned int perf_probe_ioctl(int request, void *argp, struct file *file)
 {
     switch (request)
@@ -269,6 +480,12 @@ unsigned int perf_probe_ioctl(int request, void *argp, struct file *file)
             return perf_probe_ucopy(argp);
         case PERF_PROBE_ENABLE_DISABLE_WAIT:
             return perf_probe_ioctl_enable_disable_wait(argp);
+        case PERF_PROBE_SET_FILTER:
+            return perf_probe_set_filter(argp);
+        case PERF_PROBE_ATTACH_COUNTER:
+            return perf_probe_attach_counter(argp, file);
+        case PERF_PROBE_RESET_COUNTER:
+            return perf_probe_reset_counter(file);
     }
 
     return -ENOTTY;
@@ -284,7 +501,10 @@ PER_CPU_VAR(flame_graph_entry *curwait_fge) = nullptr;
 void perf_probe_setup_wait(struct flame_graph_entry *fge)
 {
     const auto t0 = clocksource_get_time();
+    fge->rips[0] = 0;
     fge->rips[31] = t0;
+    fge->user_rips[0] = 0;
+    perf_probe_fill_ids(fge, get_current_thread());
     write_per_cpu(curwait_fge, fge);
 }
 
@@ -298,7 +518,7 @@ void perf_probe_commit_wait(const struct flame_graph_entry *fge)
     if (perf_lock.try_read() < 0)
         return;
 
-    if (!perf_probe_wait_enabled)
+    if (!perf_probe_wait_enabled || !perf_probe_wants(get_current_thread()))
     {
         perf_lock.unlock_read();
         return;
@@ -358,7 +578,9 @@ void perf_probe_do(struct registers *regs)
     if (perf_lock.try_read() < 0)
         return;
 
-    if (!perf_probe_enabled)
+    struct thread *curr = get_current_thread();
+
+    if (!perf_probe_enabled || !perf_probe_wants(curr))
     {
         perf_lock.unlock_read();
         return;
@@ -369,18 +591,28 @@ void perf_probe_do(struct registers *regs)
     struct flame_graph_entry *e = &pcpu->fge[pcpu->windex % FLAME_GRAPH_NENTRIES];
     (void) e;
     pcpu->windex++;
+    perf_probe_fill_ids(e, curr);
 #ifdef __x86_64__
-    e->rips[0] = regs->rip;
-    e->rips[1] = 0;
-    stack_trace_get((unsigned long *) regs->rbp, e->rips + 1, 31);
+    if (in_kernel_space_regs(regs))
+    {
+        e->rips[0] = regs->rip;
+        e->rips[1] = 0;
+        stack_trace_get((unsigned long *) regs->rbp, e->rips + 1, 31);
+        e->user_rips[0] = 0;
+    }
+    else
+    {
+        e->rips[0] = 0;
+        perf_probe_user_stack(regs->rip, regs->rbp, e->user_rips);
+    }
 #endif
     irq_restore(_);
 
     perf_lock.unlock_read();
 }
 
-const file_ops perf_probe_fops = {.read = nullptr, // TODO
-                                  .ioctl = perf_probe_ioctl};
+const file_ops perf_probe_fops = {
+    .read = perf_probe_read, .ioctl = perf_probe_ioctl, .release = perf_probe_release};
 
 /**
  * @brief Initialize perf-probe
@@ -394,3 +626,46 @@ void perf_init()
 }
 
 INIT_LEVEL_CORE_KERNEL_ENTRY(perf_init);
+
+#ifdef CONFIG_KUNIT
+
+TEST(perf, counter_attach_read)
+{
+    struct file f = {};
+    struct perf_counter_attr attr = {};
+    attr.event = PERF_COUNT_SW_CONTEXT_SWITCHES;
+    attr.tid = 0;
+
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    // Reading a file without a counter fails
+    __u64 val;
+    EXPECT_EQ(perf_probe_read(0, sizeof(val), &val, &f), (size_t) -EINVAL);
+
+    ASSERT_EQ(perf_probe_attach_counter(&attr, &f), 0);
+    ASSERT_NONNULL(f.private_data);
+    EXPECT_EQ(perf_probe_attach_counter(&attr, &f), -EBUSY);
+
+    // Sleeping switches us out at least once
+    sched_sleep_ms(1);
+    ASSERT_EQ(perf_probe_read(0, sizeof(val), &val, &f), sizeof(val));
+    EXPECT_GT(val, 0UL);
+
+    EXPECT_EQ(perf_probe_read(0, sizeof(val) - 1, &val, &f), (size_t) -EINVAL);
+
+    perf_probe_release(&f);
+}
+
+TEST(perf, counter_attach_bad_event)
+{
+    struct file f = {};
+    struct perf_counter_attr attr = {};
+    attr.event = PERF_COUNT_SW_MAX;
+    attr.tid = 0;
+
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+    EXPECT_EQ(perf_probe_attach_counter(&attr, &f), -EINVAL);
+    EXPECT_NULL(f.private_data);
+}
+
+#endif
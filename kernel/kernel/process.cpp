@@ -36,7 +36,6 @@
 #include <onyx/user.h>
 #include <onyx/utils.h>
 #include <onyx/vdso.h>
-#include <onyx/worker.h>
 
 ids *process_ids = nullptr;
 
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <onyx/cpu.h>
+#include <onyx/cpumask.h>
+#include <onyx/percpu.h>
+#include <onyx/rcu.h>
+#include <onyx/scheduler.h>
+#include <onyx/smp.h>
+#include <onyx/softirq.h>
+#include <onyx/spinlock.h>
+#include <onyx/task_switching.h>
+#include <onyx/tickless.h>
+#include <onyx/utils.h>
+
+/* Quiescent-state-based RCU. Readers run with preemption disabled, so once every cpu has gone
+ * through a context switch (or the idle loop), every reader that was around when a grace period
+ * started is done.
+ *
+ * Grace periods are numbered by rcu_gp_seq, whose low bit is set while one is in progress. A grace
+ * period starts by marking every online cpu in rcu_gp_pending, and ends when the last one reports
+ * a quiescent state. Cpus with their tick stopped get kicked, so they go through a context switch.
+ *
+ * Callbacks are batched per-cpu: new callbacks go into the next list, which gets moved to the wait
+ * list (and assigned a grace period) once the wait list is empty. When that grace period ends, the
+ * wait list is moved to the done list and the RCU softirq invokes it.
+ */
+
+struct rcu_cblist
+{
+    struct rcu_head *head;
+    struct rcu_head *tail;
+};
+
+struct rcu_data
+{
+    struct rcu_cblist next;
+    struct rcu_cblist wait;
+    /* Sequence number the wait list is waiting for */
+    unsigned long wait_seq;
+    struct rcu_cblist done;
+};
+
+static PER_CPU_VAR(struct rcu_data rcu_data);
+
+static struct spinlock rcu_gp_lock;
+static unsigned long rcu_gp_seq;
+/* Sequence number of the last grace period someone is waiting on */
+static unsigned long rcu_gp_wanted;
+static cpumask rcu_gp_pending;
+
+static bool rcu_cblist_empty(const struct rcu_cblist *list)
+{
+    return list->head == nullptr;
+}
+
+static void rcu_cblist_add(struct rcu_cblist *list, struct rcu_head *head)
+{
+    if (list->tail)
+        list->tail->next = head;
+    else
+        list->head = head;
+    list->tail = head;
+}
+
+static void rcu_cblist_splice(struct rcu_cblist *dst, struct rcu_cblist *src)
+{
+    if (rcu_cblist_empty(src))
+        return;
+
+    if (dst->tail)
+        dst->tail->next = src->head;
+    else
+        dst->head = src->head;
+    dst->tail = src->tail;
+    src->head = src->tail = nullptr;
+}
+
+/**
+ * @brief Get the sequence number that marks the end of a full grace period that starts after now.
+ * If a grace period is in progress, that's the one after it.
+ */
+static unsigned long rcu_seq_snap()
+{
+    return (__atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE) + 3) & ~1UL;
+}
+
+static bool rcu_seq_done(unsigned long seq)
+{
+    return (long) (__atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE) - seq) >= 0;
+}
+
+/**
+ * @brief Start a grace period, if one is wanted and there isn't one going already.
+ *
+ * @param kick Set to the cpus that need to report a quiescent state
+ * @return True if a grace period was started
+ */
+static bool rcu_start_gp_locked(cpumask *kick)
+{
+    MUST_HOLD_LOCK(&rcu_gp_lock);
+
+    if (rcu_gp_seq & 1 || (long) (rcu_gp_wanted - rcu_gp_seq) <= 0)
+        return false;
+
+    rcu_gp_pending = smp::get_online_cpumask();
+    *kick = rcu_gp_pending;
+
+    /* Publish the pending mask before the grace period, for rcu_qs's lockless check */
+    __atomic_store_n(&rcu_gp_seq, rcu_gp_seq + 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+static void rcu_kick_cpus(cpumask &mask)
+{
+    /* Cpus that have their tick running will get to a context switch by themselves */
+    mask.for_every_cpu([](unsigned long cpu) -> bool {
+        tick_nohz_kick(cpu);
+        return true;
+    });
+}
+
+static void rcu_request_gp(unsigned long seq)
+{
+    cpumask kick;
+    bool started;
+
+    {
+        scoped_lock<spinlock, true> g{rcu_gp_lock};
+        if ((long) (seq - rcu_gp_wanted) > 0)
+            rcu_gp_wanted = seq;
+        started = rcu_start_gp_locked(&kick);
+    }
+
+    if (started)
+        rcu_kick_cpus(kick);
+}
+
+/**
+ * @brief Assign the next list to a grace period. Called with IRQs disabled.
+ */
+static void rcu_accelerate(struct rcu_data *rd)
+{
+    rcu_cblist_splice(&rd->wait, &rd->next);
+    rd->wait_seq = rcu_seq_snap();
+    rcu_request_gp(rd->wait_seq);
+}
+
+void rcu_qs()
+{
+    unsigned long flags = irq_save_and_disable();
+    const unsigned int cpu = get_cpu_nr();
+    cpumask kick;
+    bool started = false;
+
+    if (!rcu_gp_pending.is_cpu_set(cpu))
+    {
+        irq_restore(flags);
+        return;
+    }
+
+    spin_lock(&rcu_gp_lock);
+
+    if (rcu_gp_pending.is_cpu_set(cpu))
+    {
+        rcu_gp_pending.remove_cpu(cpu);
+
+        if (rcu_gp_pending.is_empty())
+        {
+            /* We were the last one, end the grace period and start the next one, if needed */
+            __atomic_store_n(&rcu_gp_seq, rcu_gp_seq + 1, __ATOMIC_RELEASE);
+            started = rcu_start_gp_locked(&kick);
+        }
+    }
+
+    spin_unlock(&rcu_gp_lock);
+    irq_restore(flags);
+
+    if (started)
+        rcu_kick_cpus(kick);
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    head->func = func;
+    head->next = nullptr;
+
+    unsigned long flags = irq_save_and_disable();
+    struct rcu_data *rd = get_per_cpu_ptr(rcu_data);
+
+    rcu_cblist_add(&rd->next, head);
+
+    if (rcu_cblist_empty(&rd->wait))
+        rcu_accelerate(rd);
+
+    /* Only the tick moves callbacks along, so get ours going again if it was stopped */
+    tick_nohz_kick(get_cpu_nr());
+
+    irq_restore(flags);
+}
+
+void rcu_check_callbacks()
+{
+    bool raise = false;
+    unsigned long flags = irq_save_and_disable();
+    struct rcu_data *rd = get_per_cpu_ptr(rcu_data);
+
+    if (!rcu_cblist_empty(&rd->wait) && rcu_seq_done(rd->wait_seq))
+    {
+        rcu_cblist_splice(&rd->done, &rd->wait);
+        raise = true;
+    }
+
+    if (rcu_cblist_empty(&rd->wait) && !rcu_cblist_empty(&rd->next))
+        rcu_accelerate(rd);
+
+    irq_restore(flags);
+
+    if (raise)
+        softirq_raise(SOFTIRQ_VECTOR_RCU);
+}
+
+bool rcu_needs_cpu()
+{
+    struct rcu_data *rd = get_per_cpu_ptr(rcu_data);
+    return !rcu_cblist_empty(&rd->next) || !rcu_cblist_empty(&rd->wait) ||
+           !rcu_cblist_empty(&rd->done);
+}
+
+void rcu_do_callbacks()
+{
+    unsigned long flags = irq_save_and_disable();
+    struct rcu_data *rd = get_per_cpu_ptr(rcu_data);
+    struct rcu_head *head = rd->done.head;
+    rd->done.head = rd->done.tail = nullptr;
+    irq_restore(flags);
+
+    while (head)
+    {
+        struct rcu_head *next = head->next;
+        head->func(head);
+        head = next;
+    }
+}
+
+struct rcu_synchronize
+{
+    struct rcu_head head;
+    struct thread *thread;
+    bool done;
+};
+
+static void rcu_synchronize_wake(struct rcu_head *head)
+{
+    struct rcu_synchronize *rs = container_of(head, struct rcu_synchronize, head);
+    struct thread *thread = rs->thread;
+
+    /* rs lives on the waiter's stack, and may be gone as soon as done is set */
+    thread_get(thread);
+    __atomic_store_n(&rs->done, true, __ATOMIC_RELEASE);
+    thread_wake_up(thread);
+    thread_put(thread);
+}
+
+void synchronize_rcu()
+{
+    struct rcu_synchronize rs;
+    rs.thread = get_current_thread();
+    rs.done = false;
+
+    call_rcu(&rs.head, rcu_synchronize_wake);
+
+    for (;;)
+    {
+        set_current_state(THREAD_UNINTERRUPTIBLE);
+        if (__atomic_load_n(&rs.done, __ATOMIC_ACQUIRE))
+            break;
+        sched_yield();
+    }
+
+    set_current_state(THREAD_RUNNABLE);
+}
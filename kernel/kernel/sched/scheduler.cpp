@@ -19,9 +19,9 @@
 #include <onyx/clock.h>
 #include <onyx/condvar.h>
 #include <onyx/cpu.h>
-#include <onyx/dpc.h>
 #include <onyx/elf.h>
 #include <onyx/fpu.h>
+#include <onyx/futex.h>
 #include <onyx/irq.h>
 #include <onyx/kcov.h>
 #include <onyx/mm/kasan.h>
@@ -29,15 +29,17 @@
 #include <onyx/percpu.h>
 #include <onyx/perf_probe.h>
 #include <onyx/process.h>
+#include <onyx/rcu.h>
 #include <onyx/rwlock.h>
 #include <onyx/semaphore.h>
 #include <onyx/softirq.h>
 #include <onyx/spinlock.h>
 #include <onyx/task_switching.h>
+#include <onyx/tickless.h>
 #include <onyx/timer.h>
 #include <onyx/tss.h>
 #include <onyx/vm.h>
-#include <onyx/worker.h>
+#include <onyx/workqueue.h>
 
 #include <libdict/rb_tree.h>
 
@@ -57,6 +59,8 @@ PER_CPU_VAR(spinlock scheduler_lock) = STATIC_SPINLOCK_INIT;
 PER_CPU_VAR(thread *thread_queues_head[NUM_PRIO]);
 PER_CPU_VAR(thread *thread_queues_tail[NUM_PRIO]);
 PER_CPU_VAR(thread *current_thread);
+/* The idle thread sits in a run queue whenever something else runs */
+static PER_CPU_VAR(thread *idle_thread);
 
 void thread_append_to_global_list(thread *t)
 {
@@ -272,13 +276,26 @@ void sched_decrease_quantum(clockevent *ev)
         curr->flags |= THREAD_NEEDS_RESCHED;
     }
 
+    clock_update_coarse();
+
+    rcu_check_callbacks();
+
     ev->deadline = clocksource_get_time() + NS_PER_MS;
+
+    tick_nohz_stop_busy(ev);
 }
 
 void sched_load_thread(thread *thread, unsigned int cpu)
 {
     write_per_cpu(current_thread, thread);
 
+    if (thread->last_cpu != cpu)
+    {
+        if (thread->last_cpu != -1U)
+            perf_count_sw_thread(thread, PERF_COUNT_SW_CPU_MIGRATIONS);
+        thread->last_cpu = cpu;
+    }
+
     errno = thread->errno_val;
 
     native::arch_load_thread(thread, cpu);
@@ -288,6 +305,11 @@ void sched_load_thread(thread *thread, unsigned int cpu)
 
     write_per_cpu(sched_quantum, SCHED_QUANTUM);
 
+    tick_nohz_task_switch();
+
+    if (thread->wq_worker)
+        wq_worker_running(thread);
+
     cputime_restart_accounting(thread);
 
     spin_unlock_irqrestore(get_per_cpu_ptr_any(scheduler_lock, cpu), irq_save_and_disable());
@@ -303,7 +325,11 @@ NO_ASAN void sched_load_finish(thread *prev_thread, thread *next_thread)
     sched_load_thread(next_thread, get_cpu_nr());
 
     if (prev_thread)
+    {
         prev_thread->flags &= ~THREAD_RUNNING;
+        if (prev_thread != next_thread)
+            perf_count_sw_thread(prev_thread, PERF_COUNT_SW_CONTEXT_SWITCHES);
+    }
 
     next_thread->flags |= THREAD_RUNNING;
 
@@ -345,6 +371,10 @@ extern "C" void *sched_schedule(void *last_stack)
 
         curr_thread->flags &= ~THREAD_ACTIVE;
 
+        /* Let the worker pool know, so it can get another worker going */
+        if (thread_blocked && curr_thread->wq_worker)
+            wq_worker_sleeping(curr_thread);
+
         sched_save_thread(curr_thread, last_stack);
 
         do_cputime_accounting();
@@ -353,6 +383,9 @@ extern "C" void *sched_schedule(void *last_stack)
     thread *source_thread = curr_thread;
     irq_save_and_disable();
 
+    /* We're not in a read-side critical section, as preemption is enabled */
+    rcu_qs();
+
     curr_thread = sched_find_runnable();
     st_invoked++;
 
@@ -395,6 +428,9 @@ void sched_idle(void *ptr)
     /* This function will not do work at all, just idle using hlt or a similar instruction */
     for (;;)
     {
+        rcu_check_callbacks();
+        tick_nohz_idle_enter();
+        rcu_qs();
         cpu_sleep();
     }
 }
@@ -465,6 +501,7 @@ void thread_add(thread_t *thread, unsigned int cpu_num)
     add_per_cpu_any(active_threads, 1, cpu_num);
     /* Append the thread to the queue */
     sched_append_to_queue(thread->priority, cpu_num, thread);
+    tick_nohz_kick(cpu_num);
 }
 
 void sched_init_cpu(unsigned int cpu)
@@ -477,10 +514,11 @@ void sched_init_cpu(unsigned int cpu)
     t->cpu = cpu;
 
     write_per_cpu_any(current_thread, t, cpu);
+    write_per_cpu_any(idle_thread, t, cpu);
     write_per_cpu_any(sched_quantum, SCHED_QUANTUM, cpu);
     write_per_cpu_any(preemption_counter, 0, cpu);
 
-    auto cev = new clockevent;
+    auto cev = new clockevent{};
 
     assert(cev != nullptr);
 
@@ -498,6 +536,30 @@ void sched_enable_pulse(void)
     timer_queue_clockevent(ev);
 }
 
+void sched_disable_pulse(void)
+{
+    timer_cancel_event(get_per_cpu(sched_pulse));
+}
+
+bool sched_cpu_has_queued_threads(unsigned int cpu)
+{
+    auto thread_queues = (struct thread **) get_per_cpu_ptr_any(thread_queues_head, cpu);
+    const thread *idle = get_per_cpu_any(idle_thread, cpu);
+
+    for (int i = 0; i < NUM_PRIO; i++)
+    {
+        thread *t = __atomic_load_n(&thread_queues[i], __ATOMIC_RELAXED);
+        if (!t)
+            continue;
+
+        /* The idle thread doesn't count, it only runs if there's nothing else to */
+        if (t != idle || __atomic_load_n(&t->next_prio, __ATOMIC_RELAXED))
+            return true;
+    }
+
+    return false;
+}
+
 int sched_rbtree_cmp(const void *t1, const void *t2)
 {
     int tid0 = (int) (unsigned long) t1;
@@ -517,7 +579,7 @@ int sched_init(void)
     write_per_cpu(sched_quantum, SCHED_QUANTUM);
     set_current_thread(t);
 
-    auto cev = new clockevent;
+    auto cev = new clockevent{};
 
     assert(cev != nullptr);
 
@@ -575,6 +637,7 @@ hrtime_t sched_sleep(unsigned long ns)
      */
     ev.flags = CLOCKEVENT_FLAG_ATOMIC;
     ev.deadline = clocksource_get_time() + ns;
+    ev.slack = TIMER_SLACK_DEFAULT;
     timer_queue_clockevent(&ev);
 
     /* This is a bit of a hack but we need this in cases where we have timeout but we're not
@@ -641,6 +704,37 @@ int sched_remove_thread_from_execution(thread_t *thread)
     return st;
 }
 
+void sched_set_priority(struct thread *thread, int prio)
+{
+    for (;;)
+    {
+        const unsigned int cpu = __atomic_load_n(&thread->cpu, __ATOMIC_RELAXED);
+        spinlock *s = get_per_cpu_ptr_any(scheduler_lock, cpu);
+        unsigned long cpu_flags = spin_lock_irqsave(s);
+
+        /* Raced with a migration, try again */
+        if (thread->cpu != cpu)
+        {
+            spin_unlock_irqrestore(s, cpu_flags);
+            continue;
+        }
+
+        /* If it's sitting in a runqueue, move it to the right one. Otherwise, it's either
+         * running or blocked, and it'll get queued with the new priority.
+         */
+        if (__sched_remove_thread_from_execution(thread, cpu) == 0)
+        {
+            thread->priority = prio;
+            __sched_append_to_queue(prio, cpu, thread);
+        }
+        else
+            thread->priority = prio;
+
+        spin_unlock_irqrestore(s, cpu_flags);
+        break;
+    }
+}
+
 void sched_remove_thread(thread_t *thread)
 {
     sched_remove_thread_from_execution(thread);
@@ -688,6 +782,11 @@ int sys_nanosleep(const timespec *req, timespec *rem)
 
 extern "C" void thread_finish_destruction(void *);
 
+static void thread_destroy_work(struct work_struct *work)
+{
+    thread_finish_destruction(container_of(work, struct thread, destroy_work));
+}
+
 void thread_destroy(struct thread *thread)
 {
     /* This function should destroy everything that we can destroy right now.
@@ -713,10 +812,8 @@ void thread_destroy(struct thread *thread)
     sched_remove_thread(thread);
 
     /* Schedule further thread destruction */
-    dpc_work w;
-    w.context = thread;
-    w.funcptr = thread_finish_destruction;
-    dpc_schedule_work(&w, DPC_PRIORITY_MEDIUM);
+    INIT_WORK(&thread->destroy_work, thread_destroy_work);
+    schedule_work(&thread->destroy_work);
 }
 
 void thread_exit()
@@ -726,6 +823,9 @@ void thread_exit()
     thread *current = get_current_thread();
 
     kcov_free_thread(current);
+
+    futex_exit_pi(current);
+
     sched_disable_preempt();
 
     /* We need to switch to the fallback page directory while we can, because
@@ -822,6 +922,7 @@ void __thread_wake_up(thread *thread, unsigned int cpu)
 
     thread->status = THREAD_RUNNABLE;
     __sched_append_to_queue(thread->priority, cpu, thread);
+    tick_nohz_kick(cpu);
 
     if (cpu == get_cpu_nr())
     {
@@ -1084,10 +1185,23 @@ pid_t sys_gettid()
     return current->id;
 }
 
+int sys_getcpu(unsigned int *ucpu, unsigned int *unode, void *tcache)
+{
+    const unsigned int cpu = get_cpu_nr();
+    const unsigned int node = 0;
+
+    if (ucpu && copy_to_user(ucpu, &cpu, sizeof(cpu)) < 0)
+        return -EFAULT;
+    if (unode && copy_to_user(unode, &node, sizeof(node)) < 0)
+        return -EFAULT;
+    return 0;
+}
+
 void sched_transition_to_idle()
 {
     thread *curr = get_current_thread();
     curr->priority = SCHED_PRIO_VERY_LOW;
+    write_per_cpu(idle_thread, curr);
     curr->entry(nullptr);
 }
 
@@ -82,6 +82,11 @@ unsigned int get_online_cpus()
     return nr_online_cpus;
 }
 
+const cpumask &get_online_cpumask()
+{
+    return online_cpus;
+}
+
 namespace internal
 {
 
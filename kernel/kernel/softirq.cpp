@@ -1,20 +1,88 @@
 /*
- * Copyright (c) 2020 - 2023 Pedro Falcato
+ * Copyright (c) 2020 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  *
  * SPDX-License-Identifier: MIT
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <onyx/cmdline.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
 #include <onyx/irq.h>
 #include <onyx/net/netif.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
+#include <onyx/rcu.h>
+#include <onyx/scheduler.h>
 #include <onyx/softirq.h>
+#include <onyx/sysfs.h>
 #include <onyx/timer.h>
+#include <onyx/user.h>
+
+#include <onyx/utility.hpp>
+
+/* Softirqs run on IRQ exit and when preemption gets re-enabled. To keep a flood of softirqs
+ * (think network RX) from starving everything else, softirq_handle() only restarts so many times,
+ * for so long. If there's still work pending after that, the rest is left to the cpu's ksoftirqd,
+ * a normal thread that gets scheduled like everyone else. While ksoftirqd has work, deferrable
+ * vectors aren't handled inline anymore.
+ */
+#define SOFTIRQ_MAX_RESTART 10
+#define SOFTIRQ_MAX_TIME    (2 * NS_PER_MS)
+
+/* Vectors that get left to ksoftirqd while it's running. Timers stay inline, as they're cheap and
+ * latency sensitive.
+ */
+#define SOFTIRQ_DEFERRABLE (1 << SOFTIRQ_VECTOR_NETRX)
+
+struct softirq_stats
+{
+    unsigned long count[SOFTIRQ_NR_VECTORS];
+    hrtime_t time[SOFTIRQ_NR_VECTORS];
+    /* Number of times the budget ran out, and ksoftirqd got woken up */
+    unsigned long deferred;
+    hrtime_t ksoftirqd_time;
+};
 
 PER_CPU_VAR(unsigned int pending_vectors);
 PER_CPU_VAR(bool handling_softirq);
+static PER_CPU_VAR(struct thread *ksoftirqd);
+static PER_CPU_VAR(bool ksoftirqd_pending);
+static PER_CPU_VAR(struct softirq_stats softirq_stats);
+
+/* ksoftirqd's scheduling priority (1 - SCHED_PRIO_VERY_HIGH). Defaults to SCHED_PRIO_NORMAL */
+static KERNEL_PARAM("ksoftirqd_prio", ksoftirqd_prio, int);
+
+static void softirq_timer()
+{
+    timer_handle_events(platform_get_timer());
+}
+
+#ifdef CONFIG_NET
+static void softirq_netrx()
+{
+    netif_do_rx();
+}
+#endif
+
+/* Both indexed by softirq_vector */
+static void (*const softirq_handlers[SOFTIRQ_NR_VECTORS])() = {
+    softirq_timer,
+#ifdef CONFIG_NET
+    softirq_netrx,
+#else
+    nullptr,
+#endif
+    rcu_do_callbacks,
+};
+
+static const char *const softirq_names[SOFTIRQ_NR_VECTORS] = {"timer", "netrx", "rcu"};
 
 bool softirq_may_handle()
 {
@@ -29,42 +97,89 @@ bool softirq_pending()
     return get_per_cpu(pending_vectors) != 0;
 }
 
-void softirq_handle()
+static void wakeup_ksoftirqd()
+{
+    struct thread *t = get_per_cpu(ksoftirqd);
+    if (!t)
+        return;
+
+    write_per_cpu(ksoftirqd_pending, true);
+    get_per_cpu_ptr(softirq_stats)->deferred++;
+    thread_wake_up(t);
+}
+
+/**
+ * @brief Run pending softirqs, within budget.
+ *
+ * @param mask Vectors to run
+ */
+static void __softirq_handle(unsigned int mask)
 {
     write_per_cpu(handling_softirq, true);
 
     sched_disable_preempt();
 
     bool is_disabled = irq_is_disabled();
+    auto stats = get_per_cpu_ptr(softirq_stats);
+    const hrtime_t start = clocksource_get_time();
+    unsigned int restarts = SOFTIRQ_MAX_RESTART;
 
-    irq_enable();
+    irq_disable();
 
-    auto pending = get_per_cpu(pending_vectors);
+    unsigned int pending = get_per_cpu(pending_vectors);
 
-    if (pending & (1 << SOFTIRQ_VECTOR_TIMER))
+    while (pending & mask)
     {
-        timer_handle_events(platform_get_timer());
-        pending &= ~(1 << SOFTIRQ_VECTOR_TIMER);
-    }
+        /* Vectors raised from here on get picked up on the next round */
+        write_per_cpu(pending_vectors, pending & ~mask);
+        pending &= mask;
 
-#ifdef CONFIG_NET
-    if (pending & (1 << SOFTIRQ_VECTOR_NETRX))
-    {
-        netif_do_rx();
-        pending &= ~(1 << SOFTIRQ_VECTOR_NETRX);
-    }
-#endif
+        irq_enable();
 
-    write_per_cpu(pending_vectors, pending);
+        while (pending)
+        {
+            const unsigned int vec = __builtin_ctz(pending);
+            pending &= ~(1U << vec);
+
+            const hrtime_t t0 = clocksource_get_time();
+            if (softirq_handlers[vec])
+                softirq_handlers[vec]();
+            stats->time[vec] += clocksource_get_time() - t0;
+            stats->count[vec]++;
+        }
 
-    if (is_disabled)
         irq_disable();
 
+        pending = get_per_cpu(pending_vectors);
+        if (!(pending & mask))
+            break;
+
+        if (--restarts == 0 || clocksource_get_time() - start >= SOFTIRQ_MAX_TIME)
+        {
+            wakeup_ksoftirqd();
+            break;
+        }
+    }
+
+    if (!is_disabled)
+        irq_enable();
+
     sched_enable_preempt_no_softirq();
 
     write_per_cpu(handling_softirq, false);
 }
 
+void softirq_handle()
+{
+    unsigned int mask = ~0U;
+
+    /* ksoftirqd is already on it, don't get in the way of the threads it's sharing the cpu with */
+    if (get_per_cpu(ksoftirqd_pending) && get_current_thread() != get_per_cpu(ksoftirqd))
+        mask &= ~SOFTIRQ_DEFERRABLE;
+
+    __softirq_handle(mask);
+}
+
 void softirq_try_handle()
 {
     if (get_per_cpu(pending_vectors) && softirq_may_handle())
@@ -87,3 +202,103 @@ void softirq_raise(enum softirq_vector vec)
     if (pending && softirq_may_handle())
         softirq_handle();
 }
+
+static void ksoftirqd_thread(void *arg)
+{
+    for (;;)
+    {
+        irq_disable();
+
+        if (!get_per_cpu(pending_vectors))
+        {
+            write_per_cpu(ksoftirqd_pending, false);
+            set_current_state(THREAD_UNINTERRUPTIBLE);
+            irq_enable();
+            sched_yield();
+            continue;
+        }
+
+        irq_enable();
+
+        const hrtime_t t0 = clocksource_get_time();
+        __softirq_handle(~0U);
+        get_per_cpu_ptr(softirq_stats)->ksoftirqd_time += clocksource_get_time() - t0;
+
+        /* Give everyone else on this cpu a turn before we go again */
+        sched_yield();
+    }
+}
+
+static void softirq_start_threads()
+{
+    int prio = SCHED_PRIO_NORMAL;
+    if (ksoftirqd_prio > SCHED_PRIO_VERY_LOW && ksoftirqd_prio <= SCHED_PRIO_VERY_HIGH)
+        prio = ksoftirqd_prio;
+
+    for (unsigned int cpu = 0; cpu < get_nr_cpus(); cpu++)
+    {
+        struct thread *t = sched_create_thread(ksoftirqd_thread, THREAD_KERNEL, nullptr);
+        if (!t)
+            panic("softirq: Could not create ksoftirqd");
+
+        t->priority = prio;
+        write_per_cpu_any(ksoftirqd, t, cpu);
+        sched_start_thread_for_cpu(t, cpu);
+    }
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(softirq_start_threads);
+
+static ssize_t softirq_stats_print(void *buffer, size_t size, off_t off)
+{
+    const unsigned int nr_cpus = get_nr_cpus();
+    const size_t buflen = 64 * (SOFTIRQ_NR_VECTORS + 2) * (nr_cpus + 1);
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = snprintf(buf, buflen, "cpu vector count time_ns\n");
+
+    for (unsigned int cpu = 0; cpu < nr_cpus && len < buflen; cpu++)
+    {
+        const struct softirq_stats *s = get_per_cpu_ptr_any(softirq_stats, cpu);
+
+        for (unsigned int vec = 0; vec < SOFTIRQ_NR_VECTORS && len < buflen; vec++)
+            len += snprintf(buf + len, buflen - len, "%u %s %lu %lu\n", cpu, softirq_names[vec],
+                            s->count[vec], s->time[vec]);
+
+        if (len < buflen)
+            len += snprintf(buf + len, buflen - len, "%u ksoftirqd %lu %lu\n", cpu, s->deferred,
+                            s->ksoftirqd_time);
+    }
+
+    if (len >= buflen)
+        len = buflen - 1;
+
+    ssize_t st = 0;
+    if ((size_t) off < len)
+    {
+        size_t to_copy = cul::min(len - off, size);
+        st = copy_to_user(buffer, buf + off, to_copy) < 0 ? -EFAULT : (ssize_t) to_copy;
+    }
+
+    free(buf);
+    return st;
+}
+
+static struct sysfs_object softirq_obj;
+static struct sysfs_object softirq_stats_file;
+
+static void softirq_sysfs_init()
+{
+    assert(sysfs_object_init("softirq", &softirq_obj) == 0);
+    softirq_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("stats", &softirq_stats_file, &softirq_obj) == 0);
+    softirq_stats_file.read = softirq_stats_print;
+    softirq_stats_file.perms = 0444 | S_IFREG;
+
+    sysfs_add(&softirq_obj, nullptr);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(softirq_sysfs_init);
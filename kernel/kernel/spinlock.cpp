@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2016 - 2023 Pedro Falcato
+ * Copyright (c) 2016 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  *
@@ -10,10 +10,36 @@
 
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
+#include <onyx/cpumask.h>
+#include <onyx/lockstat.h>
+#include <onyx/percpu.h>
 #include <onyx/scheduler.h>
 #include <onyx/spinlock.h>
 #include <onyx/task_switching.h>
 
+/* Spinlocks are MCS-style queued locks, squeezed into 32 bits. Uncontended, locking is a single
+ * cmpxchg of the owner into a zeroed lock word. Under contention, waiters queue up in FIFO order
+ * using per-cpu queue nodes, and each waiter spins on its own node, instead of everyone hammering
+ * the lock's cacheline. Only the head of the queue looks at the lock word.
+ *
+ * The tail of the queue is encoded as ((cpu + 1) << 2 | nesting level), as a cpu can be waiting on
+ * up to SPIN_MAX_NESTING locks at the same time (task, softirq, irq and nmi context).
+ */
+
+#define SPIN_MAX_NESTING 4
+
+static_assert(CONFIG_SMP_NR_CPUS < (1 << 14), "spinlock tails only have room for 16383 cpus");
+
+struct spin_mcs_node
+{
+    struct spin_mcs_node *next;
+    unsigned int locked;
+    /* Number of nodes in use on this cpu, only valid in the first node */
+    unsigned int count;
+};
+
+static PER_CPU_VAR(struct spin_mcs_node spin_nodes[SPIN_MAX_NESTING]);
+
 __always_inline void post_lock_actions(struct spinlock *lock)
 {
 #ifdef CONFIG_SPINLOCK_DEBUG
@@ -35,28 +61,158 @@ __always_inline bool spin_lock_fast_path(struct spinlock *lock, raw_spinlock_t c
                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
-__noinline void spin_lock_slow_path(struct spinlock *lock, raw_spinlock_t what_to_insert)
+static inline raw_spinlock_t spin_encode_tail(unsigned int cpu, unsigned int idx)
 {
-    raw_spinlock_t expected_val = 0;
+    return ((cpu + 1) << 2 | idx) << SPINLOCK_TAIL_SHIFT;
+}
+
+static inline struct spin_mcs_node *spin_decode_tail(raw_spinlock_t val)
+{
+    const unsigned int tail = val >> SPINLOCK_TAIL_SHIFT;
+    const unsigned int cpu = (tail >> 2) - 1;
+    return &(*get_per_cpu_ptr_any(spin_nodes, cpu))[tail & 3];
+}
+
+/**
+ * @brief Make ourselves the tail of the queue, keeping the owner intact.
+ *
+ * @param lock Lock
+ * @param tail Our tail
+ * @return The old lock word
+ */
+static raw_spinlock_t spin_xchg_tail(struct spinlock *lock, raw_spinlock_t tail)
+{
+    raw_spinlock_t old = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
 
-    while (true)
+    while (!__atomic_compare_exchange_n(&lock->lock, &old, (old & SPINLOCK_OWNER_MASK) | tail,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        cpu_relax();
+
+    return old;
+}
+
+/**
+ * @brief Grab the lock once the owner goes away, without queueing.
+ * Only used when we run out of queue nodes, which should pretty much never happen.
+ */
+static void spin_lock_unqueued(struct spinlock *lock, raw_spinlock_t what_to_insert)
+{
+    raw_spinlock_t val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+
+    for (;;)
     {
-        do
+        if (val & SPINLOCK_OWNER_MASK)
         {
             cpu_relax();
-        } while (__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) != 0);
+            val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+            continue;
+        }
 
-        if (__atomic_compare_exchange_n(&lock->lock, &expected_val, what_to_insert, false,
+        if (__atomic_compare_exchange_n(&lock->lock, &val, val | what_to_insert, false,
                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+__noinline void spin_lock_slow_path(struct spinlock *lock, raw_spinlock_t what_to_insert)
+{
+    struct spin_mcs_node *nodes = &(*get_per_cpu_ptr(spin_nodes))[0];
+    const unsigned int idx = nodes[0].count++;
+
+    if (idx >= SPIN_MAX_NESTING) [[unlikely]]
+    {
+        spin_lock_unqueued(lock, what_to_insert);
+        nodes[0].count--;
+        return;
+    }
+
+    struct spin_mcs_node *node = &nodes[idx];
+    node->next = nullptr;
+    node->locked = 0;
+
+    const raw_spinlock_t tail = spin_encode_tail(get_cpu_nr(), idx);
+    raw_spinlock_t val = spin_xchg_tail(lock, tail);
+
+    if (val >> SPINLOCK_TAIL_SHIFT)
+    {
+        /* There's someone in front of us. Link ourselves in and wait for our turn, spinning on
+         * our own node.
+         */
+        struct spin_mcs_node *prev = spin_decode_tail(val);
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+        while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            cpu_relax();
+    }
+
+    /* We're the head of the queue, wait for the owner to release the lock */
+    val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        if (val & SPINLOCK_OWNER_MASK)
+        {
+            cpu_relax();
+            val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /* If we're the last one in the queue, clear the tail as we take the lock */
+        const bool last = (val & ~SPINLOCK_OWNER_MASK) == tail;
+        const raw_spinlock_t new_val = last ? what_to_insert : val | what_to_insert;
+
+        if (__atomic_compare_exchange_n(&lock->lock, &val, new_val, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
             break;
+    }
+
+    if ((val & ~SPINLOCK_OWNER_MASK) != tail)
+    {
+        /* Someone queued up behind us, wait for them to link in and make them the head */
+        struct spin_mcs_node *next;
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            cpu_relax();
 
-        expected_val = 0;
+        __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
     }
+
+    nodes[0].count--;
 }
 
+#ifdef CONFIG_LOCKSTAT
+
+__noinline static void spin_lock_stat(struct spinlock *lock, raw_spinlock_t what_to_insert,
+                                      unsigned long site)
+{
+    const hrtime_t start = clocksource_get_time();
+    hrtime_t acquired = start;
+    bool contended = false;
+
+    if (!spin_lock_fast_path(lock, what_to_insert)) [[unlikely]]
+    {
+        spin_lock_slow_path(lock, what_to_insert);
+        acquired = clocksource_get_time();
+        contended = true;
+    }
+
+    post_lock_actions(lock);
+    lockstat_acquire(lock, site, contended, acquired - start, acquired);
+}
+
+#endif
+
 void __spin_lock(struct spinlock *lock)
 {
     raw_spinlock_t what_to_insert = get_cpu_nr() + 1;
+
+#ifdef CONFIG_LOCKSTAT
+    if (lockstat_enabled) [[unlikely]]
+    {
+        spin_lock_stat(lock, what_to_insert, (unsigned long) __builtin_return_address(0));
+        return;
+    }
+#endif
+
     if (!spin_lock_fast_path(lock, what_to_insert)) [[unlikely]]
         spin_lock_slow_path(lock, what_to_insert);
 
@@ -66,12 +222,18 @@ void __spin_lock(struct spinlock *lock)
 void __spin_unlock(struct spinlock *lock)
 {
 #ifdef CONFIG_SPINLOCK_DEBUG
-    assert(lock->lock > 0);
+    assert(lock->owner > 0);
+#endif
+
+#ifdef CONFIG_LOCKSTAT
+    if (lock->lockstat_class) [[unlikely]]
+        lockstat_release(lock);
 #endif
 
     post_release_actions(lock);
 
-    __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
+    /* Only clear the owner, waiters may be changing the tail */
+    __atomic_store_n(&lock->owner, 0, __ATOMIC_RELEASE);
 }
 
 int spin_try_lock(struct spinlock *lock)
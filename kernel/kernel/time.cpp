@@ -25,6 +25,9 @@ struct clocksource *main_clock;
 #define NR_CLOCKS CLOCK_TAI
 static struct clock_time clocks[NR_CLOCKS];
 
+/* CLOCK_MONOTONIC as of the last tick, for the _COARSE clocks */
+static hrtime_t coarse_mono;
+
 void register_wallclock_source(struct wallclock_source *clk)
 {
     assert(clk->get_posix_time != NULL);
@@ -93,6 +96,7 @@ void register_clock_source(struct clocksource *clk)
 
     if (main_clock == clk)
     {
+        vdso_update_clocksource(clk);
         sample_wallclock();
     }
 }
@@ -148,6 +152,19 @@ int clock_gettime_kernel(clockid_t clk_id, struct timespec *tp)
             break;
         }
 
+        case CLOCK_REALTIME_COARSE:
+        case CLOCK_MONOTONIC_COARSE: {
+            hrtime_t t = __atomic_load_n(&coarse_mono, __ATOMIC_RELAXED);
+            if (clk_id == CLOCK_REALTIME_COARSE)
+            {
+                const auto &real = clocks[CLOCK_REALTIME];
+                t = real.epoch * NS_PER_SEC + (t - real.measurement_timestamp);
+            }
+
+            hrtime_to_timespec(t, tp);
+            break;
+        }
+
         case CLOCK_PROCESS_CPUTIME_ID: {
             struct process *p = get_current_process();
 
@@ -216,6 +233,20 @@ void time_set(clockid_t clock, struct clock_time *val)
     vdso_update_time(clock, val);
 }
 
+void clock_update_coarse()
+{
+    const hrtime_t now = clocksource_get_time();
+    hrtime_t last = __atomic_load_n(&coarse_mono, __ATOMIC_RELAXED);
+
+    /* Every cpu's tick ends up here, and they only need one update per tick between them */
+    if (now - last < NS_PER_MS / 2 ||
+        !__atomic_compare_exchange_n(&coarse_mono, &last, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    vdso_update_coarse(now);
+}
+
 struct clock_time *get_raw_clock_time(clockid_t clkid)
 {
     return &clocks[clkid];
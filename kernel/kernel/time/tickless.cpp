@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <onyx/clock.h>
+#include <onyx/cmdline.h>
+#include <onyx/cpu.h>
+#include <onyx/kunit.h>
+#include <onyx/percpu.h>
+#include <onyx/preempt.h>
+#include <onyx/rcu.h>
+#include <onyx/scheduler.h>
+#include <onyx/tickless.h>
+#include <onyx/timer.h>
+#include <onyx/wait_queue.h>
+
+/* The scheduler tick (sched_pulse) only exists to expire time slices. A cpu that's idle, or that
+ * has a single runnable thread, has nothing to preempt, so the tick gets stopped and the timer is
+ * left programmed for the next real clockevent.
+ *
+ * RCU callbacks get moved along by the tick, so cpus with callbacks queued keep ticking, and
+ * call_rcu() restarts the tick of a cpu that queues some while it's stopped. The tick also keeps
+ * the coarse clocks up to date: the boot cpu keeps ticking while any cpu has its tick stopped
+ * while busy, so it does that for them. Otherwise, nothing else depends on the tick: cputime is
+ * accounted with timestamps on kernel entry/exit and context switches, and clocksources get kept
+ * from wrapping around by their own clockevents.
+ *
+ * nohz_full enables stopping the tick on busy cpus. The boot cpu always keeps ticking while busy.
+ */
+static KERNEL_PARAM("nohz_full", nohz_full, bool);
+
+enum tick_state
+{
+    TICK_RUNNING = 0,
+    TICK_STOPPED_IDLE,
+    TICK_STOPPED_BUSY
+};
+
+struct tick_sched
+{
+    /* Read by other cpus, see tick_nohz_kick() */
+    int state;
+    hrtime_t stopped_at;
+};
+
+static PER_CPU_VAR(struct tick_sched tick_sched);
+
+/* Number of cpus with their tick stopped while busy. The boot cpu doesn't stop its tick while
+ * there are any.
+ */
+static unsigned int nr_busy_stopped;
+
+/**
+ * @brief Try to switch the tick into a stopped state.
+ * Races with tick_nohz_kick() on other cpus: either we see the thread they queued, or they see
+ * the tick stopped and kick us.
+ *
+ * @return True if the tick can be stopped
+ */
+static bool tick_try_stop(struct tick_sched *ts, int state)
+{
+    const unsigned int cpu = get_cpu_nr();
+
+    __atomic_store_n(&ts->state, state, __ATOMIC_RELAXED);
+    /* Order the store against the loads below, pairs with the fence in tick_nohz_kick() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (sched_cpu_has_queued_threads(cpu) || rcu_needs_cpu() ||
+        (cpu == 0 && __atomic_load_n(&nr_busy_stopped, __ATOMIC_RELAXED)))
+    {
+        __atomic_store_n(&ts->state, TICK_RUNNING, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    ts->stopped_at = clocksource_get_time();
+    platform_get_timer()->stats.tick_stops++;
+    return true;
+}
+
+void tick_nohz_idle_enter(void)
+{
+    unsigned long flags = irq_save_and_disable();
+    auto ts = get_per_cpu_ptr(tick_sched);
+
+    if (ts->state == TICK_RUNNING && tick_try_stop(ts, TICK_STOPPED_IDLE))
+    {
+        sched_disable_pulse();
+        timer_reprogram(platform_get_timer());
+    }
+
+    irq_restore(flags);
+}
+
+static bool tick_stop_busy(struct tick_sched *ts, struct clockevent *pulse)
+{
+    if (ts->state != TICK_RUNNING || !tick_try_stop(ts, TICK_STOPPED_BUSY))
+        return false;
+
+    /* We're running under the timer's lock, so we can't cancel the pulse. Just don't requeue it */
+    pulse->flags &= ~CLOCKEVENT_FLAG_PULSE;
+
+    /* The boot cpu may have stopped its tick before seeing us, get it going again */
+    __atomic_add_fetch(&nr_busy_stopped, 1, __ATOMIC_RELAXED);
+    tick_nohz_kick(0);
+    return true;
+}
+
+void tick_nohz_stop_busy(struct clockevent *pulse)
+{
+    if (!nohz_full || get_cpu_nr() == 0)
+        return;
+
+    tick_stop_busy(get_per_cpu_ptr(tick_sched), pulse);
+}
+
+void tick_nohz_task_switch(void)
+{
+    auto ts = get_per_cpu_ptr(tick_sched);
+    const int state = ts->state;
+
+    if (state == TICK_RUNNING)
+        return;
+
+    __atomic_store_n(&ts->state, TICK_RUNNING, __ATOMIC_RELAXED);
+
+    if (state == TICK_STOPPED_BUSY)
+        __atomic_sub_fetch(&nr_busy_stopped, 1, __ATOMIC_RELAXED);
+
+    /* The coarse clocks may have gone stale, if every cpu's tick was stopped */
+    clock_update_coarse();
+
+    const hrtime_t skipped = (clocksource_get_time() - ts->stopped_at) / NS_PER_MS;
+    auto &stats = platform_get_timer()->stats;
+    if (state == TICK_STOPPED_IDLE)
+        stats.ticks_skipped_idle += skipped;
+    else
+        stats.ticks_skipped_busy += skipped;
+
+    /* The new thread's time slice was just reset, so the tick can just start over */
+    sched_enable_pulse();
+}
+
+void tick_nohz_kick(unsigned int cpu)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&get_per_cpu_ptr_any(tick_sched, cpu)->state, __ATOMIC_RELAXED) ==
+        TICK_RUNNING)
+        return;
+
+    /* A reschedule goes through a context switch, which restarts the tick. We may be in the
+     * middle of the timer code here, so we can't touch our own tick directly.
+     */
+    if (cpu == get_cpu_nr())
+        sched_should_resched();
+    else
+        cpu_send_resched(cpu);
+}
+
+#ifdef CONFIG_KUNIT
+
+struct tick_test
+{
+    struct wait_queue wq;
+    bool done;
+    bool stopped;
+    int state;
+};
+
+static void tick_test_busy_thread(void *arg)
+{
+    struct tick_test *test = (struct tick_test *) arg;
+    clockevent pulse{};
+
+    /* Something else may come along and run on this cpu (or queue RCU callbacks) at the same
+     * time, so give it a few tries.
+     */
+    for (int i = 0; i < 100 && !test->stopped; i++)
+    {
+        unsigned long flags = irq_save_and_disable();
+        auto ts = get_per_cpu_ptr(tick_sched);
+
+        pulse.flags = CLOCKEVENT_FLAG_PULSE;
+        test->stopped = tick_stop_busy(ts, &pulse);
+        test->state = ts->state;
+
+        if (test->stopped)
+        {
+            /* The real pulse is still queued, so undo it by hand instead of going through
+             * tick_nohz_task_switch().
+             */
+            __atomic_store_n(&ts->state, TICK_RUNNING, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&nr_busy_stopped, 1, __ATOMIC_RELAXED);
+        }
+
+        irq_restore(flags);
+
+        if (!test->stopped)
+            sched_sleep_ms(10);
+    }
+
+    test->done = true;
+    wait_queue_wake_all(&test->wq);
+    thread_exit();
+}
+
+TEST(tickless, busy_tick_stops_with_one_thread)
+{
+    struct tick_test test;
+    test.done = test.stopped = false;
+    test.state = TICK_RUNNING;
+
+    struct thread *t = sched_create_thread(tick_test_busy_thread, THREAD_KERNEL, &test);
+    ASSERT_NONNULL(t);
+
+    /* Run it by itself on a cpu that isn't ours, if there's one */
+    sched_start_thread_for_cpu(t, get_nr_cpus() - 1);
+
+    wait_for_event(&test.wq, __atomic_load_n(&test.done, __ATOMIC_ACQUIRE));
+
+    /* The idle thread is always queued behind the running thread, and mustn't keep the tick on */
+    EXPECT_TRUE(test.stopped);
+    EXPECT_EQ((int) TICK_STOPPED_BUSY, test.state);
+}
+
+#endif
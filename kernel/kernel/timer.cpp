@@ -1,25 +1,432 @@
 /*
- * Copyright (c) 2019 - 2022 Pedro Falcato
+ * Copyright (c) 2019 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  *
  * SPDX-License-Identifier: MIT
  */
+#include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/kunit.h>
 #include <onyx/panic.h>
+#include <onyx/percpu.h>
 #include <onyx/process.h>
 #include <onyx/scoped_lock.h>
 #include <onyx/softirq.h>
 #include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
 #include <onyx/timer.h>
 #include <onyx/user.h>
 #include <onyx/vm.h>
 
 #include <uapi/time.h>
 
+#include <onyx/utility.hpp>
+
+/* Timers come in two flavours:
+ *  - hrtimers, kept in a per-cpu pairing heap ordered by deadline + slack. Insertion is O(1),
+ *    removal is O(log n) amortized.
+ *  - coarse timers (CLOCKEVENT_FLAG_COARSE), kept in a per-cpu hierarchical timer wheel, like
+ *    linux's. Insertion and removal are O(1), and timers never cascade, at the cost of firing up
+ *    to 12.5% late. Most coarse timers (retransmits, expiries) get cancelled before they fire.
+ */
+
+static PER_CPU_VAR(struct timer *cpu_timer);
+
+#define LVL_SHIFT(n)   ((n) * TIMER_WHEEL_LVL_CLK_SHIFT)
+#define LVL_GRAN(n)    (1UL << LVL_SHIFT(n))
+#define LVL_OFFS(n)    ((n) * TIMER_WHEEL_LVL_SIZE)
+#define LVL_MASK       (TIMER_WHEEL_LVL_SIZE - 1)
+#define LVL_CLK_DIV    (1UL << TIMER_WHEEL_LVL_CLK_SHIFT)
+#define LVL_CLK_MASK   (LVL_CLK_DIV - 1)
+/* First tick delta that goes to level n (for n > 0) */
+#define LVL_START(n)   ((TIMER_WHEEL_LVL_SIZE - 1) << (((n) - 1) * TIMER_WHEEL_LVL_CLK_SHIFT))
+#define WHEEL_CUTOFF   LVL_START(TIMER_WHEEL_LVL_DEPTH)
+#define WHEEL_MAX_TIME (WHEEL_CUTOFF - LVL_GRAN(TIMER_WHEEL_LVL_DEPTH - 1))
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+static void __timer_init(struct timer *t)
+{
+    t->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
+    t->hrtimers = nullptr;
+    INIT_LIST_HEAD(&t->softirq_list);
+    spinlock_init(&t->event_list_lock);
+    memset(&t->stats, 0, sizeof(t->stats));
+
+    auto &w = t->wheel;
+    /* The clock gets forwarded on the first insertion */
+    w.clk = 0;
+    w.next_expiry = ULONG_MAX;
+    w.nr_events = 0;
+    memset(w.pending, 0, sizeof(w.pending));
+    for (auto &b : w.buckets)
+        INIT_LIST_HEAD(&b);
+}
+
+void timer_init(struct timer *t)
+{
+    __timer_init(t);
+    write_per_cpu(cpu_timer, t);
+}
+
+static hrtime_t clockevent_expiry(const struct clockevent *ev)
+{
+    hrtime_t expiry = ev->deadline + ev->slack;
+    /* Saturate, deadlines close to UINT64_MAX are a thing */
+    return expiry < ev->deadline ? UINT64_MAX : expiry;
+}
+
+static struct clockevent *heap_meld(struct clockevent *a, struct clockevent *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (clockevent_expiry(b) < clockevent_expiry(a))
+    {
+        auto tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    /* b becomes a's first child */
+    b->heap_prev = a;
+    b->heap_next = a->heap_child;
+    if (a->heap_child)
+        a->heap_child->heap_prev = b;
+    a->heap_child = b;
+    return a;
+}
+
+/**
+ * @brief Merge a list of siblings into a single heap, using the standard two-pass pairing.
+ *
+ * @param first First sibling
+ * @return The new root
+ */
+static struct clockevent *heap_merge_pairs(struct clockevent *first)
+{
+    struct clockevent *pairs = nullptr;
+
+    /* Left to right, meld pairs of siblings, stacking the results up */
+    while (first)
+    {
+        auto a = first;
+        auto b = a->heap_next;
+        first = b ? b->heap_next : nullptr;
+
+        a->heap_next = a->heap_prev = nullptr;
+        if (b)
+            b->heap_next = b->heap_prev = nullptr;
+
+        auto m = heap_meld(a, b);
+        m->heap_next = pairs;
+        pairs = m;
+    }
+
+    /* Right to left, meld everything into one */
+    struct clockevent *root = nullptr;
+    while (pairs)
+    {
+        auto next = pairs->heap_next;
+        pairs->heap_next = nullptr;
+        root = heap_meld(root, pairs);
+        pairs = next;
+    }
+
+    return root;
+}
+
+static void heap_insert(struct timer *t, struct clockevent *ev)
+{
+    ev->heap_child = ev->heap_next = ev->heap_prev = nullptr;
+    t->hrtimers = heap_meld(t->hrtimers, ev);
+
+    if (++t->stats.nr_hrtimers > t->stats.max_hrtimers)
+        t->stats.max_hrtimers = t->stats.nr_hrtimers;
+}
+
+static void heap_remove(struct timer *t, struct clockevent *ev)
+{
+    auto children = heap_merge_pairs(ev->heap_child);
+    ev->heap_child = nullptr;
+
+    if (t->hrtimers == ev)
+        t->hrtimers = children;
+    else
+    {
+        /* Cut ev (and its subtree) off from its parent or left sibling */
+        if (ev->heap_prev->heap_child == ev)
+            ev->heap_prev->heap_child = ev->heap_next;
+        else
+            ev->heap_prev->heap_next = ev->heap_next;
+
+        if (ev->heap_next)
+            ev->heap_next->heap_prev = ev->heap_prev;
+
+        t->hrtimers = heap_meld(t->hrtimers, children);
+    }
+
+    ev->heap_next = ev->heap_prev = nullptr;
+    t->stats.nr_hrtimers--;
+}
+
+static unsigned int wheel_calc_index(unsigned long expires, unsigned int lvl,
+                                     unsigned long *bucket_expiry)
+{
+    /* Round up to the level's granularity, so the timer never fires early */
+    expires = (expires + LVL_GRAN(lvl)) >> LVL_SHIFT(lvl);
+    *bucket_expiry = expires << LVL_SHIFT(lvl);
+    return LVL_OFFS(lvl) + (expires & LVL_MASK);
+}
+
+static unsigned int wheel_index(unsigned long expires, unsigned long clk,
+                                unsigned long *bucket_expiry)
+{
+    if ((long) (expires - clk) < 0)
+    {
+        /* Already expired, handle it on the next tick */
+        *bucket_expiry = clk;
+        return clk & LVL_MASK;
+    }
+
+    const unsigned long delta = expires - clk;
+
+    for (unsigned int lvl = 0; lvl < TIMER_WHEEL_LVL_DEPTH - 1; lvl++)
+    {
+        if (delta < LVL_START(lvl + 1))
+            return wheel_calc_index(expires, lvl, bucket_expiry);
+    }
+
+    /* Anything further out than the wheel can hold gets clamped to the wheel's capacity */
+    if (delta >= WHEEL_CUTOFF)
+        expires = clk + WHEEL_MAX_TIME;
+
+    return wheel_calc_index(expires, TIMER_WHEEL_LVL_DEPTH - 1, bucket_expiry);
+}
+
+/**
+ * @brief Catch the wheel's clock up to the current time, if it has been idle.
+ * Timeouts are relative to the wheel's clock, so a stale clock would make them too coarse.
+ *
+ * @param w Timer wheel
+ * @param now Current tick
+ */
+static void wheel_forward(struct timer_wheel *w, unsigned long now)
+{
+    if (now <= w->clk)
+        return;
+
+    w->clk = w->next_expiry > now ? now : w->next_expiry;
+}
+
+static void wheel_insert(struct timer *t, struct clockevent *ev, unsigned long now)
+{
+    auto w = &t->wheel;
+    unsigned long bucket_expiry;
+
+    wheel_forward(w, now);
+
+    const unsigned int idx = wheel_index(ev->deadline / TIMER_WHEEL_TICK, w->clk, &bucket_expiry);
+    list_add_tail(&ev->list_node, &w->buckets[idx]);
+    w->pending[idx / BITS_PER_LONG] |= 1UL << (idx % BITS_PER_LONG);
+    ev->wheel_idx = idx;
+
+    if (bucket_expiry < w->next_expiry)
+        w->next_expiry = bucket_expiry;
+
+    w->nr_events++;
+    if (++t->stats.nr_wheel > t->stats.max_wheel)
+        t->stats.max_wheel = t->stats.nr_wheel;
+}
+
+static void wheel_remove(struct timer *t, struct clockevent *ev)
+{
+    auto w = &t->wheel;
+    const unsigned int idx = ev->wheel_idx;
+
+    list_remove(&ev->list_node);
+    if (list_is_empty(&w->buckets[idx]))
+        w->pending[idx / BITS_PER_LONG] &= ~(1UL << (idx % BITS_PER_LONG));
+
+    /* next_expiry is allowed to be stale (early), we'll just find an empty bucket */
+    w->nr_events--;
+    t->stats.nr_wheel--;
+}
+
+static unsigned int wheel_find_next_bit(const unsigned long *bitmap, unsigned int start,
+                                        unsigned int end)
+{
+    while (start < end)
+    {
+        unsigned long word = bitmap[start / BITS_PER_LONG] >> (start % BITS_PER_LONG);
+        if (word)
+        {
+            start += __builtin_ctzl(word);
+            return start < end ? start : end;
+        }
+
+        start = (start / BITS_PER_LONG + 1) * BITS_PER_LONG;
+    }
+
+    return end;
+}
+
+/**
+ * @brief Find the next pending bucket in a level, starting from clk (and wrapping around).
+ *
+ * @return Distance from clk to the bucket, or -1 if the level is empty
+ */
+static int wheel_next_pending_bucket(const struct timer_wheel *w, unsigned int offset,
+                                     unsigned int clk)
+{
+    const unsigned int start = offset + clk;
+    const unsigned int end = offset + TIMER_WHEEL_LVL_SIZE;
+
+    unsigned int pos = wheel_find_next_bit(w->pending, start, end);
+    if (pos != end)
+        return pos - start;
+
+    pos = wheel_find_next_bit(w->pending, offset, start);
+    return pos != start ? (int) (pos + TIMER_WHEEL_LVL_SIZE - start) : -1;
+}
+
+/**
+ * @brief Find the tick at which the next bucket needs processing.
+ *
+ * @param w Timer wheel
+ * @return Tick, or ULONG_MAX if the wheel is empty
+ */
+static unsigned long wheel_next_expiry(const struct timer_wheel *w)
+{
+    if (!w->nr_events)
+        return ULONG_MAX;
+
+    unsigned long clk = w->clk;
+    unsigned long next = ULONG_MAX;
+    unsigned int offset = 0;
+
+    for (unsigned int lvl = 0; lvl < TIMER_WHEEL_LVL_DEPTH; lvl++, offset += TIMER_WHEEL_LVL_SIZE)
+    {
+        const int pos = wheel_next_pending_bucket(w, offset, clk & LVL_MASK);
+        const unsigned long lvl_clk = clk & LVL_CLK_MASK;
+
+        if (pos >= 0)
+        {
+            const unsigned long tmp = (clk + pos) << LVL_SHIFT(lvl);
+            if (tmp < next)
+                next = tmp;
+
+            /* If the bucket comes before the next level's clock would tick, nothing in the
+             * upper levels can expire earlier.
+             */
+            if ((unsigned long) pos <= ((LVL_CLK_DIV - lvl_clk) & LVL_CLK_MASK))
+                break;
+        }
+
+        /* The next level's clock only covers the current one if we're at a boundary.
+         * Otherwise, its current bucket is already in the past, so look from the next one.
+         */
+        clk >>= TIMER_WHEEL_LVL_CLK_SHIFT;
+        clk += lvl_clk != 0;
+    }
+
+    return next;
+}
+
+/**
+ * @brief Move every event in the buckets that expire at w->clk to a list.
+ */
+static void wheel_collect(struct timer *t, struct list_head *expired)
+{
+    auto w = &t->wheel;
+    unsigned long clk = w->clk;
+
+    for (unsigned int lvl = 0; lvl < TIMER_WHEEL_LVL_DEPTH; lvl++)
+    {
+        const unsigned int idx = LVL_OFFS(lvl) + (clk & LVL_MASK);
+        auto bucket = &w->buckets[idx];
+
+        if (w->pending[idx / BITS_PER_LONG] & (1UL << (idx % BITS_PER_LONG)))
+        {
+            w->pending[idx / BITS_PER_LONG] &= ~(1UL << (idx % BITS_PER_LONG));
+            list_for_every_safe (bucket)
+            {
+                struct clockevent *ev = container_of(l, struct clockevent, list_node);
+                list_remove(&ev->list_node);
+                list_add_tail(&ev->list_node, expired);
+                w->nr_events--;
+                t->stats.nr_wheel--;
+                t->stats.wheel_expirations++;
+            }
+        }
+
+        /* Upper levels only get looked at when the lower level's clock wraps */
+        if (clk & LVL_CLK_MASK)
+            break;
+        clk >>= TIMER_WHEEL_LVL_CLK_SHIFT;
+    }
+}
+
+static void wheel_run(struct timer *t, struct list_head *expired, unsigned long now)
+{
+    auto w = &t->wheel;
+
+    while (w->nr_events && w->next_expiry <= now)
+    {
+        w->clk = w->next_expiry;
+        wheel_collect(t, expired);
+        w->clk++;
+        w->next_expiry = wheel_next_expiry(w);
+    }
+
+    if (!w->nr_events)
+        w->next_expiry = ULONG_MAX;
+
+    wheel_forward(w, now);
+}
+
+/**
+ * @brief Get the next time the timer needs to go off.
+ */
+static hrtime_t timer_next_expiry(const struct timer *t)
+{
+    hrtime_t next = TIMER_NEXT_EVENT_NOT_PENDING;
+
+    if (t->hrtimers)
+        next = clockevent_expiry(t->hrtimers);
+
+    if (t->wheel.next_expiry != ULONG_MAX)
+    {
+        const hrtime_t wheel_next = t->wheel.next_expiry * TIMER_WHEEL_TICK;
+        if (wheel_next < next)
+            next = wheel_next;
+    }
+
+    return next;
+}
+
+static void timer_enqueue(struct timer *t, struct clockevent *ev)
+{
+    if (ev->flags & CLOCKEVENT_FLAG_COARSE)
+        wheel_insert(t, ev, clocksource_get_time() / TIMER_WHEEL_TICK);
+    else
+        heap_insert(t, ev);
+
+    ev->timer = t;
+    ev->flags |= CLOCKEVENT_FLAG_POISON;
+}
+
 void timer_queue_clockevent(struct clockevent *ev)
 {
     auto timer = platform_get_timer();
@@ -30,16 +437,13 @@ void timer_queue_clockevent(struct clockevent *ev)
     if (ev->flags & CLOCKEVENT_FLAG_POISON)
         panic("Tried to queue clockevent that's already queued");
 
-    ev->timer = timer;
+    timer_enqueue(timer, ev);
 
-    list_add_tail(&ev->list_node, &timer->event_list);
-
-    ev->flags |= CLOCKEVENT_FLAG_POISON;
-
-    if (timer->next_event > ev->deadline)
+    const hrtime_t next = timer_next_expiry(timer);
+    if (timer->next_event > next)
     {
-        timer->next_event = ev->deadline;
-        timer->set_oneshot(ev->deadline);
+        timer->next_event = next;
+        timer->set_oneshot(next);
     }
 }
 
@@ -53,46 +457,65 @@ void timer_handle_events(struct timer *t)
 {
     bool atomic_context = irq_is_disabled();
     bool has_raised_softirq = false;
-    struct list_head to_handle;
-    INIT_LIST_HEAD(&to_handle);
+    DEFINE_LIST(expired);
+    DEFINE_LIST(to_handle);
 
     auto current_time = clocksource_get_time();
 
     unsigned long cpu_flags = spin_lock_irqsave(&t->event_list_lock);
 
-    hrtime_t lowest = UINT64_MAX;
+    /* Anything whose deadline passed goes, even if the timer was programmed for its
+     * deadline + slack. That's what makes the slack useful.
+     */
+    while (t->hrtimers && t->hrtimers->deadline <= current_time)
+    {
+        auto ev = t->hrtimers;
+        if (clockevent_expiry(ev) > current_time)
+            t->stats.coalesced++;
+        heap_remove(t, ev);
+        list_add_tail(&ev->list_node, &expired);
+        t->stats.hrtimer_expirations++;
+    }
+
+    wheel_run(t, &expired, current_time / TIMER_WHEEL_TICK);
 
-    list_for_every_safe (&t->event_list)
+    if (!atomic_context)
     {
-        struct clockevent *ev = container_of(l, struct clockevent, list_node);
-        if (ev->deadline > current_time)
+        /* Pick up whatever was left for us by the timer interrupt */
+        list_for_every_safe (&t->softirq_list)
         {
-            lowest = lowest < ev->deadline ? lowest : ev->deadline;
-            continue;
+            struct clockevent *ev = container_of(l, struct clockevent, list_node);
+            list_remove(&ev->list_node);
+            ev->flags &= ~CLOCKEVENT_FLAG_PENDING;
+            ev->timer = nullptr;
+            list_add_tail(&ev->list_node, &to_handle);
+            t->stats.softirq_expirations++;
         }
+    }
+
+    list_for_every_safe (&expired)
+    {
+        struct clockevent *ev = container_of(l, struct clockevent, list_node);
+        list_remove(&ev->list_node);
 
         if (ev->flags & CLOCKEVENT_FLAG_ATOMIC)
         {
             ev->callback(ev);
-            if (!(ev->flags & CLOCKEVENT_FLAG_PULSE))
-            {
-                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
-                list_remove(&ev->list_node);
-            }
+            if (ev->flags & CLOCKEVENT_FLAG_PULSE)
+                timer_enqueue(t, ev);
             else
-            {
-                lowest = lowest < ev->deadline ? lowest : ev->deadline;
-            }
+                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
         }
         else if (!atomic_context)
         {
             ev->timer = nullptr;
-            list_remove(&ev->list_node);
             list_add_tail(&ev->list_node, &to_handle);
         }
         else
         {
+            /* Still POISON, so timer_cancel_event can take it off the softirq list */
             ev->flags |= CLOCKEVENT_FLAG_PENDING;
+            list_add_tail(&ev->list_node, &t->softirq_list);
             if (!has_raised_softirq)
             {
                 has_raised_softirq = true;
@@ -101,16 +524,13 @@ void timer_handle_events(struct timer *t)
         }
     }
 
-    if (lowest == UINT64_MAX)
-    {
-        t->next_event = TIMER_NEXT_EVENT_NOT_PENDING;
+    const hrtime_t next = timer_next_expiry(t);
+    t->next_event = next;
+
+    if (next == TIMER_NEXT_EVENT_NOT_PENDING)
         timer_disable(t);
-    }
     else
-    {
-        t->next_event = lowest;
-        t->set_oneshot(lowest);
-    }
+        t->set_oneshot(next);
 
     spin_unlock_irqrestore(&t->event_list_lock, cpu_flags);
 
@@ -120,22 +540,13 @@ void timer_handle_events(struct timer *t)
         list_for_every_safe (&to_handle)
         {
             struct clockevent *ev = container_of(l, struct clockevent, list_node);
+            list_remove(&ev->list_node);
 
             ev->callback(ev);
 
-            ev->flags &= ~CLOCKEVENT_FLAG_PENDING;
-            if (!(ev->flags & CLOCKEVENT_FLAG_PULSE))
-            {
-                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
-                list_remove(&to_handle);
-                ev->timer = nullptr;
-            }
-            else
-            {
-                ev->flags &= ~CLOCKEVENT_FLAG_POISON;
+            ev->flags &= ~CLOCKEVENT_FLAG_POISON;
+            if (ev->flags & CLOCKEVENT_FLAG_PULSE)
                 timer_queue_clockevent(ev);
-                lowest = lowest < ev->deadline ? lowest : ev->deadline;
-            }
         }
     }
 }
@@ -145,10 +556,10 @@ void timer_cancel_event(struct clockevent *ev)
     scoped_lock<spinlock, true> g{ev->lock};
     auto timer = ev->timer;
 
-    /* ev->timer is set after list_remove up there, therefore we check first
-     * if ev->timer is nullptr. If so, it's not in there and we don't need to lock.
-     * If it's set, we lock the event list, and recheck for CLOCKEVENT_POISON; if it's set,
-     * the event is still in there and we need to list_remove it.
+    /* ev->timer is cleared when the event is handed over to softirq-context handling,
+     * therefore we check first if ev->timer is nullptr. If so, it's not queued and we don't
+     * need to lock. If it's set, we lock the timer, and recheck for CLOCKEVENT_POISON; if it's
+     * set, the event is still queued and we need to remove it.
      */
     if (timer != nullptr && ev->flags & CLOCKEVENT_FLAG_POISON)
     {
@@ -156,14 +567,102 @@ void timer_cancel_event(struct clockevent *ev)
 
         if (ev->flags & CLOCKEVENT_FLAG_POISON)
         {
-            list_remove(&ev->list_node);
-            ev->flags &= ~CLOCKEVENT_FLAG_POISON;
+            if (ev->flags & CLOCKEVENT_FLAG_PENDING)
+                list_remove(&ev->list_node);
+            else if (ev->flags & CLOCKEVENT_FLAG_COARSE)
+                wheel_remove(timer, ev);
+            else
+                heap_remove(timer, ev);
+
+            ev->flags &= ~(CLOCKEVENT_FLAG_POISON | CLOCKEVENT_FLAG_PENDING);
         }
 
+        /* We don't bother reprogramming the timer, it'll just find nothing to do */
         spin_unlock_irqrestore(&timer->event_list_lock, cpu_flags);
     }
 }
 
+void timer_reprogram(struct timer *t)
+{
+    scoped_lock<spinlock, true> g{t->event_list_lock};
+
+    const hrtime_t next = timer_next_expiry(t);
+    if (next == t->next_event)
+        return;
+
+    t->next_event = next;
+    if (next == TIMER_NEXT_EVENT_NOT_PENDING)
+        timer_disable(t);
+    else
+        t->set_oneshot(next);
+}
+
+void timer_mod_event(struct clockevent *ev, hrtime_t deadline)
+{
+    timer_cancel_event(ev);
+    ev->deadline = deadline;
+    timer_queue_clockevent(ev);
+}
+
+static ssize_t timer_stats_print(void *buffer, size_t size, off_t off)
+{
+    const unsigned int nr_cpus = get_nr_cpus();
+    const size_t buflen = 224 * (nr_cpus + 1);
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = snprintf(buf, buflen, "cpu hrtimer_exp wheel_exp coalesced softirq_exp "
+                                       "hrtimers max_hrtimers wheel max_wheel tick_stops "
+                                       "ticks_skipped_idle ticks_skipped_busy\n");
+
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+    {
+        struct timer *t = get_per_cpu_any(cpu_timer, cpu);
+        if (!t)
+            continue;
+
+        const struct timer_stats &s = t->stats;
+        len += snprintf(buf + len, buflen - len,
+                        "%u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", cpu,
+                        s.hrtimer_expirations, s.wheel_expirations, s.coalesced,
+                        s.softirq_expirations, s.nr_hrtimers, s.max_hrtimers, s.nr_wheel,
+                        s.max_wheel, s.tick_stops, s.ticks_skipped_idle, s.ticks_skipped_busy);
+        if (len >= buflen)
+        {
+            len = buflen - 1;
+            break;
+        }
+    }
+
+    ssize_t st = 0;
+    if ((size_t) off < len)
+    {
+        size_t to_copy = cul::min(len - off, size);
+        st = copy_to_user(buffer, buf + off, to_copy) < 0 ? -EFAULT : (ssize_t) to_copy;
+    }
+
+    free(buf);
+    return st;
+}
+
+static struct sysfs_object timer_obj;
+static struct sysfs_object timer_stats_file;
+
+static void timer_sysfs_init()
+{
+    assert(sysfs_object_init("timer", &timer_obj) == 0);
+    timer_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("stats", &timer_stats_file, &timer_obj) == 0);
+    timer_stats_file.read = timer_stats_print;
+    timer_stats_file.perms = 0444 | S_IFREG;
+
+    sysfs_add(&timer_obj, nullptr);
+}
+
+INIT_LEVEL_CORE_KERNEL_ENTRY(timer_sysfs_init);
+
 void itimer_init(struct process *p)
 {
     int timer_whichs[3] = {ITIMER_REAL, ITIMER_VIRTUAL, ITIMER_PROF};
@@ -321,3 +820,76 @@ int sys_setitimer(int which, const struct itimerval *new_value, struct itimerval
 
     return st;
 }
+
+#ifdef CONFIG_KUNIT
+
+TEST(timer, hrtimer_heap_orders_by_slack)
+{
+    struct timer *t = (struct timer *) malloc(sizeof(struct timer));
+    ASSERT_NONNULL(t);
+    __timer_init(t);
+
+    clockevent evs[4] = {};
+    const hrtime_t deadlines[4] = {400, 100, 300, 200};
+    const hrtime_t slacks[4] = {0, 250, 0, 0};
+
+    for (int i = 0; i < 4; i++)
+    {
+        evs[i].deadline = deadlines[i];
+        evs[i].slack = slacks[i];
+        heap_insert(t, &evs[i]);
+    }
+
+    EXPECT_EQ(4UL, t->stats.nr_hrtimers);
+
+    /* evs[1] expires at 100 + 250, after evs[3] and evs[2] */
+    EXPECT_EQ(&evs[3], t->hrtimers);
+    heap_remove(t, &evs[2]);
+    EXPECT_EQ(&evs[3], t->hrtimers);
+    heap_remove(t, &evs[3]);
+    EXPECT_EQ(&evs[1], t->hrtimers);
+    heap_remove(t, &evs[1]);
+    EXPECT_EQ(&evs[0], t->hrtimers);
+    heap_remove(t, &evs[0]);
+    EXPECT_NULL(t->hrtimers);
+    EXPECT_EQ(0UL, t->stats.nr_hrtimers);
+
+    free(t);
+}
+
+TEST(timer, wheel_never_fires_early)
+{
+    struct timer *t = (struct timer *) malloc(sizeof(struct timer));
+    ASSERT_NONNULL(t);
+    __timer_init(t);
+
+    const unsigned long timeouts[] = {1, 63, 64, 200, 5000, 100000};
+    clockevent evs[6] = {};
+
+    for (int i = 0; i < 6; i++)
+    {
+        evs[i].deadline = timeouts[i] * TIMER_WHEEL_TICK;
+        evs[i].flags = CLOCKEVENT_FLAG_COARSE;
+        wheel_insert(t, &evs[i], 0);
+    }
+
+    for (int i = 0; i < 6; i++)
+    {
+        DEFINE_LIST(expired);
+        auto &w = t->wheel;
+        const unsigned long next = w.next_expiry;
+
+        /* Expires no earlier than its timeout, no later than 1/8th of it on top */
+        EXPECT_LE(timeouts[i], next);
+        EXPECT_GE(timeouts[i] + timeouts[i] / 8 + 1, next);
+
+        wheel_run(t, &expired, next);
+        ASSERT_FALSE(list_is_empty(&expired));
+        EXPECT_EQ(&evs[i].list_node, list_first_element(&expired));
+    }
+
+    EXPECT_EQ(0UL, t->wheel.nr_events);
+    free(t);
+}
+
+#endif
@@ -6,8 +6,8 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <onyx/dpc.h>
 #include <onyx/serial.h>
+#include <onyx/workqueue.h>
 
 static ssize_t serial_write_tty(const void *buffer, size_t size, struct tty *tty)
 {
@@ -64,9 +64,9 @@ void serial_port::dispatch()
     }
 }
 
-void do_dispatch(void *ctx)
+void serial_port::rx_work_fn(work_struct *work)
 {
-    serial_port *port = (serial_port *) ctx;
+    serial_port *port = container_of(work, serial_port, rx_work);
     port->dispatch();
 }
 
@@ -80,10 +80,6 @@ void serial_port::receive_byte(uint8_t data)
         byte_buf[byte_buf_size++] = data;
     }
 
-    struct dpc_work work;
-    work.context = (void *) this;
-
-    work.funcptr = do_dispatch;
-
-    dpc_schedule_work(&work, DPC_PRIORITY_HIGH);
+    /* If it's already queued, the bytes will get picked up along with the others */
+    queue_work(system_highpri_wq, &rx_work);
 }
@@ -15,7 +15,6 @@
 #include <uapi/ioctls.h>
 #include <onyx/types.h>
 
-#include <onyx/dpc.h>
 #include <onyx/font.h>
 #include <onyx/framebuffer.h>
 #include <onyx/init.h>
@@ -69,11 +68,6 @@ struct console_cell
     uint32_t flags;
 };
 
-static inline void vterm_set_dirty(struct console_cell *c)
-{
-    c->flags |= VTERM_CONSOLE_CELL_DIRTY;
-}
-
 static inline void vterm_clear_dirty(struct console_cell *c)
 {
     c->flags &= ~VTERM_CONSOLE_CELL_DIRTY;
@@ -84,6 +78,26 @@ static inline bool vterm_is_dirty(struct console_cell *c)
     return c->flags & VTERM_CONSOLE_CELL_DIRTY;
 }
 
+/* The font's glyphs are 8x16 */
+#define VTERM_GLYPH_WIDTH  8
+#define VTERM_GLYPH_HEIGHT 16
+
+/* Must be a power of 2 */
+#define VTERM_GLYPH_CACHE_SIZE 256
+
+/**
+ * @brief A glyph rendered in some colours, in the framebuffer's pixel format.
+ * Drawing a cell then comes down to copying VTERM_GLYPH_HEIGHT rows of pixels out.
+ */
+struct vterm_glyph
+{
+    uint32_t codepoint;
+    uint32_t fg;
+    uint32_t bg;
+    bool valid;
+    uint8_t pixels[VTERM_GLYPH_HEIGHT * VTERM_GLYPH_WIDTH * sizeof(uint32_t)];
+};
+
 #define VTERM_MESSAGE_FLUSH     1
 #define VTERM_MESSAGE_FLUSH_ALL 2
 #define VTERM_MESSAGE_DIE       3
@@ -96,6 +110,10 @@ struct vterm_message
 };
 
 #define MAX_ARGS 4
+
+/* Must be a power of 2 */
+#define VTERM_INPUT_QUEUE_SIZE 64
+
 struct vterm
 {
     struct mutex vt_lock;
@@ -120,6 +138,20 @@ struct vterm
     // Buffer used for any multibyte buffering for utf8
     char multibyte_buffer[10];
 
+    /* Rows [dirty_top, dirty_bottom) may have dirty cells */
+    unsigned int dirty_top, dirty_bottom;
+    /* Number of lines the cells got scrolled up by (down, if negative) since the last flush. The
+     * framebuffer gets scrolled to match on the next one.
+     */
+    int pending_scroll;
+    struct vterm_glyph *glyph_cache;
+
+    /* Key actions waiting to be handed to the tty, see vterm_handle_key */
+    struct spinlock input_lock;
+    const char *input_queue[VTERM_INPUT_QUEUE_SIZE];
+    unsigned int input_head, input_tail;
+    struct work_struct input_work;
+
     bool in_escape;
     bool seq_finished;
     bool in_csi;
@@ -152,6 +184,18 @@ private:
     void repeat_last(unsigned long nr);
 };
 
+static inline void vterm_set_dirty(struct console_cell *c, struct vterm *vt)
+{
+    unsigned int row = (c - vt->cells) / vt->columns;
+
+    c->flags |= VTERM_CONSOLE_CELL_DIRTY;
+
+    if (row < vt->dirty_top)
+        vt->dirty_top = row;
+    if (row >= vt->dirty_bottom)
+        vt->dirty_bottom = row + 1;
+}
+
 void vterm_append_msg(struct vterm *vterm, struct vterm_message *msg)
 {
     mutex_lock(&vterm->condvar_mutex);
@@ -193,68 +237,147 @@ static inline uint32_t unpack_rgba(struct color color, struct framebuffer *fb)
     return c;
 }
 
-static void draw_char(uint32_t c, unsigned int x, unsigned int y, struct framebuffer *fb,
-                      struct color fg, struct color bg)
+/**
+ * @brief Get a glyph rendered in the given colours, rendering it if it's not cached
+ *
+ * @param c Codepoint
+ * @param fg Foreground colour, in the framebuffer's format
+ * @param bg Background colour, in the framebuffer's format
+ * @param vt Virtual terminal
+ * @return The rendered glyph
+ */
+static const struct vterm_glyph *vterm_get_glyph(uint32_t c, uint32_t fg, uint32_t bg,
+                                                 struct vterm *vt)
 {
     struct font *font = get_font_data();
+    struct framebuffer *fb = vt->fb;
 
     if (c >= font->chars)
         c = '?';
 
-    volatile char *buffer = (volatile char *) fb->framebuffer;
+    uint32_t hash = c ^ (fg * 0x9e3779b1) ^ (bg * 0x85ebca6b);
+    hash ^= hash >> 16;
 
-    buffer += y * fb->pitch + x * (fb->bpp / 8);
+    struct vterm_glyph *g = &vt->glyph_cache[hash & (VTERM_GLYPH_CACHE_SIZE - 1)];
+    if (g->valid && g->codepoint == c && g->fg == fg && g->bg == bg)
+        return g;
 
-    unsigned int font_start = c * font->height;
+    const unsigned int bytes = fb->bpp / 8;
+    const unsigned char *bitmap = &font->font_bitmap[c * font->height];
+    uint8_t *p = g->pixels;
 
-    for (int i = 0; i < 16; i++)
+    for (unsigned int i = 0; i < VTERM_GLYPH_HEIGHT; i++)
     {
-        for (int j = 0; j < 8; j++)
+        for (unsigned int j = 0; j < VTERM_GLYPH_WIDTH; j++)
         {
-            struct color color;
-            unsigned char f = font->font_bitmap[font_start + i];
-
-            if (f & font->mask[j])
-                color = fg;
-            else
-                color = bg;
-
-            uint32_t color_u32 = unpack_rgba(color, fb);
-            volatile uint32_t *b = (volatile uint32_t *) ((uint32_t *) buffer + j);
+            uint32_t color = bitmap[i] & font->mask[j] ? fg : bg;
 
-            /* If the bpp is 32 bits, we can just blit it out */
-            if (fb->bpp == 32)
-                mov_non_temporal(b, color_u32);
-            else
+            for (unsigned int k = 0; k < bytes; k++)
             {
-                volatile unsigned char *buf = (volatile unsigned char *) (buffer + j);
-                int bytes = fb->bpp / 8;
-                for (int k = 0; k < bytes; k++)
-                {
-                    buf[k] = color_u32;
-                    color_u32 >>= 8;
-                }
+                *p++ = color;
+                color >>= 8;
             }
         }
-
-        buffer = (volatile char *) (((char *) buffer) + fb->pitch);
     }
+
+    g->codepoint = c;
+    g->fg = fg;
+    g->bg = bg;
+    g->valid = true;
+    return g;
 }
 
-void do_vterm_flush_all(struct vterm *vterm)
+/* Cells get drawn in batches of this many, so the glyph pointers fit on the stack */
+#define VTERM_DRAW_BATCH 32
+
+/**
+ * @brief Draw a run of cells in a row. The pixels get written out one scanline at a time, left
+ * to right, so the framebuffer sees long sequential writes instead of a glyph at a time.
+ *
+ * @param x First column
+ * @param end One past the last column
+ * @param y Row
+ * @param vt Virtual terminal
+ */
+static void vterm_draw_span(unsigned int x, unsigned int end, unsigned int y, struct vterm *vt)
 {
-    struct font *f = get_font_data();
-    for (unsigned int i = 0; i < vterm->columns; i++)
+    struct framebuffer *fb = vt->fb;
+    const unsigned int row_bytes = VTERM_GLYPH_WIDTH * (fb->bpp / 8);
+    const struct vterm_glyph *glyphs[VTERM_DRAW_BATCH];
+
+    while (x < end)
     {
-        for (unsigned int j = 0; j < vterm->rows; j++)
+        const unsigned int nr = cul::min(end - x, (unsigned int) VTERM_DRAW_BATCH);
+        struct console_cell *cell = &vt->cells[y * vt->columns + x];
+
+        for (unsigned int i = 0; i < nr; i++)
         {
-            struct console_cell *cell = &vterm->cells[j * vterm->columns + i];
-            draw_char(cell->codepoint, i * f->width, j * f->height, vterm->fb, cell->fg, cell->bg);
-            vterm_clear_dirty(cell);
+            glyphs[i] = vterm_get_glyph(cell[i].codepoint, unpack_rgba(cell[i].fg, fb),
+                                        unpack_rgba(cell[i].bg, fb), vt);
+            vterm_clear_dirty(&cell[i]);
         }
+
+        char *line = (char *) fb->framebuffer + y * VTERM_GLYPH_HEIGHT * fb->pitch + x * row_bytes;
+
+        for (unsigned int i = 0; i < VTERM_GLYPH_HEIGHT; i++)
+        {
+            char *dst = line;
+
+            for (unsigned int j = 0; j < nr; j++)
+            {
+                memcpy(dst, glyphs[j]->pixels + i * row_bytes, row_bytes);
+                dst += row_bytes;
+            }
+
+            line += fb->pitch;
+        }
+
+        x += nr;
     }
 }
 
+/**
+ * @brief Catch the framebuffer up with the scrolls done to the cells since the last flush
+ *
+ * @param vt Virtual terminal
+ */
+static void vterm_apply_scroll(struct vterm *vt)
+{
+    int lines = vt->pending_scroll;
+    vt->pending_scroll = 0;
+
+    /* Scrolling a whole screen's worth leaves nothing to keep, and everything's dirty */
+    if (lines == 0 || (unsigned int) abs(lines) >= vt->rows)
+        return;
+
+    struct framebuffer *fb = vt->fb;
+    const size_t line_size = VTERM_GLYPH_HEIGHT * fb->pitch;
+    const size_t to_move = (vt->rows - abs(lines)) * line_size;
+    char *start = (char *) fb->framebuffer;
+
+    /* The lines that got exposed are dirty, and get drawn by the flush */
+    if (lines > 0)
+        memmove(start, start + lines * line_size, to_move);
+    else
+        memmove(start - lines * line_size, start, to_move);
+}
+
+static void vterm_reset_dirty(struct vterm *vt)
+{
+    vt->dirty_top = vt->rows;
+    vt->dirty_bottom = 0;
+}
+
+void do_vterm_flush_all(struct vterm *vterm)
+{
+    vterm->pending_scroll = 0;
+
+    for (unsigned int j = 0; j < vterm->rows; j++)
+        vterm_draw_span(0, vterm->columns, j, vterm);
+
+    vterm_reset_dirty(vterm);
+}
+
 void vterm_flush_all(struct vterm *vterm)
 {
     if (vterm->multithread_enabled)
@@ -263,33 +386,66 @@ void vterm_flush_all(struct vterm *vterm)
         do_vterm_flush_all(vterm);
 }
 
-void vterm_scroll(struct framebuffer *fb, struct vterm *vt)
+/**
+ * @brief Scroll the screen up
+ * The cells get moved right away, and the framebuffer on the next flush, with a single memmove of
+ * the pixel rows. Only the exposed lines need to be drawn.
+ *
+ * @param fb Framebuffer
+ * @param vt Virtual terminal
+ * @param nr Number of lines
+ */
+void vterm_scroll(struct framebuffer *fb, struct vterm *vt, unsigned int nr = 1)
 {
-    memcpy(vt->cells, vt->cells + vt->columns,
-           sizeof(struct console_cell) * (vt->rows - 1) * vt->columns);
+    nr = cul::min(nr, vt->rows);
 
-    for (unsigned int i = 0; i < vt->columns; i++)
+    memmove(vt->cells, vt->cells + nr * vt->columns,
+            sizeof(struct console_cell) * (vt->rows - nr) * vt->columns);
+
+    for (unsigned int i = (vt->rows - nr) * vt->columns; i < vt->rows * vt->columns; i++)
     {
-        struct console_cell *c = &vt->cells[(vt->rows - 1) * vt->columns + i];
+        struct console_cell *c = &vt->cells[i];
         c->codepoint = ' ';
         c->bg = vt->bg;
         c->fg = vt->fg;
+        c->flags = 0;
+        vterm_set_dirty(c, vt);
     }
+
+    /* Dirty cells moved up along with the rest */
+    vt->dirty_top = vt->dirty_top > nr ? vt->dirty_top - nr : 0;
+    vt->pending_scroll += nr;
 }
 
-void vterm_scroll_down(struct framebuffer *fb, struct vterm *vt)
+/**
+ * @brief Scroll the screen down
+ *
+ * @param fb Framebuffer
+ * @param vt Virtual terminal
+ * @param nr Number of lines
+ */
+void vterm_scroll_down(struct framebuffer *fb, struct vterm *vt, unsigned int nr = 1)
 {
-    memmove(vt->cells + vt->columns, vt->cells,
-            sizeof(struct console_cell) * (vt->rows - 1) * vt->columns);
+    nr = cul::min(nr, vt->rows);
 
-    for (unsigned int i = 0; i < vt->columns; i++)
+    memmove(vt->cells + nr * vt->columns, vt->cells,
+            sizeof(struct console_cell) * (vt->rows - nr) * vt->columns);
+
+    for (unsigned int i = 0; i < nr * vt->columns; i++)
     {
         struct console_cell *c = &vt->cells[i];
         c->codepoint = ' ';
         c->bg = vt->bg;
         c->fg = vt->fg;
+        c->flags = 0;
+        vterm_set_dirty(c, vt);
     }
+
+    /* Dirty cells moved down along with the rest */
+    vt->dirty_bottom = cul::min(vt->dirty_bottom + nr, vt->rows);
+    vt->pending_scroll -= nr;
 }
+
 void vterm_set_char(utf32_t c, unsigned int x, unsigned int y, struct color fg, struct color bg,
                     struct vterm *vterm)
 {
@@ -297,13 +453,13 @@ void vterm_set_char(utf32_t c, unsigned int x, unsigned int y, struct color fg,
     cell->codepoint = c;
     cell->fg = fg;
     cell->bg = bg;
-    vterm_set_dirty(cell);
+    vterm_set_dirty(cell, vterm);
 }
 
 void vterm_dirty_cell(unsigned int x, unsigned int y, struct vterm *vt)
 {
     struct console_cell *cell = &vt->cells[y * vt->columns + x];
-    vterm_set_dirty(cell);
+    vterm_set_dirty(cell, vt);
 }
 
 bool vterm_putc(utf32_t c, struct vterm *vt)
@@ -456,21 +612,32 @@ void vterm_flush(struct vterm *vterm);
 
 void do_vterm_flush(struct vterm *vterm)
 {
-    struct font *f = get_font_data();
-    for (unsigned int i = 0; i < vterm->columns; i++)
+    vterm_apply_scroll(vterm);
+
+    /* Draw every run of dirty cells in one go */
+    for (unsigned int j = vterm->dirty_top; j < vterm->dirty_bottom; j++)
     {
-        for (unsigned int j = 0; j < vterm->rows; j++)
-        {
-            struct console_cell *cell = &vterm->cells[j * vterm->columns + i];
+        struct console_cell *row = &vterm->cells[j * vterm->columns];
+        unsigned int i = 0;
 
-            if (vterm_is_dirty(cell))
+        while (i < vterm->columns)
+        {
+            if (!vterm_is_dirty(&row[i]))
             {
-                draw_char(cell->codepoint, i * f->width, j * f->height, vterm->fb, cell->fg,
-                          cell->bg);
-                vterm_clear_dirty(cell);
+                i++;
+                continue;
             }
+
+            unsigned int end = i + 1;
+            while (end < vterm->columns && vterm_is_dirty(&row[end]))
+                end++;
+
+            vterm_draw_span(i, end, j, vterm);
+            i = end;
         }
     }
+
+    vterm_reset_dirty(vterm);
 }
 
 void platform_serial_write(const char *s, size_t size);
@@ -493,7 +660,7 @@ void vterm_fill_screen(struct vterm *vterm, uint32_t character, struct color fg,
             cell->codepoint = character;
             cell->bg = bg;
             cell->fg = fg;
-            vterm_set_dirty(cell);
+            vterm_set_dirty(cell, vterm);
         }
     }
 }
@@ -717,7 +884,7 @@ void vterm_ansi_erase_in_line(unsigned long n, struct vterm *vt)
                 c->codepoint = ' ';
                 c->fg = vt->fg;
                 c->bg = vt->bg;
-                vterm_set_dirty(c);
+                vterm_set_dirty(c, vt);
             }
             break;
         }
@@ -732,7 +899,7 @@ void vterm_ansi_erase_in_line(unsigned long n, struct vterm *vt)
                 c->codepoint = ' ';
                 c->fg = vt->fg;
                 c->bg = vt->bg;
-                vterm_set_dirty(c);
+                vterm_set_dirty(c, vt);
             }
             break;
         }
@@ -745,7 +912,7 @@ void vterm_ansi_erase_in_line(unsigned long n, struct vterm *vt)
                 c->codepoint = ' ';
                 c->fg = vt->fg;
                 c->bg = vt->bg;
-                vterm_set_dirty(c);
+                vterm_set_dirty(c, vt);
             }
             break;
         }
@@ -772,7 +939,7 @@ void vterm_ansi_erase_in_display(unsigned long n, struct vterm *vt)
                 c->codepoint = ' ';
                 c->fg = vt->fg;
                 c->bg = vt->bg;
-                vterm_set_dirty(c);
+                vterm_set_dirty(c, vt);
             }
 
             break;
@@ -788,7 +955,7 @@ void vterm_ansi_erase_in_display(unsigned long n, struct vterm *vt)
                 c->codepoint = ' ';
                 c->fg = vt->fg;
                 c->bg = vt->bg;
-                vterm_set_dirty(c);
+                vterm_set_dirty(c, vt);
             }
 
             break;
@@ -827,7 +994,7 @@ void vterm_csi_delete_chars(unsigned long chars, struct vterm *vt)
             c->bg = vt->bg;
         }
 
-        vterm_set_dirty(c);
+        vterm_set_dirty(c, vt);
     }
 }
 
@@ -848,7 +1015,7 @@ void vterm::insert_blank(unsigned long nr)
             cell.bg = bg;
         }
 
-        vterm_set_dirty(&cell);
+        vterm_set_dirty(&cell, this);
     }
 }
 
@@ -1090,16 +1257,14 @@ void vterm::do_csi_command(char escape)
         }
 
         case ANSI_SCROLL_UP: {
-            for (unsigned long i = 0; i < args[0]; i++)
-                vterm_scroll(fb, this);
-            vterm_flush_all(this);
+            vterm_scroll(fb, this, cul::min(args[0], (unsigned long) rows));
+            vterm_flush(this);
             break;
         }
 
         case ANSI_SCROLL_DOWN: {
-            for (unsigned long i = 0; i < args[0]; i++)
-                vterm_scroll_down(fb, this);
-            vterm_flush_all(this);
+            vterm_scroll_down(fb, this, cul::min(args[0], (unsigned long) rows));
+            vterm_flush(this);
             break;
         }
 
@@ -1223,14 +1388,14 @@ void vterm::insert_lines(unsigned long nr)
         cell[i].fg = fg;
         cell[i].codepoint = ' ';
         cell[i].flags = 0;
-        vterm_set_dirty(&cell[i]);
+        vterm_set_dirty(&cell[i], this);
     }
 
     for (unsigned int i = moved_y; i < rows; i++)
     {
         for (unsigned int j = 0; j < columns; j++)
         {
-            vterm_set_dirty(&cells[i * columns + j]);
+            vterm_set_dirty(&cells[i * columns + j], this);
         }
     }
 }
@@ -1290,7 +1455,6 @@ ssize_t vterm_write_tty(const void *buffer, size_t size, struct tty *tty)
     mutex_lock(&vt->vt_lock);
     size_t i = 0;
     const char *data = (const char *) buffer;
-    bool did_scroll = false;
 
     for (; i < size; i++)
     {
@@ -1319,18 +1483,15 @@ ssize_t vterm_write_tty(const void *buffer, size_t size, struct tty *tty)
             platform_serial_write(x, strlen(x));
 #endif
             // platform_serial_write(data + i, 1);
-            if (vterm_putc(codepoint, vt))
-                did_scroll = true;
+            vterm_putc(codepoint, vt);
 
             /* We sub a 1 because we're incrementing on the for loop */
             i += codepoint_length - 1;
         }
     }
 
-    if (!did_scroll)
-        vterm_flush(vt);
-    else
-        vterm_flush_all(vt);
+    /* Scrolls are taken care of by the flush, no need to redraw everything */
+    vterm_flush(vt);
     update_cursor(vt);
 
     mutex_unlock(&vt->vt_lock);
@@ -1359,12 +1520,16 @@ unsigned int vterm_ioctl_tty(int request, void *argp, struct tty *tty)
     }
 }
 
+static void vterm_input_work(struct work_struct *work);
+
 void vterm_init(struct tty *tty)
 {
     struct vterm *vt = (vterm *) tty->priv;
 
     mutex_init(&vt->vt_lock);
     mutex_init(&vt->condvar_mutex);
+    spinlock_init(&vt->input_lock);
+    INIT_WORK(&vt->input_work, vterm_input_work);
 
     tty->is_vterm = true;
     struct framebuffer *fb = get_primary_framebuffer();
@@ -1377,6 +1542,12 @@ void vterm_init(struct tty *tty)
                                  VM_TYPE_REGULAR, VM_READ | VM_WRITE);
     assert(vt->cells != NULL);
 
+    vt->glyph_cache = (struct vterm_glyph *) vmalloc(
+        vm_size_to_pages(VTERM_GLYPH_CACHE_SIZE * sizeof(struct vterm_glyph)), VM_TYPE_REGULAR,
+        VM_READ | VM_WRITE);
+    assert(vt->glyph_cache != NULL);
+    vterm_reset_dirty(vt);
+
     vt->fg = default_fg;
     vt->bg = default_bg;
 
@@ -1545,10 +1716,23 @@ struct key_action pt_pt_key_actions[] = {
 
 const size_t nr_actions = sizeof(key_actions) / sizeof(key_actions[0]);
 
-void __vterm_receive_input(void *p)
+static void vterm_input_work(struct work_struct *work)
 {
-    char *s = (char *) p;
-    vterm_receive_input(s);
+    struct vterm *vt = container_of(work, struct vterm, input_work);
+
+    while (true)
+    {
+        const char *s;
+
+        {
+            scoped_lock<spinlock, true> g{vt->input_lock};
+            if (vt->input_head == vt->input_tail)
+                return;
+            s = vt->input_queue[vt->input_tail++ % VTERM_INPUT_QUEUE_SIZE];
+        }
+
+        tty_received_characters(vt->tty, (char *) s);
+    }
 }
 
 void sched_dump_threads(void);
@@ -1603,10 +1787,15 @@ int vterm_handle_key(struct vterm *vt, struct input_device *dev, struct input_ev
 
     if (likely(action_string))
     {
-        struct dpc_work w;
-        w.context = (void *) action_string;
-        w.funcptr = __vterm_receive_input;
-        dpc_schedule_work(&w, DPC_PRIORITY_MEDIUM);
+        {
+            scoped_lock<spinlock, true> g{vt->input_lock};
+            /* Drop keys if the queue is full, like a real keyboard would */
+            if (vt->input_head - vt->input_tail == VTERM_INPUT_QUEUE_SIZE)
+                return 0;
+            vt->input_queue[vt->input_head++ % VTERM_INPUT_QUEUE_SIZE] = action_string;
+        }
+
+        queue_work(system_wq, &vt->input_work);
     }
 
     return 0;
@@ -17,14 +17,11 @@
 #include <onyx/log.h>
 #include <onyx/mm/vm_object.h>
 #include <onyx/panic.h>
+#include <onyx/spinlock.h>
 #include <onyx/vdso.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 
-#ifdef __x86_64__
-#include <onyx/x86/tsc.h>
-#endif
-
 #include <sys/time.h>
 
 extern Elf64_Ehdr __vdso_start;
@@ -42,8 +39,9 @@ private:
     size_t length;
     vm_object *vmo;
     bool vdso_setup;
-    clock_time *clock_monotonic;
-    clock_time *clock_realtime;
+    vdso_data *data;
+    /* Serializes updates to data */
+    spinlock data_lock;
     unsigned long vdso_base;
     Elf64_Sym *vdso_symtab{nullptr};
     size_t nr_sym{0};
@@ -81,16 +79,27 @@ private:
         return true;
     }
 
+    void write_begin()
+    {
+        __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    void write_end()
+    {
+        __atomic_store_n(&data->seq, data->seq + 1, __ATOMIC_RELEASE);
+    }
+
 public:
     vdso(Elf64_Ehdr *start, size_t length)
-        : vdso_start{start}, length{length}, vmo{nullptr}, vdso_setup{false},
-          clock_monotonic{nullptr}, clock_realtime{nullptr}
+        : vdso_start{start}, length{length}, vmo{nullptr}, vdso_setup{false}, data{nullptr},
+          data_lock{}
     {
     }
 
     vdso()
-        : vdso_start{nullptr}, length{0}, vmo{nullptr}, vdso_setup{false}, clock_monotonic{nullptr},
-          clock_realtime{nullptr}
+        : vdso_start{nullptr}, length{0}, vmo{nullptr}, vdso_setup{false}, data{nullptr},
+          data_lock{}
     {
     }
 
@@ -117,6 +126,9 @@ public:
     }
 
     int update_time(clockid_t id, struct clock_time *time);
+    void update_clocksource(struct clocksource *clk);
+    void update_coarse(hrtime_t now);
+    void enable_getcpu();
 
     void *map();
 };
@@ -161,20 +173,16 @@ __attribute__((no_sanitize_undefined)) bool vdso::init()
     if (!create_vmo())
         return false;
 
-#ifdef __x86_64__
-    auto time = lookup_symbol<vdso_time *>("__time");
-    /* Configure the vdso with tsc stuff */
-    tsc_setup_vdso(time);
-#endif
+    data = lookup_symbol<vdso_data *>("__vdso_data");
+    if (!data)
+        return false;
 
-    clock_monotonic = lookup_symbol<clock_time *>("clock_monotonic");
-    clock_realtime = lookup_symbol<clock_time *>("clock_realtime");
+    vdso_setup = true;
 
     /* Update the vdso for the first time */
-    main_vdso.update_time(CLOCK_MONOTONIC, get_raw_clock_time(CLOCK_MONOTONIC));
-    main_vdso.update_time(CLOCK_REALTIME, get_raw_clock_time(CLOCK_REALTIME));
-
-    vdso_setup = true;
+    update_clocksource(get_main_clock());
+    update_time(CLOCK_REALTIME, get_raw_clock_time(CLOCK_REALTIME));
+    update_coarse(clocksource_get_time());
 
     return true;
 }
@@ -198,29 +206,80 @@ int vdso::update_time(clockid_t id, struct clock_time *time)
 {
     if (!vdso_setup)
         return 0;
-    /* First, get the corresponding symbol */
-    struct clock_time *t = NULL;
-    if (id == CLOCK_REALTIME)
-        t = clock_realtime;
-    else if (id == CLOCK_MONOTONIC)
-        t = clock_monotonic;
-
-    /* If we didn't find the symbol/the clock isn't in the vdso, return an error */
-    if (!t)
+
+    /* Only CLOCK_REALTIME can be set, everything else derives from the clocksource */
+    if (id != CLOCK_REALTIME)
         return errno = EINVAL, -1;
 
-    /* FIXME: Probably something like a seqlock would be good for this (like pvclock does) */
-    t->epoch = time->epoch;
-    t->measurement_timestamp = get_main_clock()->get_ticks();
+    scoped_lock<spinlock, true> g{data_lock};
+    write_begin();
+    /* CLOCK_REALTIME = epoch + (monotonic - measurement_timestamp), see clock_gettime_kernel */
+    data->realtime_offset = time->epoch * NS_PER_SEC - time->measurement_timestamp;
+    write_end();
 
     return 0;
 }
 
+void vdso::update_clocksource(struct clocksource *clk)
+{
+    if (!vdso_setup)
+        return;
+
+    scoped_lock<spinlock, true> g{data_lock};
+    write_begin();
+
+    data->clock_mode = clk->ticks_per_ns ? clk->vdso_clock_mode : VDSO_CLOCK_MODE_NONE;
+    if (data->clock_mode != VDSO_CLOCK_MODE_NONE)
+    {
+        data->ticks_per_ns = *clk->ticks_per_ns;
+        data->mono_offset = clk->base + clk->monotonic_warp;
+    }
+
+    write_end();
+}
+
+void vdso::update_coarse(hrtime_t now)
+{
+    if (!vdso_setup)
+        return;
+
+    scoped_lock<spinlock, true> g{data_lock};
+    /* Racing updaters may get here out of order */
+    if (now <= data->coarse_mono)
+        return;
+
+    write_begin();
+    data->coarse_mono = now;
+    write_end();
+}
+
+void vdso::enable_getcpu()
+{
+    if (!vdso_setup)
+        return;
+    __atomic_or_fetch(&data->flags, VDSO_FLAG_GETCPU, __ATOMIC_RELAXED);
+}
+
 int vdso_update_time(clockid_t id, clock_time *time)
 {
     return main_vdso.update_time(id, time);
 }
 
+void vdso_update_clocksource(struct clocksource *clk)
+{
+    main_vdso.update_clocksource(clk);
+}
+
+void vdso_update_coarse(hrtime_t now)
+{
+    main_vdso.update_coarse(now);
+}
+
+void vdso_enable_getcpu()
+{
+    main_vdso.enable_getcpu();
+}
+
 /* Ubsan is being stupid so I need to shut it up */
 void vdso_init()
 {
@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/panic.h>
+#include <onyx/percpu.h>
+#include <onyx/preempt.h>
+#include <onyx/scheduler.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
+#include <onyx/workqueue.h>
+
+/* Workqueues are backed by pools of worker threads. Every cpu has a normal and a high priority
+ * pool, and there's a normal and a high priority pool for unbound work.
+ *
+ * Pools are concurrency managed: normally a single worker runs the pool's work, one item after
+ * the other. When that worker blocks, the scheduler tells us (wq_worker_sleeping()), and an idle
+ * worker gets woken up to keep the pool going. Whoever's about to run work makes sure there's an
+ * idle worker around for that, creating one if needed. Workers that find another worker running
+ * when they're done go back to idle.
+ *
+ * A workqueue is attached to pools through pool_workqueues, one per pool it uses. These limit
+ * how much of the workqueue's work can be in the pool at once (max_active); the rest waits on
+ * the pwq's inactive list. Ordered workqueues are unbound, with max_active = 1.
+ *
+ * Workers that sit idle for WORKER_IDLE_TIMEOUT exit, as long as the pool keeps another idle
+ * worker and at least WORKER_POOL_MIN_WORKERS workers around.
+ */
+
+#define NR_STD_WORKER_POOLS 2
+#define WQ_DFL_ACTIVE       256
+
+#define WORKER_IDLE_TIMEOUT     (300 * NS_PER_SEC)
+#define WORKER_POOL_MIN_WORKERS 2
+
+/* work_struct::data flag: the work is on its pwq's inactive list */
+#define WORK_STRUCT_INACTIVE (1UL << 1)
+#define WORK_STRUCT_PWQ_MASK (~(WORK_STRUCT_PENDING | WORK_STRUCT_INACTIVE))
+
+struct worker_pool
+{
+    struct spinlock lock;
+    struct list_head worklist;
+    struct list_head idle_list;
+    /* WORK_CPU_UNBOUND for unbound pools */
+    unsigned int cpu;
+    int prio;
+    unsigned int nr_workers;
+    unsigned int nr_idle;
+    /* Workers that aren't idle nor blocked. Not protected by the lock, see wq_worker_running */
+    unsigned int nr_running;
+    bool creating;
+};
+
+struct worker
+{
+    struct thread *thread;
+    struct worker_pool *pool;
+    struct list_head idle_node;
+    /* When the worker last went idle */
+    hrtime_t idle_since;
+    bool idle;
+    bool sleeping;
+};
+
+struct pool_workqueue
+{
+    struct workqueue *wq;
+    struct worker_pool *pool;
+    unsigned int max_active;
+    unsigned int nr_active;
+    struct list_head inactive;
+    /* Work queued or running, for flush_workqueue */
+    unsigned long nr_in_flight;
+};
+
+struct workqueue
+{
+    const char *name;
+    unsigned int flags;
+    /* One per cpu, or just one for unbound workqueues */
+    struct pool_workqueue *pwqs;
+    unsigned int nr_pwqs;
+    struct wait_queue flush_wq;
+};
+
+static PER_CPU_VAR(struct worker_pool cpu_worker_pools[NR_STD_WORKER_POOLS]);
+static struct worker_pool unbound_pools[NR_STD_WORKER_POOLS];
+static unsigned int nr_pool_cpus;
+
+struct workqueue *system_wq;
+struct workqueue *system_highpri_wq;
+struct workqueue *system_unbound_wq;
+
+static struct pool_workqueue *work_pwq(unsigned long data)
+{
+    return (struct pool_workqueue *) (data & WORK_STRUCT_PWQ_MASK);
+}
+
+/**
+ * @brief Take an idle worker out of the idle list, to run the pool's work.
+ * Must be called with the pool lock held.
+ *
+ * @param pool Worker pool
+ * @return The worker's thread, that needs to be woken up after dropping the lock; or nullptr
+ */
+static struct thread *pool_claim_idle(struct worker_pool *pool)
+{
+    if (list_is_empty(&pool->worklist) || list_is_empty(&pool->idle_list))
+        return nullptr;
+
+    struct worker *w = container_of(list_first_element(&pool->idle_list), struct worker, idle_node);
+    list_remove(&w->idle_node);
+    pool->nr_idle--;
+    w->idle = false;
+    __atomic_add_fetch(&pool->nr_running, 1, __ATOMIC_RELAXED);
+    return w->thread;
+}
+
+static void worker_enter_idle(struct worker *w)
+{
+    auto pool = w->pool;
+
+    w->idle = true;
+    w->idle_since = clocksource_get_time();
+    list_add(&w->idle_node, &pool->idle_list);
+    pool->nr_idle++;
+    __atomic_sub_fetch(&pool->nr_running, 1, __ATOMIC_RELAXED);
+}
+
+/* Called with the pool lock held */
+static void pwq_activate_first(struct pool_workqueue *pwq)
+{
+    struct work_struct *work =
+        container_of(list_first_element(&pwq->inactive), struct work_struct, entry);
+
+    list_remove(&work->entry);
+    list_add_tail(&work->entry, &pwq->pool->worklist);
+    __atomic_and_fetch(&work->data, ~WORK_STRUCT_INACTIVE, __ATOMIC_RELAXED);
+    pwq->nr_active++;
+}
+
+/**
+ * @brief Account for a work item that left the pwq (ran, or got cancelled).
+ * Called with the pool lock held.
+ *
+ * @param pwq Pool workqueue
+ * @param active True if the item was active (it was on the pool's worklist)
+ */
+static void pwq_work_done(struct pool_workqueue *pwq, bool active)
+{
+    if (active)
+    {
+        pwq->nr_active--;
+        if (!list_is_empty(&pwq->inactive) && pwq->nr_active < pwq->max_active)
+            pwq_activate_first(pwq);
+    }
+
+    if (--pwq->nr_in_flight == 0)
+        wait_queue_wake_all(&pwq->wq->flush_wq);
+}
+
+static void worker_thread(void *arg);
+
+/**
+ * @brief Create a new worker for a pool.
+ *
+ * @param pool Worker pool
+ * @param idle If true, the worker starts out idle. Else, it goes straight to the worklist.
+ * @return The new worker, or nullptr if we're out of memory
+ */
+static struct worker *create_worker(struct worker_pool *pool, bool idle)
+{
+    struct worker *w = (struct worker *) malloc(sizeof(*w));
+    if (!w)
+        return nullptr;
+
+    w->pool = pool;
+    w->sleeping = false;
+    w->thread = nullptr;
+
+    struct thread *t = sched_create_thread(worker_thread, THREAD_KERNEL, w);
+    if (!t)
+    {
+        free(w);
+        return nullptr;
+    }
+
+    t->priority = pool->prio;
+    t->wq_worker = w;
+    w->thread = t;
+
+    {
+        scoped_lock<spinlock, true> g{pool->lock};
+        pool->nr_workers++;
+        w->idle = false;
+        __atomic_add_fetch(&pool->nr_running, 1, __ATOMIC_RELAXED);
+        if (idle)
+            worker_enter_idle(w);
+    }
+
+    if (pool->cpu == WORK_CPU_UNBOUND)
+        sched_start_thread(t);
+    else
+        sched_start_thread_for_cpu(t, pool->cpu);
+
+    return w;
+}
+
+static void worker_idle_timeout(struct clockevent *ev)
+{
+    thread_wake_up((struct thread *) ev->priv);
+}
+
+/**
+ * @brief Sleep until we get claimed, or until the worker's idle timeout expires.
+ * The caller sets the thread state, and re-checks what woke it up.
+ *
+ * @param w Worker
+ */
+static void worker_idle_sleep(struct worker *w)
+{
+    clockevent ev;
+    ev.callback = worker_idle_timeout;
+    ev.priv = w->thread;
+    ev.flags = CLOCKEVENT_FLAG_ATOMIC | CLOCKEVENT_FLAG_COARSE;
+    ev.deadline = w->idle_since + WORKER_IDLE_TIMEOUT;
+    timer_queue_clockevent(&ev);
+
+    sched_yield();
+
+    timer_cancel_event(&ev);
+}
+
+/* Called with the pool lock held */
+static bool pool_has_spare_workers(struct worker_pool *pool)
+{
+    return pool->nr_idle > 1 && pool->nr_workers > WORKER_POOL_MIN_WORKERS;
+}
+
+/**
+ * @brief Exit an idle worker. Called with the pool lock held, doesn't return.
+ *
+ * @param w Worker
+ * @param flags Flags returned by spin_lock_irqsave
+ */
+[[noreturn]] static void worker_exit(struct worker *w, unsigned long flags)
+{
+    auto pool = w->pool;
+
+    list_remove(&w->idle_node);
+    pool->nr_idle--;
+    pool->nr_workers--;
+    /* Don't let the scheduler call back into the pool for a dying thread */
+    w->thread->wq_worker = nullptr;
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    free(w);
+    thread_exit();
+    __builtin_unreachable();
+}
+
+static void worker_thread(void *arg)
+{
+    struct worker *worker = (struct worker *) arg;
+    struct worker_pool *pool = worker->pool;
+
+    unsigned long flags = spin_lock_irqsave(&pool->lock);
+
+    for (;;)
+    {
+        while (worker->idle)
+        {
+            set_current_state(THREAD_UNINTERRUPTIBLE);
+            spin_unlock_irqrestore(&pool->lock, flags);
+            worker_idle_sleep(worker);
+            flags = spin_lock_irqsave(&pool->lock);
+
+            if (!worker->idle)
+                break;
+
+            const hrtime_t now = clocksource_get_time();
+            if (now - worker->idle_since < WORKER_IDLE_TIMEOUT)
+                continue;
+
+            if (pool_has_spare_workers(pool))
+                worker_exit(worker, flags);
+
+            /* The pool still needs us, wait for another timeout */
+            worker->idle_since = now;
+        }
+
+        /* Leave the work to whoever else is running */
+        if (list_is_empty(&pool->worklist) ||
+            __atomic_load_n(&pool->nr_running, __ATOMIC_RELAXED) > 1)
+        {
+            worker_enter_idle(worker);
+            continue;
+        }
+
+        /* Make sure someone can take over if we block. If we can't create a worker, just carry
+         * on, we'll retry on the next item.
+         */
+        if (pool->nr_idle == 0 && !pool->creating)
+        {
+            pool->creating = true;
+            spin_unlock_irqrestore(&pool->lock, flags);
+            bool created = create_worker(pool, true) != nullptr;
+            flags = spin_lock_irqsave(&pool->lock);
+            pool->creating = false;
+
+            if (created)
+                continue;
+        }
+
+        if (list_is_empty(&pool->worklist))
+            continue;
+
+        struct work_struct *work =
+            container_of(list_first_element(&pool->worklist), struct work_struct, entry);
+        list_remove(&work->entry);
+
+        struct pool_workqueue *pwq = work_pwq(work->data);
+        /* From here on, the work may be queued again */
+        __atomic_store_n(&work->data, 0, __ATOMIC_RELEASE);
+
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        work->func(work);
+
+        flags = spin_lock_irqsave(&pool->lock);
+        pwq_work_done(pwq, true);
+    }
+}
+
+void wq_worker_sleeping(struct thread *thread)
+{
+    struct worker *w = thread->wq_worker;
+    if (w->idle || w->sleeping)
+        return;
+
+    w->sleeping = true;
+
+    auto pool = w->pool;
+    if (__atomic_sub_fetch(&pool->nr_running, 1, __ATOMIC_RELAXED) != 0)
+        return;
+
+    struct thread *t;
+    {
+        scoped_lock<spinlock, true> g{pool->lock};
+        t = pool_claim_idle(pool);
+    }
+
+    if (t)
+        thread_wake_up(t);
+}
+
+void wq_worker_running(struct thread *thread)
+{
+    struct worker *w = thread->wq_worker;
+    if (!w->sleeping)
+        return;
+
+    w->sleeping = false;
+    __atomic_add_fetch(&w->pool->nr_running, 1, __ATOMIC_RELAXED);
+}
+
+static struct pool_workqueue *wq_select_pwq(struct workqueue *wq, unsigned int cpu)
+{
+    if (wq->nr_pwqs == 1)
+        return &wq->pwqs[0];
+
+    if (cpu == WORK_CPU_UNBOUND)
+        cpu = get_cpu_nr();
+
+    return &wq->pwqs[cpu < wq->nr_pwqs ? cpu : 0];
+}
+
+/**
+ * @brief Queue work whose PENDING bit we own.
+ */
+static void __queue_work(unsigned int cpu, struct workqueue *wq, struct work_struct *work)
+{
+    struct thread *to_wake = nullptr;
+
+    sched_disable_preempt();
+
+    struct pool_workqueue *pwq = wq_select_pwq(wq, cpu);
+    struct worker_pool *pool = pwq->pool;
+
+    {
+        scoped_lock<spinlock, true> g{pool->lock};
+        pwq->nr_in_flight++;
+
+        if (pwq->nr_active < pwq->max_active)
+        {
+            __atomic_store_n(&work->data, (unsigned long) pwq | WORK_STRUCT_PENDING,
+                             __ATOMIC_RELEASE);
+            pwq->nr_active++;
+            list_add_tail(&work->entry, &pool->worklist);
+
+            if (__atomic_load_n(&pool->nr_running, __ATOMIC_RELAXED) == 0)
+                to_wake = pool_claim_idle(pool);
+        }
+        else
+        {
+            __atomic_store_n(&work->data,
+                             (unsigned long) pwq | WORK_STRUCT_PENDING | WORK_STRUCT_INACTIVE,
+                             __ATOMIC_RELEASE);
+            list_add_tail(&work->entry, &pwq->inactive);
+        }
+    }
+
+    if (to_wake)
+        thread_wake_up(to_wake);
+
+    sched_enable_preempt();
+}
+
+static bool work_try_claim(struct work_struct *work)
+{
+    return !(__atomic_fetch_or(&work->data, WORK_STRUCT_PENDING, __ATOMIC_ACQUIRE) &
+             WORK_STRUCT_PENDING);
+}
+
+bool queue_work_on(unsigned int cpu, struct workqueue *wq, struct work_struct *work)
+{
+    if (!work_try_claim(work))
+        return false;
+
+    __queue_work(cpu, wq, work);
+    return true;
+}
+
+bool queue_work(struct workqueue *wq, struct work_struct *work)
+{
+    return queue_work_on(WORK_CPU_UNBOUND, wq, work);
+}
+
+static void delayed_work_timer_fn(struct clockevent *ev)
+{
+    struct delayed_work *dw = (struct delayed_work *) ev->priv;
+    __queue_work(dw->cpu, dw->wq, &dw->work);
+}
+
+bool queue_delayed_work(struct workqueue *wq, struct delayed_work *dw, hrtime_t delay)
+{
+    if (!work_try_claim(&dw->work))
+        return false;
+
+    if (delay == 0)
+    {
+        __queue_work(WORK_CPU_UNBOUND, wq, &dw->work);
+        return true;
+    }
+
+    dw->wq = wq;
+    /* Per-cpu workqueues get the work on the cpu the timer fires on, which is this one */
+    dw->cpu = WORK_CPU_UNBOUND;
+    dw->timer.deadline = clocksource_get_time() + delay;
+    dw->timer.priv = dw;
+    dw->timer.callback = delayed_work_timer_fn;
+    dw->timer.flags = CLOCKEVENT_FLAG_ATOMIC | CLOCKEVENT_FLAG_COARSE;
+    timer_queue_clockevent(&dw->timer);
+    return true;
+}
+
+/**
+ * @brief Take pending work off its pwq.
+ *
+ * @param work Work item
+ * @return True if the work was pending
+ */
+static bool __cancel_work(struct work_struct *work)
+{
+    unsigned long data;
+
+    while (true)
+    {
+        data = __atomic_load_n(&work->data, __ATOMIC_ACQUIRE);
+        if (!(data & WORK_STRUCT_PENDING))
+            return false;
+
+        /* Someone's in the middle of queueing it */
+        if (!work_pwq(data))
+        {
+            cpu_relax();
+            continue;
+        }
+
+        auto pwq = work_pwq(data);
+        scoped_lock<spinlock, true> g{pwq->pool->lock};
+
+        /* It may have started running, or been requeued somewhere else, in the meanwhile */
+        if (__atomic_load_n(&work->data, __ATOMIC_RELAXED) != data)
+            continue;
+
+        list_remove(&work->entry);
+        __atomic_store_n(&work->data, 0, __ATOMIC_RELEASE);
+        pwq_work_done(pwq, !(data & WORK_STRUCT_INACTIVE));
+        return true;
+    }
+}
+
+bool cancel_work(struct work_struct *work)
+{
+    return __cancel_work(work);
+}
+
+bool cancel_delayed_work(struct delayed_work *dw)
+{
+    /* Once this returns, the timer either fired (and the work is queued), or never will */
+    timer_cancel_event(&dw->timer);
+
+    const unsigned long data = __atomic_load_n(&dw->work.data, __ATOMIC_ACQUIRE);
+    if (!(data & WORK_STRUCT_PENDING))
+        return false;
+
+    if (!work_pwq(data))
+    {
+        /* Got it before the timer fired */
+        __atomic_store_n(&dw->work.data, 0, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    return __cancel_work(&dw->work);
+}
+
+static bool workqueue_idle(struct workqueue *wq)
+{
+    for (unsigned int i = 0; i < wq->nr_pwqs; i++)
+    {
+        if (__atomic_load_n(&wq->pwqs[i].nr_in_flight, __ATOMIC_ACQUIRE) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+void flush_workqueue(struct workqueue *wq)
+{
+    wait_for_event(&wq->flush_wq, workqueue_idle(wq));
+}
+
+static struct worker_pool *get_std_pool(unsigned int cpu, bool highpri)
+{
+    if (cpu == WORK_CPU_UNBOUND)
+        return &unbound_pools[highpri];
+    return &(*get_per_cpu_ptr_any(cpu_worker_pools, cpu))[highpri];
+}
+
+struct workqueue *workqueue_create(const char *name, unsigned int flags)
+{
+    if (flags & WQ_ORDERED)
+        flags |= WQ_UNBOUND;
+
+    struct workqueue *wq = (struct workqueue *) malloc(sizeof(*wq));
+    if (!wq)
+        return nullptr;
+
+    spinlock_init(&wq->flush_wq.lock);
+    init_wait_queue_head(&wq->flush_wq);
+    wq->name = name;
+    wq->flags = flags;
+    wq->nr_pwqs = flags & WQ_UNBOUND ? 1 : nr_pool_cpus;
+    wq->pwqs = (struct pool_workqueue *) calloc(wq->nr_pwqs, sizeof(struct pool_workqueue));
+    if (!wq->pwqs)
+    {
+        free(wq);
+        return nullptr;
+    }
+
+    const bool highpri = flags & WQ_HIGHPRI;
+
+    for (unsigned int i = 0; i < wq->nr_pwqs; i++)
+    {
+        struct pool_workqueue *pwq = &wq->pwqs[i];
+        pwq->wq = wq;
+        pwq->pool = get_std_pool(flags & WQ_UNBOUND ? WORK_CPU_UNBOUND : i, highpri);
+        pwq->max_active = flags & WQ_ORDERED ? 1 : WQ_DFL_ACTIVE;
+        INIT_LIST_HEAD(&pwq->inactive);
+    }
+
+    return wq;
+}
+
+void workqueue_destroy(struct workqueue *wq)
+{
+    flush_workqueue(wq);
+    free(wq->pwqs);
+    free(wq);
+}
+
+static void worker_pool_init(struct worker_pool *pool, unsigned int cpu, bool highpri)
+{
+    spinlock_init(&pool->lock);
+    INIT_LIST_HEAD(&pool->worklist);
+    INIT_LIST_HEAD(&pool->idle_list);
+    pool->cpu = cpu;
+    pool->prio = highpri ? SCHED_PRIO_VERY_HIGH : SCHED_PRIO_NORMAL;
+    pool->nr_workers = pool->nr_idle = pool->nr_running = 0;
+    pool->creating = false;
+}
+
+static void workqueue_init()
+{
+    nr_pool_cpus = get_nr_cpus();
+
+    for (unsigned int cpu = 0; cpu < nr_pool_cpus; cpu++)
+    {
+        for (unsigned int i = 0; i < NR_STD_WORKER_POOLS; i++)
+            worker_pool_init(get_std_pool(cpu, i), cpu, i);
+    }
+
+    for (unsigned int i = 0; i < NR_STD_WORKER_POOLS; i++)
+        worker_pool_init(get_std_pool(WORK_CPU_UNBOUND, i), WORK_CPU_UNBOUND, i);
+
+    system_wq = workqueue_create("events", 0);
+    system_highpri_wq = workqueue_create("events_highpri", WQ_HIGHPRI);
+    system_unbound_wq = workqueue_create("events_unbound", WQ_UNBOUND);
+    if (!system_wq || !system_highpri_wq || !system_unbound_wq)
+        panic("workqueue: Could not create the system workqueues");
+}
+
+INIT_LEVEL_CORE_INIT_ENTRY(workqueue_init);
+
+/* Work can get queued from early on. It sits in the pools until the first workers get started */
+static void workqueue_start_workers()
+{
+    for (unsigned int cpu = 0; cpu < nr_pool_cpus; cpu++)
+    {
+        for (unsigned int i = 0; i < NR_STD_WORKER_POOLS; i++)
+        {
+            if (!create_worker(get_std_pool(cpu, i), false))
+                panic("workqueue: Could not create workers");
+        }
+    }
+
+    for (unsigned int i = 0; i < NR_STD_WORKER_POOLS; i++)
+    {
+        if (!create_worker(get_std_pool(WORK_CPU_UNBOUND, i), false))
+            panic("workqueue: Could not create workers");
+    }
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(workqueue_start_workers);
@@ -10,34 +10,45 @@
 #include <stdlib.h>
 #include <string.h>
 #ifdef __is_onyx_kernel
+#include <onyx/irq.h>
 #include <onyx/log.h>
-#include <onyx/mutex.h>
-#include <onyx/scoped_lock.h>
-#include <onyx/spinlock.h>
+#include <onyx/percpu.h>
 #endif
 
-static mutex buffer_lock;
-static char buffer[10000];
-
-void tty_write_string_kernel(const char *s);
+/* printf() and printk() format into a per-cpu buffer with irqs off, so they can be called from any
+ * context without serialising against other cpus. The result gets copied into the kernel log
+ * before irqs come back on, and the console only gets kicked after that.
+ */
+struct printf_buffer
+{
+    char buf[1024];
+};
 
-static spinlock log_buffer_lock;
-static char log_temp_buffer[10000];
+static PER_CPU_VAR(struct printf_buffer printf_buf);
 
-static void __flush_print()
+static int kernel_vprintf(unsigned int flags, const char *__restrict__ format, va_list va)
 {
+    unsigned long irqf = irq_save_and_disable();
+    char *buf = get_per_cpu_ptr(printf_buf)->buf;
+
+    int i = vsnprintf(buf, sizeof(printf_buffer::buf), format, va);
+    if (i < 0)
+    {
+        irq_restore(irqf);
+        return -1;
+    }
+
 #ifdef __is_onyx_kernel
-    kernlog_print(log_temp_buffer);
+    size_t len = (size_t) i < sizeof(printf_buffer::buf) ? i : sizeof(printf_buffer::buf) - 1;
+    __kernlog_emit(KLOG_DEFAULT_LEVEL, flags, buf, len);
 #endif
-    memset(buffer, 0, sizeof(log_temp_buffer));
-}
+    irq_restore(irqf);
 
-void __flush_print_screen()
-{
 #ifdef __is_onyx_kernel
-    tty_write_string_kernel(buffer);
+    kernlog_kick_console();
 #endif
-    memset(buffer, 0, sizeof(buffer));
+
+    return i;
 }
 
 #ifdef __is_onyx_kernel
@@ -56,14 +67,7 @@ int putchar(int c)
 
 extern "C" int vprintf(const char *__restrict__ format, va_list va)
 {
-    scoped_lock g{log_buffer_lock};
-
-    int i = vsnprintf(log_temp_buffer, 10000, format, va);
-    if (i < 0)
-        return -1;
-    __flush_print();
-
-    return i;
+    return kernel_vprintf(0, format, va);
 }
 
 extern "C" int printf(const char *__restrict__ format, ...)
@@ -78,20 +82,15 @@ extern "C" int printf(const char *__restrict__ format, ...)
 
 extern "C" int printk(const char *__restrict__ format, ...)
 {
-    scoped_mutex<false> g{buffer_lock};
     va_list parameters;
     va_start(parameters, format);
-    int i = vsnprintf(buffer, 10000, format, parameters);
-    if (i < 0)
-        return -1;
-
-    __flush_print_screen();
+    int i = kernel_vprintf(KLOG_CONSOLE, format, parameters);
     va_end(parameters);
 
-    return 0;
+    return i < 0 ? -1 : 0;
 }
 
 void bust_printk_lock(void)
 {
-    buffer_lock.counter = 0;
+    kernlog_bust_console();
 }
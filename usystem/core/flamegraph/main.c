@@ -7,7 +7,9 @@
  */
 #define _GNU_SOURCE
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -16,8 +18,11 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <libonyx/handle.h>
+#include <libonyx/process.h>
 #include <symbolize/symbolize.h>
 #include <uapi/perf_probe.h>
+#include <uapi/process.h>
 
 bool tracing_wait = false;
 
@@ -50,6 +55,17 @@ bool is_same_stack(struct flame_graph_entry *e, struct flame_graph_entry *e2)
             break;
     }
 
+    if (e->pid != e2->pid)
+        return false;
+
+    for (size_t i = 0; i < FLAME_GRAPH_USER_FRAMES; i++)
+    {
+        if (e->user_rips[i] != e2->user_rips[i])
+            return false;
+        if (e->user_rips[i] == 0)
+            break;
+    }
+
     return true;
 }
 
@@ -58,7 +74,8 @@ void add_to_freqmap(struct flame_graph_entry_freqmap *freqmap, struct flame_grap
     size_t i;
     for (i = 0; i < freqmap->wpos; i++)
     {
-        if (freqmap->freqmap[i].e.rips[0] == e->rips[0])
+        if (freqmap->freqmap[i].e.rips[0] == e->rips[0] &&
+            freqmap->freqmap[i].e.user_rips[0] == e->user_rips[0])
         {
             if (is_same_stack(&freqmap->freqmap[i].e, e))
             {
@@ -80,6 +97,142 @@ void add_to_freqmap(struct flame_graph_entry_freqmap *freqmap, struct flame_grap
 
 struct symbolize_ctx ctx;
 
+/* Address space of a sampled process, as returned by PROCESS_GET_VM_REGIONS */
+struct proc_maps
+{
+    pid_t pid;
+    char *data;
+    size_t len;
+};
+
+/* Symbolization context for a user binary or library, keyed by path */
+struct user_image
+{
+    char *path;
+    struct symbolize_ctx ctx;
+    bool valid;
+};
+
+static struct proc_maps *maps;
+static size_t nr_maps;
+static struct user_image *images;
+static size_t nr_images;
+
+static struct proc_maps *get_proc_maps(pid_t pid)
+{
+    for (size_t i = 0; i < nr_maps; i++)
+    {
+        if (maps[i].pid == pid)
+            return &maps[i];
+    }
+
+    struct proc_maps *newmaps = realloc(maps, (nr_maps + 1) * sizeof(struct proc_maps));
+    if (!newmaps)
+        return NULL;
+    maps = newmaps;
+
+    struct proc_maps *m = &maps[nr_maps++];
+    m->pid = pid;
+    m->data = NULL;
+    m->len = 0;
+
+    /* If the process is gone by now, leave the maps empty and fall back to raw addresses */
+    int handle = onx_process_open(pid, ONX_HANDLE_CLOEXEC);
+    if (handle < 0)
+        return m;
+
+    size_t quantity = 0;
+
+    do
+    {
+        char *data = realloc(m->data, quantity);
+        if (!data && quantity)
+            break;
+        m->data = data;
+        m->len = quantity;
+
+        ssize_t st = onx_handle_query(handle, m->data, m->len, PROCESS_GET_VM_REGIONS, &quantity,
+                                      NULL);
+        if (st == -1 && errno != ENOSPC)
+        {
+            m->len = 0;
+            break;
+        }
+    } while (m->len != quantity);
+
+    onx_process_close(handle);
+    return m;
+}
+
+static struct user_image *get_user_image(const char *path)
+{
+    for (size_t i = 0; i < nr_images; i++)
+    {
+        if (!strcmp(images[i].path, path))
+            return &images[i];
+    }
+
+    struct user_image *newimages = realloc(images, (nr_images + 1) * sizeof(struct user_image));
+    if (!newimages)
+        return NULL;
+    images = newimages;
+
+    struct user_image *img = &images[nr_images];
+    img->path = strdup(path);
+    if (!img->path)
+        return NULL;
+    nr_images++;
+    img->valid = false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return img;
+
+    img->valid = symbolize_exec(fd, &img->ctx) == 0;
+    close(fd);
+    return img;
+}
+
+/* Symbolize a user address of process pid, as image`symbol. Returns -1 if we couldn't. */
+static int symbolize_user(pid_t pid, unsigned long addr, char *buf, size_t buflen)
+{
+    struct proc_maps *m = get_proc_maps(pid);
+    if (!m)
+        return -1;
+
+    for (size_t i = 0; i < m->len;)
+    {
+        const struct onx_process_vm_region *reg = (const void *) (m->data + i);
+        i += reg->size;
+
+        if (addr < reg->start || addr >= reg->start + reg->length)
+            continue;
+
+        /* Anonymous memory (JIT code, etc) has nothing to symbolize against */
+        if (reg->size == sizeof(struct onx_process_vm_region) || !reg->name[0])
+            return -1;
+
+        struct user_image *img = get_user_image(reg->name);
+        if (!img || !img->valid)
+            return -1;
+
+        unsigned long vaddr;
+        if (symbolize_offset_to_vaddr(&img->ctx, addr - reg->start + reg->offset, &vaddr) < 0)
+            return -1;
+
+        char symbuf[1024];
+        if (symbolize_symbolize(&img->ctx, vaddr, symbuf, sizeof(symbuf)) < 0)
+            return -1;
+
+        char *path = strdup(reg->name);
+        snprintf(buf, buflen, "%s`%s", path ? basename(path) : reg->name, symbuf);
+        free(path);
+        return 0;
+    }
+
+    return -1;
+}
+
 void print_stack(struct flame_graph_entry_freq *f)
 {
     const size_t frames = tracing_wait ? FLAME_GRAPH_FRAMES - 1 : FLAME_GRAPH_FRAMES;
@@ -98,6 +251,17 @@ void print_stack(struct flame_graph_entry_freq *f)
 
         printf("        vmonyx`%s\n", symbuf);
     }
+
+    for (size_t i = 0; i < FLAME_GRAPH_USER_FRAMES; i++)
+    {
+        if (f->e.user_rips[i] == 0)
+            break;
+        char symbuf[1024];
+        if (symbolize_user(f->e.pid, f->e.user_rips[i], symbuf, sizeof(symbuf)) < 0)
+            snprintf(symbuf, sizeof(symbuf), "0x%lx", f->e.user_rips[i]);
+
+        printf("        %s\n", symbuf);
+    }
 }
 
 void print_fmap(struct flame_graph_entry_freqmap *fmap)
@@ -112,24 +276,40 @@ void print_fmap(struct flame_graph_entry_freqmap *fmap)
 
 static void print_usage(void)
 {
-    printf("Usage: flamegraph [-w]\n");
-    printf("Collects kernel flamegraphs and prints them to stdout.\n"
+    printf("Usage: flamegraph [-w] [-p pid | -g pgid] [-F freq]\n");
+    printf("Collects kernel and user flamegraphs and prints them to stdout.\n"
            "The format may then be collected by FlameGraph's stackcollapse.pl"
            " and processed to create a .svg\n");
     printf("\n  -w       Collect a wait flamegraph instead of a CPU one\n");
+    printf("  -p pid   Only sample threads of process pid\n");
+    printf("  -g pgid  Only sample threads of processes in process group pgid\n");
+    printf("  -F freq  Sample at freq Hz (default %d, max %d)\n", PERF_PROBE_DEFAULT_FREQ,
+           PERF_PROBE_MAX_FREQ);
+    printf("\nUser stacks are only symbolized if the sampled processes are still running once "
+           "sampling ends.\n");
 }
 
 int main(int argc, char **argv)
 {
     int c;
+    struct perf_probe_filter filter = {};
 
-    while ((c = getopt(argc, argv, "w")) != -1)
+    while ((c = getopt(argc, argv, "whp:g:F:")) != -1)
     {
         switch (c)
         {
             case 'w':
                 tracing_wait = true;
                 break;
+            case 'p':
+                filter.pid = atoi(optarg);
+                break;
+            case 'g':
+                filter.pgid = atoi(optarg);
+                break;
+            case 'F':
+                filter.freq = strtoul(optarg, NULL, 10);
+                break;
             case 'h':
             case '?':
                 print_usage();
@@ -150,6 +330,9 @@ int main(int argc, char **argv)
     if (fd < 0)
         err(1, "error opening perf-probe");
 
+    if (ioctl(fd, PERF_PROBE_SET_FILTER, &filter) < 0)
+        err(1, "error setting perf-probe filter");
+
     int enable = 1;
     if (ioctl(fd, tracing_wait ? PERF_PROBE_ENABLE_DISABLE_WAIT : PERF_PROBE_ENABLE_DISABLE_CPU,
               &enable) < 0)
@@ -191,7 +374,7 @@ int main(int argc, char **argv)
 
     for (size_t i = 0; i < nentries; i++)
     {
-        if (buf[i].rips[0] == 0)
+        if (buf[i].rips[0] == 0 && buf[i].user_rips[0] == 0)
             continue;
         add_to_freqmap(&fmap, &buf[i]);
     }
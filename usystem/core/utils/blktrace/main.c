@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <uapi/blktrace.h>
+
+#define BLKTRACE_PATH        "/sys/block/trace"
+#define BLKTRACE_ENABLE_PATH "/sys/block/trace_enable"
+
+#define EVENTS_PER_READ 64
+
+static const char *op_names[] = {"R", "W", "D", "Z", "F"};
+
+static volatile sig_atomic_t stop;
+
+static int set_tracing(int enable)
+{
+    int fd = open(BLKTRACE_ENABLE_PATH, O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    int st = write(fd, enable ? "1" : "0", 1) == 1 ? 0 : -1;
+    close(fd);
+    return st;
+}
+
+static void disable_tracing(void)
+{
+    set_tracing(0);
+}
+
+static void sigint_handler(int sig)
+{
+    stop = 1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-n count]\n", argv0);
+}
+
+static void print_event(const struct blktrace_event *ev)
+{
+    const char *op = ev->op < sizeof(op_names) / sizeof(op_names[0]) ? op_names[ev->op] : "?";
+
+    printf("%5llu.%06llu %-8.*s %s %10llu + %-6u %8llu.%03llu us %4u%s\n",
+           ev->time / 1000000000ULL, (ev->time / 1000) % 1000000ULL, BLKTRACE_DEV_NAME_LEN,
+           ev->dev, op, ev->sector, ev->nr_sectors, ev->latency / 1000, ev->latency % 1000,
+           ev->in_flight, ev->flags & BLKTRACE_FLAG_ERROR ? " error" : "");
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev = NULL;
+    unsigned long count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                dev = optarg;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int fd = open(BLKTRACE_PATH, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(BLKTRACE_PATH);
+        return 1;
+    }
+
+    if (set_tracing(1) < 0)
+    {
+        perror(BLKTRACE_ENABLE_PATH);
+        return 1;
+    }
+
+    atexit(disable_tracing);
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
+
+    printf("%12s %-8s %s %19s %-6s %15s %4s\n", "time", "device", "op", "sector", "nr", "latency",
+           "qd");
+
+    struct blktrace_event events[EVENTS_PER_READ];
+    unsigned long long next_seq = 0;
+    unsigned long printed = 0;
+
+    while (!stop && (!count || printed < count))
+    {
+        ssize_t st = pread(fd, events, sizeof(events), next_seq * sizeof(struct blktrace_event));
+        if (st < 0)
+        {
+            perror("pread");
+            return 1;
+        }
+
+        if (st == 0)
+        {
+            usleep(100000);
+            continue;
+        }
+
+        size_t nr = st / sizeof(struct blktrace_event);
+
+        /* Events we fell too far behind on got overwritten. Let the user know. */
+        if (events[0].seq != next_seq && next_seq != 0)
+            fprintf(stderr, "blktrace: lost %llu events\n", events[0].seq - next_seq);
+
+        for (size_t i = 0; i < nr && (!count || printed < count); i++)
+        {
+            if (dev && strncmp(events[i].dev, dev, BLKTRACE_DEV_NAME_LEN))
+                continue;
+            print_event(&events[i]);
+            printed++;
+        }
+
+        next_seq = events[nr - 1].seq + 1;
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -1,20 +1,77 @@
 /*
- * Copyright (c) 2017 - 2022 Pedro Falcato
+ * Copyright (c) 2017 - 2024 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  *
  * SPDX-License-Identifier: MIT
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-#define _GNU_SOURCE
+#include <string.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-int main()
+/* Follow /dev/kmsg, printing records as they come in */
+static int follow(void)
 {
+    char buf[256];
+    int fd = open("/dev/kmsg", O_RDONLY);
+    if (fd < 0)
+    {
+        perror("dmesg: /dev/kmsg");
+        return 1;
+    }
+
+    for (;;)
+    {
+        ssize_t st = read(fd, buf, sizeof(buf) - 1);
+        if (st < 0)
+        {
+            /* We fell behind and missed some records, carry on from the oldest one */
+            if (errno == EPIPE)
+                continue;
+            perror("dmesg: read");
+            return 1;
+        }
+
+        buf[st] = '\0';
+
+        /* level,seq,timestamp_us,flag;text */
+        unsigned int level;
+        unsigned long seq, usecs;
+        char flag;
+        int off;
+        if (sscanf(buf, "%u,%lu,%lu,%c;%n", &level, &seq, &usecs, &flag, &off) != 4)
+            continue;
+
+        if (flag == 'c')
+            printf("%s", buf + off);
+        else
+            printf("[%5lu.%06lu] %s", usecs / 1000000, usecs % 1000000, buf + off);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "wh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                return follow();
+            default:
+                fprintf(stderr, "Usage: %s [-w]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
     int size = (int) syscall(SYS_syslog, 10, NULL, -1);
     char *buf = malloc(size);
     if (!buf)
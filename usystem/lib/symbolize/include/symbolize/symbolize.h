@@ -26,10 +26,20 @@ struct symbol
 #define SYMBOL_FUNCTION   (1 << 2)
 #define SYMBOL_OBJECT     (1 << 3)
 
+/* A loadable segment, for mapping file offsets to addresses */
+struct symbolize_segment
+{
+    unsigned long vaddr;
+    unsigned long offset;
+    unsigned long size;
+};
+
 struct symbolize_ctx
 {
     struct symbol *sym;
     size_t nr_syms;
+    struct symbolize_segment *segs;
+    size_t nr_segs;
 };
 
 /**
@@ -69,4 +79,17 @@ struct symbol *symbolize_get_sym(struct symbolize_ctx *ctx, unsigned long addr);
  */
 int symbolize_symbolize(struct symbolize_ctx *ctx, unsigned long addr, char *buf, size_t buflen);
 
+/**
+ * @brief Translate an offset into the file to the address it gets loaded at (relative to the load
+ * base, for PIEs and shared libraries). Used to symbolize addresses in a process, given the file
+ * offset its mapping says they're at.
+ *
+ * @param ctx Context
+ * @param offset File offset
+ * @param vaddr Result
+ * @return 0 on success, -1 with errno set to ENOENT if no loadable segment covers the offset
+ */
+int symbolize_offset_to_vaddr(struct symbolize_ctx *ctx, unsigned long offset,
+                              unsigned long *vaddr);
+
 #endif
@@ -140,6 +140,35 @@ void symbolize_free_symbols(struct symbol *table, size_t syms)
     free(table);
 }
 
+static int symbolize_load_segments(Elf64_Ehdr *hdr, struct symbolize_ctx *ctx)
+{
+    Elf64_Phdr *phdrs = (void *) ((char *) hdr + hdr->e_phoff);
+    size_t nr = 0;
+
+    for (unsigned int i = 0; i < hdr->e_phnum; i++)
+    {
+        if (phdrs[i].p_type == PT_LOAD)
+            nr++;
+    }
+
+    ctx->segs = calloc(sizeof(struct symbolize_segment), nr);
+    if (!ctx->segs && nr)
+        return -1;
+
+    for (unsigned int i = 0, n = 0; i < hdr->e_phnum; i++)
+    {
+        if (phdrs[i].p_type != PT_LOAD)
+            continue;
+        ctx->segs[n].vaddr = phdrs[i].p_vaddr;
+        ctx->segs[n].offset = phdrs[i].p_offset;
+        ctx->segs[n].size = phdrs[i].p_filesz;
+        n++;
+    }
+
+    ctx->nr_segs = nr;
+    return 0;
+}
+
 /**
  * @brief Symbolizes an executable/shared library/module
  *
@@ -149,7 +178,8 @@ void symbolize_free_symbols(struct symbol *table, size_t syms)
  */
 int symbolize_exec(int fd, struct symbolize_ctx *ctx)
 {
-    struct symbol *table;
+    struct symbol *table = NULL;
+    size_t useful_syms = 0;
     int st = 0;
 
     struct stat buf;
@@ -169,6 +199,12 @@ int symbolize_exec(int fd, struct symbolize_ctx *ctx)
 
     char *strtab = NULL;
 
+    if (symbolize_load_segments(hdr, ctx) < 0)
+    {
+        st = -1;
+        goto out;
+    }
+
     for (unsigned int i = 0; i < hdr->e_shnum; i++)
     {
         char *name = elf_get_string(sections[i].sh_name, shstrtab);
@@ -190,7 +226,6 @@ int symbolize_exec(int fd, struct symbolize_ctx *ctx)
 
     const size_t num = symtab->sh_size / symtab->sh_entsize;
     Elf64_Sym *syms = (Elf64_Sym *) (symtab->sh_offset + (char *) hdr);
-    size_t useful_syms = 0;
 
     for (size_t i = 0; i < num; i++)
     {
@@ -232,6 +267,12 @@ out:
     munmap(ptr, buf.st_size);
     if (st == -1 && table)
         symbolize_free_symbols(table, useful_syms);
+    if (st == -1)
+    {
+        free(ctx->segs);
+        ctx->segs = NULL;
+        ctx->nr_segs = 0;
+    }
     return st;
 }
 
@@ -312,3 +353,30 @@ int symbolize_symbolize(struct symbolize_ctx *ctx, unsigned long addr, char *buf
         return errno = E2BIG, -1;
     return 0;
 }
+
+/**
+ * @brief Translate an offset into the file to the address it gets loaded at (relative to the load
+ * base, for PIEs and shared libraries). Used to symbolize addresses in a process, given the file
+ * offset its mapping says they're at.
+ *
+ * @param ctx Context
+ * @param offset File offset
+ * @param vaddr Result
+ * @return 0 on success, -1 with errno set to ENOENT if no loadable segment covers the offset
+ */
+int symbolize_offset_to_vaddr(struct symbolize_ctx *ctx, unsigned long offset,
+                              unsigned long *vaddr)
+{
+    for (size_t i = 0; i < ctx->nr_segs; i++)
+    {
+        const struct symbolize_segment *seg = &ctx->segs[i];
+
+        if (offset >= seg->offset && offset < seg->offset + seg->size)
+        {
+            *vaddr = seg->vaddr + (offset - seg->offset);
+            return 0;
+        }
+    }
+
+    return errno = ENOENT, -1;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <libonyx/unique_fd.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+static void connect_loopback(int rx, int tx)
+{
+    sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    ASSERT_NE(bind(rx, (sockaddr *) &addr, sizeof(addr)), -1);
+    ASSERT_NE(getsockname(rx, (sockaddr *) &addr, &len), -1);
+    ASSERT_NE(connect(tx, (sockaddr *) &addr, sizeof(addr)), -1);
+}
+
+TEST(Udp, SendmmsgRecvmmsg)
+{
+    onx::unique_fd rx = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(rx.valid());
+    ASSERT_TRUE(tx.valid());
+    connect_loopback(rx.get(), tx.get());
+
+    char data[4] = {'a', 'b', 'c', 'd'};
+    iovec iovs[4];
+    mmsghdr msgs[4] = {};
+
+    for (int i = 0; i < 4; i++)
+    {
+        iovs[i].iov_base = &data[i];
+        iovs[i].iov_len = 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    ASSERT_EQ(sendmmsg(tx.get(), msgs, 4, 0), 4);
+    for (int i = 0; i < 4; i++)
+        EXPECT_EQ(msgs[i].msg_len, 1u);
+
+    char rbuf[4] = {};
+    sockaddr_in src[4];
+    for (int i = 0; i < 4; i++)
+    {
+        iovs[i].iov_base = &rbuf[i];
+        iovs[i].iov_len = 4;
+        msgs[i].msg_hdr.msg_name = &src[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+        msgs[i].msg_len = 0;
+    }
+
+    // Only ask for two, the rest must stay queued
+    ASSERT_EQ(recvmmsg(rx.get(), msgs, 2, 0, nullptr), 2);
+    ASSERT_EQ(recvmmsg(rx.get(), msgs + 2, 2, 0, nullptr), 2);
+
+    for (int i = 0; i < 4; i++)
+    {
+        EXPECT_EQ(msgs[i].msg_len, 1u);
+        EXPECT_EQ(rbuf[i], data[i]);
+        EXPECT_EQ(msgs[i].msg_hdr.msg_namelen, sizeof(sockaddr_in));
+        EXPECT_EQ(src[i].sin_family, AF_INET);
+        EXPECT_EQ(src[i].sin_addr.s_addr, htonl(INADDR_LOOPBACK));
+    }
+}
+
+TEST(Udp, RecvmmsgWaitforone)
+{
+    onx::unique_fd rx = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(rx.valid());
+    ASSERT_TRUE(tx.valid());
+    connect_loopback(rx.get(), tx.get());
+
+    char c = 'a';
+    ASSERT_EQ(send(tx.get(), &c, 1, 0), 1);
+
+    char rbuf[2];
+    iovec iovs[2] = {{&rbuf[0], 1}, {&rbuf[1], 1}};
+    mmsghdr msgs[2] = {};
+    msgs[0].msg_hdr.msg_iov = &iovs[0];
+    msgs[0].msg_hdr.msg_iovlen = 1;
+    msgs[1].msg_hdr.msg_iov = &iovs[1];
+    msgs[1].msg_hdr.msg_iovlen = 1;
+
+    // Returns as soon as one message is in, instead of waiting for the second one
+    EXPECT_EQ(recvmmsg(rx.get(), msgs, 2, MSG_WAITFORONE, nullptr), 1);
+    EXPECT_EQ(rbuf[0], 'a');
+
+    EXPECT_EQ(recvmmsg(rx.get(), msgs, 2, MSG_DONTWAIT, nullptr), -1);
+    EXPECT_EQ(errno, EAGAIN);
+}
+
+TEST(Udp, SegmentAndGro)
+{
+    onx::unique_fd rx = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(rx.valid());
+    ASSERT_TRUE(tx.valid());
+    connect_loopback(rx.get(), tx.get());
+
+    int gso = 100;
+    ASSERT_NE(setsockopt(tx.get(), SOL_UDP, UDP_SEGMENT, &gso, sizeof(gso)), -1);
+
+    std::vector<char> buf(250);
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = (char) i;
+
+    // 250 bytes go out as 100 + 100 + 50
+    ASSERT_EQ(send(tx.get(), buf.data(), buf.size(), 0), (ssize_t) buf.size());
+
+    std::vector<char> rbuf(buf.size());
+    ASSERT_EQ(recv(rx.get(), rbuf.data(), rbuf.size(), 0), 100);
+    EXPECT_EQ(memcmp(rbuf.data(), buf.data(), 100), 0);
+
+    // Coalesce the rest
+    int one = 1;
+    ASSERT_NE(setsockopt(rx.get(), SOL_UDP, UDP_GRO, &one, sizeof(one)), -1);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec iov = {rbuf.data(), rbuf.size()};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ASSERT_EQ(recvmsg(rx.get(), &msg, MSG_DONTWAIT), 150);
+    EXPECT_EQ(memcmp(rbuf.data(), buf.data() + 100, 150), 0);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    ASSERT_NE(cmsg, nullptr);
+    EXPECT_EQ(cmsg->cmsg_level, SOL_UDP);
+    EXPECT_EQ(cmsg->cmsg_type, UDP_GRO);
+    int segment;
+    memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+    EXPECT_EQ(segment, 100);
+}
+
+TEST(Udp, Reuseport)
+{
+    onx::unique_fd a = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd b = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd c = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(a.valid());
+    ASSERT_TRUE(b.valid());
+    ASSERT_TRUE(c.valid());
+    ASSERT_TRUE(tx.valid());
+
+    int one = 1;
+    ASSERT_NE(setsockopt(a.get(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)), -1);
+    ASSERT_NE(setsockopt(b.get(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)), -1);
+
+    sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    ASSERT_NE(bind(a.get(), (sockaddr *) &addr, sizeof(addr)), -1);
+    ASSERT_NE(getsockname(a.get(), (sockaddr *) &addr, &len), -1);
+    ASSERT_NE(bind(b.get(), (sockaddr *) &addr, sizeof(addr)), -1);
+
+    // c didn't ask for SO_REUSEPORT
+    EXPECT_EQ(bind(c.get(), (sockaddr *) &addr, sizeof(addr)), -1);
+    EXPECT_EQ(errno, EADDRINUSE);
+
+    // Datagrams from the same flow always land on the same socket
+    for (int i = 0; i < 8; i++)
+    {
+        char ch = 'a';
+        ASSERT_EQ(sendto(tx.get(), &ch, 1, 0, (sockaddr *) &addr, sizeof(addr)), 1);
+    }
+
+    char buf[8];
+    ssize_t ra = recv(a.get(), buf, 1, MSG_DONTWAIT);
+    ssize_t rb = recv(b.get(), buf, 1, MSG_DONTWAIT);
+    EXPECT_TRUE((ra == 1) != (rb == 1));
+
+    int nr = 1;
+    int fd = ra == 1 ? a.get() : b.get();
+    while (recv(fd, buf, 1, MSG_DONTWAIT) == 1)
+        nr++;
+    EXPECT_EQ(nr, 8);
+}
+
+TEST(Udp, ManySockets)
+{
+    // Enough sockets to make the socket table grow
+    rlimit old, rl;
+    ASSERT_NE(getrlimit(RLIMIT_NOFILE, &old), -1);
+    rl = old;
+    rl.rlim_cur = rl.rlim_max;
+    ASSERT_NE(setrlimit(RLIMIT_NOFILE, &rl), -1);
+
+    const rlim_t nr_sockets = std::min(rl.rlim_cur - 64, (rlim_t) 4000);
+
+    std::vector<onx::unique_fd> fds;
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (rlim_t i = 0; i < nr_sockets; i++)
+    {
+        onx::unique_fd fd = socket(AF_INET, SOCK_DGRAM, 0);
+        ASSERT_TRUE(fd.valid());
+        ASSERT_NE(bind(fd.get(), (sockaddr *) &addr, sizeof(addr)), -1);
+        fds.push_back(std::move(fd));
+    }
+
+    // Every socket must still be reachable
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(tx.valid());
+
+    for (size_t i = 0; i < fds.size(); i += 97)
+    {
+        sockaddr_in dst;
+        socklen_t len = sizeof(dst);
+        ASSERT_NE(getsockname(fds[i].get(), (sockaddr *) &dst, &len), -1);
+
+        char ch = 'a';
+        ASSERT_EQ(sendto(tx.get(), &ch, 1, 0, (sockaddr *) &dst, sizeof(dst)), 1);
+        EXPECT_EQ(recv(fds[i].get(), &ch, 1, MSG_DONTWAIT), 1);
+    }
+
+    fds.clear();
+    ASSERT_NE(setrlimit(RLIMIT_NOFILE, &old), -1);
+}
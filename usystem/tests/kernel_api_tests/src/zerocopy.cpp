@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <libonyx/unique_fd.h>
+
+#include <uapi/errqueue.h>
+
+static void bind_loopback(int fd, sockaddr_in &addr)
+{
+    socklen_t len = sizeof(addr);
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    ASSERT_NE(bind(fd, (sockaddr *) &addr, sizeof(addr)), -1);
+    ASSERT_NE(getsockname(fd, (sockaddr *) &addr, &len), -1);
+}
+
+TEST(MsgZerocopy, UdpSendCompletes)
+{
+    onx::unique_fd rx = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(rx.valid());
+    ASSERT_TRUE(tx.valid());
+
+    sockaddr_in addr;
+    bind_loopback(rx.get(), addr);
+
+    int one = 1;
+    ASSERT_NE(setsockopt(tx.get(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)), -1);
+
+    std::vector<char> buf(4096, 'a');
+
+    for (int i = 0; i < 2; i++)
+    {
+        ASSERT_EQ(sendto(tx.get(), buf.data(), buf.size(), MSG_ZEROCOPY, (sockaddr *) &addr,
+                         sizeof(addr)),
+                  (ssize_t) buf.size());
+    }
+
+    char control[CMSG_SPACE(sizeof(sock_extended_err))];
+    msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ASSERT_EQ(recvmsg(tx.get(), &msg, MSG_ERRQUEUE), 0);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    ASSERT_NE(cmsg, nullptr);
+    EXPECT_EQ(cmsg->cmsg_level, SOL_IP);
+    EXPECT_EQ(cmsg->cmsg_type, IP_RECVERR);
+
+    sock_extended_err err;
+    memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+    EXPECT_EQ(err.ee_errno, 0u);
+    EXPECT_EQ(err.ee_origin, SO_EE_ORIGIN_ZEROCOPY);
+    // Both sends complete in order, so they get reported as a single range
+    EXPECT_EQ(err.ee_info, 0u);
+    EXPECT_EQ(err.ee_data, 1u);
+    // Loopback can't offload checksums, so the data was copied
+    EXPECT_EQ(err.ee_code, SO_EE_CODE_ZEROCOPY_COPIED);
+
+    msg.msg_controllen = sizeof(control);
+    EXPECT_EQ(recvmsg(tx.get(), &msg, MSG_ERRQUEUE), -1);
+    EXPECT_EQ(errno, EAGAIN);
+
+    std::vector<char> rbuf(buf.size());
+    for (int i = 0; i < 2; i++)
+    {
+        ASSERT_EQ(recv(rx.get(), rbuf.data(), rbuf.size(), 0), (ssize_t) rbuf.size());
+        EXPECT_EQ(rbuf, buf);
+    }
+}
+
+TEST(MsgZerocopy, IgnoredWithoutSoZerocopy)
+{
+    onx::unique_fd rx = socket(AF_INET, SOCK_DGRAM, 0);
+    onx::unique_fd tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(rx.valid());
+    ASSERT_TRUE(tx.valid());
+
+    sockaddr_in addr;
+    bind_loopback(rx.get(), addr);
+
+    char c = 'a';
+    ASSERT_EQ(sendto(tx.get(), &c, 1, MSG_ZEROCOPY, (sockaddr *) &addr, sizeof(addr)), 1);
+
+    msghdr msg = {};
+    EXPECT_EQ(recvmsg(tx.get(), &msg, MSG_ERRQUEUE), -1);
+    EXPECT_EQ(errno, EAGAIN);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+// clock_gettime() goes through the vDSO, syscall(SYS_clock_gettime) always enters the kernel
+
+static void clock_gettime_vdso(benchmark::State &state)
+{
+    const auto clk = (clockid_t) state.range(0);
+    struct timespec ts;
+
+    for (auto _ : state)
+    {
+        clock_gettime(clk, &ts);
+        benchmark::DoNotOptimize(ts);
+    }
+}
+
+BENCHMARK(clock_gettime_vdso)
+    ->Arg(CLOCK_REALTIME)
+    ->Arg(CLOCK_MONOTONIC)
+    ->Arg(CLOCK_BOOTTIME)
+    ->Arg(CLOCK_REALTIME_COARSE)
+    ->Arg(CLOCK_MONOTONIC_COARSE);
+
+static void clock_gettime_syscall(benchmark::State &state)
+{
+    const auto clk = (clockid_t) state.range(0);
+    struct timespec ts;
+
+    for (auto _ : state)
+    {
+        syscall(SYS_clock_gettime, clk, &ts);
+        benchmark::DoNotOptimize(ts);
+    }
+}
+
+BENCHMARK(clock_gettime_syscall)
+    ->Arg(CLOCK_REALTIME)
+    ->Arg(CLOCK_MONOTONIC)
+    ->Arg(CLOCK_BOOTTIME)
+    ->Arg(CLOCK_REALTIME_COARSE)
+    ->Arg(CLOCK_MONOTONIC_COARSE);
+
+// Readers racing with each other (and with the kernel's updates on every tick)
+BENCHMARK(clock_gettime_vdso)->Arg(CLOCK_MONOTONIC)->Threads(4);
+
+static void gettimeofday_vdso(benchmark::State &state)
+{
+    struct timeval tv;
+
+    for (auto _ : state)
+    {
+        gettimeofday(&tv, nullptr);
+        benchmark::DoNotOptimize(tv);
+    }
+}
+
+BENCHMARK(gettimeofday_vdso);
+
+static void getcpu_vdso(benchmark::State &state)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(sched_getcpu());
+}
+
+BENCHMARK(getcpu_vdso);
+
+#ifdef SYS_getcpu
+static void getcpu_syscall(benchmark::State &state)
+{
+    unsigned int cpu;
+
+    for (auto _ : state)
+    {
+        syscall(SYS_getcpu, &cpu, nullptr, nullptr);
+        benchmark::DoNotOptimize(cpu);
+    }
+}
+
+BENCHMARK(getcpu_syscall);
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// fio-style random I/O over a preallocated file, with and without O_DIRECT
+static constexpr size_t dio_file_size = 64 * 1024 * 1024;
+static constexpr size_t dio_align = 4096;
+
+struct dio_file
+{
+    int fd;
+
+    dio_file(int flags)
+    {
+        fd = open("dio_tmp", O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open fd");
+
+        unlink("dio_tmp");
+
+        std::vector<char> buf(1024 * 1024);
+        if (getrandom(buf.data(), buf.size(), 0) < 0)
+            throw std::runtime_error("Failed to get random");
+
+        for (size_t i = 0; i < dio_file_size; i += buf.size())
+        {
+            if (write(fd, buf.data(), buf.size()) != (ssize_t) buf.size())
+                throw std::runtime_error("Failed to write");
+        }
+
+        if (fsync(fd) < 0)
+            throw std::runtime_error("Failed to fsync");
+
+        if (fcntl(fd, F_SETFL, flags) < 0)
+            throw std::runtime_error("Failed to set O_DIRECT");
+    }
+
+    ~dio_file()
+    {
+        close(fd);
+    }
+};
+
+static void dio_rand_bench(benchmark::State& state, int flags, bool is_write)
+{
+    const size_t bs = state.range(0);
+    dio_file f{flags};
+
+    std::unique_ptr<char, decltype(&free)> buf{(char*) aligned_alloc(dio_align, bs), free};
+    if (!buf)
+        throw std::runtime_error("Failed to allocate buffer");
+
+    if (getrandom(buf.get(), bs, 0) < 0)
+        throw std::runtime_error("Failed to get random");
+
+    std::mt19937_64 rng{bs};
+    std::uniform_int_distribution<size_t> dist{0, dio_file_size / bs - 1};
+
+    for (auto _ : state)
+    {
+        const off_t off = dist(rng) * bs;
+        ssize_t st = is_write ? pwrite(f.fd, buf.get(), bs, off) : pread(f.fd, buf.get(), bs, off);
+
+        if (st != (ssize_t) bs)
+            throw std::runtime_error("Short I/O");
+    }
+
+    state.SetBytesProcessed(state.iterations() * bs);
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void dio_randread(benchmark::State& state)
+{
+    dio_rand_bench(state, O_DIRECT, false);
+}
+
+static void dio_randwrite(benchmark::State& state)
+{
+    dio_rand_bench(state, O_DIRECT, true);
+}
+
+static void buffered_randread(benchmark::State& state)
+{
+    dio_rand_bench(state, 0, false);
+}
+
+static void buffered_randwrite(benchmark::State& state)
+{
+    dio_rand_bench(state, 0, true);
+}
+
+BENCHMARK(dio_randread)->RangeMultiplier(4)->Range(4096, 1024 * 1024);
+BENCHMARK(dio_randwrite)->RangeMultiplier(4)->Range(4096, 1024 * 1024);
+BENCHMARK(buffered_randread)->RangeMultiplier(4)->Range(4096, 1024 * 1024);
+BENCHMARK(buffered_randwrite)->RangeMultiplier(4)->Range(4096, 1024 * 1024);
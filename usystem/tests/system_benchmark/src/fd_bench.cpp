@@ -4,6 +4,7 @@
  * check LICENSE at the root directory for more information
  */
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <stdexcept>
@@ -27,4 +28,22 @@ static void fd_open_close_bench(benchmark::State& state)
 
 BENCHMARK(fd_open_close_bench)->Threads(4);
 
+static int shared_fd = open("/dev/null", O_RDONLY);
+
+// Every thread looks up the same fd, which used to mean everyone taking the fd table's lock
+static void fd_lookup_bench(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        struct stat buf;
+        if (fstat(shared_fd, &buf) < 0)
+        {
+            state.SkipWithError("fstat failed");
+            break;
+        }
+    }
+}
+
+BENCHMARK(fd_lookup_bench)->ThreadRange(1, 16)->UseRealTime();
+
 BENCHMARK_MAIN();
@@ -6,11 +6,15 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <exception>
 #include <stdexcept>
+#include <vector>
 
 #include <benchmark/benchmark.h>
 
@@ -55,3 +59,124 @@ static void vfork_bench(benchmark::State& state)
 }
 
 BENCHMARK(vfork_bench)->ThreadRange(1, 16);
+
+// Large-RSS forks: fork should cost about the same no matter how much memory we have resident
+
+static char* map_resident(size_t size)
+{
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error("mmap failed");
+
+    // Touch every page so it's resident (and not the zero page)
+    memset(ptr, 0xaa, size);
+    return (char*) ptr;
+}
+
+static void fork_rss_bench(benchmark::State& state)
+{
+    const size_t size = (size_t) state.range(0) << 20;
+    char* buf = map_resident(size);
+
+    for (auto _ : state)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            throw std::runtime_error("Failed to fork");
+        }
+        else if (pid == 0)
+        {
+            _exit(0);
+        }
+
+        waitpid(pid, nullptr, 0);
+    }
+
+    state.SetBytesProcessed(state.iterations() * size);
+    munmap(buf, size);
+}
+
+BENCHMARK(fork_rss_bench)->RangeMultiplier(4)->Range(1, 1024)->Unit(benchmark::kMicrosecond);
+
+// Like a prefork server: the parent keeps dirtying its heap between forks, while the children
+// stay around
+
+static void kill_children(std::vector<pid_t>& children)
+{
+    for (pid_t pid : children)
+        kill(pid, SIGKILL);
+    for (pid_t pid : children)
+        waitpid(pid, nullptr, 0);
+    children.clear();
+}
+
+static void fork_rss_dirty_bench(benchmark::State& state)
+{
+    const size_t size = (size_t) state.range(0) << 20;
+    const long page_size = sysconf(_SC_PAGESIZE);
+    char* buf = map_resident(size);
+    std::vector<pid_t> children;
+    size_t off = 0;
+
+    for (auto _ : state)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            throw std::runtime_error("Failed to fork");
+        }
+        else if (pid == 0)
+        {
+            pause();
+            _exit(0);
+        }
+
+        state.PauseTiming();
+
+        children.push_back(pid);
+
+        // Dirty a few pages, like a server would between forks
+        for (int i = 0; i < 16; i++, off = (off + page_size) % size)
+            buf[off]++;
+
+        if (children.size() == 16)
+            kill_children(children);
+
+        state.ResumeTiming();
+    }
+
+    kill_children(children);
+    munmap(buf, size);
+}
+
+BENCHMARK(fork_rss_dirty_bench)->RangeMultiplier(8)->Range(8, 512)->Unit(benchmark::kMicrosecond);
+
+// Cost of the COW faults the child takes after forking, writing to the whole thing
+
+static void fork_rss_child_write_bench(benchmark::State& state)
+{
+    const size_t size = (size_t) state.range(0) << 20;
+    char* buf = map_resident(size);
+
+    for (auto _ : state)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            throw std::runtime_error("Failed to fork");
+        }
+        else if (pid == 0)
+        {
+            memset(buf, 0x55, size);
+            _exit(0);
+        }
+
+        waitpid(pid, nullptr, 0);
+    }
+
+    state.SetBytesProcessed(state.iterations() * size);
+    munmap(buf, size);
+}
+
+BENCHMARK(fork_rss_child_write_bench)->RangeMultiplier(4)->Range(1, 256)->Unit(benchmark::kMicrosecond);
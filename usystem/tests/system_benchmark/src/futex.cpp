@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <limits.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <uapi/futex.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// Lock contention benchmarks. Every thread hammers the same lock, with a tiny critical section.
+
+static long futex(std::atomic<int> *uaddr, int op, int val, const struct timespec *ts = nullptr,
+                  std::atomic<int> *uaddr2 = nullptr, int val3 = 0)
+{
+    return syscall(SYS_futex, uaddr, op, val, ts, uaddr2, val3);
+}
+
+// Drepper's "Futexes are tricky" mutex: 0 = unlocked, 1 = locked, 2 = locked with waiters
+struct futex_mutex
+{
+    std::atomic<int> word{0};
+
+    void lock()
+    {
+        int c = 0;
+        if (word.compare_exchange_strong(c, 1, std::memory_order_acquire))
+            return;
+
+        if (c != 2)
+            c = word.exchange(2, std::memory_order_acquire);
+
+        while (c != 0)
+        {
+            futex(&word, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2);
+            c = word.exchange(2, std::memory_order_acquire);
+        }
+    }
+
+    void unlock()
+    {
+        if (word.exchange(0, std::memory_order_release) != 1)
+            futex(&word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1);
+    }
+};
+
+// PI mutex: the word is the owner's TID, contended paths go through FUTEX_LOCK_PI/UNLOCK_PI
+struct pi_mutex
+{
+    std::atomic<int> word{0};
+
+    void lock(int tid)
+    {
+        int expected = 0;
+        if (word.compare_exchange_strong(expected, tid, std::memory_order_acquire))
+            return;
+
+        futex(&word, FUTEX_LOCK_PI | FUTEX_PRIVATE_FLAG, 0);
+    }
+
+    void unlock(int tid)
+    {
+        int expected = tid;
+        if (word.compare_exchange_strong(expected, 0, std::memory_order_release))
+            return;
+
+        futex(&word, FUTEX_UNLOCK_PI | FUTEX_PRIVATE_FLAG, 0);
+    }
+};
+
+static futex_mutex raw_mutex;
+static std::mutex std_mutex;
+static pi_mutex pi_mtx;
+static unsigned long counter;
+
+static void futex_mutex_contention(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        raw_mutex.lock();
+        counter++;
+        raw_mutex.unlock();
+    }
+}
+
+BENCHMARK(futex_mutex_contention)->ThreadRange(1, 16)->UseRealTime();
+
+static void pthread_mutex_contention(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        std::scoped_lock g{std_mutex};
+        counter++;
+    }
+}
+
+BENCHMARK(pthread_mutex_contention)->ThreadRange(1, 16)->UseRealTime();
+
+static void pi_mutex_contention(benchmark::State &state)
+{
+    const int tid = syscall(SYS_gettid);
+
+    for (auto _ : state)
+    {
+        pi_mtx.lock(tid);
+        counter++;
+        pi_mtx.unlock(tid);
+    }
+}
+
+BENCHMARK(pi_mutex_contention)->ThreadRange(1, 16)->UseRealTime();
+
+// N waiters on one futex word, split between two bitsets, with FUTEX_WAKE_BITSET waking one half.
+// This is what rwlocks and condvars built on bitsets look like.
+static void futex_wake_bitset(benchmark::State &state)
+{
+    std::atomic<int> word{0};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> waiters;
+
+    for (int i = 0; i < state.range(0); i++)
+    {
+        waiters.emplace_back([&, bitset = 1 << (i & 1)]() {
+            for (;;)
+            {
+                // Load the value before checking stop, so we can't miss the final wake
+                int val = word.load();
+                if (stop.load())
+                    break;
+                futex(&word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val, nullptr, nullptr, bitset);
+            }
+        });
+    }
+
+    for (auto _ : state)
+    {
+        word.fetch_add(1, std::memory_order_release);
+        futex(&word, FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG, INT_MAX, nullptr, nullptr, 1);
+    }
+
+    stop.store(true);
+    word.fetch_add(1);
+    futex(&word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX);
+
+    for (auto &t : waiters)
+        t.join();
+}
+
+BENCHMARK(futex_wake_bitset)->RangeMultiplier(2)->Range(2, 64)->UseRealTime();
+
+// The uncontended syscall cost of FUTEX_WAKE_OP, as used by condvar signalling
+static void futex_wake_op_uncontended(benchmark::State &state)
+{
+    std::atomic<int> w1{0}, w2{0};
+
+    for (auto _ : state)
+        futex(&w1, FUTEX_WAKE_OP | FUTEX_PRIVATE_FLAG, 1, (const struct timespec *) 1, &w2,
+              FUTEX_OP(FUTEX_OP_ADD, 1, FUTEX_OP_CMP_GT, 0));
+}
+
+BENCHMARK(futex_wake_op_uncontended);
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// Serves a file over a loopback TCP connection, with a thread on the other end draining it
+struct file_server
+{
+    int file_fd;
+    int sock_fd;
+    std::thread drainer;
+
+    file_server(size_t file_size)
+    {
+        file_fd = open("sendfile_tmp", O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (file_fd < 0)
+            throw std::runtime_error("Failed to open fd");
+
+        unlink("sendfile_tmp");
+
+        std::vector<char> buf(file_size);
+        if (getrandom(buf.data(), buf.size(), 0) < 0)
+            throw std::runtime_error("Failed to get random");
+
+        if (write(file_fd, buf.data(), buf.size()) != (ssize_t) buf.size())
+            throw std::runtime_error("Failed to write");
+
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0)
+            throw std::runtime_error("Failed to create socket");
+
+        sockaddr_in addr = {};
+        socklen_t len = sizeof(addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) < 0 ||
+            getsockname(listen_fd, (sockaddr*) &addr, &len) < 0 || listen(listen_fd, 1) < 0)
+            throw std::runtime_error("Failed to listen");
+
+        sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock_fd < 0 || connect(sock_fd, (sockaddr*) &addr, sizeof(addr)) < 0)
+            throw std::runtime_error("Failed to connect");
+
+        int peer = accept(listen_fd, nullptr, nullptr);
+        if (peer < 0)
+            throw std::runtime_error("Failed to accept");
+
+        close(listen_fd);
+
+        drainer = std::thread{[peer]() {
+            std::vector<char> buf(64 * 1024);
+            while (read(peer, buf.data(), buf.size()) > 0)
+                ;
+            close(peer);
+        }};
+    }
+
+    ~file_server()
+    {
+        shutdown(sock_fd, SHUT_WR);
+        drainer.join();
+        close(sock_fd);
+        close(file_fd);
+    }
+};
+
+static void file_to_socket_read_write(benchmark::State& state)
+{
+    const size_t size = state.range(0);
+    file_server server{size};
+    std::vector<char> buf(64 * 1024);
+
+    for (auto _ : state)
+    {
+        off_t off = 0;
+        while ((size_t) off < size)
+        {
+            ssize_t st = pread(server.file_fd, buf.data(), buf.size(), off);
+            if (st <= 0)
+                throw std::runtime_error("Failed to read");
+
+            for (ssize_t written = 0; written < st;)
+            {
+                ssize_t st2 = write(server.sock_fd, buf.data() + written, st - written);
+                if (st2 < 0)
+                    throw std::runtime_error("Failed to write");
+                written += st2;
+            }
+
+            off += st;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * size);
+}
+
+static void file_to_socket_sendfile(benchmark::State& state)
+{
+    const size_t size = state.range(0);
+    file_server server{size};
+
+    for (auto _ : state)
+    {
+        off_t off = 0;
+        while ((size_t) off < size)
+        {
+            if (sendfile(server.sock_fd, server.file_fd, &off, size - off) <= 0)
+                throw std::runtime_error("Failed to sendfile");
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * size);
+}
+
+BENCHMARK(file_to_socket_read_write)->RangeMultiplier(4)->Range(4096, 4 << 20);
+BENCHMARK(file_to_socket_sendfile)->RangeMultiplier(4)->Range(4096, 4 << 20);
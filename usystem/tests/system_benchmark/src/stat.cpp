@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+// Path lookup benchmarks. These are all served from the dcache, so they mostly measure the
+// path walk itself.
+
+static void stat_deep_path(benchmark::State &state)
+{
+    struct stat buf;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(stat("/usr/share/zoneinfo/Europe/Lisbon", &buf));
+}
+
+BENCHMARK(stat_deep_path)->ThreadRange(1, 16)->UseRealTime();
+
+static void stat_root(benchmark::State &state)
+{
+    struct stat buf;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(stat("/", &buf));
+}
+
+BENCHMARK(stat_root);
+
+// What a shell does when looking up a command in $PATH: a bunch of misses, then a hit. The misses
+// are served by negative dentries.
+static void stat_path_search(benchmark::State &state)
+{
+    static const char *const dirs[] = {"/usr/local/sbin", "/usr/local/bin", "/usr/sbin",
+                                       "/usr/bin", "/sbin", "/bin"};
+    struct stat buf;
+
+    for (auto _ : state)
+    {
+        for (auto dir : dirs)
+        {
+            std::string path{dir};
+            path += "/ls";
+            if (stat(path.c_str(), &buf) == 0)
+                break;
+        }
+    }
+}
+
+BENCHMARK(stat_path_search)->ThreadRange(1, 16)->UseRealTime();
+
+static void stat_missing(benchmark::State &state)
+{
+    struct stat buf;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(stat("/usr/bin/this-file-does-not-exist", &buf));
+}
+
+BENCHMARK(stat_missing)->ThreadRange(1, 16)->UseRealTime();
@@ -23,3 +23,20 @@ static void terminal_scroll_bench(benchmark::State &state)
 }
 
 BENCHMARK(terminal_scroll_bench);
+
+static void terminal_text_bench(benchmark::State &state)
+{
+    char line[81];
+    memset(line, 'a', 79);
+    line[79] = '\n';
+    line[80] = '\0';
+
+    for (auto _ : state)
+    {
+        write(STDOUT_FILENO, line, 80);
+    }
+
+    state.SetBytesProcessed(state.iterations() * 80);
+}
+
+BENCHMARK(terminal_text_bench);
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2024 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ */
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Datagrams sent (and received) per benchmark iteration
+static constexpr unsigned int batch = 32;
+
+// A connected pair of UDP sockets over loopback
+struct udp_pair
+{
+    int rx;
+    int tx;
+
+    udp_pair()
+    {
+        rx = socket(AF_INET, SOCK_DGRAM, 0);
+        tx = socket(AF_INET, SOCK_DGRAM, 0);
+        if (rx < 0 || tx < 0)
+            throw std::runtime_error("Failed to create socket");
+
+        sockaddr_in addr = {};
+        socklen_t len = sizeof(addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (bind(rx, (sockaddr*) &addr, sizeof(addr)) < 0 ||
+            getsockname(rx, (sockaddr*) &addr, &len) < 0 ||
+            connect(tx, (sockaddr*) &addr, sizeof(addr)) < 0)
+            throw std::runtime_error("Failed to connect");
+    }
+
+    ~udp_pair()
+    {
+        close(rx);
+        close(tx);
+    }
+};
+
+// Receives a whole batch with plain recv()
+static void drain_recv(int fd, std::vector<char>& buf, size_t size)
+{
+    for (unsigned int i = 0; i < batch; i++)
+    {
+        if (recv(fd, buf.data(), size, 0) != (ssize_t) size)
+            throw std::runtime_error("Failed to recv");
+    }
+}
+
+static void udp_send_recv(benchmark::State& state)
+{
+    const size_t size = state.range(0);
+    udp_pair pair;
+    std::vector<char> buf(size);
+
+    for (auto _ : state)
+    {
+        for (unsigned int i = 0; i < batch; i++)
+        {
+            if (send(pair.tx, buf.data(), size, 0) != (ssize_t) size)
+                throw std::runtime_error("Failed to send");
+        }
+
+        drain_recv(pair.rx, buf, size);
+    }
+
+    state.SetItemsProcessed(state.iterations() * batch);
+    state.SetBytesProcessed(state.iterations() * batch * size);
+}
+
+static void udp_sendmmsg_recvmmsg(benchmark::State& state)
+{
+    const size_t size = state.range(0);
+    udp_pair pair;
+    std::vector<char> buf(size * batch);
+    iovec iovs[batch];
+    mmsghdr msgs[batch] = {};
+
+    for (unsigned int i = 0; i < batch; i++)
+    {
+        iovs[i].iov_base = buf.data() + i * size;
+        iovs[i].iov_len = size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (auto _ : state)
+    {
+        for (unsigned int sent = 0; sent < batch;)
+        {
+            int st = sendmmsg(pair.tx, msgs + sent, batch - sent, 0);
+            if (st <= 0)
+                throw std::runtime_error("Failed to sendmmsg");
+            sent += st;
+        }
+
+        for (unsigned int received = 0; received < batch;)
+        {
+            int st = recvmmsg(pair.rx, msgs + received, batch - received, 0, nullptr);
+            if (st <= 0)
+                throw std::runtime_error("Failed to recvmmsg");
+            received += st;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * batch);
+    state.SetBytesProcessed(state.iterations() * batch * size);
+}
+
+static void udp_segment_gro(benchmark::State& state)
+{
+    const size_t size = state.range(0);
+    udp_pair pair;
+    std::vector<char> buf(size * batch);
+    int gso = size;
+    int one = 1;
+
+    if (setsockopt(pair.tx, SOL_UDP, UDP_SEGMENT, &gso, sizeof(gso)) < 0 ||
+        setsockopt(pair.rx, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+    {
+        state.SkipWithError("UDP_SEGMENT/UDP_GRO not supported");
+        return;
+    }
+
+    for (auto _ : state)
+    {
+        if (send(pair.tx, buf.data(), buf.size(), 0) != (ssize_t) buf.size())
+            throw std::runtime_error("Failed to send");
+
+        for (size_t received = 0; received < buf.size();)
+        {
+            ssize_t st = recv(pair.rx, buf.data(), buf.size(), 0);
+            if (st <= 0)
+                throw std::runtime_error("Failed to recv");
+            received += st;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * batch);
+    state.SetBytesProcessed(state.iterations() * batch * size);
+}
+
+BENCHMARK(udp_send_recv)->Arg(64)->Arg(512)->Arg(1400);
+BENCHMARK(udp_sendmmsg_recvmmsg)->Arg(64)->Arg(512)->Arg(1400);
+BENCHMARK(udp_segment_gro)->Arg(64)->Arg(512)->Arg(1400);